@@ -34,7 +34,7 @@ void spice_channel_handle_set_ack(SpiceChannel *channel, SpiceMsgIn *in)
         .generation = ack->generation,
     };
 
-    c->message_ack_window = c->message_ack_count = ack->window;
+    spice_channel_set_ack_window(channel, ack->window);
     c->marshallers->msgc_ack_sync(out->marshaller, &sync);
     spice_msg_out_send_internal(out);
 }
@@ -49,6 +49,10 @@ void spice_channel_handle_ping(SpiceChannel *channel, SpiceMsgIn *in)
 
     c->marshallers->msgc_pong(pong->marshaller, ping);
     spice_msg_out_send_internal(pong);
+
+    /* the server pings periodically to measure the latency, a fresh
+     * sample of ours for the stats and the ACK window */
+    spice_channel_sample_rtt(channel);
 }
 
 /* coroutine context */
@@ -94,23 +98,17 @@ void spice_channel_handle_disconnect(SpiceChannel *channel, SpiceMsgIn *in)
 typedef struct WaitForChannelData
 {
     SpiceWaitForChannel *wait;
-    SpiceChannel *channel;
+    SpiceChannel *wait_channel;
 } WaitForChannelData;
 
 /* coroutine and main context */
 static gboolean wait_for_channel(gpointer data)
 {
     WaitForChannelData *wfc = data;
-    SpiceChannelPrivate *c = wfc->channel->priv;
-    SpiceChannel *wait_channel;
+    SpiceChannelPrivate *w = wfc->wait_channel->priv;
 
-    wait_channel = spice_session_lookup_channel(c->session, wfc->wait->channel_id, wfc->wait->channel_type);
-    g_return_val_if_fail(wait_channel != NULL, TRUE);
-
-    if (wait_channel->priv->last_message_serial >= wfc->wait->message_serial)
-        return TRUE;
-
-    return FALSE;
+    /* or it left the session, and no message will come */
+    return w->last_message_serial >= wfc->wait->message_serial || w->session == NULL;
 }
 
 /* coroutine context */
@@ -124,14 +122,21 @@ void spice_channel_handle_wait_for_channels(SpiceChannel *channel, SpiceMsgIn *i
     for (i = 0; i < wfc->wait_count; ++i) {
         WaitForChannelData data = {
             .wait = wfc->wait_list + i,
-            .channel = channel
         };
 
+        data.wait_channel = spice_session_lookup_channel(c->session, data.wait->channel_id,
+                                                         data.wait->channel_type);
+        g_return_if_fail(data.wait_channel != NULL);
+
+        /* the wait is on its waiters, it must not go away meanwhile */
+        g_object_ref(data.wait_channel);
         CHANNEL_DEBUG(channel, "waiting for serial %" PRIu64 " (%d/%d)", data.wait->message_serial, i + 1, wfc->wait_count);
-        if (g_coroutine_condition_wait(&c->coroutine, wait_for_channel, &data))
+        if (g_coroutine_condition_wait_on(&c->coroutine, &data.wait_channel->priv->waiters,
+                                          wait_for_channel, &data))
             CHANNEL_DEBUG(channel, "waiting for serial %"  PRIu64 ", done", data.wait->message_serial);
         else
             CHANNEL_DEBUG(channel, "waiting for serial %" PRIu64 ", cancelled", data.wait->message_serial);
+        g_object_unref(data.wait_channel);
     }
 }
 
@@ -202,10 +207,10 @@ static void set_handlers(SpiceChannelClassPrivate *klass,
 {
     int i;
 
-    g_array_set_size(klass->handlers, MAX(klass->handlers->len, n));
+    g_return_if_fail(n <= klass->n_handlers);
     for (i = 0; i < n; i++) {
         if (handlers[i])
-            g_array_index(klass->handlers, spice_msg_handler, i) = handlers[i];
+            klass->handlers[i] = handlers[i];
     }
 }
 
@@ -231,7 +236,9 @@ void spice_channel_set_handlers(SpiceChannelClass *klass,
         G_TYPE_CLASS_GET_PRIVATE (klass, spice_channel_get_type (), SpiceChannelClassPrivate);
 
     g_return_if_fail(klass->priv->handlers == NULL);
-    klass->priv->handlers = g_array_sized_new(FALSE, TRUE, sizeof(spice_msg_handler), n);
+    /* a plain table, zeroed: the types with no handler are NULL */
+    klass->priv->n_handlers = MAX(n, SPICE_MSG_BASE_LAST);
+    klass->priv->handlers = g_new0(spice_msg_handler, klass->priv->n_handlers);
 
     spice_channel_add_base_handlers(klass->priv);
     set_handlers(klass->priv, handlers, n);
@@ -17,6 +17,8 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_CURSOR
+
 #include "glib-compat.h"
 #include "spice-client.h"
 #include "spice-common.h"
@@ -248,14 +250,119 @@ static void mono_cursor(display_cursor *cursor, const guint8 *data)
                               and, xor, dest);
 }
 
-static guint8 get_pix_mask(const guint8 *data, gint offset, gint pix_index)
+static guint32 get_pix_hack(gint pix_index, gint width)
 {
-    return data[offset + (pix_index >> 3)] & (0x80 >> (pix_index % 8));
+    return (((pix_index % width) ^ (pix_index / width)) & 1) ? 0xc0303030 : 0x30505050;
 }
 
-static guint32 get_pix_hack(gint pix_index, gint width)
+/* swaps the bytes 0 and 2 in memory, RGBA <-> BGRA */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define SWAP_RB(p) (((p) & 0xff00ff00) | (((p) & 0xff) << 16) | (((p) >> 16) & 0xff))
+#else
+#define SWAP_RB(p) (((p) & 0x00ff00ff) | (((p) & 0xff00) << 16) | (((p) >> 16) & 0xff00))
+#endif
+
+static void swap_rb(guint32 *pixels, gint n)
 {
-    return (((pix_index % width) ^ (pix_index / width)) & 1) ? 0xc0303030 : 0x30505050;
+    gint i;
+
+    for (i = 0; i < n; i++)
+        pixels[i] = SWAP_RB(pixels[i]);
+}
+
+/*
+ * The colored cursors are converted 8 pixels at a time, one byte of
+ * the AND mask, with the swap to RGBA folded in: the inner loops have
+ * no data dependent branch and the compiler can vectorize them.
+ */
+static void color32_cursor(display_cursor *cursor, const guint8 *data)
+{
+    gint n = cursor->hdr.width * cursor->hdr.height;
+    const guint8 *mask = data + 4u * n;
+    guint32 *dest = cursor->data;
+    gint i, j;
+
+    for (i = 0; i < n; i += 8) {
+        guint8 m = mask[i >> 3];
+        gint len = MIN(8, n - i);
+        gboolean hack = FALSE;
+
+        for (j = 0; j < len; j++) {
+            guint32 pix;
+
+            memcpy(&pix, data + 4 * (i + j), sizeof(pix));
+            hack |= (m & (0x80 >> j)) && pix == 0xffffff;
+            dest[i + j] = SWAP_RB(pix | ((m & (0x80 >> j)) ? 0 : 0xff000000));
+        }
+
+        /* rare, the inverted pixels of the mono cursors */
+        if (G_UNLIKELY(hack)) {
+            for (j = 0; j < len; j++) {
+                guint32 pix;
+
+                memcpy(&pix, data + 4 * (i + j), sizeof(pix));
+                if ((m & (0x80 >> j)) && pix == 0xffffff)
+                    dest[i + j] = get_pix_hack(i + j, cursor->hdr.width);
+            }
+        }
+    }
+}
+
+static void color16_cursor(display_cursor *cursor, const guint8 *data)
+{
+    gint n = cursor->hdr.width * cursor->hdr.height;
+    /* the mask is where the 32 bits cursors have it */
+    const guint8 *mask = data + 4u * n;
+    guint32 *dest = cursor->data;
+    gint i, j;
+
+    for (i = 0; i < n; i += 8) {
+        guint8 m = mask[i >> 3];
+        gint len = MIN(8, n - i);
+        gboolean hack = FALSE;
+
+        for (j = 0; j < len; j++) {
+            guint16 pix;
+            guint32 rgb;
+
+            memcpy(&pix, data + 2 * (i + j), sizeof(pix));
+            hack |= (m & (0x80 >> j)) && pix == 0x7fff;
+            rgb = ((pix & 0x1f) << 3) | ((pix & 0x3e0) << 6) | ((pix & 0x7c00) << 9);
+            dest[i + j] = SWAP_RB(rgb | ((m & (0x80 >> j)) ? 0 : 0xff000000));
+        }
+
+        if (G_UNLIKELY(hack)) {
+            for (j = 0; j < len; j++) {
+                guint16 pix;
+
+                memcpy(&pix, data + 2 * (i + j), sizeof(pix));
+                if ((m & (0x80 >> j)) && pix == 0x7fff)
+                    dest[i + j] = get_pix_hack(i + j, cursor->hdr.width);
+            }
+        }
+    }
+}
+
+static void color4_cursor(display_cursor *cursor, const guint8 *data)
+{
+    gint n = cursor->hdr.width * cursor->hdr.height;
+    gsize size = ((unsigned int)(SPICE_ALIGN(cursor->hdr.width, 2) / 2)) * cursor->hdr.height;
+    const guint8 *mask = data + size + (sizeof(uint32_t) << 4);
+    guint32 palette[16];
+    gint i;
+
+    memcpy(palette, data + size, sizeof(palette));
+    for (i = 0; i < n; i++) {
+        guint8 pix_mask = mask[i >> 3] & (0x80 >> (i % 8));
+        gint idx = (i & 1) ? (data[i >> 1] & 0x0f) : ((data[i >> 1] & 0xf0) >> 4);
+        guint32 pix = palette[idx];
+
+        if (pix_mask && pix == 0xffffff) {
+            cursor->data[i] = get_pix_hack(i, cursor->hdr.width);
+        } else {
+            cursor->data[i] = SWAP_RB(pix | (pix_mask ? 0 : 0xff000000));
+        }
+    }
 }
 
 static display_cursor * display_cursor_ref(display_cursor *cursor)
@@ -300,10 +407,7 @@ static display_cursor *set_cursor(SpiceChannel *channel, SpiceCursor *scursor)
     SpiceCursorHeader *hdr = &scursor->header;
     display_cursor *cursor;
     size_t size;
-    gint i, pix_mask, pix;
     const guint8* data;
-    guint8 *rgba;
-    guint8 val;
 
     CHANNEL_DEBUG(channel, "%s: flags %d, size %d", __FUNCTION__,
                   scursor->flags, scursor->data_size);
@@ -332,64 +436,29 @@ static display_cursor *set_cursor(SpiceChannel *channel, SpiceCursor *scursor)
 
     switch (hdr->type) {
     case SPICE_CURSOR_TYPE_MONO:
+        /* black, white or transparent, the swap is a no-op */
         mono_cursor(cursor, data);
         break;
     case SPICE_CURSOR_TYPE_ALPHA:
         memcpy(cursor->data, data, size);
+        swap_rb(cursor->data, hdr->width * hdr->height);
         break;
     case SPICE_CURSOR_TYPE_COLOR32:
-        memcpy(cursor->data, data, size);
-        for (i = 0; i < hdr->width * hdr->height; i++) {
-            pix_mask = get_pix_mask(data, size, i);
-            if (pix_mask && *((guint32*)data + i) == 0xffffff) {
-                cursor->data[i] = get_pix_hack(i, hdr->width);
-            } else {
-                cursor->data[i] |= (pix_mask ? 0 : 0xff000000);
-            }
-        }
+        color32_cursor(cursor, data);
         break;
     case SPICE_CURSOR_TYPE_COLOR16:
-        for (i = 0; i < hdr->width * hdr->height; i++) {
-            pix_mask = get_pix_mask(data, size, i);
-            pix = *((guint16*)data + i);
-            if (pix_mask && pix == 0x7fff) {
-                cursor->data[i] = get_pix_hack(i, hdr->width);
-            } else {
-                cursor->data[i] |= ((pix & 0x1f) << 3) | ((pix & 0x3e0) << 6) |
-                    ((pix & 0x7c00) << 9) | (pix_mask ? 0 : 0xff000000);
-            }
-        }
+        color16_cursor(cursor, data);
         break;
     case SPICE_CURSOR_TYPE_COLOR4:
-        size = ((unsigned int)(SPICE_ALIGN(hdr->width, 2) / 2)) * hdr->height;
-        for (i = 0; i < hdr->width * hdr->height; i++) {
-            pix_mask = get_pix_mask(data, size + (sizeof(uint32_t) << 4), i);
-            int idx = (i & 1) ? (data[i >> 1] & 0x0f) : ((data[i >> 1] & 0xf0) >> 4);
-            pix = *((uint32_t*)(data + size) + idx);
-            if (pix_mask && pix == 0xffffff) {
-                cursor->data[i] = get_pix_hack(i, hdr->width);
-            } else {
-                cursor->data[i] = pix | (pix_mask ? 0 : 0xff000000);
-            }
-        }
-
+        color4_cursor(cursor, data);
         break;
     default:
         g_warning("%s: unimplemented cursor type %d", __FUNCTION__,
                   hdr->type);
         cursor->default_cursor = TRUE;
-        goto cache_add;
-    }
-
-    rgba = (guint8*)cursor->data;
-    for (i = 0; i < hdr->width * hdr->height; i++) {
-        val = rgba[0];
-        rgba[0] = rgba[2];
-        rgba[2] = val;
-        rgba += 4;
+        break;
     }
 
-cache_add:
     if (scursor->flags & SPICE_CURSOR_FLAGS_CACHE_ME) {
         cache_add(c->cursors, hdr->unique, display_cursor_ref(cursor));
     }
@@ -467,8 +536,8 @@ static void cursor_handle_move(SpiceChannel *channel, SpiceMsgIn *in)
 
     g_return_if_fail(c->init_done == TRUE);
 
-    g_coroutine_signal_emit(channel, signals[SPICE_CURSOR_MOVE], 0,
-                            move->position.x, move->position.y);
+    g_coroutine_signal_emit_queued(channel, signals[SPICE_CURSOR_MOVE], 0,
+                                   move->position.x, move->position.y);
 }
 
 /* coroutine context */
@@ -25,11 +25,7 @@
 
 static void mjpeg_src_init(struct jpeg_decompress_struct *cinfo)
 {
-    display_stream *st = SPICE_CONTAINEROF(cinfo->src, display_stream, mjpeg_src);
-    uint8_t *data;
-
-    cinfo->src->bytes_in_buffer = stream_get_current_frame(st, &data);
-    cinfo->src->next_input_byte = data;
+    /* the input buffer is set by stream_mjpeg_decode() */
 }
 
 static boolean mjpeg_src_fill(struct jpeg_decompress_struct *cinfo)
@@ -49,8 +45,7 @@ static void mjpeg_src_term(struct jpeg_decompress_struct *cinfo)
     /* nothing */
 }
 
-G_GNUC_INTERNAL
-void stream_mjpeg_init(display_stream *st)
+static void stream_mjpeg_init(display_stream *st)
 {
     st->mjpeg_cinfo.err = jpeg_std_error(&st->mjpeg_jerr);
     jpeg_create_decompress(&st->mjpeg_cinfo);
@@ -63,21 +58,32 @@ void stream_mjpeg_init(display_stream *st)
     st->mjpeg_cinfo.src               = &st->mjpeg_src;
 }
 
-G_GNUC_INTERNAL
-void stream_mjpeg_data(display_stream *st)
+/*
+ * Decodes into @out_frame, with rows @stride bytes apart, or into a new
+ * frame if NULL. A @stride other than width * 4 needs libjpeg-turbo.
+ * libjpeg scales in the DCT domain, which is cheaper than decoding the
+ * full frame.
+ */
+/* main context, or decoding thread */
+static uint8_t *stream_mjpeg_decode(display_stream *st, uint8_t *data, uint32_t size,
+                             int width, int height, int scale_denom, gboolean back_compat,
+                             uint8_t *out_frame, int stride)
 {
-    gboolean back_compat = st->channel->priv->peer_hdr.major_version == 1;
-    int width;
-    int height;
     uint8_t *dest;
     uint8_t *lines[4];
 
-    stream_get_dimensions(st, &width, &height);
-    dest = g_malloc0(width * height * 4);
+    width = STREAM_SCALED(width, scale_denom);
+    height = STREAM_SCALED(height, scale_denom);
 
-    g_free(st->out_frame);
-    st->out_frame = dest;
+    /* every pixel is written, no need to clear it */
+    if (out_frame == NULL) {
+        out_frame = g_malloc(width * height * 4);
+        stride = width * 4;
+    }
+    dest = out_frame;
 
+    st->mjpeg_src.next_input_byte = data;
+    st->mjpeg_src.bytes_in_buffer = size;
     jpeg_read_header(&st->mjpeg_cinfo, 1);
 #ifdef JCS_EXTENSIONS
     // requires jpeg-turbo
@@ -96,6 +102,8 @@ void stream_mjpeg_data(display_stream *st)
     st->mjpeg_cinfo.do_block_smoothing = FALSE;
     st->mjpeg_cinfo.dither_mode = JDITHER_ORDERED;
 #endif
+    st->mjpeg_cinfo.scale_num = 1;
+    st->mjpeg_cinfo.scale_denom = scale_denom;
     // TODO: in theory should check cinfo.output_height match with our height
     jpeg_start_decompress(&st->mjpeg_cinfo);
     /* rec_outbuf_height is the recommended size of the output buffer we
@@ -103,7 +111,7 @@ void stream_mjpeg_data(display_stream *st)
      */
     if (st->mjpeg_cinfo.rec_outbuf_height > G_N_ELEMENTS(lines)) {
         jpeg_abort_decompress(&st->mjpeg_cinfo);
-        g_return_if_reached();
+        g_return_val_if_reached(out_frame);
     }
 
     while (st->mjpeg_cinfo.output_scanline < st->mjpeg_cinfo.output_height) {
@@ -113,7 +121,7 @@ void stream_mjpeg_data(display_stream *st)
         for (unsigned int j = 0; j < st->mjpeg_cinfo.rec_outbuf_height; j++) {
             lines[j] = dest;
 #ifdef JCS_EXTENSIONS
-            dest += 4 * width;
+            dest += stride;
 #else
             dest += 3 * width;
 #endif
@@ -142,15 +150,82 @@ void stream_mjpeg_data(display_stream *st)
             }
         }
 #endif
-        dest = &st->out_frame[st->mjpeg_cinfo.output_scanline * width * 4];
+        dest = &out_frame[st->mjpeg_cinfo.output_scanline * stride];
     }
     jpeg_finish_decompress(&st->mjpeg_cinfo);
+
+    return out_frame;
 }
 
-G_GNUC_INTERNAL
-void stream_mjpeg_cleanup(display_stream *st)
+static void stream_mjpeg_data(display_stream *st)
+{
+    gboolean back_compat = st->channel->priv->peer_hdr.major_version == 1;
+    int width;
+    int height;
+    gsize frame_size;
+    uint8_t *data;
+    uint32_t size;
+
+    stream_get_dimensions(st, &width, &height);
+    size = stream_get_current_frame(st, &data);
+    frame_size = (gsize)STREAM_SCALED(width, st->scale_denom) *
+        STREAM_SCALED(height, st->scale_denom) * 4;
+
+    /* the frame is only used from the main context, decode over it */
+    if (st->out_frame_size != frame_size) {
+        g_free(st->out_frame);
+        st->out_frame = NULL;
+    }
+    st->out_frame = stream_mjpeg_decode(st, data, size, width, height, st->scale_denom,
+                                        back_compat, st->out_frame,
+                                        STREAM_SCALED(width, st->scale_denom) * 4);
+    st->out_frame_size = frame_size;
+}
+
+/*
+ * Decodes the current frame straight into @dest, rows @stride bytes
+ * apart, in the x8r8g8b8 format of the surfaces.
+ */
+/* main context */
+static gboolean stream_mjpeg_data_direct(display_stream *st, uint8_t *dest, int stride)
+{
+#ifdef JCS_EXTENSIONS
+    int width;
+    int height;
+    uint8_t *data;
+    uint32_t size;
+
+    /* the old servers send RGBX */
+    if (st->channel->priv->peer_hdr.major_version == 1)
+        return FALSE;
+
+    stream_get_dimensions(st, &width, &height);
+    size = stream_get_current_frame(st, &data);
+    stream_mjpeg_decode(st, data, size, width, height, 1, FALSE, dest, stride);
+
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+static void stream_mjpeg_cleanup(display_stream *st)
 {
     jpeg_destroy_decompress(&st->mjpeg_cinfo);
     g_free(st->out_frame);
     st->out_frame = NULL;
+    g_free(st->spare_frame);
+    st->spare_frame = NULL;
 }
+
+G_GNUC_INTERNAL
+const stream_decoder stream_mjpeg_decoder = {
+    .codec_type = SPICE_VIDEO_CODEC_TYPE_MJPEG,
+    .independent_frames = TRUE,
+    .scalable = TRUE,
+    .init = stream_mjpeg_init,
+    .data = stream_mjpeg_data,
+    .decode = stream_mjpeg_decode,
+    .data_direct = stream_mjpeg_data_direct,
+    .cleanup = stream_mjpeg_cleanup,
+};
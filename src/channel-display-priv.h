@@ -35,18 +35,25 @@
 G_BEGIN_DECLS
 
 
-typedef struct display_surface {
+typedef struct display_surface display_surface;
+
+/* a solid fill of a rectangle inside the surface, in its pixel format */
+typedef void (*display_fill_rect_func)(display_surface *surface,
+                                       const SpiceRect *rect, uint32_t color);
+
+struct display_surface {
     guint32                     surface_id;
     bool                        primary;
     enum SpiceSurfaceFmt        format;
     int                         width, height, stride, size;
+    int                         alloc_size; /* of data, may exceed size */
     int                         shmid;
+    int                         memfd; /* -1 unless data is mapped from it */
+    bool                        mapped; /* data is an anonymous mapping */
     uint8_t                     *data;
     SpiceCanvas                 *canvas;
-    SpiceGlzDecoder             *glz_decoder;
-    SpiceZlibDecoder            *zlib_decoder;
-    SpiceJpegDecoder            *jpeg_decoder;
-} display_surface;
+    display_fill_rect_func      fill_rect; /* NULL for the 8 and 1 bit formats */
+};
 
 typedef struct drops_sequence_stats {
     uint32_t len;
@@ -54,10 +61,64 @@ typedef struct drops_sequence_stats {
     uint32_t duration;
 } drops_sequence_stats;
 
-typedef struct display_stream {
+/* the last ones only, a stream may last for days */
+#define DROPS_SEQS_HISTORY 32
+
+typedef struct display_stream display_stream;
+
+/*
+ * A stream decoder, for one video codec. data() decodes the current
+ * frame of the stream into its out_frame, in the format of the
+ * surfaces. The optional decode() is the same, without touching the
+ * stream besides the decoder state, so that it can run in the decoding
+ * thread. The optional data_direct() decodes the current frame at
+ * @dest, and returns FALSE if it cannot.
+ *
+ * A scalable decoder decodes at 1/scale_denom of the frame size, the
+ * st->scale_denom of data(), the @scale_denom of decode(), which are
+ * 1, 2, 4 or 8; @width and @height are those of the frame, and
+ * @out_frame the size given by STREAM_SCALED().
+ */
+#define STREAM_SCALED(size, denom) (((size) + (denom) - 1) / (denom))
+
+typedef struct stream_decoder {
+    int         codec_type; /* SPICE_VIDEO_CODEC_TYPE_ */
+    gboolean    independent_frames; /* the hidden ones needn't be decoded */
+    gboolean    scalable;
+    void        (*init)(display_stream *st);
+    void        (*data)(display_stream *st);
+    uint8_t*    (*decode)(display_stream *st, uint8_t *data, uint32_t size,
+                          int width, int height, int scale_denom, gboolean back_compat,
+                          uint8_t *out_frame, int stride);
+    gboolean    (*data_direct)(display_stream *st, uint8_t *dest, int stride);
+    void        (*cleanup)(display_stream *st);
+} stream_decoder;
+
+/* a stream frame, decoded in the channel decoding thread */
+typedef struct display_frame {
+    display_stream              *st;
+    SpiceMsgIn                  *in;
+
+    /* read-only for the decoding thread */
+    uint8_t                     *data;
+    uint32_t                    size;
+    int                         width, height;
+    int                         scale_denom;
+    gboolean                    back_compat;
+    gint                        cancelled; /* atomic */
+
+    /* set by the decoding thread, unless recycled */
+    uint8_t                     *out_frame;
+
+    /* main context only */
+    gboolean                    done;
+} display_frame;
+
+struct display_stream {
     SpiceMsgIn                  *msg_create;
     SpiceMsgIn                  *msg_clip;
     SpiceMsgIn                  *msg_data;
+    SpiceMsgIn                  *msg_skipped; /* last frame not rendered, while hidden */
 
     /* from messages */
     display_surface             *surface;
@@ -65,6 +126,7 @@ typedef struct display_stream {
     QRegion                     region;
     int                         have_region;
     int                         codec;
+    const stream_decoder        *decoder; /* NULL if the codec is unknown */
 
     /* mjpeg decoder */
     struct jpeg_source_mgr         mjpeg_src;
@@ -72,10 +134,25 @@ typedef struct display_stream {
     struct jpeg_error_mgr          mjpeg_jerr;
 
     uint8_t                     *out_frame;
+    gsize                       out_frame_size;
+    int                         scale_denom; /* of out_frame */
+    uint8_t                     *spare_frame; /* for the decoding thread */
+    gsize                       spare_frame_size;
     GQueue                      *msgq;
     guint                       timeout;
     SpiceChannel                *channel;
 
+    /* threaded decoding */
+    GHashTable                  *frames; /* SpiceMsgIn -> display_frame */
+    guint                       frames_in_flight;
+
+    /* playout scheduling */
+    guint32                     jitter; /* of the arrival latency, in 1/16 ms */
+    gint32                      last_latency;
+    gint64                      decode_time; /* average, in us */
+    gint32                      av_offset; /* render mm-time - frame mm-time, in 1/16 ms */
+    gint32                      av_lead; /* correction of the render time, in us */
+
     /* stats */
     uint32_t             first_frame_mm_time;
     uint32_t             num_drops_on_receive;
@@ -83,8 +160,12 @@ typedef struct display_stream {
     uint32_t             num_drops_on_playback;
     uint32_t             num_input_frames;
     drops_sequence_stats cur_drops_seq_stats;
-    GArray               *drops_seqs_stats_arr;
+    drops_sequence_stats drops_seqs_stats[DROPS_SEQS_HISTORY]; /* ring */
     uint32_t             num_drops_seqs;
+    uint64_t             drops_duration_total;
+    gint64               stats_time; /* of the last fps sample */
+    uint32_t             stats_out_frames;
+    gdouble              fps;
 
     uint32_t             playback_sync_drops_seq_len;
 
@@ -96,17 +177,16 @@ typedef struct display_stream {
     uint64_t report_start_time;
     uint32_t report_start_frame_time;
     uint32_t report_num_frames;
-    uint32_t report_num_drops;
+    uint32_t report_num_drops; /* on receive */
+    uint32_t report_num_playback_drops; /* decoded too late */
     uint32_t report_drops_seq_len;
-} display_stream;
+};
 
 void stream_get_dimensions(display_stream *st, int *width, int *height);
 uint32_t stream_get_current_frame(display_stream *st, uint8_t **data);
 
 /* channel-display-mjpeg.c */
-void stream_mjpeg_init(display_stream *st);
-void stream_mjpeg_data(display_stream *st);
-void stream_mjpeg_cleanup(display_stream *st);
+extern const stream_decoder stream_mjpeg_decoder;
 
 G_END_DECLS
 
@@ -17,6 +17,12 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_DISPLAY
+
+#ifdef HAVE_MEMFD_CREATE
+#define _GNU_SOURCE /* memfd_create() */
+#endif
+
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -29,6 +35,16 @@
 #include <sys/ipc.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_MEMFD_CREATE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "glib-compat.h"
 #include "spice-client.h"
 #include "spice-common.h"
@@ -38,6 +54,7 @@
 #include "spice-session-priv.h"
 #include "channel-display-priv.h"
 #include "decode.h"
+#include "spice-trace.h"
 
 /**
  * SECTION:channel-display
@@ -62,16 +79,59 @@
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), SPICE_TYPE_DISPLAY_CHANNEL, SpiceDisplayChannelPrivate))
 
 #define MONITORS_MAX 256
+/* the surface ids are small, the servers hand them out densely */
+#define SURFACES_MAX 65536
+
+/*
+ * The palettes are stored in place, in a slot picked by the low bits of
+ * their id: the ids are handed out in sequence and the server keeps
+ * few of them. Those that collide, or have more than 256 entries, go
+ * to the overflow cache.
+ */
+#define PALETTE_SLOTS    64 /* a bit each in palette_slots_used */
+#define PALETTE_MAX_ENTS 256
+
+typedef union palette_slot {
+    SpicePalette                palette;
+    guint8                      storage[sizeof(SpicePalette) +
+                                        PALETTE_MAX_ENTS * sizeof(uint32_t)];
+} palette_slot;
+
+/* the image codecs timed for the adaptive compression */
+enum {
+    CODEC_QUIC,
+    CODEC_LZ,
+    CODEC_GLZ,
+    CODEC_JPEG,
+    CODEC_LZ4,
+    CODEC_LAST,
+};
 
 struct _SpiceDisplayChannelPrivate {
-    GHashTable                  *surfaces;
+    GPtrArray                   *surfaces; /* indexed by surface id */
+    pixman_region32_t           damage; /* of the primary, not emitted yet */
+    gint64                      damage_wire_time; /* of the oldest draw in damage */
+    gint64                      present_wire_time; /* of the oldest draw not presented */
+    guint64                     latency[SPICE_DISPLAY_LATENCY_BUCKETS];
+    guint64                     surface_bytes; /* of pixels allocated */
+    guint64                     lossy_image_draws; /* from the cache, still lossy */
+    guint64                     lossy_image_upgrades;
     display_surface             *primary;
     display_cache               *images;
-    display_cache               *palettes;
+    display_cache               *palettes; /* overflow of palette_slots */
+    palette_slot                *palette_slots;
+    guint64                     palette_slots_used;
     SpiceImageCache             image_cache;
     SpicePaletteCache           palette_cache;
     SpiceImageSurfaces          image_surfaces;
     SpiceGlzDecoderWindow       *glz_window;
+    /* the canvases decode one image at a time, they share the decoders */
+    SpiceGlzDecoder             *glz_decoder;
+    SpiceZlibDecoder            *zlib_decoder;
+    SpiceJpegDecoder            *jpeg_decoder;
+#ifdef USE_LZ4
+    GByteArray                  *lz4_rows; /* the rows, before the surface */
+#endif
     display_stream              **streams;
     int                         nstreams;
     gboolean                    mark;
@@ -79,6 +139,28 @@ struct _SpiceDisplayChannelPrivate {
     GArray                      *monitors;
     guint                       monitors_max;
     gboolean                    enable_adaptive_streaming;
+    gboolean                    threaded_decode;
+    GThreadPool                 *decode_pool;
+    GAsyncQueue                 *decoded_frames;
+    GQueue                      deferred_draws;
+    GCoroutineWaiter            *deferred_waiter;
+    gboolean                    replaying;
+    GList                       *exports; /* SpiceDisplayExport */
+    /* the adaptive compression, see compression_check() */
+    gboolean                    compression_adaptive;
+    guint                       compression_check_id;
+    guint                       compression_samples; /* since the last check */
+    gdouble                     codec_ns[CODEC_LAST]; /* per pixel, smoothed */
+    guint                       codec_draws[CODEC_LAST]; /* since the last preference */
+    gboolean                    lz4_refused; /* LZ4 was preferred, the server ignored it */
+    SpiceImageCompression       compression_pending;
+    SpiceImageCompression       compression_sent;
+    guint                       primary_serial; /* bumped on each primary */
+    guint64                     frame_sequence; /* bumped on each update */
+    GHashTable                  *view_scales; /* view -> scale, in 1/1000 */
+    GHashTable                  *hidden_views;
+    gboolean                    views_hidden; /* all of them */
+    int                         decode_scale_denom; /* of the scalable streams */
 #ifdef G_OS_WIN32
     HDC dc;
 #endif
@@ -92,7 +174,11 @@ enum {
     PROP_WIDTH,
     PROP_HEIGHT,
     PROP_MONITORS,
-    PROP_MONITORS_MAX
+    PROP_MONITORS_MAX,
+    PROP_THREADED_DECODE,
+    PROP_SURFACE_BYTES,
+    PROP_LOSSY_IMAGE_DRAWS,
+    PROP_LOSSY_IMAGE_UPGRADES,
 };
 
 enum {
@@ -100,6 +186,9 @@ enum {
     SPICE_DISPLAY_PRIMARY_DESTROY,
     SPICE_DISPLAY_INVALIDATE,
     SPICE_DISPLAY_MARK,
+    SPICE_DISPLAY_INVALIDATE_REGION,
+    SPICE_DISPLAY_INVALIDATE_MONITOR,
+    SPICE_DISPLAY_STREAM_STATS,
 
     SPICE_DISPLAY_LAST_SIGNAL,
 };
@@ -107,17 +196,27 @@ enum {
 static guint signals[SPICE_DISPLAY_LAST_SIGNAL];
 
 static void spice_display_channel_up(SpiceChannel *channel);
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 static void channel_set_handlers(SpiceChannelClass *klass);
 
 static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary);
+static void set_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id,
+                        display_surface *surface);
 static void clear_streams(SpiceChannel *channel);
 static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id);
 static gboolean display_stream_render(display_stream *st);
+static SpiceRect *stream_get_dest(display_stream *st);
+static uint32_t stream_get_flags(display_stream *st);
+static gboolean display_stream_skip_hidden(display_stream *st);
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_display_channel_reset_capabilities(SpiceChannel *channel);
-static void destroy_canvas(display_surface *surface);
-static void _msg_in_unref_func(gpointer data, gpointer user_data);
+static void destroy_canvas(SpiceDisplayChannelPrivate *c, display_surface *surface);
+static SpiceCanvas *surface_get_canvas(SpiceDisplayChannelPrivate *c,
+                                       display_surface *surface);
+static void display_stream_release_msg_func(gpointer data, gpointer user_data);
 static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer data);
+static void clear_deferred_draws(SpiceChannel *channel);
+static void display_update_views_hidden(SpiceChannel *channel);
 
 /* ------------------------------------------------------------------ */
 
@@ -129,6 +228,11 @@ static void spice_display_channel_dispose(GObject *object)
         g_source_remove(c->mark_false_event_id);
         c->mark_false_event_id = 0;
     }
+    if (c->compression_check_id != 0) {
+        g_source_remove(c->compression_check_id);
+        c->compression_check_id = 0;
+    }
+    clear_deferred_draws(SPICE_CHANNEL(object));
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose(object);
@@ -140,9 +244,24 @@ static void spice_display_channel_finalize(GObject *object)
 
     g_clear_pointer(&c->monitors, g_array_unref);
     clear_surfaces(SPICE_CHANNEL(object), FALSE);
-    g_hash_table_unref(c->surfaces);
+    g_ptr_array_unref(c->surfaces);
+    pixman_region32_fini(&c->damage);
     clear_streams(SPICE_CHANNEL(object));
+    if (c->decode_pool) {
+        /* all the frames were collected when destroying the streams */
+        g_thread_pool_free(c->decode_pool, FALSE, TRUE);
+        g_async_queue_unref(c->decoded_frames);
+    }
     g_clear_pointer(&c->palettes, cache_unref);
+    g_free(c->palette_slots);
+    g_clear_pointer(&c->glz_decoder, glz_decoder_destroy);
+    g_clear_pointer(&c->zlib_decoder, zlib_decoder_destroy);
+    g_clear_pointer(&c->jpeg_decoder, jpeg_decoder_destroy);
+#ifdef USE_LZ4
+    g_clear_pointer(&c->lz4_rows, g_byte_array_unref);
+#endif
+    g_clear_pointer(&c->view_scales, g_hash_table_unref);
+    g_clear_pointer(&c->hidden_views, g_hash_table_unref);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize(object);
@@ -156,11 +275,16 @@ static void spice_display_channel_constructed(GObject *object)
     g_return_if_fail(s != NULL);
     spice_session_get_caches(s, &c->images, &c->glz_window);
     c->palettes = cache_new(g_free);
+    c->palette_slots = g_new(palette_slot, PALETTE_SLOTS);
 
     g_return_if_fail(c->glz_window != NULL);
     g_return_if_fail(c->images != NULL);
     g_return_if_fail(c->palettes != NULL);
 
+    c->glz_decoder = glz_decoder_new(c->glz_window);
+    c->zlib_decoder = zlib_decoder_new();
+    c->jpeg_decoder = jpeg_decoder_new();
+
     c->monitors = g_array_new(FALSE, TRUE, sizeof(SpiceDisplayMonitorConfig));
     spice_g_signal_connect_object(s, "mm-time-reset",
                                   G_CALLBACK(display_session_mm_time_reset_cb),
@@ -196,6 +320,18 @@ static void spice_display_get_property(GObject    *object,
         g_value_set_uint(value, c->monitors_max);
         break;
     }
+    case PROP_THREADED_DECODE:
+        g_value_set_boolean(value, c->threaded_decode);
+        break;
+    case PROP_SURFACE_BYTES:
+        g_value_set_uint64(value, c->surface_bytes);
+        break;
+    case PROP_LOSSY_IMAGE_DRAWS:
+        g_value_set_uint64(value, c->lossy_image_draws);
+        break;
+    case PROP_LOSSY_IMAGE_UPGRADES:
+        g_value_set_uint64(value, c->lossy_image_upgrades);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -207,7 +343,12 @@ static void spice_display_set_property(GObject      *object,
                                        const GValue *value,
                                        GParamSpec   *pspec)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
+
     switch (prop_id) {
+    case PROP_THREADED_DECODE:
+        c->threaded_decode = g_value_get_boolean(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -217,13 +358,44 @@ static void spice_display_set_property(GObject      *object,
 /* main or coroutine context */
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    c->compression_adaptive = FALSE;
+    if (c->compression_check_id != 0) {
+        g_source_remove(c->compression_check_id);
+        c->compression_check_id = 0;
+    }
+
     /* palettes, images, and glz_window are cleared in the session */
+    clear_deferred_draws(channel);
     clear_streams(channel);
     clear_surfaces(channel, TRUE);
 
     SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->channel_reset(channel, migrating);
 }
 
+/* main context: the surfaces pixels, and the decoded stream frames */
+static gsize spice_display_get_memory_usage(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gsize size = c->surface_bytes;
+    int i;
+
+    for (i = 0; i < c->nstreams; i++) {
+        display_stream *st = c->streams[i];
+
+        if (st == NULL)
+            continue;
+        size += st->out_frame_size + st->spare_frame_size;
+    }
+#ifdef USE_LZ4
+    if (c->lz4_rows)
+        size += c->lz4_rows->len;
+#endif
+
+    return size;
+}
+
 static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
@@ -236,6 +408,7 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
     gobject_class->constructed = spice_display_channel_constructed;
 
     channel_class->channel_up   = spice_display_channel_up;
+    channel_class->handle_msg   = spice_display_handle_msg;
     channel_class->channel_reset = spice_display_channel_reset;
     channel_class->channel_reset_capabilities = spice_display_channel_reset_capabilities;
 
@@ -291,6 +464,83 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                            G_PARAM_READABLE |
                            G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplayChannel:threaded-decode:
+     *
+     * Decode the video stream frames in a thread dedicated to this
+     * channel, as soon as they are received, instead of decoding them
+     * from the main loop when they are due. Drawing to the surfaces
+     * and the #SpiceDisplayChannel::display-invalidate signal still
+     * happen in the main context.
+     *
+     * Enabled by default, unless SPICE_DISABLE_THREADED_DECODE is set
+     * in the environment.
+     *
+     * Since: 0.29
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_THREADED_DECODE,
+         g_param_spec_boolean("threaded-decode",
+                              "Threaded decode",
+                              "Decode video streams in a separate thread",
+                              TRUE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:surface-bytes:
+     *
+     * The memory allocated for the pixels of the surfaces of the
+     * channel, in bytes. The off-screen surfaces are only allocated
+     * when they are first drawn to, or used as a source.
+     *
+     * Since: 0.29
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_SURFACE_BYTES,
+         g_param_spec_uint64("surface-bytes",
+                             "Surface bytes",
+                             "Memory allocated for the surface pixels",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:lossy-image-draws:
+     *
+     * The number of times a cached image was drawn while only its lossy
+     * version was received, such as the JPEG sent first with
+     * jpeg-wan-compression.
+     *
+     * Since: 0.29
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_LOSSY_IMAGE_DRAWS,
+         g_param_spec_uint64("lossy-image-draws",
+                             "Lossy image draws",
+                             "Cached images drawn in their lossy version",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:lossy-image-upgrades:
+     *
+     * The number of cached lossy images replaced by their lossless
+     * version. With #SpiceDisplayChannel:lossy-image-draws, how often a
+     * lossy image is drawn before its upgrade, on average.
+     *
+     * Since: 0.29
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_LOSSY_IMAGE_UPGRADES,
+         g_param_spec_uint64("lossy-image-upgrades",
+                             "Lossy image upgrades",
+                             "Cached lossy images replaced by their lossless version",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplayChannel::display-primary-create:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -361,6 +611,85 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                      4,
                      G_TYPE_INT, G_TYPE_INT, G_TYPE_INT, G_TYPE_INT);
 
+    /**
+     * SpiceDisplayChannel::display-invalidate-region:
+     * @display: the #SpiceDisplayChannel that emitted the signal
+     * @boxes: (type gpointer): the updated rectangles, an array of
+     * pixman_box32_t, valid during the emission
+     * @n_boxes: the number of rectangles
+     *
+     * The #SpiceDisplayChannel::display-invalidate-region signal is
+     * emitted when a region of the primary buffer is updated. The
+     * draws are accumulated until the channel has no more input to
+     * handle, or a non-draw message arrives. The same update is then
+     * emitted as one #SpiceDisplayChannel::display-invalidate signal
+     * per rectangle, and as #SpiceDisplayChannel::display-invalidate-monitor
+     * signals, so a handler should connect to only one of them.
+     *
+     * Since: 0.29
+     **/
+    signals[SPICE_DISPLAY_INVALIDATE_REGION] =
+        g_signal_new("display-invalidate-region",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_user_marshal_VOID__POINTER_INT,
+                     G_TYPE_NONE,
+                     2,
+                     G_TYPE_POINTER, G_TYPE_INT);
+
+    /**
+     * SpiceDisplayChannel::display-invalidate-monitor:
+     * @display: the #SpiceDisplayChannel that emitted the signal
+     * @x: x position
+     * @y: y position
+     * @width: width
+     * @height: height
+     *
+     * The #SpiceDisplayChannel::display-invalidate-monitor signal is
+     * emitted like #SpiceDisplayChannel::display-invalidate, with the
+     * rectangle clipped to each monitor of the primary surface it
+     * touches, and the id of that monitor in decimal as the detail:
+     * connecting to "display-invalidate-monitor::1" gives only the
+     * updates of the monitor 1.
+     *
+     * Since: 0.29
+     **/
+    signals[SPICE_DISPLAY_INVALIDATE_MONITOR] =
+        g_signal_new("display-invalidate-monitor",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST | G_SIGNAL_DETAILED,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_user_marshal_VOID__INT_INT_INT_INT,
+                     G_TYPE_NONE,
+                     4,
+                     G_TYPE_INT, G_TYPE_INT, G_TYPE_INT, G_TYPE_INT);
+
+    /**
+     * SpiceDisplayChannel::display-stream-stats:
+     * @display: the #SpiceDisplayChannel that emitted the signal
+     * @stats: the #SpiceDisplayStreamStats of the stream
+     *
+     * The #SpiceDisplayChannel::display-stream-stats signal is emitted
+     * about once a second for each video stream that is playing, with
+     * its statistics. @stats is only valid during the emission, see
+     * spice_display_get_stream_stats() to get them at any time.
+     *
+     * Since: 0.29
+     **/
+    signals[SPICE_DISPLAY_STREAM_STATS] =
+        g_signal_new("display-stream-stats",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__BOXED,
+                     G_TYPE_NONE,
+                     1,
+                     SPICE_TYPE_DISPLAY_STREAM_STATS);
+
     /**
      * SpiceDisplayChannel::display-mark:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -388,6 +717,7 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
     quic_init();
     rop3_init();
     channel_set_handlers(SPICE_CHANNEL_CLASS(klass));
+    channel_class->priv->get_memory_usage = spice_display_get_memory_usage;
 }
 
 /**
@@ -427,140 +757,736 @@ gboolean spice_display_get_primary(SpiceChannel *channel, guint32 surface_id,
     return TRUE;
 }
 
-/* ------------------------------------------------------------------ */
-
-static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image)
+/**
+ * spice_display_get_primary_fd:
+ * @channel:
+ * @surface_id:
+ *
+ * Retrieve the file descriptor backing the data of the primary display
+ * surface @surface_id, when it is allocated from a memfd. The data
+ * starts at offset 0, with the stride given by
+ * spice_display_get_primary(). The descriptor is owned by @channel and
+ * stays valid until the primary is destroyed; it can be passed to a
+ * compositor, for example as a wl_shm pool, to present the surface
+ * without copying it.
+ *
+ * Returns: the file descriptor, or -1 if the surface is not found or is
+ * not backed by a memfd.
+ *
+ * Since: 0.29
+ */
+gint spice_display_get_primary_fd(SpiceChannel *channel, guint32 surface_id)
 {
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+    g_return_val_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel), -1);
 
-    cache_add(c->images, id, pixman_image_ref(image));
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_surface *surface = find_surface(c, surface_id);
+
+    if (surface == NULL)
+        return -1;
+
+    g_return_val_if_fail(surface->primary, -1);
+
+    return surface->memfd;
 }
 
-typedef struct _WaitImageData
+/* past that, the damage of an export is reduced to its extents */
+#define EXPORT_MAX_RECTS 32
+
+struct _SpiceDisplayExport {
+    SpiceChannel                *channel;
+    pixman_region32_t           damage; /* since the last frame */
+    SpiceDisplayExportFunc      func;
+    gpointer                    user_data;
+    GDestroyNotify              notify;
+    guint                       ready_id;
+};
+
+struct _SpiceDisplayFrame {
+    gint                        ref_count;
+    SpiceChannel                *channel;
+    guint                       primary_serial;
+    guint64                     sequence;
+    enum SpiceSurfaceFmt        format;
+    gint                        width;
+    gint                        height;
+    gint                        stride;
+    guint8                      *data;
+    gint                        fd;
+    SpiceDisplayRect            *damage;
+    guint                       n_damage;
+};
+
+G_DEFINE_BOXED_TYPE(SpiceDisplayFrame, spice_display_frame,
+                    spice_display_frame_ref, spice_display_frame_unref)
+
+/* main context */
+static gboolean export_ready(gpointer data)
 {
-    gboolean lossy;
-    SpiceImageCache *cache;
-    uint64_t id;
-    pixman_image_t *image;
-} WaitImageData;
+    SpiceDisplayExport *display_export = data;
 
-static gboolean wait_image(gpointer data)
+    display_export->ready_id = 0;
+    display_export->func(display_export, display_export->user_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Adds @region, in primary coordinates, to the damage of the exports,
+ * which are told about it from the main loop if they were up to date.
+ */
+/* main or coroutine context */
+static void export_damage(SpiceDisplayChannelPrivate *c, pixman_region32_t *region)
 {
-    gboolean lossy;
-    WaitImageData *wait = data;
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
-    pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
+    GList *l;
 
-    if (!image || (lossy && !wait->lossy))
-        return FALSE;
+    c->frame_sequence++;
+    for (l = c->exports; l != NULL; l = l->next) {
+        SpiceDisplayExport *display_export = l->data;
 
-    wait->image = pixman_image_ref(image);
+        pixman_region32_union(&display_export->damage, &display_export->damage, region);
+        if (pixman_region32_n_rects(&display_export->damage) > EXPORT_MAX_RECTS) {
+            pixman_box32_t extents = *pixman_region32_extents(&display_export->damage);
 
-    return TRUE;
+            pixman_region32_reset(&display_export->damage, &extents);
+        }
+
+        if (display_export->func != NULL && display_export->ready_id == 0)
+            display_export->ready_id = g_idle_add(export_ready, display_export);
+    }
 }
 
-static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
+/* main or coroutine context */
+static void export_damage_primary(SpiceDisplayChannelPrivate *c)
 {
-    WaitImageData wait = {
-        .lossy = TRUE,
-        .cache = cache,
-        .id = id,
-        .image = NULL
-    };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
-        SPICE_DEBUG("wait image got cancelled");
+    pixman_region32_t region;
 
-    return wait.image;
+    if (c->exports == NULL || c->primary == NULL)
+        return;
+
+    pixman_region32_init_rect(&region, 0, 0, c->primary->width, c->primary->height);
+    export_damage(c, &region);
+    pixman_region32_fini(&region);
 }
 
-static void palette_put(SpicePaletteCache *cache, SpicePalette *palette)
+/**
+ * spice_display_export_new:
+ * @channel: a #SpiceDisplayChannel
+ * @func: (scope notified) (allow-none): called from the main loop when
+ * the primary surface has changed since the last frame
+ * @user_data: data passed to @func
+ * @notify: (allow-none): called on @user_data when the export is freed
+ *
+ * Creates a consumer of the primary surface of @channel, for example an
+ * encoder. Each consumer gets frames that are views of the primary
+ * surface, without a copy, with the region that has changed since its
+ * previous frame, see spice_display_export_get_frame().
+ *
+ * Returns: (transfer full): a new #SpiceDisplayExport, free it with
+ * spice_display_export_free()
+ *
+ * Since: 0.29
+ */
+SpiceDisplayExport *spice_display_export_new(SpiceChannel *channel,
+                                             SpiceDisplayExportFunc func,
+                                             gpointer user_data,
+                                             GDestroyNotify notify)
 {
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, palette_cache);
-
-    cache_add(c->palettes, palette->unique,
-              g_memdup(palette, sizeof(SpicePalette) +
-                       palette->num_ents * sizeof(palette->ents[0])));
+    SpiceDisplayChannelPrivate *c;
+    SpiceDisplayExport *display_export;
+
+    g_return_val_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel), NULL);
+
+    c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_export = g_new0(SpiceDisplayExport, 1);
+    display_export->channel = g_object_ref(channel);
+    display_export->func = func;
+    display_export->user_data = user_data;
+    display_export->notify = notify;
+    pixman_region32_init(&display_export->damage);
+    if (c->primary != NULL)
+        pixman_region32_union_rect(&display_export->damage, &display_export->damage,
+                                   0, 0, c->primary->width, c->primary->height);
+    c->exports = g_list_prepend(c->exports, display_export);
+
+    return display_export;
 }
 
-static SpicePalette *palette_get(SpicePaletteCache *cache, uint64_t id)
+/**
+ * spice_display_export_free:
+ * @display_export: a #SpiceDisplayExport
+ *
+ * Frees @display_export. The frames it gave remain valid until they are
+ * unreferenced.
+ *
+ * Since: 0.29
+ */
+void spice_display_export_free(SpiceDisplayExport *display_export)
 {
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, palette_cache);
+    SpiceDisplayChannelPrivate *c;
 
-    /* here the returned pointer is weak, no ref given to caller.  it
-     * seems spice canvas usage is exclusively temporary, so it's ok.
-     * palette_release is a noop. */
-    return cache_find(c->palettes, id);
+    g_return_if_fail(display_export != NULL);
+
+    c = SPICE_DISPLAY_CHANNEL(display_export->channel)->priv;
+    c->exports = g_list_remove(c->exports, display_export);
+    if (display_export->ready_id != 0)
+        g_source_remove(display_export->ready_id);
+    if (display_export->notify != NULL)
+        display_export->notify(display_export->user_data);
+    pixman_region32_fini(&display_export->damage);
+    g_object_unref(display_export->channel);
+    g_free(display_export);
 }
 
-static void palette_remove(SpicePaletteCache *cache, uint64_t id)
+/**
+ * spice_display_export_get_frame:
+ * @display_export: a #SpiceDisplayExport
+ *
+ * Gets a view of the current primary surface, with the region that has
+ * changed since the previous frame of @display_export, and starts accumulating
+ * the changes for the next one. The first frame, and the first one
+ * after the primary surface was created again, has all of it damaged.
+ *
+ * The pixels are those of the surface, they are not copied: they only
+ * change when the channel runs, from the main loop. A consumer reads
+ * the damaged rectangles before returning to the main loop, or copies
+ * them, and can then keep the frame to check its sequence number.
+ *
+ * Returns: (transfer full) (allow-none): the frame, or %NULL when there
+ * is no primary surface
+ *
+ * Since: 0.29
+ */
+SpiceDisplayFrame *spice_display_export_get_frame(SpiceDisplayExport *display_export)
 {
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, palette_cache);
+    SpiceDisplayChannelPrivate *c;
+    SpiceDisplayFrame *frame;
+    pixman_box32_t *boxes;
+    int i, n;
+
+    g_return_val_if_fail(display_export != NULL, NULL);
+
+    c = SPICE_DISPLAY_CHANNEL(display_export->channel)->priv;
+    if (c->primary == NULL || c->primary->data == NULL)
+        return NULL;
+
+    frame = g_new0(SpiceDisplayFrame, 1);
+    frame->ref_count = 1;
+    frame->channel = g_object_ref(display_export->channel);
+    frame->primary_serial = c->primary_serial;
+    frame->sequence = c->frame_sequence;
+    frame->format = c->primary->format;
+    frame->width = c->primary->width;
+    frame->height = c->primary->height;
+    frame->stride = c->primary->stride;
+    frame->data = c->primary->data;
+    frame->fd = c->primary->memfd;
+
+    boxes = pixman_region32_rectangles(&display_export->damage, &n);
+    frame->damage = g_new(SpiceDisplayRect, n);
+    frame->n_damage = n;
+    for (i = 0; i < n; i++) {
+        frame->damage[i].x = boxes[i].x1;
+        frame->damage[i].y = boxes[i].y1;
+        frame->damage[i].width = boxes[i].x2 - boxes[i].x1;
+        frame->damage[i].height = boxes[i].y2 - boxes[i].y1;
+    }
+    pixman_region32_clear(&display_export->damage);
 
-    cache_remove(c->palettes, id);
+    return frame;
 }
 
-static void palette_release(SpicePaletteCache *cache, SpicePalette *palette)
+/**
+ * spice_display_frame_ref:
+ * @frame: a #SpiceDisplayFrame
+ *
+ * Returns: (transfer full): @frame, with one more reference
+ *
+ * Since: 0.29
+ */
+SpiceDisplayFrame *spice_display_frame_ref(SpiceDisplayFrame *frame)
 {
-    /* there is no refcount of palette, see palette_get() */
+    g_return_val_if_fail(frame != NULL, NULL);
+
+    g_atomic_int_inc(&frame->ref_count);
+
+    return frame;
 }
 
-static void image_put_lossy(SpiceImageCache *cache, uint64_t id,
-                            pixman_image_t *surface)
+/**
+ * spice_display_frame_unref:
+ * @frame: a #SpiceDisplayFrame
+ *
+ * Drops a reference on @frame, and frees it when it was the last one.
+ *
+ * Since: 0.29
+ */
+void spice_display_frame_unref(SpiceDisplayFrame *frame)
 {
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+    g_return_if_fail(frame != NULL);
 
-#ifndef NDEBUG
-    g_warn_if_fail(cache_find(c->images, id) == NULL);
-#endif
+    if (!g_atomic_int_dec_and_test(&frame->ref_count))
+        return;
 
-    cache_add_lossy(c->images, id, pixman_image_ref(surface), TRUE);
+    g_object_unref(frame->channel);
+    g_free(frame->damage);
+    g_free(frame);
 }
 
-static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
-                                pixman_image_t *surface)
+#ifndef WITH_GSTAUDIO
+/* see spice-gstdisplaysrc.c, built when the GStreamer libraries are found */
+gboolean spice_display_gst_src_register(void)
 {
-    image_put(cache, id, surface);
+    return FALSE;
 }
+#endif
 
-static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
+/* the primary was destroyed or created again since @frame was taken */
+static gboolean frame_is_stale(SpiceDisplayFrame *frame)
 {
-    WaitImageData wait = {
-        .lossy = FALSE,
-        .cache = cache,
-        .id = id,
-        .image = NULL
-    };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
-        SPICE_DEBUG("wait lossless got cancelled");
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(frame->channel)->priv;
 
-    return wait.image;
+    return c->primary == NULL || c->primary_serial != frame->primary_serial;
 }
 
-static SpiceCanvas *surfaces_get(SpiceImageSurfaces *surfaces,
-                                 uint32_t surface_id)
+/**
+ * spice_display_frame_get_data:
+ * @frame: a #SpiceDisplayFrame
+ * @stride: (out) (allow-none): the stride of the rows, in bytes
+ *
+ * Returns: (transfer none) (allow-none): the pixels of the primary
+ * surface, or %NULL if it was destroyed or created again since @frame
+ * was taken
+ *
+ * Since: 0.29
+ */
+const guint8 *spice_display_frame_get_data(SpiceDisplayFrame *frame, gint *stride)
 {
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(surfaces, SpiceDisplayChannelPrivate, image_surfaces);
+    g_return_val_if_fail(frame != NULL, NULL);
 
-    display_surface *s =
-        find_surface(c, surface_id);
+    if (stride != NULL)
+        *stride = frame->stride;
 
-    return s ? s->canvas : NULL;
+    return frame_is_stale(frame) ? NULL : frame->data;
 }
 
-static SpiceImageCacheOps image_cache_ops = {
-    .put = image_put,
-    .get = image_get,
-
-    .put_lossy = image_put_lossy,
-    .replace_lossy = image_replace_lossy,
-    .get_lossless = image_get_lossless,
+/**
+ * spice_display_frame_get_fd:
+ * @frame: a #SpiceDisplayFrame
+ *
+ * Gets the memfd holding the pixels, see spice_display_get_primary_fd().
+ *
+ * Returns: the file descriptor, owned by the channel, or -1 if the
+ * surface is not backed by a memfd or is gone
+ *
+ * Since: 0.29
+ */
+gint spice_display_frame_get_fd(SpiceDisplayFrame *frame)
+{
+    g_return_val_if_fail(frame != NULL, -1);
+
+    return frame_is_stale(frame) ? -1 : frame->fd;
+}
+
+/**
+ * spice_display_frame_get_format:
+ * @frame: a #SpiceDisplayFrame
+ * @width: (out) (allow-none): the width of the surface
+ * @height: (out) (allow-none): the height of the surface
+ *
+ * Returns: the format of the pixels
+ *
+ * Since: 0.29
+ */
+enum SpiceSurfaceFmt spice_display_frame_get_format(SpiceDisplayFrame *frame,
+                                                    gint *width, gint *height)
+{
+    g_return_val_if_fail(frame != NULL, SPICE_SURFACE_FMT_INVALID);
+
+    if (width != NULL)
+        *width = frame->width;
+    if (height != NULL)
+        *height = frame->height;
+
+    return frame->format;
+}
+
+/**
+ * spice_display_frame_get_sequence:
+ * @frame: a #SpiceDisplayFrame
+ *
+ * Returns: the number of the updates of the channel when @frame was
+ * taken, two frames with the same number have the same pixels
+ *
+ * Since: 0.29
+ */
+guint64 spice_display_frame_get_sequence(SpiceDisplayFrame *frame)
+{
+    g_return_val_if_fail(frame != NULL, 0);
+
+    return frame->sequence;
+}
+
+/**
+ * spice_display_frame_get_damage:
+ * @frame: a #SpiceDisplayFrame
+ * @n_rects: (out): the number of rectangles
+ *
+ * Returns: (transfer none) (array length=n_rects): the rectangles that
+ * changed since the previous frame of the export, owned by @frame
+ *
+ * Since: 0.29
+ */
+const SpiceDisplayRect *spice_display_frame_get_damage(SpiceDisplayFrame *frame,
+                                                       guint *n_rects)
+{
+    g_return_val_if_fail(frame != NULL, NULL);
+    g_return_val_if_fail(n_rects != NULL, NULL);
+
+    *n_rects = frame->n_damage;
+
+    return frame->damage;
+}
+
+/**
+ * spice_display_presented:
+ * @channel: a #SpiceDisplayChannel
+ *
+ * Tells @channel that what it invalidated so far is on screen, so that
+ * it can account for the latency from the wire to the screen. The
+ * #SpiceDisplay widget calls it when it draws.
+ *
+ * Since: 0.29
+ */
+void spice_display_presented(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c;
+    gint64 ms;
+    guint i;
+
+    g_return_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel));
+
+    c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    if (c->present_wire_time == 0)
+        return;
+
+    spice_session_startup_reached(spice_channel_get_session(channel),
+                                  SPICE_SESSION_STARTUP_FIRST_FRAME);
+
+    ms = (g_get_monotonic_time() - c->present_wire_time) / 1000;
+    c->present_wire_time = 0;
+    for (i = 0; i < SPICE_DISPLAY_LATENCY_BUCKETS - 1 && ms > 0; i++)
+        ms >>= 1;
+    c->latency[i]++;
+}
+
+/**
+ * spice_display_get_latency_histogram:
+ * @channel: a #SpiceDisplayChannel
+ * @histogram: (out) (array fixed-size=16): the counts of each bucket
+ *
+ * Gets the histogram of the latencies from the wire to the screen, that
+ * is from the reception of a draw or a stream frame to the first
+ * spice_display_presented() that follows, over the channel life-time.
+ * Bucket 0 counts the latencies under 1 ms, bucket i those from
+ * 2^(i-1) to 2^i ms, and the last one all those above.
+ *
+ * Since: 0.29
+ */
+void spice_display_get_latency_histogram(SpiceChannel *channel,
+                                         guint64 histogram[SPICE_DISPLAY_LATENCY_BUCKETS])
+{
+    g_return_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel));
+
+    memcpy(histogram, SPICE_DISPLAY_CHANNEL(channel)->priv->latency,
+           sizeof(guint64) * SPICE_DISPLAY_LATENCY_BUCKETS);
+}
+
+/**
+ * spice_display_set_view_scale:
+ * @channel: a #SpiceDisplayChannel
+ * @view: the object displaying @channel, a widget for example
+ * @scale: the scale @view displays @channel at, or 0 once it stops
+ *
+ * Tells @channel at which scale one of its views displays it. While
+ * all of its views scale it down to 1/2 or less, the video streams
+ * that can be are decoded at 1/2, 1/4 or 1/8 of their size, the
+ * largest that is still not downscaled by every view, and scaled back
+ * up on the surface. That saves most of the decoding when many
+ * displays are shown at once, as thumbnails.
+ *
+ * Since: 0.29
+ */
+void spice_display_set_view_scale(SpiceChannel *channel, gpointer view, gdouble scale)
+{
+    SpiceDisplayChannelPrivate *c;
+    GHashTableIter iter;
+    gpointer value;
+    guint max = 0;
+    int denom = 1;
+
+    g_return_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel));
+    g_return_if_fail(view != NULL);
+
+    c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    if (c->view_scales == NULL)
+        c->view_scales = g_hash_table_new(NULL, NULL);
+
+    if (scale <= 0) {
+        g_hash_table_remove(c->view_scales, view);
+        if (c->hidden_views)
+            g_hash_table_remove(c->hidden_views, view);
+        display_update_views_hidden(channel);
+    } else
+        g_hash_table_insert(c->view_scales, view,
+                            GUINT_TO_POINTER((guint)CLAMP(scale * 1000, 1, G_MAXINT)));
+
+    g_hash_table_iter_init(&iter, c->view_scales);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        max = MAX(max, GPOINTER_TO_UINT(value));
+
+    if (max != 0) {
+        while (denom < 8 && max * denom * 2 <= 1000)
+            denom *= 2;
+    }
+
+    if (denom != c->decode_scale_denom) {
+        CHANNEL_DEBUG(channel, "decoding the streams at 1/%d", denom);
+        c->decode_scale_denom = denom;
+    }
+}
+
+/**
+ * spice_display_set_view_visible:
+ * @channel: a #SpiceDisplayChannel
+ * @view: an object displaying @channel, as given to
+ * spice_display_set_view_scale()
+ * @visible: whether @view is visible on the screen
+ *
+ * Tells @channel whether one of its views can be seen, it is not when
+ * it is unmapped or fully covered. While none of the views of @channel
+ * is visible, the frames of its video streams that need not be decoded
+ * are not; the surfaces are still kept up to date otherwise. The last
+ * frame of each stream is rendered once a view is visible again, or
+ * when the stream ends.
+ *
+ * Since: 0.29
+ */
+void spice_display_set_view_visible(SpiceChannel *channel, gpointer view, gboolean visible)
+{
+    SpiceDisplayChannelPrivate *c;
+
+    g_return_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel));
+    g_return_if_fail(view != NULL);
+
+    c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    if (c->hidden_views == NULL)
+        c->hidden_views = g_hash_table_new(NULL, NULL);
+
+    if (visible)
+        g_hash_table_remove(c->hidden_views, view);
+    else
+        g_hash_table_insert(c->hidden_views, view, view);
+
+    display_update_views_hidden(channel);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+
+    cache_add(c->images, id, pixman_image_ref(image));
+}
+
+typedef struct _WaitImageData
+{
+    gboolean lossy;
+    SpiceImageCache *cache;
+    uint64_t id;
+    pixman_image_t *image;
+    gboolean image_lossy;
+} WaitImageData;
+
+static gboolean wait_image(gpointer data)
+{
+    gboolean lossy;
+    WaitImageData *wait = data;
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
+    pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
+
+    if (!image || (lossy && !wait->lossy))
+        return FALSE;
+
+    wait->image = pixman_image_ref(image);
+    wait->image_lossy = lossy;
+
+    return TRUE;
+}
+
+/* the image may be added from another display channel, wait for it */
+static gboolean image_wait(SpiceImageCache *cache, WaitImageData *wait)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+    GCoroutineWaiter *waiter;
+    gboolean ready;
+
+    if (wait_image(wait))
+        return TRUE;
+
+    waiter = g_coroutine_waiter_new(wait_image, wait, wait->id);
+    cache_add_waiter(c->images, waiter);
+    ready = g_coroutine_waiter_wait(g_coroutine_self(), waiter);
+    cache_remove_waiter(c->images, waiter);
+    g_coroutine_waiter_unref(waiter);
+
+    return ready;
+}
+
+static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+    WaitImageData wait = {
+        .lossy = TRUE,
+        .cache = cache,
+        .id = id,
+        .image = NULL
+    };
+    if (!image_wait(cache, &wait))
+        SPICE_DEBUG("wait image got cancelled");
+    if (wait.image_lossy)
+        c->lossy_image_draws++;
+
+    return wait.image;
+}
+
+static void palette_put(SpicePaletteCache *cache, SpicePalette *palette)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, palette_cache);
+    guint i = palette->unique % PALETTE_SLOTS;
+    gsize size = sizeof(SpicePalette) + palette->num_ents * sizeof(palette->ents[0]);
+
+    gboolean in_slot = (c->palette_slots_used & (G_GUINT64_CONSTANT(1) << i)) &&
+        c->palette_slots[i].palette.unique == palette->unique;
+
+    /* a palette id is in one place only, or the older one is found */
+    if (palette->num_ents <= PALETTE_MAX_ENTS &&
+        (!(c->palette_slots_used & (G_GUINT64_CONSTANT(1) << i)) || in_slot)) {
+        memcpy(&c->palette_slots[i], palette, size);
+        c->palette_slots_used |= G_GUINT64_CONSTANT(1) << i;
+        cache_remove(c->palettes, palette->unique);
+        return;
+    }
+
+    if (in_slot)
+        c->palette_slots_used &= ~(G_GUINT64_CONSTANT(1) << i);
+    cache_add(c->palettes, palette->unique, g_memdup(palette, size));
+}
+
+static SpicePalette *palette_get(SpicePaletteCache *cache, uint64_t id)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, palette_cache);
+    guint i = id % PALETTE_SLOTS;
+
+    /* here the returned pointer is weak, no ref given to caller.  it
+     * seems spice canvas usage is exclusively temporary, so it's ok.
+     * palette_release is a noop. */
+    if ((c->palette_slots_used & (G_GUINT64_CONSTANT(1) << i)) &&
+        c->palette_slots[i].palette.unique == id)
+        return &c->palette_slots[i].palette;
+
+    return cache_find(c->palettes, id);
+}
+
+static void palette_remove(SpicePaletteCache *cache, uint64_t id)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, palette_cache);
+    guint i = id % PALETTE_SLOTS;
+
+    if ((c->palette_slots_used & (G_GUINT64_CONSTANT(1) << i)) &&
+        c->palette_slots[i].palette.unique == id) {
+        c->palette_slots_used &= ~(G_GUINT64_CONSTANT(1) << i);
+        return;
+    }
+
+    cache_remove(c->palettes, id);
+}
+
+static void palette_clear(SpiceDisplayChannelPrivate *c)
+{
+    c->palette_slots_used = 0;
+    cache_clear(c->palettes);
+}
+
+static void palette_release(SpicePaletteCache *cache, SpicePalette *palette)
+{
+    /* there is no refcount of palette, see palette_get() */
+}
+
+static void image_put_lossy(SpiceImageCache *cache, uint64_t id,
+                            pixman_image_t *surface)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+
+#ifndef NDEBUG
+    g_warn_if_fail(cache_find(c->images, id) == NULL);
+#endif
+
+    cache_add_lossy(c->images, id, pixman_image_ref(surface), TRUE);
+}
+
+static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
+                                pixman_image_t *surface)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+
+    c->lossy_image_upgrades++;
+    image_put(cache, id, surface);
+}
+
+static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
+{
+    WaitImageData wait = {
+        .lossy = FALSE,
+        .cache = cache,
+        .id = id,
+        .image = NULL
+    };
+    if (!image_wait(cache, &wait))
+        SPICE_DEBUG("wait lossless got cancelled");
+
+    return wait.image;
+}
+
+static SpiceCanvas *surfaces_get(SpiceImageSurfaces *surfaces,
+                                 uint32_t surface_id)
+{
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(surfaces, SpiceDisplayChannelPrivate, image_surfaces);
+
+    display_surface *s =
+        find_surface(c, surface_id);
+
+    return s ? surface_get_canvas(c, s) : NULL;
+}
+
+static SpiceImageCacheOps image_cache_ops = {
+    .put = image_put,
+    .get = image_get,
+
+    .put_lossy = image_put_lossy,
+    .replace_lossy = image_replace_lossy,
+    .get_lossless = image_get_lossless,
 };
 
 static SpicePaletteCacheOps palette_cache_ops = {
@@ -590,6 +1516,7 @@ static void spice_display_channel_reset_capabilities(SpiceChannel *channel)
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_MONITORS_CONFIG);
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_COMPOSITE);
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_A8_SURFACE);
+    spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_PREF_COMPRESSION);
 #ifdef USE_LZ4
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_LZ4_COMPRESSION);
 #endif
@@ -598,11 +1525,9 @@ static void spice_display_channel_reset_capabilities(SpiceChannel *channel)
     }
 }
 
-static void destroy_surface(gpointer data)
+static void destroy_surface(SpiceDisplayChannelPrivate *c, display_surface *surface)
 {
-    display_surface *surface = data;
-
-    destroy_canvas(surface);
+    destroy_canvas(c, surface);
     g_slice_free(display_surface, surface);
 }
 
@@ -612,10 +1537,12 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
 
     c = channel->priv = SPICE_DISPLAY_CHANNEL_GET_PRIVATE(channel);
 
-    c->surfaces = g_hash_table_new_full(NULL, NULL, NULL, destroy_surface);
+    c->surfaces = g_ptr_array_new();
     c->image_cache.ops = &image_cache_ops;
     c->palette_cache.ops = &palette_cache_ops;
     c->image_surfaces.ops = &image_surfaces_ops;
+    g_queue_init(&c->deferred_draws);
+    pixman_region32_init(&c->damage);
 #if defined(G_OS_WIN32)
     c->dc = create_compatible_dc();
 #endif
@@ -627,59 +1554,225 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     } else {
         c->enable_adaptive_streaming = TRUE;
     }
+    c->threaded_decode = g_getenv("SPICE_DISABLE_THREADED_DECODE") == NULL;
+    c->decode_scale_denom = 1;
     spice_display_channel_reset_capabilities(SPICE_CHANNEL(channel));
 }
 
 /* ------------------------------------------------------------------ */
 
-static int create_canvas(SpiceChannel *channel, display_surface *surface)
+/*
+ * rows start on a cache line, the canvas and the widgets take any stride,
+ * but the X11 widget only shares the segment of a packed primary
+ */
+#define SURFACE_STRIDE_ALIGN 64
+
+static int surface_stride(int width)
 {
-    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    return (width * 4 + SURFACE_STRIDE_ALIGN - 1) & ~(SURFACE_STRIDE_ALIGN - 1);
+}
 
-    if (surface->primary) {
-        if (c->primary) {
-            if (c->primary->width == surface->width &&
-                c->primary->height == surface->height) {
-                CHANNEL_DEBUG(channel, "Reusing existing primary surface");
-                return 0;
-            }
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_HUGEPAGE)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-            g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
+/*
+ * Draws walk the surfaces by rows and by columns, in 4 KiB pages a 4K
+ * primary is 8000 TLB entries. Transparent huge pages cut that to 16.
+ */
+static void surface_advise_huge(gpointer data, gsize size)
+{
+    if (size >= HUGE_PAGE_SIZE)
+        madvise(data, size, MADV_HUGEPAGE);
+}
 
-            g_hash_table_remove(c->surfaces, GINT_TO_POINTER(c->primary->surface_id));
-        }
+/* zeroed, and aligned on a huge page so that all of it can be backed by some */
+static gboolean surface_pixels_map(display_surface *surface)
+{
+    gsize size = (surface->size + HUGE_PAGE_SIZE - 1) & ~(gsize)(HUGE_PAGE_SIZE - 1);
+    guint8 *map, *data;
 
-        CHANNEL_DEBUG(channel, "Create primary canvas");
-#if defined(WITH_X11) && defined(HAVE_SYS_SHM_H)
-        surface->shmid = shmget(IPC_PRIVATE, surface->size, IPC_CREAT | 0777);
-        if (surface->shmid >= 0) {
-            surface->data = shmat(surface->shmid, 0, 0);
-            if (surface->data == NULL) {
-                shmctl(surface->shmid, IPC_RMID, 0);
-                surface->shmid = -1;
-            }
-        }
-#else
-        surface->shmid = -1;
+    map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return FALSE;
+
+    data = (guint8 *)(((guintptr)map + HUGE_PAGE_SIZE - 1) & ~(guintptr)(HUGE_PAGE_SIZE - 1));
+    if (data > map)
+        munmap(map, data - map);
+    munmap(data + size, map + HUGE_PAGE_SIZE - data);
+    surface_advise_huge(data, size);
+
+    surface->data = data;
+    surface->alloc_size = size;
+    surface->mapped = true;
+    return TRUE;
+}
 #endif
-    } else {
-        surface->shmid = -1;
+
+/* the pixels of a surface not shared with the X server or a compositor */
+static void surface_pixels_alloc(display_surface *surface)
+{
+#ifdef HUGE_PAGE_SIZE
+    if (surface->size >= HUGE_PAGE_SIZE && surface_pixels_map(surface))
+        return;
+#endif
+    surface->data = g_malloc0(surface->size);
+    surface->alloc_size = surface->size;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/* the pages are zeroed lazily by the kernel, and can be shared */
+static gboolean primary_memfd_alloc(display_surface *surface)
+{
+    gpointer data;
+
+    surface->memfd = memfd_create("spice-primary", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (surface->memfd < 0)
+        goto failed;
+
+    if (ftruncate(surface->memfd, surface->alloc_size) < 0)
+        goto failed;
+
+#ifdef F_ADD_SEALS
+    /* a compositor mapping the surface must not see it shrink */
+    fcntl(surface->memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+#endif
+
+    data = mmap(NULL, surface->alloc_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                surface->memfd, 0);
+    if (data == MAP_FAILED)
+        goto failed;
+#ifdef HUGE_PAGE_SIZE
+    surface_advise_huge(data, surface->alloc_size);
+#endif
+
+    surface->data = data;
+    return TRUE;
+
+failed:
+    g_warning("failed to allocate the primary from a memfd: %s", g_strerror(errno));
+    if (surface->memfd >= 0)
+        close(surface->memfd);
+    surface->memfd = -1;
+    return FALSE;
+}
+#endif
+
+/*
+ * The primary allocation only grows: a mode that fits in it takes it
+ * over from the previous primary, and only the canvas is created again.
+ * The display keeps its image data, so PRIMARY_DESTROY is not emitted.
+ */
+static gboolean primary_rebind(display_surface *old, display_surface *surface)
+{
+    if (old->data == NULL || old->alloc_size < surface->size)
+        return FALSE;
+
+    surface->data = old->data;
+    surface->shmid = old->shmid;
+    surface->memfd = old->memfd;
+    surface->mapped = old->mapped;
+    surface->alloc_size = old->alloc_size;
+
+    /* destroy_canvas() leaves it alone now */
+    old->data = NULL;
+    old->shmid = -1;
+    old->memfd = -1;
+    old->mapped = false;
+
+    return TRUE;
+}
+
+/*
+ * Solid fills, the most common draw, are written straight to the
+ * surface with a kernel picked for its format when the canvas is
+ * created, rather than going through the region and rop handling of
+ * the canvas for each of them.
+ */
+#define FILL_RECT_KERNEL(name, pixel_t)                                 \
+static void name(display_surface *surface, const SpiceRect *rect,       \
+                 uint32_t color)                                        \
+{                                                                       \
+    int width = rect->right - rect->left;                               \
+    uint8_t *row = surface->data + rect->top * surface->stride +        \
+        rect->left * sizeof(pixel_t);                                   \
+    pixel_t pixel = color;                                              \
+    int x, y;                                                           \
+                                                                        \
+    for (y = rect->top; y < rect->bottom; y++) {                        \
+        pixel_t *p = (pixel_t *)row;                                    \
+        for (x = 0; x < width; x++)                                     \
+            p[x] = pixel;                                               \
+        row += surface->stride;                                         \
+    }                                                                   \
+}
+
+FILL_RECT_KERNEL(fill_rect_32, uint32_t)
+FILL_RECT_KERNEL(fill_rect_16, uint16_t)
+
+static display_fill_rect_func surface_fill_rect_func(enum SpiceSurfaceFmt format)
+{
+    switch (format) {
+    case SPICE_SURFACE_FMT_32_xRGB:
+    case SPICE_SURFACE_FMT_32_ARGB:
+        return fill_rect_32;
+    case SPICE_SURFACE_FMT_16_555:
+    case SPICE_SURFACE_FMT_16_565:
+        return fill_rect_16;
+    default:
+        return NULL;
     }
+}
 
-    if (surface->shmid == -1)
-        surface->data = g_malloc0(surface->size);
+/* the rect clipped to the box and the surface, FALSE if nothing is left */
+static gboolean fill_rect_clip(display_surface *surface, const SpiceRect *box,
+                               const SpiceRect *rect, SpiceRect *out)
+{
+    out->left = MAX(MAX(rect->left, box->left), 0);
+    out->top = MAX(MAX(rect->top, box->top), 0);
+    out->right = MIN(MIN(rect->right, box->right), surface->width);
+    out->bottom = MIN(MIN(rect->bottom, box->bottom), surface->height);
 
-    g_return_val_if_fail(c->glz_window, 0);
+    return out->left < out->right && out->top < out->bottom;
+}
 
-    g_warn_if_fail(surface->canvas == NULL);
-    g_warn_if_fail(surface->glz_decoder == NULL);
-    g_warn_if_fail(surface->zlib_decoder == NULL);
-    g_warn_if_fail(surface->jpeg_decoder == NULL);
+/* the fills the canvas would do with pixman_fill(), FALSE for the others */
+static gboolean draw_fill_solid(display_surface *surface, SpiceMsgDisplayDrawFill *op)
+{
+    SpiceFill *fill = &op->data;
+    SpiceClip *clip = &op->base.clip;
+    SpiceRect rect;
+    guint i;
 
-    surface->glz_decoder = glz_decoder_new(c->glz_window);
-    surface->zlib_decoder = zlib_decoder_new();
-    surface->jpeg_decoder = jpeg_decoder_new();
+    if (surface->fill_rect == NULL || fill->brush.type != SPICE_BRUSH_TYPE_SOLID ||
+        fill->rop_descriptor != SPICE_ROPD_OP_PUT || fill->mask.bitmap != NULL)
+        return FALSE;
+
+    switch (clip->type) {
+    case SPICE_CLIP_TYPE_NONE:
+        if (fill_rect_clip(surface, &op->base.box, &op->base.box, &rect))
+            surface->fill_rect(surface, &rect, fill->brush.u.color);
+        return TRUE;
+    case SPICE_CLIP_TYPE_RECTS:
+        /* overlapping rects are filled twice, with the same color */
+        for (i = 0; i < clip->rects->num_rects; i++) {
+            if (fill_rect_clip(surface, &op->base.box, &clip->rects->rects[i], &rect))
+                surface->fill_rect(surface, &rect, fill->brush.u.color);
+        }
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static gboolean surface_create_canvas(SpiceDisplayChannelPrivate *c,
+                                      display_surface *surface)
+{
+    g_return_val_if_fail(c->glz_decoder, FALSE);
+
+    g_warn_if_fail(surface->canvas == NULL);
 
+    surface->fill_rect = surface_fill_rect_func(surface->format);
     surface->canvas = canvas_create_for_data(surface->width,
                                              surface->height,
                                              surface->format,
@@ -688,16 +1781,104 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                                              &c->image_cache,
                                              &c->palette_cache,
                                              &c->image_surfaces,
-                                             surface->glz_decoder,
-                                             surface->jpeg_decoder,
-                                             surface->zlib_decoder);
+                                             c->glz_decoder,
+                                             c->jpeg_decoder,
+                                             c->zlib_decoder);
 
-    g_return_val_if_fail(surface->canvas != NULL, 0);
-    g_hash_table_insert(c->surfaces, GINT_TO_POINTER(surface->surface_id), surface);
+    g_return_val_if_fail(surface->canvas != NULL, FALSE);
+
+    return TRUE;
+}
+
+/* allocates the off-screen surfaces when they are first used */
+static SpiceCanvas *surface_get_canvas(SpiceDisplayChannelPrivate *c,
+                                       display_surface *surface)
+{
+    if (surface->canvas == NULL) {
+        if (surface->data == NULL) {
+            surface_pixels_alloc(surface);
+            c->surface_bytes += surface->alloc_size;
+        }
+        surface_create_canvas(c, surface);
+    }
+
+    return surface->canvas;
+}
+
+static int create_canvas(SpiceChannel *channel, display_surface *surface)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gboolean rebound = FALSE;
+
+    surface->memfd = -1;
+    surface->alloc_size = surface->size;
+
+    if (surface->primary) {
+        if (c->primary) {
+            if (c->primary->width == surface->width &&
+                c->primary->height == surface->height) {
+                CHANNEL_DEBUG(channel, "Reusing existing primary surface");
+                return 0;
+            }
+
+            /* even when the pixels are kept: the widget drops what it
+             * derived from the old primary, and takes the new one */
+            g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
+            rebound = primary_rebind(c->primary, surface);
+
+            set_surface(c, c->primary->surface_id, NULL);
+            c->primary = NULL;
+        }
+    }
+
+    if (rebound) {
+        CHANNEL_DEBUG(channel, "Rebind primary canvas, %d of %d bytes",
+                      surface->size, surface->alloc_size);
+    } else if (surface->primary) {
+        CHANNEL_DEBUG(channel, "Create primary canvas");
+#if defined(WITH_X11) && defined(HAVE_SYS_SHM_H)
+        surface->shmid = shmget(IPC_PRIVATE, surface->size, IPC_CREAT | 0777);
+        if (surface->shmid >= 0) {
+            surface->data = shmat(surface->shmid, 0, 0);
+            if (surface->data == NULL) {
+                shmctl(surface->shmid, IPC_RMID, 0);
+                surface->shmid = -1;
+            }
+#ifdef HUGE_PAGE_SIZE
+            else
+                surface_advise_huge(surface->data, surface->size);
+#endif
+        }
+#else
+        surface->shmid = -1;
+#ifdef HAVE_MEMFD_CREATE
+        primary_memfd_alloc(surface);
+#endif
+#endif
+    } else {
+        /* many are never drawn to, or destroyed right away: the pixels
+         * and the canvas are allocated by surface_get_canvas() */
+        surface->shmid = -1;
+        set_surface(c, surface->surface_id, surface);
+        return 0;
+    }
+
+    if (!rebound) {
+        if (surface->shmid == -1 && surface->memfd == -1)
+            surface_pixels_alloc(surface);
+        c->surface_bytes += surface->alloc_size;
+    }
+
+    if (!surface_create_canvas(c, surface))
+        return 0;
+    set_surface(c, surface->surface_id, surface);
 
     if (surface->primary) {
         g_warn_if_fail(c->primary == NULL);
         c->primary = surface;
+        c->primary_serial++;
+        export_damage_primary(c);
+        spice_session_primary_created(spice_channel_get_session(channel));
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_CREATE], 0,
                                 surface->format, surface->width, surface->height,
                                 surface->stride, surface->shmid, surface->data);
@@ -709,121 +1890,712 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
             config->width = surface->width;
             config->height = surface->height;
             g_coroutine_object_notify(G_OBJECT(channel), "monitors");
+            spice_session_update_caches(spice_channel_get_session(channel));
         }
     }
 
-    return 0;
+    return 0;
+}
+
+static void destroy_canvas(SpiceDisplayChannelPrivate *c, display_surface *surface)
+{
+    if (surface == NULL)
+        return;
+
+    if (surface->data != NULL)
+        c->surface_bytes -= surface->alloc_size;
+
+#ifdef HAVE_MEMFD_CREATE
+    if (surface->memfd != -1) {
+        munmap(surface->data, surface->alloc_size);
+        close(surface->memfd);
+        surface->memfd = -1;
+    } else
+#endif
+#ifdef HUGE_PAGE_SIZE
+    if (surface->mapped) {
+        munmap(surface->data, surface->alloc_size);
+        surface->mapped = false;
+    } else
+#endif
+    if (surface->shmid == -1) {
+        g_free(surface->data);
+    }
+#ifdef HAVE_SYS_SHM_H
+    else {
+        shmdt(surface->data);
+        shmctl(surface->shmid, IPC_RMID, 0);
+    }
+#endif
+    surface->shmid = -1;
+    surface->data = NULL;
+
+    if (surface->canvas != NULL) {
+        surface->canvas->ops->destroy(surface->canvas);
+        surface->canvas = NULL;
+    }
+}
+
+static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id)
+{
+    if (c->primary && c->primary->surface_id == surface_id)
+        return c->primary;
+
+    if (surface_id >= c->surfaces->len)
+        return NULL;
+
+    return g_ptr_array_index(c->surfaces, surface_id);
+}
+
+/* replaces the surface of @surface_id, destroying the previous one */
+static void set_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id,
+                        display_surface *surface)
+{
+    display_surface *old;
+
+    g_return_if_fail(surface_id < SURFACES_MAX);
+
+    if (surface_id >= c->surfaces->len) {
+        if (surface == NULL)
+            return;
+        g_ptr_array_set_size(c->surfaces, surface_id + 1);
+    }
+
+    old = g_ptr_array_index(c->surfaces, surface_id);
+    g_ptr_array_index(c->surfaces, surface_id) = surface;
+    if (old != NULL && old != surface)
+        destroy_surface(c, old);
+}
+
+/* main or coroutine context */
+static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_surface *surface;
+    guint i;
+
+    if (!keep_primary) {
+        c->primary = NULL;
+        pixman_region32_fini(&c->damage);
+        pixman_region32_init(&c->damage);
+        c->damage_wire_time = 0;
+        c->present_wire_time = 0;
+        g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
+    }
+
+    for (i = 0; i < c->surfaces->len; i++) {
+        surface = g_ptr_array_index(c->surfaces, i);
+        if (surface == NULL)
+            continue;
+
+        if (keep_primary && surface->primary) {
+            CHANNEL_DEBUG(channel, "keeping existing primary surface, migration or reset");
+            continue;
+        }
+
+        set_surface(c, i, NULL);
+    }
+}
+
+/* past that, the damage is reduced to its extents */
+#define DAMAGE_MAX_RECTS 32
+
+/*
+ * Emits @box clipped to the monitors of the primary surface it touches,
+ * each monitor widget only hears about its own area.
+ */
+/* main or coroutine context */
+static void emit_invalidate_monitors(SpiceChannel *channel,
+                                     const pixman_box32_t *box, gboolean queued)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    guint i;
+
+    for (i = 0; i < c->monitors->len; i++) {
+        SpiceDisplayMonitorConfig *mc = &g_array_index(c->monitors, SpiceDisplayMonitorConfig, i);
+        gint x1 = MAX(box->x1, (gint)mc->x);
+        gint y1 = MAX(box->y1, (gint)mc->y);
+        gint x2 = MIN(box->x2, (gint)(mc->x + mc->width));
+        gint y2 = MIN(box->y2, (gint)(mc->y + mc->height));
+        gchar id[16];
+        GQuark detail;
+
+        if (mc->surface_id != 0 || x1 >= x2 || y1 >= y2)
+            continue;
+
+        g_snprintf(id, sizeof(id), "%u", mc->id);
+        detail = g_quark_from_string(id);
+        /* the widget connects with the monitor id as the detail */
+        if (!g_signal_has_handler_pending(channel, signals[SPICE_DISPLAY_INVALIDATE_MONITOR],
+                                          detail, TRUE))
+            continue;
+        if (queued)
+            g_coroutine_signal_emit_queued(channel, signals[SPICE_DISPLAY_INVALIDATE_MONITOR],
+                                           detail, x1, y1, x2 - x1, y2 - y1);
+        else
+            g_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE_MONITOR],
+                          detail, x1, y1, x2 - x1, y2 - y1);
+    }
+}
+
+/* main or coroutine context */
+static void flush_damage(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    pixman_box32_t *boxes;
+    int i, n;
+
+    if (!pixman_region32_not_empty(&c->damage))
+        return;
+
+    if (c->exports != NULL)
+        export_damage(c, &c->damage);
+
+    boxes = pixman_region32_rectangles(&c->damage, &n);
+    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE_REGION], 0,
+                            boxes, n);
+    /* the handlers read the surface, which may only be more recent */
+    for (i = 0; i < n; i++) {
+        g_coroutine_signal_emit_queued(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                                       boxes[i].x1, boxes[i].y1,
+                                       boxes[i].x2 - boxes[i].x1,
+                                       boxes[i].y2 - boxes[i].y1);
+        emit_invalidate_monitors(channel, &boxes[i], TRUE);
+    }
+
+    pixman_region32_fini(&c->damage);
+    pixman_region32_init(&c->damage);
+
+    if (c->present_wire_time == 0)
+        c->present_wire_time = c->damage_wire_time;
+    c->damage_wire_time = 0;
+}
+
+/* main or coroutine context, see spice_display_handle_msg() */
+static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    if (c->damage_wire_time == 0)
+        c->damage_wire_time = spice_msg_in_wire_time(in);
+    pixman_region32_union_rect(&c->damage, &c->damage,
+                               bbox->left, bbox->top,
+                               bbox->right - bbox->left,
+                               bbox->bottom - bbox->top);
+
+    if (pixman_region32_n_rects(&c->damage) > DAMAGE_MAX_RECTS) {
+        pixman_box32_t extents = *pixman_region32_extents(&c->damage);
+
+        pixman_region32_reset(&c->damage, &extents);
+    }
+}
+
+/*
+ * Adaptive image compression
+ *
+ * With the adaptive compression policy of the session, the draws of
+ * compressed images are timed per pixel, for each codec, and the link
+ * is rated from its round-trip time and the bandwidth estimate of the
+ * session.
+ * Every few seconds, the compression that fits both is sent to the
+ * server, when it changed twice in a row. The checks stop while the
+ * channel draws no image, and start again with the next one.
+ */
+
+/* the policy is checked that often */
+#define COMPRESSION_CHECK_INTERVAL  5 /* s */
+/* smaller images say more about the message overhead than the codec */
+#define COMPRESSION_MIN_PIXELS      (64 * 64)
+/* a client decoding slower than that is slow */
+#define COMPRESSION_SLOW_NS         20.0 /* per pixel */
+/* a link faster than that, or with a shorter round-trip, is a LAN */
+#define COMPRESSION_LAN_RATE        (12 * 1000 * 1000) /* bytes/s */
+#define COMPRESSION_LAN_RTT_US      2000
+/* the other lossless draws after preferring LZ4, before giving up on it */
+#define COMPRESSION_REFUSED_DRAWS   16
+
+static int image_codec(const SpiceImage *image)
+{
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        return CODEC_QUIC;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+        return CODEC_LZ;
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        return CODEC_GLZ;
+    case SPICE_IMAGE_TYPE_JPEG:
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        return CODEC_JPEG;
+    case SPICE_IMAGE_TYPE_LZ4:
+        return CODEC_LZ4;
+    default:
+        return -1;
+    }
+}
+
+static gboolean compression_check(gpointer data);
+
+/* coroutine context, the draw of @image started at @start */
+static void record_draw_cost(SpiceChannel *channel, const SpiceImage *image,
+                             gint64 start)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    guint64 pixels;
+    gdouble ns;
+    int codec;
+
+    if (image == NULL)
+        return;
+
+    codec = image_codec(image);
+    pixels = (guint64)image->descriptor.width * image->descriptor.height;
+    if (codec < 0 || pixels < COMPRESSION_MIN_PIXELS)
+        return;
+
+    ns = (g_get_monotonic_time() - start) * 1000.0 / pixels;
+    c->codec_draws[codec]++;
+    if (c->codec_ns[codec] == 0)
+        c->codec_ns[codec] = ns;
+    else
+        c->codec_ns[codec] += (ns - c->codec_ns[codec]) / 8;
+
+    c->compression_samples++;
+    if (c->compression_check_id == 0)
+        c->compression_check_id = g_timeout_add_seconds(COMPRESSION_CHECK_INTERVAL,
+                                                        compression_check, channel);
+}
+
+/* main context */
+static gboolean compression_check(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceChannelStats *stats = &channel->priv->stats;
+    SpiceMsgcDisplayPreferredCompression msg;
+    SpiceImageCompression pref;
+    SpiceMsgOut *out;
+    guint64 bandwidth;
+    gdouble ns;
+    gboolean lan;
+
+    /* nothing new to look at, no need to wake up for it */
+    if (c->compression_samples == 0) {
+        c->compression_check_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+    c->compression_samples = 0;
+
+    bandwidth = spice_session_get_bandwidth(spice_channel_get_session(channel));
+    if (bandwidth == 0 && stats->rtt_us == 0)
+        return G_SOURCE_CONTINUE;
+    lan = (stats->rtt_us != 0 && stats->rtt_us < COMPRESSION_LAN_RTT_US) ||
+        bandwidth >= COMPRESSION_LAN_RATE;
+
+    /* the lossless codecs the server picks from, the first one seen */
+    ns = c->codec_ns[CODEC_GLZ];
+    if (ns == 0)
+        ns = c->codec_ns[CODEC_LZ];
+    if (ns == 0)
+        ns = c->codec_ns[CODEC_QUIC];
+    if (ns == 0)
+        ns = c->codec_ns[CODEC_LZ4];
+    if (ns == 0)
+        return G_SOURCE_CONTINUE;
+
+#ifdef USE_LZ4
+    /* a server without LZ4 picks another lossless codec */
+    if (c->compression_sent == SPICE_IMAGE_COMPRESSION_LZ4 && !c->lz4_refused &&
+        c->codec_draws[CODEC_LZ4] == 0 &&
+        c->codec_draws[CODEC_GLZ] + c->codec_draws[CODEC_LZ] +
+        c->codec_draws[CODEC_QUIC] >= COMPRESSION_REFUSED_DRAWS) {
+        CHANNEL_DEBUG(channel, "LZ4 compression refused by the server");
+        c->lz4_refused = TRUE;
+    }
+#endif
+
+    if (lan)
+        pref = ns > COMPRESSION_SLOW_NS ? SPICE_IMAGE_COMPRESSION_LZ :
+            SPICE_IMAGE_COMPRESSION_AUTO_LZ;
+    else
+        pref = ns > COMPRESSION_SLOW_NS ? SPICE_IMAGE_COMPRESSION_AUTO_GLZ :
+            SPICE_IMAGE_COMPRESSION_GLZ;
+#ifdef USE_LZ4
+    /* the cheapest to decode, straight into the surface */
+    if (lan && !c->lz4_refused)
+        pref = SPICE_IMAGE_COMPRESSION_LZ4;
+#endif
+
+    if (pref != c->compression_pending) {
+        c->compression_pending = pref;
+        return G_SOURCE_CONTINUE;
+    }
+    if (pref == c->compression_sent)
+        return G_SOURCE_CONTINUE;
+
+    CHANNEL_DEBUG(channel, "preferred compression %d: %.1f ns/pixel, %s, %" G_GUINT64_FORMAT
+                  " bytes/s, rtt %" G_GUINT64_FORMAT " us", pref, ns, lan ? "lan" : "wan",
+                  bandwidth, stats->rtt_us);
+    msg.image_compression = pref;
+    out = spice_msg_out_new(channel, SPICE_MSGC_DISPLAY_PREFERRED_COMPRESSION);
+    out->marshallers->msgc_display_preferred_compression(out->marshaller, &msg);
+    spice_msg_out_send(out);
+    c->compression_sent = pref;
+    memset(c->codec_draws, 0, sizeof(c->codec_draws));
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* ------------------------------------------------------------------ */
+
+/* coroutine context */
+static void spice_display_channel_up(SpiceChannel *channel)
+{
+    SpiceMsgOut *out;
+    SpiceSession *s = spice_channel_get_session(channel);
+    SpiceMsgcDisplayInit init;
+    int cache_size;
+    int glz_window_size;
+
+    spice_session_get_cache_limits(s, &cache_size, &glz_window_size);
+    CHANNEL_DEBUG(channel, "%s: cache_size %d, glz_window_size %d (bytes)", __FUNCTION__,
+                  cache_size, glz_window_size);
+    init.pixmap_cache_id = 1;
+    init.glz_dictionary_id = 1;
+    init.pixmap_cache_size = cache_size / 4; /* pixels */
+    init.glz_dictionary_window_size = glz_window_size / 4; /* pixels */
+    out = spice_msg_out_new(channel, SPICE_MSGC_DISPLAY_INIT);
+    out->marshallers->msgc_display_init(out->marshaller, &init);
+    spice_msg_out_send_internal(out);
+
+    if (spice_session_get_compression_policy(s) == SPICE_SESSION_COMPRESSION_POLICY_ADAPTIVE &&
+        spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_PREF_COMPRESSION)) {
+        SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+        c->compression_pending = c->compression_sent = SPICE_IMAGE_COMPRESSION_INVALID;
+        c->compression_adaptive = TRUE;
+        c->compression_samples = 0;
+        c->compression_check_id = g_timeout_add_seconds(COMPRESSION_CHECK_INTERVAL,
+                                                        compression_check, channel);
+    }
+
+    /* if we are not using monitors config, notify of existence of
+       this monitor */
+    if (channel->priv->channel_id != 0)
+        g_coroutine_object_notify(G_OBJECT(channel), "monitors");
+}
+
+/*
+ * Deferred draws
+ *
+ * A GLZ image may refer to an image decoded by another display channel,
+ * which may not have arrived yet. Rather than blocking the channel, the
+ * draw is queued until the image is there, and the following draws that
+ * do not depend on the queued ones are done meanwhile. A following draw
+ * depends on the queued ones if it overlaps one of them on the same
+ * surface, or if its images must be decoded in order: GLZ images, since
+ * decoding them releases older ones from the window, and cached images.
+ * The queued draws are done in order, and all of them before any other
+ * message.
+ */
+
+/* beyond, the channel waits as if the draws were not deferred */
+#define MAX_DEFERRED_DRAWS 64
+#define MAX_DRAW_IMAGES 3
+
+typedef struct deferred_draw {
+    SpiceMsgIn       *in;
+    spice_msg_handler handler;
+    guint32          surface_id;
+    SpiceRect        box;
+    SpiceImage       *images[MAX_DRAW_IMAGES];
+    int              n_images;
+} deferred_draw;
+
+static void deferred_draw_free(deferred_draw *draw)
+{
+    spice_msg_in_unref(draw->in);
+    g_slice_free(deferred_draw, draw);
+}
+
+/* returns TRUE if decoding @image would wait for a GLZ image */
+static gboolean image_missing(SpiceDisplayChannelPrivate *c, SpiceImage *image,
+                              guint64 *missing)
+{
+    SpiceChunks *chunks;
+
+    if (image == NULL || image->descriptor.type != SPICE_IMAGE_TYPE_GLZ_RGB)
+        return FALSE;
+
+    chunks = image->u.lz_rgb.data;
+    if (chunks->num_chunks == 0)
+        return FALSE;
+
+    return glz_decoder_window_missing(c->glz_window, chunks->chunk[0].data,
+                                      chunks->chunk[0].len, missing);
+}
+
+static gboolean deferred_draw_missing(SpiceDisplayChannelPrivate *c,
+                                      deferred_draw *draw, guint64 *missing)
+{
+    int i;
+
+    for (i = 0; i < draw->n_images; i++)
+        if (image_missing(c, draw->images[i], missing))
+            return TRUE;
+
+    return FALSE;
+}
+
+static gboolean overlaps_deferred_draws(SpiceDisplayChannelPrivate *c,
+                                        guint32 surface_id, const SpiceRect *box)
+{
+    GList *l;
+
+    for (l = c->deferred_draws.head; l != NULL; l = l->next) {
+        deferred_draw *draw = l->data;
+
+        if (draw->surface_id == surface_id &&
+            box->left < draw->box.right && draw->box.left < box->right &&
+            box->top < draw->box.bottom && draw->box.top < box->bottom)
+            return TRUE;
+    }
+
+    return FALSE;
 }
 
-static void destroy_canvas(display_surface *surface)
+static void replay_deferred_draws(SpiceChannel *channel, gboolean wait);
+
+/* main context */
+static gboolean deferred_draws_wakeup(gpointer data)
 {
-    if (surface == NULL)
-        return;
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
 
-    glz_decoder_destroy(surface->glz_decoder);
-    zlib_decoder_destroy(surface->zlib_decoder);
-    jpeg_decoder_destroy(surface->jpeg_decoder);
+    glz_decoder_window_remove_waiter(c->glz_window, c->deferred_waiter);
+    g_clear_pointer(&c->deferred_waiter, g_coroutine_waiter_unref);
 
-    if (surface->shmid == -1) {
-        g_free(surface->data);
+    /* otherwise, the channel is already doing them */
+    if (!c->replaying)
+        replay_deferred_draws(channel, FALSE);
+
+    return FALSE;
+}
+
+static gboolean glz_image_added(gpointer data)
+{
+    /* the waiter is only notified for its image */
+    return TRUE;
+}
+
+/*
+ * Does the deferred draws in order. Unless @wait, stops at the first draw
+ * that is still missing an image, and waits for it in the main context.
+ */
+static void replay_deferred_draws(SpiceChannel *channel, gboolean wait)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    deferred_draw *draw;
+    guint64 missing;
+
+    c->replaying = TRUE;
+    while ((draw = g_queue_peek_head(&c->deferred_draws)) != NULL) {
+        if (!wait && deferred_draw_missing(c, draw, &missing)) {
+            if (c->deferred_waiter == NULL) {
+                c->deferred_waiter = g_coroutine_waiter_new(glz_image_added, NULL, missing);
+                glz_decoder_window_add_waiter(c->glz_window, c->deferred_waiter);
+                g_coroutine_waiter_attach(c->deferred_waiter, deferred_draws_wakeup, channel);
+            }
+            break;
+        }
+
+        g_queue_pop_head(&c->deferred_draws);
+        draw->handler(channel, draw->in);
+        deferred_draw_free(draw);
     }
-#ifdef HAVE_SYS_SHM_H
-    else {
-        shmdt(surface->data);
-        shmctl(surface->shmid, IPC_RMID, 0);
+    c->replaying = FALSE;
+    flush_damage(channel);
+}
+
+static void clear_deferred_draws(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    deferred_draw *draw;
+
+    if (c->deferred_waiter != NULL) {
+        g_coroutine_waiter_detach(c->deferred_waiter);
+        glz_decoder_window_remove_waiter(c->glz_window, c->deferred_waiter);
+        g_clear_pointer(&c->deferred_waiter, g_coroutine_waiter_unref);
     }
-#endif
-    surface->shmid = -1;
-    surface->data = NULL;
 
-    surface->canvas->ops->destroy(surface->canvas);
-    surface->canvas = NULL;
+    while ((draw = g_queue_pop_head(&c->deferred_draws)) != NULL)
+        deferred_draw_free(draw);
 }
 
-static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id)
+/* coroutine context */
+static void flush_deferred_draws(SpiceChannel *channel)
 {
-    if (c->primary && c->primary->surface_id == surface_id)
-        return c->primary;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    if (g_queue_is_empty(&c->deferred_draws))
+        return;
 
-    return g_hash_table_lookup(c->surfaces, GINT_TO_POINTER(surface_id));
+    if (c->deferred_waiter != NULL) {
+        g_coroutine_waiter_detach(c->deferred_waiter);
+        glz_decoder_window_remove_waiter(c->glz_window, c->deferred_waiter);
+        g_clear_pointer(&c->deferred_waiter, g_coroutine_waiter_unref);
+    }
+    replay_deferred_draws(channel, TRUE);
 }
 
-/* main or coroutine context */
-static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
+/* coroutine context, returns TRUE if the draw is deferred */
+static gboolean defer_draw(SpiceChannel *channel, SpiceMsgIn *in,
+                           spice_msg_handler handler, SpiceMsgDisplayBase *base,
+                           SpiceImage **images, int n_images)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
-    GHashTableIter iter;
-    display_surface *surface;
+    gboolean ordered = FALSE, deferrable = TRUE, missing = FALSE;
+    deferred_draw *draw;
+    guint64 id;
+    int i;
 
-    if (!keep_primary) {
-        c->primary = NULL;
-        g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
-    }
+    g_return_val_if_fail(n_images <= MAX_DRAW_IMAGES, FALSE);
 
-    g_hash_table_iter_init(&iter, c->surfaces);
-    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&surface)) {
+    if (c->replaying)
+        return FALSE;
 
-        if (keep_primary && surface->primary) {
-            CHANNEL_DEBUG(channel, "keeping existing primary surface, migration or reset");
+    for (i = 0; i < n_images; i++) {
+        SpiceImage *image = images[i];
+
+        if (image == NULL)
             continue;
+
+        switch (image->descriptor.type) {
+        case SPICE_IMAGE_TYPE_GLZ_RGB:
+            ordered = TRUE;
+            missing |= image_missing(c, image, &id);
+            break;
+        case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        case SPICE_IMAGE_TYPE_FROM_CACHE:
+        case SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS:
+        case SPICE_IMAGE_TYPE_SURFACE:
+            ordered = TRUE;
+            deferrable = FALSE;
+            break;
+        default:
+            break;
+        }
+
+        /* another channel may be waiting for it in the cache */
+        if (image->descriptor.flags & (SPICE_IMAGE_FLAGS_CACHE_ME |
+                                       SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) {
+            ordered = TRUE;
+            deferrable = FALSE;
         }
+    }
 
-        g_hash_table_iter_remove(&iter);
+    if (g_queue_is_empty(&c->deferred_draws)) {
+        if (!missing || !deferrable)
+            return FALSE;
+    } else {
+        if (!ordered && !overlaps_deferred_draws(c, base->surface_id, &base->box))
+            return FALSE;
+        if (!deferrable || g_queue_get_length(&c->deferred_draws) >= MAX_DEFERRED_DRAWS) {
+            flush_deferred_draws(channel);
+            return FALSE;
+        }
     }
+
+    draw = g_slice_new(deferred_draw);
+    draw->in = in;
+    spice_msg_in_ref(in);
+    draw->handler = handler;
+    draw->surface_id = base->surface_id;
+    draw->box = base->box;
+    memcpy(draw->images, images, n_images * sizeof(SpiceImage *));
+    draw->n_images = n_images;
+    g_queue_push_tail(&c->deferred_draws, draw);
+
+    if (g_queue_get_length(&c->deferred_draws) == 1)
+        replay_deferred_draws(channel, FALSE);
+
+    return TRUE;
 }
 
-/* coroutine context */
-static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
+static gboolean is_draw_msg(int type)
 {
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                            bbox->left, bbox->top,
-                            bbox->right - bbox->left,
-                            bbox->bottom - bbox->top);
+    switch (type) {
+    case SPICE_MSG_DISPLAY_DRAW_FILL:
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_BLACKNESS:
+    case SPICE_MSG_DISPLAY_DRAW_WHITENESS:
+    case SPICE_MSG_DISPLAY_DRAW_INVERS:
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+    case SPICE_MSG_DISPLAY_DRAW_STROKE:
+    case SPICE_MSG_DISPLAY_DRAW_TEXT:
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_COMPOSITE:
+        return TRUE;
+    default:
+        return FALSE;
+    }
 }
 
-/* ------------------------------------------------------------------ */
-
 /* coroutine context */
-static void spice_display_channel_up(SpiceChannel *channel)
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg)
 {
-    SpiceMsgOut *out;
-    SpiceSession *s = spice_channel_get_session(channel);
-    SpiceMsgcDisplayInit init;
-    int cache_size;
-    int glz_window_size;
+    int type = spice_msg_in_type(msg);
 
-    g_object_get(s,
-                 "cache-size", &cache_size,
-                 "glz-window-size", &glz_window_size,
-                 NULL);
-    CHANNEL_DEBUG(channel, "%s: cache_size %d, glz_window_size %d (bytes)", __FUNCTION__,
-                  cache_size, glz_window_size);
-    init.pixmap_cache_id = 1;
-    init.glz_dictionary_id = 1;
-    init.pixmap_cache_size = cache_size / 4; /* pixels */
-    init.glz_dictionary_window_size = glz_window_size / 4; /* pixels */
-    out = spice_msg_out_new(channel, SPICE_MSGC_DISPLAY_INIT);
-    out->marshallers->msgc_display_init(out->marshaller, &init);
-    spice_msg_out_send_internal(out);
+    /* the deferred draws are done before any other display message */
+    if (type > SPICE_MSG_BASE_LAST && !is_draw_msg(type)) {
+        flush_deferred_draws(channel);
+        flush_damage(channel);
+    }
 
-    /* if we are not using monitors config, notify of existence of
-       this monitor */
-    if (channel->priv->channel_id != 0)
-        g_coroutine_object_notify(G_OBJECT(channel), "monitors");
+    SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->handle_msg(channel, msg);
+
+    /* the coroutine is about to wait for more */
+    if (!spice_channel_has_pending_input(channel))
+        flush_damage(channel);
 }
 
-#define DRAW(type) {                                                    \
-        display_surface *surface =                                      \
-            find_surface(SPICE_DISPLAY_CHANNEL(channel)->priv,          \
-                op->base.surface_id);                                   \
+#define BRUSH_IMAGE(brush) \
+    ((brush).type == SPICE_BRUSH_TYPE_PATTERN ? (brush).u.pattern.pat : NULL)
+
+/* fast, evaluated once the surface is known, is TRUE if it did the draw */
+#define DRAW_FAST(type, fast, ...) {                                    \
+        SpiceImage *images[] = { __VA_ARGS__ };                         \
+        SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv; \
+        display_surface *surface = find_surface(c, op->base.surface_id); \
+        SpiceCanvas *canvas;                                            \
         g_return_if_fail(surface != NULL);                              \
-        surface->canvas->ops->draw_##type(surface->canvas, &op->base.box, \
-                                          &op->base.clip, &op->data);   \
+        if (defer_draw(channel, in, display_handle_draw_##type,         \
+                       &op->base, images, G_N_ELEMENTS(images)))        \
+            return;                                                     \
+        canvas = surface_get_canvas(c, surface);                        \
+        g_return_if_fail(canvas != NULL);                               \
+        SPICE_TRACE2(draw_start, #type,                                 \
+                     images[0] ? images[0]->descriptor.type : -1);      \
+        if (!(fast)) {                                                  \
+            gint64 start = c->compression_adaptive ?                    \
+                g_get_monotonic_time() : 0;                             \
+            canvas->ops->draw_##type(canvas, &op->base.box,             \
+                                     &op->base.clip, &op->data);        \
+            if (start != 0)                                             \
+                record_draw_cost(channel, images[0], start);            \
+        }                                                               \
+        SPICE_TRACE1(draw_done, #type);                                 \
         if (surface->primary) {                                         \
-            emit_invalidate(channel, &op->base.box);                    \
+            emit_invalidate(channel, &op->base.box, in);                \
         }                                                               \
 }
 
+#define DRAW(type, ...) DRAW_FAST(type, FALSE, __VA_ARGS__)
+
 /* coroutine context */
 static void display_handle_mode(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -838,7 +2610,7 @@ static void display_handle_mode(SpiceChannel *channel, SpiceMsgIn *in)
         SPICE_SURFACE_FMT_32_xRGB : SPICE_SURFACE_FMT_16_555;
     surface->width   = mode->x_res;
     surface->height  = mode->y_res;
-    surface->stride  = surface->width * 4;
+    surface->stride  = surface_stride(surface->width);
     surface->size    = surface->height * surface->stride;
     surface->primary = true;
     create_canvas(channel, surface);
@@ -870,24 +2642,52 @@ static void display_handle_reset(SpiceChannel *channel, SpiceMsgIn *in)
     if (surface != NULL)
         surface->canvas->ops->clear(surface->canvas);
 
-    cache_clear(c->palettes);
+    palette_clear(c);
 
     c->mark = FALSE;
     g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
 }
 
+/*
+ * A vertical scroll of whole rows is a single move of contiguous
+ * memory, the canvas would move it row by row.
+ */
+static gboolean copy_bits_rows(display_surface *surface, SpiceMsgDisplayCopyBits *op)
+{
+    SpiceRect *box = &op->base.box;
+    int height = box->bottom - box->top;
+
+    if (op->base.clip.type != SPICE_CLIP_TYPE_NONE ||
+        box->left != 0 || box->right != surface->width || op->src_pos.x != 0)
+        return FALSE;
+
+    if (height <= 0 || box->top < 0 || box->bottom > surface->height ||
+        op->src_pos.y < 0 || op->src_pos.y + height > surface->height)
+        return FALSE;
+
+    memmove(surface->data + box->top * surface->stride,
+            surface->data + op->src_pos.y * surface->stride,
+            (gsize)height * surface->stride);
+
+    return TRUE;
+}
+
 /* coroutine context */
 static void display_handle_copy_bits(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayCopyBits *op = spice_msg_in_parsed(in);
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     display_surface *surface = find_surface(c, op->base.surface_id);
+    SpiceCanvas *canvas;
 
     g_return_if_fail(surface != NULL);
-    surface->canvas->ops->copy_bits(surface->canvas, &op->base.box,
-                                    &op->base.clip, &op->src_pos);
+    canvas = surface_get_canvas(c, surface);
+    g_return_if_fail(canvas != NULL);
+    if (!copy_bits_rows(surface, op))
+        canvas->ops->copy_bits(canvas, &op->base.box,
+                               &op->base.clip, &op->src_pos);
     if (surface->primary) {
-        emit_invalidate(channel, &op->base.box);
+        emit_invalidate(channel, &op->base.box, in);
     }
 }
 
@@ -925,91 +2725,365 @@ static void display_handle_inv_pixmap_all(SpiceChannel *channel, SpiceMsgIn *in)
 /* coroutine context */
 static void display_handle_inv_palette(SpiceChannel *channel, SpiceMsgIn *in)
 {
-    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
-    SpiceMsgDisplayInvalOne* op = spice_msg_in_parsed(in);
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayInvalOne* op = spice_msg_in_parsed(in);
+
+    palette_remove(&c->palette_cache, op->id);
+}
+
+/* coroutine context */
+static void display_handle_inv_palette_all(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    palette_clear(c);
+}
+
+/* ------------------------------------------------------------------ */
+
+/* the stream decoders, a backend is added here with its codec */
+static const stream_decoder *stream_decoders[] = {
+    &stream_mjpeg_decoder,
+};
+
+static const stream_decoder *stream_decoder_find(int codec_type)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(stream_decoders); i++) {
+        if (stream_decoders[i]->codec_type == codec_type)
+            return stream_decoders[i];
+    }
+
+    return NULL;
+}
+
+static void display_update_stream_region(display_stream *st)
+{
+    int i;
+
+    switch (st->clip->type) {
+    case SPICE_CLIP_TYPE_RECTS:
+        region_clear(&st->region);
+        for (i = 0; i < st->clip->rects->num_rects; i++) {
+            region_add(&st->region, &st->clip->rects->rects[i]);
+        }
+        st->have_region = true;
+        break;
+    case SPICE_CLIP_TYPE_NONE:
+    default:
+        st->have_region = false;
+        break;
+    }
+}
+
+/* coroutine context */
+static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayStreamCreate *op = spice_msg_in_parsed(in);
+    display_stream *st;
+
+    CHANNEL_DEBUG(channel, "%s: id %d", __FUNCTION__, op->id);
+
+    if (op->id >= c->nstreams) {
+        int n = c->nstreams;
+        if (!c->nstreams) {
+            c->nstreams = 1;
+        }
+        while (op->id >= c->nstreams) {
+            c->nstreams *= 2;
+        }
+        c->streams = realloc(c->streams, c->nstreams * sizeof(c->streams[0]));
+        memset(c->streams + n, 0, (c->nstreams - n) * sizeof(c->streams[0]));
+    }
+    g_return_if_fail(c->streams[op->id] == NULL);
+    c->streams[op->id] = g_new0(display_stream, 1);
+    st = c->streams[op->id];
+
+    st->msg_create = in;
+    spice_msg_in_ref(in);
+    st->clip = &op->clip;
+    st->codec = op->codec_type;
+    st->surface = find_surface(c, op->surface_id);
+    st->msgq = g_queue_new();
+    st->channel = channel;
+    st->stats_time = g_get_monotonic_time();
+    st->scale_denom = 1;
+
+    region_init(&st->region);
+    display_update_stream_region(st);
+
+    st->decoder = stream_decoder_find(st->codec);
+    if (st->decoder)
+        st->decoder->init(st);
+    else
+        SPICE_DEBUG("unsupported stream codec %d", st->codec);
+}
+
+/*
+ * Threaded decoding: each stream frame is handed to the channel
+ * decoding thread when it is received, along with a reference on its
+ * message. The thread never touches the message refcount, it only
+ * reads the compressed data and gives the frame back through the
+ * decoded_frames queue, where the main context collects it. A frame
+ * dropped before being decoded is only marked as cancelled, and is
+ * freed once it has been collected.
+ */
+
+/* decoding thread */
+static void display_decode_frame(gpointer data, gpointer user_data)
+{
+    display_frame *frame = data;
+    GAsyncQueue *decoded_frames = user_data;
+
+    if (!g_atomic_int_get(&frame->cancelled)) {
+        SPICE_TRACE1(frame_decode_start, frame->st->codec);
+        frame->out_frame = frame->st->decoder->decode(frame->st, frame->data, frame->size,
+                                                      frame->width, frame->height,
+                                                      frame->scale_denom, frame->back_compat,
+                                                      frame->out_frame,
+                                                      STREAM_SCALED(frame->width,
+                                                                    frame->scale_denom) * 4);
+        SPICE_TRACE1(frame_decode_done, frame->st->codec);
+    }
+
+    g_async_queue_push(decoded_frames, frame);
+}
+
+static void display_frame_free(display_frame *frame)
+{
+    spice_msg_in_unref(frame->in);
+    g_free(frame->out_frame);
+    g_slice_free(display_frame, frame);
+}
+
+/* main context */
+static void display_collect_frames(SpiceDisplayChannelPrivate *c,
+                                   display_frame *wait_frame,
+                                   display_stream *wait_stream)
+{
+    display_frame *frame;
+
+    if (c->decoded_frames == NULL)
+        return;
+
+    while (1) {
+        if ((wait_frame && !wait_frame->done) ||
+            (wait_stream && wait_stream->frames_in_flight > 0))
+            frame = g_async_queue_pop(c->decoded_frames);
+        else
+            frame = g_async_queue_try_pop(c->decoded_frames);
+        if (frame == NULL)
+            break;
+
+        frame->st->frames_in_flight--;
+        if (g_atomic_int_get(&frame->cancelled))
+            display_frame_free(frame);
+        else
+            frame->done = TRUE;
+    }
+}
+
+#define STREAM_MAX_DECODE_AHEAD 4
+
+/* any context */
+static gsize display_frame_size(display_frame *frame)
+{
+    return (gsize)STREAM_SCALED(frame->width, frame->scale_denom) *
+        STREAM_SCALED(frame->height, frame->scale_denom) * 4;
+}
+
+/* main or coroutine context */
+static int display_stream_scale_denom(display_stream *st)
+{
+    if (st->decoder == NULL || !st->decoder->scalable)
+        return 1;
+
+    return SPICE_DISPLAY_CHANNEL(st->channel)->priv->decode_scale_denom;
+}
+
+/* coroutine context */
+static void display_stream_submit_frame(display_stream *st, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    display_frame *frame;
+
+    if (st->decoder == NULL || st->decoder->decode == NULL ||
+        display_stream_skip_hidden(st))
+        return;
+
+    /* bound the decoded frames waiting for display, the others are
+     * decoded when due */
+    if (st->frames && g_hash_table_size(st->frames) >= STREAM_MAX_DECODE_AHEAD)
+        return;
+
+    if (c->decode_pool == NULL) {
+        GError *error = NULL;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+        if (!g_thread_get_initialized()) {
+            g_warning("threads are not initialized, can't decode in a thread");
+            c->threaded_decode = FALSE;
+            return;
+        }
+#endif
+        c->decoded_frames = g_async_queue_new();
+        c->decode_pool = g_thread_pool_new(display_decode_frame, c->decoded_frames,
+                                           1, TRUE, &error);
+        if (error != NULL) {
+            g_warning("failed to create the decoding thread: %s", error->message);
+            g_clear_error(&error);
+            g_async_queue_unref(c->decoded_frames);
+            c->decoded_frames = NULL;
+            c->threaded_decode = FALSE;
+            return;
+        }
+    }
+
+    if (st->frames == NULL)
+        st->frames = g_hash_table_new(NULL, NULL);
+
+    frame = g_slice_new0(display_frame);
+    frame->st = st;
+    frame->in = in;
+    spice_msg_in_ref(in);
+
+    st->msg_data = in;
+    stream_get_dimensions(st, &frame->width, &frame->height);
+    frame->size = stream_get_current_frame(st, &frame->data);
+    st->msg_data = NULL;
+    frame->back_compat = st->channel->priv->peer_hdr.major_version == 1;
+    frame->scale_denom = display_stream_scale_denom(st);
+
+    /* recycle the frame that was last displayed */
+    if (st->spare_frame != NULL &&
+        st->spare_frame_size == display_frame_size(frame)) {
+        frame->out_frame = st->spare_frame;
+        st->spare_frame = NULL;
+    }
+
+    g_hash_table_insert(st->frames, in, frame);
+    st->frames_in_flight++;
+    g_thread_pool_push(c->decode_pool, frame, NULL);
+
+    /* release the frames that were dropped in the meantime */
+    display_collect_frames(c, NULL, NULL);
+}
+
+/* main context */
+static void display_stream_decode(display_stream *st)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    display_frame *frame = NULL;
+
+    if (st->frames)
+        frame = g_hash_table_lookup(st->frames, st->msg_data);
+
+    if (frame) {
+        display_collect_frames(c, frame, NULL);
+        g_free(st->spare_frame);
+        st->spare_frame = st->out_frame;
+        st->spare_frame_size = st->out_frame_size;
+        st->out_frame = frame->out_frame;
+        st->out_frame_size = display_frame_size(frame);
+        st->scale_denom = frame->scale_denom;
+        frame->out_frame = NULL;
+        return;
+    }
 
-    palette_remove(&c->palette_cache, op->id);
+    /* the decoder state is used by the thread for the pending frames */
+    display_collect_frames(c, NULL, st);
+
+    st->scale_denom = display_stream_scale_denom(st);
+    if (st->decoder)
+        st->decoder->data(st);
 }
 
-/* coroutine context */
-static void display_handle_inv_palette_all(SpiceChannel *channel, SpiceMsgIn *in)
+/*
+ * Decodes the current frame straight into the surface, when it covers
+ * an unclipped rectangle of it at its own size. This saves a frame
+ * sized buffer and a copy per frame.
+ */
+/* main context */
+static gboolean display_stream_decode_direct(display_stream *st)
 {
-    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    display_surface *surface = st->surface;
+    SpiceRect *dest;
+    int width;
+    int height;
+
+    if (st->decoder == NULL || st->decoder->data_direct == NULL || st->have_region ||
+        !(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN) ||
+        display_stream_scale_denom(st) != 1)
+        return FALSE;
 
-    cache_clear(c->palettes);
-}
+    /* already being decoded by the thread */
+    if (st->frames && g_hash_table_lookup(st->frames, st->msg_data))
+        return FALSE;
 
-/* ------------------------------------------------------------------ */
+    if (surface->format != SPICE_SURFACE_FMT_32_xRGB ||
+        surface->data == NULL || surface->stride <= 0)
+        return FALSE;
 
-static void display_update_stream_region(display_stream *st)
-{
-    int i;
+    stream_get_dimensions(st, &width, &height);
+    dest = stream_get_dest(st);
+    if (dest->right - dest->left != width || dest->bottom - dest->top != height ||
+        dest->left < 0 || dest->top < 0 ||
+        dest->right > surface->width || dest->bottom > surface->height)
+        return FALSE;
 
-    switch (st->clip->type) {
-    case SPICE_CLIP_TYPE_RECTS:
-        region_clear(&st->region);
-        for (i = 0; i < st->clip->rects->num_rects; i++) {
-            region_add(&st->region, &st->clip->rects->rects[i]);
-        }
-        st->have_region = true;
-        break;
-    case SPICE_CLIP_TYPE_NONE:
-    default:
-        st->have_region = false;
-        break;
-    }
+    /* the decoder state is used by the thread for the pending frames */
+    display_collect_frames(c, NULL, st);
+
+    return st->decoder->data_direct(st,
+                                    surface->data + dest->top * surface->stride +
+                                    dest->left * 4,
+                                    surface->stride);
 }
 
-/* coroutine context */
-static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
+/* main or coroutine context */
+static void display_stream_release_msg(display_stream *st, SpiceMsgIn *in)
 {
-    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
-    SpiceMsgDisplayStreamCreate *op = spice_msg_in_parsed(in);
-    display_stream *st;
+    display_frame *frame = NULL;
 
-    CHANNEL_DEBUG(channel, "%s: id %d", __FUNCTION__, op->id);
+    if (st->frames)
+        frame = g_hash_table_lookup(st->frames, in);
 
-    if (op->id >= c->nstreams) {
-        int n = c->nstreams;
-        if (!c->nstreams) {
-            c->nstreams = 1;
-        }
-        while (op->id >= c->nstreams) {
-            c->nstreams *= 2;
-        }
-        c->streams = realloc(c->streams, c->nstreams * sizeof(c->streams[0]));
-        memset(c->streams + n, 0, (c->nstreams - n) * sizeof(c->streams[0]));
+    if (frame) {
+        g_hash_table_remove(st->frames, in);
+        if (frame->done)
+            display_frame_free(frame);
+        else
+            g_atomic_int_set(&frame->cancelled, TRUE);
     }
-    g_return_if_fail(c->streams[op->id] == NULL);
-    c->streams[op->id] = g_new0(display_stream, 1);
-    st = c->streams[op->id];
-
-    st->msg_create = in;
-    spice_msg_in_ref(in);
-    st->clip = &op->clip;
-    st->codec = op->codec_type;
-    st->surface = find_surface(c, op->surface_id);
-    st->msgq = g_queue_new();
-    st->channel = channel;
-    st->drops_seqs_stats_arr = g_array_new(FALSE, FALSE, sizeof(drops_sequence_stats));
 
-    region_init(&st->region);
-    display_update_stream_region(st);
+    spice_msg_in_unref(in);
+}
 
-    switch (st->codec) {
-    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-        stream_mjpeg_init(st);
-        break;
-    }
+static void display_stream_release_msg_func(gpointer data, gpointer user_data)
+{
+    display_stream_release_msg(user_data, data);
 }
 
 /* coroutine or main context */
+/*
+ * Playout: the head frame is rendered at its multimedia time, ahead by
+ * the average decoding time so that it is shown on time. A late frame
+ * is still rendered, unless the next queued frame is due as well and
+ * supersedes it: frames are only dropped when the queue runs behind,
+ * not because of the jitter of a single frame.
+ *
+ * Returns FALSE if a frame was dropped and the next one is to be
+ * rendered right away.
+ */
 static gboolean display_stream_schedule(display_stream *st)
 {
     SpiceSession *session = spice_channel_get_session(st->channel);
-    guint32 time, d;
+    guint32 time, lead, d;
     SpiceStreamDataHeader *op;
-    SpiceMsgIn *in;
+    SpiceMsgIn *in, *next;
 
     SPICE_DEBUG("%s", __FUNCTION__);
     if (st->timeout || !session)
@@ -1023,22 +3097,36 @@ static gboolean display_stream_schedule(display_stream *st)
     }
 
     op = spice_msg_in_parsed(in);
-    if (time < op->multi_media_time) {
-        d = op->multi_media_time - time;
+    lead = (st->decode_time + st->av_lead) / 1000;
+    if (time + lead < op->multi_media_time) {
+        d = op->multi_media_time - time - lead;
         SPICE_DEBUG("scheduling next stream render in %u ms", d);
         st->timeout = g_timeout_add(d, (GSourceFunc)display_stream_render, st);
         return TRUE;
-    } else {
-        SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
-                    __FUNCTION__, time - op->multi_media_time,
-                    op->multi_media_time, time);
-        in = g_queue_pop_head(st->msgq);
-        spice_msg_in_unref(in);
-        st->num_drops_on_playback++;
-        if (g_queue_get_length(st->msgq) == 0)
-            return TRUE;
     }
 
+    /* a frame that is only late by the clock uncertainty is still shown */
+    next = g_queue_peek_nth(st->msgq, 1);
+    if (next == NULL ||
+        time < ((SpiceStreamDataHeader *)spice_msg_in_parsed(next))->multi_media_time +
+               spice_session_get_mm_time_error(session)) {
+        if (time > op->multi_media_time)
+            SPICE_DEBUG("%s: rendering late by %u ms (ts: %u, mmtime: %u)",
+                        __FUNCTION__, time - op->multi_media_time,
+                        op->multi_media_time, time);
+        st->timeout = g_timeout_add(0, (GSourceFunc)display_stream_render, st);
+        return TRUE;
+    }
+
+    SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
+                __FUNCTION__, time - op->multi_media_time,
+                op->multi_media_time, time);
+    in = g_queue_pop_head(st->msgq);
+    display_stream_release_msg(st, in);
+    st->num_drops_on_playback++;
+    if (st->report_is_active)
+        st->report_num_playback_drops++;
+
     return FALSE;
 }
 
@@ -1108,7 +3196,150 @@ void stream_get_dimensions(display_stream *st, int *width, int *height)
    }
 }
 
+/* returns the visible part of @dest, in @visible */
+static void display_stream_visible_region(display_stream *st, SpiceRect *dest,
+                                          pixman_region32_t *visible)
+{
+    pixman_region32_init_rect(visible, dest->left, dest->top,
+                              dest->right - dest->left,
+                              dest->bottom - dest->top);
+    if (st->have_region)
+        pixman_region32_intersect(visible, visible, &st->region);
+}
+
+/* main context */
+static void display_stream_invalidate(display_stream *st, pixman_region32_t *visible)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    pixman_box32_t *boxes;
+    int i, n;
+
+    if (!st->surface->primary)
+        return;
+
+    if (c->present_wire_time == 0)
+        c->present_wire_time = spice_msg_in_wire_time(st->msg_data);
+    if (c->exports != NULL)
+        export_damage(c, visible);
+    boxes = pixman_region32_rectangles(visible, &n);
+    for (i = 0; i < n; i++) {
+        g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                      boxes[i].x1, boxes[i].y1,
+                      boxes[i].x2 - boxes[i].x1,
+                      boxes[i].y2 - boxes[i].y1);
+        emit_invalidate_monitors(st->channel, &boxes[i], FALSE);
+    }
+}
+
+/* main or coroutine context */
+static gboolean display_stream_skip_hidden(display_stream *st)
+{
+    return SPICE_DISPLAY_CHANNEL(st->channel)->priv->views_hidden &&
+        st->decoder && st->decoder->independent_frames;
+}
+
 /* main context */
+static void display_stream_render_frame(display_stream *st)
+{
+    pixman_region32_t visible;
+    SpiceRect *dest = stream_get_dest(st);
+    gboolean direct;
+    gint64 start;
+
+    display_stream_visible_region(st, dest, &visible);
+
+    if (surface_get_canvas(SPICE_DISPLAY_CHANNEL(st->channel)->priv, st->surface) == NULL) {
+        pixman_region32_fini(&visible);
+        return;
+    }
+
+    /* the frames of the other codecs may be needed to decode the next ones */
+    if (!pixman_region32_not_empty(&visible) && st->decoder &&
+        st->decoder->independent_frames) {
+        pixman_region32_fini(&visible);
+        return;
+    }
+
+    if (display_stream_skip_hidden(st)) {
+        spice_msg_in_ref(st->msg_data);
+        if (st->msg_skipped)
+            spice_msg_in_unref(st->msg_skipped);
+        st->msg_skipped = st->msg_data;
+        pixman_region32_fini(&visible);
+        return;
+    }
+
+    start = g_get_monotonic_time();
+    SPICE_TRACE1(frame_decode_start, st->codec);
+    direct = display_stream_decode_direct(st);
+    if (!direct)
+        display_stream_decode(st);
+    SPICE_TRACE1(frame_decode_done, st->codec);
+    /* including the wait for the decoding thread */
+    st->decode_time += (g_get_monotonic_time() - start - st->decode_time) / 8;
+
+    if (!direct && st->out_frame && pixman_region32_not_empty(&visible)) {
+        int width;
+        int height;
+        uint8_t *data;
+        int stride;
+
+        stream_get_dimensions(st, &width, &height);
+        /* the canvas scales it back to the destination */
+        width = STREAM_SCALED(width, st->scale_denom);
+        height = STREAM_SCALED(height, st->scale_denom);
+
+        data = st->out_frame;
+        stride = width * sizeof(uint32_t);
+        if (!(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN)) {
+            data += stride * (height - 1);
+            stride = -stride;
+        }
+
+        st->surface->canvas->ops->put_image(
+            st->surface->canvas,
+#ifdef G_OS_WIN32
+            SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
+#endif
+            dest, data,
+            width, height, stride,
+            st->have_region ? &st->region : NULL);
+    }
+
+    if (direct || st->out_frame) {
+        SPICE_TRACE1(frame_present, st->codec);
+        display_stream_invalidate(st, &visible);
+    }
+
+    pixman_region32_fini(&visible);
+}
+
+/* main context */
+/*
+ * The frames are rendered when the session mm-time, which follows the
+ * audio playback delay, reaches theirs. What is left, the main loop
+ * delays, is measured and taken into account on the next frames.
+ */
+#define STREAM_AV_LEAD_MAX_US (50 * 1000)
+
+static void display_stream_update_av_sync(display_stream *st, SpiceMsgIn *in)
+{
+    SpiceSession *session = spice_channel_get_session(st->channel);
+    SpiceStreamDataHeader *op = spice_msg_in_parsed(in);
+    gint32 offset;
+
+    if (!session)
+        return;
+
+    offset = spice_session_get_mm_time(session) - op->multi_media_time;
+    /* a frame that was late already is not a scheduling error */
+    if (offset > 100 || offset < -100)
+        return;
+
+    st->av_offset += (offset * 16 - st->av_offset) / 16;
+    st->av_lead = CLAMP(st->av_lead + offset * 1000 / 16, 0, STREAM_AV_LEAD_MAX_US);
+}
+
 static gboolean display_stream_render(display_stream *st)
 {
     SpiceMsgIn *in;
@@ -1119,48 +3350,12 @@ static gboolean display_stream_render(display_stream *st)
 
         g_return_val_if_fail(in != NULL, FALSE);
 
+        display_stream_update_av_sync(st, in);
         st->msg_data = in;
-        switch (st->codec) {
-        case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-            stream_mjpeg_data(st);
-            break;
-        }
-
-        if (st->out_frame) {
-            int width;
-            int height;
-            SpiceRect *dest;
-            uint8_t *data;
-            int stride;
-
-            stream_get_dimensions(st, &width, &height);
-            dest = stream_get_dest(st);
-
-            data = st->out_frame;
-            stride = width * sizeof(uint32_t);
-            if (!(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN)) {
-                data += stride * (height - 1);
-                stride = -stride;
-            }
-
-            st->surface->canvas->ops->put_image(
-                st->surface->canvas,
-#ifdef G_OS_WIN32
-                SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
-#endif
-                dest, data,
-                width, height, stride,
-                st->have_region ? &st->region : NULL);
-
-            if (st->surface->primary)
-                g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                    dest->left, dest->top,
-                    dest->right - dest->left,
-                    dest->bottom - dest->top);
-        }
+        display_stream_render_frame(st);
 
         st->msg_data = NULL;
-        spice_msg_in_unref(in);
+        display_stream_release_msg(st, in);
 
         in = g_queue_peek_head(st->msgq);
         if (in == NULL)
@@ -1176,6 +3371,15 @@ static gboolean display_stream_render(display_stream *st)
  * if the report window is bigger */
 #define STREAM_REPORT_DROP_SEQ_LEN_LIMIT 3
 
+/*
+ * The report has no field for the load of the client, the server only
+ * adapts to the drops and to the delay of the last frame. So the drops
+ * on playback, of frames that arrived in time but could not be decoded
+ * in time, are counted with the others, and the delay is what is left
+ * once the frames queued before it are decoded too: with a client too
+ * slow to decode, it gets negative while the network is fine.
+ */
+
 static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t stream_id,
                                          uint32_t frame_time, int32_t latency)
 {
@@ -1206,20 +3410,28 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
         SpiceMsgcDisplayStreamReport report;
         SpiceSession *session = spice_channel_get_session(SPICE_CHANNEL(channel));
         SpiceMsgOut *msg;
+        guint queued = MAX(g_queue_get_length(st->msgq), 1);
 
         report.stream_id = stream_id;
         report.unique_id = st->report_id;
         report.start_frame_mm_time = st->report_start_frame_time;
         report.end_frame_mm_time = frame_time;
+
         report.num_frames = st->report_num_frames;
-        report.num_drops = st-> report_num_drops;
-        report.last_frame_delay = latency;
+        report.num_drops = MIN(st->report_num_drops + st->report_num_playback_drops,
+                               st->report_num_frames);
+        /* the margin left once the frame, and the ones before, are decoded */
+        report.last_frame_delay = latency - queued * st->decode_time / 1000;
         if (spice_session_is_playback_active(session)) {
             report.audio_delay = spice_session_get_playback_latency(session);
         } else {
             report.audio_delay = UINT_MAX;
         }
 
+        CHANNEL_DEBUG(channel, "stream %u report: %u frames, drops %u on receive, "
+                      "%u on playback, decode %" G_GINT64_FORMAT "us, %u queued",
+                      stream_id, st->report_num_frames, st->report_num_drops,
+                      st->report_num_playback_drops, st->decode_time, queued);
         msg = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_DISPLAY_STREAM_REPORT);
         msg->marshallers->msgc_display_stream_report(msg->marshaller, &report);
         spice_msg_out_send(msg);
@@ -1228,10 +3440,120 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
         st->report_start_frame_time = 0;
         st->report_num_frames = 0;
         st->report_num_drops = 0;
+        st->report_num_playback_drops = 0;
         st->report_drops_seq_len = 0;
     }
 }
 
+G_DEFINE_BOXED_TYPE(SpiceDisplayStreamStats, spice_display_stream_stats,
+                    spice_display_stream_stats_copy, spice_display_stream_stats_free)
+
+/**
+ * spice_display_stream_stats_copy:
+ * @stats: a #SpiceDisplayStreamStats
+ *
+ * Returns: (transfer full): a copy of @stats, to be freed with
+ * spice_display_stream_stats_free()
+ * Since: 0.29
+ **/
+SpiceDisplayStreamStats *spice_display_stream_stats_copy(const SpiceDisplayStreamStats *stats)
+{
+    g_return_val_if_fail(stats != NULL, NULL);
+
+    return g_slice_dup(SpiceDisplayStreamStats, stats);
+}
+
+/**
+ * spice_display_stream_stats_free:
+ * @stats: a #SpiceDisplayStreamStats
+ *
+ * Free @stats.
+ *
+ * Since: 0.29
+ **/
+void spice_display_stream_stats_free(SpiceDisplayStreamStats *stats)
+{
+    g_slice_free(SpiceDisplayStreamStats, stats);
+}
+
+static guint32 display_stream_out_frames(display_stream *st)
+{
+    return st->num_input_frames - st->num_drops_on_receive - st->num_drops_on_playback;
+}
+
+static void display_stream_get_stats(display_stream *st, guint id,
+                                     SpiceDisplayStreamStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->id = id;
+    stats->codec = st->codec;
+    stats->num_frames = st->num_input_frames;
+    stats->num_drops_on_receive = st->num_drops_on_receive;
+    stats->num_drops_on_playback = st->num_drops_on_playback;
+    stats->late_time_ms = st->num_drops_on_receive ?
+        st->arrive_late_time / st->num_drops_on_receive : 0;
+    stats->fps = st->fps;
+    stats->decode_time_us = st->decode_time;
+    stats->jitter_ms = st->jitter >> 4;
+    stats->num_drops_seqs = st->num_drops_seqs;
+}
+
+#define STREAM_STATS_INTERVAL G_USEC_PER_SEC
+
+/* coroutine context */
+static void display_stream_update_stats(SpiceDisplayChannel *channel, guint id)
+{
+    display_stream *st = channel->priv->streams[id];
+    SpiceDisplayStreamStats stats;
+    gint64 now = g_get_monotonic_time();
+    guint32 out_frames;
+
+    if (now - st->stats_time < STREAM_STATS_INTERVAL)
+        return;
+
+    out_frames = display_stream_out_frames(st);
+    st->fps = (out_frames - st->stats_out_frames) * (gdouble)G_USEC_PER_SEC /
+        (now - st->stats_time);
+    st->stats_out_frames = out_frames;
+    st->stats_time = now;
+
+    if (!g_signal_has_handler_pending(channel, signals[SPICE_DISPLAY_STREAM_STATS], 0, FALSE))
+        return;
+
+    display_stream_get_stats(st, id, &stats);
+    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_STREAM_STATS], 0, &stats);
+}
+
+/**
+ * spice_display_get_stream_stats:
+ * @channel: a #SpiceDisplayChannel
+ * @stream_id: the id of a video stream, as in the
+ * #SpiceDisplayChannel::display-stream-stats signal
+ *
+ * Retrieves the current statistics of a video stream of @channel.
+ *
+ * Returns: (transfer full): a new #SpiceDisplayStreamStats, to be freed
+ * with spice_display_stream_stats_free(), or %NULL if there is no such
+ * stream
+ * Since: 0.29
+ **/
+SpiceDisplayStreamStats *spice_display_get_stream_stats(SpiceChannel *channel,
+                                                        guint stream_id)
+{
+    SpiceDisplayChannelPrivate *c;
+    SpiceDisplayStreamStats stats;
+
+    g_return_val_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel), NULL);
+
+    c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    if (stream_id >= c->nstreams || c->streams[stream_id] == NULL)
+        return NULL;
+
+    display_stream_get_stats(c->streams[stream_id], stream_id, &stats);
+
+    return spice_display_stream_stats_copy(&stats);
+}
+
 static void display_stream_reset_rendering_timer(display_stream *st)
 {
     SPICE_DEBUG("%s", __FUNCTION__);
@@ -1320,13 +3642,35 @@ static void display_stream_test_frames_mm_time_reset(display_stream *st,
                     new_op->multi_media_time,
                     tail_op->multi_media_time,
                     new_op->id);
-        g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
+        g_queue_foreach(st->msgq, display_stream_release_msg_func, st);
         g_queue_clear(st->msgq);
         display_stream_reset_rendering_timer(st);
     }
 }
 
 #define STREAM_PLAYBACK_SYNC_DROP_SEQ_LEN_LIMIT 5
+/* of the late frames still queued, in ms */
+#define STREAM_LATE_TOLERANCE_MIN 5
+#define STREAM_LATE_TOLERANCE_MAX 100
+
+/* coroutine context */
+static void display_stream_update_jitter(display_stream *st, gint32 latency)
+{
+    gint32 d;
+
+    /* RFC 3550 interarrival jitter */
+    if (st->num_input_frames > 1) {
+        d = ABS(latency - st->last_latency);
+        st->jitter += d - ((st->jitter + 8) >> 4);
+    }
+    st->last_latency = latency;
+}
+
+static gint32 display_stream_late_tolerance(display_stream *st)
+{
+    return CLAMP(2 * (st->jitter >> 4),
+                 STREAM_LATE_TOLERANCE_MIN, STREAM_LATE_TOLERANCE_MAX);
+}
 
 /* coroutine context */
 static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
@@ -1359,7 +3703,9 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
     st->num_input_frames++;
 
     latency = op->multi_media_time - mmtime;
-    if (latency < 0) {
+    display_stream_update_jitter(st, latency);
+    /* a frame late within the jitter may still be displayed */
+    if (latency < -display_stream_late_tolerance(st)) {
         CHANNEL_DEBUG(channel, "stream data too late by %u ms (ts: %u, mmtime: %u), dropping",
                       mmtime - op->multi_media_time, op->multi_media_time, mmtime);
         st->arrive_late_time += mmtime - op->multi_media_time;
@@ -1375,12 +3721,16 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
         spice_msg_in_ref(in);
         display_stream_test_frames_mm_time_reset(st, in, mmtime);
         g_queue_push_tail(st->msgq, in);
+        if (c->threaded_decode)
+            display_stream_submit_frame(st, in);
         while (!display_stream_schedule(st)) {
         }
         if (st->cur_drops_seq_stats.len) {
             st->cur_drops_seq_stats.duration = op->multi_media_time -
                                                st->cur_drops_seq_stats.start_mm_time;
-            g_array_append_val(st->drops_seqs_stats_arr, st->cur_drops_seq_stats);
+            st->drops_seqs_stats[st->num_drops_seqs % DROPS_SEQS_HISTORY] =
+                st->cur_drops_seq_stats;
+            st->drops_duration_total += st->cur_drops_seq_stats.duration;
             memset(&st->cur_drops_seq_stats, 0, sizeof(st->cur_drops_seq_stats));
             st->num_drops_seqs++;
         }
@@ -1394,6 +3744,7 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
             st->playback_sync_drops_seq_len = 0;
         }
     }
+    display_stream_update_stats(SPICE_DISPLAY_CHANNEL(channel), op->id);
 }
 
 /* coroutine context */
@@ -1418,18 +3769,12 @@ static void display_handle_stream_clip(SpiceChannel *channel, SpiceMsgIn *in)
     display_update_stream_region(st);
 }
 
-static void _msg_in_unref_func(gpointer data, gpointer user_data)
-{
-    spice_msg_in_unref(data);
-}
-
 static void destroy_stream(SpiceChannel *channel, int id)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     display_stream *st;
-    guint64 drops_duration_total = 0;
     guint32 num_out_frames;
-    int i;
+    guint32 i;
 
     g_return_if_fail(c != NULL);
     g_return_if_fail(c->streams != NULL);
@@ -1439,53 +3784,102 @@ static void destroy_stream(SpiceChannel *channel, int id)
     if (!st)
         return;
 
-    num_out_frames = st->num_input_frames - st->num_drops_on_receive - st->num_drops_on_playback;
+    num_out_frames = display_stream_out_frames(st);
     CHANNEL_DEBUG(channel, "%s: id=%d #in-frames=%d out/in=%.2f "
         "#drops-on-receive=%d avg-late-time(ms)=%.2f "
-        "#drops-on-playback=%d", __FUNCTION__,
+        "#drops-on-playback=%d av-offset(ms)=%.1f", __FUNCTION__,
         id,
         st->num_input_frames,
         num_out_frames / (double)st->num_input_frames,
         st->num_drops_on_receive,
         st->num_drops_on_receive ? st->arrive_late_time / ((double)st->num_drops_on_receive): 0,
-        st->num_drops_on_playback);
+        st->num_drops_on_playback,
+        st->av_offset / 16.0);
     if (st->num_drops_seqs) {
         CHANNEL_DEBUG(channel, "%s: #drops-sequences=%u ==>", __FUNCTION__, st->num_drops_seqs);
     }
-    for (i = 0; i < st->num_drops_seqs; i++) {
-            drops_sequence_stats *stats = &g_array_index(st->drops_seqs_stats_arr,
-                                                         drops_sequence_stats,
-                                                         i);
-            drops_duration_total += stats->duration;
+    /* the last ones */
+    for (i = st->num_drops_seqs - MIN(st->num_drops_seqs, DROPS_SEQS_HISTORY);
+         i < st->num_drops_seqs; i++) {
+            drops_sequence_stats *stats = &st->drops_seqs_stats[i % DROPS_SEQS_HISTORY];
             CHANNEL_DEBUG(channel, "%s: \t len=%u start-ms=%u duration-ms=%u", __FUNCTION__,
                                    stats->len,
                                    stats->start_mm_time - st->first_frame_mm_time,
                                    stats->duration);
     }
     if (st->num_drops_seqs) {
-        CHANNEL_DEBUG(channel, "%s: drops-total-duration=%"G_GUINT64_FORMAT" ==>", __FUNCTION__, drops_duration_total);
+        CHANNEL_DEBUG(channel, "%s: drops-total-duration=%"G_GUINT64_FORMAT" ==>", __FUNCTION__,
+                      st->drops_duration_total);
     }
 
-    g_array_free(st->drops_seqs_stats_arr, TRUE);
+    g_queue_foreach(st->msgq, display_stream_release_msg_func, st);
+    g_queue_free(st->msgq);
+    /* wait for the decoding thread to be done with this stream */
+    display_collect_frames(c, NULL, st);
+    if (st->frames)
+        g_hash_table_unref(st->frames);
 
-    switch (st->codec) {
-    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-        stream_mjpeg_cleanup(st);
-        break;
-    }
+    if (st->decoder)
+        st->decoder->cleanup(st);
 
     if (st->msg_clip)
         spice_msg_in_unref(st->msg_clip);
+    if (st->msg_skipped)
+        spice_msg_in_unref(st->msg_skipped);
     spice_msg_in_unref(st->msg_create);
 
-    g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
-    g_queue_free(st->msgq);
     if (st->timeout != 0)
         g_source_remove(st->timeout);
     g_free(st);
     c->streams[id] = NULL;
 }
 
+/* the last frame skipped while hidden */
+/* main or coroutine context */
+static void display_stream_render_skipped(display_stream *st)
+{
+    SpiceMsgIn *in = st->msg_skipped;
+
+    if (in == NULL)
+        return;
+
+    st->msg_skipped = NULL;
+    st->msg_data = in;
+    display_stream_render_frame(st);
+    st->msg_data = NULL;
+    spice_msg_in_unref(in);
+}
+
+/* main context */
+static void display_update_views_hidden(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    GHashTableIter iter;
+    gpointer view;
+    gboolean hidden = c->view_scales != NULL && g_hash_table_size(c->view_scales) > 0;
+    int i;
+
+    if (hidden) {
+        g_hash_table_iter_init(&iter, c->view_scales);
+        while (hidden && g_hash_table_iter_next(&iter, &view, NULL))
+            hidden = c->hidden_views != NULL && g_hash_table_lookup(c->hidden_views, view) != NULL;
+    }
+
+    if (hidden == c->views_hidden)
+        return;
+
+    CHANNEL_DEBUG(channel, "views %s", hidden ? "hidden" : "visible");
+    c->views_hidden = hidden;
+    if (hidden)
+        return;
+
+    /* catch up */
+    for (i = 0; i < c->nstreams; i++) {
+        if (c->streams[i])
+            display_stream_render_skipped(c->streams[i]);
+    }
+}
+
 static void clear_streams(SpiceChannel *channel)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
@@ -1502,16 +3896,27 @@ static void clear_streams(SpiceChannel *channel)
 /* coroutine context */
 static void display_handle_stream_destroy(SpiceChannel *channel, SpiceMsgIn *in)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     SpiceMsgDisplayStreamDestroy *op = spice_msg_in_parsed(in);
 
     g_return_if_fail(op != NULL);
     CHANNEL_DEBUG(channel, "%s: id %d", __FUNCTION__, op->id);
+    if (c->nstreams > op->id && c->streams[op->id])
+        display_stream_render_skipped(c->streams[op->id]);
     destroy_stream(channel, op->id);
 }
 
 /* coroutine context */
 static void display_handle_stream_destroy_all(SpiceChannel *channel, SpiceMsgIn *in)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    int i;
+
+    /* what is left on the surfaces */
+    for (i = 0; i < c->nstreams; i++) {
+        if (c->streams[i])
+            display_stream_render_skipped(c->streams[i]);
+    }
     clear_streams(channel);
 }
 
@@ -1537,6 +3942,7 @@ static void display_handle_stream_activate_report(SpiceChannel *channel, SpiceMs
     st->report_start_frame_time = 0;
     st->report_num_frames = 0;
     st->report_num_drops = 0;
+    st->report_num_playback_drops = 0;
     st->report_drops_seq_len = 0;
 }
 
@@ -1546,90 +3952,151 @@ static void display_handle_stream_activate_report(SpiceChannel *channel, SpiceMs
 static void display_handle_draw_fill(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawFill *op = spice_msg_in_parsed(in);
-    DRAW(fill);
+    DRAW_FAST(fill, draw_fill_solid(surface, op),
+              BRUSH_IMAGE(op->data.brush), op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_opaque(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawOpaque *op = spice_msg_in_parsed(in);
-    DRAW(opaque);
+    DRAW(opaque, op->data.src_bitmap, BRUSH_IMAGE(op->data.brush), op->data.mask.bitmap);
+}
+
+#ifdef USE_LZ4
+/*
+ * A 32-bit LZ4 image copied as is is decoded straight into the surface:
+ * the canvas would decode it into an image of its own, then composite it.
+ */
+static gboolean draw_copy_lz4(SpiceChannel *channel, display_surface *surface,
+                              SpiceMsgDisplayDrawCopy *op)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceCopy *copy = &op->data;
+    SpiceImage *image = copy->src_bitmap;
+    SpiceRect *box = &op->base.box;
+    SpiceChunks *chunks;
+    int width, height;
+    gint64 start;
+
+    if (image == NULL || image->descriptor.type != SPICE_IMAGE_TYPE_LZ4 ||
+        (image->descriptor.flags &
+         (SPICE_IMAGE_FLAGS_CACHE_ME | SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) ||
+        surface->format != SPICE_SURFACE_FMT_32_xRGB ||
+        copy->rop_descriptor != SPICE_ROPD_OP_PUT || copy->mask.bitmap != NULL ||
+        op->base.clip.type != SPICE_CLIP_TYPE_NONE)
+        return FALSE;
+
+    width = image->descriptor.width;
+    height = image->descriptor.height;
+    chunks = image->u.lz4.data;
+    if (chunks->num_chunks != 1 ||
+        copy->src_area.left != 0 || copy->src_area.top != 0 ||
+        copy->src_area.right != width || copy->src_area.bottom != height ||
+        box->right - box->left != width || box->bottom - box->top != height ||
+        box->left < 0 || box->top < 0 ||
+        box->right > surface->width || box->bottom > surface->height)
+        return FALSE;
+
+    if (c->lz4_rows == NULL)
+        c->lz4_rows = g_byte_array_new();
+
+    start = c->compression_adaptive ? g_get_monotonic_time() : 0;
+    /* a corrupted image leaves the surface as it was, for the canvas to report */
+    if (!lz4_decode_image(chunks->chunk[0].data, chunks->chunk[0].len, width, height,
+                          surface->data + box->top * surface->stride + box->left * 4,
+                          surface->stride, c->lz4_rows))
+        return FALSE;
+    if (start != 0)
+        record_draw_cost(channel, image, start);
+
+    /* kept for the next images, unless it is a large one */
+    if (c->lz4_rows->len > 4 * 1024 * 1024)
+        g_clear_pointer(&c->lz4_rows, g_byte_array_unref);
+
+    return TRUE;
 }
+#endif
 
 /* coroutine context */
 static void display_handle_draw_copy(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawCopy *op = spice_msg_in_parsed(in);
-    DRAW(copy);
+#ifdef USE_LZ4
+    DRAW_FAST(copy, draw_copy_lz4(channel, surface, op),
+              op->data.src_bitmap, op->data.mask.bitmap);
+#else
+    DRAW(copy, op->data.src_bitmap, op->data.mask.bitmap);
+#endif
 }
 
 /* coroutine context */
 static void display_handle_draw_blend(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawBlend *op = spice_msg_in_parsed(in);
-    DRAW(blend);
+    DRAW(blend, op->data.src_bitmap, op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_blackness(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawBlackness *op = spice_msg_in_parsed(in);
-    DRAW(blackness);
+    DRAW(blackness, op->data.mask.bitmap);
 }
 
 static void display_handle_draw_whiteness(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawWhiteness *op = spice_msg_in_parsed(in);
-    DRAW(whiteness);
+    DRAW(whiteness, op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_invers(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawInvers *op = spice_msg_in_parsed(in);
-    DRAW(invers);
+    DRAW(invers, op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_rop3(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawRop3 *op = spice_msg_in_parsed(in);
-    DRAW(rop3);
+    DRAW(rop3, op->data.src_bitmap, BRUSH_IMAGE(op->data.brush), op->data.mask.bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_stroke(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawStroke *op = spice_msg_in_parsed(in);
-    DRAW(stroke);
+    DRAW(stroke, BRUSH_IMAGE(op->data.brush));
 }
 
 /* coroutine context */
 static void display_handle_draw_text(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawText *op = spice_msg_in_parsed(in);
-    DRAW(text);
+    DRAW(text, BRUSH_IMAGE(op->data.fore_brush), BRUSH_IMAGE(op->data.back_brush));
 }
 
 /* coroutine context */
 static void display_handle_draw_transparent(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawTransparent *op = spice_msg_in_parsed(in);
-    DRAW(transparent);
+    DRAW(transparent, op->data.src_bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_alpha_blend(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawAlphaBlend *op = spice_msg_in_parsed(in);
-    DRAW(alpha_blend);
+    DRAW(alpha_blend, op->data.src_bitmap);
 }
 
 /* coroutine context */
 static void display_handle_draw_composite(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgDisplayDrawComposite *op = spice_msg_in_parsed(in);
-    DRAW(composite);
+    DRAW(composite, op->data.src_bitmap, op->data.mask_bitmap);
 }
 
 /* coroutine context */
@@ -1637,13 +4104,19 @@ static void display_handle_surface_create(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     SpiceMsgSurfaceCreate *create = spice_msg_in_parsed(in);
-    display_surface *surface = g_slice_new0(display_surface);
+    display_surface *surface;
 
+    if (create->surface_id >= SURFACES_MAX) {
+        g_warning("invalid surface id %u", create->surface_id);
+        return;
+    }
+
+    surface = g_slice_new0(display_surface);
     surface->surface_id = create->surface_id;
     surface->format = create->format;
     surface->width  = create->width;
     surface->height = create->height;
-    surface->stride = create->width * 4;
+    surface->stride = surface_stride(create->width);
     surface->size   = surface->height * surface->stride;
 
     if (create->flags & SPICE_SURFACE_FLAGS_PRIMARY) {
@@ -1698,7 +4171,7 @@ static void display_handle_surface_destroy(SpiceChannel *channel, SpiceMsgIn *in
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
-    g_hash_table_remove(c->surfaces, GINT_TO_POINTER(surface->surface_id));
+    set_surface(c, surface->surface_id, NULL);
 }
 
 #define CLAMP_CHECK(x, low, high)  (((x) > (high)) ? TRUE : (((x) < (low)) ? TRUE : FALSE))
@@ -1743,6 +4216,7 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
     }
 
     g_coroutine_object_notify(G_OBJECT(channel), "monitors");
+    spice_session_update_caches(spice_channel_get_session(channel));
 }
 
 static void channel_set_handlers(SpiceChannelClass *klass)
@@ -96,6 +96,114 @@ struct _SpiceDisplayChannelClass {
 GType	        spice_display_channel_get_type(void);
 gboolean        spice_display_get_primary(SpiceChannel *channel, guint32 surface_id,
                                           SpiceDisplayPrimary *primary);
+gint            spice_display_get_primary_fd(SpiceChannel *channel, guint32 surface_id);
+
+typedef struct _SpiceDisplayRect SpiceDisplayRect;
+struct _SpiceDisplayRect {
+    gint x;
+    gint y;
+    gint width;
+    gint height;
+};
+
+/**
+ * SpiceDisplayExport:
+ *
+ * A consumer of the primary surface, see spice_display_export_new().
+ * The struct is opaque.
+ */
+typedef struct _SpiceDisplayExport SpiceDisplayExport;
+
+/**
+ * SpiceDisplayFrame:
+ *
+ * A view of the primary surface, see spice_display_export_get_frame().
+ * The struct is opaque.
+ */
+typedef struct _SpiceDisplayFrame SpiceDisplayFrame;
+
+/**
+ * SpiceDisplayExportFunc:
+ * @display_export: the #SpiceDisplayExport
+ * @user_data: the data given to spice_display_export_new()
+ *
+ * Tells that the primary surface changed since the last frame of @display_export.
+ */
+typedef void (*SpiceDisplayExportFunc)(SpiceDisplayExport *display_export, gpointer user_data);
+
+#define SPICE_TYPE_DISPLAY_FRAME (spice_display_frame_get_type())
+
+SpiceDisplayExport *spice_display_export_new(SpiceChannel *channel,
+                                             SpiceDisplayExportFunc func,
+                                             gpointer user_data,
+                                             GDestroyNotify notify);
+void                spice_display_export_free(SpiceDisplayExport *display_export);
+SpiceDisplayFrame   *spice_display_export_get_frame(SpiceDisplayExport *display_export);
+
+GType                   spice_display_frame_get_type(void);
+SpiceDisplayFrame       *spice_display_frame_ref(SpiceDisplayFrame *frame);
+void                    spice_display_frame_unref(SpiceDisplayFrame *frame);
+const guint8            *spice_display_frame_get_data(SpiceDisplayFrame *frame, gint *stride);
+gint                    spice_display_frame_get_fd(SpiceDisplayFrame *frame);
+enum SpiceSurfaceFmt    spice_display_frame_get_format(SpiceDisplayFrame *frame,
+                                                       gint *width, gint *height);
+guint64                 spice_display_frame_get_sequence(SpiceDisplayFrame *frame);
+const SpiceDisplayRect  *spice_display_frame_get_damage(SpiceDisplayFrame *frame,
+                                                        guint *n_rects);
+
+gboolean            spice_display_gst_src_register(void);
+
+/**
+ * SpiceDisplayStreamStats:
+ * @id: the id of the stream
+ * @codec: the video codec of the stream, a #SpiceVideoCodecType
+ * @num_frames: frames received
+ * @num_drops_on_receive: frames dropped because they arrived too late
+ * @num_drops_on_playback: frames dropped because they could not be
+ * decoded in time
+ * @late_time_ms: how late the frames dropped on receive were, on average
+ * @fps: frames displayed per second, over the last second
+ * @decode_time_us: time to decode a frame, on average
+ * @jitter_ms: jitter of the arrival of the frames
+ * @num_drops_seqs: sequences of frames dropped on receive
+ *
+ * Statistics of a video stream of a #SpiceDisplayChannel, since the
+ * stream was created.
+ *
+ * The structure is allocated by the library, and more fields may be
+ * appended in future versions.
+ *
+ * Since: 0.29
+ */
+typedef struct _SpiceDisplayStreamStats SpiceDisplayStreamStats;
+struct _SpiceDisplayStreamStats {
+    guint   id;
+    gint    codec;
+    guint   num_frames;
+    guint   num_drops_on_receive;
+    guint   num_drops_on_playback;
+    guint   late_time_ms;
+    gdouble fps;
+    guint   decode_time_us;
+    guint   jitter_ms;
+    guint   num_drops_seqs;
+};
+
+#define SPICE_TYPE_DISPLAY_STREAM_STATS (spice_display_stream_stats_get_type())
+GType                   spice_display_stream_stats_get_type(void);
+SpiceDisplayStreamStats *spice_display_stream_stats_copy(const SpiceDisplayStreamStats *stats);
+void                    spice_display_stream_stats_free(SpiceDisplayStreamStats *stats);
+SpiceDisplayStreamStats *spice_display_get_stream_stats(SpiceChannel *channel, guint stream_id);
+
+#define SPICE_DISPLAY_LATENCY_BUCKETS 16
+
+void            spice_display_presented(SpiceChannel *channel);
+void            spice_display_get_latency_histogram(SpiceChannel *channel,
+                                                    guint64 histogram[SPICE_DISPLAY_LATENCY_BUCKETS]);
+void            spice_display_set_view_scale(SpiceChannel *channel, gpointer view,
+                                             gdouble scale);
+void            spice_display_set_view_visible(SpiceChannel *channel, gpointer view,
+                                               gboolean visible);
 
 G_END_DECLS
 
@@ -17,6 +17,8 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_INPUTS
+
 #include "spice-client.h"
 #include "spice-common.h"
 #include "spice-channel-priv.h"
@@ -50,14 +52,38 @@ struct _SpiceInputsChannelPrivate {
     int                         motion_count;
     int                         modifiers;
     guint32                     locks;
+
+    /* motion coalescing */
+    guint                       motion_rate; /* Hz, 0 to send every motion */
+    gint64                      motion_last; /* when motion was last sent */
+    guint                       motion_timeout_id;
+    guint64                     motion_sent;
+    guint64                     motion_coalesced;
+
+    /* scancode batches, the head one being sent */
+    GQueue                      key_batches;
+    gboolean                    key_batch_flushing;
 };
 
+typedef struct {
+    GSimpleAsyncResult          *result;
+    GCancellable                *cancellable;
+    GFileProgressCallback       progress_callback;
+    gpointer                    progress_callback_data;
+    guint                       *scancodes;
+    guint                       n_scancodes;
+    guint                       sent;
+} KeyBatch;
+
 G_DEFINE_TYPE(SpiceInputsChannel, spice_inputs_channel, SPICE_TYPE_CHANNEL)
 
 /* Properties */
 enum {
     PROP_0,
     PROP_KEY_MODIFIERS,
+    PROP_MOTION_RATE,
+    PROP_MOTION_SENT,
+    PROP_MOTION_COALESCED,
 };
 
 /* Signals */
@@ -78,6 +104,8 @@ static void channel_set_handlers(SpiceChannelClass *klass);
 static void spice_inputs_channel_init(SpiceInputsChannel *channel)
 {
     channel->priv = SPICE_INPUTS_CHANNEL_GET_PRIVATE(channel);
+    channel->priv->dpy = -1;
+    SPICE_CHANNEL(channel)->priv->xmit_priority = TRUE;
 }
 
 static void spice_inputs_get_property(GObject    *object,
@@ -91,14 +119,52 @@ static void spice_inputs_get_property(GObject    *object,
     case PROP_KEY_MODIFIERS:
         g_value_set_int(value, c->modifiers);
         break;
+    case PROP_MOTION_RATE:
+        g_value_set_uint(value, c->motion_rate);
+        break;
+    case PROP_MOTION_SENT:
+        g_value_set_uint64(value, c->motion_sent);
+        break;
+    case PROP_MOTION_COALESCED:
+        g_value_set_uint64(value, c->motion_coalesced);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        break;
+    }
+}
+
+static void spice_inputs_set_property(GObject      *object,
+                                      guint         prop_id,
+                                      const GValue *value,
+                                      GParamSpec   *pspec)
+{
+    SpiceInputsChannelPrivate *c = SPICE_INPUTS_CHANNEL(object)->priv;
+
+    switch (prop_id) {
+    case PROP_MOTION_RATE:
+        c->motion_rate = g_value_get_uint(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
     }
 }
 
+static void motion_timeout_remove(SpiceInputsChannel *channel)
+{
+    SpiceInputsChannelPrivate *c = channel->priv;
+
+    if (c->motion_timeout_id) {
+        g_source_remove(c->motion_timeout_id);
+        c->motion_timeout_id = 0;
+    }
+}
+
 static void spice_inputs_channel_finalize(GObject *obj)
 {
+    motion_timeout_remove(SPICE_INPUTS_CHANNEL(obj));
+
     if (G_OBJECT_CLASS(spice_inputs_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_inputs_channel_parent_class)->finalize(obj);
 }
@@ -110,6 +176,7 @@ static void spice_inputs_channel_class_init(SpiceInputsChannelClass *klass)
 
     gobject_class->finalize     = spice_inputs_channel_finalize;
     gobject_class->get_property = spice_inputs_get_property;
+    gobject_class->set_property = spice_inputs_set_property;
     channel_class->channel_up   = spice_inputs_channel_up;
     channel_class->channel_reset = spice_inputs_channel_reset;
 
@@ -124,6 +191,59 @@ static void spice_inputs_channel_class_init(SpiceInputsChannelClass *klass)
                           G_PARAM_STATIC_NICK |
                           G_PARAM_STATIC_BLURB));
 
+    /**
+     * SpiceInputsChannel:motion-rate:
+     *
+     * The maximum rate at which the mouse motion is sent, in Hz. The
+     * motion reported in between is coalesced, and sent at once. A
+     * change of the buttons state is sent right away. 0 sends every
+     * motion as soon as the server acknowledgements allow.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MOTION_RATE,
+         g_param_spec_uint("motion-rate",
+                           "Motion rate",
+                           "Maximum rate of the mouse motion messages, in Hz",
+                           0, 1000, 200,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceInputsChannel:motion-sent:
+     *
+     * The number of mouse motion and position messages sent.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MOTION_SENT,
+         g_param_spec_uint64("motion-sent",
+                             "Motion sent",
+                             "Number of mouse motion messages sent",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceInputsChannel:motion-coalesced:
+     *
+     * The number of mouse motions that were coalesced with the
+     * following ones, instead of being sent in their own message.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MOTION_COALESCED,
+         g_param_spec_uint64("motion-coalesced",
+                             "Motion coalesced",
+                             "Number of mouse motions merged in a later message",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceInputsChannel::inputs-modifier:
      * @display: the #SpiceInputsChannel that emitted the signal
@@ -166,6 +286,8 @@ static SpiceMsgOut* mouse_motion(SpiceInputsChannel *channel)
     msg->marshallers->msgc_inputs_mouse_motion(msg->marshaller, &motion);
 
     c->motion_count++;
+    c->motion_sent++;
+    c->motion_last = g_get_monotonic_time();
     c->dx = 0;
     c->dy = 0;
 
@@ -191,6 +313,8 @@ static SpiceMsgOut* mouse_position(SpiceInputsChannel *channel)
     msg->marshallers->msgc_inputs_mouse_position(msg->marshaller, &position);
 
     c->motion_count++;
+    c->motion_sent++;
+    c->motion_last = g_get_monotonic_time();
     c->dpy = -1;
 
     return msg;
@@ -226,6 +350,57 @@ static void send_motion(SpiceInputsChannel *channel)
     spice_msg_out_send(msg);
 }
 
+/* main context */
+static gboolean motion_timeout(gpointer user_data)
+{
+    SpiceInputsChannel *channel = user_data;
+    SpiceInputsChannelPrivate *c = channel->priv;
+
+    c->motion_timeout_id = 0;
+
+    /* else, the acknowledgement flushes it */
+    if (c->motion_count < SPICE_INPUT_MOTION_ACK_BUNCH * 2) {
+        send_motion(channel);
+        send_position(channel);
+    }
+
+    return FALSE;
+}
+
+/*
+ * Sends the pending motion, unless it was sent less than 1/motion-rate
+ * ago: then it is sent when that is over, with the motion reported
+ * until then. The acknowledgements of the server remain the limit
+ * on the messages in flight.
+ */
+/* main context */
+static void flush_motion(SpiceInputsChannel *channel, gboolean now)
+{
+    SpiceInputsChannelPrivate *c = channel->priv;
+    gint64 interval, delay;
+
+    if (c->motion_count >= SPICE_INPUT_MOTION_ACK_BUNCH * 2) {
+        c->motion_coalesced++;
+        return;
+    }
+
+    if (!now && c->motion_rate != 0) {
+        interval = G_USEC_PER_SEC / c->motion_rate;
+        delay = c->motion_last + interval - g_get_monotonic_time();
+        if (delay > 0) {
+            c->motion_coalesced++;
+            if (c->motion_timeout_id == 0)
+                c->motion_timeout_id = g_timeout_add((delay + 999) / 1000,
+                                                     motion_timeout, channel);
+            return;
+        }
+    }
+
+    motion_timeout_remove(channel);
+    send_motion(channel);
+    send_position(channel);
+}
+
 /* coroutine context */
 static void inputs_handle_init(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -289,6 +464,7 @@ void spice_inputs_motion(SpiceInputsChannel *channel, gint dx, gint dy,
                          gint button_state)
 {
     SpiceInputsChannelPrivate *c;
+    gboolean now;
 
     g_return_if_fail(channel != NULL);
     g_return_if_fail(SPICE_CHANNEL(channel)->priv->state != SPICE_CHANNEL_STATE_UNCONNECTED);
@@ -299,13 +475,12 @@ void spice_inputs_motion(SpiceInputsChannel *channel, gint dx, gint dy,
         return;
 
     c = channel->priv;
+    now = button_state != c->bs;
     c->bs  = button_state;
     c->dx += dx;
     c->dy += dy;
 
-    if (c->motion_count < SPICE_INPUT_MOTION_ACK_BUNCH * 2) {
-        send_motion(channel);
-    }
+    flush_motion(channel, now);
 }
 
 /**
@@ -322,6 +497,7 @@ void spice_inputs_position(SpiceInputsChannel *channel, gint x, gint y,
                            gint display, gint button_state)
 {
     SpiceInputsChannelPrivate *c;
+    gboolean now;
 
     g_return_if_fail(channel != NULL);
 
@@ -329,16 +505,14 @@ void spice_inputs_position(SpiceInputsChannel *channel, gint x, gint y,
         return;
 
     c = channel->priv;
+    /* coalescing keeps the last position */
+    now = button_state != c->bs;
     c->bs  = button_state;
     c->x   = x;
     c->y   = y;
     c->dpy = display;
 
-    if (c->motion_count < SPICE_INPUT_MOTION_ACK_BUNCH * 2) {
-        send_position(channel);
-    } else {
-        CHANNEL_DEBUG(channel, "over SPICE_INPUT_MOTION_ACK_BUNCH * 2, dropping");
-    }
+    flush_motion(channel, now);
 }
 
 /**
@@ -536,6 +710,259 @@ void spice_inputs_key_press_and_release(SpiceInputsChannel *input_channel, guint
     }
 }
 
+/* at most 2 bytes per key, as the server reads them */
+#define KEY_SEQUENCE_MAX_KEYS 512
+
+/**
+ * spice_inputs_key_sequence:
+ * @channel: a #SpiceInputsChannel
+ * @scancodes: (array length=n_scancodes): PC XT (set 1) key scancodes, as
+ *             for spice_inputs_key_press(), OR'ed with
+ *             %SPICE_INPUTS_KEY_RELEASE for a release
+ * @n_scancodes: the number of @scancodes
+ *
+ * Presses and releases keys, in the order of @scancodes. When the server
+ * supports it, they are packed into as few messages as possible, which
+ * are read atomically, as with spice_inputs_key_press_and_release().
+ *
+ * Since: 0.29
+ **/
+void spice_inputs_key_sequence(SpiceInputsChannel *input_channel, const guint *scancodes,
+                               guint n_scancodes)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(input_channel);
+    guint i, n;
+
+    g_return_if_fail(channel != NULL);
+    g_return_if_fail(scancodes != NULL || n_scancodes == 0);
+    g_return_if_fail(channel->priv->state != SPICE_CHANNEL_STATE_UNCONNECTED);
+
+    if (channel->priv->state != SPICE_CHANNEL_STATE_READY)
+        return;
+    if (spice_channel_get_read_only(channel))
+        return;
+
+    if (!spice_channel_test_capability(channel, SPICE_INPUTS_CAP_KEY_SCANCODE)) {
+        for (i = 0; i < n_scancodes; i++) {
+            guint scancode = scancodes[i] & ~SPICE_INPUTS_KEY_RELEASE;
+
+            if (scancodes[i] & SPICE_INPUTS_KEY_RELEASE)
+                spice_inputs_key_release(input_channel, scancode);
+            else
+                spice_inputs_key_press(input_channel, scancode);
+        }
+        return;
+    }
+
+    for (i = 0; i < n_scancodes; i += n) {
+        SpiceMsgOut *msg;
+        guint j;
+
+        n = MIN(n_scancodes - i, KEY_SEQUENCE_MAX_KEYS);
+        msg = spice_msg_out_new(channel, SPICE_MSGC_INPUTS_KEY_SCANCODE);
+        for (j = i; j < i + n; j++) {
+            guint scancode = scancodes[j] & ~SPICE_INPUTS_KEY_RELEASE;
+            guint16 code = spice_make_scancode(scancode, scancodes[j] & SPICE_INPUTS_KEY_RELEASE);
+            guint8 *buf;
+
+            if (scancode < 0x100) {
+                buf = (guint8*)spice_marshaller_reserve_space(msg->marshaller, 1);
+                buf[0] = code;
+            } else {
+                buf = (guint8*)spice_marshaller_reserve_space(msg->marshaller, 2);
+                buf[0] = code & 0xff;
+                buf[1] = code >> 8;
+            }
+        }
+        spice_msg_out_send(msg);
+    }
+}
+
+/* keys sent before waiting for the previous ones to be written */
+#define KEY_BATCH_CHUNK 64
+
+static void key_batch_free(KeyBatch *batch)
+{
+    g_object_unref(batch->result);
+    g_clear_object(&batch->cancellable);
+    g_free(batch->scancodes);
+    g_free(batch);
+}
+
+static void key_batch_complete(KeyBatch *batch)
+{
+    g_simple_async_result_complete_in_idle(batch->result);
+    key_batch_free(batch);
+}
+
+static void key_batches_fail(SpiceInputsChannel *channel)
+{
+    SpiceInputsChannelPrivate *c = channel->priv;
+    KeyBatch *batch;
+
+    while ((batch = g_queue_pop_head(&c->key_batches)) != NULL) {
+        g_simple_async_result_set_error(batch->result, SPICE_CLIENT_ERROR,
+                                        SPICE_CLIENT_ERROR_FAILED,
+                                        "The channel was reset");
+        key_batch_complete(batch);
+    }
+}
+
+static void key_batch_flushed(GObject *source_object, GAsyncResult *res, gpointer user_data);
+
+/* main context */
+static void key_batch_next(SpiceInputsChannel *channel)
+{
+    SpiceInputsChannelPrivate *c = channel->priv;
+    KeyBatch *batch;
+    GError *error = NULL;
+
+    if (SPICE_CHANNEL(channel)->priv->state != SPICE_CHANNEL_STATE_READY) {
+        key_batches_fail(channel);
+        return;
+    }
+
+    while ((batch = g_queue_peek_head(&c->key_batches)) != NULL) {
+        guint n;
+
+        if (g_cancellable_set_error_if_cancelled(batch->cancellable, &error)) {
+            g_simple_async_result_take_error(batch->result, error);
+            g_queue_pop_head(&c->key_batches);
+            key_batch_complete(batch);
+            continue;
+        }
+
+        n = MIN(batch->n_scancodes - batch->sent, KEY_BATCH_CHUNK);
+        spice_inputs_key_sequence(channel, batch->scancodes + batch->sent, n);
+        batch->sent += n;
+        if (batch->progress_callback)
+            batch->progress_callback(batch->sent, batch->n_scancodes,
+                                     batch->progress_callback_data);
+
+        if (batch->sent == batch->n_scancodes) {
+            g_simple_async_result_set_op_res_gboolean(batch->result, TRUE);
+            g_queue_pop_head(&c->key_batches);
+            key_batch_complete(batch);
+            continue;
+        }
+
+        /* the rest once these are on the wire, at the pace the server reads them */
+        c->key_batch_flushing = TRUE;
+        spice_channel_flush_async(SPICE_CHANNEL(channel), NULL,
+                                  key_batch_flushed, NULL);
+        return;
+    }
+}
+
+/* main context */
+static void key_batch_flushed(GObject *source_object, GAsyncResult *res,
+                              gpointer user_data G_GNUC_UNUSED)
+{
+    SpiceInputsChannel *channel = SPICE_INPUTS_CHANNEL(source_object);
+
+    channel->priv->key_batch_flushing = FALSE;
+    /* if it failed, the channel is no longer ready and the batches fail */
+    spice_channel_flush_finish(SPICE_CHANNEL(channel), res, NULL);
+    key_batch_next(channel);
+}
+
+/**
+ * spice_inputs_send_scancodes_batch_async:
+ * @channel: a #SpiceInputsChannel
+ * @scancodes: (array length=n_scancodes): the keys, as for
+ *             spice_inputs_key_sequence()
+ * @n_scancodes: the number of @scancodes
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore
+ * @progress_callback: (allow-none) (scope call): function to call with
+ *     the number of keys sent so far, or %NULL
+ * @progress_callback_data: (closure): user data to pass to @progress_callback
+ * @callback: a #GAsyncReadyCallback to call when the keys are sent
+ * @user_data: the data to pass to callback function
+ *
+ * Queues a long sequence of keys, such as a text to be typed, and sends
+ * it a chunk at a time, each one once the previous one was written. It
+ * doesn't wait between keys, so that it takes as long as the connection
+ * needs to take them.
+ *
+ * The batches are sent one after the other, in the order they were
+ * queued. Other keys sent in the meantime are mixed with them.
+ *
+ * When the operation is finished, callback will be called. You can then
+ * call spice_inputs_send_scancodes_batch_finish() to get the result of
+ * the operation.
+ *
+ * Since: 0.29
+ **/
+void spice_inputs_send_scancodes_batch_async(SpiceInputsChannel *channel,
+                                             const guint *scancodes,
+                                             guint n_scancodes,
+                                             GCancellable *cancellable,
+                                             GFileProgressCallback progress_callback,
+                                             gpointer progress_callback_data,
+                                             GAsyncReadyCallback callback,
+                                             gpointer user_data)
+{
+    SpiceInputsChannelPrivate *c;
+    KeyBatch *batch;
+
+    g_return_if_fail(SPICE_IS_INPUTS_CHANNEL(channel));
+    g_return_if_fail(scancodes != NULL || n_scancodes == 0);
+
+    if (SPICE_CHANNEL(channel)->priv->state != SPICE_CHANNEL_STATE_READY) {
+        g_simple_async_report_error_in_idle(G_OBJECT(channel), callback, user_data,
+            SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+            "The channel is not ready yet");
+        return;
+    }
+
+    c = channel->priv;
+    batch = g_new0(KeyBatch, 1);
+    batch->result = g_simple_async_result_new(G_OBJECT(channel), callback, user_data,
+                                              spice_inputs_send_scancodes_batch_async);
+    batch->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+    batch->progress_callback = progress_callback;
+    batch->progress_callback_data = progress_callback_data;
+    batch->scancodes = g_memdup(scancodes, n_scancodes * sizeof(guint));
+    batch->n_scancodes = n_scancodes;
+
+    g_queue_push_tail(&c->key_batches, batch);
+    if (c->key_batch_flushing || g_queue_get_length(&c->key_batches) > 1)
+        return;
+
+    key_batch_next(channel);
+}
+
+/**
+ * spice_inputs_send_scancodes_batch_finish:
+ * @channel: a #SpiceInputsChannel
+ * @result: a #GAsyncResult
+ * @error: a #GError location to store the error occurring, or %NULL
+ *
+ * Finishes sending keys started with
+ * spice_inputs_send_scancodes_batch_async().
+ *
+ * Returns: %TRUE if all the keys were sent, %FALSE on error.
+ *
+ * Since: 0.29
+ **/
+gboolean spice_inputs_send_scancodes_batch_finish(SpiceInputsChannel *channel,
+                                                  GAsyncResult *result,
+                                                  GError **error)
+{
+    GSimpleAsyncResult *simple;
+
+    g_return_val_if_fail(SPICE_IS_INPUTS_CHANNEL(channel), FALSE);
+    g_return_val_if_fail(g_simple_async_result_is_valid(result,
+        G_OBJECT(channel), spice_inputs_send_scancodes_batch_async), FALSE);
+
+    simple = (GSimpleAsyncResult *)result;
+
+    if (g_simple_async_result_propagate_error(simple, error))
+        return FALSE;
+
+    return g_simple_async_result_get_op_res_gboolean(simple);
+}
+
 /* main or coroutine context */
 static SpiceMsgOut* set_key_locks(SpiceInputsChannel *channel, guint locks)
 {
@@ -598,6 +1025,8 @@ static void spice_inputs_channel_reset(SpiceChannel *channel, gboolean migrating
 {
     SpiceInputsChannelPrivate *c = SPICE_INPUTS_CHANNEL(channel)->priv;
     c->motion_count = 0;
+    motion_timeout_remove(SPICE_INPUTS_CHANNEL(channel));
+    key_batches_fail(SPICE_INPUTS_CHANNEL(channel));
 
     SPICE_CHANNEL_CLASS(spice_inputs_channel_parent_class)->channel_reset(channel, migrating);
 }
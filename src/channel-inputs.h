@@ -39,6 +39,16 @@ typedef enum {
     SPICE_INPUTS_CAPS_LOCK   = (1 << 2)
 } SpiceInputsLock;
 
+/**
+ * SPICE_INPUTS_KEY_RELEASE:
+ *
+ * OR'ed with a scancode given to spice_inputs_key_sequence(), for a key
+ * release rather than a press.
+ *
+ * Since: 0.29
+ */
+#define SPICE_INPUTS_KEY_RELEASE (1 << 16)
+
 /**
  * SpiceInputsChannel:
  *
@@ -83,6 +93,19 @@ void spice_inputs_key_press(SpiceInputsChannel *channel, guint scancode);
 void spice_inputs_key_release(SpiceInputsChannel *channel, guint scancode);
 void spice_inputs_set_key_locks(SpiceInputsChannel *channel, guint locks);
 void spice_inputs_key_press_and_release(SpiceInputsChannel *channel, guint scancode);
+void spice_inputs_key_sequence(SpiceInputsChannel *channel, const guint *scancodes,
+                               guint n_scancodes);
+void spice_inputs_send_scancodes_batch_async(SpiceInputsChannel *channel,
+                                             const guint *scancodes,
+                                             guint n_scancodes,
+                                             GCancellable *cancellable,
+                                             GFileProgressCallback progress_callback,
+                                             gpointer progress_callback_data,
+                                             GAsyncReadyCallback callback,
+                                             gpointer user_data);
+gboolean spice_inputs_send_scancodes_batch_finish(SpiceInputsChannel *channel,
+                                                  GAsyncResult *result,
+                                                  GError **error);
 
 G_END_DECLS
 
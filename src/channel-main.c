@@ -56,21 +56,92 @@
 typedef struct spice_migrate spice_migrate;
 
 #define FILE_XFER_CHUNK_SIZE (VD_AGENT_MAX_DATA_SIZE * 32)
+/* chunks read ahead of the agent tokens, per transfer */
+#define FILE_XFER_READ_AHEAD 4
+/* free chunks kept for the next reads */
+#define FILE_XFER_POOL_SIZE  8
+/* transfers opened at once, the others wait for them to complete */
+#define FILE_XFER_WINDOW 32
+/* the data in an agent message of one token */
+#define FILE_XFER_DATA_MSG_SIZE \
+    (VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage) - sizeof(VDAgentFileXferDataMessage))
+
+typedef struct {
+    SpiceMainChannel               *channel;
+    uint32_t                       id;
+    guint                          refs; /* agent messages sending it */
+    gsize                          size;
+    guint8                         data[FILE_XFER_CHUNK_SIZE];
+} SpiceFileXferChunk;
+
+/* the agent messages are sent by class, a class has to wait for the
+   others above it, never for the agent messages below it */
+typedef enum {
+    AGENT_PRIO_CONTROL,
+    AGENT_PRIO_CLIPBOARD,
+    AGENT_PRIO_BULK,
+
+    AGENT_PRIO_LAST,
+} AgentPrio;
+
+/* the monitors config is sent once the changes stop for twice their
+   average interval, within these bounds */
+#define DISPLAY_CONFIG_MIN_DELAY_MS 100
+#define DISPLAY_CONFIG_MAX_DELAY_MS 1000
+
+/* tokens that only control messages may take, unless nothing is in flight */
+#define AGENT_TOKENS_RESERVED 2
+
+/* the chunks of one agent message, they're sent one after the other */
+typedef struct {
+    GQueue                         outs;
+    AgentPrio                      prio;
+    gint64                         queue_time;
+} AgentMsgOut;
+
+typedef struct {
+    guint                          depth;
+    guint                          max_depth;
+    guint64                        sent;
+    guint64                        wait_time_us; /* total, until the first chunk is sent */
+    gint64                         max_wait_time_us;
+} AgentQueueStats;
+
+/* the files of a spice_main_file_copy_async() call */
+typedef struct {
+    guint                          n_files;
+    guint                          n_done;
+    GFileProgressCallback          progress_callback;
+    gpointer                       progress_callback_data;
+    GAsyncReadyCallback            callback;
+    gpointer                       user_data;
+    gboolean                       progress_pending;
+    uint64_t                       sent_bytes;
+    uint64_t                       total_bytes; /* of the files opened so far */
+    gint64                         start_time;
+    GError                         *error; /* the first one */
+} SpiceFileXferGroup;
+
 typedef struct SpiceFileXferTask {
     uint32_t                       id;
-    gboolean                       pending;
+    guint                          pending; /* async operations */
     GFile                          *file;
     SpiceMainChannel               *channel;
+    SpiceFileXferGroup             *group;
     GFileInputStream               *file_stream;
+    GFileInfo                      *info;
     GFileCopyFlags                 flags;
     GCancellable                   *cancellable;
-    GFileProgressCallback          progress_callback;
-    gpointer                       progress_callback_data;
-    GAsyncReadyCallback            callback;
-    gpointer                       user_data;
-    char                           buffer[FILE_XFER_CHUNK_SIZE];
+    SpiceFileXferChunk             *read_chunk;
+    GQueue                         chunks; /* read, waiting for agent tokens */
+    guint                          n_chunks; /* read, and not sent yet */
+    gboolean                       started; /* opened, in the window */
+    gboolean                       can_send; /* the agent takes the data */
+    gboolean                       eof;
     uint64_t                       read_bytes;
+    uint64_t                       sent_bytes;
     uint64_t                       file_size;
+    gint64                         start_time;
     GError                         *error;
 } SpiceFileXferTask;
 
@@ -84,12 +155,17 @@ struct _SpiceMainChannelPrivate  {
     gboolean                    display_disable_wallpaper:1;
     gboolean                    display_disable_font_smooth:1;
     gboolean                    display_disable_animation:1;
+    gboolean                    display_effects_auto:1;
+    guint                       display_effects_reduced:1; /* by effects_auto */
     gboolean                    disable_display_position:1;
     gboolean                    disable_display_align:1;
 
     int                         agent_tokens;
+    int                         agent_tokens_window;
     VDAgentMessage              agent_msg; /* partial msg reconstruction */
     guint8                      *agent_msg_data;
+    guint32                     agent_msg_data_size; /* the clipboard header, if streaming */
+    gboolean                    agent_msg_streaming;
     guint                       agent_msg_pos;
     uint8_t                     agent_msg_size;
     uint32_t                    agent_caps[VD_AGENT_CAPS_SIZE];
@@ -102,9 +178,21 @@ struct _SpiceMainChannelPrivate  {
         gboolean                enabled_set;
     } display[MAX_DISPLAY];
     gint                        timer_id;
-    GQueue                      *agent_msg_queue;
+    gint64                      display_change_time;
+    guint                       display_change_interval; /* ms, average */
+    VDAgentMonitorsConfig       *monitors_config_sent;
+    gsize                       monitors_config_sent_size;
+    GQueue                      agent_msg_queue[AGENT_PRIO_LAST];
+    AgentMsgOut                 *agent_msg_sending;
+    AgentQueueStats             agent_queue_stats[AGENT_PRIO_LAST];
     GHashTable                  *file_xfer_tasks;
-    GSList                      *flushing;
+    GQueue                      file_xfer_ready; /* tasks with chunks to send, in turn */
+    GQueue                      file_xfer_waiting; /* tasks not started, in order */
+    guint                       file_xfer_n_started;
+    gboolean                    file_xfer_starting; /* in file_xfer_start_next() */
+    GSList                      *file_xfer_pool;
+    guint                       file_xfer_n_chunks; /* allocated, pooled too */
+    guint                       file_xfer_progress_id;
 
     guint                       switch_host_delayed_id;
     guint                       migrate_delayed_id;
@@ -142,6 +230,7 @@ enum {
     PROP_DISPLAY_DISABLE_WALLPAPER,
     PROP_DISPLAY_DISABLE_FONT_SMOOTH,
     PROP_DISPLAY_DISABLE_ANIMATION,
+    PROP_DISPLAY_EFFECTS_AUTO,
     PROP_DISPLAY_COLOR_DEPTH,
     PROP_DISABLE_DISPLAY_POSITION,
     PROP_DISABLE_DISPLAY_ALIGN,
@@ -160,6 +249,7 @@ enum {
     SPICE_MAIN_CLIPBOARD_SELECTION_GRAB,
     SPICE_MAIN_CLIPBOARD_SELECTION_REQUEST,
     SPICE_MAIN_CLIPBOARD_SELECTION_RELEASE,
+    SPICE_MAIN_CLIPBOARD_SELECTION_CHUNK,
     SPICE_MIGRATION_STARTED,
     SPICE_MAIN_LAST_SIGNAL,
 };
@@ -170,13 +260,17 @@ static void spice_main_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 static void channel_set_handlers(SpiceChannelClass *klass);
 static void agent_send_msg_queue(SpiceMainChannel *channel);
 static void agent_free_msg_queue(SpiceMainChannel *channel);
+static void agent_queue_stats_dump(SpiceMainChannel *channel);
 static void migrate_channel_event_cb(SpiceChannel *channel, SpiceChannelEvent event,
                                      gpointer data);
 static gboolean main_migrate_handshake_done(gpointer data);
+static void session_bandwidth_changed(SpiceSession *session, GParamSpec *pspec,
+                                      gpointer data);
 static void spice_main_channel_send_migration_handshake(SpiceChannel *channel);
 static void file_xfer_continue_read(SpiceFileXferTask *task);
 static void file_xfer_completed(SpiceFileXferTask *task, GError *error);
-static void file_xfer_flushed(SpiceMainChannel *channel, gboolean success);
+static gboolean file_xfer_queue_next(SpiceMainChannel *channel);
+static void file_xfer_start_next(SpiceMainChannel *channel);
 static void spice_main_set_max_clipboard(SpiceMainChannel *self, gint max);
 static void set_agent_connected(SpiceMainChannel *channel, gboolean connected);
 
@@ -234,10 +328,14 @@ static void spice_main_channel_reset_capabilties(SpiceChannel *channel)
 static void spice_main_channel_init(SpiceMainChannel *channel)
 {
     SpiceMainChannelPrivate *c;
+    gint i;
 
     c = channel->priv = SPICE_MAIN_CHANNEL_GET_PRIVATE(channel);
-    c->agent_msg_queue = g_queue_new();
+    for (i = 0; i < AGENT_PRIO_LAST; i++)
+        g_queue_init(&c->agent_msg_queue[i]);
     c->file_xfer_tasks = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_queue_init(&c->file_xfer_ready);
+    g_queue_init(&c->file_xfer_waiting);
     c->cancellable_volume_info = g_cancellable_new();
 
     spice_main_channel_reset_capabilties(SPICE_CHANNEL(channel));
@@ -280,6 +378,9 @@ static void spice_main_get_property(GObject    *object,
     case PROP_DISPLAY_DISABLE_ANIMATION:
         g_value_set_boolean(value, c->display_disable_animation);
         break;
+    case PROP_DISPLAY_EFFECTS_AUTO:
+        g_value_set_boolean(value, c->display_effects_auto);
+        break;
     case PROP_DISPLAY_COLOR_DEPTH:
         g_value_set_uint(value, c->display_color_depth);
         break;
@@ -314,6 +415,9 @@ static void spice_main_set_property(GObject *gobject, guint prop_id,
     case PROP_DISPLAY_DISABLE_ANIMATION:
         c->display_disable_animation = g_value_get_boolean(value);
         break;
+    case PROP_DISPLAY_EFFECTS_AUTO:
+        c->display_effects_auto = g_value_get_boolean(value);
+        break;
     case PROP_DISPLAY_COLOR_DEPTH: {
         guint color_depth = g_value_get_uint(value);
         g_return_if_fail(color_depth % 8 == 0);
@@ -354,6 +458,11 @@ static void spice_main_channel_dispose(GObject *obj)
         c->migrate_delayed_id = 0;
     }
 
+    if (c->file_xfer_progress_id) {
+        g_source_remove(c->file_xfer_progress_id);
+        c->file_xfer_progress_id = 0;
+    }
+
     g_cancellable_cancel(c->cancellable_volume_info);
     g_clear_object(&c->cancellable_volume_info);
 
@@ -366,9 +475,11 @@ static void spice_main_channel_finalize(GObject *obj)
     SpiceMainChannelPrivate *c = SPICE_MAIN_CHANNEL(obj)->priv;
 
     g_free(c->agent_msg_data);
+    g_free(c->monitors_config_sent);
     agent_free_msg_queue(SPICE_MAIN_CHANNEL(obj));
     if (c->file_xfer_tasks)
         g_hash_table_unref(c->file_xfer_tasks);
+    g_slist_free_full(c->file_xfer_pool, g_free);
 
     if (G_OBJECT_CLASS(spice_main_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_main_channel_parent_class)->finalize(obj);
@@ -397,7 +508,11 @@ static void spice_main_channel_reset_agent(SpiceMainChannel *channel)
     c->agent_msg_pos = 0;
     g_free(c->agent_msg_data);
     c->agent_msg_data = NULL;
+    c->agent_msg_data_size = 0;
+    c->agent_msg_streaming = FALSE;
     c->agent_msg_size = 0;
+    /* a new agent gets the config, whatever the previous one got */
+    g_clear_pointer(&c->monitors_config_sent, g_free);
 
     tasks = g_hash_table_get_values(c->file_xfer_tasks);
     for (l = tasks; l != NULL; l = l->next) {
@@ -408,7 +523,6 @@ static void spice_main_channel_reset_agent(SpiceMainChannel *channel)
         file_xfer_completed(task, error);
     }
     g_list_free(tasks);
-    file_xfer_flushed(channel, FALSE);
 }
 
 /* main or coroutine context */
@@ -421,8 +535,8 @@ static void spice_main_channel_reset(SpiceChannel *channel, gboolean migrating)
        it has send an agent-disconnected msg as that is what the original
        spicec did. Also see the TODO in server/reds.c reds_reset_vdp() */
     c->agent_tokens = 0;
+    agent_queue_stats_dump(SPICE_MAIN_CHANNEL(channel));
     agent_free_msg_queue(SPICE_MAIN_CHANNEL(channel));
-    c->agent_msg_queue = g_queue_new();
 
     c->agent_volume_playback_sync = FALSE;
     c->agent_volume_record_sync = FALSE;
@@ -442,6 +556,30 @@ static void spice_main_constructed(GObject *object)
 
     if (G_OBJECT_CLASS(spice_main_channel_parent_class)->constructed)
         G_OBJECT_CLASS(spice_main_channel_parent_class)->constructed(object);
+
+    spice_g_signal_connect_object(spice_channel_get_session(SPICE_CHANNEL(self)),
+                                  "notify::bandwidth",
+                                  G_CALLBACK(session_bandwidth_changed), self, 0);
+}
+
+/* main context: the file transfer chunks, and the queued agent messages,
+ * counted as full ones */
+static gsize spice_main_get_memory_usage(SpiceChannel *channel)
+{
+    SpiceMainChannelPrivate *c = SPICE_MAIN_CHANNEL(channel)->priv;
+    gsize size = c->file_xfer_n_chunks * sizeof(SpiceFileXferChunk);
+    GList *l;
+    int i;
+
+    for (i = 0; i < AGENT_PRIO_LAST; i++) {
+        for (l = c->agent_msg_queue[i].head; l != NULL; l = l->next) {
+            AgentMsgOut *msg = l->data;
+
+            size += g_queue_get_length(&msg->outs) * VD_AGENT_MAX_DATA_SIZE;
+        }
+    }
+
+    return size;
 }
 
 static void spice_main_channel_class_init(SpiceMainChannelClass *klass)
@@ -535,6 +673,27 @@ static void spice_main_channel_class_init(SpiceMainChannelClass *klass)
                               G_PARAM_CONSTRUCT |
                               G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceMainChannel:disable-effects-auto:
+     *
+     * Disable the guest wallpaper and animations while the link to the
+     * server is slow, and enable them again once it is faster, as
+     * estimated by #SpiceSession:bandwidth. The effects disabled by
+     * #SpiceMainChannel:disable-wallpaper and
+     * #SpiceMainChannel:disable-animation stay disabled.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_DISPLAY_EFFECTS_AUTO,
+         g_param_spec_boolean("disable-effects-auto",
+                              "Disable guest effects automatically",
+                              "Disable guest effects while the link is slow",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT |
+                              G_PARAM_STATIC_STRINGS));
+
     g_object_class_install_property
         (gobject_class, PROP_DISABLE_DISPLAY_POSITION,
          g_param_spec_boolean("disable-display-position",
@@ -796,6 +955,39 @@ static void spice_main_channel_class_init(SpiceMainChannelClass *klass)
                      1,
                      G_TYPE_UINT);
 
+    /**
+     * SpiceMainChannel::main-clipboard-selection-chunk:
+     * @main: the #SpiceMainChannel that emitted the signal
+     * @selection: a VD_AGENT_CLIPBOARD_SELECTION clipboard
+     * @type: the VD_AGENT_CLIPBOARD data type
+     * @data: a part of the clipboard data
+     * @size: size of @data in bytes
+     * @offset: offset of @data in the clipboard data
+     * @total: size of the clipboard data
+     *
+     * Provides the guest clipboard data as it arrives, when it does not
+     * fit in a single message. If a handler returns %TRUE for the first
+     * part, at @offset 0, it is given the next ones too, the last one
+     * ending at @total, and #SpiceMainChannel::main-clipboard-selection
+     * is not emitted for that data. Otherwise, the data is gathered and
+     * given to #SpiceMainChannel::main-clipboard-selection, as is the
+     * data received at once.
+     *
+     * Returns: %TRUE to take the next parts of the data
+     * Since: 0.29
+     **/
+    signals[SPICE_MAIN_CLIPBOARD_SELECTION_CHUNK] =
+        g_signal_new("main-clipboard-selection-chunk",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_LAST,
+                     0,
+                     g_signal_accumulator_true_handled, NULL,
+                     g_cclosure_user_marshal_BOOLEAN__UINT_UINT_POINTER_UINT_UINT_UINT,
+                     G_TYPE_BOOLEAN,
+                     6,
+                     G_TYPE_UINT, G_TYPE_UINT, G_TYPE_POINTER, G_TYPE_UINT,
+                     G_TYPE_UINT, G_TYPE_UINT);
+
     /**
      * SpiceMainChannel::migration-started:
      * @main: the #SpiceMainChannel that emitted the signal
@@ -820,79 +1012,132 @@ static void spice_main_channel_class_init(SpiceMainChannelClass *klass)
 
     g_type_class_add_private(klass, sizeof(SpiceMainChannelPrivate));
     channel_set_handlers(SPICE_CHANNEL_CLASS(klass));
+    channel_class->priv->get_memory_usage = spice_main_get_memory_usage;
 }
 
 /* ------------------------------------------------------------------ */
 
 
+static void agent_msg_out_free(AgentMsgOut *msg)
+{
+    g_queue_foreach(&msg->outs, (GFunc)spice_msg_out_unref, NULL);
+    g_queue_clear(&msg->outs);
+    g_slice_free(AgentMsgOut, msg);
+}
+
 static void agent_free_msg_queue(SpiceMainChannel *channel)
 {
     SpiceMainChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
-
-    if (!c->agent_msg_queue)
-        return;
+    AgentMsgOut *msg;
+    gint i;
 
-    while (!g_queue_is_empty(c->agent_msg_queue)) {
-        out = g_queue_pop_head(c->agent_msg_queue);
-        spice_msg_out_unref(out);
+    if (c->agent_msg_sending) {
+        agent_msg_out_free(c->agent_msg_sending);
+        c->agent_msg_sending = NULL;
     }
 
-    g_queue_free(c->agent_msg_queue);
-    c->agent_msg_queue = NULL;
+    for (i = 0; i < AGENT_PRIO_LAST; i++) {
+        while ((msg = g_queue_pop_head(&c->agent_msg_queue[i])) != NULL)
+            agent_msg_out_free(msg);
+        c->agent_queue_stats[i].depth = 0;
+    }
 }
 
-/* Here, flushing algorithm is stolen from spice-channel.c */
-static void file_xfer_flushed(SpiceMainChannel *channel, gboolean success)
+static void agent_queue_stats_dump(SpiceMainChannel *channel)
 {
+    static const char *names[] = { "control", "clipboard", "bulk" };
     SpiceMainChannelPrivate *c = channel->priv;
-    GSList *l;
+    gint i;
 
-    for (l = c->flushing; l != NULL; l = l->next) {
-        GSimpleAsyncResult *result = G_SIMPLE_ASYNC_RESULT(l->data);
-        g_simple_async_result_set_op_res_gboolean(result, success);
-        g_simple_async_result_complete_in_idle(result);
+    G_STATIC_ASSERT(G_N_ELEMENTS(names) == AGENT_PRIO_LAST);
+    for (i = 0; i < AGENT_PRIO_LAST; i++) {
+        AgentQueueStats *st = &c->agent_queue_stats[i];
+
+        if (st->sent == 0)
+            continue;
+        CHANNEL_DEBUG(channel, "agent %s messages: %" G_GUINT64_FORMAT " sent, max depth %u, "
+                      "wait %" G_GUINT64_FORMAT " us average, %" G_GINT64_FORMAT " us max",
+                      names[i], st->sent, st->max_depth, st->wait_time_us / st->sent,
+                      st->max_wait_time_us);
     }
+}
 
-    g_slist_free_full(c->flushing, g_object_unref);
-    c->flushing = NULL;
+static AgentPrio agent_msg_prio(int type)
+{
+    switch (type) {
+    case VD_AGENT_FILE_XFER_DATA:
+        return AGENT_PRIO_BULK;
+    /* they go in the order they're queued in */
+    case VD_AGENT_CLIPBOARD:
+    case VD_AGENT_CLIPBOARD_GRAB:
+    case VD_AGENT_CLIPBOARD_REQUEST:
+    case VD_AGENT_CLIPBOARD_RELEASE:
+        return AGENT_PRIO_CLIPBOARD;
+    default:
+        return AGENT_PRIO_CONTROL;
+    }
 }
 
-static void file_xfer_flush_async(SpiceMainChannel *channel, GCancellable *cancellable,
-                                  GAsyncReadyCallback callback, gpointer user_data)
+static AgentMsgOut *agent_msg_out_new(int type)
 {
-    GSimpleAsyncResult *simple;
-    SpiceMainChannelPrivate *c = channel->priv;
-    gboolean was_empty;
+    AgentMsgOut *msg = g_slice_new0(AgentMsgOut);
 
-    simple = g_simple_async_result_new(G_OBJECT(channel), callback, user_data,
-                                       file_xfer_flush_async);
+    g_queue_init(&msg->outs);
+    msg->prio = agent_msg_prio(type);
 
-    was_empty = g_queue_is_empty(c->agent_msg_queue);
-    if (was_empty) {
-        g_simple_async_result_set_op_res_gboolean(simple, TRUE);
-        g_simple_async_result_complete_in_idle(simple);
-        g_object_unref(simple);
-        return;
-    }
+    return msg;
+}
+
+static void agent_msg_out_queue(SpiceMainChannel *channel, AgentMsgOut *msg)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    AgentQueueStats *st = &c->agent_queue_stats[msg->prio];
 
-    c->flushing = g_slist_append(c->flushing, simple);
+    msg->queue_time = g_get_monotonic_time();
+    g_queue_push_tail(&c->agent_msg_queue[msg->prio], msg);
+    st->depth++;
+    st->max_depth = MAX(st->max_depth, st->depth);
 }
 
-static gboolean file_xfer_flush_finish(SpiceMainChannel *channel, GAsyncResult *result,
-                                       GError **error)
+/*
+ * Picks the next agent message to send: the chunks of an agent message
+ * can't be mixed with other messages, but whole messages are sent by
+ * priority. Some tokens are kept for the control messages, so that they
+ * don't wait behind bulk data for the tokens to come back.
+ */
+/* coroutine context */
+static gboolean agent_msg_next(SpiceMainChannel *channel)
 {
-    GSimpleAsyncResult *simple = (GSimpleAsyncResult *)result;
+    SpiceMainChannelPrivate *c = channel->priv;
+    gboolean idle = c->agent_tokens >= c->agent_tokens_window;
+    AgentMsgOut *msg;
+    gint i;
 
-    g_return_val_if_fail(g_simple_async_result_is_valid(result,
-        G_OBJECT(channel), file_xfer_flush_async), FALSE);
+    for (i = 0; i < AGENT_PRIO_LAST; i++) {
+        AgentQueueStats *st = &c->agent_queue_stats[i];
+        gint64 wait;
 
-    if (g_simple_async_result_propagate_error(simple, error)) {
-        return FALSE;
+        if (i > AGENT_PRIO_CONTROL && !idle && c->agent_tokens <= AGENT_TOKENS_RESERVED)
+            break;
+
+        /* the file chunks go when nothing else waits, one per transfer in turn */
+        if (i == AGENT_PRIO_BULK && g_queue_is_empty(&c->agent_msg_queue[i]))
+            file_xfer_queue_next(channel);
+
+        msg = g_queue_pop_head(&c->agent_msg_queue[i]);
+        if (msg == NULL)
+            continue;
+
+        wait = g_get_monotonic_time() - msg->queue_time;
+        st->depth--;
+        st->sent++;
+        st->wait_time_us += wait;
+        st->max_wait_time_us = MAX(st->max_wait_time_us, wait);
+        c->agent_msg_sending = msg;
+        return TRUE;
     }
 
-    CHANNEL_DEBUG(channel, "flushed finished!");
-    return g_simple_async_result_get_op_res_gboolean(simple);
+    return FALSE;
 }
 
 /* coroutine context */
@@ -901,14 +1146,18 @@ static void agent_send_msg_queue(SpiceMainChannel *channel)
     SpiceMainChannelPrivate *c = channel->priv;
     SpiceMsgOut *out;
 
-    while (c->agent_tokens > 0 &&
-           !g_queue_is_empty(c->agent_msg_queue)) {
+    while (c->agent_tokens > 0) {
+        if (c->agent_msg_sending == NULL && !agent_msg_next(channel))
+            break;
+
         c->agent_tokens--;
-        out = g_queue_pop_head(c->agent_msg_queue);
+        out = g_queue_pop_head(&c->agent_msg_sending->outs);
         spice_msg_out_send_internal(out);
-    }
-    if (g_queue_is_empty(c->agent_msg_queue) && c->flushing != NULL) {
-        file_xfer_flushed(channel, TRUE);
+
+        if (g_queue_is_empty(&c->agent_msg_sending->outs)) {
+            agent_msg_out_free(c->agent_msg_sending);
+            c->agent_msg_sending = NULL;
+        }
     }
 }
 
@@ -924,7 +1173,7 @@ G_GNUC_NULL_TERMINATED
 static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void *data, ...)
 {
     va_list args;
-    SpiceMainChannelPrivate *c = channel->priv;
+    AgentMsgOut *queued;
     SpiceMsgOut *out;
     VDAgentMessage msg;
     guint8 *payload;
@@ -944,6 +1193,7 @@ static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void
     msg.opaque = 0;
     msg.size = size;
 
+    queued = agent_msg_out_new(type);
     paysize = MIN(VD_AGENT_MAX_DATA_SIZE, size + sizeof(VDAgentMessage));
     out = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_MAIN_AGENT_DATA);
     payload = spice_marshaller_reserve_space(out->marshaller, paysize);
@@ -951,7 +1201,7 @@ static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void
     payload += sizeof(VDAgentMessage);
     paysize -= sizeof(VDAgentMessage);
     if (paysize == 0) {
-        g_queue_push_tail(c->agent_msg_queue, out);
+        g_queue_push_tail(&queued->outs, out);
         out = NULL;
     }
 
@@ -972,13 +1222,89 @@ static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void
             size -= mins;
             paysize -= mins;
             if (paysize == 0) {
-                g_queue_push_tail(c->agent_msg_queue, out);
+                g_queue_push_tail(&queued->outs, out);
                 out = NULL;
             }
         }
     }
     va_end(args);
     g_warn_if_fail(out == NULL);
+
+    agent_msg_out_queue(channel, queued);
+}
+
+/* the data referenced by the messages of agent_msg_queue_ref() */
+typedef struct {
+    guint refs;
+    GDestroyNotify free_func;
+    gpointer free_data;
+} AgentMsgData;
+
+static void agent_msg_data_unref(uint8_t *data, void *opaque)
+{
+    AgentMsgData *d = opaque;
+
+    if (--d->refs > 0)
+        return;
+
+    d->free_func(d->free_data);
+    g_slice_free(AgentMsgData, d);
+}
+
+/* any context: like agent_msg_queue_many(), with a small @header that is
+   copied, followed by @data that isn't: the messages refer to it until
+   they are sent or dropped, then @free_func is called */
+static void agent_msg_queue_ref(SpiceMainChannel *channel, int type,
+                                const void *header, gsize header_size,
+                                guint8 *data, gsize size,
+                                GDestroyNotify free_func, gpointer free_data)
+{
+    AgentMsgOut *queued;
+    SpiceMsgOut *out;
+    VDAgentMessage msg;
+    AgentMsgData *ref;
+    guint8 *payload;
+    gsize paysize, n;
+
+    g_return_if_fail(sizeof(VDAgentMessage) + header_size <= VD_AGENT_MAX_DATA_SIZE);
+
+    msg.protocol = VD_AGENT_PROTOCOL;
+    msg.type = type;
+    msg.opaque = 0;
+    msg.size = header_size + size;
+
+    queued = agent_msg_out_new(type);
+    out = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_MAIN_AGENT_DATA);
+    payload = spice_marshaller_reserve_space(out->marshaller,
+                                             sizeof(VDAgentMessage) + header_size);
+    memcpy(payload, &msg, sizeof(VDAgentMessage));
+    memcpy(payload + sizeof(VDAgentMessage), header, header_size);
+    paysize = VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage) - header_size;
+
+    ref = g_slice_new(AgentMsgData);
+    ref->refs = 1; /* until all the messages are queued */
+    ref->free_func = free_func;
+    ref->free_data = free_data;
+
+    do {
+        if (out == NULL) {
+            out = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_MAIN_AGENT_DATA);
+            paysize = VD_AGENT_MAX_DATA_SIZE;
+        }
+        n = MIN(paysize, size);
+        if (n > 0) {
+            ref->refs++;
+            spice_marshaller_add_ref_full(out->marshaller, data, n,
+                                          agent_msg_data_unref, ref);
+            data += n;
+            size -= n;
+        }
+        g_queue_push_tail(&queued->outs, out);
+        out = NULL;
+    } while (size > 0);
+
+    agent_msg_out_queue(channel, queued);
+    agent_msg_data_unref(NULL, ref);
 }
 
 static int monitors_cmp(const void *p1, const void *p2, gpointer user_data)
@@ -1032,16 +1358,13 @@ static void monitors_align(VDAgentMonConfig *monitors, int nmonitors)
 #define agent_msg_queue(Channel, Type, Size, Data) \
     agent_msg_queue_many((Channel), (Type), (Data), (Size), NULL)
 
-/**
- * spice_main_send_monitor_config:
- * @channel:
- *
- * Send monitors configuration previously set with
- * spice_main_set_display() and spice_main_set_display_enabled()
- *
- * Returns: %TRUE on success.
- **/
-gboolean spice_main_send_monitor_config(SpiceMainChannel *channel)
+/*
+ * @dedup: the config isn't sent if it is the last one sent. That is only
+ * for the delayed updates: the guest can change its config on its own,
+ * and an explicit request re-asserts this one.
+ */
+/* main context */
+static gboolean monitor_config_send(SpiceMainChannel *channel, gboolean dedup)
 {
     SpiceMainChannelPrivate *c;
     VDAgentMonitorsConfig *mon;
@@ -1094,18 +1417,45 @@ gboolean spice_main_send_monitor_config(SpiceMainChannel *channel)
     if (c->disable_display_align == FALSE)
         monitors_align(mon->monitors, mon->num_of_monitors);
 
-    agent_msg_queue(channel, VD_AGENT_MONITORS_CONFIG, size, mon);
-    g_free(mon);
-
-    spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
     if (c->timer_id != 0) {
         g_source_remove(c->timer_id);
         c->timer_id = 0;
     }
 
+    /* each config makes the guest reallocate its surfaces */
+    if (dedup && c->monitors_config_sent != NULL &&
+        c->monitors_config_sent_size == size &&
+        memcmp(c->monitors_config_sent, mon, size) == 0) {
+        CHANNEL_DEBUG(channel, "monitors config unchanged, not sent");
+        g_free(mon);
+        return TRUE;
+    }
+
+    agent_msg_queue(channel, VD_AGENT_MONITORS_CONFIG, size, mon);
+    g_free(c->monitors_config_sent);
+    c->monitors_config_sent = mon;
+    c->monitors_config_sent_size = size;
+    spice_session_monitors_config_sent(spice_channel_get_session(SPICE_CHANNEL(channel)));
+
+    spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
+
     return TRUE;
 }
 
+/**
+ * spice_main_send_monitor_config:
+ * @channel:
+ *
+ * Send monitors configuration previously set with
+ * spice_main_set_display() and spice_main_set_display_enabled()
+ *
+ * Returns: %TRUE on success.
+ **/
+gboolean spice_main_send_monitor_config(SpiceMainChannel *channel)
+{
+    return monitor_config_send(channel, FALSE);
+}
+
 static void audio_playback_volume_info_cb(GObject *object, GAsyncResult *res, gpointer user_data)
 {
     SpiceMainChannel *main_channel = user_data;
@@ -1148,14 +1498,16 @@ static void audio_playback_volume_info_cb(GObject *object, GAsyncResult *res, gp
 static void agent_sync_audio_playback(SpiceMainChannel *main_channel)
 {
     SpiceSession *session = spice_channel_get_session(SPICE_CHANNEL(main_channel));
-    SpiceAudio *audio = spice_audio_get(session, NULL);
     SpiceMainChannelPrivate *c = main_channel->priv;
+    SpiceAudio *audio;
 
     if (!test_agent_cap(main_channel, VD_AGENT_CAP_AUDIO_VOLUME_SYNC) ||
         c->agent_volume_playback_sync == TRUE) {
         SPICE_DEBUG("%s - is not going to sync audio with guest", __func__);
         return;
     }
+    /* the audio backend is only created when there's something to sync */
+    audio = spice_audio_get(session, NULL);
     /* only one per connection */
     g_cancellable_reset(c->cancellable_volume_info);
     c->agent_volume_playback_sync = TRUE;
@@ -1204,14 +1556,16 @@ static void audio_record_volume_info_cb(GObject *object, GAsyncResult *res, gpoi
 static void agent_sync_audio_record(SpiceMainChannel *main_channel)
 {
     SpiceSession *session = spice_channel_get_session(SPICE_CHANNEL(main_channel));
-    SpiceAudio *audio = spice_audio_get(session, NULL);
     SpiceMainChannelPrivate *c = main_channel->priv;
+    SpiceAudio *audio;
 
     if (!test_agent_cap(main_channel, VD_AGENT_CAP_AUDIO_VOLUME_SYNC) ||
         c->agent_volume_record_sync == TRUE) {
         SPICE_DEBUG("%s - is not going to sync audio with guest", __func__);
         return;
     }
+    /* the audio backend is only created when there's something to sync */
+    audio = spice_audio_get(session, NULL);
     /* only one per connection */
     g_cancellable_reset(c->cancellable_volume_info);
     c->agent_volume_record_sync = TRUE;
@@ -1226,7 +1580,7 @@ static void agent_display_config(SpiceMainChannel *channel)
     SpiceMainChannelPrivate *c = channel->priv;
     VDAgentDisplayConfig config = { 0, };
 
-    if (c->display_disable_wallpaper) {
+    if (c->display_disable_wallpaper || c->display_effects_reduced) {
         config.flags |= VD_AGENT_DISPLAY_CONFIG_FLAG_DISABLE_WALLPAPER;
     }
 
@@ -1234,7 +1588,7 @@ static void agent_display_config(SpiceMainChannel *channel)
         config.flags |= VD_AGENT_DISPLAY_CONFIG_FLAG_DISABLE_FONT_SMOOTH;
     }
 
-    if (c->display_disable_animation) {
+    if (c->display_disable_animation || c->display_effects_reduced) {
         config.flags |= VD_AGENT_DISPLAY_CONFIG_FLAG_DISABLE_ANIMATION;
     }
 
@@ -1248,6 +1602,46 @@ static void agent_display_config(SpiceMainChannel *channel)
     agent_msg_queue(channel, VD_AGENT_DISPLAY_CONFIG, sizeof(VDAgentDisplayConfig), &config);
 }
 
+/*
+ * The wallpaper and the animations are the effects that cost the most
+ * bandwidth, and the least to the user. They are disabled below the
+ * first rate, and enabled again above the second one, well apart so
+ * that an estimate around either of them does not flip the guest
+ * settings back and forth.
+ */
+#define EFFECTS_REDUCE_RATE     (256 * 1024) /* bytes/s, about 2Mbit/s */
+#define EFFECTS_RESTORE_RATE    (1024 * 1024)
+
+/* main context */
+static void session_bandwidth_changed(SpiceSession *session, GParamSpec *pspec,
+                                      gpointer data)
+{
+    SpiceMainChannel *channel = SPICE_MAIN_CHANNEL(data);
+    SpiceMainChannelPrivate *c = channel->priv;
+    guint64 bandwidth = spice_session_get_bandwidth(session);
+    gboolean reduced;
+
+    if (!c->display_effects_auto || bandwidth == 0)
+        return;
+
+    if (c->display_effects_reduced)
+        reduced = bandwidth < EFFECTS_RESTORE_RATE;
+    else
+        reduced = bandwidth < EFFECTS_REDUCE_RATE;
+    if (reduced == c->display_effects_reduced)
+        return;
+
+    CHANNEL_DEBUG(channel, "link at %" G_GUINT64_FORMAT "B/s, guest effects %s",
+                  bandwidth, reduced ? "disabled" : "enabled");
+    c->display_effects_reduced = reduced;
+
+    /* otherwise, the agent gets them when it connects */
+    if (c->agent_connected && c->agent_display_config_sent) {
+        agent_display_config(channel);
+        spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
+    }
+}
+
 /* any context: the message is not flushed immediately,
    you can wakeup() the channel coroutine or send_msg_queue() */
 static void agent_announce_caps(SpiceMainChannel *channel)
@@ -1317,8 +1711,10 @@ static void agent_clipboard_grab(SpiceMainChannel *channel, guint selection,
 
 /* any context: the message is not flushed immediately,
    you can wakeup() the channel coroutine or send_msg_queue() */
+/* @data is released with @free_func when sent, it is copied without */
 static void agent_clipboard_notify(SpiceMainChannel *self, guint selection,
-                                   guint32 type, const guchar *data, size_t size)
+                                   guint32 type, const guchar *data, size_t size,
+                                   GDestroyNotify free_func)
 {
     SpiceMainChannelPrivate *c = self->priv;
     VDAgentClipboard *cb;
@@ -1326,16 +1722,19 @@ static void agent_clipboard_notify(SpiceMainChannel *self, guint selection,
     size_t msgsize;
     gint max_clipboard = spice_main_get_max_clipboard(self);
 
-    g_return_if_fail(c->agent_connected);
-    g_return_if_fail(test_agent_cap(self, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND));
-    g_return_if_fail(max_clipboard == -1 || size < max_clipboard);
-
     msgsize = sizeof(VDAgentClipboard);
+    if (!c->agent_connected ||
+        !test_agent_cap(self, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND) ||
+        (max_clipboard != -1 && size >= max_clipboard)) {
+        g_warn_if_reached();
+        goto drop;
+    }
+
     if (test_agent_cap(self, VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
         msgsize += 4;
     } else if (selection != VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD) {
         CHANNEL_DEBUG(self, "Ignoring clipboard notify");
-        return;
+        goto drop;
     }
 
     msg = g_alloca(msgsize);
@@ -1349,7 +1748,16 @@ static void agent_clipboard_notify(SpiceMainChannel *self, guint selection,
     }
 
     cb->type = type;
-    agent_msg_queue_many(self, VD_AGENT_CLIPBOARD, msg, msgsize, data, size, NULL);
+    if (free_func != NULL)
+        agent_msg_queue_ref(self, VD_AGENT_CLIPBOARD, msg, msgsize,
+                            (guint8 *)data, size, free_func, (gpointer)data);
+    else
+        agent_msg_queue_many(self, VD_AGENT_CLIPBOARD, msg, msgsize, data, size, NULL);
+    return;
+
+drop:
+    if (free_func != NULL)
+        free_func((gpointer)data);
 }
 
 /* any context: the message is not flushed immediately,
@@ -1431,20 +1839,46 @@ static gboolean timer_set_display(gpointer data)
             return FALSE;
         }
 
-    spice_main_send_monitor_config(channel);
+    monitor_config_send(channel, TRUE);
 
     return FALSE;
 }
 
-/* any context  */
-static void update_display_timer(SpiceMainChannel *channel, guint seconds)
+/* any context: the config goes after the pending events, when the main
+   loop is idle */
+static void update_display_timer(SpiceMainChannel *channel, guint delay_ms)
 {
     SpiceMainChannelPrivate *c = channel->priv;
 
     if (c->timer_id)
         g_source_remove(c->timer_id);
 
-    c->timer_id = g_timeout_add_seconds(seconds, timer_set_display, channel);
+    c->timer_id = g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE, delay_ms,
+                                     timer_set_display, channel, NULL);
+}
+
+/*
+ * A resize by a drag changes the config many times a second, the guest
+ * gets it soon after the last change. A single change waits longer, in
+ * case others follow.
+ */
+/* any context */
+static void display_config_changed(SpiceMainChannel *channel)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    gint64 now = g_get_monotonic_time();
+    guint interval = DISPLAY_CONFIG_MAX_DELAY_MS;
+
+    if (c->display_change_time != 0)
+        interval = MIN((now - c->display_change_time) / 1000, DISPLAY_CONFIG_MAX_DELAY_MS);
+    if (c->display_change_interval == 0)
+        c->display_change_interval = DISPLAY_CONFIG_MAX_DELAY_MS / 2;
+    c->display_change_interval = (3 * c->display_change_interval + interval) / 4;
+    c->display_change_time = now;
+
+    update_display_timer(channel, CLAMP(2 * c->display_change_interval,
+                                        DISPLAY_CONFIG_MIN_DELAY_MS,
+                                        DISPLAY_CONFIG_MAX_DELAY_MS));
 }
 
 /* coroutine context  */
@@ -1528,6 +1962,7 @@ static void main_handle_init(SpiceChannel *channel, SpiceMsgIn *in)
     SpiceMsgOut *out;
 
     session = spice_channel_get_session(channel);
+    spice_session_main_reconnected(session, init->session_id);
     spice_session_set_connection_id(session, init->session_id);
 
     set_mouse_mode(SPICE_MAIN_CHANNEL(channel), init->supported_mouse_modes,
@@ -1536,7 +1971,7 @@ static void main_handle_init(SpiceChannel *channel, SpiceMsgIn *in)
     spice_session_set_mm_time(session, init->multi_media_time);
     spice_session_set_caches_hints(session, init->ram_hint, init->display_channels_hint);
 
-    c->agent_tokens = init->agent_tokens;
+    c->agent_tokens = c->agent_tokens_window = init->agent_tokens;
     if (init->agent_connected)
         agent_start(SPICE_MAIN_CHANNEL(channel));
 
@@ -1591,7 +2026,10 @@ static gboolean _channel_new(channel_new_t *c)
 {
     g_return_val_if_fail(c != NULL, FALSE);
 
-    spice_channel_new(c->session, c->type, c->id);
+    /* after a fast reconnection, the channel may still be there */
+    if (!spice_session_defer_channel(c->session, c->type, c->id) &&
+        !spice_session_reconnect_channel(c->session, c->type, c->id))
+        spice_channel_new(c->session, c->type, c->id);
 
     g_object_unref(c->session);
     g_free(c);
@@ -1622,7 +2060,8 @@ static void main_handle_channels_list(SpiceChannel *channel, SpiceMsgIn *in)
         /* no need to explicitely switch to main context, since
            synchronous call is not needed. */
         /* no need to track idle, session is refed */
-        g_idle_add((GSourceFunc)_channel_new, c);
+        g_idle_add_full(spice_channel_connect_priority(c->type, c->id),
+                        (GSourceFunc)_channel_new, c, NULL);
     }
 }
 
@@ -1645,7 +2084,7 @@ static void main_handle_agent_connected_tokens(SpiceChannel *channel, SpiceMsgIn
     SpiceMainChannelPrivate *c = SPICE_MAIN_CHANNEL(channel)->priv;
     SpiceMsgMainAgentConnectedTokens *msg = spice_msg_in_parsed(in);
 
-    c->agent_tokens = msg->num_tokens;
+    c->agent_tokens = c->agent_tokens_window = msg->num_tokens;
     agent_start(SPICE_MAIN_CHANNEL(channel));
 }
 
@@ -1655,27 +2094,112 @@ static void main_handle_agent_disconnected(SpiceChannel *channel, SpiceMsgIn *in
     agent_stopped(SPICE_MAIN_CHANNEL(channel));
 }
 
+static SpiceFileXferChunk *file_xfer_chunk_new(SpiceFileXferTask *task)
+{
+    SpiceMainChannelPrivate *c = task->channel->priv;
+    SpiceFileXferChunk *chunk;
+
+    if (c->file_xfer_pool != NULL) {
+        chunk = c->file_xfer_pool->data;
+        c->file_xfer_pool = g_slist_delete_link(c->file_xfer_pool, c->file_xfer_pool);
+    } else {
+        chunk = g_new(SpiceFileXferChunk, 1);
+        c->file_xfer_n_chunks++;
+    }
+    chunk->channel = task->channel;
+    chunk->id = task->id;
+    chunk->size = 0;
+
+    return chunk;
+}
+
+static void file_xfer_chunk_free(SpiceFileXferChunk *chunk)
+{
+    SpiceMainChannelPrivate *c = chunk->channel->priv;
+
+    if (g_slist_length(c->file_xfer_pool) < FILE_XFER_POOL_SIZE) {
+        c->file_xfer_pool = g_slist_prepend(c->file_xfer_pool, chunk);
+    } else {
+        g_free(chunk);
+        c->file_xfer_n_chunks--;
+    }
+}
+
 static void file_xfer_task_free(SpiceFileXferTask *task)
 {
     SpiceMainChannelPrivate *c;
+    SpiceFileXferChunk *chunk;
 
     g_return_if_fail(task != NULL);
 
     c = task->channel->priv;
     g_hash_table_remove(c->file_xfer_tasks, GUINT_TO_POINTER(task->id));
+    g_queue_remove(&c->file_xfer_ready, task);
+    if (task->started)
+        c->file_xfer_n_started--;
+    else
+        g_queue_remove(&c->file_xfer_waiting, task);
+
+    /* the chunks already queued to the agent are freed when sent */
+    while ((chunk = g_queue_pop_head(&task->chunks)) != NULL)
+        file_xfer_chunk_free(chunk);
+    if (task->read_chunk)
+        file_xfer_chunk_free(task->read_chunk);
 
     g_clear_object(&task->channel);
     g_clear_object(&task->file);
     g_clear_object(&task->file_stream);
+    g_clear_object(&task->info);
     g_free(task);
 }
 
+/* main context: the last file of the group completes it */
+static void file_xfer_group_done(SpiceMainChannel *channel, SpiceFileXferGroup *group,
+                                 GError *error)
+{
+    GSimpleAsyncResult *res;
+    gdouble elapsed;
+
+    if (error != NULL && group->error == NULL)
+        group->error = g_error_copy(error);
+    if (++group->n_done < group->n_files)
+        return;
+
+    /* the last progress, before the completion */
+    if (group->progress_pending && group->progress_callback)
+        group->progress_callback(group->sent_bytes, group->total_bytes,
+                                 group->progress_callback_data);
+
+    elapsed = (g_get_monotonic_time() - group->start_time) / 1e6;
+    CHANNEL_DEBUG(channel, "xfer of %u files: %" G_GUINT64_FORMAT " bytes in %.3f s, "
+                  "%.1f files/s, %.1f MB/s", group->n_files, group->sent_bytes, elapsed,
+                  elapsed > 0 ? group->n_files / elapsed : 0.0,
+                  elapsed > 0 ? group->sent_bytes / elapsed / (1024 * 1024) : 0.0);
+
+    /* Notify to user that files have been transferred or something error
+       happened. */
+    res = g_simple_async_result_new(G_OBJECT(channel),
+                                    group->callback,
+                                    group->user_data,
+                                    spice_main_file_copy_async);
+    if (group->error) {
+        g_simple_async_result_take_error(res, group->error);
+        g_simple_async_result_set_op_res_gboolean(res, FALSE);
+    } else {
+        g_simple_async_result_set_op_res_gboolean(res, TRUE);
+    }
+    g_simple_async_result_complete_in_idle(res);
+    g_object_unref(res);
+    g_free(group);
+}
+
 /* main context */
 static void file_xfer_close_cb(GObject      *object,
                                GAsyncResult *close_res,
                                gpointer      user_data)
 {
-    GSimpleAsyncResult *res;
+    SpiceMainChannel *channel;
+    SpiceFileXferGroup *group;
     SpiceFileXferTask *task;
     GError *error = NULL;
 
@@ -1691,58 +2215,126 @@ static void file_xfer_close_cb(GObject      *object,
         }
     }
 
-    /* Notify to user that files have been transferred or something error
-       happened. */
-    res = g_simple_async_result_new(G_OBJECT(task->channel),
-                                    task->callback,
-                                    task->user_data,
-                                    spice_main_file_copy_async);
-    if (task->error) {
-        g_simple_async_result_take_error(res, task->error);
-        g_simple_async_result_set_op_res_gboolean(res, FALSE);
-    } else {
-        g_simple_async_result_set_op_res_gboolean(res, TRUE);
+    if (task->start_time != 0) {
+        gdouble elapsed = (g_get_monotonic_time() - task->start_time) / 1e6;
+
+        CHANNEL_DEBUG(task->channel, "xfer task %u: %" G_GUINT64_FORMAT " bytes in %.3f s, "
+                      "%.1f MB/s", task->id, task->sent_bytes, elapsed,
+                      elapsed > 0 ? task->sent_bytes / elapsed / (1024 * 1024) : 0.0);
     }
-    g_simple_async_result_complete_in_idle(res);
-    g_object_unref(res);
 
+    channel = g_object_ref(task->channel);
+    group = task->group;
+    file_xfer_group_done(channel, group, task->error);
+    g_clear_error(&task->error);
     file_xfer_task_free(task);
+
+    /* its slot goes to the next file */
+    file_xfer_start_next(channel);
+    g_object_unref(channel);
 }
 
-static void file_xfer_data_flushed_cb(GObject *source_object,
-                                      GAsyncResult *res,
-                                      gpointer user_data)
+/* main context */
+static gboolean file_xfer_progress(gpointer user_data)
 {
-    SpiceFileXferTask *task = user_data;
-    SpiceMainChannel *channel = (SpiceMainChannel *)source_object;
-    GError *error = NULL;
+    SpiceMainChannel *channel = user_data;
+    SpiceMainChannelPrivate *c = channel->priv;
+    GHashTableIter iter;
+    gpointer value;
 
-    task->pending = FALSE;
-    file_xfer_flush_finish(channel, res, &error);
-    if (error || task->error) {
-        file_xfer_completed(task, error);
-        return;
+    c->file_xfer_progress_id = 0;
+
+    /* the progress of the whole group */
+    g_hash_table_iter_init(&iter, c->file_xfer_tasks);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        SpiceFileXferGroup *group = ((SpiceFileXferTask *)value)->group;
+
+        if (!group->progress_pending)
+            continue;
+        group->progress_pending = FALSE;
+        if (group->progress_callback)
+            group->progress_callback(group->sent_bytes, group->total_bytes,
+                                     group->progress_callback_data);
     }
 
-    if (task->progress_callback)
-        task->progress_callback(task->read_bytes, task->file_size,
-                                task->progress_callback_data);
+    return FALSE;
+}
+
+/* any context: the agent messages of the chunk are sent, or dropped */
+static void file_xfer_chunk_sent(gpointer data)
+{
+    SpiceFileXferChunk *chunk = data;
+    SpiceMainChannelPrivate *c = chunk->channel->priv;
+    SpiceFileXferTask *task;
 
-    /* Read more data */
-    file_xfer_continue_read(task);
+    if (--chunk->refs > 0)
+        return;
+
+    task = g_hash_table_lookup(c->file_xfer_tasks, GUINT_TO_POINTER(chunk->id));
+    if (task != NULL) {
+        task->n_chunks--;
+        task->sent_bytes += chunk->size;
+        task->group->sent_bytes += chunk->size;
+        task->group->progress_pending = TRUE;
+        if (c->file_xfer_progress_id == 0)
+            c->file_xfer_progress_id = g_idle_add(file_xfer_progress, chunk->channel);
+    }
+    file_xfer_chunk_free(chunk);
+
+    /* a slot is free, read the next chunk */
+    if (task != NULL)
+        file_xfer_continue_read(task);
 }
 
-static void file_xfer_queue(SpiceFileXferTask *task, int data_size)
+/*
+ * The transfers take turns, a chunk each. A chunk goes in agent messages
+ * of one token, so that the other agent messages can go in between.
+ */
+/* coroutine context */
+static gboolean file_xfer_queue_next(SpiceMainChannel *channel)
 {
+    SpiceMainChannelPrivate *c = channel->priv;
     VDAgentFileXferDataMessage msg;
-    SpiceMainChannel *channel = SPICE_MAIN_CHANNEL(task->channel);
+    SpiceFileXferTask *task;
+    SpiceFileXferChunk *chunk;
+    gsize pos = 0;
+
+    task = g_queue_pop_head(&c->file_xfer_ready);
+    if (task == NULL)
+        return FALSE;
+
+    chunk = g_queue_pop_head(&task->chunks);
+    if (!g_queue_is_empty(&task->chunks))
+        g_queue_push_tail(&c->file_xfer_ready, task);
 
     msg.id = task->id;
-    msg.size = data_size;
-    agent_msg_queue_many(channel, VD_AGENT_FILE_XFER_DATA,
-                         &msg, sizeof(msg),
-                         task->buffer, data_size, NULL);
-    spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
+    chunk->refs = 1;
+    do {
+        msg.size = MIN(chunk->size - pos, FILE_XFER_DATA_MSG_SIZE);
+        chunk->refs++;
+        agent_msg_queue_ref(channel, VD_AGENT_FILE_XFER_DATA,
+                            &msg, sizeof(msg),
+                            chunk->data + pos, msg.size,
+                            file_xfer_chunk_sent, chunk);
+        pos += msg.size;
+    } while (pos < chunk->size);
+    file_xfer_chunk_sent(chunk);
+
+    return TRUE;
+}
+
+static void file_xfer_queue(SpiceFileXferTask *task, SpiceFileXferChunk *chunk)
+{
+    SpiceMainChannelPrivate *c = task->channel->priv;
+
+    g_queue_push_tail(&task->chunks, chunk);
+    task->n_chunks++;
+    /* prefetched until the agent takes it */
+    if (!task->can_send)
+        return;
+    if (g_queue_get_length(&task->chunks) == 1)
+        g_queue_push_tail(&c->file_xfer_ready, task);
+    spice_channel_wakeup(SPICE_CHANNEL(task->channel), FALSE);
 }
 
 /* main context */
@@ -1751,28 +2343,35 @@ static void file_xfer_read_cb(GObject *source_object,
                               gpointer user_data)
 {
     SpiceFileXferTask *task = user_data;
-    SpiceMainChannel *channel = task->channel;
+    SpiceFileXferChunk *chunk = task->read_chunk;
     gssize count;
     GError *error = NULL;
 
-    task->pending = FALSE;
+    task->pending--;
+    task->read_chunk = NULL;
     count = g_input_stream_read_finish(G_INPUT_STREAM(task->file_stream),
                                        res, &error);
     /* Check for pending earlier errors */
     if (task->error) {
+        file_xfer_chunk_free(chunk);
         file_xfer_completed(task, error);
         return;
     }
 
     if (count > 0 || task->file_size == 0) {
         task->read_bytes += count;
-        file_xfer_queue(task, count);
-        if (count == 0)
-            return;
-        file_xfer_flush_async(channel, task->cancellable,
-                              file_xfer_data_flushed_cb, task);
-        task->pending = TRUE;
-    } else if (error) {
+        /* don't wait for a read of 0 when the size is known */
+        if (count == 0 || task->read_bytes >= task->file_size)
+            task->eof = TRUE;
+        chunk->size = count;
+        file_xfer_queue(task, chunk);
+        /* reads ahead, while the chunks are sent */
+        file_xfer_continue_read(task);
+        return;
+    }
+
+    file_xfer_chunk_free(chunk);
+    if (error) {
         VDAgentFileXferStatusMessage msg = {
             .id = task->id,
             .result = VD_AGENT_FILE_XFER_STATUS_ERROR,
@@ -1781,21 +2380,34 @@ static void file_xfer_read_cb(GObject *source_object,
                              &msg, sizeof(msg), NULL);
         spice_channel_wakeup(SPICE_CHANNEL(task->channel), FALSE);
         file_xfer_completed(task, error);
+        return;
     }
     /* else EOF, do nothing (wait for VD_AGENT_FILE_XFER_STATUS from agent) */
+    task->eof = TRUE;
 }
 
-/* coroutine context */
+/*
+ * any context: up to FILE_XFER_READ_AHEAD chunks are read and not sent,
+ * the first one while the agent is asked for the transfer
+ */
 static void file_xfer_continue_read(SpiceFileXferTask *task)
 {
+    if (task->pending || task->eof || task->error ||
+        task->n_chunks >= (task->can_send ? FILE_XFER_READ_AHEAD : 1))
+        return;
+
+    if (task->start_time == 0)
+        task->start_time = g_get_monotonic_time();
+
+    task->read_chunk = file_xfer_chunk_new(task);
     g_input_stream_read_async(G_INPUT_STREAM(task->file_stream),
-                              task->buffer,
+                              task->read_chunk->data,
                               FILE_XFER_CHUNK_SIZE,
                               G_PRIORITY_DEFAULT,
                               task->cancellable,
                               file_xfer_read_cb,
                               task);
-    task->pending = TRUE;
+    task->pending++;
 }
 
 /* coroutine context */
@@ -1817,12 +2429,17 @@ static void file_xfer_handle_status(SpiceMainChannel *channel,
 
     switch (msg->result) {
     case VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA:
-        if (task->pending) {
+        /* but the prefetch */
+        if (task->pending && task->read_chunk == NULL) {
             error = g_error_new(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
                            "transfer received CAN_SEND_DATA in pending state");
             break;
         }
+        task->can_send = TRUE;
+        if (!g_queue_is_empty(&task->chunks))
+            g_queue_push_tail(&c->file_xfer_ready, task);
         file_xfer_continue_read(task);
+        spice_channel_wakeup(channel, FALSE);
         return;
     case VD_AGENT_FILE_XFER_STATUS_CANCELLED:
         error = g_error_new(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
@@ -1996,10 +2613,54 @@ static void main_agent_handle_msg(SpiceChannel *channel,
     }
 }
 
+/*
+ * The clipboard data that spans several messages may be streamed to
+ * the consumer: only its header is gathered, and each part is given as
+ * it arrives, straight from the message.
+ */
+/* coroutine context */
+static guint32 agent_clipboard_header_size(SpiceMainChannel *self)
+{
+    SpiceMainChannelPrivate *c = self->priv;
+    guint32 size = sizeof(VDAgentClipboard);
+
+    if (c->agent_msg.type != VD_AGENT_CLIPBOARD ||
+        !g_signal_has_handler_pending(self, signals[SPICE_MAIN_CLIPBOARD_SELECTION_CHUNK],
+                                      0, FALSE))
+        return c->agent_msg.size;
+
+    if (test_agent_cap(self, VD_AGENT_CAP_CLIPBOARD_SELECTION))
+        size += 4;
+
+    return MIN(size, c->agent_msg.size);
+}
+
+/* coroutine context */
+static gboolean agent_clipboard_chunk(SpiceMainChannel *self, guint8 *data, guint32 size)
+{
+    SpiceMainChannelPrivate *c = self->priv;
+    guint32 header_size = c->agent_msg_data_size;
+    VDAgentClipboard *cb;
+    guint selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    gboolean ret = FALSE;
+
+    if (header_size > sizeof(VDAgentClipboard))
+        selection = c->agent_msg_data[0];
+    cb = (VDAgentClipboard *)(c->agent_msg_data + header_size - sizeof(VDAgentClipboard));
+
+    g_coroutine_signal_emit(self, signals[SPICE_MAIN_CLIPBOARD_SELECTION_CHUNK], 0,
+                            selection, cb->type, data, size,
+                            c->agent_msg_pos - sizeof(VDAgentMessage) - header_size,
+                            c->agent_msg.size - header_size, &ret);
+
+    return ret;
+}
+
 /* coroutine context */
 static void main_handle_agent_data_msg(SpiceChannel* channel, int* msg_size, guchar** msg_pos)
 {
-    SpiceMainChannelPrivate *c = SPICE_MAIN_CHANNEL(channel)->priv;
+    SpiceMainChannel *self = SPICE_MAIN_CHANNEL(channel);
+    SpiceMainChannelPrivate *c = self->priv;
     int n;
 
     if (c->agent_msg_pos < sizeof(VDAgentMessage)) {
@@ -2012,12 +2673,37 @@ static void main_handle_agent_data_msg(SpiceChannel* channel, int* msg_size, guc
             SPICE_DEBUG("agent msg start: msg_size=%d, protocol=%d, type=%d",
                         c->agent_msg.size, c->agent_msg.protocol, c->agent_msg.type);
             g_return_if_fail(c->agent_msg_data == NULL);
-            c->agent_msg_data = g_malloc0(c->agent_msg.size);
+            /* every byte is written, no need to clear it */
+            c->agent_msg_data_size = agent_clipboard_header_size(self);
+            c->agent_msg_data = g_malloc(c->agent_msg_data_size);
         }
     }
 
     if (c->agent_msg_pos >= sizeof(VDAgentMessage)) {
-        n = MIN(sizeof(VDAgentMessage) + c->agent_msg.size - c->agent_msg_pos, *msg_size);
+        guint32 data_pos = c->agent_msg_pos - sizeof(VDAgentMessage);
+
+        n = MIN(c->agent_msg.size - data_pos, *msg_size);
+        if (n > 0 && !c->agent_msg_streaming && data_pos == c->agent_msg_data_size) {
+            /* the header is complete, the rest may be streamed */
+            if (agent_clipboard_chunk(self, *msg_pos, n)) {
+                c->agent_msg_streaming = TRUE;
+                c->agent_msg_pos += n;
+                *msg_size -= n;
+                *msg_pos += n;
+            } else {
+                c->agent_msg_data = g_realloc(c->agent_msg_data, c->agent_msg.size);
+                c->agent_msg_data_size = c->agent_msg.size;
+            }
+        } else if (n > 0 && c->agent_msg_streaming) {
+            agent_clipboard_chunk(self, *msg_pos, n);
+            c->agent_msg_pos += n;
+            *msg_size -= n;
+            *msg_pos += n;
+        }
+    }
+
+    if (c->agent_msg_pos >= sizeof(VDAgentMessage) && !c->agent_msg_streaming) {
+        n = MIN(sizeof(VDAgentMessage) + c->agent_msg_data_size - c->agent_msg_pos, *msg_size);
         memcpy(c->agent_msg_data + c->agent_msg_pos - sizeof(VDAgentMessage), *msg_pos, n);
         c->agent_msg_pos += n;
         *msg_size -= n;
@@ -2025,9 +2711,13 @@ static void main_handle_agent_data_msg(SpiceChannel* channel, int* msg_size, guc
     }
 
     if (c->agent_msg_pos == sizeof(VDAgentMessage) + c->agent_msg.size) {
-        main_agent_handle_msg(channel, &c->agent_msg, c->agent_msg_data);
+        /* the streamed data was given already */
+        if (!c->agent_msg_streaming)
+            main_agent_handle_msg(channel, &c->agent_msg, c->agent_msg_data);
         g_free(c->agent_msg_data);
         c->agent_msg_data = NULL;
+        c->agent_msg_data_size = 0;
+        c->agent_msg_streaming = FALSE;
         c->agent_msg_pos = 0;
     }
 }
@@ -2079,11 +2769,13 @@ static void migrate_channel_new_cb(SpiceSession *s, SpiceChannel *channel, gpoin
                      G_CALLBACK(migrate_channel_event_cb), data);
 }
 
-static SpiceChannel* migrate_channel_connect(spice_migrate *mig, int type, int id)
+static SpiceChannel* migrate_channel_connect(spice_migrate *mig, int type, int id,
+                                             gboolean hold_link)
 {
     SPICE_DEBUG("migrate_channel_connect %d:%d", type, id);
 
     SpiceChannel *newc = spice_channel_new(mig->session, type, id);
+    spice_channel_hold_link(newc, hold_link);
     spice_channel_connect(newc);
     mig->nchannels++;
 
@@ -2116,13 +2808,10 @@ static void migrate_channel_event_cb(SpiceChannel *channel, SpiceChannelEvent ev
 {
     spice_migrate *mig = data;
     SpiceChannelPrivate  *c = SPICE_CHANNEL(channel)->priv;
-    SpiceSession *session;
 
     g_return_if_fail(mig->nchannels > 0);
     g_signal_handlers_disconnect_by_func(channel, migrate_channel_event_cb, data);
 
-    session = spice_channel_get_session(mig->src_channel);
-
     switch (event) {
     case SPICE_CHANNEL_OPENED:
 
@@ -2137,15 +2826,13 @@ static void migrate_channel_event_cb(SpiceChannel *channel, SpiceChannelEvent ev
                 c->state = SPICE_CHANNEL_STATE_MIGRATING;
                 mig->nchannels--;
             }
-            /* now connect the rest of the channels */
+            /* now link the rest of the channels, already connected */
             GList *channels, *l;
-            l = channels = spice_session_get_channels(session);
+            l = channels = spice_session_get_channels(mig->session);
             while (l != NULL) {
-                SpiceChannelPrivate  *curc = SPICE_CHANNEL(l->data)->priv;
+                if (l->data != channel)
+                    spice_channel_hold_link(l->data, FALSE);
                 l = l->next;
-                if (curc->channel_type == SPICE_CHANNEL_MAIN)
-                    continue;
-                migrate_channel_connect(mig, curc->channel_type, curc->channel_id);
             }
             g_list_free(channels);
         } else {
@@ -2195,6 +2882,7 @@ static gboolean migrate_connect(gpointer data)
 {
     spice_migrate *mig = data;
     SpiceChannelPrivate  *c;
+    GList *channels, *l;
     int port, sport;
     const char *host;
 
@@ -2262,9 +2950,22 @@ static gboolean migrate_connect(gpointer data)
     g_signal_emit(mig->src_channel, signals[SPICE_MIGRATION_STARTED], 0,
                   mig->session);
 
+    /* the CA is not loaded again for the destination */
+    spice_session_share_ssl_ctx(mig->session, spice_channel_get_session(mig->src_channel));
+
     /* the migration process is in 2 steps, first the main channel and
-       then the rest of the channels */
-    migrate_channel_connect(mig, SPICE_CHANNEL_MAIN, 0);
+       then the rest of the channels: they connect meanwhile, and only
+       wait for the destination main channel to send their link */
+    migrate_channel_connect(mig, SPICE_CHANNEL_MAIN, 0, FALSE);
+    channels = spice_session_get_channels(spice_channel_get_session(mig->src_channel));
+    for (l = channels; l != NULL; l = l->next) {
+        SpiceChannelPrivate *curc = SPICE_CHANNEL(l->data)->priv;
+
+        if (curc->channel_type == SPICE_CHANNEL_MAIN)
+            continue;
+        migrate_channel_connect(mig, curc->channel_type, curc->channel_id, TRUE);
+    }
+    g_list_free(channels);
 
     return FALSE;
 }
@@ -2279,6 +2980,7 @@ static void main_migrate_connect(SpiceChannel *channel,
     spice_migrate mig = { 0, };
     SpiceMsgOut *out;
     SpiceSession *session;
+    GList *channels, *l;
 
     mig.src_channel = channel;
     mig.info = dst_info;
@@ -2302,6 +3004,13 @@ static void main_migrate_connect(SpiceChannel *channel,
     /* switch to main loop and wait for connections */
     coroutine_yield(NULL);
 
+    /* the channels still connecting must not get back to this frame */
+    g_signal_handlers_disconnect_by_func(mig.session, migrate_channel_new_cb, &mig);
+    channels = spice_session_get_channels(mig.session);
+    for (l = channels; l != NULL; l = l->next)
+        g_signal_handlers_disconnect_by_func(l->data, migrate_channel_event_cb, &mig);
+    g_list_free(channels);
+
     if (mig.nchannels != 0) {
         CHANNEL_DEBUG(channel, "migrate failed: some channels failed to connect");
         spice_session_abort_migration(session);
@@ -2525,14 +3234,15 @@ gboolean spice_main_agent_test_capability(SpiceMainChannel *channel, guint32 cap
  * @y: y position
  * @width: display width
  * @height: display height
- * @update: if %TRUE, update guest resolution after 1sec.
+ * @update: if %TRUE, update guest resolution once the changes stop.
  *
  * Update the display @id resolution.
  *
  * If @update is %TRUE, the remote configuration will be updated too
- * after 1 second without further changes. You can send when you want
- * without delay the new configuration to the remote with
- * spice_main_send_monitor_config()
+ * when there are no further changes, after up to 1 second. You can send
+ * when you want without delay the new configuration to the remote with
+ * spice_main_send_monitor_config(). The delayed update isn't sent if the
+ * configuration is the one last sent.
  **/
 void spice_main_update_display(SpiceMainChannel *channel, int id,
                                int x, int y, int width, int height,
@@ -2557,7 +3267,7 @@ void spice_main_update_display(SpiceMainChannel *channel, int id,
     c->display[id].height = height;
 
     if (update)
-        update_display_timer(channel, 1);
+        display_config_changed(channel);
 }
 
 /**
@@ -2688,7 +3398,34 @@ void spice_main_clipboard_selection_notify(SpiceMainChannel *channel, guint sele
     g_return_if_fail(channel != NULL);
     g_return_if_fail(SPICE_IS_MAIN_CHANNEL(channel));
 
-    agent_clipboard_notify(channel, selection, type, data, size);
+    agent_clipboard_notify(channel, selection, type, data, size, NULL);
+    spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
+}
+
+/**
+ * spice_main_clipboard_selection_notify_full:
+ * @channel: a #SpiceMainChannel
+ * @selection: one of the clipboard #VD_AGENT_CLIPBOARD_SELECTION_*
+ * @type: a #VD_AGENT_CLIPBOARD type
+ * @data: (transfer full): clipboard data
+ * @size: data length in bytes
+ * @free_func: function to release @data
+ *
+ * Send the clipboard data to the guest, like
+ * spice_main_clipboard_selection_notify(), without a copy of @data. The
+ * agent messages refer to it until they are sent, then @free_func is
+ * called on it.
+ *
+ * Since: 0.29
+ **/
+void spice_main_clipboard_selection_notify_full(SpiceMainChannel *channel, guint selection,
+                                                guint32 type, guchar *data, size_t size,
+                                                GDestroyNotify free_func)
+{
+    g_return_if_fail(SPICE_IS_MAIN_CHANNEL(channel));
+    g_return_if_fail(free_func != NULL);
+
+    agent_clipboard_notify(channel, selection, type, data, size, free_func);
     spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
 }
 
@@ -2762,7 +3499,7 @@ void spice_main_set_display_enabled(SpiceMainChannel *channel, int id, gboolean
         c->display[id].enabled_set = TRUE;
     }
 
-    update_display_timer(channel, 1);
+    display_config_changed(channel);
 }
 
 static void file_xfer_completed(SpiceFileXferTask *task, GError *error)
@@ -2789,32 +3526,26 @@ static void file_xfer_completed(SpiceFileXferTask *task, GError *error)
                                task->cancellable,
                                file_xfer_close_cb,
                                task);
-    task->pending = TRUE;
+    task->pending++;
 }
 
-static void file_xfer_info_async_cb(GObject *obj, GAsyncResult *res, gpointer data)
+/* main context: once the file is opened and its size known */
+static void file_xfer_send_start(SpiceFileXferTask *task)
 {
-    GFileInfo *info;
-    GFile *file = G_FILE(obj);
-    GError *error = NULL;
-    GKeyFile *keyfile = NULL;
-    gchar *basename = NULL;
+    GKeyFile *keyfile;
+    gchar *basename;
     VDAgentFileXferStartMessage msg;
     gsize /*msg_size*/ data_len;
     gchar *string;
-    SpiceFileXferTask *task = (SpiceFileXferTask *)data;
-
-    task->pending = FALSE;
-    info = g_file_query_info_finish(file, res, &error);
-    if (error || task->error)
-        goto failed;
+    GError *error = NULL;
 
     task->file_size =
-        g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+        g_file_info_get_attribute_uint64(task->info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+    task->group->total_bytes += task->file_size;
     keyfile = g_key_file_new();
 
     /* File name */
-    basename = g_file_get_basename(file);
+    basename = g_file_get_basename(task->file);
     g_key_file_set_string(keyfile, "vdagent-file-xfer", "name", basename);
     g_free(basename);
     /* File size */
@@ -2824,8 +3555,10 @@ static void file_xfer_info_async_cb(GObject *obj, GAsyncResult *res, gpointer da
        need to be sent to guest */
     string = g_key_file_to_data(keyfile, &data_len, &error);
     g_key_file_free(keyfile);
-    if (error)
-        goto failed;
+    if (error) {
+        file_xfer_completed(task, error);
+        return;
+    }
 
     /* Create file-xfer start message */
     msg.id = task->id;
@@ -2834,10 +3567,25 @@ static void file_xfer_info_async_cb(GObject *obj, GAsyncResult *res, gpointer da
                          string, data_len + 1, NULL);
     g_free(string);
     spice_channel_wakeup(SPICE_CHANNEL(task->channel), FALSE);
-    return;
 
-failed:
-    file_xfer_completed(task, error);
+    /* the first chunk is read during the round-trip to the agent */
+    file_xfer_continue_read(task);
+}
+
+static void file_xfer_info_async_cb(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    SpiceFileXferTask *task = (SpiceFileXferTask *)data;
+    GError *error = NULL;
+
+    task->pending--;
+    task->info = g_file_query_info_finish(G_FILE(obj), res, &error);
+    if (error || task->error) {
+        file_xfer_completed(task, error);
+        return;
+    }
+
+    if (task->file_stream != NULL)
+        file_xfer_send_start(task);
 }
 
 static void file_xfer_read_async_cb(GObject *obj, GAsyncResult *res, gpointer data)
@@ -2846,13 +3594,30 @@ static void file_xfer_read_async_cb(GObject *obj, GAsyncResult *res, gpointer da
     SpiceFileXferTask *task = (SpiceFileXferTask *)data;
     GError *error = NULL;
 
-    task->pending = FALSE;
+    task->pending--;
     task->file_stream = g_file_read_finish(file, res, &error);
     if (error || task->error) {
         file_xfer_completed(task, error);
         return;
     }
 
+    if (task->info != NULL)
+        file_xfer_send_start(task);
+}
+
+/* main context: the file is opened and its size queried at once */
+static void file_xfer_start(SpiceFileXferTask *task)
+{
+    SpiceMainChannelPrivate *c = task->channel->priv;
+
+    task->started = TRUE;
+    c->file_xfer_n_started++;
+
+    g_file_read_async(task->file,
+                      G_PRIORITY_DEFAULT,
+                      task->cancellable,
+                      file_xfer_read_async_cb,
+                      task);
     g_file_query_info_async(task->file,
                             G_FILE_ATTRIBUTE_STANDARD_SIZE,
                             G_FILE_QUERY_INFO_NONE,
@@ -2860,9 +3625,41 @@ static void file_xfer_read_async_cb(GObject *obj, GAsyncResult *res, gpointer da
                             task->cancellable,
                             file_xfer_info_async_cb,
                             task);
-    task->pending = TRUE;
+    task->pending += 2;
+}
+
+/* main context */
+static void file_xfer_start_next(SpiceMainChannel *channel)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    SpiceFileXferTask *task;
+
+    /* the cancelled tasks complete from the loop, not recursively */
+    if (c->file_xfer_starting)
+        return;
+    c->file_xfer_starting = TRUE;
+    while (c->agent_connected && c->file_xfer_n_started < FILE_XFER_WINDOW &&
+           (task = g_queue_pop_head(&c->file_xfer_waiting)) != NULL) {
+        if (g_cancellable_is_cancelled(task->cancellable)) {
+            GError *error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                                "The transfer was cancelled");
+
+            /* it isn't waiting anymore */
+            task->started = TRUE;
+            c->file_xfer_n_started++;
+            file_xfer_completed(task, error);
+            continue;
+        }
+        file_xfer_start(task);
+    }
+    c->file_xfer_starting = FALSE;
 }
 
+/*
+ * The files are transferred FILE_XFER_WINDOW at a time: a folder of
+ * small files would otherwise wait for one agent round-trip per file,
+ * or open them all at once.
+ */
 static void file_xfer_send_start_msg_async(SpiceMainChannel *channel,
                                            GFile **files,
                                            GFileCopyFlags flags,
@@ -2873,32 +3670,43 @@ static void file_xfer_send_start_msg_async(SpiceMainChannel *channel,
                                            gpointer user_data)
 {
     SpiceMainChannelPrivate *c = channel->priv;
+    SpiceFileXferGroup *group;
     SpiceFileXferTask *task;
     static uint32_t xfer_id;    /* Used to identify task id */
     gint i;
 
+    group = g_new0(SpiceFileXferGroup, 1);
+    group->progress_callback = progress_callback;
+    group->progress_callback_data = progress_callback_data;
+    group->callback = callback;
+    group->user_data = user_data;
+    group->start_time = g_get_monotonic_time();
+
     for (i = 0; files[i] != NULL && !g_cancellable_is_cancelled(cancellable); i++) {
         task = g_malloc0(sizeof(SpiceFileXferTask));
         task->id = ++xfer_id;
         task->channel = g_object_ref(channel);
+        task->group = group;
         task->file = g_object_ref(files[i]);
         task->flags = flags;
         task->cancellable = cancellable;
-        task->progress_callback = progress_callback;
-        task->progress_callback_data = progress_callback_data;
-        task->callback = callback;
-        task->user_data = user_data;
+        group->n_files++;
 
         CHANNEL_DEBUG(task->channel, "Insert a xfer task:%d to task list", task->id);
         g_hash_table_insert(c->file_xfer_tasks, GUINT_TO_POINTER(task->id), task);
+        g_queue_push_tail(&c->file_xfer_waiting, task);
+    }
+
+    if (group->n_files == 0) {
+        GError *error = NULL;
 
-        g_file_read_async(files[i],
-                          G_PRIORITY_DEFAULT,
-                          cancellable,
-                          file_xfer_read_async_cb,
-                          task);
-        task->pending = TRUE;
+        group->n_files = 1;
+        g_cancellable_set_error_if_cancelled(cancellable, &error);
+        file_xfer_group_done(channel, group, error);
+        g_clear_error(&error);
+        return;
     }
+    file_xfer_start_next(channel);
 }
 
 /**
@@ -2922,7 +3730,11 @@ static void file_xfer_send_start_msg_async(SpiceMainChannel *channel,
  * setting this to a #GFileProgressCallback function. @progress_callback_data
  * will be passed to this function. It is guaranteed that this callback will
  * be called after all data has been transferred with the total number of bytes
- * copied during the operation.
+ * copied during the operation. The progress is the one of all the @sources,
+ * whose size is counted as they are opened.
+ *
+ * A few of the @sources are transferred at the same time, and @callback is
+ * called once all of them are transferred, with the first error if any.
  *
  * When the operation is finished, callback will be called. You can then call
  * spice_main_file_copy_finish() to get the result of the operation.
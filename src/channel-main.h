@@ -77,6 +77,8 @@ gboolean spice_main_send_monitor_config(SpiceMainChannel *channel);
 void spice_main_clipboard_selection_grab(SpiceMainChannel *channel, guint selection, guint32 *types, int ntypes);
 void spice_main_clipboard_selection_release(SpiceMainChannel *channel, guint selection);
 void spice_main_clipboard_selection_notify(SpiceMainChannel *channel, guint selection, guint32 type, const guchar *data, size_t size);
+void spice_main_clipboard_selection_notify_full(SpiceMainChannel *channel, guint selection, guint32 type,
+                                                guchar *data, size_t size, GDestroyNotify free_func);
 void spice_main_clipboard_selection_request(SpiceMainChannel *channel, guint selection, guint32 type);
 
 gboolean spice_main_agent_test_capability(SpiceMainChannel *channel, guint32 cap);
@@ -21,4 +21,24 @@
 gboolean spice_playback_channel_is_active(SpicePlaybackChannel *channel);
 guint32 spice_playback_channel_get_latency(SpicePlaybackChannel *channel);
 void spice_playback_channel_sync_latency(SpicePlaybackChannel *channel);
+guint32 spice_playback_channel_get_jitter(SpicePlaybackChannel *channel);
+
+/*
+ * An audio backend that takes the data directly from the channel,
+ * instead of a copy from the SpicePlaybackChannel::playback-data
+ * signal handler.
+ */
+typedef struct {
+    /* returns a buffer of up to *size bytes to decode into, or NULL */
+    gpointer (*begin_write)(gpointer user_data, gsize *size);
+    void (*cancel_write)(gpointer user_data);
+    /* when @free_func is set, @audio is kept until it is called, else it
+       is from begin_write() or copied; returns FALSE if it was dropped */
+    gboolean (*write)(gpointer user_data, gpointer audio, gsize size,
+                      GDestroyNotify free_func, gpointer free_data);
+} SpicePlaybackSink;
+
+void spice_playback_channel_set_sink(SpicePlaybackChannel *channel,
+                                     const SpicePlaybackSink *sink,
+                                     gpointer user_data);
 #endif
@@ -17,12 +17,16 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_AUDIO
+
 #include "spice-client.h"
 #include "spice-common.h"
 #include "spice-channel-priv.h"
 #include "spice-session-priv.h"
+#include "channel-playback-priv.h"
 
 #include "spice-marshal.h"
+#include "spice-trace.h"
 
 #include "common/snd_codec.h"
 
@@ -59,6 +63,10 @@ struct _SpicePlaybackChannelPrivate {
     gboolean                    is_active;
     guint32                     latency;
     guint32                     min_latency;
+    const SpicePlaybackSink     *sink;
+    gpointer                    sink_data;
+    guint32                     jitter; /* of the arrival times, in 1/16 ms */
+    gint32                      last_transit;
 };
 
 G_DEFINE_TYPE(SpicePlaybackChannel, spice_playback_channel, SPICE_TYPE_CHANNEL)
@@ -106,6 +114,8 @@ static void spice_playback_channel_init(SpicePlaybackChannel *channel)
     channel->priv = SPICE_PLAYBACK_CHANNEL_GET_PRIVATE(channel);
 
     spice_playback_channel_reset_capabilities(SPICE_CHANNEL(channel));
+    /* the audio is small and late is lost: read it before the display */
+    SPICE_CHANNEL(channel)->priv->coroutine.priority = G_PRIORITY_HIGH;
 }
 
 static void spice_playback_channel_finalize(GObject *obj)
@@ -302,6 +312,90 @@ static void spice_playback_channel_class_init(SpicePlaybackChannelClass *klass)
 
 /* ------------------------------------------------------------------ */
 
+/* RFC 3550 interarrival jitter of the packets */
+/* coroutine context */
+static void playback_update_jitter(SpiceChannel *channel, guint32 time)
+{
+    SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(channel)->priv;
+    gint32 transit = (guint32)(g_get_monotonic_time() / 1000) - time;
+
+    if (c->frame_count != 0) {
+        gint32 d = ABS(transit - c->last_transit);
+
+        c->jitter += (d * 16 - (gint32)c->jitter) / 16;
+    }
+    c->last_transit = transit;
+}
+
+/* the sink has the data, the signal is only for the other users */
+static gboolean playback_data_wanted(SpiceChannel *channel)
+{
+    SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(channel)->priv;
+
+    return c->sink == NULL ||
+        g_signal_has_handler_pending(channel, signals[SPICE_PLAYBACK_DATA], 0, FALSE);
+}
+
+/* coroutine context: yields, no sink buffer may be outstanding */
+static void playback_emit_data(SpiceChannel *channel, gpointer data, gint size)
+{
+    SPICE_TRACE1(audio_data, size);
+
+    if (!playback_data_wanted(channel))
+        return;
+
+    g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_DATA], 0, data, size);
+}
+
+/*
+ * Hands the raw data to the sink with the message it is in, or decodes
+ * into the sink buffer. Returns FALSE to fall back to a copy, always
+ * when the data is also emitted: the signal yields to the main context,
+ * which could use the stream while its buffer is outstanding.
+ */
+/* coroutine context */
+static gboolean playback_sink_write(SpiceChannel *channel, SpiceMsgIn *in,
+                                    SpiceMsgPlaybackPacket *packet)
+{
+    SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(channel)->priv;
+    gsize size = SND_CODEC_MAX_FRAME_SIZE * 2 * 2;
+    gpointer buf;
+    int n;
+
+    if (c->mode == SPICE_AUDIO_DATA_MODE_RAW) {
+        /* the message keeps the data for the signal */
+        spice_msg_in_ref(in);
+        if (!c->sink->write(c->sink_data, packet->data, packet->data_size,
+                            (GDestroyNotify)spice_msg_in_unref, in))
+            spice_msg_in_unref(in);
+        playback_emit_data(channel, packet->data, packet->data_size);
+        return TRUE;
+    }
+
+    if (playback_data_wanted(channel))
+        return FALSE;
+
+    buf = c->sink->begin_write(c->sink_data, &size);
+    if (buf == NULL)
+        return FALSE;
+    if (size < SND_CODEC_MAX_FRAME_SIZE * 2 * 2) {
+        c->sink->cancel_write(c->sink_data);
+        return FALSE;
+    }
+
+    n = size;
+    if (snd_codec_decode(c->codec, packet->data, packet->data_size,
+                         buf, &n) != SND_CODEC_OK) {
+        g_warning("snd_codec_decode() error");
+        c->sink->cancel_write(c->sink_data);
+        return TRUE;
+    }
+
+    c->sink->write(c->sink_data, buf, n, NULL, NULL);
+
+    return TRUE;
+}
+
 /* coroutine context */
 static void playback_handle_data(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -317,23 +411,28 @@ static void playback_handle_data(SpiceChannel *channel, SpiceMsgIn *in)
         g_warn_if_reached();
 
     c->last_time = packet->time;
-
-    uint8_t *data = packet->data;
-    int n = packet->data_size;
-    uint8_t pcm[SND_CODEC_MAX_FRAME_SIZE * 2 * 2];
-
-    if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-        n = sizeof(pcm);
-        data = pcm;
-
-        if (snd_codec_decode(c->codec, packet->data, packet->data_size,
-                    pcm, &n) != SND_CODEC_OK) {
-            g_warning("snd_codec_decode() error");
-            return;
+    playback_update_jitter(channel, packet->time);
+
+    if (c->sink == NULL || !playback_sink_write(channel, in, packet)) {
+        uint8_t *data = packet->data;
+        int n = packet->data_size;
+        uint8_t pcm[SND_CODEC_MAX_FRAME_SIZE * 2 * 2];
+
+        if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
+            n = sizeof(pcm);
+            data = pcm;
+
+            if (snd_codec_decode(c->codec, packet->data, packet->data_size,
+                        pcm, &n) != SND_CODEC_OK) {
+                g_warning("snd_codec_decode() error");
+                return;
+            }
         }
-    }
 
-    g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_DATA], 0, data, n);
+        if (c->sink != NULL)
+            c->sink->write(c->sink_data, data, n, NULL, NULL);
+        playback_emit_data(channel, data, n);
+    }
 
     if ((c->frame_count++ % 100) == 0) {
         g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_GET_DELAY], 0);
@@ -486,6 +585,26 @@ guint32 spice_playback_channel_get_latency(SpicePlaybackChannel *channel)
     return channel->priv->latency;
 }
 
+/* @sink may be NULL to remove it */
+G_GNUC_INTERNAL
+void spice_playback_channel_set_sink(SpicePlaybackChannel *channel,
+                                     const SpicePlaybackSink *sink,
+                                     gpointer user_data)
+{
+    g_return_if_fail(SPICE_IS_PLAYBACK_CHANNEL(channel));
+
+    channel->priv->sink = sink;
+    channel->priv->sink_data = user_data;
+}
+
+/* in ms */
+G_GNUC_INTERNAL
+guint32 spice_playback_channel_get_jitter(SpicePlaybackChannel *channel)
+{
+    g_return_val_if_fail(SPICE_IS_PLAYBACK_CHANNEL(channel), 0);
+    return channel->priv->jitter / 16;
+}
+
 G_GNUC_INTERNAL
 void spice_playback_channel_sync_latency(SpicePlaybackChannel *channel)
 {
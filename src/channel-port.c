@@ -50,15 +50,43 @@
  * receiving data via the signal SpicePortChannel::port-data, or
  * sending data via spice_port_write_async().
  *
+ * The small writes are gathered in a single message. The data written
+ * and not yet sent is SpicePortChannel:write-pending, and
+ * SpicePortChannel:write-congested tells when a writer should wait
+ * for it to go down.
+ *
  * Since: 0.15
  */
 
 #define SPICE_PORT_CHANNEL_GET_PRIVATE(obj)                                  \
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), SPICE_TYPE_PORT_CHANNEL, SpicePortChannelPrivate))
 
+/* the writes smaller than that are gathered, up to the max */
+#define PORT_WRITE_GATHER_SIZE (4 * 1024)
+#define PORT_WRITE_GATHER_MAX (64 * 1024)
+
+#define PORT_WRITE_HIGH_WATERMARK (256 * 1024)
+#define PORT_WRITE_LOW_WATERMARK (64 * 1024)
+
+/* one message, with the writes it completes */
+typedef struct _PortWrite {
+    SpicePortChannel *port;
+    GSList *results; /* GSimpleAsyncResult, last first */
+    gsize size;
+    GByteArray *data; /* gathered, or NULL */
+    gboolean failed;
+} PortWrite;
+
 struct _SpicePortChannelPrivate {
     gchar *name;
     gboolean opened;
+
+    PortWrite *gather;
+    guint gather_id;
+    guint64 write_pending;
+    guint write_high;
+    guint write_low;
+    gboolean write_congested;
 };
 
 G_DEFINE_TYPE(SpicePortChannel, spice_port_channel, SPICE_TYPE_CHANNEL)
@@ -68,6 +96,10 @@ enum {
     PROP_0,
     PROP_PORT_NAME,
     PROP_PORT_OPENED,
+    PROP_WRITE_PENDING,
+    PROP_WRITE_CONGESTED,
+    PROP_WRITE_HIGH_WATERMARK,
+    PROP_WRITE_LOW_WATERMARK,
 };
 
 /* Signals */
@@ -83,6 +115,8 @@ static void channel_set_handlers(SpiceChannelClass *klass);
 static void spice_port_channel_init(SpicePortChannel *channel)
 {
     channel->priv = SPICE_PORT_CHANNEL_GET_PRIVATE(channel);
+    channel->priv->write_high = PORT_WRITE_HIGH_WATERMARK;
+    channel->priv->write_low = PORT_WRITE_LOW_WATERMARK;
 }
 
 static void spice_port_get_property(GObject    *object,
@@ -99,6 +133,43 @@ static void spice_port_get_property(GObject    *object,
     case PROP_PORT_OPENED:
         g_value_set_boolean(value, c->opened);
         break;
+    case PROP_WRITE_PENDING:
+        g_value_set_uint64(value, c->write_pending);
+        break;
+    case PROP_WRITE_CONGESTED:
+        g_value_set_boolean(value, c->write_congested);
+        break;
+    case PROP_WRITE_HIGH_WATERMARK:
+        g_value_set_uint(value, c->write_high);
+        break;
+    case PROP_WRITE_LOW_WATERMARK:
+        g_value_set_uint(value, c->write_low);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        break;
+    }
+}
+
+static void port_update_congested(SpicePortChannel *self);
+
+static void spice_port_set_property(GObject      *object,
+                                    guint         prop_id,
+                                    const GValue *value,
+                                    GParamSpec   *pspec)
+{
+    SpicePortChannel *self = SPICE_PORT_CHANNEL(object);
+    SpicePortChannelPrivate *c = self->priv;
+
+    switch (prop_id) {
+    case PROP_WRITE_HIGH_WATERMARK:
+        c->write_high = g_value_get_uint(value);
+        port_update_congested(self);
+        break;
+    case PROP_WRITE_LOW_WATERMARK:
+        c->write_low = g_value_get_uint(value);
+        port_update_congested(self);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -115,6 +186,8 @@ static void spice_port_channel_finalize(GObject *object)
         G_OBJECT_CLASS(spice_port_channel_parent_class)->finalize(object);
 }
 
+static gboolean port_write_done(gpointer user_data);
+
 static void spice_port_channel_reset(SpiceChannel *channel, gboolean migrating)
 {
     SpicePortChannelPrivate *c = SPICE_PORT_CHANNEL(channel)->priv;
@@ -122,6 +195,17 @@ static void spice_port_channel_reset(SpiceChannel *channel, gboolean migrating)
     g_clear_pointer(&c->name, g_free);
     c->opened = FALSE;
 
+    /* the gathered writes won't be sent */
+    if (c->gather_id) {
+        g_source_remove(c->gather_id);
+        c->gather_id = 0;
+    }
+    if (c->gather) {
+        c->gather->failed = TRUE;
+        g_idle_add(port_write_done, c->gather);
+        c->gather = NULL;
+    }
+
     SPICE_CHANNEL_CLASS(spice_port_channel_parent_class)->channel_reset(channel, migrating);
 }
 
@@ -132,6 +216,7 @@ static void spice_port_channel_class_init(SpicePortChannelClass *klass)
 
     gobject_class->finalize     = spice_port_channel_finalize;
     gobject_class->get_property = spice_port_get_property;
+    gobject_class->set_property = spice_port_set_property;
     channel_class->channel_reset = spice_port_channel_reset;
 
     g_object_class_install_property
@@ -150,6 +235,70 @@ static void spice_port_channel_class_init(SpicePortChannelClass *klass)
                               FALSE,
                               G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpicePortChannel:write-pending:
+     *
+     * The number of bytes written with spice_port_write_async() and
+     * not sent yet. It is not notified.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_WRITE_PENDING,
+         g_param_spec_uint64("write-pending",
+                             "Write pending",
+                             "Bytes written and not sent yet",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpicePortChannel:write-congested:
+     *
+     * Set when SpicePortChannel:write-pending goes over
+     * SpicePortChannel:write-high-watermark, and unset when it is back
+     * to SpicePortChannel:write-low-watermark: a writer may wait for
+     * the notification instead of queuing more data.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_WRITE_CONGESTED,
+         g_param_spec_boolean("write-congested",
+                              "Write congested",
+                              "Too much data is pending",
+                              FALSE,
+                              G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpicePortChannel:write-high-watermark:
+     *
+     * The pending bytes over which the port is congested.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_WRITE_HIGH_WATERMARK,
+         g_param_spec_uint("write-high-watermark",
+                           "Write high watermark",
+                           "Pending bytes over which the port is congested",
+                           0, G_MAXUINT, PORT_WRITE_HIGH_WATERMARK,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpicePortChannel:write-low-watermark:
+     *
+     * The pending bytes under which the port is no longer congested.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_WRITE_LOW_WATERMARK,
+         g_param_spec_uint("write-low-watermark",
+                           "Write low watermark",
+                           "Pending bytes under which the port is no longer congested",
+                           0, G_MAXUINT, PORT_WRITE_LOW_WATERMARK,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
     /**
      * SpicePort::port-data:
      * @channel: the channel that emitted the signal
@@ -262,6 +411,105 @@ static void port_handle_msg(SpiceChannel *channel, SpiceMsgIn *in)
     g_coroutine_signal_emit(channel, signals[SPICE_PORT_DATA], 0, buf, size);
 }
 
+/* main context */
+static void port_update_congested(SpicePortChannel *self)
+{
+    SpicePortChannelPrivate *c = self->priv;
+    gboolean congested = c->write_congested;
+
+    if (c->write_pending > c->write_high)
+        congested = TRUE;
+    else if (c->write_pending <= c->write_low)
+        congested = FALSE;
+
+    if (congested == c->write_congested)
+        return;
+
+    c->write_congested = congested;
+    g_object_notify(G_OBJECT(self), "write-congested");
+}
+
+static PortWrite *port_write_new(SpicePortChannel *self)
+{
+    PortWrite *w = g_slice_new0(PortWrite);
+
+    w->port = g_object_ref(self);
+
+    return w;
+}
+
+/* main context */
+static gboolean port_write_done(gpointer user_data)
+{
+    PortWrite *w = user_data;
+    SpicePortChannelPrivate *c = w->port->priv;
+    GSList *l;
+
+    c->write_pending -= w->size;
+    port_update_congested(w->port);
+
+    w->results = g_slist_reverse(w->results);
+    for (l = w->results; l != NULL; l = l->next) {
+        GSimpleAsyncResult *result = l->data;
+
+        if (w->failed)
+            g_simple_async_result_set_error(result,
+                G_IO_ERROR, G_IO_ERROR_CLOSED, "The channel was reset");
+        g_simple_async_result_complete(result);
+        g_object_unref(result);
+    }
+    g_slist_free(w->results);
+
+    if (w->data)
+        g_byte_array_unref(w->data);
+    g_object_unref(w->port);
+    g_slice_free(PortWrite, w);
+
+    return FALSE;
+}
+
+static void port_write_free_cb(uint8_t *data, void *user_data)
+{
+    /* the message may be freed in the channel coroutine */
+    g_idle_add(port_write_done, user_data);
+}
+
+static void port_write_send(PortWrite *w, const void *buffer)
+{
+    SpiceMsgOut *msg;
+
+    msg = spice_msg_out_new(SPICE_CHANNEL(w->port), SPICE_MSGC_SPICEVMC_DATA);
+    spice_marshaller_add_ref_full(msg->marshaller, (uint8_t*)buffer, w->size,
+                                  port_write_free_cb, w);
+    spice_msg_out_send(msg);
+}
+
+static void port_send_gathered(SpicePortChannel *self)
+{
+    SpicePortChannelPrivate *c = self->priv;
+    PortWrite *w = c->gather;
+
+    if (c->gather_id) {
+        g_source_remove(c->gather_id);
+        c->gather_id = 0;
+    }
+    if (w == NULL)
+        return;
+
+    c->gather = NULL;
+    port_write_send(w, w->data->data);
+}
+
+static gboolean port_gather_idle(gpointer user_data)
+{
+    SpicePortChannel *self = user_data;
+
+    self->priv->gather_id = 0;
+    port_send_gathered(self);
+
+    return FALSE;
+}
+
 /**
  * spice_port_write_async:
  * @port: A #SpicePortChannel
@@ -277,6 +525,9 @@ static void port_handle_msg(SpiceChannel *channel, SpiceMsgIn *in)
  * can then call spice_port_write_finish() to get the result of
  * the operation.
  *
+ * The writes of less than 4 KiB are copied, and sent along with the
+ * following ones in a single message. The others are sent from @buffer.
+ *
  * Since: 0.15
  **/
 void spice_port_write_async(SpicePortChannel *self,
@@ -286,6 +537,7 @@ void spice_port_write_async(SpicePortChannel *self,
                             gpointer user_data)
 {
     SpicePortChannelPrivate *c;
+    GSimpleAsyncResult *result;
 
     g_return_if_fail(SPICE_IS_PORT_CHANNEL(self));
     g_return_if_fail(buffer != NULL);
@@ -298,8 +550,35 @@ void spice_port_write_async(SpicePortChannel *self,
         return;
     }
 
-    spice_vmc_write_async(SPICE_CHANNEL(self), buffer, count,
-                          cancellable, callback, user_data);
+    result = g_simple_async_result_new(G_OBJECT(self), callback, user_data,
+                                       spice_port_write_async);
+    g_simple_async_result_set_op_res_gssize(result, count);
+    c->write_pending += count;
+
+    if (count < PORT_WRITE_GATHER_SIZE) {
+        /* copied, and sent with the next ones written until idle */
+        if (c->gather && c->gather->size + count > PORT_WRITE_GATHER_MAX)
+            port_send_gathered(self);
+        if (c->gather == NULL) {
+            c->gather = port_write_new(self);
+            c->gather->data = g_byte_array_sized_new(PORT_WRITE_GATHER_MAX);
+        }
+        g_byte_array_append(c->gather->data, buffer, count);
+        c->gather->size += count;
+        c->gather->results = g_slist_prepend(c->gather->results, result);
+        if (c->gather_id == 0)
+            c->gather_id = g_idle_add(port_gather_idle, self);
+    } else {
+        PortWrite *w = port_write_new(self);
+
+        /* in order */
+        port_send_gathered(self);
+        w->size = count;
+        w->results = g_slist_prepend(w->results, result);
+        port_write_send(w, buffer);
+    }
+
+    port_update_congested(self);
 }
 
 /**
@@ -17,6 +17,8 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_AUDIO
+
 #include "spice-client.h"
 #include "spice-common.h"
 #include "spice-channel-priv.h"
@@ -26,6 +28,10 @@
 
 #include "common/snd_codec.h"
 
+#ifdef WITH_OPUS
+#include <opus.h>
+#endif
+
 /**
  * SECTION:channel-record
  * @short_description: audio stream for recording
@@ -55,11 +61,29 @@ struct _SpiceRecordChannelPrivate {
     gboolean                    started;
     SndCodec                    codec;
     gsize                       frame_bytes;
+    guint8                      channels; /* of the recording */
     guint8                      *last_frame;
     gsize                       last_frame_current;
     guint8                      nchannels;
     guint16                     *volume;
     guint8                      mute;
+
+    /* Opus encoder tuning */
+    gint                        opus_complexity; /* -1 for the default */
+    gint                        opus_bitrate; /* bps, 0 for the default */
+    gboolean                    opus_dtx;
+    guint                       opus_frame_duration; /* us */
+#ifdef WITH_OPUS
+    OpusEncoder                 *opus; /* in place of codec, when tuned */
+#endif
+
+    /* silence suppression */
+    gboolean                    silence_suppression;
+    guint                       silence_hangover; /* frames still sent as voice */
+    uint8_t                     *silence_frame; /* zeroed, encoded for the silent ones */
+    gboolean                    silence_dtx; /* the tuned encoder has DTX for it */
+    guint64                     num_frames;
+    guint64                     num_silent_frames;
 };
 
 G_DEFINE_TYPE(SpiceRecordChannel, spice_record_channel, SPICE_TYPE_CHANNEL)
@@ -70,6 +94,12 @@ enum {
     PROP_NCHANNELS,
     PROP_VOLUME,
     PROP_MUTE,
+    PROP_OPUS_COMPLEXITY,
+    PROP_OPUS_BITRATE,
+    PROP_OPUS_DTX,
+    PROP_OPUS_FRAME_DURATION,
+    PROP_SILENCE_SUPPRESSION,
+    PROP_SILENCE_RATIO,
 };
 
 /* Signals */
@@ -102,6 +132,86 @@ static void spice_record_channel_init(SpiceRecordChannel *channel)
     channel->priv = SPICE_RECORD_CHANNEL_GET_PRIVATE(channel);
 
     spice_record_channel_reset_capabilities(SPICE_CHANNEL(channel));
+    /* see spice_playback_channel_init() */
+    SPICE_CHANNEL(channel)->priv->coroutine.priority = G_PRIORITY_HIGH;
+}
+
+/* the default frame, and the ones the server can decode */
+#define OPUS_FRAME_DURATION_DEFAULT 10000
+
+#ifdef WITH_OPUS
+static gboolean record_opus_is_tuned(SpiceRecordChannelPrivate *c)
+{
+    return c->opus_complexity != -1 || c->opus_bitrate != 0 || c->opus_dtx ||
+        c->opus_frame_duration != OPUS_FRAME_DURATION_DEFAULT;
+}
+#endif
+
+static void record_opus_apply(SpiceRecordChannelPrivate *c)
+{
+#ifdef WITH_OPUS
+    c->silence_dtx = FALSE;
+    if (c->opus == NULL)
+        return;
+
+    if (c->opus_complexity != -1)
+        opus_encoder_ctl(c->opus, OPUS_SET_COMPLEXITY(c->opus_complexity));
+    opus_encoder_ctl(c->opus, OPUS_SET_BITRATE(c->opus_bitrate ? c->opus_bitrate : OPUS_AUTO));
+    opus_encoder_ctl(c->opus, OPUS_SET_DTX(c->opus_dtx ? 1 : 0));
+#endif
+}
+
+static void record_codec_destroy(SpiceRecordChannelPrivate *c)
+{
+    g_clear_pointer(&c->silence_frame, g_free);
+    snd_codec_destroy(&c->codec);
+#ifdef WITH_OPUS
+    g_clear_pointer(&c->opus, opus_encoder_destroy);
+#endif
+}
+
+/* returns the frame size, in samples, or 0 on error */
+static int record_codec_create(SpiceRecordChannelPrivate *c, int frequency, int channels)
+{
+#ifdef WITH_OPUS
+    if (c->mode == SPICE_AUDIO_DATA_MODE_OPUS && record_opus_is_tuned(c)) {
+        int error;
+
+        c->opus = opus_encoder_create(frequency, channels, OPUS_APPLICATION_VOIP, &error);
+        if (c->opus == NULL) {
+            g_warning("Failed to create the Opus encoder: %s", opus_strerror(error));
+            return 0;
+        }
+        record_opus_apply(c);
+        return (gint64)frequency * c->opus_frame_duration / G_USEC_PER_SEC;
+    }
+#endif
+
+    if (snd_codec_create(&c->codec, c->mode, frequency, SND_CODEC_ENCODE) != SND_CODEC_OK) {
+        g_warning("Failed to create encoder");
+        return 0;
+    }
+
+    return snd_codec_frame_size(c->codec);
+}
+
+static gboolean record_codec_encode(SpiceRecordChannelPrivate *c,
+                                    uint8_t *frame, int frame_size,
+                                    uint8_t *out, int *len)
+{
+#ifdef WITH_OPUS
+    if (c->opus != NULL) {
+        int n = opus_encode(c->opus, (const opus_int16 *)frame, frame_size / (2 * c->channels),
+                            out, *len);
+
+        if (n < 0)
+            return FALSE;
+        *len = n;
+        return TRUE;
+    }
+#endif
+
+    return snd_codec_encode(c->codec, frame, frame_size, out, len) == SND_CODEC_OK;
 }
 
 static void spice_record_channel_finalize(GObject *obj)
@@ -111,7 +221,7 @@ static void spice_record_channel_finalize(GObject *obj)
     g_free(c->last_frame);
     c->last_frame = NULL;
 
-    snd_codec_destroy(&c->codec);
+    record_codec_destroy(c);
 
     g_free(c->volume);
     c->volume = NULL;
@@ -138,6 +248,25 @@ static void spice_record_channel_get_property(GObject    *gobject,
     case PROP_MUTE:
         g_value_set_boolean(value, c->mute);
         break;
+    case PROP_OPUS_COMPLEXITY:
+        g_value_set_int(value, c->opus_complexity);
+        break;
+    case PROP_OPUS_BITRATE:
+        g_value_set_int(value, c->opus_bitrate);
+        break;
+    case PROP_OPUS_DTX:
+        g_value_set_boolean(value, c->opus_dtx);
+        break;
+    case PROP_OPUS_FRAME_DURATION:
+        g_value_set_uint(value, c->opus_frame_duration);
+        break;
+    case PROP_SILENCE_SUPPRESSION:
+        g_value_set_boolean(value, c->silence_suppression);
+        break;
+    case PROP_SILENCE_RATIO:
+        g_value_set_double(value, c->num_frames ?
+                           (double)c->num_silent_frames / c->num_frames : 0);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -149,6 +278,8 @@ static void spice_record_channel_set_property(GObject      *gobject,
                                               const GValue *value,
                                               GParamSpec   *pspec)
 {
+    SpiceRecordChannelPrivate *c = SPICE_RECORD_CHANNEL(gobject)->priv;
+
     switch (prop_id) {
     case PROP_VOLUME:
         /* TODO: request guest volume change */
@@ -156,6 +287,32 @@ static void spice_record_channel_set_property(GObject      *gobject,
     case PROP_MUTE:
         /* TODO: request guest mute change */
         break;
+    case PROP_OPUS_COMPLEXITY:
+        c->opus_complexity = g_value_get_int(value);
+        record_opus_apply(c);
+        break;
+    case PROP_OPUS_BITRATE:
+        c->opus_bitrate = g_value_get_int(value);
+        record_opus_apply(c);
+        break;
+    case PROP_OPUS_DTX:
+        c->opus_dtx = g_value_get_boolean(value);
+        record_opus_apply(c);
+        break;
+    case PROP_OPUS_FRAME_DURATION: {
+        guint duration = g_value_get_uint(value);
+
+        /* the frame duration is taken at the next start */
+        if (duration != 2500 && duration != 5000 && duration != 10000) {
+            g_warning("unsupported Opus frame duration %u us", duration);
+            break;
+        }
+        c->opus_frame_duration = duration;
+        break;
+    }
+    case PROP_SILENCE_SUPPRESSION:
+        c->silence_suppression = g_value_get_boolean(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -172,7 +329,7 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
     g_coroutine_signal_emit(channel, signals[SPICE_RECORD_STOP], 0);
     c->started = FALSE;
 
-    snd_codec_destroy(&c->codec);
+    record_codec_destroy(c);
 
     SPICE_CHANNEL_CLASS(spice_record_channel_parent_class)->channel_reset(channel, migrating);
 }
@@ -213,6 +370,122 @@ static void spice_record_channel_class_init(SpiceRecordChannelClass *klass)
                               FALSE,
                               G_PARAM_READWRITE |
                               G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:opus-complexity:
+     *
+     * The complexity of the Opus encoder, from 0 to 10. Lower values
+     * take less CPU, for a lower quality at the same bitrate. -1 keeps
+     * the encoder default.
+     *
+     * Tuning the Opus encoder requires spice-gtk to be built with
+     * libopus, the properties are ignored otherwise.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_OPUS_COMPLEXITY,
+         g_param_spec_int("opus-complexity",
+                          "Opus complexity",
+                          "Complexity of the Opus encoder, -1 for the default",
+                          -1, 10, -1,
+                          G_PARAM_READWRITE |
+                          G_PARAM_CONSTRUCT |
+                          G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:opus-bitrate:
+     *
+     * The bitrate of the Opus encoder, in bits per second, or 0 to let
+     * the encoder pick it.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_OPUS_BITRATE,
+         g_param_spec_int("opus-bitrate",
+                          "Opus bitrate",
+                          "Bitrate of the Opus encoder in bps, 0 for the default",
+                          0, 512000, 0,
+                          G_PARAM_READWRITE |
+                          G_PARAM_CONSTRUCT |
+                          G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:opus-dtx:
+     *
+     * Enable the discontinuous transmission of the Opus encoder: the
+     * silences are sent at a very low bitrate.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_OPUS_DTX,
+         g_param_spec_boolean("opus-dtx",
+                              "Opus DTX",
+                              "Discontinuous transmission of the Opus encoder",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:opus-frame-duration:
+     *
+     * The duration of the Opus frames, in microseconds: 2500, 5000 or
+     * 10000. Shorter frames lower the latency, for more CPU and
+     * bandwidth. The server cannot decode longer frames. It is taken
+     * into account when the recording starts.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_OPUS_FRAME_DURATION,
+         g_param_spec_uint("opus-frame-duration",
+                           "Opus frame duration",
+                           "Duration of the Opus frames, in us",
+                           2500, 10000, OPUS_FRAME_DURATION_DEFAULT,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:silence-suppression:
+     *
+     * Encode the silent frames of the recording as digital silence,
+     * with DTX when the Opus encoder is tuned, so that they cost few
+     * bits. The server still gets a packet for each frame, with its
+     * timestamp. This has no effect when the audio is sent uncompressed.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_SILENCE_SUPPRESSION,
+         g_param_spec_boolean("silence-suppression",
+                              "Silence suppression",
+                              "Send the silent frames as digital silence",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:silence-ratio:
+     *
+     * The fraction of the recorded frames that were sent as silence
+     * since the channel was created.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_SILENCE_RATIO,
+         g_param_spec_double("silence-ratio",
+                             "Silence ratio",
+                             "Fraction of the frames sent as silence",
+                             0, 1, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceRecordChannel::record-start:
      * @channel: the #SpiceRecordChannel that emitted the signal
@@ -307,6 +580,110 @@ static void spice_record_start_mark(SpiceRecordChannel *channel, uint32_t time)
     spice_msg_out_send(msg);
 }
 
+/* the raw frames sent in a message, the server buffer holds 8192 samples */
+#define RECORD_RAW_BATCH_FRAMES 4
+
+/* below about -50 dBFS, a frame is silent */
+#define RECORD_SILENCE_PEAK 100
+/* frames sent as they are after the voice, not to cut its end */
+#define RECORD_SILENCE_HANGOVER_FRAMES 20
+
+static gboolean record_frame_is_silent(SpiceRecordChannelPrivate *rc,
+                                       const uint8_t *frame, int frame_size)
+{
+    const gint16 *samples = (const gint16 *)frame;
+    int i, n = frame_size / 2;
+    gint peak = 0;
+
+    /* kept branchless, so that the compiler vectorizes it */
+    for (i = 0; i < n; i++) {
+        gint v = samples[i];
+        v = v < 0 ? -v : v;
+        peak = v > peak ? v : peak;
+    }
+
+    if (peak >= RECORD_SILENCE_PEAK) {
+        rc->silence_hangover = RECORD_SILENCE_HANGOVER_FRAMES;
+        return FALSE;
+    }
+    if (rc->silence_hangover > 0) {
+        rc->silence_hangover--;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * A silent frame is encoded as digital silence, which costs the encoder
+ * few bits. It still goes through the encoder, whose state has to follow
+ * the decoder's: a packet sent again would leave the encoder at the last
+ * voice frame, and the next onset would glitch.
+ */
+static uint8_t *record_silence_frame(SpiceRecordChannelPrivate *rc, int frame_size)
+{
+    if (rc->silence_frame == NULL)
+        rc->silence_frame = g_malloc0(rc->frame_bytes);
+    g_return_val_if_fail((gsize)frame_size <= rc->frame_bytes, NULL);
+
+    return rc->silence_frame;
+}
+
+/* the tuned Opus encoder sends the silences with DTX */
+static void record_opus_set_silent(SpiceRecordChannelPrivate *rc, gboolean silent)
+{
+#ifdef WITH_OPUS
+    if (rc->opus == NULL || rc->opus_dtx || rc->silence_dtx == silent)
+        return;
+
+    opus_encoder_ctl(rc->opus, OPUS_SET_DTX(silent ? 1 : 0));
+    rc->silence_dtx = silent;
+#endif
+}
+
+/* encodes @frame right into the message, returns FALSE on error */
+static gboolean record_send_frame(SpiceRecordChannel *channel, SpiceMsgcRecordPacket *p,
+                                  uint8_t *frame, int frame_size)
+{
+    SpiceRecordChannelPrivate *rc = channel->priv;
+    SpiceMsgOut *msg;
+
+    msg = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_RECORD_DATA);
+    msg->marshallers->msgc_record_data(msg->marshaller, p);
+
+    if (rc->mode == SPICE_AUDIO_DATA_MODE_RAW) {
+        spice_marshaller_add(msg->marshaller, frame, frame_size);
+    } else {
+        int len = SND_CODEC_MAX_COMPRESSED_BYTES;
+        uint8_t *buf = spice_marshaller_reserve_space(msg->marshaller, len);
+        gboolean silent = rc->silence_suppression &&
+            record_frame_is_silent(rc, frame, frame_size);
+
+        if (silent) {
+            uint8_t *zeros = record_silence_frame(rc, frame_size);
+
+            if (zeros != NULL) {
+                frame = zeros;
+                rc->num_silent_frames++;
+            }
+        }
+        record_opus_set_silent(rc, silent);
+
+        if (!record_codec_encode(rc, frame, frame_size, buf, &len)) {
+            g_warning("encode failed");
+            spice_msg_out_unref(msg);
+            return FALSE;
+        }
+        spice_marshaller_unreserve_space(msg->marshaller, SND_CODEC_MAX_COMPRESSED_BYTES - len);
+    }
+    if (rc->mode != SPICE_AUDIO_DATA_MODE_RAW)
+        rc->num_frames++;
+
+    spice_msg_out_send(msg);
+
+    return TRUE;
+}
+
 /**
  * spice_record_send_data:
  * @channel:
@@ -331,23 +708,17 @@ void spice_record_send_data(SpiceRecordChannel *channel, gpointer data,
 
     g_return_if_fail(spice_channel_get_read_only(SPICE_CHANNEL(channel)) == FALSE);
 
-    uint8_t *encode_buf = NULL;
-
     if (!rc->started) {
         spice_record_mode(channel, time, rc->mode, NULL, 0);
         spice_record_start_mark(channel, time);
         rc->started = TRUE;
     }
 
-    if (rc->mode != SPICE_AUDIO_DATA_MODE_RAW)
-        encode_buf = g_alloca(SND_CODEC_MAX_COMPRESSED_BYTES);
-
     p.time = time;
 
     while (bytes > 0) {
         gsize n;
         int frame_size;
-        SpiceMsgOut *msg;
         uint8_t *frame;
 
         if (rc->last_frame_current > 0) {
@@ -360,34 +731,22 @@ void spice_record_send_data(SpiceRecordChannel *channel, gpointer data,
                 break;
             frame = rc->last_frame;
             frame_size = rc->frame_bytes;
-        } else {
-            n = MIN(bytes, rc->frame_bytes);
-            frame_size = n;
-            frame = data;
-        }
-
-        if (rc->last_frame_current == 0 &&
-            n < rc->frame_bytes) {
+        } else if (bytes < rc->frame_bytes) {
             /* start a new frame */
-            memcpy(rc->last_frame, data, n);
-            rc->last_frame_current = n;
+            memcpy(rc->last_frame, data, bytes);
+            rc->last_frame_current = bytes;
             break;
+        } else {
+            /* whole frames are used in place, several at once if raw */
+            n = rc->frame_bytes;
+            if (rc->mode == SPICE_AUDIO_DATA_MODE_RAW)
+                n *= MIN(bytes / rc->frame_bytes, RECORD_RAW_BATCH_FRAMES);
+            frame = data;
+            frame_size = n;
         }
 
-        if (rc->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-            int len = SND_CODEC_MAX_COMPRESSED_BYTES;
-            if (snd_codec_encode(rc->codec, frame, frame_size, encode_buf, &len) != SND_CODEC_OK) {
-                g_warning("encode failed");
-                return;
-            }
-            frame = encode_buf;
-            frame_size = len;
-        }
-
-        msg = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_RECORD_DATA);
-        msg->marshallers->msgc_record_data(msg->marshaller, &p);
-        spice_marshaller_add(msg->marshaller, frame, frame_size);
-        spice_msg_out_send(msg);
+        if (!record_send_frame(channel, &p, frame, frame_size))
+            return;
 
         if (rc->last_frame_current == rc->frame_bytes)
             rc->last_frame_current = 0;
@@ -413,14 +772,13 @@ static void record_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
 
     g_return_if_fail(start->format == SPICE_AUDIO_FMT_S16);
 
-    snd_codec_destroy(&c->codec);
+    record_codec_destroy(c);
+    c->channels = start->channels;
 
     if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-        if (snd_codec_create(&c->codec, c->mode, start->frequency, SND_CODEC_ENCODE) != SND_CODEC_OK) {
-            g_warning("Failed to create encoder");
+        frame_size = record_codec_create(c, start->frequency, start->channels);
+        if (frame_size == 0)
             return;
-        }
-        frame_size = snd_codec_frame_size(c->codec);
     }
 
     g_free(c->last_frame);
@@ -78,16 +78,27 @@ struct _SpiceSmartcardChannelPrivate {
     GHashTable *pending_card_insertions;
 
     /* next commands to be sent to the spice server. This is needed since
-     * we have to wait for a command answer before sending the next one
+     * only SMARTCARD_MAX_IN_FLIGHT commands may wait for their answer
      */
     GQueue *message_queue;
 
-    /* message that is currently being processed by the spice server (ie last
-     * message that was sent to the server)
+    /* messages that are currently being processed by the spice server,
+     * it answers them in order: the oldest is first
      */
-    SpiceSmartcardChannelMessage *in_flight_message;
+    GQueue *in_flight;
+
+    /* the APDUs from the guest, and the time spent on them by the card */
+    guint64 apdus;
+    guint64 apdu_time_us;
+    guint64 apdu_max_time_us;
+    /* and from the last answer to the next APDU */
+    gint64 apdu_answer_time;
+    guint64 apdu_wait_time_us;
 };
 
+/* the commands sent without waiting for the answer to the previous ones */
+#define SMARTCARD_MAX_IN_FLIGHT 8
+
 G_DEFINE_TYPE(SpiceSmartcardChannel, spice_smartcard_channel, SPICE_TYPE_CHANNEL)
 
 enum {
@@ -118,6 +129,7 @@ static void spice_smartcard_channel_init(SpiceSmartcardChannel *channel)
     channel->priv = SPICE_SMARTCARD_CHANNEL_GET_PRIVATE(channel);
     priv = channel->priv;
     priv->message_queue = g_queue_new();
+    priv->in_flight = g_queue_new();
 
 #ifdef USE_SMARTCARD
     priv->pending_card_insertions =
@@ -174,9 +186,10 @@ static void spice_smartcard_channel_finalize(GObject *obj)
         g_queue_free(c->message_queue);
         c->message_queue = NULL;
     }
-    if (c->in_flight_message != NULL) {
-        smartcard_message_free(c->in_flight_message);
-        c->in_flight_message = NULL;
+    if (c->in_flight != NULL) {
+        g_queue_foreach(c->in_flight, (GFunc)smartcard_message_free, NULL);
+        g_queue_free(c->in_flight);
+        c->in_flight = NULL;
     }
 
     g_list_free(c->pending_reader_additions);
@@ -199,14 +212,24 @@ static void spice_smartcard_channel_reset(SpiceChannel *channel, gboolean migrat
         g_queue_clear(c->message_queue);
     }
 
-    if (c->in_flight_message != NULL) {
-        smartcard_message_free(c->in_flight_message);
-        c->in_flight_message = NULL;
-    }
+    g_queue_foreach(c->in_flight, (GFunc)smartcard_message_free, NULL);
+    g_queue_clear(c->in_flight);
 
     g_list_free(c->pending_reader_additions);
     c->pending_reader_additions = NULL;
 
+    if (c->apdus > 0)
+        CHANNEL_DEBUG(channel, "%" G_GUINT64_FORMAT " APDUs, card %" G_GUINT64_FORMAT
+                      " us on average, %" G_GUINT64_FORMAT " us at most, %" G_GUINT64_FORMAT
+                      " us on average from an answer to the next APDU",
+                      c->apdus, c->apdu_time_us / c->apdus, c->apdu_max_time_us,
+                      c->apdu_wait_time_us / MAX(c->apdus - 1, 1));
+    c->apdus = 0;
+    c->apdu_time_us = 0;
+    c->apdu_max_time_us = 0;
+    c->apdu_answer_time = 0;
+    c->apdu_wait_time_us = 0;
+
     SPICE_CHANNEL_CLASS(spice_smartcard_channel_parent_class)->channel_reset(channel, migrating);
 }
 
@@ -308,21 +331,53 @@ smartcard_message_new(VSCMsgType msg_type, SpiceMsgOut *msg_out)
     return message;
 }
 
-/* Indicates that handling of the message that is currently in flight has
- * been completed. If needed, sends the next queued command to the server. */
+/* The server answers in order, so several commands can wait for their
+ * answer. But a reader addition is waited for alone: the next commands
+ * may need the reader id it gets. */
+static gboolean
+smartcard_message_can_send(SpiceSmartcardChannel *channel,
+                           SpiceSmartcardChannelMessage *message)
+{
+    GQueue *in_flight = channel->priv->in_flight;
+    SpiceSmartcardChannelMessage *last = g_queue_peek_tail(in_flight);
+
+    if (last == NULL)
+        return TRUE;
+
+    return g_queue_get_length(in_flight) < SMARTCARD_MAX_IN_FLIGHT &&
+        last->message_type != VSC_ReaderAdd &&
+        message->message_type != VSC_ReaderAdd;
+}
+
+/* Sends the queued commands the server can be given now. */
 static void
-smartcard_message_complete_in_flight(SpiceSmartcardChannel *channel)
+smartcard_message_send_queued(SpiceSmartcardChannel *channel)
 {
-    g_return_if_fail(channel->priv->in_flight_message != NULL);
+    SpiceSmartcardChannelPrivate *priv = channel->priv;
+    SpiceSmartcardChannelMessage *message;
 
-    smartcard_message_free(channel->priv->in_flight_message);
-    channel->priv->in_flight_message = g_queue_pop_head(channel->priv->message_queue);
-    if (channel->priv->in_flight_message != NULL) {
-        spice_msg_out_send(channel->priv->in_flight_message->message);
-        channel->priv->in_flight_message->message = NULL;
+    while ((message = g_queue_peek_head(priv->message_queue)) != NULL &&
+           smartcard_message_can_send(channel, message)) {
+        g_queue_pop_head(priv->message_queue);
+        spice_msg_out_send(message->message);
+        message->message = NULL;
+        g_queue_push_tail(priv->in_flight, message);
     }
 }
 
+/* Indicates that handling of the oldest message in flight has been
+ * completed. If needed, sends the next queued commands to the server. */
+static void
+smartcard_message_complete_in_flight(SpiceSmartcardChannel *channel)
+{
+    SpiceSmartcardChannelMessage *message = g_queue_pop_head(channel->priv->in_flight);
+
+    g_return_if_fail(message != NULL);
+
+    smartcard_message_free(message);
+    smartcard_message_send_queued(channel);
+}
+
 static void smartcard_message_send(SpiceSmartcardChannel *channel,
                                    VSCMsgType msg_type,
                                    SpiceMsgOut *msg_out, gboolean queue)
@@ -340,14 +395,8 @@ static void smartcard_message_send(SpiceSmartcardChannel *channel,
     }
 
     message = smartcard_message_new(msg_type, msg_out);
-    if (channel->priv->in_flight_message == NULL) {
-        g_return_if_fail(g_queue_is_empty(channel->priv->message_queue));
-        channel->priv->in_flight_message = message;
-        spice_msg_out_send(channel->priv->in_flight_message->message);
-        channel->priv->in_flight_message->message = NULL;
-    } else {
-        g_queue_push_tail(channel->priv->message_queue, message);
-    }
+    g_queue_push_tail(channel->priv->message_queue, message);
+    smartcard_message_send_queued(channel);
 }
 
 static void
@@ -510,14 +559,16 @@ static void handle_smartcard_msg(SpiceChannel *channel, SpiceMsgIn *in)
     SpiceSmartcardChannel *smartcard_channel = SPICE_SMARTCARD_CHANNEL(channel);
     SpiceSmartcardChannelPrivate *priv = smartcard_channel->priv;
     SpiceMsgSmartcard *msg = spice_msg_in_parsed(in);
+    SpiceSmartcardChannelMessage *in_flight;
     VReader *reader;
 
     CHANNEL_DEBUG(channel, "handle msg %d", msg->type);
     switch (msg->type) {
         case VSC_Error:
-            g_return_if_fail(priv->in_flight_message != NULL);
-            CHANNEL_DEBUG(channel, "in flight %d", priv->in_flight_message->message_type);
-            switch (priv->in_flight_message->message_type) {
+            in_flight = g_queue_peek_head(priv->in_flight);
+            g_return_if_fail(in_flight != NULL);
+            CHANNEL_DEBUG(channel, "in flight %d", in_flight->message_type);
+            switch (in_flight->message_type) {
                 case VSC_ReaderAdd:
                     g_return_if_fail(priv->pending_reader_additions != NULL);
                     reader = priv->pending_reader_additions->data;
@@ -545,7 +596,7 @@ static void handle_smartcard_msg(SpiceChannel *channel, SpiceMsgIn *in)
                 case VSC_ReaderRemove:
                     break;
                 default:
-                    g_warning("Unexpected message: %d", priv->in_flight_message->message_type);
+                    g_warning("Unexpected message: %d", in_flight->message_type);
                     break;
             }
             smartcard_message_complete_in_flight(smartcard_channel);
@@ -558,14 +609,25 @@ static void handle_smartcard_msg(SpiceChannel *channel, SpiceMsgIn *in)
             VReaderStatus reader_status;
             uint8_t data_out[APDU_BUFFER_SIZE + sizeof(uint32_t)];
             int data_out_len = sizeof(data_out);
+            gint64 start, time_us;
 
             g_return_if_fail(msg->reader_id != VSCARD_UNDEFINED_READER_ID);
             reader = vreader_get_reader_by_id(msg->reader_id);
             g_return_if_fail(reader != NULL); //FIXME: add log message
 
+            start = g_get_monotonic_time();
             reader_status = vreader_xfr_bytes(reader,
                                               msg->data, msg->length,
                                               data_out, &data_out_len);
+            if (msg->type == VSC_APDU) {
+                time_us = g_get_monotonic_time() - start;
+                priv->apdus++;
+                priv->apdu_time_us += time_us;
+                priv->apdu_max_time_us = MAX(priv->apdu_max_time_us, time_us);
+                if (priv->apdu_answer_time)
+                    priv->apdu_wait_time_us += start - priv->apdu_answer_time;
+                priv->apdu_answer_time = start + time_us;
+            }
             if (reader_status == VREADER_OK) {
                 send_msg_generic_with_data(smartcard_channel,
                                            reader, VSC_APDU,
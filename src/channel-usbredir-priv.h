@@ -51,6 +51,10 @@ void spice_usbredir_channel_disconnect_device(SpiceUsbredirChannel *channel);
 
 libusb_device *spice_usbredir_channel_get_device(SpiceUsbredirChannel *channel);
 
+SpiceUsbDeviceStats *spice_usbredir_channel_get_stats(SpiceUsbredirChannel *channel);
+void spice_usbredir_channel_set_iso_buffering(SpiceUsbredirChannel *channel,
+                                              guint buffer_ms, gsize batch_size);
+
 void spice_usbredir_channel_get_guest_filter(
                           SpiceUsbredirChannel               *channel,
                           const struct usbredirfilter_rule  **rules_ret,
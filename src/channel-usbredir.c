@@ -21,6 +21,8 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_USB
+
 #ifdef USE_USBREDIR
 #include <glib/gi18n.h>
 #include <usbredirhost.h>
@@ -64,6 +66,46 @@ enum SpiceUsbredirChannelState {
     STATE_DISCONNECTING,
 };
 
+/*
+ * HID and other interrupt endpoints make many small packets, they are
+ * sent together up to this size. A larger packet is still sent alone.
+ */
+#define USBREDIR_WRITE_MSG_MAX_SIZE (32 * 1024)
+
+/*
+ * The isochronous streams of webcams and headsets can't wait: their
+ * packets are dropped by usbredirhost while the channel has more than a
+ * budget to send, at the rate of the streams, that much queued. Unless
+ * set, the budget covers a couple of round-trips, and grows while too
+ * many packets are dropped.
+ */
+#define ISO_ADAPT_INTERVAL_MS 500
+#define ISO_BUFFER_BASE_MS 30
+#define ISO_BUFFER_MIN_MS 20
+#define ISO_BUFFER_MAX_MS 500
+#define ISO_BUFFER_BOOST_STEP_MS 20
+#define ISO_BUFFER_MIN_BYTES (64 * 1024)
+/* of the packets of an interval, over that the budget grows */
+#define ISO_DROP_PERCENT 1
+
+/* follows the usbredir packets of the data from the guest */
+typedef struct {
+    guint8 header[16];
+    guint header_read;
+    guint32 type;
+    guint32 left;
+    guint8 hello[64 + 4]; /* the version and the first caps */
+    guint hello_read;
+    gboolean ids_64bits;
+    gboolean lost;
+} UsbredirStreamTracker;
+
+/* a bulk transfer requested by the guest, its id is the hash key */
+typedef struct {
+    guint64 id;
+    gint64 time;
+} UsbredirTransfer;
+
 struct _SpiceUsbredirChannelPrivate {
     libusb_device *device;
     SpiceUsbDevice *spice_device;
@@ -71,9 +113,48 @@ struct _SpiceUsbredirChannelPrivate {
     struct usbredirhost *host;
     /* To catch usbredirhost error messages and report them as a GError */
     GError **catch_error;
-    /* Data passed from channel handle msg to the usbredirhost read cb */
+    /* Data passed from channel handle msg to the usbredirhost read cb,
+       otherwise it is read off the wire, see usbredir_read_msg_data() */
     const uint8_t *read_buf;
     int read_buf_size;
+    gboolean reading;
+    /* disconnect_device() while the parser was running, see
+       usbredir_read_guest_data() */
+    gboolean disconnect_deferred;
+    /* The buffers of one usbredirhost write go in one message, taken
+       with write_lock held, as the statistics are */
+    STATIC_MUTEX write_lock;
+    SpiceMsgOut *write_msg;
+    gsize write_msg_size;
+    /* GSList of the messages written by the usb event thread, newest
+       first, pushed and taken without a lock */
+    gpointer handed_off;
+    gint handed_off_wakeup;
+    /* statistics of the redirected device */
+    SpiceUsbDeviceStats stats;
+    gint64 stats_start;
+    guint64 packets_out;
+    guint64 messages_out;
+    guint64 messages_in;
+    GHashTable *bulk_pending; /* UsbredirTransfer */
+    guint64 bulk_timed;
+    guint64 bulk_latency_total;
+    /* isochronous streams from the device, see usbredir_iso_adapt() */
+    gint queued; /* bytes written to the channel, not sent yet, atomic */
+    gint iso_budget; /* queued bytes the streams are dropped over, atomic */
+    gint iso_dropped; /* atomic */
+    gboolean iso_dropping; /* usb event thread */
+    guint iso_buffer_ms; /* 0 to adapt it */
+    guint iso_boost_ms; /* added while the streams are dropped */
+    guint iso_adapt_id;
+    guint64 iso_bytes_out;
+    guint64 iso_packets_out;
+    guint64 iso_last_bytes, iso_last_packets, iso_last_dropped;
+    gint64 iso_last_time;
+    guint64 iso_rate; /* bytes/s, while sent */
+    gsize write_msg_max_size;
+    gboolean host_ids_64bits;
+    UsbredirStreamTracker tracker;
     enum SpiceUsbredirChannelState state;
 #if USE_POLKIT
     GSimpleAsyncResult *result;
@@ -86,16 +167,22 @@ static void spice_usbredir_channel_up(SpiceChannel *channel);
 static void spice_usbredir_channel_dispose(GObject *obj);
 static void spice_usbredir_channel_finalize(GObject *obj);
 static void usbredir_handle_msg(SpiceChannel *channel, SpiceMsgIn *in);
+static void usbredir_read_msg_data(SpiceChannel *channel, gsize size);
 
 static void usbredir_log(void *user_data, int level, const char *msg);
 static int usbredir_read_callback(void *user_data, uint8_t *data, int count);
 static int usbredir_write_callback(void *user_data, uint8_t *data, int count);
 static void usbredir_write_flush_callback(void *user_data);
+static void usbredir_write_guest_data(SpiceUsbredirChannel *channel);
+static void usbredir_handed_off_free(SpiceUsbredirChannel *channel);
 
 static void *usbredir_alloc_lock(void);
 static void usbredir_lock_lock(void *user_data);
 static void usbredir_unlock_lock(void *user_data);
 static void usbredir_free_lock(void *user_data);
+#ifdef HAVE_USBREDIRHOST_BUFFERED_OUTPUT
+static uint64_t usbredir_buffered_output_size_callback(void *user_data);
+#endif
 
 #endif
 
@@ -107,6 +194,11 @@ static void spice_usbredir_channel_init(SpiceUsbredirChannel *channel)
 {
 #ifdef USE_USBREDIR
     channel->priv = SPICE_USBREDIR_CHANNEL_GET_PRIVATE(channel);
+    STATIC_MUTEX_INIT(channel->priv->write_lock);
+    channel->priv->bulk_pending = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                        NULL, g_free);
+    channel->priv->write_msg_max_size = USBREDIR_WRITE_MSG_MAX_SIZE;
+    channel->priv->iso_budget = G_MAXINT;
 #endif
 }
 
@@ -119,7 +211,12 @@ static void spice_usbredir_channel_reset(SpiceChannel *c, gboolean migrating)
     if (priv->host) {
         if (priv->state == STATE_CONNECTED)
             spice_usbredir_channel_disconnect_device(channel);
+        /* the messages refer to the host buffers */
+        usbredir_handed_off_free(channel);
         usbredirhost_close(priv->host);
+        /* the new host starts a new stream */
+        memset(&priv->tracker, 0, sizeof(priv->tracker));
+        priv->host_ids_64bits = FALSE;
         priv->host = NULL;
         /* Call set_context to re-create the host */
         spice_usbredir_channel_set_context(channel, priv->context);
@@ -180,8 +277,12 @@ static void spice_usbredir_channel_finalize(GObject *obj)
 {
     SpiceUsbredirChannel *channel = SPICE_USBREDIR_CHANNEL(obj);
 
-    if (channel->priv->host)
+    if (channel->priv->host) {
+        usbredir_handed_off_free(channel);
         usbredirhost_close(channel->priv->host);
+    }
+    g_hash_table_destroy(channel->priv->bulk_pending);
+    STATIC_MUTEX_CLEAR(channel->priv->write_lock);
 
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_usbredir_channel_parent_class)->finalize)
@@ -224,6 +325,82 @@ void spice_usbredir_channel_set_context(SpiceUsbredirChannel *channel,
                                    usbredirhost_fl_write_cb_owns_buffer);
     if (!priv->host)
         g_error("Out of memory allocating usbredirhost");
+#ifdef HAVE_USBREDIRHOST_BUFFERED_OUTPUT
+    usbredirhost_set_buffered_output_size_cb(priv->host,
+                                             usbredir_buffered_output_size_callback);
+#endif
+
+    /* the parser copies the data into its packets anyway */
+    spice_channel_set_msg_data_reader(SPICE_CHANNEL(channel), SPICE_MSG_SPICEVMC_DATA,
+                                      usbredir_read_msg_data);
+}
+
+/* main context */
+static gboolean usbredir_iso_adapt(gpointer user_data)
+{
+    SpiceUsbredirChannel *channel = user_data;
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    gint64 now = g_get_monotonic_time();
+    guint64 bytes, packets, dropped, budget;
+    gint64 elapsed;
+    guint buffer_ms;
+
+    STATIC_MUTEX_LOCK(priv->write_lock);
+    bytes = priv->iso_bytes_out - priv->iso_last_bytes;
+    packets = priv->iso_packets_out - priv->iso_last_packets;
+    priv->iso_last_bytes = priv->iso_bytes_out;
+    priv->iso_last_packets = priv->iso_packets_out;
+    STATIC_MUTEX_UNLOCK(priv->write_lock);
+    dropped = (guint)g_atomic_int_get(&priv->iso_dropped) - priv->iso_last_dropped;
+    priv->iso_last_dropped += dropped;
+    elapsed = MAX(now - priv->iso_last_time, 1);
+    priv->iso_last_time = now;
+
+    if (bytes == 0 && dropped == 0)
+        return G_SOURCE_CONTINUE;
+    /* the rate is kept while the streams are dropped entirely */
+    if (bytes > 0)
+        priv->iso_rate = bytes * G_USEC_PER_SEC / elapsed;
+
+    if (priv->iso_buffer_ms != 0) {
+        buffer_ms = priv->iso_buffer_ms;
+    } else {
+        SpiceChannelStats *stats = spice_channel_get_stats(SPICE_CHANNEL(channel));
+
+        if (dropped * 100 > (packets + dropped) * ISO_DROP_PERCENT)
+            priv->iso_boost_ms = MIN(priv->iso_boost_ms + ISO_BUFFER_BOOST_STEP_MS,
+                                     ISO_BUFFER_MAX_MS);
+        else if (dropped == 0)
+            priv->iso_boost_ms -= MIN(priv->iso_boost_ms, ISO_BUFFER_BOOST_STEP_MS / 4);
+        buffer_ms = CLAMP(2 * stats->rtt_us / 1000 + ISO_BUFFER_BASE_MS + priv->iso_boost_ms,
+                          ISO_BUFFER_MIN_MS, ISO_BUFFER_MAX_MS);
+        spice_channel_stats_free(stats);
+    }
+
+    budget = priv->iso_rate * buffer_ms / 1000;
+    budget = CLAMP(budget, ISO_BUFFER_MIN_BYTES, G_MAXINT);
+    g_atomic_int_set(&priv->iso_budget, budget);
+
+    STATIC_MUTEX_LOCK(priv->write_lock);
+    priv->stats.iso_buffer_ms = buffer_ms;
+    STATIC_MUTEX_UNLOCK(priv->write_lock);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* main context: buffer_ms 0 adapts the buffering, batch_size 0 is the default */
+G_GNUC_INTERNAL
+void spice_usbredir_channel_set_iso_buffering(SpiceUsbredirChannel *channel,
+                                              guint buffer_ms, gsize batch_size)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+
+    priv->iso_buffer_ms = buffer_ms;
+    priv->iso_boost_ms = 0;
+
+    STATIC_MUTEX_LOCK(priv->write_lock);
+    priv->write_msg_max_size = batch_size != 0 ? batch_size : USBREDIR_WRITE_MSG_MAX_SIZE;
+    STATIC_MUTEX_UNLOCK(priv->write_lock);
 }
 
 static gboolean spice_usbredir_channel_open_device(
@@ -265,6 +442,24 @@ static gboolean spice_usbredir_channel_open_device(
 
     priv->state = STATE_CONNECTED;
 
+    STATIC_MUTEX_LOCK(priv->write_lock);
+    memset(&priv->stats, 0, sizeof(priv->stats));
+    priv->stats_start = g_get_monotonic_time();
+    priv->packets_out = priv->messages_out = priv->messages_in = 0;
+    g_hash_table_remove_all(priv->bulk_pending);
+    priv->bulk_timed = priv->bulk_latency_total = 0;
+    priv->iso_bytes_out = priv->iso_packets_out = 0;
+    priv->iso_last_bytes = priv->iso_last_packets = priv->iso_last_dropped = 0;
+    priv->iso_last_time = priv->stats_start;
+    priv->iso_rate = 0;
+    priv->iso_boost_ms = 0;
+    priv->iso_dropping = FALSE;
+    g_atomic_int_set(&priv->iso_dropped, 0);
+    g_atomic_int_set(&priv->iso_budget, G_MAXINT);
+    STATIC_MUTEX_UNLOCK(priv->write_lock);
+
+    priv->iso_adapt_id = g_timeout_add(ISO_ADAPT_INTERVAL_MS, usbredir_iso_adapt, channel);
+
     return TRUE;
 }
 
@@ -275,12 +470,16 @@ static void spice_usbredir_channel_open_acl_cb(
     SpiceUsbAclHelper *acl_helper = SPICE_USB_ACL_HELPER(gobject);
     SpiceUsbredirChannel *channel = SPICE_USBREDIR_CHANNEL(user_data);
     SpiceUsbredirChannelPrivate *priv = channel->priv;
+    SpiceUsbDeviceManager *manager;
     GError *err = NULL;
+    gint busnum, devnum;
 
     g_return_if_fail(acl_helper == priv->acl_helper);
     g_return_if_fail(priv->state == STATE_WAITING_FOR_ACL_HELPER ||
                      priv->state == STATE_DISCONNECTING);
 
+    busnum = libusb_get_bus_number(priv->device);
+    devnum = libusb_get_device_address(priv->device);
     spice_usb_acl_helper_open_acl_finish(acl_helper, acl_res, &err);
     if (!err && priv->state == STATE_DISCONNECTING) {
         err = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
@@ -298,10 +497,13 @@ static void spice_usbredir_channel_open_acl_cb(
         priv->state  = STATE_DISCONNECTED;
     }
 
-    spice_usb_acl_helper_close_acl(priv->acl_helper);
+    /* the opened device stays usable without the ACL */
+    spice_usb_acl_helper_close_acl(priv->acl_helper, busnum, devnum);
     g_clear_object(&priv->acl_helper);
-    g_object_set(spice_channel_get_session(SPICE_CHANNEL(channel)),
-                 "inhibit-keyboard-grab", FALSE, NULL);
+    manager = spice_usb_device_manager_get(
+        spice_channel_get_session(SPICE_CHANNEL(channel)), NULL);
+    if (manager != NULL)
+        spice_usb_device_manager_inhibit_keyboard_grab(manager, FALSE);
 
     g_simple_async_result_complete_in_idle(priv->result);
     g_clear_object(&priv->result);
@@ -319,7 +521,9 @@ void spice_usbredir_channel_connect_device_async(
 {
     SpiceUsbredirChannelPrivate *priv = channel->priv;
     GSimpleAsyncResult *result;
-#if ! USE_POLKIT
+#if USE_POLKIT
+    SpiceUsbDeviceManager *manager;
+#else
     GError *err = NULL;
 #endif
 
@@ -345,15 +549,27 @@ void spice_usbredir_channel_connect_device_async(
         goto done;
     }
 
+#if USE_POLKIT
+    /* it holds the ACL helper */
+    manager = spice_usb_device_manager_get(
+        spice_channel_get_session(SPICE_CHANNEL(channel)), NULL);
+    if (manager == NULL) {
+        g_simple_async_result_set_error(result,
+                            SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                            "Error USB device manager not available");
+        goto done;
+    }
+#endif
+
     priv->device = libusb_ref_device(device);
     priv->spice_device = g_boxed_copy(spice_usb_device_get_type(),
                                       spice_device);
 #if USE_POLKIT
     priv->result = result;
     priv->state  = STATE_WAITING_FOR_ACL_HELPER;
-    priv->acl_helper = spice_usb_acl_helper_new();
-    g_object_set(spice_channel_get_session(SPICE_CHANNEL(channel)),
-                 "inhibit-keyboard-grab", TRUE, NULL);
+    priv->acl_helper =
+        g_object_ref(spice_usb_device_manager_get_acl_helper(manager));
+    spice_usb_device_manager_inhibit_keyboard_grab(manager, TRUE);
     spice_usb_acl_helper_open_acl(priv->acl_helper,
                                   libusb_get_bus_number(device),
                                   libusb_get_device_address(device),
@@ -394,6 +610,81 @@ gboolean spice_usbredir_channel_connect_device_finish(
     return TRUE;
 }
 
+G_GNUC_INTERNAL
+SpiceUsbDeviceStats *spice_usbredir_channel_get_stats(SpiceUsbredirChannel *channel)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    SpiceUsbDeviceStats *stats;
+
+    STATIC_MUTEX_LOCK(priv->write_lock);
+    stats = spice_usb_device_stats_copy(&priv->stats);
+    stats->bulk_in_flight = g_hash_table_size(priv->bulk_pending);
+    if (priv->bulk_timed > 0)
+        stats->bulk_latency_us = priv->bulk_latency_total / priv->bulk_timed;
+    stats->redirected_time_us = g_get_monotonic_time() - priv->stats_start;
+    STATIC_MUTEX_UNLOCK(priv->write_lock);
+    stats->iso_packets_dropped = g_atomic_int_get(&priv->iso_dropped);
+
+    return stats;
+}
+
+/* main context */
+static void spice_usbredir_channel_report_stats(SpiceUsbredirChannel *channel)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    SpiceUsbDeviceStats *stats = spice_usbredir_channel_get_stats(channel);
+    gdouble elapsed = MAX(stats->redirected_time_us, 1) / 1e6;
+
+    STATIC_MUTEX_LOCK(priv->write_lock);
+    CHANNEL_DEBUG(channel, "device redirected for %.1f s: "
+                  "out %" G_GUINT64_FORMAT " packets in %" G_GUINT64_FORMAT " messages, "
+                  "%.0f packets/s, %.1f KiB/s, "
+                  "in %" G_GUINT64_FORMAT " messages, %.1f KiB/s", elapsed,
+                  priv->packets_out, priv->messages_out,
+                  priv->packets_out / elapsed, stats->bytes_from_device / elapsed / 1024,
+                  priv->messages_in, stats->bytes_to_device / elapsed / 1024);
+    STATIC_MUTEX_UNLOCK(priv->write_lock);
+    CHANNEL_DEBUG(channel, "%" G_GUINT64_FORMAT " control, %" G_GUINT64_FORMAT " bulk, "
+                  "%" G_GUINT64_FORMAT " iso, %" G_GUINT64_FORMAT " interrupt, "
+                  "bulk latency %" G_GUINT64_FORMAT " us (max %" G_GUINT64_FORMAT "), "
+                  "%u in flight at most",
+                  stats->control_transfers, stats->bulk_transfers,
+                  stats->iso_packets, stats->interrupt_packets,
+                  stats->bulk_latency_us, stats->bulk_max_latency_us,
+                  stats->bulk_max_in_flight);
+    spice_usb_device_stats_free(stats);
+}
+
+static void usbredir_release_device(SpiceUsbredirChannel *channel)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+
+    /*
+     * This sets the usb event thread run condition to FALSE, therefor
+     * it must be done before usbredirhost_set_device NULL, as
+     * usbredirhost_set_device NULL will interrupt the
+     * libusb_handle_events call in the thread.
+     */
+    {
+        SpiceSession *session = spice_channel_get_session(SPICE_CHANNEL(channel));
+        if (session != NULL)
+            spice_usb_device_manager_stop_event_listening(
+                spice_usb_device_manager_get(session, NULL));
+    }
+    if (priv->iso_adapt_id != 0) {
+        g_source_remove(priv->iso_adapt_id);
+        priv->iso_adapt_id = 0;
+    }
+    /* This also closes the libusb handle we passed from open_device */
+    usbredirhost_set_device(priv->host, NULL);
+    spice_usbredir_channel_report_stats(channel);
+    libusb_unref_device(priv->device);
+    priv->device = NULL;
+    g_boxed_free(spice_usb_device_get_type(), priv->spice_device);
+    priv->spice_device = NULL;
+    priv->state  = STATE_DISCONNECTED;
+}
+
 G_GNUC_INTERNAL
 void spice_usbredir_channel_disconnect_device(SpiceUsbredirChannel *channel)
 {
@@ -409,29 +700,23 @@ void spice_usbredir_channel_disconnect_device(SpiceUsbredirChannel *channel)
     case STATE_WAITING_FOR_ACL_HELPER:
         priv->state = STATE_DISCONNECTING;
         /* We're still waiting for the acl helper -> cancel it */
-        spice_usb_acl_helper_close_acl(priv->acl_helper);
+        spice_usb_acl_helper_close_acl(priv->acl_helper,
+                                       libusb_get_bus_number(priv->device),
+                                       libusb_get_device_address(priv->device));
         break;
 #endif
     case STATE_CONNECTED:
         /*
-         * This sets the usb event thread run condition to FALSE, therefor
-         * it must be done before usbredirhost_set_device NULL, as
-         * usbredirhost_set_device NULL will interrupt the
-         * libusb_handle_events call in the thread.
+         * The coroutine yields in the middle of the usbredirhost parser,
+         * which must not see the device go: it goes once the read returns.
          */
-        {
-            SpiceSession *session = spice_channel_get_session(SPICE_CHANNEL(channel));
-            if (session != NULL)
-                spice_usb_device_manager_stop_event_listening(
-                    spice_usb_device_manager_get(session, NULL));
+        if (priv->reading) {
+            CHANNEL_DEBUG(channel, "reading guest data, deferring the disconnection");
+            priv->state = STATE_DISCONNECTING;
+            priv->disconnect_deferred = TRUE;
+            break;
         }
-        /* This also closes the libusb handle we passed from open_device */
-        usbredirhost_set_device(priv->host, NULL);
-        libusb_unref_device(priv->device);
-        priv->device = NULL;
-        g_boxed_free(spice_usb_device_get_type(), priv->spice_device);
-        priv->spice_device = NULL;
-        priv->state  = STATE_DISCONNECTED;
+        usbredir_release_device(channel);
         break;
     }
 }
@@ -472,7 +757,7 @@ static void usbredir_write_flush_callback(void *user_data)
     if (!priv->host)
         return;
 
-    usbredirhost_write_guest_data(priv->host);
+    usbredir_write_guest_data(channel);
 }
 
 static void usbredir_log(void *user_data, int level, const char *msg)
@@ -502,16 +787,181 @@ static void usbredir_log(void *user_data, int level, const char *msg)
     }
 }
 
+/*
+ * The usbredir packet headers are read to count the transfers: with
+ * usbredirhost_fl_write_cb_owns_buffer, each write buffer is a packet,
+ * the guest data is followed as a stream.
+ */
+#define USBREDIR_MAX_PACKET_SIZE (64 * 1024 * 1024)
+
+static guint32 usbredir_read_le32(const guint8 *p)
+{
+    guint32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return GUINT32_FROM_LE(v);
+}
+
+static guint64 usbredir_read_le64(const guint8 *p)
+{
+    guint64 v;
+
+    memcpy(&v, p, sizeof(v));
+    return GUINT64_FROM_LE(v);
+}
+
+/* any context, with write_lock held */
+static void usbredir_stats_packet_to_guest(SpiceUsbredirChannel *channel,
+                                           const guint8 *data, gsize count)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    guint32 type, length;
+    gsize header_len;
+    guint64 id;
+    UsbredirTransfer *transfer;
+
+    priv->packets_out++;
+    priv->stats.bytes_from_device += count;
+    if (count < 12)
+        return;
+
+    type = usbredir_read_le32(data);
+    length = usbredir_read_le32(data + 4);
+    if (length > count - 12)
+        return;
+    header_len = count - length;
+    id = header_len >= 16 ? usbredir_read_le64(data + 8) : usbredir_read_le32(data + 8);
+
+    switch (type) {
+    case usb_redir_hello:
+        if (length >= 64 + 4)
+            priv->host_ids_64bits = (usbredir_read_le32(data + header_len + 64) &
+                                     (1 << usb_redir_cap_64bits_ids)) != 0;
+        break;
+    case usb_redir_control_packet:
+        priv->stats.control_transfers++;
+        break;
+    case usb_redir_bulk_packet:
+        priv->stats.bulk_transfers++;
+        transfer = g_hash_table_lookup(priv->bulk_pending, &id);
+        if (transfer != NULL) {
+            guint64 latency = g_get_monotonic_time() - transfer->time;
+
+            priv->bulk_timed++;
+            priv->bulk_latency_total += latency;
+            priv->stats.bulk_max_latency_us = MAX(priv->stats.bulk_max_latency_us, latency);
+            g_hash_table_remove(priv->bulk_pending, &id);
+        }
+        break;
+    case usb_redir_iso_packet:
+        priv->stats.iso_packets++;
+        priv->iso_packets_out++;
+        priv->iso_bytes_out += count;
+        break;
+    case usb_redir_interrupt_packet:
+        priv->stats.interrupt_packets++;
+        break;
+    }
+}
+
+/* coroutine context */
+static void usbredir_stats_packet_from_guest(SpiceUsbredirChannel *channel,
+                                             guint32 type, guint64 id)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    UsbredirTransfer *transfer;
+
+    switch (type) {
+    case usb_redir_bulk_packet:
+        transfer = g_new(UsbredirTransfer, 1);
+        transfer->id = id;
+        transfer->time = g_get_monotonic_time();
+        STATIC_MUTEX_LOCK(priv->write_lock);
+        g_hash_table_replace(priv->bulk_pending, &transfer->id, transfer);
+        priv->stats.bulk_max_in_flight = MAX(priv->stats.bulk_max_in_flight,
+                                             g_hash_table_size(priv->bulk_pending));
+        STATIC_MUTEX_UNLOCK(priv->write_lock);
+        break;
+    case usb_redir_iso_packet:
+        STATIC_MUTEX_LOCK(priv->write_lock);
+        priv->stats.iso_packets++;
+        STATIC_MUTEX_UNLOCK(priv->write_lock);
+        break;
+    }
+}
+
+/* coroutine context */
+static void usbredir_stats_data_from_guest(SpiceUsbredirChannel *channel,
+                                           const guint8 *data, gsize len)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    UsbredirStreamTracker *t = &priv->tracker;
+
+    /* updated by the coroutine only */
+    priv->stats.bytes_to_device += len;
+
+    while (len > 0 && !t->lost) {
+        guint header_len = t->ids_64bits ? 16 : 12;
+        gsize n;
+
+        if (t->header_read < header_len) {
+            n = MIN(header_len - t->header_read, len);
+            memcpy(t->header + t->header_read, data, n);
+            t->header_read += n;
+            if (t->header_read == header_len) {
+                t->type = usbredir_read_le32(t->header);
+                t->left = usbredir_read_le32(t->header + 4);
+                t->hello_read = 0;
+                if (t->left > USBREDIR_MAX_PACKET_SIZE) {
+                    CHANNEL_DEBUG(channel, "lost track of the usbredir packets");
+                    t->lost = TRUE;
+                    break;
+                }
+                usbredir_stats_packet_from_guest(channel, t->type, header_len == 16 ?
+                                                 usbredir_read_le64(t->header + 8) :
+                                                 usbredir_read_le32(t->header + 8));
+            }
+        } else {
+            n = MIN(t->left, len);
+            if (t->type == usb_redir_hello && t->hello_read < sizeof(t->hello)) {
+                gsize h = MIN(n, sizeof(t->hello) - t->hello_read);
+
+                memcpy(t->hello + t->hello_read, data, h);
+                t->hello_read += h;
+            }
+            t->left -= n;
+        }
+        data += n;
+        len -= n;
+
+        if (t->header_read == header_len && t->left == 0) {
+            /* from the next packet, if both have the cap */
+            if (t->type == usb_redir_hello && t->hello_read == sizeof(t->hello))
+                t->ids_64bits = priv->host_ids_64bits &&
+                    (usbredir_read_le32(t->hello + 64) & (1 << usb_redir_cap_64bits_ids));
+            t->header_read = 0;
+        }
+    }
+}
+
 static int usbredir_read_callback(void *user_data, uint8_t *data, int count)
 {
     SpiceUsbredirChannel *channel = user_data;
     SpiceUsbredirChannelPrivate *priv = channel->priv;
 
+    if (priv->read_buf == NULL) {
+        count = spice_channel_read_msg_data(SPICE_CHANNEL(channel), data, count);
+        if (count > 0)
+            usbredir_stats_data_from_guest(channel, data, count);
+        return count;
+    }
+
     if (priv->read_buf_size < count) {
         count = priv->read_buf_size;
     }
 
     memcpy(data, priv->read_buf, count);
+    usbredir_stats_data_from_guest(channel, data, count);
 
     priv->read_buf_size -= count;
     if (priv->read_buf_size) {
@@ -523,28 +973,171 @@ static int usbredir_read_callback(void *user_data, uint8_t *data, int count)
     return count;
 }
 
+/* the same for a packet written and freed, from its header */
+static gint usbredir_queued_size(const guint8 *data)
+{
+    return 12 + usbredir_read_le32(data + 4);
+}
+
+/* once sent, or dropped with the channel */
 static void usbredir_free_write_cb_data(uint8_t *data, void *user_data)
 {
     SpiceUsbredirChannel *channel = user_data;
     SpiceUsbredirChannelPrivate *priv = channel->priv;
 
+    g_atomic_int_add(&priv->queued, -usbredir_queued_size(data));
     usbredirhost_free_write_buffer(priv->host, data);
 }
 
+/* any context */
+static GSList *usbredir_handed_off_take(SpiceUsbredirChannel *channel)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    GSList *list;
+
+    do {
+        list = g_atomic_pointer_get(&priv->handed_off);
+    } while (list != NULL &&
+             !g_atomic_pointer_compare_and_exchange(&priv->handed_off, list, NULL));
+
+    return g_slist_reverse(list);
+}
+
+/* main context */
+static void usbredir_handed_off_send(SpiceUsbredirChannel *channel)
+{
+    GSList *list = usbredir_handed_off_take(channel);
+    GSList *l;
+
+    for (l = list; l != NULL; l = l->next)
+        spice_msg_out_send(l->data);
+    g_slist_free(list);
+}
+
+/* main context */
+static gboolean usbredir_handed_off_idle(gpointer user_data)
+{
+    SpiceUsbredirChannel *channel = user_data;
+
+    /* before the messages are taken, a later one wakes up again */
+    g_atomic_int_set(&channel->priv->handed_off_wakeup, FALSE);
+    usbredir_handed_off_send(channel);
+
+    return FALSE;
+}
+
+static void usbredir_handed_off_free(SpiceUsbredirChannel *channel)
+{
+    GSList *list = usbredir_handed_off_take(channel);
+
+    g_slist_free_full(list, (GDestroyNotify)spice_msg_out_unref);
+}
+
+/*
+ * The usb event thread would take the channel xmit queue lock, and wake
+ * the main loop up, for each message of an isochronous stream: its
+ * messages are pushed on a list instead, and sent from the main context
+ * with a single wakeup for all those pushed meanwhile.
+ */
+/* usb event thread, with write_lock held */
+static void usbredir_hand_off(SpiceUsbredirChannel *channel, SpiceMsgOut *msg)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    GSList *link = g_slist_alloc();
+
+    link->data = msg;
+    do {
+        link->next = g_atomic_pointer_get(&priv->handed_off);
+    } while (!g_atomic_pointer_compare_and_exchange(&priv->handed_off, link->next, link));
+
+    if (g_atomic_int_compare_and_exchange(&priv->handed_off_wakeup, FALSE, TRUE))
+        g_idle_add_full(G_PRIORITY_HIGH, usbredir_handed_off_idle,
+                        g_object_ref(channel), g_object_unref);
+}
+
+/* any context, with write_lock held */
+static void usbredir_write_msg_send(SpiceUsbredirChannel *channel)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+
+    if (priv->write_msg == NULL)
+        return;
+
+    if (g_main_context_is_owner(g_main_context_default())) {
+        /* after those handed off before */
+        usbredir_handed_off_send(channel);
+        spice_msg_out_send(priv->write_msg);
+    } else {
+        usbredir_hand_off(channel, priv->write_msg);
+    }
+    priv->write_msg = NULL;
+    priv->write_msg_size = 0;
+    priv->messages_out++;
+}
+
+/* any context, called by usbredirhost_write_guest_data() */
 static int usbredir_write_callback(void *user_data, uint8_t *data, int count)
 {
     SpiceUsbredirChannel *channel = user_data;
-    SpiceMsgOut *msg_out;
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+
+    if (priv->write_msg != NULL &&
+        priv->write_msg_size + count > priv->write_msg_max_size)
+        usbredir_write_msg_send(channel);
 
-    msg_out = spice_msg_out_new(SPICE_CHANNEL(channel),
-                                SPICE_MSGC_SPICEVMC_DATA);
-    spice_marshaller_add_ref_full(msg_out->marshaller, data, count,
+    if (priv->write_msg == NULL)
+        priv->write_msg = spice_msg_out_new(SPICE_CHANNEL(channel),
+                                            SPICE_MSGC_SPICEVMC_DATA);
+    spice_marshaller_add_ref_full(priv->write_msg->marshaller, data, count,
                                   usbredir_free_write_cb_data, channel);
-    spice_msg_out_send(msg_out);
+    priv->write_msg_size += count;
+    g_atomic_int_add(&priv->queued, usbredir_queued_size(data));
+    usbredir_stats_packet_to_guest(channel, data, count);
 
     return count;
 }
 
+/* any context: sends what usbredirhost has queued, with one wakeup */
+static void usbredir_write_guest_data(SpiceUsbredirChannel *channel)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+
+    STATIC_MUTEX_LOCK(priv->write_lock);
+    usbredirhost_write_guest_data(priv->host);
+    usbredir_write_msg_send(channel);
+    STATIC_MUTEX_UNLOCK(priv->write_lock);
+}
+
+#ifdef HAVE_USBREDIRHOST_BUFFERED_OUTPUT
+/*
+ * usb event thread, for each isochronous packet from the device: the
+ * packets are dropped while it is over usbredirhost's threshold, it
+ * starts again once it is under. The size is kept for the channel
+ * budget instead, with its own hysteresis.
+ */
+static uint64_t usbredir_buffered_output_size_callback(void *user_data)
+{
+    SpiceUsbredirChannel *channel = user_data;
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    gint queued = g_atomic_int_get(&priv->queued);
+    gint budget = g_atomic_int_get(&priv->iso_budget);
+
+    if (priv->iso_dropping && queued < budget / 2) {
+        CHANNEL_DEBUG(channel, "isochronous packets sent again, %d bytes queued", queued);
+        priv->iso_dropping = FALSE;
+    } else if (!priv->iso_dropping && queued > budget) {
+        CHANNEL_DEBUG(channel, "dropping isochronous packets, %d bytes queued", queued);
+        priv->iso_dropping = TRUE;
+    }
+
+    if (!priv->iso_dropping)
+        return 0;
+
+    g_atomic_int_inc(&priv->iso_dropped);
+    return G_MAXUINT64;
+}
+#endif
+
 static void *usbredir_alloc_lock(void) {
 #if GLIB_CHECK_VERSION(2,32,0)
     GMutex *mutex;
@@ -615,30 +1208,27 @@ static gboolean device_error(gpointer user_data)
 static void spice_usbredir_channel_up(SpiceChannel *c)
 {
     SpiceUsbredirChannel *channel = SPICE_USBREDIR_CHANNEL(c);
-    SpiceUsbredirChannelPrivate *priv = channel->priv;
 
     /* Flush any pending writes */
-    usbredirhost_write_guest_data(priv->host);
+    usbredir_write_guest_data(channel);
 }
 
-static void usbredir_handle_msg(SpiceChannel *c, SpiceMsgIn *in)
+/* coroutine context */
+static void usbredir_read_guest_data(SpiceUsbredirChannel *channel)
 {
-    SpiceUsbredirChannel *channel = SPICE_USBREDIR_CHANNEL(c);
+    SpiceChannel *c = SPICE_CHANNEL(channel);
     SpiceUsbredirChannelPrivate *priv = channel->priv;
     device_error_data data;
-    int r, size;
-    uint8_t *buf;
-
-    g_return_if_fail(priv->host != NULL);
-
-    /* No recursion allowed! */
-    g_return_if_fail(priv->read_buf == NULL);
-
-    buf = spice_msg_in_raw(in, &size);
-    priv->read_buf = buf;
-    priv->read_buf_size = size;
+    int r;
 
+    priv->reading = TRUE;
     r = usbredirhost_read_guest_data(priv->host);
+    priv->reading = FALSE;
+    if (priv->disconnect_deferred) {
+        priv->disconnect_deferred = FALSE;
+        usbredir_release_device(channel);
+        return;
+    }
     if (r != 0) {
         SpiceUsbDevice *spice_device = priv->spice_device;
         gchar *desc;
@@ -683,4 +1273,41 @@ static void usbredir_handle_msg(SpiceChannel *c, SpiceMsgIn *in)
     }
 }
 
+static void usbredir_handle_msg(SpiceChannel *c, SpiceMsgIn *in)
+{
+    SpiceUsbredirChannel *channel = SPICE_USBREDIR_CHANNEL(c);
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    int size;
+    uint8_t *buf;
+
+    g_return_if_fail(priv->host != NULL);
+
+    /* No recursion allowed! */
+    g_return_if_fail(!priv->reading);
+
+    buf = spice_msg_in_raw(in, &size);
+    priv->read_buf = buf;
+    priv->read_buf_size = size;
+    priv->messages_in++;
+
+    usbredir_read_guest_data(channel);
+}
+
+/*
+ * The parser reads the data straight into its packets, a bulk or
+ * isochronous stream isn't copied out of a SpiceMsgIn first.
+ */
+/* coroutine context */
+static void usbredir_read_msg_data(SpiceChannel *c, gsize size)
+{
+    SpiceUsbredirChannel *channel = SPICE_USBREDIR_CHANNEL(c);
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+
+    g_return_if_fail(priv->host != NULL);
+    g_return_if_fail(!priv->reading);
+
+    priv->messages_in++;
+    usbredir_read_guest_data(channel);
+}
+
 #endif /* USE_USBREDIR */
@@ -24,7 +24,6 @@
 #include "spice-marshal.h"
 #include "glib-compat.h"
 #include "vmcstream.h"
-#include "giopipe.h"
 
 /**
  * SECTION:channel-webdav
@@ -58,10 +57,11 @@ struct _SpiceWebdavChannelPrivate {
     OutputQueue *queue;
 
     gboolean demuxing;
+    gboolean demux_blocked; /* a client has too much to write */
     struct _demux {
         gint64 client;
         guint16 size;
-        guint8 *buf;
+        GByteArray *data;
     } demux;
 };
 
@@ -69,11 +69,28 @@ G_DEFINE_TYPE(SpiceWebdavChannel, spice_webdav_channel, SPICE_TYPE_PORT_CHANNEL)
 
 static void spice_webdav_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 
+/*
+ * The mux writes are copied into the channel messages: several are
+ * written before waiting for them to reach the wire, up to this size.
+ */
+#define OUTPUT_QUEUE_WINDOW (512 * 1024)
+
+/*
+ * The guest daemon frames are at most MAX_MUX_SIZE: the smaller ones,
+ * replies to interactive requests, are gathered in a single channel
+ * message when several are queued.
+ */
+#define OUTPUT_QUEUE_GATHER_SIZE (4 * 1024)
+#define OUTPUT_QUEUE_GATHER_MAX (64 * 1024)
+
 struct _OutputQueue {
+    SpiceChannel *channel; /* weak */
     GOutputStream *output;
     gboolean flushing;
+    gsize in_flight; /* written since the last flush */
     guint idle_id;
     GQueue *queue;
+    GByteArray *gather;
 };
 
 typedef struct _OutputQueueElem {
@@ -84,12 +101,14 @@ typedef struct _OutputQueueElem {
     gpointer user_data;
 } OutputQueueElem;
 
-static OutputQueue* output_queue_new(GOutputStream *output)
+static OutputQueue* output_queue_new(SpiceChannel *channel, GOutputStream *output)
 {
     OutputQueue *queue = g_new0(OutputQueue, 1);
 
+    queue->channel = channel;
     queue->output = g_object_ref(output);
     queue->queue = g_queue_new();
+    queue->gather = g_byte_array_sized_new(OUTPUT_QUEUE_GATHER_MAX);
 
     return queue;
 }
@@ -97,9 +116,9 @@ static OutputQueue* output_queue_new(GOutputStream *output)
 static void output_queue_free(OutputQueue *queue)
 {
     g_warn_if_fail(g_queue_get_length(queue->queue) == 0);
-    g_warn_if_fail(!queue->flushing);
 
     g_queue_free_full(queue->queue, g_free);
+    g_byte_array_unref(queue->gather);
     g_clear_object(&queue->output);
     if (queue->idle_id)
         g_source_remove(queue->idle_id);
@@ -113,57 +132,92 @@ static void output_queue_flush_cb(GObject *source_object,
                                   gpointer user_data)
 {
     GError *error = NULL;
-    OutputQueueElem *e = user_data;
-    OutputQueue *q = e->queue;
+    OutputQueue *q;
 
-    q->flushing = FALSE;
-    g_output_stream_flush_finish(G_OUTPUT_STREAM(source_object),
-                                 res, &error);
+    spice_channel_flush_finish(SPICE_CHANNEL(source_object), res, &error);
     if (error)
-        g_warning("error: %s", error->message);
-
+        CHANNEL_DEBUG(source_object, "flush failed: %s", error->message);
     g_clear_error(&error);
 
-    if (!q->idle_id)
-        q->idle_id = g_idle_add(output_queue_idle, q);
+    /* the channel outlives the flush, not the queue */
+    q = SPICE_WEBDAV_CHANNEL(source_object)->priv->queue;
+    if (q == NULL)
+        return;
 
-    g_free(e);
+    q->flushing = FALSE;
+    q->in_flight = 0;
+    if (!q->idle_id && !g_queue_is_empty(q->queue))
+        q->idle_id = g_idle_add(output_queue_idle, q);
 }
 
-static gboolean output_queue_idle(gpointer user_data)
+static gboolean output_queue_write(OutputQueue *q, const guint8 *buf, gsize size)
 {
-    OutputQueue *q = user_data;
-    OutputQueueElem *e;
     GError *error = NULL;
 
-    if (q->flushing) {
-        q->idle_id = 0;
+    if (!g_output_stream_write_all(q->output, buf, size, NULL, NULL, &error)) {
+        g_warning("failed to write to output stream");
+        if (error)
+            g_warning("error: %s", error->message);
+        g_clear_error(&error);
         return FALSE;
     }
+    q->in_flight += size;
 
-    e = g_queue_pop_head(q->queue);
-    if (!e) {
-        q->idle_id = 0;
-        return FALSE;
-    }
+    return TRUE;
+}
 
-    if (!g_output_stream_write_all(q->output, e->buf, e->size, NULL, NULL, &error))
-        goto err;
-    else if (e->pushed_cb)
-        e->pushed_cb(q, e->user_data);
+static gboolean output_queue_write_gathered(OutputQueue *q)
+{
+    gboolean success = TRUE;
 
-    q->flushing = TRUE;
-    g_output_stream_flush_async(q->output, G_PRIORITY_DEFAULT, NULL, output_queue_flush_cb, e);
+    if (q->gather->len > 0) {
+        success = output_queue_write(q, q->gather->data, q->gather->len);
+        g_byte_array_set_size(q->gather, 0);
+    }
 
-    return TRUE;
+    return success;
+}
 
-err:
-    g_warning("failed to write to output stream");
-    if (error)
-        g_warning("error: %s", error->message);
-    g_clear_error(&error);
+static gboolean output_queue_idle(gpointer user_data)
+{
+    OutputQueue *q = user_data;
+    OutputQueueElem *e;
 
     q->idle_id = 0;
+
+    while (q->in_flight + q->gather->len < OUTPUT_QUEUE_WINDOW &&
+           (e = g_queue_pop_head(q->queue)) != NULL) {
+        gboolean success;
+
+        if (e->size < OUTPUT_QUEUE_GATHER_SIZE) {
+            success = TRUE;
+            if (q->gather->len + e->size > OUTPUT_QUEUE_GATHER_MAX)
+                success = output_queue_write_gathered(q);
+            g_byte_array_append(q->gather, e->buf, e->size);
+        } else {
+            /* in order */
+            success = output_queue_write_gathered(q) &&
+                output_queue_write(q, e->buf, e->size);
+        }
+        if (!success) {
+            g_free(e);
+            return FALSE;
+        }
+
+        if (e->pushed_cb)
+            e->pushed_cb(q, e->user_data);
+        g_free(e);
+    }
+
+    if (!output_queue_write_gathered(q))
+        return FALSE;
+
+    /* learn when the first half of the window is out, and go on */
+    if (!q->flushing && q->in_flight >= OUTPUT_QUEUE_WINDOW / 2) {
+        q->flushing = TRUE;
+        spice_channel_flush_async(q->channel, NULL, output_queue_flush_cb, NULL);
+    }
+
     return FALSE;
 }
 
@@ -179,10 +233,19 @@ static void output_queue_push(OutputQueue *q, const guint8 *buf, gsize size,
     e->queue = q;
     g_queue_push_tail(q->queue, e);
 
-    if (!q->idle_id && !q->flushing)
+    if (!q->idle_id && q->in_flight < OUTPUT_QUEUE_WINDOW)
         q->idle_id = g_idle_add(output_queue_idle, q);
 }
 
+/* a client has a single read in flight, they take turns in the queue */
+#define MAX_MUX_SIZE G_MAXUINT16
+/* phodav and the channel don't wait on each other for that much */
+#define CLIENT_PIPE_CAPACITY (4 * MAX_MUX_SIZE)
+#define MUX_HEADER_SIZE (sizeof(gint64) + sizeof(guint16))
+
+/* the demux goes on while a client has less than that to write */
+#define MAX_DEMUX_PENDING (1024 * 1024)
+
 typedef struct Client
 {
     guint refs;
@@ -192,10 +255,13 @@ typedef struct Client
     GCancellable *cancellable;
 
     struct _mux {
-        gint64 id;
         guint16 size;
-        guint8 *buf;
+        guint8 *buf; /* the header, then the data */
     } mux;
+
+    GQueue demux_queue; /* GByteArray */
+    gsize demux_pending;
+    gboolean demux_writing;
 } Client;
 
 static void
@@ -205,6 +271,8 @@ client_unref(Client *client)
         return;
 
     g_free(client->mux.buf);
+    g_queue_foreach(&client->demux_queue, (GFunc)g_byte_array_unref, NULL);
+    g_queue_clear(&client->demux_queue);
 
     g_object_unref(client->pipe);
     g_object_unref(client->cancellable);
@@ -220,6 +288,7 @@ client_ref(Client *client)
 }
 
 static void client_start_read(SpiceWebdavChannel *self, Client *client);
+static void start_demux(SpiceWebdavChannel *self);
 
 static void remove_client(SpiceWebdavChannel *self, Client *client)
 {
@@ -232,6 +301,12 @@ static void remove_client(SpiceWebdavChannel *self, Client *client)
 
     c = self->priv;
     g_hash_table_remove(c->clients, &client->id);
+
+    /* it may be the one the demux waits for */
+    if (c->demux_blocked) {
+        c->demux_blocked = FALSE;
+        start_demux(self);
+    }
 }
 
 static void mux_pushed_cb(OutputQueue *q, gpointer user_data)
@@ -247,8 +322,6 @@ static void mux_pushed_cb(OutputQueue *q, gpointer user_data)
     client_unref(client);
 }
 
-#define MAX_MUX_SIZE G_MAXUINT16
-
 static void server_reply_cb(GObject *source_object,
                             GAsyncResult *res,
                             gpointer user_data)
@@ -258,6 +331,7 @@ static void server_reply_cb(GObject *source_object,
     SpiceWebdavChannelPrivate *c = self->priv;
     GError *err = NULL;
     gssize size;
+    guint16 le_size;
 
     size = g_input_stream_read_finish(G_INPUT_STREAM(source_object), res, &err);
     if (err || g_cancellable_is_cancelled(client->cancellable))
@@ -267,10 +341,11 @@ static void server_reply_cb(GObject *source_object,
     g_return_if_fail(size >= 0);
     client->mux.size = size;
 
-    output_queue_push(c->queue, (guint8 *)&client->mux.id, sizeof(gint64), NULL, NULL);
-    client->mux.size = GUINT16_TO_LE(client->mux.size);
-    output_queue_push(c->queue, (guint8 *)&client->mux.size, sizeof(guint16), NULL, NULL);
-    output_queue_push(c->queue, (guint8 *)client->mux.buf, size, (GFunc)mux_pushed_cb, client);
+    /* the id is already in place, a single write for the message */
+    le_size = GUINT16_TO_LE(client->mux.size);
+    memcpy(client->mux.buf + sizeof(gint64), &le_size, sizeof(guint16));
+    output_queue_push(c->queue, client->mux.buf, MUX_HEADER_SIZE + size,
+                      (GFunc)mux_pushed_cb, client);
 
     return;
 
@@ -290,114 +365,128 @@ static void client_start_read(SpiceWebdavChannel *self, Client *client)
     GInputStream *input;
 
     input = g_io_stream_get_input_stream(G_IO_STREAM(client->pipe));
-    g_input_stream_read_async(input, client->mux.buf, MAX_MUX_SIZE,
+    g_input_stream_read_async(input, client->mux.buf + MUX_HEADER_SIZE, MAX_MUX_SIZE,
                               G_PRIORITY_DEFAULT, client->cancellable, server_reply_cb,
                               client_ref(client));
 }
 
-static void start_demux(SpiceWebdavChannel *self);
-
 #ifdef USE_PHODAV
-static void demux_to_client_finish(SpiceWebdavChannel *self,
-                                   Client *client, gboolean fail)
+static void client_demux_write(Client *client);
+
+static void client_demux_write_cb(GObject *source, GAsyncResult *result, gpointer user_data)
 {
-    SpiceWebdavChannelPrivate *c = self->priv;
+    Client *client = user_data;
+    SpiceWebdavChannel *self = client->self;
+    GByteArray *data = g_queue_pop_head(&client->demux_queue);
+    GError *error = NULL;
+    gsize size = 0;
+
+    g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, &size, &error);
+    client->demux_writing = FALSE;
+    client->demux_pending -= data->len;
+
+    if (g_cancellable_is_cancelled(client->cancellable))
+        goto end;
 
-    if (fail) {
+    if (error)
+        CHANNEL_DEBUG(self, "write failed: %s", error->message);
+
+    if (size != data->len) {
         remove_client(self, client);
+        goto end;
     }
 
-    c->demuxing = FALSE;
-    start_demux(self);
+    client_demux_write(client);
+    if (self->priv->demux_blocked && client->demux_pending < MAX_DEMUX_PENDING) {
+        self->priv->demux_blocked = FALSE;
+        start_demux(self);
+    }
+
+end:
+    g_clear_error(&error);
+    g_byte_array_unref(data);
+    client_unref(client);
 }
 
-static void demux_to_client_cb(GObject *source, GAsyncResult *result, gpointer user_data)
+/* each client is written to on its own, a slow one doesn't hold the others */
+static void client_demux_write(Client *client)
 {
-    Client *client = user_data;
-    SpiceWebdavChannelPrivate *c = client->self->priv;
-    GError *error = NULL;
-    gboolean fail;
-    gsize size;
+    GByteArray *data;
 
-    g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, &size, &error);
+    if (client->demux_writing)
+        return;
 
-    if (error) {
-        CHANNEL_DEBUG(client->self, "write failed: %s", error->message);
-        g_clear_error(&error);
-    }
+    data = g_queue_peek_head(&client->demux_queue);
+    if (data == NULL)
+        return;
 
-    fail = (size != c->demux.size);
-    g_warn_if_fail(size == c->demux.size);
-    demux_to_client_finish(client->self, client, fail);
+    client->demux_writing = TRUE;
+    g_output_stream_write_all_async(g_io_stream_get_output_stream(client->pipe),
+                                    data->data, data->len, G_PRIORITY_DEFAULT,
+                                    client->cancellable, client_demux_write_cb,
+                                    client_ref(client));
 }
 #endif
 
-static void demux_to_client(SpiceWebdavChannel *self,
-                            Client *client)
+/* returns FALSE if the demux should wait for the client to write */
+static gboolean demux_to_client(SpiceWebdavChannel *self,
+                                Client *client, GByteArray *data)
 {
 #ifdef USE_PHODAV
-    SpiceWebdavChannelPrivate *c = self->priv;
-    gsize size = c->demux.size;
+    CHANNEL_DEBUG(self, "pushing %u to client %p", data->len, client);
 
-    CHANNEL_DEBUG(self, "pushing %"G_GSIZE_FORMAT" to client %p", size, client);
-
-    if (size > 0) {
-        g_output_stream_write_all_async(g_io_stream_get_output_stream(client->pipe),
-                                        c->demux.buf, size, G_PRIORITY_DEFAULT,
-                                        c->cancellable, demux_to_client_cb, client);
-        return;
-    } else {
-        /* Nothing to write */
-        demux_to_client_finish(self, client, FALSE);
+    if (data->len > 0) {
+        g_queue_push_tail(&client->demux_queue, g_byte_array_ref(data));
+        client->demux_pending += data->len;
+        client_demux_write(client);
     }
+
+    return client->demux_pending < MAX_DEMUX_PENDING;
+#else
+    return TRUE;
 #endif
 }
 
-static void start_client(SpiceWebdavChannel *self)
+static Client *start_client(SpiceWebdavChannel *self)
 {
 #ifdef USE_PHODAV
     SpiceWebdavChannelPrivate *c = self->priv;
     Client *client;
-    GIOStream *peer = NULL;
+    GIOStream *pipe;
     SpiceSession *session;
-    SoupServer *server;
-    GSocketAddress *addr;
     GError *error = NULL;
+    gint64 mux_id;
 
     session = spice_channel_get_session(SPICE_CHANNEL(self));
-    server = phodav_server_get_soup_server(spice_session_get_webdav_server(session));
 
     CHANNEL_DEBUG(self, "starting client %" G_GINT64_FORMAT, c->demux.client);
 
+    /* the server answers from its own thread, if any */
+    pipe = spice_session_webdav_connect(session, CLIENT_PIPE_CAPACITY, &error);
+    if (pipe == NULL) {
+        CHANNEL_DEBUG(self, "failed to start client: %s", error->message);
+        g_clear_error(&error);
+        return NULL;
+    }
+
     client = g_new0(Client, 1);
     client->refs = 1;
     client->id = c->demux.client;
     client->self = self;
-    client->mux.id = GINT64_TO_LE(client->id);
-    client->mux.buf = g_malloc0(MAX_MUX_SIZE);
+    client->mux.buf = g_malloc0(MUX_HEADER_SIZE + MAX_MUX_SIZE);
+    mux_id = GINT64_TO_LE(client->id);
+    memcpy(client->mux.buf, &mux_id, sizeof(gint64));
+    g_queue_init(&client->demux_queue);
     client->cancellable = g_cancellable_new();
-    spice_make_pipe(&client->pipe, &peer);
-
-    addr = g_inet_socket_address_new_from_string ("127.0.0.1", 0);
-    if (!soup_server_accept_iostream(server, peer, addr, addr, &error))
-        goto fail;
+    client->pipe = pipe;
 
     g_hash_table_insert(c->clients, &client->id, client);
 
     client_start_read(self, client);
-    demux_to_client(self, client);
 
-    g_clear_object(&addr);
-    return;
-
-fail:
-    if (error)
-        CHANNEL_DEBUG(self, "failed to start client: %s", error->message);
-
-    g_clear_object(&addr);
-    g_clear_object(&peer);
-    g_clear_error(&error);
-    client_unref(client);
+    return client;
+#else
+    return NULL;
 #endif
 }
 
@@ -408,7 +497,9 @@ static void data_read_cb(GObject *source_object,
     SpiceWebdavChannel *self = user_data;
     SpiceWebdavChannelPrivate *c;
     Client *client;
+    GByteArray *data;
     GError *error = NULL;
+    gboolean blocked = FALSE;
     gssize size;
 
     size = spice_vmc_input_stream_read_all_finish(G_INPUT_STREAM(source_object), res, &error);
@@ -421,12 +512,23 @@ static void data_read_cb(GObject *source_object,
     c = self->priv;
     g_return_if_fail(size == c->demux.size);
 
-    client = g_hash_table_lookup(c->clients, &c->demux.client);
+    data = c->demux.data;
+    c->demux.data = NULL;
 
+    client = g_hash_table_lookup(c->clients, &c->demux.client);
+    if (!client)
+        client = start_client(self);
     if (client)
-        demux_to_client(self, client);
-    else
-        start_client(self);
+        blocked = !demux_to_client(self, client, data);
+    g_byte_array_unref(data);
+
+    c->demuxing = FALSE;
+    if (blocked) {
+        CHANNEL_DEBUG(self, "waiting for client %p to write", client);
+        c->demux_blocked = TRUE;
+    } else {
+        start_demux(self);
+    }
 }
 
 
@@ -446,8 +548,12 @@ static void size_read_cb(GObject *source_object,
 
     c = self->priv;
     c->demux.size = GUINT16_FROM_LE(c->demux.size);
+    /* read into the buffer handed to the client */
+    g_clear_pointer(&c->demux.data, g_byte_array_unref);
+    c->demux.data = g_byte_array_sized_new(c->demux.size);
+    g_byte_array_set_size(c->demux.data, c->demux.size);
     spice_vmc_input_stream_read_all_async(istream,
-        c->demux.buf, c->demux.size,
+        c->demux.data->data, c->demux.size,
         G_PRIORITY_DEFAULT, c->cancellable, data_read_cb, self);
     return;
 
@@ -490,7 +596,7 @@ static void start_demux(SpiceWebdavChannel *self)
     SpiceWebdavChannelPrivate *c = self->priv;
     GInputStream *istream = g_io_stream_get_input_stream(G_IO_STREAM(c->stream));
 
-    if (c->demuxing)
+    if (c->demuxing || c->demux_blocked)
         return;
 
     c->demuxing = TRUE;
@@ -513,6 +619,7 @@ static void port_event(SpiceWebdavChannel *self, gint event)
         g_cancellable_cancel(c->cancellable);
         c->demuxing = FALSE;
         g_hash_table_remove_all(c->clients);
+        c->demux_blocked = FALSE;
     }
 }
 
@@ -533,17 +640,16 @@ static void spice_webdav_channel_init(SpiceWebdavChannel *channel)
     c->cancellable = g_cancellable_new();
     c->clients = g_hash_table_new_full(g_int64_hash, g_int64_equal,
                                        NULL, client_remove_unref);
-    c->demux.buf = g_malloc0(MAX_MUX_SIZE);
 
     GOutputStream *ostream = g_io_stream_get_output_stream(G_IO_STREAM(c->stream));
-    c->queue = output_queue_new(ostream);
+    c->queue = output_queue_new(SPICE_CHANNEL(channel), ostream);
 }
 
 static void spice_webdav_channel_finalize(GObject *object)
 {
     SpiceWebdavChannelPrivate *c = SPICE_WEBDAV_CHANNEL(object)->priv;
 
-    g_free(c->demux.buf);
+    g_clear_pointer(&c->demux.data, g_byte_array_unref);
 
     G_OBJECT_CLASS(spice_webdav_channel_parent_class)->finalize(object);
 }
@@ -596,7 +702,7 @@ static void webdav_handle_msg(SpiceChannel *channel, SpiceMsgIn *in)
 
     spice_vmc_input_stream_co_data(
         SPICE_VMC_INPUT_STREAM(g_io_stream_get_input_stream(G_IO_STREAM(c->stream))),
-        buf, size);
+        in);
 }
 
 
@@ -0,0 +1,276 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "color-convert.h"
+
+/*
+ * 16bpp to 32bpp conversion of the primary surface, for guests running
+ * at 16-bit depth. The SIMD variants are built with per-function target
+ * attributes and picked at runtime, so the library still runs on any
+ * CPU of the architecture.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && \
+                            (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define COLOR_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define COLOR_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define CONVERT_0565_TO_0888(s)                                         \
+    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |                       \
+     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |                   \
+     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
+
+#define CONVERT_0555_TO_0888(s)                                         \
+    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |                  \
+     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |                  \
+     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
+
+static gboolean scalar_supported(void)
+{
+    return TRUE;
+}
+
+static void scalar_convert_555(guint32 *dest, const guint16 *src, gint width)
+{
+    gint x;
+
+    for (x = 0; x < width; x++)
+        dest[x] = CONVERT_0555_TO_0888(src[x]);
+}
+
+static void scalar_convert_565(guint32 *dest, const guint16 *src, gint width)
+{
+    gint x;
+
+    for (x = 0; x < width; x++)
+        dest[x] = CONVERT_0565_TO_0888(src[x]);
+}
+
+#ifdef COLOR_CONVERT_X86
+/* expand 5 or 6-bit channels to 8 bits, replicating the high bits */
+#define EXPAND5(v) _mm_or_si128(_mm_slli_epi16(v, 3), _mm_srli_epi16(v, 2))
+#define EXPAND6(v) _mm_or_si128(_mm_slli_epi16(v, 2), _mm_srli_epi16(v, 4))
+
+static gboolean sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_store(guint32 *dest, __m128i b, __m128i g, __m128i r)
+{
+    __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+    _mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(bg, r));
+    _mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi16(bg, r));
+}
+
+__attribute__((target("sse2")))
+static void sse2_convert_555(guint32 *dest, const guint16 *src, gint width)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i b = _mm_and_si128(p, mask5);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask5);
+        __m128i r = _mm_and_si128(_mm_srli_epi16(p, 10), mask5);
+
+        sse2_store(dest + x, EXPAND5(b), EXPAND5(g), EXPAND5(r));
+    }
+
+    scalar_convert_555(dest + x, src + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void sse2_convert_565(guint32 *dest, const guint16 *src, gint width)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    const __m128i mask6 = _mm_set1_epi16(0x3f);
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i b = _mm_and_si128(p, mask5);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+        __m128i r = _mm_srli_epi16(p, 11);
+
+        sse2_store(dest + x, EXPAND5(b), EXPAND6(g), EXPAND5(r));
+    }
+
+    scalar_convert_565(dest + x, src + x, width - x);
+}
+
+#define EXPAND5_256(v) _mm256_or_si256(_mm256_slli_epi16(v, 3), _mm256_srli_epi16(v, 2))
+#define EXPAND6_256(v) _mm256_or_si256(_mm256_slli_epi16(v, 2), _mm256_srli_epi16(v, 4))
+
+static gboolean avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_store(guint32 *dest, __m256i b, __m256i g, __m256i r)
+{
+    __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+    /* unpacking works within 128-bit lanes */
+    __m256i lo = _mm256_unpacklo_epi16(bg, r);
+    __m256i hi = _mm256_unpackhi_epi16(bg, r);
+
+    _mm256_storeu_si256((__m256i *)dest, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void avx2_convert_555(guint32 *dest, const guint16 *src, gint width)
+{
+    const __m256i mask5 = _mm256_set1_epi16(0x1f);
+    gint x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + x));
+        __m256i b = _mm256_and_si256(p, mask5);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask5);
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(p, 10), mask5);
+
+        avx2_store(dest + x, EXPAND5_256(b), EXPAND5_256(g), EXPAND5_256(r));
+    }
+
+    sse2_convert_555(dest + x, src + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void avx2_convert_565(guint32 *dest, const guint16 *src, gint width)
+{
+    const __m256i mask5 = _mm256_set1_epi16(0x1f);
+    const __m256i mask6 = _mm256_set1_epi16(0x3f);
+    gint x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + x));
+        __m256i b = _mm256_and_si256(p, mask5);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask6);
+        __m256i r = _mm256_srli_epi16(p, 11);
+
+        avx2_store(dest + x, EXPAND5_256(b), EXPAND6_256(g), EXPAND5_256(r));
+    }
+
+    sse2_convert_565(dest + x, src + x, width - x);
+}
+#endif /* COLOR_CONVERT_X86 */
+
+#ifdef COLOR_CONVERT_NEON
+static gboolean neon_supported(void)
+{
+    return TRUE;
+}
+
+static inline void neon_store(guint32 *dest, uint16x8_t b, uint16x8_t g, uint16x8_t r)
+{
+    uint8x8x4_t bgrx;
+
+    bgrx.val[0] = vmovn_u16(b);
+    bgrx.val[1] = vmovn_u16(g);
+    bgrx.val[2] = vmovn_u16(r);
+    bgrx.val[3] = vdup_n_u8(0);
+    vst4_u8((uint8_t *)dest, bgrx);
+}
+
+#define NEON_EXPAND5(v) vorrq_u16(vshlq_n_u16(v, 3), vshrq_n_u16(v, 2))
+#define NEON_EXPAND6(v) vorrq_u16(vshlq_n_u16(v, 2), vshrq_n_u16(v, 4))
+
+static void neon_convert_555(guint32 *dest, const guint16 *src, gint width)
+{
+    const uint16x8_t mask5 = vdupq_n_u16(0x1f);
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t p = vld1q_u16(src + x);
+        uint16x8_t b = vandq_u16(p, mask5);
+        uint16x8_t g = vandq_u16(vshrq_n_u16(p, 5), mask5);
+        uint16x8_t r = vandq_u16(vshrq_n_u16(p, 10), mask5);
+
+        neon_store(dest + x, NEON_EXPAND5(b), NEON_EXPAND5(g), NEON_EXPAND5(r));
+    }
+
+    scalar_convert_555(dest + x, src + x, width - x);
+}
+
+static void neon_convert_565(guint32 *dest, const guint16 *src, gint width)
+{
+    const uint16x8_t mask5 = vdupq_n_u16(0x1f);
+    const uint16x8_t mask6 = vdupq_n_u16(0x3f);
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t p = vld1q_u16(src + x);
+        uint16x8_t b = vandq_u16(p, mask5);
+        uint16x8_t g = vandq_u16(vshrq_n_u16(p, 5), mask6);
+        uint16x8_t r = vshrq_n_u16(p, 11);
+
+        neon_store(dest + x, NEON_EXPAND5(b), NEON_EXPAND6(g), NEON_EXPAND5(r));
+    }
+
+    scalar_convert_565(dest + x, src + x, width - x);
+}
+#endif /* COLOR_CONVERT_NEON */
+
+/* sorted by preference, scalar last */
+static const SpiceColorConverter converters[] = {
+#ifdef COLOR_CONVERT_X86
+    { "avx2", avx2_supported, avx2_convert_555, avx2_convert_565 },
+    { "sse2", sse2_supported, sse2_convert_555, sse2_convert_565 },
+#endif
+#ifdef COLOR_CONVERT_NEON
+    { "neon", neon_supported, neon_convert_555, neon_convert_565 },
+#endif
+    { "scalar", scalar_supported, scalar_convert_555, scalar_convert_565 },
+};
+
+const SpiceColorConverter *spice_color_converter_list(guint *n_converters)
+{
+    *n_converters = G_N_ELEMENTS(converters);
+    return converters;
+}
+
+const SpiceColorConverter *spice_color_converter_get(void)
+{
+    static const SpiceColorConverter *converter = NULL;
+    guint i;
+
+    if (converter != NULL)
+        return converter;
+
+    for (i = 0; i < G_N_ELEMENTS(converters); i++) {
+        if (converters[i].supported()) {
+            converter = &converters[i];
+            break;
+        }
+    }
+
+    return converter;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef COLOR_CONVERT_H
+#define COLOR_CONVERT_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* convert @width 16bpp pixels to x8r8g8b8, with a 0 x byte */
+typedef void (*SpiceColorConvertRow)(guint32 *dest, const guint16 *src, gint width);
+
+typedef struct _SpiceColorConverter {
+    const gchar          *name;
+    gboolean             (*supported)(void);
+    SpiceColorConvertRow convert_555;
+    SpiceColorConvertRow convert_565;
+} SpiceColorConverter;
+
+const SpiceColorConverter *spice_color_converter_get(void);
+const SpiceColorConverter *spice_color_converter_list(guint *n_converters);
+
+G_END_DECLS
+
+#endif /* COLOR_CONVERT_H */
@@ -53,6 +53,10 @@ static void continuation_trampoline(int i0, int i1)
 	}
 
 	cc->entry(cc);
+
+	/* back to the last one that switched to us, never returns */
+	cc->exited = 1;
+	_longjmp(cc->caller->jmp, 2);
 }
 
 void cc_init(struct continuation *cc)
@@ -78,20 +82,22 @@ int cc_release(struct continuation *cc)
 	return 0;
 }
 
+/*
+ * Only _setjmp()/_longjmp() here: unlike swapcontext() and getcontext(),
+ * they don't save the signal mask, which costs a syscall on each switch.
+ * The exit of @to is caught by its trampoline instead of uc_link.
+ */
 int cc_swap(struct continuation *from, struct continuation *to)
 {
-	to->exited = 0;
-	if (getcontext(&to->last) == -1)
-		return -1;
-	else if (to->exited == 0)
-		to->exited = 1; // so when coroutine finishes
-        else if (to->exited == 1)
-                return 1; // it ends up here
+	int ret;
 
-	if (_setjmp(from->jmp) == 0)
+	to->caller = from;
+	ret = _setjmp(from->jmp);
+	if (ret == 0)
 		_longjmp(to->jmp, 1);
 
-	return 0;
+	/* 2 when @to finished */
+	return ret == 2 ? 1 : 0;
 }
 /*
  * Local variables:
@@ -34,9 +34,10 @@ struct continuation
 
 	/* private */
 	ucontext_t uc;
-	ucontext_t last;
+	ucontext_t last; /* only to start it */
 	int exited;
 	jmp_buf jmp;
+	struct continuation *caller; /* resumed when it finishes */
 };
 
 void cc_init(struct continuation *cc);
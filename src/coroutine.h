@@ -31,8 +31,11 @@
 #include <glib.h>
 #endif
 
+#define COROUTINE_DEFAULT_STACK_SIZE (16 << 20)
+
 struct coroutine
 {
+	/* 0 for COROUTINE_DEFAULT_STACK_SIZE */
 	size_t stack_size;
 	void *(*entry)(void *);
 	int (*release)(struct coroutine *);
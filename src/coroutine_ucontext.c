@@ -29,12 +29,99 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "coroutine.h"
 
 #ifndef MAP_ANONYMOUS
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
+/*
+ * Stacks are kept in a small pool when their coroutine exits, so that
+ * channel reconnections don't churn mmap()/munmap(). Each stack has a
+ * guard page below it, to crash cleanly on overflow instead of silently
+ * corrupting the neighbouring mapping. The pool entry is stored at the
+ * bottom of the idle stack itself.
+ */
+#define STACK_POOL_MAX 8
+
+struct stack_item
+{
+	struct stack_item *next;
+	size_t size;
+};
+
+static struct stack_item *stack_pool;
+static guint stack_pool_len;
+G_LOCK_DEFINE_STATIC(stack_pool);
+
+static size_t stack_page_size(void)
+{
+	static size_t page_size;
+
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	return page_size;
+}
+
+static char *stack_alloc(size_t size)
+{
+	size_t page = stack_page_size();
+	struct stack_item **item;
+	char *base;
+
+	G_LOCK(stack_pool);
+	for (item = &stack_pool; *item; item = &(*item)->next) {
+		if ((*item)->size == size) {
+			char *stack = (char *)*item;
+			*item = (*item)->next;
+			stack_pool_len--;
+			G_UNLOCK(stack_pool);
+			return stack;
+		}
+	}
+	G_UNLOCK(stack_pool);
+
+	base = mmap(0, size + page,
+		    PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+	if (base == MAP_FAILED)
+		g_error("mmap(%" G_GSIZE_FORMAT ") failed: %s",
+			size, g_strerror(errno));
+
+	if (mprotect(base, page, PROT_NONE) < 0)
+		g_warning("failed to set up coroutine stack guard page: %s",
+			  g_strerror(errno));
+
+	return base + page;
+}
+
+static void stack_free(char *stack, size_t size)
+{
+	size_t page = stack_page_size();
+	struct stack_item *item = (struct stack_item *)stack;
+
+	G_LOCK(stack_pool);
+	if (stack_pool_len < STACK_POOL_MAX) {
+		item->size = size;
+		item->next = stack_pool;
+		stack_pool = item;
+		stack_pool_len++;
+		G_UNLOCK(stack_pool);
+#ifdef MADV_DONTNEED
+		/* give back the used pages, but keep the mapping */
+		if (size > page)
+			madvise(stack + page, size - page, MADV_DONTNEED);
+#endif
+		return;
+	}
+	G_UNLOCK(stack_pool);
+
+	munmap(stack - page, size + page);
+}
+
 int coroutine_release(struct coroutine *co)
 {
 	return cc_release(&co->cc);
@@ -50,7 +137,7 @@ static int _coroutine_release(struct continuation *cc)
 			return ret;
 	}
 
-	munmap(co->cc.stack, co->cc.stack_size);
+	stack_free(co->cc.stack, co->cc.stack_size);
 
 	co->caller = NULL;
 
@@ -65,17 +152,13 @@ static void coroutine_trampoline(struct continuation *cc)
 
 void coroutine_init(struct coroutine *co)
 {
+	size_t page = stack_page_size();
+
 	if (co->stack_size == 0)
-		co->stack_size = 16 << 20;
-
-	co->cc.stack_size = co->stack_size;
-	co->cc.stack = mmap(0, co->stack_size,
-			    PROT_READ | PROT_WRITE,
-			    MAP_PRIVATE | MAP_ANONYMOUS,
-			    -1, 0);
-	if (co->cc.stack == MAP_FAILED)
-		g_error("mmap(%" G_GSIZE_FORMAT ") failed: %s",
-			co->stack_size, g_strerror(errno));
+		co->stack_size = COROUTINE_DEFAULT_STACK_SIZE;
+
+	co->cc.stack_size = (co->stack_size + page - 1) & ~(page - 1);
+	co->cc.stack = stack_alloc(co->cc.stack_size);
 
 	co->cc.entry = coroutine_trampoline;
 	co->cc.release = _coroutine_release;
@@ -37,6 +37,11 @@
 #define COPY_REF_PIXEL(ref, out) (*(out++) = *(ref++))
 #endif
 
+/* whole 32bpp pixels are copied, the matches take the copy_ref_rgb32() path */
+#if !defined(LZ_RGB_ALPHA) && (defined(LZ_RGB32) || defined(TO_RGB32))
+#define COPY_REF_RGB32
+#endif
+
 // decompressing plt to plt
 #ifdef LZ_PLT
 #ifndef TO_RGB32
@@ -265,6 +270,10 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 
             /* copying the match*/
 
+#ifdef COPY_REF_RGB32
+            copy_ref_rgb32(op, ref, len, image_dist ? 0 : pixel_ofs);
+            op += len;
+#else
             if (ref == (op - 1)) { // run (this will never be called in PLT4/1_TO_RGB because the
                                   // number of pixel copied is larger then one...
                 /* optimize copy for a run */
@@ -279,6 +288,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
                     g_return_val_if_fail(op <= op_limit, 0);
                 }
             }
+#endif
         } else { // copy
             ctrl++; // copy count is biased by 1
 #if defined(TO_RGB32) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
@@ -334,3 +344,4 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 #undef COPY_COMP_PIXEL
 #undef COPY_PLT_ENTRY
 #undef CAST_PLT_DISTANCE
+#undef COPY_REF_RGB32
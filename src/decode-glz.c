@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
@@ -45,14 +46,11 @@ struct glz_image {
     uint8_t                 *data;
 };
 
-static struct glz_image *glz_image_new(struct glz_image_hdr *hdr,
-                                       int type, void *opaque)
+static gboolean glz_image_init(struct glz_image *img, struct glz_image_hdr *hdr,
+                               int type, void *opaque)
 {
-    struct glz_image *img;
+    g_return_val_if_fail(type == LZ_IMAGE_TYPE_RGB32 || type == LZ_IMAGE_TYPE_RGBA, FALSE);
 
-    g_return_val_if_fail(type == LZ_IMAGE_TYPE_RGB32 || type == LZ_IMAGE_TYPE_RGBA, NULL);
-
-    img = g_new0(struct glz_image, 1);
     img->hdr = *hdr;
     img->surface = alloc_lz_image_surface
         (opaque, type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
@@ -62,41 +60,77 @@ static struct glz_image *glz_image_new(struct glz_image_hdr *hdr,
     if (!img->hdr.top_down) {
         img->data = img->data - img->hdr.width * (img->hdr.height - 1) * 4;
     }
-    return img;
+    return TRUE;
 }
 
-static void glz_image_destroy(struct glz_image *img)
+/* empties the slot */
+static void glz_image_clear(struct glz_image *img)
 {
-    if (img == NULL)
+    if (img->surface == NULL)
         return;
 
     pixman_image_unref(img->surface);
-    free(img);
+    img->surface = NULL;
+    img->data = NULL;
 }
 
 /* ------------------------------------------------------------------ */
 
-#define INIT_IMAGES_CAPACITY 100
+#define MIN_IMAGES_CAPACITY 16
+#define MAX_IMAGES_CAPACITY 65536
+/* to presize the window, assume images of 32x32 pixels on average */
+#define AVERAGE_IMAGE_PIXELS 1024
+/*
+ * The images are released a bit later than in the server window, and the
+ * server may keep images that another display channel still refers to.
+ */
 #define WIN_OVERFLOW_FACTOR 1.5
-#define WIN_REALLOC_FACTOR 1.5
 
+/*
+ * The images are stored in place, in slots indexed by id, so adding and
+ * releasing an image does not allocate. The surfaces themselves are
+ * allocated by the canvas, which may keep them after their release from
+ * the window.
+ */
 struct SpiceGlzDecoderWindow {
-    struct glz_image        **images;
+    struct glz_image        *images;
     uint32_t                nimages;
+    uint32_t                min_images; /* from the window size hint */
     uint64_t                oldest;
     uint64_t                tail_gap;
+    GSList                  *waiters; /* GCoroutineWaiter, tagged by id */
+    gsize                   size; /* bytes of the images */
+    gsize                   max_size; /* 0 if unbounded */
+    gboolean                overflowed;
+    SpiceGlzWindowOverflowFunc overflow_func;
+    gpointer                overflow_data;
 };
 
+static gsize glz_image_size(const struct glz_image *img)
+{
+    return (gsize)img->hdr.gross_pixels * 4;
+}
+
+/* empties a slot of the window */
+static void glz_decoder_window_drop(SpiceGlzDecoderWindow *w, int slot)
+{
+    if (w->images[slot].surface == NULL)
+        return;
+
+    w->size -= glz_image_size(&w->images[slot]);
+    glz_image_clear(&w->images[slot]);
+}
+
 static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
 {
-    struct glz_image  **new_images;
+    struct glz_image  *new_images;
     int i, new_slot;
 
     SPICE_DEBUG("%s: array resize %d -> %d", __FUNCTION__,
                 w->nimages, w->nimages * 2);
-    new_images = g_new0(struct glz_image*, w->nimages * 2);
+    new_images = g_new0(struct glz_image, w->nimages * 2);
     for (i = 0; i < w->nimages; i++) {
-        if (w->images[i] == NULL) {
+        if (w->images[i].surface == NULL) {
             /*
              * We can have empty slots when images come in out of order, this
              * can happen when a vm has multiple displays, since each display
@@ -105,10 +139,10 @@ static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
              */
             continue;
         }
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
+        new_slot = w->images[i].hdr.id % (w->nimages * 2);
         new_images[new_slot] = w->images[i];
     }
-    free(w->images);
+    g_free(w->images);
     w->images = new_images;
     w->nimages *= 2;
 }
@@ -118,17 +152,46 @@ static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
 {
     int slot = img->hdr.id % w->nimages;
 
-    if (w->images[slot]) {
-        /* need more space */
+    /* an id sent again replaces its image, it is not a collision */
+    if (w->images[slot].surface != NULL && w->images[slot].hdr.id == img->hdr.id) {
+        SPICE_DEBUG("%s: image %" G_GUINT64_FORMAT " replaced", __FUNCTION__,
+                    (guint64)img->hdr.id);
+        glz_decoder_window_drop(w, slot);
+    }
+
+    /* an image larger than the window is still let in an empty window */
+    if (w->max_size != 0 && w->size != 0 &&
+        w->size + glz_image_size(img) > w->max_size) {
+        /*
+         * The server does not release its images: keep the memory bounded
+         * and let the session give up on the window.
+         */
+        if (!w->overflowed) {
+            SPICE_DEBUG("%s: %" G_GSIZE_FORMAT " bytes used", __FUNCTION__, w->size);
+            w->overflowed = TRUE;
+            if (w->overflow_func)
+                w->overflow_func(w, w->overflow_data);
+        }
+        glz_image_clear(img);
+        return;
+    }
+
+    /* the slots of a full window collide, and images may come out of order */
+    while (w->images[slot].surface != NULL) {
         glz_decoder_window_resize(w);
         slot = img->hdr.id % w->nimages;
     }
 
-    w->images[slot] = img;
+    w->images[slot] = *img;
+    w->size += glz_image_size(img);
 
     /* close the gap */
-    while (w->tail_gap <= img->hdr.id && w->images[w->tail_gap % w->nimages] != NULL)
+    while (w->tail_gap <= img->hdr.id &&
+           w->images[w->tail_gap % w->nimages].surface != NULL)
         w->tail_gap++;
+
+    if (w->waiters)
+        g_coroutine_waiters_notify(&w->waiters, img->hdr.id);
 }
 
 struct wait_for_image_data {
@@ -140,8 +203,8 @@ static gboolean wait_for_image(gpointer data)
 {
     struct wait_for_image_data *wait = data;
     int slot = wait->id % wait->window->nimages;
-    struct glz_image *image = wait->window->images[slot];
-    gboolean ready = image && image->hdr.id == wait->id;
+    struct glz_image *image = &wait->window->images[slot];
+    gboolean ready = image->surface && image->hdr.id == wait->id;
 
     return ready;
 }
@@ -154,16 +217,24 @@ static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
         .id = id - dist,
     };
 
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_for_image, &data))
-        SPICE_DEBUG("wait for image cancelled");
+    /* the image may come from another display channel */
+    if (!wait_for_image(&data)) {
+        GCoroutineWaiter *waiter = g_coroutine_waiter_new(wait_for_image, &data, data.id);
+
+        g_coroutine_waiters_add(&w->waiters, waiter);
+        if (!g_coroutine_waiter_wait(g_coroutine_self(), waiter))
+            SPICE_DEBUG("wait for image cancelled");
+        g_coroutine_waiters_remove(&w->waiters, waiter);
+        g_coroutine_waiter_unref(waiter);
+    }
 
     int slot = (id - dist) % w->nimages;
 
-    g_return_val_if_fail(w->images[slot] != NULL, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+    g_return_val_if_fail(w->images[slot].surface != NULL, NULL);
+    g_return_val_if_fail(w->images[slot].hdr.id == id - dist, NULL);
+    g_return_val_if_fail(w->images[slot].hdr.gross_pixels >= offset, NULL);
 
-    return w->images[slot]->data + offset * 4;
+    return w->images[slot].data + offset * 4;
 }
 
 static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
@@ -173,12 +244,66 @@ static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
 
     while (w->oldest < oldest) {
         slot = w->oldest % w->nimages;
-        glz_image_destroy(w->images[slot]);
-        w->images[slot] = NULL;
+        glz_decoder_window_drop(w, slot);
         w->oldest++;
     }
 }
 
+/* the header is fixed size, the id and the window head distance are last */
+#define GLZ_HEADER_SIZE 33
+#define GLZ_HEADER_ID_OFFSET 21
+
+static uint32_t read_32(const uint8_t *data)
+{
+    return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+/*
+ * Checks, without waiting, whether the images that the encoded image
+ * @data may refer to have all been decoded. Otherwise, returns TRUE and
+ * sets @missing to the id of the first image that is not there yet.
+ */
+gboolean glz_decoder_window_missing(SpiceGlzDecoderWindow *w,
+                                    const uint8_t *data, size_t size,
+                                    uint64_t *missing)
+{
+    uint64_t id, i;
+    uint32_t win_head_dist;
+
+    if (size < GLZ_HEADER_SIZE)
+        return FALSE;
+
+    id = (uint64_t)read_32(data + GLZ_HEADER_ID_OFFSET) << 32 |
+        read_32(data + GLZ_HEADER_ID_OFFSET + 4);
+    win_head_dist = read_32(data + GLZ_HEADER_ID_OFFSET + 8);
+
+    /* the images before the gap are all there, or released */
+    if (id <= w->tail_gap)
+        return FALSE;
+
+    for (i = MAX(id - MIN(win_head_dist, id), w->tail_gap); i < id; i++) {
+        struct glz_image *image = &w->images[i % w->nimages];
+
+        if (image->surface == NULL || image->hdr.id != i) {
+            *missing = i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* @waiter is notified when the image with its tag as id is added */
+void glz_decoder_window_add_waiter(SpiceGlzDecoderWindow *w, GCoroutineWaiter *waiter)
+{
+    g_coroutine_waiters_add(&w->waiters, waiter);
+}
+
+void glz_decoder_window_remove_waiter(SpiceGlzDecoderWindow *w, GCoroutineWaiter *waiter)
+{
+    g_coroutine_waiters_remove(&w->waiters, waiter);
+}
+
 /* ------------------------------------------------------------------ */
 
 typedef struct GlibGlzDecoder {
@@ -238,6 +363,37 @@ typedef uint16_t rgb16_pixel_t;
 
 #undef ATTR_PACKED
 
+/*
+ * Copies a match of @len 32bpp pixels. @dist is the distance between the
+ * output and the reference when they are in the same image, 0 when the
+ * reference is in another image of the window.
+ */
+static inline void copy_ref_rgb32(rgb32_pixel_t *op, const rgb32_pixel_t *ref,
+                                  uint32_t len, uint32_t dist)
+{
+    if (LZ_EXPECT_CONDITIONAL(dist == 0 || dist >= len)) {
+        /* no overlap, the libc memcpy is vectorized */
+        memcpy(op, ref, len * sizeof(rgb32_pixel_t));
+    } else if (dist == 1) {
+        /* a run */
+        rgb32_pixel_t p = *ref;
+        uint32_t i;
+
+        for (i = 0; i < len; i++)
+            op[i] = p;
+    } else {
+        /* replicate the pattern, doubling its length at each copy */
+        while (len) {
+            uint32_t n = MIN(dist, len);
+
+            memcpy(op, ref, n * sizeof(rgb32_pixel_t));
+            op += n;
+            len -= n;
+            dist *= 2;
+        }
+    }
+}
+
 #define LZ_PLT
 #include "decode-glz-tmpl.c"
 
@@ -380,7 +536,7 @@ static void decode(SpiceGlzDecoder *decoder,
 {
     GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
     LzImageType decoded_type;
-    struct glz_image *decoded_image;
+    struct glz_image decoded_image;
     size_t n_in_bytes_decoded;
 
     d->in_start = data;
@@ -394,26 +550,27 @@ static void decode(SpiceGlzDecoder *decoder,
         decoded_type = LZ_IMAGE_TYPE_RGB32;
     }
 
-    decoded_image = glz_image_new(&d->image, decoded_type, usr_data);
+    if (!glz_image_init(&decoded_image, &d->image, decoded_type, usr_data))
+        return;
 
     n_in_bytes_decoded = DECODE_TO_RGB32[d->image.type]
-        (d->window, d->in_now, decoded_image->data,
+        (d->window, d->in_now, decoded_image.data,
          d->image.gross_pixels, d->image.id, palette);
 
     d->in_now += n_in_bytes_decoded;
 
     if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
-        glz_rgb_alpha_decode(d->window, d->in_now, decoded_image->data,
+        glz_rgb_alpha_decode(d->window, d->in_now, decoded_image.data,
                              d->image.gross_pixels, d->image.id, palette);
     }
 
-    glz_decoder_window_add(d->window, decoded_image);
+    glz_decoder_window_add(d->window, &decoded_image);
 
     { /* release old images from last tail_gap, only if the gap is closed  */
         uint64_t oldest;
-        struct glz_image *image = d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
+        struct glz_image *image = &d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
 
-        g_return_if_fail(image != NULL);
+        g_return_if_fail(image->surface != NULL);
 
         oldest = image->hdr.id - image->hdr.win_head_dist;
         glz_decoder_window_release(d->window, oldest);
@@ -432,21 +589,60 @@ void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
 
     g_return_if_fail(w->nimages == 0 || w->images != NULL);
 
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i]) {
-            glz_image_destroy(w->images[i]);
-        }
-    }
+    for (i = 0; i < w->nimages; i++)
+        glz_decoder_window_drop(w, i);
+    w->overflowed = FALSE;
 
-    w->nimages = 16;
-    g_free(w->images);
-    w->images = g_new0(struct glz_image*, w->nimages);
+    if (w->nimages != w->min_images) {
+        w->nimages = w->min_images;
+        g_free(w->images);
+        w->images = g_new0(struct glz_image, w->nimages);
+    }
+    w->oldest = 0;
     w->tail_gap = 0;
 }
 
+/*
+ * Sizes the window advertised to the server, in bytes: the slots are
+ * presized for it, and the images it holds are bounded by it.
+ */
+void glz_decoder_window_set_size_hint(SpiceGlzDecoderWindow *w, int window_size)
+{
+    uint32_t n = MIN_IMAGES_CAPACITY;
+
+    w->max_size = window_size * WIN_OVERFLOW_FACTOR;
+
+    while (n < MAX_IMAGES_CAPACITY && n * AVERAGE_IMAGE_PIXELS < window_size / 4)
+        n *= 2;
+
+    if (n <= w->nimages)
+        return;
+
+    SPICE_DEBUG("%s: %d slots for a %d bytes window", __FUNCTION__, n, window_size);
+    w->min_images = n;
+    while (w->nimages < n)
+        glz_decoder_window_resize(w);
+}
+
+/* bytes of the images held by the window */
+gsize glz_decoder_window_get_size(SpiceGlzDecoderWindow *w)
+{
+    return w->size;
+}
+
+/* @func is called once when the window would grow past its size */
+void glz_decoder_window_set_overflow_func(SpiceGlzDecoderWindow *w,
+                                          SpiceGlzWindowOverflowFunc func,
+                                          gpointer data)
+{
+    w->overflow_func = func;
+    w->overflow_data = data;
+}
+
 SpiceGlzDecoderWindow *glz_decoder_window_new(void)
 {
     SpiceGlzDecoderWindow *w = g_new0(SpiceGlzDecoderWindow, 1);
+    w->min_images = MIN_IMAGES_CAPACITY;
     glz_decoder_window_clear(w);
     return w;
 }
@@ -457,7 +653,8 @@ void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
         return;
 
     glz_decoder_window_clear(w);
-    free(w->images);
+    g_coroutine_waiters_free(&w->waiters);
+    g_free(w->images);
     free(w);
 }
 
@@ -102,14 +102,54 @@ static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
     }
 }
 
+#ifdef JCS_EXTENSIONS
+/*
+ * libjpeg-turbo can output the bitmap format directly: decode straight
+ * into the destination, several lines at a time, without going through
+ * an intermediate RGB line and a per-pixel conversion.
+ */
+static void decode_direct(GlibJpegDecoder *d, uint8_t* dest, int stride,
+                          J_COLOR_SPACE color_space)
+{
+    JSAMPROW rows[4];
+
+    d->_cinfo.out_color_space = color_space;
+    jpeg_start_decompress(&d->_cinfo);
+
+    while (d->_cinfo.output_scanline < d->_cinfo.output_height) {
+        JDIMENSION n = MIN(d->_cinfo.rec_outbuf_height, G_N_ELEMENTS(rows));
+        JDIMENSION j;
+
+        n = MIN(n, d->_cinfo.output_height - d->_cinfo.output_scanline);
+        for (j = 0; j < n; j++)
+            rows[j] = dest + (d->_cinfo.output_scanline + j) * stride;
+        jpeg_read_scanlines(&d->_cinfo, rows, n);
+    }
+
+    jpeg_finish_decompress(&d->_cinfo);
+}
+#endif
+
 static void decode(SpiceJpegDecoder *decoder,
                    uint8_t* dest, int stride, int format)
 {
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
+    uint8_t* scan_line;
     converter_rgb_t converter = NULL;
     int row;
 
+#ifdef JCS_EXTENSIONS
+    switch (format) {
+    case SPICE_BITMAP_FMT_24BIT:
+        decode_direct(d, dest, stride, JCS_EXT_BGR);
+        return;
+    case SPICE_BITMAP_FMT_32BIT:
+        decode_direct(d, dest, stride, JCS_EXT_BGRX);
+        return;
+    }
+#endif
+
+    scan_line = g_alloca(d->_width * 3);
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
         converter = convert_rgb_to_bgr;
@@ -124,6 +164,7 @@ static void decode(SpiceJpegDecoder *decoder,
 
     g_return_if_fail(converter != NULL);
 
+    d->_cinfo.out_color_space = JCS_RGB;
     jpeg_start_decompress(&d->_cinfo);
 
     for (row = 0; row < d->_height; row++) {
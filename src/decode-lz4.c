@@ -0,0 +1,104 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+
+#include "decode.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+
+/*
+ * An LZ4 image is a top-down flag and a SpiceBitmapFmt byte, followed
+ * by blocks of a guint32 big-endian size and its compressed data. The
+ * blocks decode to the packed rows, one after the other, and may refer
+ * to the data decoded by the previous blocks.
+ */
+static gboolean lz4_decode_rows(const uint8_t *data, const uint8_t *end,
+                                uint8_t *dest, int size)
+{
+    LZ4_streamDecode_t stream;
+    int available = size;
+
+    LZ4_setStreamDecode(&stream, NULL, 0);
+    while (data < end) {
+        guint32 enc_size;
+        int dec_size;
+
+        if (end - data < 4)
+            return FALSE;
+        memcpy(&enc_size, data, 4);
+        enc_size = GUINT32_FROM_BE(enc_size);
+        data += 4;
+        if (enc_size > (gsize)(end - data))
+            return FALSE;
+
+        dec_size = LZ4_decompress_safe_continue(&stream, (const char *)data,
+                                                (char *)dest, enc_size, available);
+        if (dec_size <= 0)
+            return FALSE;
+        dest += dec_size;
+        available -= dec_size;
+        data += enc_size;
+    }
+
+    return available == 0;
+}
+
+/*
+ * Decode the 32-bit LZ4 image @data into the @width x @height rectangle at
+ * @dest, of rows @stride bytes apart. The rows are decoded in @scratch
+ * first, so that a corrupted image leaves @dest as it was. FALSE if the
+ * image is not a 32-bit one, or is corrupted.
+ */
+gboolean lz4_decode_image(const uint8_t *data, size_t data_size,
+                          int width, int height,
+                          uint8_t *dest, int stride, GByteArray *scratch)
+{
+    const uint8_t *end = data + data_size;
+    int row_size = width * 4;
+    gboolean top_down;
+    const uint8_t *src;
+    int y;
+
+    g_return_val_if_fail(width > 0 && height > 0, FALSE);
+    g_return_val_if_fail(stride >= row_size, FALSE);
+
+    if (data_size < 2 || data[1] != SPICE_BITMAP_FMT_32BIT)
+        return FALSE;
+    top_down = data[0] != 0;
+    data += 2;
+
+    g_byte_array_set_size(scratch, row_size * height);
+    if (!lz4_decode_rows(data, end, scratch->data, scratch->len))
+        return FALSE;
+
+    if (top_down && stride == row_size) {
+        memcpy(dest, scratch->data, scratch->len);
+        return TRUE;
+    }
+
+    for (y = 0; y < height; y++) {
+        src = scratch->data + (top_down ? y : height - 1 - y) * row_size;
+        memcpy(dest + y * stride, src, row_size);
+    }
+
+    return TRUE;
+}
+#endif /* USE_LZ4 */
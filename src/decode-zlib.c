@@ -19,6 +19,60 @@
 
 #include "decode.h"
 
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+
+/* libdeflate only does one-shot decoding, which is all that is needed */
+typedef struct GlibZlibDecoder
+{
+    SpiceZlibDecoder                base;
+    struct libdeflate_decompressor  *decompressor;
+} GlibZlibDecoder;
+
+static void decode(SpiceZlibDecoder *decoder,
+                   uint8_t *data, int data_size,
+                   uint8_t *dest, int dest_size)
+{
+    GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
+    enum libdeflate_result ret;
+
+    ret = libdeflate_zlib_decompress(d->decompressor, data, data_size,
+                                     dest, dest_size, NULL);
+    if (ret != LIBDEFLATE_SUCCESS) {
+        g_warning("zlib inflate failed, error %d", ret);
+    }
+}
+
+static SpiceZlibDecoderOps zlib_decoder_ops = {
+    .decode = decode,
+};
+
+SpiceZlibDecoder *zlib_decoder_new(void)
+{
+    GlibZlibDecoder *d = g_new0(GlibZlibDecoder, 1);
+
+    d->decompressor = libdeflate_alloc_decompressor();
+    if (d->decompressor == NULL) {
+        g_warning("zlib decoder init failed");
+        g_free(d);
+        return NULL;
+    }
+
+    d->base.ops = &zlib_decoder_ops;
+
+    return &d->base;
+}
+
+void zlib_decoder_destroy(SpiceZlibDecoder *decoder)
+{
+    GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
+
+    libdeflate_free_decompressor(d->decompressor);
+    g_free(d);
+}
+
+#else /* USE_LIBDEFLATE */
+
 #ifndef __GNUC__
 #define ZLIB_WINAPI
 #endif
@@ -87,3 +141,5 @@ void zlib_decoder_destroy(SpiceZlibDecoder *decoder)
     inflateEnd(&d->_z_strm);
     free(d);
 }
+
+#endif /* USE_LIBDEFLATE */
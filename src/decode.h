@@ -21,13 +21,25 @@
 #include <glib.h>
 
 #include "client_sw_canvas.h"
+#include "gio-coroutine.h"
 
 G_BEGIN_DECLS
 
 typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
+typedef void (*SpiceGlzWindowOverflowFunc)(SpiceGlzDecoderWindow *w, gpointer data);
 
 SpiceGlzDecoderWindow *glz_decoder_window_new(void);
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w);
+void glz_decoder_window_set_size_hint(SpiceGlzDecoderWindow *w, int window_size);
+gsize glz_decoder_window_get_size(SpiceGlzDecoderWindow *w);
+void glz_decoder_window_set_overflow_func(SpiceGlzDecoderWindow *w,
+                                          SpiceGlzWindowOverflowFunc func,
+                                          gpointer data);
+gboolean glz_decoder_window_missing(SpiceGlzDecoderWindow *w,
+                                    const uint8_t *data, size_t size,
+                                    uint64_t *missing);
+void glz_decoder_window_add_waiter(SpiceGlzDecoderWindow *w, GCoroutineWaiter *waiter);
+void glz_decoder_window_remove_waiter(SpiceGlzDecoderWindow *w, GCoroutineWaiter *waiter);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
@@ -39,6 +51,11 @@ void zlib_decoder_destroy(SpiceZlibDecoder *d);
 SpiceJpegDecoder *jpeg_decoder_new(void);
 void jpeg_decoder_destroy(SpiceJpegDecoder *d);
 
+/* only with USE_LZ4 */
+gboolean lz4_decode_image(const uint8_t *data, size_t data_size,
+                          int width, int height,
+                          uint8_t *dest, int stride, GByteArray *scratch);
+
 G_END_DECLS
 
 #endif // SPICEGTK_DECODE_H_
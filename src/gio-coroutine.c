@@ -20,6 +20,8 @@
 */
 #include "config.h"
 
+#include <gobject/gvaluecollector.h>
+
 #include "gio-coroutine.h"
 
 typedef struct _GConditionWaitSource
@@ -58,6 +60,7 @@ GIOCondition g_coroutine_socket_wait(GCoroutine *self,
 
     src = g_socket_create_source(sock, cond | G_IO_HUP | G_IO_ERR | G_IO_NVAL, NULL);
     g_source_set_callback(src, (GSourceFunc)g_io_wait_helper, self, NULL);
+    g_source_set_priority(src, self->priority);
     self->wait_id = g_source_attach(src, NULL);
     ret = coroutine_yield(NULL);
     g_source_unref(src);
@@ -71,6 +74,20 @@ GIOCondition g_coroutine_socket_wait(GCoroutine *self,
     return val;
 }
 
+/*
+ * Wait for g_coroutine_wakeup(), for the events that have no main loop
+ * source of their own, such as io_uring completions.
+ */
+void g_coroutine_wakeup_wait(GCoroutine *self)
+{
+    g_return_if_fail(self != NULL);
+    g_return_if_fail(self->wait_id == 0);
+
+    self->wait_id = G_MAXUINT; /* no source, only tested by g_coroutine_wakeup() */
+    coroutine_yield(NULL);
+    self->wait_id = 0;
+}
+
 void g_coroutine_condition_cancel(GCoroutine *coroutine)
 {
     g_return_if_fail(coroutine != NULL);
@@ -182,6 +199,235 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     return TRUE;
 }
 
+struct _GCoroutineWaiter
+{
+    GSource src;
+    GConditionWaitFunc func;
+    gpointer data;
+    guint64 tag;
+    gboolean notified;
+};
+
+static gboolean g_waiter_ready(GSource *src)
+{
+    GCoroutineWaiter *waiter = (GCoroutineWaiter *)src;
+
+    if (!waiter->notified)
+        return FALSE;
+
+    if (waiter->func(waiter->data))
+        return TRUE;
+
+    /* not for us after all, wait for the next notification */
+    waiter->notified = FALSE;
+    return FALSE;
+}
+
+static gboolean g_waiter_prepare(GSource *src, int *timeout)
+{
+    *timeout = -1;
+    return g_waiter_ready(src);
+}
+
+static gboolean g_waiter_dispatch(GSource *src, GSourceFunc cb, gpointer data)
+{
+    GCoroutineWaiter *waiter = (GCoroutineWaiter *)src;
+
+    /* an attached waiter that is kept waits for the next notification */
+    waiter->notified = FALSE;
+    return cb(data);
+}
+
+static GSourceFuncs waiterFuncs = {
+    .prepare = g_waiter_prepare,
+    .check = g_waiter_ready,
+    .dispatch = g_waiter_dispatch,
+};
+
+GCoroutineWaiter *g_coroutine_waiter_new(GConditionWaitFunc func, gpointer data,
+                                         guint64 tag)
+{
+    GCoroutineWaiter *waiter;
+
+    g_return_val_if_fail(func != NULL, NULL);
+
+    waiter = (GCoroutineWaiter *)g_source_new(&waiterFuncs, sizeof(GCoroutineWaiter));
+    waiter->func = func;
+    waiter->data = data;
+    waiter->tag = tag;
+
+    return waiter;
+}
+
+void g_coroutine_waiter_unref(GCoroutineWaiter *waiter)
+{
+    g_source_unref(&waiter->src);
+}
+
+/*
+ * g_coroutine_waiter_wait:
+ * @coroutine: the coroutine to wait on
+ * @waiter: the waiter
+ *
+ * Like g_coroutine_condition_wait(), but the condition of @waiter is
+ * only checked again after g_coroutine_waiters_notify() was called
+ * with its tag, instead of on every main loop iteration.
+ *
+ * The wait can be cancelled with g_coroutine_condition_cancel().
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled
+ */
+gboolean g_coroutine_waiter_wait(GCoroutine *self, GCoroutineWaiter *waiter)
+{
+    g_return_val_if_fail(self != NULL, FALSE);
+    g_return_val_if_fail(self->condition_id == 0, FALSE);
+    g_return_val_if_fail(waiter != NULL, FALSE);
+
+    if (waiter->func(waiter->data))
+        return TRUE;
+
+    waiter->notified = FALSE;
+    self->condition_id = g_source_attach(&waiter->src, NULL);
+    g_source_set_callback(&waiter->src, g_condition_wait_helper, self, NULL);
+    coroutine_yield(NULL);
+
+    if (self->condition_id == 0)
+        return waiter->func(waiter->data);
+
+    g_source_destroy(&waiter->src);
+    self->condition_id = 0;
+    return TRUE;
+}
+
+/*
+ * g_coroutine_waiter_attach:
+ * @waiter: the waiter
+ * @func: the callback
+ * @data: the user data passed to @func callback
+ *
+ * Instead of blocking a coroutine, calls @func from the main context once
+ * @waiter is notified and its condition is satisfied. The waiter is
+ * detached when @func returns %FALSE.
+ *
+ * Returns: the source id
+ */
+guint g_coroutine_waiter_attach(GCoroutineWaiter *waiter,
+                                GSourceFunc func, gpointer data)
+{
+    g_return_val_if_fail(waiter != NULL, 0);
+    g_return_val_if_fail(func != NULL, 0);
+
+    waiter->notified = FALSE;
+    g_source_set_callback(&waiter->src, func, data, NULL);
+    return g_source_attach(&waiter->src, NULL);
+}
+
+void g_coroutine_waiter_detach(GCoroutineWaiter *waiter)
+{
+    g_source_destroy(&waiter->src);
+}
+
+void g_coroutine_waiters_add(GSList **waiters, GCoroutineWaiter *waiter)
+{
+    g_source_ref(&waiter->src);
+    *waiters = g_slist_prepend(*waiters, waiter);
+}
+
+void g_coroutine_waiters_remove(GSList **waiters, GCoroutineWaiter *waiter)
+{
+    GSList *link = g_slist_find(*waiters, waiter);
+
+    if (link == NULL)
+        return;
+
+    *waiters = g_slist_delete_link(*waiters, link);
+    g_source_unref(&waiter->src);
+}
+
+static void waiters_notify(GSList **waiters, gboolean any_tag, guint64 tag)
+{
+    GSList *l = *waiters;
+
+    while (l != NULL) {
+        GCoroutineWaiter *waiter = l->data;
+        GSList *next = l->next;
+
+        if (g_source_is_destroyed(&waiter->src)) {
+            *waiters = g_slist_delete_link(*waiters, l);
+            g_source_unref(&waiter->src);
+        } else if (any_tag || waiter->tag == tag) {
+            waiter->notified = TRUE;
+            if (g_source_get_context(&waiter->src))
+                g_main_context_wakeup(g_source_get_context(&waiter->src));
+        }
+        l = next;
+    }
+}
+
+/*
+ * Wakes up the waiters for @tag. The waiters of cancelled waits, which
+ * never returned to remove themselves, are dropped on the way.
+ */
+void g_coroutine_waiters_notify(GSList **waiters, guint64 tag)
+{
+    waiters_notify(waiters, FALSE, tag);
+}
+
+/*
+ * g_coroutine_condition_wait_on:
+ * @coroutine: the coroutine to wait on
+ * @waiters: the waiters of the producer
+ * @func: the condition callback
+ * @data: the user data passed to @func callback
+ *
+ * Like g_coroutine_condition_wait(), but @func is only called again
+ * once the producer called g_coroutine_condition_signal() on @waiters,
+ * whose owner must outlive the wait.
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled
+ */
+gboolean g_coroutine_condition_wait_on(GCoroutine *self, GSList **waiters,
+                                       GConditionWaitFunc func, gpointer data)
+{
+    GCoroutineWaiter *waiter;
+    gboolean ready;
+
+    g_return_val_if_fail(waiters != NULL, FALSE);
+
+    if (func(data))
+        return TRUE;
+
+    waiter = g_coroutine_waiter_new(func, data, 0);
+    g_coroutine_waiters_add(waiters, waiter);
+    ready = g_coroutine_waiter_wait(self, waiter);
+    g_coroutine_waiters_remove(waiters, waiter);
+    g_coroutine_waiter_unref(waiter);
+
+    return ready;
+}
+
+/* the condition of all the @waiters may have changed, whatever their tag */
+void g_coroutine_condition_signal(GSList **waiters)
+{
+    if (*waiters != NULL)
+        waiters_notify(waiters, TRUE, 0);
+}
+
+void g_coroutine_waiters_free(GSList **waiters)
+{
+    g_slist_free_full(*waiters, (GDestroyNotify)g_source_unref);
+    *waiters = NULL;
+}
+
+/* the emissions of a coroutine with a priority (the audio channels)
+ * go first too; every coroutine emitting signals is a GCoroutine */
+static gint emit_priority(struct coroutine *caller)
+{
+    GCoroutine *self = (GCoroutine *)caller;
+
+    return self->priority != 0 ? self->priority : G_PRIORITY_DEFAULT_IDLE;
+}
+
 struct signal_data
 {
     gpointer instance;
@@ -223,7 +469,7 @@ g_coroutine_signal_emit(gpointer instance, guint signal_id,
         g_signal_emit_valist(instance, signal_id, detail, data.var_args);
     } else {
         g_object_ref(instance);
-        g_idle_add(emit_main_context, &data);
+        g_idle_add_full(emit_priority(data.caller), emit_main_context, &data, NULL);
         coroutine_yield(NULL);
         g_warn_if_fail(data.notified);
         g_object_unref(instance);
@@ -232,6 +478,97 @@ g_coroutine_signal_emit(gpointer instance, guint signal_id,
     va_end (data.var_args);
 }
 
+/*
+ * The queued emissions do not wait for their handlers: the arguments
+ * are copied in GValues, and the emissions queued meanwhile, by any
+ * coroutine, run in order from a single idle. A synchronous emission
+ * that follows runs after them, its idle being added later.
+ */
+struct queued_signal
+{
+    guint signal_id;
+    GQuark detail;
+    guint n_values;
+    GValue *values; /* the instance, then the parameters */
+};
+
+static GQueue queued_signals = G_QUEUE_INIT;
+static guint queued_signals_id;
+
+static void queued_signal_free(struct queued_signal *signal)
+{
+    guint i;
+
+    for (i = 0; i < signal->n_values; i++)
+        if (G_IS_VALUE(&signal->values[i]))
+            g_value_unset(&signal->values[i]);
+    g_free(signal->values);
+    g_slice_free(struct queued_signal, signal);
+}
+
+static gboolean emit_queued_main_context(gpointer opaque)
+{
+    struct queued_signal *signal;
+
+    queued_signals_id = 0;
+    while ((signal = g_queue_pop_head(&queued_signals)) != NULL) {
+        g_signal_emitv(signal->values, signal->signal_id, signal->detail, NULL);
+        queued_signal_free(signal);
+    }
+
+    return FALSE;
+}
+
+/* coroutine -> main context, for the signals without a return value
+ * whose parameters are copied by their GValue (no G_TYPE_POINTER) */
+void
+g_coroutine_signal_emit_queued(gpointer instance, guint signal_id,
+                               GQuark detail, ...)
+{
+    struct queued_signal *signal;
+    GSignalQuery query;
+    va_list var_args;
+    guint i;
+
+    va_start(var_args, detail);
+
+    if (coroutine_self_is_main()) {
+        g_signal_emit_valist(instance, signal_id, detail, var_args);
+        va_end(var_args);
+        return;
+    }
+
+    g_signal_query(signal_id, &query);
+    g_warn_if_fail(query.return_type == G_TYPE_NONE);
+
+    signal = g_slice_new(struct queued_signal);
+    signal->signal_id = signal_id;
+    signal->detail = detail;
+    signal->n_values = query.n_params + 1;
+    signal->values = g_new0(GValue, signal->n_values);
+    g_value_init(&signal->values[0], G_TYPE_FROM_INSTANCE(instance));
+    g_value_set_object(&signal->values[0], instance);
+
+    for (i = 0; i < query.n_params; i++) {
+        GType type = query.param_types[i] & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+        gchar *error = NULL;
+
+        g_warn_if_fail(G_TYPE_FUNDAMENTAL(type) != G_TYPE_POINTER);
+        G_VALUE_COLLECT_INIT(&signal->values[i + 1], type, var_args, 0, &error);
+        if (error != NULL) {
+            g_warning("%s: %s", G_STRFUNC, error);
+            g_free(error);
+            queued_signal_free(signal);
+            va_end(var_args);
+            return;
+        }
+    }
+    va_end(var_args);
+
+    g_queue_push_tail(&queued_signals, signal);
+    if (queued_signals_id == 0)
+        queued_signals_id = g_idle_add(emit_queued_main_context, NULL);
+}
 
 static gboolean notify_main_context(gpointer opaque)
 {
@@ -260,7 +597,7 @@ void g_coroutine_object_notify(GObject *object,
         data.propname = (gpointer)property_name;
         data.notified = FALSE;
 
-        g_idle_add(notify_main_context, &data);
+        g_idle_add_full(emit_priority(data.caller), notify_main_context, &data, NULL);
 
         /* This switches to the system coroutine context, lets
          * the idle function run to dispatch the signal, and
@@ -33,6 +33,7 @@ struct _GCoroutine
     struct coroutine coroutine;
     guint wait_id;
     guint condition_id;
+    gint priority; /* of the socket waits, G_PRIORITY_DEFAULT if 0 */
 };
 
 /*
@@ -46,18 +47,44 @@ struct _GCoroutine
  */
 typedef gboolean (*GConditionWaitFunc)(gpointer);
 
+/*
+ * A condition that is only checked again once it is notified, for
+ * waits on an event with a known producer, such as a cache insertion.
+ * The @tag identifies what is waited for, so that the producer only
+ * notifies the waiters concerned.
+ */
+typedef struct _GCoroutineWaiter GCoroutineWaiter;
+
 typedef void (*GSignalEmitMainFunc)(GObject *object, int signum, gpointer params);
 
 GCoroutine*  g_coroutine_self           (void);
 void         g_coroutine_wakeup         (GCoroutine *coroutine);
 GIOCondition g_coroutine_socket_wait    (GCoroutine *coroutine,
                                          GSocket *sock, GIOCondition cond);
+void         g_coroutine_wakeup_wait    (GCoroutine *coroutine);
 gboolean     g_coroutine_condition_wait (GCoroutine *coroutine,
                                          GConditionWaitFunc func, gpointer data);
 void         g_coroutine_condition_cancel(GCoroutine *coroutine);
 
+GCoroutineWaiter *g_coroutine_waiter_new(GConditionWaitFunc func, gpointer data,
+                                         guint64 tag);
+void         g_coroutine_waiter_unref   (GCoroutineWaiter *waiter);
+gboolean     g_coroutine_waiter_wait    (GCoroutine *coroutine, GCoroutineWaiter *waiter);
+guint        g_coroutine_waiter_attach  (GCoroutineWaiter *waiter,
+                                         GSourceFunc func, gpointer data);
+void         g_coroutine_waiter_detach  (GCoroutineWaiter *waiter);
+void         g_coroutine_waiters_add    (GSList **waiters, GCoroutineWaiter *waiter);
+void         g_coroutine_waiters_remove (GSList **waiters, GCoroutineWaiter *waiter);
+void         g_coroutine_waiters_notify (GSList **waiters, guint64 tag);
+void         g_coroutine_waiters_free   (GSList **waiters);
+gboolean     g_coroutine_condition_wait_on(GCoroutine *coroutine, GSList **waiters,
+                                           GConditionWaitFunc func, gpointer data);
+void         g_coroutine_condition_signal(GSList **waiters);
+
 void         g_coroutine_signal_emit (gpointer instance, guint signal_id,
                                       GQuark detail, ...);
+void         g_coroutine_signal_emit_queued(gpointer instance, guint signal_id,
+                                            GQuark detail, ...);
 
 void         g_coroutine_object_notify(GObject *object, const gchar *property_name);
 
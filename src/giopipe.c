@@ -45,6 +45,12 @@ struct _PipeInputStream
      */
     gboolean peer_closed;
     GList *sources;
+
+    /* buffered mode: the written data is queued here, up to capacity */
+    gsize capacity;
+    GQueue chunks; /* GBytes */
+    gsize chunk_offset;
+    gsize queued;
 };
 
 struct _PipeInputStreamClass
@@ -70,6 +76,7 @@ struct _PipeOutputStream
     gsize count;
     gboolean peer_closed;
     GList *sources;
+    gsize capacity;
 };
 
 struct _PipeOutputStreamClass
@@ -85,6 +92,64 @@ G_DEFINE_TYPE_WITH_CODE (PipeInputStream, pipe_input_stream, G_TYPE_INPUT_STREAM
                          G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_INPUT_STREAM,
                                                 pipe_input_stream_pollable_iface_init))
 
+/* the data written before the peer closed can still be read */
+static gboolean
+pipe_input_stream_check_readable (PipeInputStream *self, GError **error)
+{
+    if (g_input_stream_is_closed (G_INPUT_STREAM(self)) ||
+        (self->peer_closed && self->queued == 0)) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "Stream is already closed");
+        return FALSE;
+    }
+
+    if (self->capacity > 0 && self->queued == 0) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                             g_strerror(EAGAIN));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+pipe_input_stream_consume (PipeInputStream *self, gsize count)
+{
+    GBytes *chunk = g_queue_peek_head(&self->chunks);
+
+    self->chunk_offset += count;
+    self->queued -= count;
+    if (self->chunk_offset == g_bytes_get_size(chunk)) {
+        g_bytes_unref(g_queue_pop_head(&self->chunks));
+        self->chunk_offset = 0;
+    }
+
+    /* schedule peer source */
+    if (self->peer)
+        pipe_output_stream_check_source(self->peer);
+}
+
+static gssize
+pipe_input_stream_read_buffered (PipeInputStream *self,
+                                 guint8          *buffer,
+                                 gsize            count)
+{
+    gsize n = 0;
+
+    while (n < count && self->queued > 0) {
+        GBytes *chunk = g_queue_peek_head(&self->chunks);
+        gsize size;
+        const guint8 *data = g_bytes_get_data(chunk, &size);
+        gsize len = MIN(count - n, size - self->chunk_offset);
+
+        memcpy(buffer + n, data + self->chunk_offset, len);
+        n += len;
+        pipe_input_stream_consume(self, len);
+    }
+
+    return n;
+}
+
 static gssize
 pipe_input_stream_read (GInputStream  *stream,
                         void          *buffer,
@@ -96,11 +161,11 @@ pipe_input_stream_read (GInputStream  *stream,
 
     g_return_val_if_fail(count > 0, -1);
 
-    if (g_input_stream_is_closed (stream) || self->peer_closed) {
-        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CLOSED,
-                             "Stream is already closed");
+    if (!pipe_input_stream_check_readable(self, error))
         return -1;
-    }
+
+    if (self->capacity > 0)
+        return pipe_input_stream_read_buffered(self, buffer, count);
 
     if (!self->peer->buffer) {
         g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
@@ -216,6 +281,10 @@ pipe_input_stream_dispose(GObject *object)
     g_list_free_full (self->sources, (GDestroyNotify) g_source_unref);
     self->sources = NULL;
 
+    g_queue_foreach(&self->chunks, (GFunc)g_bytes_unref, NULL);
+    g_queue_clear(&self->chunks);
+    self->queued = 0;
+
     G_OBJECT_CLASS(pipe_input_stream_parent_class)->dispose (object);
 }
 
@@ -239,7 +308,10 @@ pipe_input_stream_is_readable (GPollableInputStream *stream)
     PipeInputStream *self = PIPE_INPUT_STREAM (stream);
     gboolean readable;
 
-    readable = (self->peer && self->peer->buffer && self->read == -1) || self->peer_closed;
+    if (self->capacity > 0)
+        readable = self->queued > 0 || self->peer_closed;
+    else
+        readable = (self->peer && self->peer->buffer && self->read == -1) || self->peer_closed;
     //g_debug("readable %p %d", self->peer, readable);
 
     return readable;
@@ -288,6 +360,21 @@ pipe_output_stream_write (GOutputStream  *stream,
         return -1;
     }
 
+    if (self->capacity > 0) {
+        if (peer->queued >= self->capacity) {
+            g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                                 g_strerror (EAGAIN));
+            return -1;
+        }
+
+        count = MIN(count, self->capacity - peer->queued);
+        g_queue_push_tail(&peer->chunks, g_bytes_new(buffer, count));
+        peer->queued += count;
+        pipe_input_stream_check_source(peer);
+
+        return count;
+    }
+
     /* this abuses pollable stream, writing sync would likely lead to
        crashes, since the buffer pointer would become invalid, a
        generic solution would need a copy..
@@ -356,7 +443,9 @@ pipe_output_stream_close (GOutputStream  *stream,
     if (self->peer) {
         /* ignore any pending errors */
         self->peer->peer_closed = TRUE;
-        g_input_stream_close(G_INPUT_STREAM(self->peer), cancellable, NULL);
+        /* the queued data is left to read */
+        if (self->peer->queued == 0)
+            g_input_stream_close(G_INPUT_STREAM(self->peer), cancellable, NULL);
         pipe_input_stream_check_source(self->peer);
     }
 
@@ -412,7 +501,10 @@ pipe_output_stream_is_writable (GPollableOutputStream *stream)
     PipeOutputStream *self = PIPE_OUTPUT_STREAM(stream);
     gboolean writable;
 
-    writable = self->buffer == NULL || self->peer->read >= 0;
+    if (self->capacity > 0)
+        writable = self->peer_closed || self->peer->queued < self->capacity;
+    else
+        writable = self->buffer == NULL || self->peer->read >= 0;
     //g_debug("writable %p %d", self, writable);
 
     return writable;
@@ -439,7 +531,7 @@ pipe_output_stream_pollable_iface_init (GPollableOutputStreamInterface *iface)
 }
 
 G_GNUC_INTERNAL void
-make_gio_pipe(GInputStream **input, GOutputStream **output)
+make_gio_pipe(GInputStream **input, GOutputStream **output, gsize capacity)
 {
     PipeInputStream *in;
     PipeOutputStream *out;
@@ -449,6 +541,7 @@ make_gio_pipe(GInputStream **input, GOutputStream **output)
 
     in = g_object_new(TYPE_PIPE_INPUT_STREAM, NULL);
     out = g_object_new(TYPE_PIPE_OUTPUT_STREAM, NULL);
+    in->capacity = out->capacity = capacity;
 
     out->peer = in;
     g_object_add_weak_pointer(G_OBJECT(in), (gpointer*)&out->peer);
@@ -460,8 +553,22 @@ make_gio_pipe(GInputStream **input, GOutputStream **output)
     *output = G_OUTPUT_STREAM(out);
 }
 
+/*
+ * Each write is handed to a read of the peer, and completes only then:
+ * see spice_make_pipe_buffered() to let the writer go on.
+ */
 G_GNUC_INTERNAL void
 spice_make_pipe(GIOStream **p1, GIOStream **p2)
+{
+    spice_make_pipe_buffered(p1, p2, 0);
+}
+
+/*
+ * With a @capacity, up to that much data is queued in each direction
+ * for the peer to read, a @capacity of 0 is spice_make_pipe().
+ */
+G_GNUC_INTERNAL void
+spice_make_pipe_buffered(GIOStream **p1, GIOStream **p2, gsize capacity)
 {
     GInputStream *in1 = NULL, *in2 = NULL;
     GOutputStream *out1 = NULL, *out2 = NULL;
@@ -471,8 +578,8 @@ spice_make_pipe(GIOStream **p1, GIOStream **p2)
     g_return_if_fail(*p1 == NULL);
     g_return_if_fail(*p2 == NULL);
 
-    make_gio_pipe(&in1, &out2);
-    make_gio_pipe(&in2, &out1);
+    make_gio_pipe(&in1, &out2, capacity);
+    make_gio_pipe(&in2, &out1, capacity);
 
     *p1 = g_simple_io_stream_new(in1, out1);
     *p2 = g_simple_io_stream_new(in2, out2);
@@ -482,3 +589,89 @@ spice_make_pipe(GIOStream **p1, GIOStream **p2)
     g_object_unref(out1);
     g_object_unref(out2);
 }
+
+/*
+ * Queues @bytes for the peer to read, without a copy. The pipe must be
+ * buffered, and, like a non-blocking write, it fails with
+ * G_IO_ERROR_WOULD_BLOCK when the pipe is full: the whole of @bytes is
+ * queued otherwise, even beyond the capacity.
+ */
+G_GNUC_INTERNAL gboolean
+spice_pipe_write_bytes(GOutputStream *stream, GBytes *bytes, GError **error)
+{
+    PipeOutputStream *self;
+    gsize size;
+
+    g_return_val_if_fail(IS_PIPE_OUTPUT_STREAM(stream), FALSE);
+    g_return_val_if_fail(bytes != NULL, FALSE);
+    self = PIPE_OUTPUT_STREAM(stream);
+    g_return_val_if_fail(self->capacity > 0, FALSE);
+
+    size = g_bytes_get_size(bytes);
+    if (size == 0)
+        return TRUE;
+
+    if (!g_output_stream_set_pending(stream, error))
+        return FALSE;
+
+    if (self->peer_closed || self->peer == NULL) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "Stream is already closed");
+        goto end;
+    }
+
+    if (self->peer->queued >= self->capacity) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                             g_strerror (EAGAIN));
+        goto end;
+    }
+
+    g_queue_push_tail(&self->peer->chunks, g_bytes_ref(bytes));
+    self->peer->queued += size;
+    pipe_input_stream_check_source(self->peer);
+
+    g_output_stream_clear_pending(stream);
+    return TRUE;
+
+end:
+    g_output_stream_clear_pending(stream);
+    return FALSE;
+}
+
+/*
+ * Returns up to @count bytes of the data queued in @stream, without a
+ * copy, or NULL with G_IO_ERROR_WOULD_BLOCK if there is none. The pipe
+ * must be buffered.
+ */
+G_GNUC_INTERNAL GBytes *
+spice_pipe_read_bytes(GInputStream *stream, gsize count, GError **error)
+{
+    PipeInputStream *self;
+    GBytes *chunk, *bytes;
+    gsize size;
+
+    g_return_val_if_fail(IS_PIPE_INPUT_STREAM(stream), NULL);
+    g_return_val_if_fail(count > 0, NULL);
+    self = PIPE_INPUT_STREAM(stream);
+    g_return_val_if_fail(self->capacity > 0, NULL);
+
+    if (!g_input_stream_set_pending(stream, error))
+        return NULL;
+
+    if (!pipe_input_stream_check_readable(self, error)) {
+        g_input_stream_clear_pending(stream);
+        return NULL;
+    }
+
+    chunk = g_queue_peek_head(&self->chunks);
+    size = g_bytes_get_size(chunk);
+    count = MIN(count, size - self->chunk_offset);
+    if (self->chunk_offset == 0 && count == size)
+        bytes = g_bytes_ref(chunk);
+    else
+        bytes = g_bytes_new_from_bytes(chunk, self->chunk_offset, count);
+    pipe_input_stream_consume(self, count);
+
+    g_input_stream_clear_pending(stream);
+    return bytes;
+}
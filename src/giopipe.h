@@ -23,6 +23,10 @@
 G_BEGIN_DECLS
 
 void spice_make_pipe(GIOStream **p1, GIOStream **p2);
+void spice_make_pipe_buffered(GIOStream **p1, GIOStream **p2, gsize capacity);
+
+gboolean spice_pipe_write_bytes(GOutputStream *stream, GBytes *bytes, GError **error);
+GBytes *spice_pipe_read_bytes(GInputStream *stream, gsize count, GError **error);
 
 G_END_DECLS
 
@@ -31,6 +31,7 @@
 #include "spice-client.h"
 #include "smartcard-manager.h"
 #include "smartcard-manager-priv.h"
+#include "spice-session-priv.h"
 #include "spice-marshal.h"
 
 /**
@@ -416,6 +417,7 @@ static gboolean smartcard_manager_init(SmartcardManagerInitArgs *args)
     gchar *dbname = NULL;
     GStrv certificates = NULL;
     gboolean retval = FALSE;
+    gint64 start = g_get_monotonic_time();
 
     SPICE_DEBUG("smartcard_manager_init");
     g_return_val_if_fail(SPICE_IS_SESSION(args->session), FALSE);
@@ -466,6 +468,7 @@ init:
 
 end:
     SPICE_DEBUG("smartcard_manager_init end: %d", retval);
+    spice_session_startup_took(args->session, SPICE_SESSION_STARTUP_SMARTCARD_INIT, start);
     g_free(emul_args);
     g_free(dbname);
     g_strfreev(certificates);
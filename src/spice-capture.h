@@ -0,0 +1,54 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPICE_CAPTURE_H_
+# define SPICE_CAPTURE_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Capture of the data received by a channel, once decrypted, from the
+ * link reply on. A channel writes one when SPICE_CAPTURE_DIR is set in
+ * the environment, and spicy-replay feeds it back to a channel.
+ *
+ * The file is a SpiceCaptureHeader followed by records, each one a
+ * SpiceCaptureRecord and @size bytes of data. The integers are in host
+ * byte order, the files are meant to be replayed on the same machine.
+ */
+
+#define SPICE_CAPTURE_MAGIC     "SPICECAP"
+#define SPICE_CAPTURE_VERSION   1
+
+typedef struct SpiceCaptureHeader {
+    char        magic[8];
+    guint32     version;
+    guint32     channel_type;
+    guint32     channel_id;
+    guint32     padding;
+} SpiceCaptureHeader;
+
+typedef struct SpiceCaptureRecord {
+    guint64     time_us; /* since the connection */
+    guint32     size;
+    guint32     padding;
+} SpiceCaptureRecord;
+
+G_END_DECLS
+
+#endif /* SPICE_CAPTURE_H_ */
@@ -0,0 +1,302 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <glib.h>
+
+#include "spice-channel-cache.h"
+
+#define CACHE_NIL          G_MAXUINT32
+#define CACHE_SLOT_EMPTY   G_MAXUINT32
+#define CACHE_MIN_SLOTS    64
+
+#define SLOT_ITEM(ref)     ((ref) >> 1)
+#define SLOT_LOSSY(ref)    ((ref) & 1)
+
+static inline guint32 cache_home(const display_cache *cache, guint64 id)
+{
+    /* Fibonacci hashing, the server ids are mostly sequential */
+    return (guint32)((id * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15)) >> 32) & cache->mask;
+}
+
+static void cache_alloc_slots(display_cache *cache, guint32 n_slots)
+{
+    guint32 i;
+
+    cache->slots = g_new(display_cache_slot, n_slots);
+    cache->mask = n_slots - 1;
+    for (i = 0; i < n_slots; i++)
+        cache->slots[i].ref = CACHE_SLOT_EMPTY;
+}
+
+/* returns the slot of @id, or the empty slot where it would go */
+static inline guint32 cache_probe(const display_cache *cache, guint64 id)
+{
+    guint32 i = cache_home(cache, id);
+
+    while (cache->slots[i].ref != CACHE_SLOT_EMPTY && cache->slots[i].id != id)
+        i = (i + 1) & cache->mask;
+
+    return i;
+}
+
+static void cache_grow(display_cache *cache)
+{
+    display_cache_slot *old = cache->slots;
+    guint32 i, n_old = cache->mask + 1;
+
+    cache_alloc_slots(cache, n_old * 2);
+    for (i = 0; i < n_old; i++) {
+        if (old[i].ref != CACHE_SLOT_EMPTY)
+            cache->slots[cache_probe(cache, old[i].id)] = old[i];
+    }
+    g_free(old);
+}
+
+/* backward shift deletion, there are no tombstones to skip over */
+static void cache_slot_clear(display_cache *cache, guint32 i)
+{
+    guint32 j = i;
+
+    for (;;) {
+        guint32 home;
+
+        j = (j + 1) & cache->mask;
+        if (cache->slots[j].ref == CACHE_SLOT_EMPTY)
+            break;
+
+        home = cache_home(cache, cache->slots[j].id);
+        /* move it back unless its home lies cyclically in (i, j] */
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            cache->slots[i] = cache->slots[j];
+            i = j;
+        }
+    }
+
+    cache->slots[i].ref = CACHE_SLOT_EMPTY;
+    cache->n_used--;
+}
+
+static void lru_unlink(display_cache *cache, guint32 n)
+{
+    display_cache_item *item = &cache->items[n];
+
+    if (item->prev != CACHE_NIL)
+        cache->items[item->prev].next = item->next;
+    else
+        cache->lru_head = item->next;
+
+    if (item->next != CACHE_NIL)
+        cache->items[item->next].prev = item->prev;
+    else
+        cache->lru_tail = item->prev;
+}
+
+static void lru_push_tail(display_cache *cache, guint32 n)
+{
+    display_cache_item *item = &cache->items[n];
+
+    item->prev = cache->lru_tail;
+    item->next = CACHE_NIL;
+    if (cache->lru_tail != CACHE_NIL)
+        cache->items[cache->lru_tail].next = n;
+    else
+        cache->lru_head = n;
+    cache->lru_tail = n;
+}
+
+static guint32 cache_item_alloc(display_cache *cache)
+{
+    guint32 n, i;
+
+    if (cache->free_item == CACHE_NIL) {
+        guint32 n_items = MAX(cache->n_items * 2, CACHE_MIN_SLOTS / 2);
+
+        cache->items = g_renew(display_cache_item, cache->items, n_items);
+        for (i = cache->n_items; i < n_items; i++)
+            cache->items[i].next = (i + 1 < n_items) ? i + 1 : CACHE_NIL;
+        cache->free_item = cache->n_items;
+        cache->n_items = n_items;
+    }
+
+    n = cache->free_item;
+    cache->free_item = cache->items[n].next;
+
+    return n;
+}
+
+/* removes the item referred to by slot @i */
+static void cache_slot_remove(display_cache *cache, guint32 i)
+{
+    guint32 n = SLOT_ITEM(cache->slots[i].ref);
+    display_cache_item *item = &cache->items[n];
+    gpointer value = item->value;
+
+    cache_slot_clear(cache, i);
+    lru_unlink(cache, n);
+    cache->size -= item->size;
+    item->next = cache->free_item;
+    cache->free_item = n;
+
+    /* last, the cache is consistent if it is used again from there */
+    if (cache->value_destroy)
+        cache->value_destroy(value);
+}
+
+static void cache_evict(display_cache *cache)
+{
+    if (cache->max_size == 0)
+        return;
+
+    /* keep the item just added */
+    while (cache->size > cache->max_size && cache->lru_head != cache->lru_tail) {
+        guint64 id = cache->items[cache->lru_head].id;
+
+        cache_slot_remove(cache, cache_probe(cache, id));
+        cache->evictions++;
+    }
+}
+
+G_GNUC_INTERNAL
+display_cache* cache_new_sized(GDestroyNotify value_destroy,
+                               display_cache_value_size value_size)
+{
+    display_cache *self = g_slice_new0(display_cache);
+
+    cache_alloc_slots(self, CACHE_MIN_SLOTS);
+    self->free_item = CACHE_NIL;
+    self->lru_head = self->lru_tail = CACHE_NIL;
+    self->value_destroy = value_destroy;
+    self->value_size = value_size;
+
+    return self;
+}
+
+G_GNUC_INTERNAL
+void cache_set_max_size(display_cache *cache, gsize max_size)
+{
+    cache->max_size = max_size;
+    cache_evict(cache);
+}
+
+G_GNUC_INTERNAL
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
+{
+    guint32 i = cache_probe(cache, id);
+    guint32 ref = cache->slots[i].ref;
+    guint32 n;
+
+    if (ref == CACHE_SLOT_EMPTY) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    *lossy = SLOT_LOSSY(ref);
+    n = SLOT_ITEM(ref);
+    if (n != cache->lru_tail) {
+        lru_unlink(cache, n);
+        lru_push_tail(cache, n);
+    }
+
+    return cache->items[n].value;
+}
+
+G_GNUC_INTERNAL
+void cache_add_lossy(display_cache *cache, uint64_t id,
+                     gpointer value, gboolean lossy)
+{
+    display_cache_item *item;
+    guint32 i, n;
+
+    i = cache_probe(cache, id);
+    if (cache->slots[i].ref != CACHE_SLOT_EMPTY) {
+        cache_slot_remove(cache, i);
+        i = cache_probe(cache, id);
+    }
+
+    /* keep the load factor under 1/2 */
+    if ((cache->n_used + 1) * 2 > cache->mask + 1) {
+        cache_grow(cache);
+        i = cache_probe(cache, id);
+    }
+
+    n = cache_item_alloc(cache);
+    item = &cache->items[n];
+    item->id = id;
+    item->value = value;
+    item->size = cache->value_size ? cache->value_size(value) : 0;
+    lru_push_tail(cache, n);
+
+    cache->slots[i].id = id;
+    cache->slots[i].ref = n << 1 | (lossy ? 1 : 0);
+    cache->n_used++;
+    cache->size += item->size;
+
+    cache_evict(cache);
+
+    if (cache->waiters)
+        g_coroutine_waiters_notify(&cache->waiters, id);
+}
+
+G_GNUC_INTERNAL
+gboolean cache_remove(display_cache *cache, uint64_t id)
+{
+    guint32 i = cache_probe(cache, id);
+
+    if (cache->slots[i].ref == CACHE_SLOT_EMPTY)
+        return FALSE;
+
+    cache_slot_remove(cache, i);
+
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+void cache_clear(display_cache *cache)
+{
+    while (cache->lru_head != CACHE_NIL) {
+        guint64 id = cache->items[cache->lru_head].id;
+
+        cache_slot_remove(cache, cache_probe(cache, id));
+    }
+}
+
+/* @waiter is woken up when an item is added with its tag as id */
+G_GNUC_INTERNAL
+void cache_add_waiter(display_cache *cache, GCoroutineWaiter *waiter)
+{
+    g_coroutine_waiters_add(&cache->waiters, waiter);
+}
+
+G_GNUC_INTERNAL
+void cache_remove_waiter(display_cache *cache, GCoroutineWaiter *waiter)
+{
+    g_coroutine_waiters_remove(&cache->waiters, waiter);
+}
+
+G_GNUC_INTERNAL
+void cache_unref(display_cache *cache)
+{
+    cache_clear(cache);
+    g_coroutine_waiters_free(&cache->waiters);
+    g_free(cache->slots);
+    g_free(cache->items);
+    g_slice_free(display_cache, cache);
+}
@@ -21,64 +21,75 @@
 #include <inttypes.h> /* For PRIx64 */
 #include "common/mem.h"
 #include "common/ring.h"
+#include "gio-coroutine.h"
 
 G_BEGIN_DECLS
 
+/*
+ * An open-addressing table keyed by the 64-bit id, with linear probing.
+ * A slot is 16 bytes, so that a probe sequence stays within a couple of
+ * cache lines; it refers to the item holding the value, with the lossy
+ * flag packed in the reference.
+ *
+ * Items are kept in least recently used order, the order in which the
+ * server evicts its side of the cache. With a size budget, the least
+ * recently used items are evicted once the budget is exceeded, which
+ * only happens if the client missed some invalidations.
+ */
+typedef struct display_cache_slot {
+    guint64                     id;
+    guint32                     ref; /* item index << 1 | lossy */
+} display_cache_slot;
+
 typedef struct display_cache_item {
     guint64                     id;
-    gboolean                    lossy;
+    gpointer                    value;
+    gsize                       size;
+    guint32                     prev, next; /* in LRU order, or free list */
 } display_cache_item;
 
-typedef GHashTable display_cache;
-
-static inline display_cache_item* cache_item_new(guint64 id, gboolean lossy)
-{
-    display_cache_item *self = g_slice_new(display_cache_item);
-    self->id = id;
-    self->lossy = lossy;
-    return self;
-}
-
-static inline void cache_item_free(display_cache_item *self)
-{
-    g_slice_free(display_cache_item, self);
-}
+typedef gsize (*display_cache_value_size)(gpointer value);
+
+typedef struct display_cache {
+    display_cache_slot          *slots;
+    guint32                     mask;
+    guint32                     n_used;
+    display_cache_item          *items;
+    guint32                     n_items;
+    guint32                     free_item;
+    guint32                     lru_head, lru_tail; /* least recent first */
+    GDestroyNotify              value_destroy;
+    display_cache_value_size    value_size;
+    gsize                       size;
+    gsize                       max_size; /* 0 for no budget */
+    guint64                     hits;
+    guint64                     misses;
+    guint64                     evictions;
+    GSList                      *waiters; /* GCoroutineWaiter, tagged by id */
+} display_cache;
+
+display_cache* cache_new_sized(GDestroyNotify value_destroy,
+                               display_cache_value_size value_size);
+void cache_set_max_size(display_cache *cache, gsize max_size);
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy);
+void cache_add_lossy(display_cache *cache, uint64_t id,
+                     gpointer value, gboolean lossy);
+gboolean cache_remove(display_cache *cache, uint64_t id);
+void cache_clear(display_cache *cache);
+void cache_unref(display_cache *cache);
+void cache_add_waiter(display_cache *cache, GCoroutineWaiter *waiter);
+void cache_remove_waiter(display_cache *cache, GCoroutineWaiter *waiter);
 
 static inline display_cache* cache_new(GDestroyNotify value_destroy)
 {
-    GHashTable* self;
-
-    self = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                 (GDestroyNotify)cache_item_free,
-                                 value_destroy);
-
-    return self;
+    return cache_new_sized(value_destroy, NULL);
 }
 
 static inline gpointer cache_find(display_cache *cache, uint64_t id)
 {
-    return g_hash_table_lookup(cache, &id);
-}
-
-static inline gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
-{
-    gpointer value;
-    display_cache_item *item;
-
-    if (!g_hash_table_lookup_extended(cache, &id, (gpointer*)&item, &value))
-        return NULL;
+    gboolean lossy;
 
-    *lossy = item->lossy;
-
-    return value;
-}
-
-static inline void cache_add_lossy(display_cache *cache, uint64_t id,
-                                   gpointer value, gboolean lossy)
-{
-    display_cache_item *item = cache_item_new(id, lossy);
-
-    g_hash_table_replace(cache, item, value);
+    return cache_find_lossy(cache, id, &lossy);
 }
 
 static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
@@ -86,21 +97,6 @@ static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
     cache_add_lossy(cache, id, value, FALSE);
 }
 
-static inline gboolean cache_remove(display_cache *cache, uint64_t id)
-{
-    return g_hash_table_remove(cache, &id);
-}
-
-static inline void cache_clear(display_cache *cache)
-{
-    g_hash_table_remove_all(cache);
-}
-
-static inline void cache_unref(display_cache *cache)
-{
-    g_hash_table_unref(cache);
-}
-
 G_END_DECLS
 
 #endif // SPICE_CHANNEL_CACHE_H_
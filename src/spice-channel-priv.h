@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <openssl/ssl.h>
 #include <gio/gio.h>
 
@@ -31,6 +32,9 @@
 #include "spice-util-priv.h"
 #include "coroutine.h"
 #include "gio-coroutine.h"
+#ifdef HAVE_LIBURING
+#include "spice-uring.h"
+#endif
 
 #include "common/client_marshallers.h"
 #include "common/client_demarshallers.h"
@@ -43,27 +47,45 @@ G_BEGIN_DECLS
 #define CHANNEL_DEBUG(channel, fmt, ...) \
     SPICE_DEBUG("%s: " fmt, SPICE_CHANNEL(channel)->priv->name, ## __VA_ARGS__)
 
+typedef struct _SpiceMsgOutPool SpiceMsgOutPool;
+
 struct _SpiceMsgOut {
     int                   refcount;
     SpiceChannel          *channel;
+    SpiceMsgOutPool       *pool;
     SpiceMessageMarshallers *marshallers;
     SpiceMarshaller       *marshaller;
     uint8_t               *header;
     gboolean              ro_check;
+    SpiceMsgOut           *xmit_next; /* older, in SpiceChannelPrivate.xmit_pushed */
 };
 
+typedef struct _SpiceMsgInPool SpiceMsgInPool;
+
 struct _SpiceMsgIn {
     int                   refcount;
     SpiceChannel          *channel;
     uint8_t               header[MAX_SPICE_DATA_HEADER_SIZE];
     uint8_t               *data;
+    gsize                 data_size; /* allocated size of data, 0 if not owned */
     int                   dpos;
     uint8_t               *parsed;
     size_t                psize;
     message_destructor_t  pfree;
     SpiceMsgIn            *parent;
+    SpiceMsgInPool        *pool;
+    gboolean              view; /* sub-message, stored in parent->subs */
+    SpiceMsgIn            *subs;
+    guint                 subs_size;
+    gint64                wire_time; /* when it was read, monotonic µs */
 };
 
+typedef struct _SpiceMsgTypeStats {
+    guint64 count;
+    guint64 bytes;
+    guint64 handle_time_us; /* received messages only */
+} SpiceMsgTypeStats;
+
 enum spice_channel_state {
     SPICE_CHANNEL_STATE_UNCONNECTED = 0,
     SPICE_CHANNEL_STATE_RECONNECTING,
@@ -74,26 +96,53 @@ enum spice_channel_state {
     SPICE_CHANNEL_STATE_MIGRATION_HANDSHAKE,
 };
 
+/* coroutine context */
+typedef void (*spice_msg_data_reader)(SpiceChannel *channel, gsize size);
+
 struct _SpiceChannelClassPrivate
 {
-    GArray *handlers;
+    /* indexed by message type, n_handlers long: the types with no
+     * handler are NULL, spice_channel_handle_msg() checks for both */
+    spice_msg_handler *handlers;
+    guint n_handlers;
+    /* main context: the memory held by the subclass, in bytes */
+    gsize (*get_memory_usage)(SpiceChannel *channel);
 };
 
 struct _SpiceChannelPrivate {
     /* swapped on migration */
-    SSL_CTX                     *ctx;
-    SSL                         *ssl;
+    SSL                         *ssl; /* its SSL_CTX is the session one */
     SpiceOpenSSLVerify          *sslverify;
+    gboolean                    ktls; /* the crypto done by the kernel */
     GSocket                     *sock;
     GSocketConnection           *conn;
     GInputStream                *in;
     GOutputStream               *out;
 
+    /* read-ahead buffer, holds data read from the wire not yet consumed */
+    uint8_t                     *read_buf;
+    gsize                       read_buf_pos;
+    gsize                       read_buf_len;
+    gint64                      read_window_start; /* the bandwidth estimate */
+    guint64                     read_window_bytes;
+    gint64                      read_drained_at;
+#ifdef HAVE_LIBURING
+    /* the socket is read with a receive posted into read_buf */
+    SpiceUring                  *uring; /* the session one, NULL when polled */
+    SpiceUringOp                uring_recv;
+    gboolean                    uring_eof;
+    int                         uring_errno;
+    gboolean                    uring_full; /* the last receive filled read_buf */
+#endif
+
 #if HAVE_SASL
     sasl_conn_t                 *sasl_conn;
     const char                  *sasl_decoded;
     unsigned int                sasl_decoded_length;
     unsigned int                sasl_decoded_offset;
+    unsigned int                sasl_maxout; /* negotiated, encoded at once */
+    GByteArray                  *sasl_encoded; /* reused for the output */
+    uint8_t                     *sasl_encoded_in; /* reused for the input */
 #endif
 
     gboolean                    use_mini_header;
@@ -106,11 +155,30 @@ struct _SpiceChannelPrivate {
     int                         fd;
     gboolean                    has_error;
     guint                       connect_delayed_id;
-
-    GQueue                      xmit_queue;
-    gboolean                    xmit_queue_blocked;
-    STATIC_MUTEX                xmit_queue_lock;
-    guint                       xmit_queue_wakeup_id;
+    gint64                      connect_start; /* for stats.ready_time_us */
+    gboolean                    hold_link; /* connected, not linked yet */
+
+    SpiceMsgInPool              *msg_in_pool;
+    SpiceMsgOutPool             *msg_out_pool;
+
+    /* see spice_channel_set_msg_data_reader() */
+    int                         msg_data_type;
+    spice_msg_data_reader       msg_data_reader;
+    gsize                       msg_data_left;
+
+    /* SpiceMsgOut, newest first, pushed by any thread without a lock,
+       or XMIT_BLOCKED while the channel is reset */
+    gpointer                    xmit_pushed;
+    GQueue                      xmit_queue; /* taken from xmit_pushed, main context */
+    GByteArray                  *xmit_buf; /* coalesced output */
+
+    /* SPICE_SPICEVMC_CAP_DATA_COMPRESS_LZ4, see SpiceSession:compress-channels */
+    gboolean                    compress; /* offered, accepted on input */
+    gboolean                    compress_out; /* the server accepts it too */
+    guint                       compress_skip; /* messages not worth trying */
+    GByteArray                  *compress_buf; /* compressed input */
+    gint                        xmit_queue_wakeup; /* one is pending */
+    gboolean                    xmit_priority; /* latency sensitive, see spice_msg_out_send() */
 
     char                        name[16];
     enum spice_channel_state    state;
@@ -129,8 +197,13 @@ struct _SpiceChannelPrivate {
     SpiceLinkReply*             peer_msg;
     int                         peer_pos;
 
-    int                         message_ack_window;
-    int                         message_ack_count;
+    guint                       message_ack_window;
+    SpiceChannelAckPolicy       ack_policy;
+    guint64                     ack_received;
+    guint64                     ack_claimed;
+    guint64                     ack_credit;
+    gint64                      ack_rate_start;
+    guint64                     ack_rate_count;
 
     GArray                      *caps;
     GArray                      *common_caps;
@@ -138,8 +211,16 @@ struct _SpiceChannelPrivate {
     GArray                      *remote_common_caps;
 
     gsize                       total_read_bytes;
+    SpiceChannelStats           stats;
+    GArray                      *msg_stats[2]; /* SpiceMsgTypeStats, in & out */
+    FILE                        *capture; /* see spice-capture.h */
+    gint64                      capture_start;
+    gint64                      last_msg_time;
+    gint64                      migration_last_msg; /* from the source server */
     uint64_t                    last_message_serial;
     GSList                      *flushing;
+    GSList                      *waiters; /* GCoroutineWaiter, on the state, the link
+                                             hold or the message serial */
 
     gboolean                    disable_channel_msg;
     gboolean                    auth_needs_username_and_password;
@@ -147,15 +228,16 @@ struct _SpiceChannelPrivate {
 };
 
 SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel);
-SpiceMsgIn *spice_msg_in_sub_new(SpiceChannel *channel, SpiceMsgIn *parent,
-                                   SpiceSubMessage *sub);
 void spice_msg_in_ref(SpiceMsgIn *in);
 void spice_msg_in_unref(SpiceMsgIn *in);
 int spice_msg_in_type(SpiceMsgIn *in);
 void *spice_msg_in_parsed(SpiceMsgIn *in);
+gint64 spice_msg_in_wire_time(SpiceMsgIn *in);
 void *spice_msg_in_raw(SpiceMsgIn *in, int *len);
 void spice_msg_in_hexdump(SpiceMsgIn *in);
 
+gboolean spice_channel_has_pending_input(SpiceChannel *channel);
+
 SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type);
 void spice_msg_out_ref(SpiceMsgOut *out);
 void spice_msg_out_unref(SpiceMsgOut *out);
@@ -175,6 +257,12 @@ enum spice_channel_state spice_channel_get_state(SpiceChannel *channel);
 /* coroutine context */
 typedef void (*handler_msg_in)(SpiceChannel *channel, SpiceMsgIn *msg, gpointer data);
 void spice_channel_recv_msg(SpiceChannel *channel, handler_msg_in handler, gpointer data);
+void spice_channel_set_ack_window(SpiceChannel *channel, guint window);
+void spice_channel_sample_rtt(SpiceChannel *channel);
+gsize spice_channel_get_memory_usage(SpiceChannel *channel);
+void spice_channel_set_msg_data_reader(SpiceChannel *channel, int type,
+                                       spice_msg_data_reader reader);
+int spice_channel_read_msg_data(SpiceChannel *channel, void *data, gsize len);
 
 /* channel-base.c */
 void spice_channel_set_handlers(SpiceChannelClass *klass,
@@ -194,6 +282,8 @@ void spice_caps_set(GArray *caps, guint32 cap, const gchar *desc);
     spice_caps_set(SPICE_CHANNEL(channel)->priv->caps, cap, #cap)
 
 gchar *spice_channel_supported_string(void);
+gint spice_channel_connect_priority(gint type, gint id);
+void spice_channel_hold_link(SpiceChannel *channel, gboolean hold);
 
 void spice_vmc_write_async(SpiceChannel *self,
                            const void *buffer, gsize count,
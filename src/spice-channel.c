@@ -17,6 +17,8 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_CHANNEL
+
 #include "spice-client.h"
 #include "spice-common.h"
 #include "glib-compat.h"
@@ -24,6 +26,8 @@
 #include "spice-channel-priv.h"
 #include "spice-session-priv.h"
 #include "spice-marshal.h"
+#include "spice-capture.h"
+#include "spice-trace.h"
 #include "bio-gio.h"
 
 #include <glib/gi18n.h>
@@ -46,8 +50,30 @@
 #endif
 #include <ctype.h>
 
+#if defined(HAVE_SYS_SOCKET_H) && !defined(G_OS_WIN32)
+#include <sys/uio.h>
+#define USE_SENDMSG 1
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+/* the session keys handed to the kernel after the handshake */
+#if defined(__linux__) && defined(USE_SENDMSG) && defined(SSL_OP_ENABLE_KTLS)
+#define USE_KTLS 1
+#endif
+
+/* the sockets received and sent through the session io_uring */
+#if defined(HAVE_LIBURING) && defined(USE_SENDMSG)
+#define USE_URING 1
+#endif
+
 #include "gio-coroutine.h"
 
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
 static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out);
 static void spice_channel_send_link(SpiceChannel *channel);
@@ -86,6 +112,7 @@ enum {
     PROP_CHANNEL_TYPE,
     PROP_CHANNEL_ID,
     PROP_TOTAL_READ_BYTES,
+    PROP_ACK_POLICY,
 };
 
 /* Signals */
@@ -100,6 +127,13 @@ static guint signals[SPICE_CHANNEL_LAST_SIGNAL];
 
 static void spice_channel_iterate_write(SpiceChannel *channel);
 static void spice_channel_iterate_read(SpiceChannel *channel);
+static int spice_channel_read(SpiceChannel *channel, void *data, size_t length);
+static void spice_channel_uring_start(SpiceChannel *channel);
+static void spice_channel_uring_stop(SpiceChannel *channel);
+static SpiceMsgInPool *msg_in_pool_new(void);
+static void msg_in_pool_close(SpiceMsgInPool *pool);
+static SpiceMsgOutPool *msg_out_pool_new(void);
+static void msg_out_pool_close(SpiceMsgOutPool *pool);
 
 static void spice_channel_init(SpiceChannel *channel)
 {
@@ -121,8 +155,11 @@ static void spice_channel_init(SpiceChannel *channel)
 #if HAVE_SASL
     spice_channel_set_common_capability(channel, SPICE_COMMON_CAP_AUTH_SASL);
 #endif
+    c->msg_in_pool = msg_in_pool_new();
+    c->msg_out_pool = msg_out_pool_new();
+    c->msg_stats[0] = g_array_new(FALSE, TRUE, sizeof(SpiceMsgTypeStats));
+    c->msg_stats[1] = g_array_new(FALSE, TRUE, sizeof(SpiceMsgTypeStats));
     g_queue_init(&c->xmit_queue);
-    STATIC_MUTEX_INIT(c->xmit_queue_lock);
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -139,6 +176,10 @@ static void spice_channel_constructed(GObject *gobject)
     if (disabled && strstr(disabled, desc))
         c->disable_channel_msg = TRUE;
 
+    /* every known message type is accounted without growing the stats */
+    g_array_set_size(c->msg_stats[0],
+                     SPICE_CHANNEL_GET_CLASS(channel)->priv->n_handlers);
+
     spice_session_channel_new(c->session, channel);
 
     /* Chain up to the parent class */
@@ -176,7 +217,15 @@ static void spice_channel_finalize(GObject *gobject)
 
     g_idle_remove_by_data(gobject);
 
-    STATIC_MUTEX_CLEAR(c->xmit_queue_lock);
+    msg_in_pool_close(c->msg_in_pool);
+    c->msg_in_pool = NULL;
+    msg_out_pool_close(c->msg_out_pool);
+    c->msg_out_pool = NULL;
+
+    g_coroutine_waiters_free(&c->waiters);
+
+    g_array_free(c->msg_stats[0], TRUE);
+    g_array_free(c->msg_stats[1], TRUE);
 
     if (c->caps)
         g_array_free(c->caps, TRUE);
@@ -216,6 +265,9 @@ static void spice_channel_get_property(GObject    *gobject,
     case PROP_TOTAL_READ_BYTES:
         g_value_set_ulong(value, c->total_read_bytes);
         break;
+    case PROP_ACK_POLICY:
+        g_value_set_enum(value, c->ack_policy);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -258,6 +310,9 @@ static void spice_channel_set_property(GObject      *gobject,
     case PROP_CHANNEL_ID:
         c->channel_id = g_value_get_int(value);
         break;
+    case PROP_ACK_POLICY:
+        c->ack_policy = g_value_get_enum(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -318,6 +373,24 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                             G_PARAM_READABLE |
                             G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceChannel:ack-policy:
+     *
+     * How the channel acknowledges the received messages, see
+     * #SpiceChannelAckPolicy.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_ACK_POLICY,
+         g_param_spec_enum("ack-policy",
+                           "ACK policy",
+                           "Message acknowledgement policy",
+                           SPICE_TYPE_CHANNEL_ACK_POLICY,
+                           SPICE_CHANNEL_ACK_POLICY_SERVER,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceChannel::channel-event:
      * @channel: the channel that emitted the signal
@@ -460,37 +533,560 @@ static inline uint32_t spice_header_get_msg_sub_list(uint8_t *header, gboolean i
     }
 }
 
+/* ---------------------------------------------------------------- */
+/* statistics                                                       */
+
+static inline void spice_channel_account_msg(SpiceChannel *channel, gboolean outgoing,
+                                             guint type, gsize size)
+{
+    GArray *msg_stats = channel->priv->msg_stats[outgoing ? 1 : 0];
+    SpiceMsgTypeStats *stats;
+
+    if (type >= msg_stats->len)
+        g_array_set_size(msg_stats, type + 1);
+
+    stats = &g_array_index(msg_stats, SpiceMsgTypeStats, type);
+    stats->count++;
+    stats->bytes += size;
+
+    if (outgoing)
+        channel->priv->stats.messages_out++;
+    else
+        channel->priv->stats.messages_in++;
+}
+
+/* a message header was received */
+static inline void spice_channel_account_msg_in_time(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 now = g_get_monotonic_time();
+
+    if (G_UNLIKELY(c->migration_last_msg != 0)) {
+        c->stats.migration_blackout_us = now - c->migration_last_msg;
+        c->migration_last_msg = 0;
+        CHANNEL_DEBUG(channel, "migration blackout %" G_GUINT64_FORMAT " us",
+                      c->stats.migration_blackout_us);
+    }
+    c->last_msg_time = now;
+}
+
+/* the message was accounted for before being handled */
+static inline void spice_channel_account_msg_time(SpiceChannel *channel,
+                                                  guint type, gint64 time_us)
+{
+    GArray *msg_stats = channel->priv->msg_stats[0];
+
+    if (type < msg_stats->len)
+        g_array_index(msg_stats, SpiceMsgTypeStats, type).handle_time_us += time_us;
+}
+
+/* the TCP stack samples the RTT on each acknowledged segment */
+static guint64 spice_channel_get_rtt(SpiceChannel *channel)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    SpiceChannelPrivate *c = channel->priv;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (c->sock == NULL ||
+        g_socket_get_family(c->sock) == G_SOCKET_FAMILY_UNIX)
+        return 0;
+
+    if (getsockopt(g_socket_get_fd(c->sock), IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        return info.tcpi_rtt;
+#endif
+
+    return 0;
+}
+
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_channel_sample_rtt(SpiceChannel *channel)
+{
+    guint64 rtt = spice_channel_get_rtt(channel);
+
+    if (rtt != 0)
+        channel->priv->stats.rtt_us = rtt;
+}
+
+/* ---------------------------------------------------------------- */
+/* ACK window                                                       */
+
+/*
+ * The server stops sending once it has twice the ACK window of
+ * messages in flight, and each SPICE_MSGC_ACK is accounted by the
+ * server as a full window of delivered messages. With the adaptive
+ * policy, the client sends its ACKs up to ack_credit messages ahead
+ * of what it has actually received, so that the in-flight data can
+ * follow the bandwidth-delay product of the link. The credit is
+ * bounded and caught up with as soon as it shrinks, since ACKs are
+ * only ever sent when received + credit covers a whole window.
+ */
+#define ACK_RATE_INTERVAL_US    (500 * 1000)
+#define ACK_MAX_CREDIT_WINDOWS  4
+
+G_GNUC_INTERNAL
+void spice_channel_set_ack_window(SpiceChannel *channel, guint window)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    c->message_ack_window = window;
+    c->ack_received = 0;
+    c->ack_claimed = 0;
+}
+
+static void spice_channel_update_ack_credit(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 now = g_get_monotonic_time();
+    gint64 elapsed = now - c->ack_rate_start;
+    guint64 rtt, bdp, window, credit = 0;
+
+    c->ack_rate_count++;
+    if (elapsed < ACK_RATE_INTERVAL_US)
+        return;
+
+    c->stats.msg_rate = c->ack_rate_count * G_USEC_PER_SEC / elapsed;
+    c->ack_rate_start = now;
+    c->ack_rate_count = 0;
+
+    if (c->ack_policy != SPICE_CHANNEL_ACK_POLICY_ADAPTIVE)
+        goto end;
+
+    rtt = spice_channel_get_rtt(channel);
+    if (rtt != 0)
+        c->stats.rtt_us = rtt;
+    else
+        rtt = c->stats.rtt_us;
+
+    /* messages needed in flight to keep the link busy */
+    bdp = c->stats.msg_rate * rtt / G_USEC_PER_SEC;
+    window = c->message_ack_window;
+    if (bdp > 2 * window)
+        credit = MIN(bdp - 2 * window, ACK_MAX_CREDIT_WINDOWS * window);
+
+end:
+    if (c->ack_credit != credit)
+        CHANNEL_DEBUG(channel, "ack credit %" G_GUINT64_FORMAT " (rate %" G_GUINT64_FORMAT
+                      " msg/s, rtt %" G_GUINT64_FORMAT " us)",
+                      credit, c->stats.msg_rate, c->stats.rtt_us);
+    c->ack_credit = credit;
+}
+
+/* coroutine context */
+static void spice_channel_ack_msg(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    spice_channel_update_ack_credit(channel);
+
+    if (c->message_ack_window == 0)
+        return;
+
+    c->ack_received++;
+    while (c->ack_received + c->ack_credit >= c->ack_claimed + c->message_ack_window) {
+        SpiceMsgOut *out = spice_msg_out_new(channel, SPICE_MSGC_ACK);
+        spice_msg_out_send_internal(out);
+        c->ack_claimed += c->message_ack_window;
+        c->stats.acks_sent++;
+    }
+}
+
+/* ---------------------------------------------------------------- */
+/* inbound message pool                                             */
+
+/*
+ * Each channel keeps a small cache of SpiceMsgIn structures and of
+ * message payload buffers, sorted in power-of-two size classes, so
+ * that the common small messages are received without hitting the
+ * allocator. The pool is refcounted by the messages it handed out,
+ * since those may be released after the channel itself is gone.
+ */
+#define MSG_IN_POOL_MIN_SHIFT   8   /* smallest class: 256 bytes */
+#define MSG_IN_POOL_CLASSES     9   /* largest class: 64 KiB */
+#define MSG_IN_POOL_DEPTH       16  /* cached items per class */
+
+typedef struct _MsgInPoolItem MsgInPoolItem;
+struct _MsgInPoolItem {
+    MsgInPoolItem *next;
+};
+
+struct _SpiceMsgInPool {
+    int           refcount;
+    gboolean      closed;
+    SpiceMsgIn    *msgs;
+    guint         n_msgs;
+    MsgInPoolItem *buffers[MSG_IN_POOL_CLASSES];
+    guint         n_buffers[MSG_IN_POOL_CLASSES];
+    SpiceMsgIn    *views;
+    guint         n_views;
+};
+
+static SpiceMsgInPool *msg_in_pool_new(void)
+{
+    SpiceMsgInPool *pool = g_new0(SpiceMsgInPool, 1);
+
+    pool->refcount = 1;
+    return pool;
+}
+
+static void msg_in_pool_drain(SpiceMsgInPool *pool)
+{
+    int i;
+
+    while (pool->msgs) {
+        SpiceMsgIn *in = pool->msgs;
+        pool->msgs = in->parent;
+        g_slice_free(SpiceMsgIn, in);
+    }
+    pool->n_msgs = 0;
+
+    for (i = 0; i < MSG_IN_POOL_CLASSES; i++) {
+        while (pool->buffers[i]) {
+            MsgInPoolItem *item = pool->buffers[i];
+            pool->buffers[i] = item->next;
+            g_free(item);
+        }
+        pool->n_buffers[i] = 0;
+    }
+
+    g_free(pool->views);
+    pool->views = NULL;
+    pool->n_views = 0;
+}
+
+static gsize msg_in_pool_get_size(SpiceMsgInPool *pool)
+{
+    gsize size = (pool->n_msgs + pool->n_views) * sizeof(SpiceMsgIn);
+    int i;
+
+    for (i = 0; i < MSG_IN_POOL_CLASSES; i++)
+        size += (gsize)pool->n_buffers[i] << (MSG_IN_POOL_MIN_SHIFT + i);
+
+    return size;
+}
+
+static void msg_in_pool_unref(SpiceMsgInPool *pool)
+{
+    if (--pool->refcount > 0)
+        return;
+
+    msg_in_pool_drain(pool);
+    g_free(pool);
+}
+
+/* channel is going away: release the cache, and stop recycling */
+static void msg_in_pool_close(SpiceMsgInPool *pool)
+{
+    pool->closed = TRUE;
+    msg_in_pool_drain(pool);
+    msg_in_pool_unref(pool);
+}
+
+/* returns the size class for @size, or -1 if it is too big to be pooled */
+static inline int msg_in_pool_class(gsize size)
+{
+    int class = 0;
+
+    while ((((gsize)1) << (class + MSG_IN_POOL_MIN_SHIFT)) < size) {
+        if (++class == MSG_IN_POOL_CLASSES)
+            return -1;
+    }
+
+    return class;
+}
+
+static uint8_t *msg_in_pool_alloc_data(SpiceMsgInPool *pool, gsize size,
+                                       gsize *allocated)
+{
+    int class = msg_in_pool_class(size);
+    MsgInPoolItem *item;
+
+    if (class < 0) {
+        /* no need to zero memory that is going to be read into */
+        *allocated = size;
+        return g_malloc(size);
+    }
+
+    *allocated = ((gsize)1) << (class + MSG_IN_POOL_MIN_SHIFT);
+    item = pool->buffers[class];
+    if (item == NULL)
+        return g_malloc(*allocated);
+
+    pool->buffers[class] = item->next;
+    pool->n_buffers[class]--;
+
+    return (uint8_t *)item;
+}
+
+static void msg_in_pool_free_data(SpiceMsgInPool *pool, uint8_t *data,
+                                  gsize allocated)
+{
+    int class = msg_in_pool_class(allocated);
+    MsgInPoolItem *item = (MsgInPoolItem *)data;
+
+    if (pool->closed || class < 0 ||
+        pool->n_buffers[class] >= MSG_IN_POOL_DEPTH ||
+        (((gsize)1) << (class + MSG_IN_POOL_MIN_SHIFT)) != allocated) {
+        g_free(data);
+        return;
+    }
+
+    item->next = pool->buffers[class];
+    pool->buffers[class] = item;
+    pool->n_buffers[class]++;
+}
+
+static void msg_in_pool_free_msg(SpiceMsgInPool *pool, SpiceMsgIn *in)
+{
+    if (pool->closed || pool->n_msgs >= MSG_IN_POOL_DEPTH) {
+        g_slice_free(SpiceMsgIn, in);
+        return;
+    }
+
+    /* the parent field is used to link free messages */
+    in->parent = pool->msgs;
+    pool->msgs = in;
+    pool->n_msgs++;
+}
+
+/*
+ * Sub-messages are views into their parent buffer. They are stored
+ * in a single array owned by the parent, so that dispatching a
+ * message list does not allocate anything per sub-message. The last
+ * array released is kept around for the next list.
+ */
+static SpiceMsgIn *msg_in_pool_alloc_views(SpiceMsgInPool *pool, guint n,
+                                           guint *allocated)
+{
+    SpiceMsgIn *views;
+
+    if (pool->views && pool->n_views >= n) {
+        views = pool->views;
+        *allocated = pool->n_views;
+        pool->views = NULL;
+        pool->n_views = 0;
+        return views;
+    }
+
+    *allocated = MAX(n, 16);
+    return g_new(SpiceMsgIn, *allocated);
+}
+
+static void msg_in_pool_free_views(SpiceMsgInPool *pool, SpiceMsgIn *views,
+                                   guint allocated)
+{
+    if (pool->closed || pool->n_views >= allocated) {
+        g_free(views);
+        return;
+    }
+
+    g_free(pool->views);
+    pool->views = views;
+    pool->n_views = allocated;
+}
+
+/* ---------------------------------------------------------------- */
+/* outbound message pool                                            */
+
+/*
+ * Inputs, acks, usbredir and record traffic are many small messages:
+ * the released SpiceMsgOut are kept with their marshaller, once reset
+ * to its first buffer, so that sending them does not allocate. The usb
+ * event thread makes and releases messages too, hence the lock. Like
+ * the inbound pool, it lives as long as the messages it handed out.
+ */
+#define MSG_OUT_POOL_DEPTH      16
+
+struct _SpiceMsgOutPool {
+    STATIC_MUTEX  lock;
+    int           refcount;
+    gboolean      closed;
+    SpiceMsgOut   *msgs; /* linked by xmit_next */
+    guint         n_msgs;
+    guint64       hits;
+    guint64       misses;
+};
+
+static SpiceMsgOutPool *msg_out_pool_new(void)
+{
+    SpiceMsgOutPool *pool = g_new0(SpiceMsgOutPool, 1);
+
+    STATIC_MUTEX_INIT(pool->lock);
+    pool->refcount = 1;
+    return pool;
+}
+
+static void msg_out_free(SpiceMsgOut *out)
+{
+    spice_marshaller_destroy(out->marshaller);
+    g_slice_free(SpiceMsgOut, out);
+}
+
+/* with the lock held, returns the messages to free once released */
+static SpiceMsgOut *msg_out_pool_steal(SpiceMsgOutPool *pool)
+{
+    SpiceMsgOut *msgs = pool->msgs;
+
+    pool->msgs = NULL;
+    pool->n_msgs = 0;
+    return msgs;
+}
+
+/* releases the lock */
+static void msg_out_pool_unref_unlock(SpiceMsgOutPool *pool)
+{
+    SpiceMsgOut *out, *next = NULL;
+    gboolean last = --pool->refcount == 0;
+
+    if (last)
+        next = msg_out_pool_steal(pool);
+    STATIC_MUTEX_UNLOCK(pool->lock);
+
+    while ((out = next) != NULL) {
+        next = out->xmit_next;
+        msg_out_free(out);
+    }
+
+    if (last) {
+        STATIC_MUTEX_CLEAR(pool->lock);
+        g_free(pool);
+    }
+}
+
+/* channel is going away: release the cache, and stop recycling */
+static void msg_out_pool_close(SpiceMsgOutPool *pool)
+{
+    SpiceMsgOut *out, *next;
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    pool->closed = TRUE;
+    next = msg_out_pool_steal(pool);
+    STATIC_MUTEX_UNLOCK(pool->lock);
+
+    while ((out = next) != NULL) {
+        next = out->xmit_next;
+        msg_out_free(out);
+    }
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    msg_out_pool_unref_unlock(pool);
+}
+
+/* any context */
+static SpiceMsgOut *msg_out_pool_alloc(SpiceMsgOutPool *pool)
+{
+    SpiceMarshaller *marshaller;
+    SpiceMsgOut *out;
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    out = pool->msgs;
+    if (out) {
+        pool->msgs = out->xmit_next;
+        pool->n_msgs--;
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    pool->refcount++;
+    STATIC_MUTEX_UNLOCK(pool->lock);
+
+    if (out == NULL) {
+        out = g_slice_new0(SpiceMsgOut);
+        out->marshaller = spice_marshaller_new();
+    } else {
+        marshaller = out->marshaller;
+        memset(out, 0, sizeof(*out));
+        out->marshaller = marshaller;
+    }
+    out->pool = pool;
+
+    return out;
+}
+
+/* any context */
+static void msg_out_pool_free(SpiceMsgOutPool *pool, SpiceMsgOut *out)
+{
+    gboolean keep;
+
+    /* releases the data added by reference, outside of the lock */
+    spice_marshaller_reset(out->marshaller);
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    keep = !pool->closed && pool->n_msgs < MSG_OUT_POOL_DEPTH;
+    if (keep) {
+        out->xmit_next = pool->msgs;
+        pool->msgs = out;
+        pool->n_msgs++;
+    }
+    msg_out_pool_unref_unlock(pool);
+
+    if (!keep)
+        msg_out_free(out);
+}
+
 /* ---------------------------------------------------------------- */
 /* private msg api                                                  */
 
 G_GNUC_INTERNAL
 SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel)
 {
+    SpiceMsgInPool *pool;
     SpiceMsgIn *in;
 
     g_return_val_if_fail(channel != NULL, NULL);
 
-    in = g_slice_new0(SpiceMsgIn);
+    pool = channel->priv->msg_in_pool;
+    if (pool->msgs) {
+        in = pool->msgs;
+        pool->msgs = in->parent;
+        pool->n_msgs--;
+        memset(in, 0, sizeof(*in));
+    } else {
+        in = g_slice_new0(SpiceMsgIn);
+    }
+
     in->refcount = 1;
     in->channel  = channel;
+    in->pool     = pool;
+    pool->refcount++;
 
     return in;
 }
 
-G_GNUC_INTERNAL
-SpiceMsgIn *spice_msg_in_sub_new(SpiceChannel *channel, SpiceMsgIn *parent,
-                                   SpiceSubMessage *sub)
+/* coroutine context */
+static void spice_msg_in_alloc_data(SpiceMsgIn *in, gsize size)
 {
-    SpiceMsgIn *in;
+    g_return_if_fail(in->data == NULL);
 
-    g_return_val_if_fail(channel != NULL, NULL);
+    in->data = msg_in_pool_alloc_data(in->pool, size, &in->data_size);
+}
 
-    in = spice_msg_in_new(channel);
+/* coroutine context */
+static void spice_msg_in_alloc_subs(SpiceMsgIn *in, guint n)
+{
+    g_return_if_fail(in->subs == NULL);
+
+    in->subs = msg_in_pool_alloc_views(in->pool, n, &in->subs_size);
+}
+
+/* coroutine context */
+static SpiceMsgIn *spice_msg_in_sub_init(SpiceMsgIn *parent, guint i,
+                                         SpiceSubMessage *sub)
+{
+    SpiceChannel *channel = parent->channel;
+    SpiceMsgIn *in = &parent->subs[i];
+
+    memset(in, 0, sizeof(*in));
+    in->refcount = 1;
+    in->channel  = channel;
+    in->view     = TRUE;
     spice_header_set_msg_type(in->header, channel->priv->use_mini_header, sub->type);
     spice_header_set_msg_size(in->header, channel->priv->use_mini_header, sub->size);
     in->data = (uint8_t*)(sub+1);
     in->dpos = sub->size;
     in->parent = parent;
+    in->wire_time = parent->wire_time;
     spice_msg_in_ref(parent);
     return in;
 }
@@ -508,17 +1104,26 @@ void spice_msg_in_unref(SpiceMsgIn *in)
 {
     g_return_if_fail(in != NULL);
 
+    SpiceMsgInPool *pool;
+
     in->refcount--;
     if (in->refcount > 0)
         return;
     if (in->parsed)
         in->pfree(in->parsed);
-    if (in->parent) {
+    if (in->view) {
+        /* the parent owns the storage of @in, and may release it */
         spice_msg_in_unref(in->parent);
-    } else {
-        g_free(in->data);
+        return;
     }
-    g_slice_free(SpiceMsgIn, in);
+    if (in->subs)
+        msg_in_pool_free_views(in->pool, in->subs, in->subs_size);
+    if (in->data_size)
+        msg_in_pool_free_data(in->pool, in->data, in->data_size);
+
+    pool = in->pool;
+    msg_in_pool_free_msg(pool, in);
+    msg_in_pool_unref(pool);
 }
 
 G_GNUC_INTERNAL
@@ -537,6 +1142,15 @@ void *spice_msg_in_parsed(SpiceMsgIn *in)
     return in->parsed;
 }
 
+/* the time its last byte was read off the wire, or 0 */
+G_GNUC_INTERNAL
+gint64 spice_msg_in_wire_time(SpiceMsgIn *in)
+{
+    g_return_val_if_fail(in != NULL, 0);
+
+    return in->wire_time;
+}
+
 G_GNUC_INTERNAL
 void *spice_msg_in_raw(SpiceMsgIn *in, int *len)
 {
@@ -623,13 +1237,12 @@ SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type)
 
     g_return_val_if_fail(c != NULL, NULL);
 
-    out = g_slice_new0(SpiceMsgOut);
+    out = msg_out_pool_alloc(c->msg_out_pool);
     out->refcount = 1;
     out->channel  = channel;
     out->ro_check = msg_check_read_only(c->channel_type, type);
 
     out->marshallers = c->marshallers;
-    out->marshaller = spice_marshaller_new();
 
     out->header = spice_marshaller_reserve_space(out->marshaller,
                                                  spice_header_get_header_size(c->use_mini_header));
@@ -658,71 +1271,132 @@ void spice_msg_out_unref(SpiceMsgOut *out)
     out->refcount--;
     if (out->refcount > 0)
         return;
-    spice_marshaller_destroy(out->marshaller);
-    g_slice_free(SpiceMsgOut, out);
+    msg_out_pool_free(out->pool, out);
 }
 
-/* system context */
-static gboolean spice_channel_idle_wakeup(gpointer user_data)
-{
-    SpiceChannel *channel = SPICE_CHANNEL(user_data);
+/*
+ * The API callers, the usb event thread and the audio backends send
+ * messages from any thread: they are pushed on xmit_pushed with a
+ * compare and exchange, and the first one pushed after a wakeup
+ * schedules the next. The coroutine takes them all at once and drains
+ * them from xmit_queue, which it alone uses.
+ */
+static gchar xmit_blocked;
+#define XMIT_BLOCKED ((gpointer)&xmit_blocked)
+
+/* any context, the previous messages, newest first, or XMIT_BLOCKED */
+static gpointer xmit_pushed_exchange(SpiceChannelPrivate *c, gpointer with)
+{
+    gpointer head;
+
+    do {
+        head = g_atomic_pointer_get(&c->xmit_pushed);
+    } while (!g_atomic_pointer_compare_and_exchange(&c->xmit_pushed, head, with));
+
+    return head;
+}
+
+static void xmit_pushed_free(gpointer head)
+{
+    SpiceMsgOut *out, *next;
+
+    if (head == XMIT_BLOCKED)
+        return;
+
+    for (out = head; out != NULL; out = next) {
+        next = out->xmit_next;
+        spice_msg_out_unref(out);
+    }
+}
+
+/* main context */
+static void spice_channel_xmit_take(SpiceChannel *channel)
+{
     SpiceChannelPrivate *c = channel->priv;
+    SpiceMsgOut *head, *out, *next;
+    GList *link = NULL;
 
-    /*
-     * Note:
-     *
-     * - This must be done before the wakeup as that may eventually
-     *   call channel_reset() which checks this.
-     * - The lock calls are really necessary, this fixes the following race:
-     *   1) usb-event-thread calls spice_msg_out_send()
-     *   2) spice_msg_out_send calls g_timeout_add_full(...)
-     *   3) we run, set xmit_queue_wakeup_id to 0
-     *   4) spice_msg_out_send stores the result of g_timeout_add_full() in
-     *      xmit_queue_wakeup_id, overwriting the 0 we just stored
-     *   5) xmit_queue_wakeup_id now says there is a wakeup pending which is
-     *      false
-     */
-    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-    c->xmit_queue_wakeup_id = 0;
-    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
+    do {
+        head = g_atomic_pointer_get(&c->xmit_pushed);
+    } while (head != NULL && head != XMIT_BLOCKED &&
+             !g_atomic_pointer_compare_and_exchange(&c->xmit_pushed, head, NULL));
+
+    if (head == NULL || head == XMIT_BLOCKED)
+        return;
+
+    /* oldest first, after those already taken */
+    for (out = head; out != NULL; out = next) {
+        next = out->xmit_next;
+        out->xmit_next = NULL;
+        link = g_list_prepend(link, out);
+    }
+    for (; link != NULL; link = g_list_delete_link(link, link))
+        g_queue_push_tail(&c->xmit_queue, link->data);
+
+    c->stats.xmit_queue_max_depth = MAX(c->stats.xmit_queue_max_depth,
+                                        g_queue_get_length(&c->xmit_queue));
+}
+
+/* system context */
+static gboolean spice_channel_idle_wakeup(gpointer user_data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(user_data);
 
+    /* before the messages are taken, a later one wakes up again */
+    g_atomic_int_set(&channel->priv->xmit_queue_wakeup, FALSE);
     spice_channel_wakeup(channel, FALSE);
 
     return FALSE;
 }
 
+/* main context */
+static void spice_channel_xmit_now(SpiceChannel *channel)
+{
+    /* the coroutine writes the queue if it was waiting, the pending
+       wakeup then finds it empty */
+    g_object_ref(channel);
+    spice_channel_wakeup(channel, FALSE);
+    g_object_unref(channel);
+}
+
 /* any context (system/co-routine/usb-event-thread) */
 G_GNUC_INTERNAL
 void spice_msg_out_send(SpiceMsgOut *out)
 {
+    SpiceChannel *channel;
     SpiceChannelPrivate *c;
-    gboolean was_empty;
+    gpointer head;
 
     g_return_if_fail(out != NULL);
     g_return_if_fail(out->channel != NULL);
-    c = out->channel->priv;
-
-    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-    if (c->xmit_queue_blocked) {
-        g_warning("message queue is blocked, dropping message");
-        goto end;
-    }
+    channel = out->channel;
+    c = channel->priv;
 
-    was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_queue_push_tail(&c->xmit_queue, out);
+    do {
+        head = g_atomic_pointer_get(&c->xmit_pushed);
+        if (head == XMIT_BLOCKED) {
+            g_warning("message queue is blocked, dropping message");
+            spice_msg_out_unref(out);
+            return;
+        }
+        out->xmit_next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&c->xmit_pushed, head, out));
 
     /* One wakeup is enough to empty the entire queue -> only do a wakeup
-       if the queue was empty, and there isn't one pending already. */
-    if (was_empty && !c->xmit_queue_wakeup_id) {
-        c->xmit_queue_wakeup_id =
-            /* Use g_timeout_add_full so that can specify the priority */
-            g_timeout_add_full(G_PRIORITY_HIGH, 0,
-                               spice_channel_idle_wakeup,
-                               out->channel, NULL);
+       if there isn't one pending already. It holds a reference, as it
+       isn't removed when the channel is reset. */
+    if (g_atomic_int_compare_and_exchange(&c->xmit_queue_wakeup, FALSE, TRUE)) {
+        /* Use g_timeout_add_full so that can specify the priority */
+        g_timeout_add_full(G_PRIORITY_HIGH, 0, spice_channel_idle_wakeup,
+                           g_object_ref(channel), g_object_unref);
     }
 
-end:
-    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
+    /* the latency sensitive channels (inputs) do not wait for the
+       main loop, which may be busy drawing and decoding, even if a
+       wakeup is already pending for an earlier message */
+    if (c->xmit_priority && coroutine_self_is_main() &&
+        g_main_context_is_owner(g_main_context_default()))
+        spice_channel_xmit_now(channel);
 }
 
 /* coroutine context */
@@ -754,8 +1428,9 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
 
         if (c->has_error) return;
 
+        c->stats.write_calls++;
         cond = 0;
-        if (c->tls) {
+        if (c->tls && !c->ktls) {
             ret = SSL_write(c->ssl, ptr+offset, datalen-offset);
             if (ret < 0) {
                 ret = SSL_get_error(c->ssl, ret);
@@ -789,82 +1464,546 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
                 return;
             }
         }
-        if (ret == 0) {
-            CHANNEL_DEBUG(channel, "Closing the connection: spice_channel_flush");
-            c->has_error = TRUE;
-            return;
+        if (ret == 0) {
+            CHANNEL_DEBUG(channel, "Closing the connection: spice_channel_flush");
+            c->has_error = TRUE;
+            return;
+        }
+        offset += ret;
+        c->stats.bytes_out += ret;
+    }
+}
+
+#if HAVE_SASL
+/* the largest plaintext encoded at once, unless the mechanism says otherwise */
+#define SASL_MAXOUT_DEFAULT     (8 * 1024)
+/* the encoded data read at once, should stay lower than maxbufsize */
+#define SASL_READ_SIZE          (64 * 1024)
+
+/*
+ * Encode all buffered data, write all encrypted data out
+ * to the wire: the data is split in as few pieces as the
+ * negotiated maximum output size allows, and the encoded
+ * pieces are written at once.
+ */
+static void spice_channel_flush_sasl(SpiceChannel *channel, const void *data, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    const char *output;
+    unsigned int outputlen;
+    size_t offset = 0;
+    int err;
+
+    if (c->sasl_encoded == NULL)
+        c->sasl_encoded = g_byte_array_new();
+
+    while (offset < len) {
+        size_t chunk = MIN(len - offset, c->sasl_maxout);
+
+        err = sasl_encode(c->sasl_conn, (const char *)data + offset, chunk,
+                          &output, &outputlen);
+        if (err != SASL_OK) {
+            g_warning ("Failed to encode SASL data %s",
+                       sasl_errstring(err, NULL, NULL));
+            c->has_error = TRUE;
+            g_byte_array_set_size(c->sasl_encoded, 0);
+            return;
+        }
+
+        /* the output belongs to the connection, until the next call */
+        g_byte_array_append(c->sasl_encoded, (const guint8 *)output, outputlen);
+        offset += chunk;
+    }
+
+    //CHANNEL_DEBUG(channel, "Flush SASL %d: %d", len, c->sasl_encoded->len);
+    spice_channel_flush_wire(channel, c->sasl_encoded->data, c->sasl_encoded->len);
+    g_byte_array_set_size(c->sasl_encoded, 0);
+}
+#endif
+
+/* coroutine context */
+static void spice_channel_write(SpiceChannel *channel, const void *data, size_t len)
+{
+#if HAVE_SASL
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->sasl_conn)
+        spice_channel_flush_sasl(channel, data, len);
+    else
+#endif
+        spice_channel_flush_wire(channel, data, len);
+}
+
+#ifdef USE_LZ4
+/* smaller messages are not worth it */
+#define COMPRESS_MIN_SIZE       1024
+/* after data that did not compress, the messages sent as is */
+#define COMPRESS_SKIP_MSGS      16
+/* the largest message accepted, once decompressed */
+#define DECOMPRESS_MAX_SIZE     (64 * 1024 * 1024)
+
+static void compressed_data_free(uint8_t *data, void *opaque)
+{
+    g_free(data);
+}
+
+/*
+ * Replaces the payload of SPICE_MSGC_SPICEVMC_DATA @out with its LZ4
+ * compressed form, unless it does not shrink: the data already
+ * compressed is then sent as is, and so are the next messages, since
+ * they are likely to be more of the same.
+ */
+/* coroutine context */
+static void spice_channel_compress_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gsize header_size = spice_header_get_header_size(c->use_mini_header);
+    SpiceMarshaller *m;
+    uint8_t *data, *compressed, *header;
+    size_t len;
+    int free_data, bound, size, payload;
+    gint64 start;
+
+    len = spice_marshaller_get_total_size(out->marshaller) - header_size;
+    if (len < COMPRESS_MIN_SIZE || len > LZ4_MAX_INPUT_SIZE)
+        return;
+    if (c->compress_skip > 0) {
+        c->compress_skip--;
+        return;
+    }
+
+    start = g_get_monotonic_time();
+    data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
+    payload = len - header_size;
+    bound = LZ4_compressBound(payload);
+    compressed = g_malloc(bound);
+    size = LZ4_compress_default((const char *)data + header_size, (char *)compressed,
+                                payload, bound);
+    if (free_data)
+        g_free(data);
+
+    if (size <= 0 || size > payload / 8 * 7) {
+        g_free(compressed);
+        c->compress_skip = COMPRESS_SKIP_MSGS;
+        c->stats.compress_time_us += g_get_monotonic_time() - start;
+        return;
+    }
+
+    m = spice_marshaller_new();
+    header = spice_marshaller_reserve_space(m, header_size);
+    memcpy(header, out->header, header_size);
+    spice_marshaller_set_base(m, header_size);
+    spice_header_set_msg_type(header, c->use_mini_header, SPICE_MSGC_SPICEVMC_COMPRESSED_DATA);
+    spice_marshaller_add_uint8(m, SPICE_DATA_COMPRESSION_TYPE_LZ4);
+    spice_marshaller_add_uint32(m, payload);
+    spice_marshaller_add_ref_full(m, compressed, size, compressed_data_free, NULL);
+
+    /* releases the payload, copied in the compressed data */
+    spice_marshaller_destroy(out->marshaller);
+    out->marshaller = m;
+    out->header = header;
+
+    c->stats.uncompressed_bytes_out += payload;
+    c->stats.compressed_bytes_out += size;
+    c->stats.compress_time_us += g_get_monotonic_time() - start;
+}
+
+/*
+ * Reads the SPICE_MSG_SPICEVMC_COMPRESSED_DATA payload of @msg_size
+ * bytes, and makes @in the SPICE_MSG_SPICEVMC_DATA it contains.
+ */
+/* coroutine context */
+static gboolean spice_channel_recv_compressed_msg(SpiceChannel *channel, SpiceMsgIn *in,
+                                                  int msg_size)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    guint32 size;
+    gint64 start;
+    int n;
+
+    if (c->compress_buf == NULL)
+        c->compress_buf = g_byte_array_new();
+    g_byte_array_set_size(c->compress_buf, msg_size);
+    spice_channel_read(channel, c->compress_buf->data, msg_size);
+    if (c->has_error)
+        return FALSE;
+
+    if ((gsize)msg_size < 1 + sizeof(size) ||
+        c->compress_buf->data[0] != SPICE_DATA_COMPRESSION_TYPE_LZ4) {
+        g_warning("unsupported compressed message: %s", c->name);
+        goto error;
+    }
+    memcpy(&size, c->compress_buf->data + 1, sizeof(size));
+    size = GUINT32_FROM_LE(size);
+    if (size > DECOMPRESS_MAX_SIZE) {
+        g_warning("compressed message too large: %s %u", c->name, size);
+        goto error;
+    }
+
+    start = g_get_monotonic_time();
+    spice_msg_in_alloc_data(in, size);
+    n = LZ4_decompress_safe((const char *)c->compress_buf->data + 1 + sizeof(size),
+                            (char *)in->data, msg_size - 1 - sizeof(size), size);
+    if (n < 0 || (guint32)n != size) {
+        g_warning("failed to decompress message: %s", c->name);
+        goto error;
+    }
+
+    spice_header_set_msg_type(in->header, c->use_mini_header, SPICE_MSG_SPICEVMC_DATA);
+    spice_header_set_msg_size(in->header, c->use_mini_header, size);
+    in->dpos = size;
+
+    c->stats.uncompressed_bytes_in += size;
+    c->stats.compressed_bytes_in += msg_size;
+    c->stats.decompress_time_us += g_get_monotonic_time() - start;
+
+    return TRUE;
+
+error:
+    /* the stream state of the data channel is lost with the message */
+    c->has_error = TRUE;
+    c->event = SPICE_CHANNEL_ERROR_IO;
+    return FALSE;
+}
+#endif
+
+/* coroutine context */
+static gboolean spice_channel_prepare_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    uint32_t msg_size;
+
+    g_return_val_if_fail(channel != NULL, FALSE);
+    g_return_val_if_fail(out != NULL, FALSE);
+    g_return_val_if_fail(channel == out->channel, FALSE);
+
+    if (out->ro_check &&
+        spice_channel_get_read_only(channel)) {
+        g_warning("Try to send message while read-only. Please report a bug.");
+        return FALSE;
+    }
+
+#ifdef USE_LZ4
+    if (channel->priv->compress_out &&
+        spice_header_get_msg_type(out->header, channel->priv->use_mini_header) ==
+        SPICE_MSGC_SPICEVMC_DATA)
+        spice_channel_compress_msg(channel, out);
+#endif
+
+    msg_size = spice_marshaller_get_total_size(out->marshaller) -
+               spice_header_get_header_size(channel->priv->use_mini_header);
+    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
+    spice_channel_account_msg(channel, TRUE,
+                              spice_header_get_msg_type(out->header,
+                                                        channel->priv->use_mini_header),
+                              msg_size);
+
+    return TRUE;
+}
+
+/* coroutine context */
+static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    uint8_t *data;
+    int free_data;
+    size_t len;
+
+    if (!spice_channel_prepare_msg(channel, out))
+        return;
+
+    data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
+    /* spice_msg_out_hexdump(out, data, len); */
+    spice_channel_write(channel, data, len);
+
+    if (free_data)
+        g_free(data);
+
+    spice_msg_out_unref(out);
+}
+
+/* maximum number of queued messages written at once */
+#define XMIT_BATCH_MAX_MSGS     64
+/* flush coalesced TLS or SASL data when it reaches that size */
+#define XMIT_COALESCE_SIZE      (64 * 1024)
+
+#ifdef USE_SENDMSG
+#define XMIT_MAX_IOV            256
+
+#ifdef USE_URING
+/* any context */
+static void spice_channel_uring_wakeup(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    /* not when the coroutine cancels its own requests */
+    if (g_coroutine_self() != &c->coroutine)
+        g_coroutine_wakeup(&c->coroutine);
+}
+
+typedef struct ChannelUringSend {
+    SpiceUringOp op;
+    SpiceChannel *channel;
+    gboolean done;
+} ChannelUringSend;
+
+/* main context */
+static void spice_channel_uring_send_done(SpiceUringOp *op, int res, gpointer data)
+{
+    ChannelUringSend *send = data;
+
+    send->done = TRUE;
+    spice_channel_uring_wakeup(send->channel);
+}
+
+/*
+ * Like sendmsg(), but waits for the socket in the ring: returns -1
+ * with EAGAIN if the request could not be queued.
+ */
+/* coroutine context */
+static ssize_t spice_channel_uring_sendmsg(SpiceChannel *channel, int fd,
+                                           struct msghdr *msg)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    ChannelUringSend send = { .channel = channel };
+
+    spice_uring_op_init(&send.op, spice_channel_uring_send_done, &send);
+    if (!spice_uring_sendmsg(c->uring, &send.op, fd, msg)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* until its callback was called, the ring refers to it */
+    while (!send.done) {
+        if (c->has_error)
+            spice_uring_cancel_sync(c->uring, &send.op);
+        else
+            g_coroutine_wakeup_wait(&c->coroutine);
+    }
+
+    if (send.op.res < 0) {
+        errno = -send.op.res;
+        return -1;
+    }
+
+    return send.op.res;
+}
+#endif
+
+/*
+ * Write all the 'iov' vectors out to the wire, with as few syscalls as
+ * possible. The vectors are modified to keep track of partial writes.
+ */
+/* coroutine context */
+static void spice_channel_flush_wire_iov(SpiceChannel *channel,
+                                         struct iovec *iov, int niov)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    int fd = g_socket_get_fd(c->sock);
+
+    while (niov > 0) {
+        struct msghdr msg = { 0, };
+        ssize_t ret;
+
+        if (c->has_error) return;
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        c->stats.write_calls++;
+        ret = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef USE_URING
+        /* sent by the kernel once there is room, without a poll */
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && c->uring)
+            ret = spice_channel_uring_sendmsg(channel, fd, &msg);
+#endif
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_OUT);
+                continue;
+            }
+            CHANNEL_DEBUG(channel, "Closing the channel: sendmsg %s", g_strerror(errno));
+            c->has_error = TRUE;
+            return;
+        }
+        if (ret == 0) {
+            CHANNEL_DEBUG(channel, "Closing the connection: sendmsg");
+            c->has_error = TRUE;
+            return;
+        }
+        c->stats.bytes_out += ret;
+
+        while (niov > 0 && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+/* coroutine context */
+static void spice_channel_write_msgs_iov(SpiceChannel *channel,
+                                         SpiceMsgOut **msgs, guint n)
+{
+    struct iovec iov[XMIT_MAX_IOV];
+    int niov = 0;
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        SpiceMarshaller *m = msgs[i]->marshaller;
+        size_t total = spice_marshaller_get_total_size(m);
+        size_t done = 0;
+
+        while (done < total) {
+            int j, filled;
+
+            if (niov == XMIT_MAX_IOV) {
+                spice_channel_flush_wire_iov(channel, iov, niov);
+                niov = 0;
+            }
+
+            filled = spice_marshaller_fill_iovec(m, iov + niov,
+                                                 XMIT_MAX_IOV - niov, done);
+            for (j = 0; j < filled; j++)
+                done += iov[niov + j].iov_len;
+            niov += filled;
+        }
+    }
+
+    if (niov > 0)
+        spice_channel_flush_wire_iov(channel, iov, niov);
+}
+#endif
+
+/* coroutine context */
+static void spice_channel_write_msgs_coalesced(SpiceChannel *channel,
+                                               SpiceMsgOut **msgs, guint n)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    guint i;
+
+    if (c->xmit_buf == NULL)
+        c->xmit_buf = g_byte_array_sized_new(XMIT_COALESCE_SIZE);
+
+    for (i = 0; i < n; i++) {
+        SpiceMarshaller *m = msgs[i]->marshaller;
+        size_t total = spice_marshaller_get_total_size(m);
+        size_t done = 0;
+
+        while (done < total) {
+            struct iovec iov[16];
+            int j, filled;
+
+            filled = spice_marshaller_fill_iovec(m, iov, G_N_ELEMENTS(iov), done);
+            for (j = 0; j < filled; j++) {
+                g_byte_array_append(c->xmit_buf, iov[j].iov_base, iov[j].iov_len);
+                done += iov[j].iov_len;
+            }
+        }
+
+        if (c->xmit_buf->len >= XMIT_COALESCE_SIZE) {
+            spice_channel_write(channel, c->xmit_buf->data, c->xmit_buf->len);
+            g_byte_array_set_size(c->xmit_buf, 0);
         }
-        offset += ret;
+    }
+
+    if (c->xmit_buf->len > 0) {
+        spice_channel_write(channel, c->xmit_buf->data, c->xmit_buf->len);
+        g_byte_array_set_size(c->xmit_buf, 0);
     }
 }
 
-#if HAVE_SASL
 /*
- * Encode all buffered data, write all encrypted data out
- * to the wire
+ * Write several queued messages at once: the marshaller chunks are
+ * either sent with a single vectored write, or coalesced into as few
+ * TLS records or SASL packets as possible, instead of being
+ * linearized one by one.
  */
-static void spice_channel_flush_sasl(SpiceChannel *channel, const void *data, size_t len)
+/* coroutine context */
+static void spice_channel_write_msgs(SpiceChannel *channel,
+                                     SpiceMsgOut **msgs, guint n)
 {
     SpiceChannelPrivate *c = channel->priv;
-    const char *output;
-    unsigned int outputlen;
-    int err;
+    guint i, ready = 0;
 
-    err = sasl_encode(c->sasl_conn, data, len, &output, &outputlen);
-    if (err != SASL_OK) {
-        g_warning ("Failed to encode SASL data %s",
-                   sasl_errstring(err, NULL, NULL));
-        c->has_error = TRUE;
-        return;
+    for (i = 0; i < n; i++) {
+        if (spice_channel_prepare_msg(channel, msgs[i]))
+            msgs[ready++] = msgs[i];
+        else
+            spice_msg_out_unref(msgs[i]);
     }
 
-    //CHANNEL_DEBUG(channel, "Flush SASL %d: %p %d", len, output, outputlen);
-    spice_channel_flush_wire(channel, output, outputlen);
-}
-#endif
+    if (ready == 0)
+        return;
 
-/* coroutine context */
-static void spice_channel_write(SpiceChannel *channel, const void *data, size_t len)
-{
+#ifdef USE_SENDMSG
+    if ((!c->tls || c->ktls) &&
 #if HAVE_SASL
-    SpiceChannelPrivate *c = channel->priv;
-
-    if (c->sasl_conn)
-        spice_channel_flush_sasl(channel, data, len);
+        !c->sasl_conn &&
+#endif
+        c->sock != NULL && !G_IS_TCP_WRAPPER_CONNECTION(c->conn))
+        spice_channel_write_msgs_iov(channel, msgs, ready);
     else
 #endif
-        spice_channel_flush_wire(channel, data, len);
+        spice_channel_write_msgs_coalesced(channel, msgs, ready);
+
+    for (i = 0; i < ready; i++)
+        spice_msg_out_unref(msgs[i]);
 }
 
-/* coroutine context */
-static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
-{
-    uint8_t *data;
-    int free_data;
-    size_t len;
-    uint32_t msg_size;
+/*
+ * The bandwidth is estimated from the rate the data arrives at: a
+ * window opens when the socket is found drained, so that everything
+ * read afterwards was received after it opened, and closes when it is
+ * found drained again, once everything received was read. Reading a
+ * backlog faster than it built up would tell the speed of the client
+ * instead. A wait longer than READ_IDLE_US means the server had
+ * nothing to send, and the window is dropped.
+ */
+#define READ_WINDOW_MIN_BYTES   (64 * 1024)
+#define READ_WINDOW_MIN_US      (50 * 1000)
+#define READ_IDLE_US            (20 * 1000)
 
-    g_return_if_fail(channel != NULL);
-    g_return_if_fail(out != NULL);
-    g_return_if_fail(channel == out->channel);
+/* coroutine context: the socket was found drained */
+static void spice_channel_read_drained(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 now = g_get_monotonic_time();
+    gint64 elapsed = now - c->read_window_start;
 
-    if (out->ro_check &&
-        spice_channel_get_read_only(channel)) {
-        g_warning("Try to send message while read-only. Please report a bug.");
+    c->read_drained_at = now;
+    if (c->read_window_start != 0 && elapsed < READ_WINDOW_MIN_US)
         return;
-    }
 
-    msg_size = spice_marshaller_get_total_size(out->marshaller) -
-               spice_header_get_header_size(channel->priv->use_mini_header);
-    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
-    data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
-    /* spice_msg_out_hexdump(out, data, len); */
-    spice_channel_write(channel, data, len);
+    if (c->read_window_start != 0 && c->read_window_bytes >= READ_WINDOW_MIN_BYTES)
+        spice_session_sample_bandwidth(c->session,
+                                       c->read_window_bytes * G_USEC_PER_SEC / elapsed);
+    c->read_window_start = now;
+    c->read_window_bytes = 0;
+}
 
-    if (free_data)
-        g_free(data);
+/* the data found drained at read_drained_at arrived */
+static void spice_channel_read_woken(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
 
-    spice_msg_out_unref(out);
+    if (c->read_drained_at != 0 &&
+        g_get_monotonic_time() - c->read_drained_at > READ_IDLE_US) {
+        c->read_window_start = 0;
+        c->read_window_bytes = 0;
+    }
+    c->read_drained_at = 0;
+}
+
+static void spice_channel_account_read(SpiceChannel *channel, gsize bytes)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->read_window_start != 0)
+        c->read_window_bytes += bytes;
 }
 
 /*
@@ -882,7 +2021,33 @@ reread:
 
     if (c->has_error) return 0; /* has_error is set by disconnect(), return no error */
 
+    c->stats.read_calls++;
     cond = 0;
+#ifdef USE_KTLS
+    if (c->ktls) {
+        ret = recv(g_socket_get_fd(c->sock), data, len, 0);
+        if (ret < 0 && errno == EIO) {
+            /* not application data, an alert or a session ticket:
+             * left to OpenSSL, which gets the type of the record */
+            ret = SSL_read(c->ssl, data, len);
+            if (ret < 0) {
+                ret = SSL_get_error(c->ssl, ret);
+                if (ret == SSL_ERROR_WANT_READ)
+                    cond |= G_IO_IN;
+                if (ret == SSL_ERROR_WANT_WRITE)
+                    cond |= G_IO_OUT;
+                ret = -1;
+            }
+        } else if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                cond = G_IO_IN;
+            } else {
+                CHANNEL_DEBUG(channel, "Read error %s", g_strerror(errno));
+            }
+            ret = -1;
+        }
+    } else
+#endif
     if (c->tls) {
         ret = SSL_read(c->ssl, data, len);
         if (ret < 0) {
@@ -910,8 +2075,11 @@ reread:
 
     if (ret == -1) {
         if (cond != 0) {
+            if (cond & G_IO_IN)
+                spice_channel_read_drained(channel);
             // TODO: should use g_pollable_input/output_stream_create_source() ?
             g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
+            spice_channel_read_woken(channel);
             goto reread;
         } else {
             c->has_error = TRUE;
@@ -924,9 +2092,226 @@ reread:
         return 0;
     }
 
+    spice_channel_account_read(channel, ret);
+
     return ret;
 }
 
+/*
+ * Size of the per-channel read-ahead buffer: many small messages can
+ * be parsed out of a single socket read. Reads larger than the
+ * threshold go straight from the wire into their destination when
+ * nothing is buffered.
+ */
+#define READ_BUFFER_SIZE                (128 * 1024)
+#define READ_BUFFER_DIRECT_THRESHOLD    (READ_BUFFER_SIZE / 2)
+
+#ifdef USE_URING
+/*
+ * With the io_uring, a receive into read_buf is posted whenever it is
+ * empty, and the socket is never read directly: the completion is what
+ * wakes up the coroutine, instead of a poll of the socket followed by
+ * a read.
+ */
+/* main context */
+static void spice_channel_uring_recv_done(SpiceUringOp *op, int res, gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (res > 0) {
+        c->read_buf_pos = 0;
+        c->read_buf_len = res;
+        c->uring_full = res == READ_BUFFER_SIZE;
+        spice_channel_read_woken(channel);
+        spice_channel_account_read(channel, res);
+    } else if (res == 0) {
+        c->uring_eof = TRUE;
+    } else if (res != -ECANCELED) {
+        c->uring_errno = -res;
+    }
+
+    /* unless it is being stopped */
+    if (c->uring != NULL)
+        spice_channel_uring_wakeup(channel);
+}
+
+/* coroutine context: FALSE if the socket must be polled instead */
+static gboolean spice_channel_uring_post_recv(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    g_return_val_if_fail(c->read_buf_len == 0, FALSE);
+
+    if (c->uring_recv.pending)
+        return TRUE;
+
+    if (c->read_buf == NULL)
+        c->read_buf = g_malloc(READ_BUFFER_SIZE);
+
+    /* the previous receive did not fill the buffer, the socket was drained */
+    if (!c->uring_full)
+        spice_channel_read_drained(channel);
+
+    c->stats.read_calls++;
+    return spice_uring_recv(c->uring, &c->uring_recv, g_socket_get_fd(c->sock),
+                            c->read_buf, READ_BUFFER_SIZE);
+}
+
+/* coroutine context */
+static int spice_channel_read_uring(SpiceChannel *channel, void *data, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    while (c->read_buf_len == 0) {
+        if (c->has_error)
+            return 0;
+
+        if (c->uring_eof) {
+            CHANNEL_DEBUG(channel, "Closing the connection: spice_channel_read() - ret=0");
+            c->has_error = TRUE;
+            return 0;
+        }
+
+        if (c->uring_errno != 0) {
+            int err = c->uring_errno;
+
+            c->uring_errno = 0;
+#ifdef USE_KTLS
+            /* not application data, see spice_channel_read_wire() */
+            if (c->ktls && err == EIO)
+                return spice_channel_read_wire(channel, data, len);
+#endif
+            CHANNEL_DEBUG(channel, "Read error %s", g_strerror(err));
+            c->has_error = TRUE;
+            return -err;
+        }
+
+        if (!spice_channel_uring_post_recv(channel))
+            return spice_channel_read_wire(channel, data, len);
+
+        g_coroutine_wakeup_wait(&c->coroutine);
+    }
+
+    len = MIN(len, c->read_buf_len);
+    memcpy(data, c->read_buf + c->read_buf_pos, len);
+    c->read_buf_pos += len;
+    c->read_buf_len -= len;
+
+    return len;
+}
+#endif
+
+/*
+ * Read at least 1 more byte of data, out of the read-ahead buffer, or
+ * off the wire
+ */
+/* coroutine context */
+static int spice_channel_read_buffered(SpiceChannel *channel, void *data, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+#ifdef USE_URING
+    if (c->uring)
+        return spice_channel_read_uring(channel, data, len);
+#endif
+
+    if (c->read_buf_len == 0) {
+        int ret;
+
+        if (len >= READ_BUFFER_DIRECT_THRESHOLD)
+            return spice_channel_read_wire(channel, data, len);
+
+        if (c->read_buf == NULL)
+            c->read_buf = g_malloc(READ_BUFFER_SIZE);
+
+        ret = spice_channel_read_wire(channel, c->read_buf, READ_BUFFER_SIZE);
+        if (ret <= 0)
+            return ret;
+
+        c->read_buf_pos = 0;
+        c->read_buf_len = ret;
+    }
+
+    len = MIN(len, c->read_buf_len);
+    memcpy(data, c->read_buf + c->read_buf_pos, len);
+    c->read_buf_pos += len;
+    c->read_buf_len -= len;
+
+    return len;
+}
+
+/* coroutine context */
+G_GNUC_INTERNAL
+gboolean spice_channel_has_pending_input(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->read_buf_len > 0)
+        return TRUE;
+
+#ifdef USE_URING
+    /* only the posted receive reads the socket */
+    if (c->uring)
+        return c->uring_eof || c->uring_errno != 0;
+#endif
+
+    if (c->tls && SSL_pending(c->ssl) > 0)
+        return TRUE;
+
+#if HAVE_SASL
+    if (c->sasl_decoded != NULL)
+        return TRUE;
+#endif
+
+    return g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in));
+}
+
+/*
+ * Once the channel is ready, its socket goes through the io_uring of the
+ * session, unless it is read through OpenSSL, SASL or a proxy. The
+ * audio channels keep their sockets polled, at their higher priority.
+ */
+/* coroutine context */
+static void spice_channel_uring_start(SpiceChannel *channel)
+{
+#ifdef USE_URING
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->uring != NULL || c->sock == NULL ||
+        c->coroutine.priority != 0 ||
+        (c->tls && !c->ktls) ||
+#if HAVE_SASL
+        c->sasl_conn != NULL ||
+#endif
+        G_IS_TCP_WRAPPER_CONNECTION(c->conn))
+        return;
+
+    spice_uring_op_init(&c->uring_recv, spice_channel_uring_recv_done, channel);
+    c->uring = spice_session_get_uring(c->session);
+    if (c->uring)
+        CHANNEL_DEBUG(channel, "socket read through io_uring");
+#endif
+}
+
+/* any context: what was received already stays in read_buf */
+static void spice_channel_uring_stop(SpiceChannel *channel)
+{
+#ifdef USE_URING
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceUring *ring = c->uring;
+
+    if (ring == NULL)
+        return;
+
+    c->uring = NULL;
+    spice_uring_cancel_sync(ring, &c->uring_recv);
+    c->uring_eof = FALSE;
+    c->uring_errno = 0;
+    c->uring_full = FALSE;
+#endif
+}
+
 #if HAVE_SASL
 /*
  * Read at least 1 more byte of data out of the SASL decrypted
@@ -940,16 +2325,20 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
     /*             c->sasl_decoded_length, c->sasl_decoded_offset); */
 
     if (c->sasl_decoded == NULL || c->sasl_decoded_length == 0) {
-        char encoded[8192]; /* should stay lower than maxbufsize */
         int err, ret;
 
         g_warn_if_fail(c->sasl_decoded_offset == 0);
 
-        ret = spice_channel_read_wire(channel, encoded, sizeof(encoded));
+        /* large enough to be read straight off the wire, once the
+         * read-ahead buffer is empty */
+        if (c->sasl_encoded_in == NULL)
+            c->sasl_encoded_in = g_malloc(SASL_READ_SIZE);
+
+        ret = spice_channel_read_buffered(channel, c->sasl_encoded_in, SASL_READ_SIZE);
         if (ret < 0)
             return ret;
 
-        err = sasl_decode(c->sasl_conn, encoded, ret,
+        err = sasl_decode(c->sasl_conn, (const char *)c->sasl_encoded_in, ret,
                           &c->sasl_decoded, &c->sasl_decoded_length);
         if (err != SASL_OK) {
             g_warning("Failed to decode SASL data %s",
@@ -976,6 +2365,61 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
 }
 #endif
 
+/* coroutine context */
+static void spice_channel_capture_open(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    const gchar *dir = g_getenv("SPICE_CAPTURE_DIR");
+    SpiceCaptureHeader header = { SPICE_CAPTURE_MAGIC, };
+    gchar *name, *path;
+
+    if (dir == NULL || c->capture != NULL)
+        return;
+
+    name = g_strdup_printf("%s-%d-%" G_GINT64_FORMAT ".spicecap",
+                           spice_channel_type_to_string(c->channel_type),
+                           c->channel_id, g_get_real_time() / 1000);
+    path = g_build_filename(dir, name, NULL);
+
+    c->capture = fopen(path, "wb");
+    if (c->capture == NULL) {
+        g_warning("%s: failed to create capture %s: %s", c->name, path, strerror(errno));
+        goto end;
+    }
+
+    header.version = SPICE_CAPTURE_VERSION;
+    header.channel_type = c->channel_type;
+    header.channel_id = c->channel_id;
+    if (fwrite(&header, sizeof(header), 1, c->capture) != 1) {
+        g_warning("%s: failed to write capture %s: %s", c->name, path, strerror(errno));
+        fclose(c->capture);
+        c->capture = NULL;
+        goto end;
+    }
+    c->capture_start = g_get_monotonic_time();
+    CHANNEL_DEBUG(channel, "capturing to %s", path);
+
+end:
+    g_free(name);
+    g_free(path);
+}
+
+/* coroutine context */
+static void spice_channel_capture(SpiceChannel *channel, const void *data, gsize size)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceCaptureRecord record = { 0, };
+
+    record.time_us = g_get_monotonic_time() - c->capture_start;
+    record.size = size;
+    if (fwrite(&record, sizeof(record), 1, c->capture) != 1 ||
+        fwrite(data, size, 1, c->capture) != 1) {
+        g_warning("%s: failed to write capture: %s", c->name, strerror(errno));
+        fclose(c->capture);
+        c->capture = NULL;
+    }
+}
+
 /*
  * Fill the 'data' buffer up with exactly 'len' bytes worth of data
  */
@@ -984,6 +2428,7 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
 {
     SpiceChannelPrivate *c = channel->priv;
     gsize len = length;
+    void *start = data;
     int ret;
 
     while (len > 0) {
@@ -994,7 +2439,7 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
             ret = spice_channel_read_sasl(channel, data, len);
         else
 #endif
-            ret = spice_channel_read_wire(channel, data, len);
+            ret = spice_channel_read_buffered(channel, data, len);
         if (ret < 0)
             return ret;
         g_assert(ret <= len);
@@ -1006,6 +2451,9 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
 #endif
     }
     c->total_read_bytes += length;
+    c->stats.bytes_in += length;
+    if (c->capture)
+        spice_channel_capture(channel, start, length);
 
     return length;
 }
@@ -1094,6 +2542,15 @@ static gboolean spice_channel_recv_auth(SpiceChannel *channel)
     }
 
     c->state = SPICE_CHANNEL_STATE_READY;
+    spice_channel_uring_start(channel);
+#ifdef USE_LZ4
+    c->compress_out = c->compress &&
+        spice_channel_test_capability(channel, SPICE_SPICEVMC_CAP_DATA_COMPRESS_LZ4);
+#endif
+    c->stats.ready_time_us = g_get_monotonic_time() - c->connect_start;
+    CHANNEL_DEBUG(channel, "ready in %" G_GUINT64_FORMAT " us", c->stats.ready_time_us);
+    if (c->channel_type == SPICE_CHANNEL_MAIN)
+        spice_session_startup_reached(c->session, SPICE_SESSION_STARTUP_MAIN_READY);
 
     g_coroutine_signal_emit(channel, signals[SPICE_CHANNEL_EVENT], 0, SPICE_CHANNEL_OPENED);
 
@@ -1128,6 +2585,16 @@ static void spice_channel_send_link(SpiceChannel *channel)
     c->link_hdr.magic = SPICE_MAGIC;
     c->link_hdr.size = sizeof(c->link_msg);
 
+#ifdef USE_LZ4
+    /* the capability is the same for all the spicevmc channels */
+    c->compress = (c->channel_type == SPICE_CHANNEL_USBREDIR ||
+                   c->channel_type == SPICE_CHANNEL_PORT ||
+                   c->channel_type == SPICE_CHANNEL_WEBDAV) &&
+        spice_session_get_compress_channel(c->session, c->channel_type);
+    if (c->compress)
+        spice_channel_set_capability(channel, SPICE_SPICEVMC_CAP_DATA_COMPRESS_LZ4);
+#endif
+
     g_object_get(c->session, "protocol", &protocol, NULL);
     switch (protocol) {
     case 1: /* protocol 1 == major 1, old 0.4 protocol, last active minor */
@@ -1656,6 +3123,11 @@ complete:
          * is defined to be sent unencrypted, and setting saslconn turns
          * on the SSF layer encryption processing */
         c->sasl_conn = saslconn;
+        c->sasl_maxout = SASL_MAXOUT_DEFAULT;
+        if (sasl_getprop(saslconn, SASL_MAXOUTBUF, &val) == SASL_OK &&
+            *(const unsigned int *)val > 0)
+            c->sasl_maxout = *(const unsigned int *)val;
+        CHANNEL_DEBUG(channel, "SASL max output %u", c->sasl_maxout);
         goto cleanup;
     }
 
@@ -1785,6 +3257,75 @@ gboolean spice_channel_get_read_only(SpiceChannel *channel)
     return spice_session_get_read_only(channel->priv->session);
 }
 
+/*
+ * The payload of the messages of @type, which have no parsed form like
+ * SPICE_MSG_SPICEVMC_DATA, isn't buffered: @reader is called instead of
+ * the message handler and reads it off the wire, into its own memory,
+ * with spice_channel_read_msg_data(). What it leaves is skipped.
+ */
+G_GNUC_INTERNAL
+void spice_channel_set_msg_data_reader(SpiceChannel *channel, int type,
+                                       spice_msg_data_reader reader)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    c->msg_data_type = reader ? type : 0;
+    c->msg_data_reader = reader;
+}
+
+/*
+ * Read up to @len bytes of the payload of the message being read, returns
+ * 0 at its end
+ */
+/* coroutine context */
+G_GNUC_INTERNAL
+int spice_channel_read_msg_data(SpiceChannel *channel, void *data, gsize len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    len = MIN(len, c->msg_data_left);
+    if (len == 0 || c->has_error)
+        return 0;
+
+    /* an error is for the channel to report, the data just ends */
+    if (spice_channel_read(channel, data, len) != len) {
+        c->msg_data_left = 0;
+        return 0;
+    }
+    c->msg_data_left -= len;
+
+    return len;
+}
+
+/* coroutine context */
+static void spice_channel_recv_msg_data(SpiceChannel *channel, int msg_type, int msg_size)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 start, handled;
+
+    spice_channel_account_msg(channel, FALSE, msg_type, msg_size);
+
+    start = g_get_monotonic_time();
+    c->msg_data_left = msg_size;
+    c->msg_data_reader(channel, msg_size);
+    SPICE_TRACE2(msg_handled, c->name, msg_type);
+
+    /* skip what the reader left */
+    while (c->msg_data_left > 0 && !c->has_error) {
+        guint8 buf[4096];
+
+        if (spice_channel_read_msg_data(channel, buf, sizeof(buf)) <= 0)
+            break;
+    }
+    c->msg_data_left = 0;
+    handled = g_get_monotonic_time();
+    spice_channel_account_msg_time(channel, msg_type, handled - start);
+    c->stats.handle_time_us += handled - start;
+
+    if (!c->has_error)
+        spice_channel_ack_msg(channel);
+}
+
 /* coroutine context */
 G_GNUC_INTERNAL
 void spice_channel_recv_msg(SpiceChannel *channel,
@@ -1795,6 +3336,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     int msg_size;
     int msg_type;
     int sub_list_offset = 0;
+    gint64 start, parsed;
 
     in = spice_msg_in_new(channel);
 
@@ -1803,60 +3345,96 @@ void spice_channel_recv_msg(SpiceChannel *channel,
                        spice_header_get_header_size(c->use_mini_header));
     if (c->has_error)
         goto end;
+    spice_channel_account_msg_in_time(channel);
 
-    msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
-    /* FIXME: do not allow others to take ref on in, and use realloc here?
-     * this would avoid malloc/free on each message?
-     */
-    in->data = g_malloc0(msg_size);
-    spice_channel_read(channel, in->data, msg_size);
-    if (c->has_error)
-        goto end;
-    in->dpos = msg_size;
-
+    msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
     msg_type = spice_header_get_msg_type(in->header, c->use_mini_header);
     sub_list_offset = spice_header_get_msg_sub_list(in->header, c->use_mini_header);
+    SPICE_TRACE3(msg_recv, c->name, msg_type, msg_size);
+
+    if (c->msg_data_reader != NULL && msg_type == c->msg_data_type &&
+        sub_list_offset == 0 &&
+        msg_handler == (handler_msg_in)SPICE_CHANNEL_GET_CLASS(channel)->handle_msg) {
+        spice_channel_recv_msg_data(channel, msg_type, msg_size);
+        goto end;
+    }
+
+#ifdef USE_LZ4
+    if (c->compress && msg_type == SPICE_MSG_SPICEVMC_COMPRESSED_DATA &&
+        sub_list_offset == 0) {
+        if (!spice_channel_recv_compressed_msg(channel, in, msg_size))
+            goto end;
+        msg_type = SPICE_MSG_SPICEVMC_DATA;
+        msg_size = in->dpos;
+    } else
+#endif
+    {
+        spice_msg_in_alloc_data(in, msg_size);
+        spice_channel_read(channel, in->data, msg_size);
+        if (c->has_error)
+            goto end;
+        in->dpos = msg_size;
+    }
+    in->wire_time = g_get_monotonic_time();
 
     if (msg_type == SPICE_MSG_LIST || sub_list_offset) {
         SpiceSubMessageList *sub_list;
         SpiceSubMessage *sub;
         SpiceMsgIn *sub_in;
-        int i;
+        int i, n_parsed;
 
         sub_list = (SpiceSubMessageList *)(in->data + sub_list_offset);
+        spice_msg_in_alloc_subs(in, sub_list->size);
+
+        /* parse the whole list first, then dispatch it */
+        start = g_get_monotonic_time();
         for (i = 0; i < sub_list->size; i++) {
             sub = (SpiceSubMessage *)(in->data + sub_list->sub_messages[i]);
-            sub_in = spice_msg_in_sub_new(channel, in, sub);
+            sub_in = spice_msg_in_sub_init(in, i, sub);
+            spice_channel_account_msg(channel, FALSE, sub->type, sub->size);
             sub_in->parsed = c->parser(sub_in->data, sub_in->data + sub_in->dpos,
-                                       spice_header_get_msg_type(sub_in->header,
-                                                                 c->use_mini_header),
-                                       c->peer_hdr.minor_version,
+                                       sub->type, c->peer_hdr.minor_version,
                                        &sub_in->psize, &sub_in->pfree);
             if (sub_in->parsed == NULL) {
                 g_critical("failed to parse sub-message: %s type %d",
-                           c->name, spice_header_get_msg_type(sub_in->header, c->use_mini_header));
-                goto end;
+                           c->name, sub->type);
+                spice_msg_in_unref(sub_in);
+                break;
             }
-            msg_handler(channel, sub_in, data);
-            spice_msg_in_unref(sub_in);
+            SPICE_TRACE2(msg_parsed, c->name, sub->type);
         }
+        n_parsed = i;
+        parsed = g_get_monotonic_time();
+        c->stats.parse_time_us += parsed - start;
+
+        for (i = 0; i < n_parsed; i++) {
+            gint64 handled;
+
+            msg_handler(channel, &in->subs[i], data);
+            SPICE_TRACE2(msg_handled, c->name, spice_msg_in_type(&in->subs[i]));
+            handled = g_get_monotonic_time();
+            spice_channel_account_msg_time(channel, spice_msg_in_type(&in->subs[i]),
+                                           handled - parsed);
+            c->stats.handle_time_us += handled - parsed;
+            parsed = handled;
+            spice_msg_in_unref(&in->subs[i]);
+        }
+
+        if (n_parsed < sub_list->size)
+            goto end;
     }
 
     /* ack message */
-    if (c->message_ack_count) {
-        c->message_ack_count--;
-        if (!c->message_ack_count) {
-            SpiceMsgOut *out = spice_msg_out_new(channel, SPICE_MSGC_ACK);
-            spice_msg_out_send_internal(out);
-            c->message_ack_count = c->message_ack_window;
-        }
-    }
+    spice_channel_ack_msg(channel);
 
     if (msg_type == SPICE_MSG_LIST) {
         goto end;
     }
 
+    spice_channel_account_msg(channel, FALSE, msg_type, msg_size);
+
     /* parse message */
+    start = g_get_monotonic_time();
     in->parsed = c->parser(in->data, in->data + msg_size, msg_type,
                            c->peer_hdr.minor_version, &in->psize, &in->pfree);
     if (in->parsed == NULL) {
@@ -1864,16 +3442,24 @@ void spice_channel_recv_msg(SpiceChannel *channel,
                    c->name, msg_type);
         goto end;
     }
+    parsed = g_get_monotonic_time();
+    SPICE_TRACE2(msg_parsed, c->name, msg_type);
 
     /* process message */
     /* spice_msg_in_hexdump(in); */
     msg_handler(channel, in, data);
+    SPICE_TRACE2(msg_handled, c->name, msg_type);
+    c->stats.parse_time_us += parsed - start;
+    start = g_get_monotonic_time();
+    spice_channel_account_msg_time(channel, msg_type, start - parsed);
+    c->stats.handle_time_us += start - parsed;
 
 end:
     /* If the server uses full header, the serial is not necessarily equal
      * to c->in_serial (the server can sometimes skip serials) */
     c->last_message_serial = spice_header_get_in_msg_serial(in);
     c->in_serial++;
+    g_coroutine_condition_signal(&c->waiters);
     spice_msg_in_unref(in);
 }
 
@@ -2079,15 +3665,19 @@ static void spice_channel_flushed(SpiceChannel *channel, gboolean success)
 static void spice_channel_iterate_write(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
+    SpiceMsgOut *batch[XMIT_BATCH_MAX_MSGS];
+    guint n;
 
     do {
-        STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-        out = g_queue_pop_head(&c->xmit_queue);
-        STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
-        if (out)
-            spice_channel_write_msg(channel, out);
-    } while (out);
+        spice_channel_xmit_take(channel);
+        for (n = 0; n < G_N_ELEMENTS(batch); n++) {
+            batch[n] = g_queue_pop_head(&c->xmit_queue);
+            if (batch[n] == NULL)
+                break;
+        }
+        if (n > 0)
+            spice_channel_write_msgs(channel, batch, n);
+    } while (n > 0);
 
     spice_channel_flushed(channel, TRUE);
 }
@@ -2097,12 +3687,21 @@ static void spice_channel_iterate_read(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
 
-    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    /* no need to wait for the socket if previously read data is pending */
+#ifdef USE_URING
+    if (c->uring) {
+        if (c->read_buf_len == 0 && !c->uring_eof && c->uring_errno == 0 &&
+            spice_channel_uring_post_recv(channel))
+            g_coroutine_wakeup_wait(&c->coroutine);
+    } else
+#endif
+    if (c->read_buf_len == 0)
+        g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
 
     /* treat all incoming data (block on message completion) */
     while (!c->has_error &&
            c->state != SPICE_CHANNEL_STATE_MIGRATING &&
-           g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))
+           spice_channel_has_pending_input(channel)
     ) { do
             spice_channel_recv_msg(channel,
                                    (handler_msg_in)SPICE_CHANNEL_GET_CLASS(channel)->handle_msg, NULL);
@@ -2135,7 +3734,7 @@ static gboolean spice_channel_iterate(SpiceChannel *channel)
     SpiceChannelPrivate *c = channel->priv;
 
     if (c->state == SPICE_CHANNEL_STATE_MIGRATING &&
-        !g_coroutine_condition_wait(&c->coroutine, wait_migration, channel))
+        !g_coroutine_condition_wait_on(&c->coroutine, &c->waiters, wait_migration, channel))
         CHANNEL_DEBUG(channel, "migration wait cancelled");
 
     /* flush any pending write and read */
@@ -2170,6 +3769,28 @@ static gboolean spice_channel_iterate(SpiceChannel *channel)
     return TRUE;
 }
 
+static gboolean link_released(gpointer data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(data);
+
+    return !channel->priv->hold_link;
+}
+
+/*
+ * A held channel connects, in TLS if needed, and waits before sending
+ * its link message, for instance for the main channel the server must
+ * know first.
+ */
+/* main context */
+G_GNUC_INTERNAL
+void spice_channel_hold_link(SpiceChannel *channel, gboolean hold)
+{
+    g_return_if_fail(SPICE_IS_CHANNEL(channel));
+
+    channel->priv->hold_link = hold;
+    g_coroutine_condition_signal(&channel->priv->waiters);
+}
+
 /* we use an idle function to allow the coroutine to exit before we actually
  * unref the object since the coroutine's state is part of the object */
 static gboolean spice_channel_delayed_unref(gpointer data)
@@ -2184,6 +3805,16 @@ static gboolean spice_channel_delayed_unref(gpointer data)
 
     c->state = SPICE_CHANNEL_STATE_UNCONNECTED;
 
+    if (c->event != SPICE_CHANNEL_NONE && c->session != NULL &&
+        spice_session_channel_lost(c->session, channel, c->event)) {
+        /* the session brings it back, or reports the error later */
+        CHANNEL_DEBUG(channel, "connection lost, waiting to reconnect");
+        c->event = SPICE_CHANNEL_NONE;
+        g_clear_error(&c->error);
+        g_object_unref(G_OBJECT(data));
+        return FALSE;
+    }
+
     if (c->event != SPICE_CHANNEL_NONE) {
         g_coroutine_signal_emit(channel, signals[SPICE_CHANNEL_EVENT], 0, c->event);
         c->event = SPICE_CHANNEL_NONE;
@@ -2203,7 +3834,7 @@ static X509_LOOKUP_METHOD spice_x509_mem_lookup = {
     0
 };
 
-static int spice_channel_load_ca(SpiceChannel *channel)
+static int spice_channel_load_ca(SpiceChannel *channel, SSL_CTX *ctx)
 {
     SpiceChannelPrivate *c = channel->priv;
     STACK_OF(X509_INFO) *inf;
@@ -2216,9 +3847,9 @@ static int spice_channel_load_ca(SpiceChannel *channel)
     const gchar *ca_file;
     int rc;
 
-    g_return_val_if_fail(c->ctx != NULL, 0);
+    g_return_val_if_fail(ctx != NULL, 0);
 
-    lookup = X509_STORE_add_lookup(c->ctx->cert_store, &spice_x509_mem_lookup);
+    lookup = X509_STORE_add_lookup(SSL_CTX_get_cert_store(ctx), &spice_x509_mem_lookup);
     ca_file = spice_session_get_ca_file(c->session);
     spice_session_get_ca(c->session, &ca, &size);
 
@@ -2246,7 +3877,7 @@ static int spice_channel_load_ca(SpiceChannel *channel)
     }
 
     if (ca_file != NULL) {
-        rc = SSL_CTX_load_verify_locations(c->ctx, ca_file, NULL);
+        rc = SSL_CTX_load_verify_locations(ctx, ca_file, NULL);
         if (rc != 1)
             g_warning("loading ca certs from %s failed", ca_file);
         else
@@ -2254,7 +3885,7 @@ static int spice_channel_load_ca(SpiceChannel *channel)
     }
 
     if (count == 0) {
-        rc = SSL_CTX_set_default_verify_paths(c->ctx);
+        rc = SSL_CTX_set_default_verify_paths(ctx);
         if (rc != 1)
             g_warning("loading ca certs from default location failed");
         else
@@ -2264,6 +3895,58 @@ static int spice_channel_load_ca(SpiceChannel *channel)
     return count;
 }
 
+#ifdef USE_KTLS
+/*
+ * Opt-in, SPICE_KTLS=1: once the handshake is done, the crypto is done
+ * by the kernel, and the channel uses the socket as if it was not
+ * encrypted. Only for direct connections, a proxy has its own stream.
+ */
+static gboolean spice_channel_want_ktls(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (g_strcmp0(g_getenv("SPICE_KTLS"), "1") != 0)
+        return FALSE;
+
+    return !G_IS_TCP_WRAPPER_CONNECTION(c->conn);
+}
+#endif
+
+/* the session keeps it for the next channels, @ca_loaded unless the
+ * verification needs no certificate */
+static SSL_CTX *spice_channel_new_ssl_ctx(SpiceChannel *channel, guint verify,
+                                          gboolean *ca_loaded)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    /* When some other SSL/TLS version becomes obsolete, add it to this
+     * variable. */
+    long ssl_options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
+    const gchar *ciphers;
+    SSL_CTX *ctx;
+    int rc;
+
+    ctx = SSL_CTX_new(SSLv23_method());
+    if (ctx == NULL) {
+        g_critical("SSL_CTX_new failed");
+        return NULL;
+    }
+
+    SSL_CTX_set_options(ctx, ssl_options);
+
+    *ca_loaded = TRUE;
+    if (verify & (SPICE_SESSION_VERIFY_SUBJECT | SPICE_SESSION_VERIFY_HOSTNAME))
+        *ca_loaded = spice_channel_load_ca(channel, ctx) > 0;
+
+    ciphers = spice_session_get_ciphers(c->session);
+    if (ciphers != NULL) {
+        rc = SSL_CTX_set_cipher_list(ctx, ciphers);
+        if (rc != 1)
+            g_warning("loading cipher list %s failed", ciphers);
+    }
+
+    return ctx;
+}
+
 /**
  * spice_channel_get_error:
  * @channel:
@@ -2284,6 +3967,126 @@ const GError* spice_channel_get_error(SpiceChannel *self)
     return c->error;
 }
 
+/*
+ * The local queueing order of the channels packets: inputs, cursor,
+ * display and the others, then the bulk transfers. The values are the
+ * Linux TC_PRIO ones, mapped to the pfifo_fast bands.
+ */
+static int spice_channel_get_socket_priority(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->xmit_priority)
+        return 6; /* TC_PRIO_INTERACTIVE */
+
+    switch (c->channel_type) {
+    case SPICE_CHANNEL_CURSOR:
+        return 4; /* TC_PRIO_INTERACTIVE_BULK */
+    case SPICE_CHANNEL_USBREDIR:
+    case SPICE_CHANNEL_PORT:
+    case SPICE_CHANNEL_WEBDAV:
+        return 2; /* TC_PRIO_BULK */
+    default:
+        return 0; /* TC_PRIO_BESTEFFORT, the socket default */
+    }
+}
+
+/*
+ * Marks the packets of the channel for the local queueing (SO_PRIORITY)
+ * and, for the latency sensitive channels when SPICE_INPUTS_DSCP is set
+ * to a DSCP value (46 for EF), for the network.
+ */
+/* coroutine context */
+static void spice_channel_set_socket_priority(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    int fd = g_socket_get_fd(c->sock);
+    const char *dscp;
+
+#ifdef SO_PRIORITY
+    {
+        int prio = spice_channel_get_socket_priority(channel);
+
+        if (prio != 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_PRIORITY,
+                       (const char*)&prio, sizeof(prio)) != 0)
+            CHANNEL_DEBUG(channel, "could not set SO_PRIORITY: %s", strerror(errno));
+    }
+#endif
+
+    if (!c->xmit_priority)
+        return;
+
+    dscp = g_getenv("SPICE_INPUTS_DSCP");
+    if (dscp != NULL) {
+        int tos = (g_ascii_strtoull(dscp, NULL, 10) & 0x3f) << 2;
+        int rc = -1;
+
+        switch (g_socket_get_family(c->sock)) {
+#ifdef IP_TOS
+        case G_SOCKET_FAMILY_IPV4:
+            rc = setsockopt(fd, IPPROTO_IP, IP_TOS, (const char*)&tos, sizeof(tos));
+            break;
+#endif
+#ifdef IPV6_TCLASS
+        case G_SOCKET_FAMILY_IPV6:
+            rc = setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, (const char*)&tos, sizeof(tos));
+            break;
+#endif
+        default:
+            break;
+        }
+        if (rc != 0)
+            CHANNEL_DEBUG(channel, "could not set DSCP %s", dscp);
+    }
+}
+
+#define KEEPALIVE_PROBES 4
+
+/*
+ * With SpiceSession:keepalive-timeout, an idle connection is probed
+ * after half of the timeout, then KEEPALIVE_PROBES times over the
+ * other half, and the data sent must be acknowledged within the
+ * timeout (TCP_USER_TIMEOUT), so that a dead peer turns into a read or
+ * write error instead of a frozen display.
+ */
+/* coroutine context */
+static void spice_channel_set_keepalive(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    guint timeout = spice_session_get_keepalive_timeout(c->session);
+    int fd = g_socket_get_fd(c->sock);
+    int idle, interval, count, user_timeout;
+
+    if (timeout == 0 ||
+        g_socket_get_family(c->sock) == G_SOCKET_FAMILY_UNIX)
+        return;
+
+    g_socket_set_keepalive(c->sock, TRUE);
+    idle = MAX(timeout / 2, 1);
+    interval = MAX((timeout - idle) / KEEPALIVE_PROBES, 1);
+    count = KEEPALIVE_PROBES;
+    user_timeout = timeout * 1000;
+
+#ifdef TCP_KEEPIDLE
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (const char*)&idle, sizeof(idle)) != 0)
+        CHANNEL_DEBUG(channel, "could not set TCP_KEEPIDLE: %s", strerror(errno));
+#endif
+#ifdef TCP_KEEPINTVL
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (const char*)&interval, sizeof(interval)) != 0)
+        CHANNEL_DEBUG(channel, "could not set TCP_KEEPINTVL: %s", strerror(errno));
+#endif
+#ifdef TCP_KEEPCNT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (const char*)&count, sizeof(count)) != 0)
+        CHANNEL_DEBUG(channel, "could not set TCP_KEEPCNT: %s", strerror(errno));
+#endif
+#ifdef TCP_USER_TIMEOUT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                   (const char*)&user_timeout, sizeof(user_timeout)) != 0)
+        CHANNEL_DEBUG(channel, "could not set TCP_USER_TIMEOUT: %s", strerror(errno));
+#endif
+}
+
 /* coroutine context */
 static void *spice_channel_coroutine(void *data)
 {
@@ -2291,13 +4094,10 @@ static void *spice_channel_coroutine(void *data)
     SpiceChannelPrivate *c = channel->priv;
     guint verify;
     int rc, delay_val = 1;
-    /* When some other SSL/TLS version becomes obsolete, add it to this
-     * variable. */
-    long ssl_options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
 
     CHANNEL_DEBUG(channel, "Started background coroutine %p", &c->coroutine);
 
-    if (spice_session_get_client_provided_socket(c->session)) {
+    if (spice_session_get_client_provided_socket(c->session) || c->fd != -1) {
         if (c->fd < 0) {
             g_critical("fd not provided!");
             c->event = SPICE_CHANNEL_ERROR_CONNECT;
@@ -2313,6 +4113,8 @@ static void *spice_channel_coroutine(void *data)
         g_socket_set_blocking(c->sock, FALSE);
         g_socket_set_keepalive(c->sock, TRUE);
         c->conn = g_socket_connection_factory_create_connection(c->sock);
+        if (c->tls)
+            goto tls;
         goto connected;
     }
 
@@ -2332,51 +4134,53 @@ reconnect:
     }
     c->sock = g_object_ref(g_socket_connection_get_socket(c->conn));
 
+tls:
     if (c->tls) {
-        c->ctx = SSL_CTX_new(SSLv23_method());
-        if (c->ctx == NULL) {
-            g_critical("SSL_CTX_new failed");
-            c->event = SPICE_CHANNEL_ERROR_TLS;
-            goto cleanup;
-        }
-
-        SSL_CTX_set_options(c->ctx, ssl_options);
+        SSL_CTX *ctx;
+        SSL_SESSION *ssl_session;
+        gboolean ca_loaded;
 
+        /* the CA is loaded once for all the channels */
         verify = spice_session_get_verify(c->session);
-        if (verify &
-            (SPICE_SESSION_VERIFY_SUBJECT | SPICE_SESSION_VERIFY_HOSTNAME)) {
-            rc = spice_channel_load_ca(channel);
-            if (rc == 0) {
-                g_warning("no cert loaded");
-                if (verify & SPICE_SESSION_VERIFY_PUBKEY) {
-                    g_warning("only pubkey active");
-                    verify = SPICE_SESSION_VERIFY_PUBKEY;
-                } else {
-                    c->event = SPICE_CHANNEL_ERROR_TLS;
-                    goto cleanup;
-                }
+        ctx = spice_session_get_ssl_ctx(c->session, &ca_loaded);
+        if (ctx == NULL) {
+            ctx = spice_channel_new_ssl_ctx(channel, verify, &ca_loaded);
+            if (ctx == NULL) {
+                c->event = SPICE_CHANNEL_ERROR_TLS;
+                goto cleanup;
             }
+            spice_session_set_ssl_ctx(c->session, ctx, ca_loaded);
         }
 
-        {
-            const gchar *ciphers = spice_session_get_ciphers(c->session);
-            if (ciphers != NULL) {
-                rc = SSL_CTX_set_cipher_list(c->ctx, ciphers);
-                if (rc != 1)
-                    g_warning("loading cipher list %s failed", ciphers);
+        if (!ca_loaded) {
+            g_warning("no cert loaded");
+            if (verify & SPICE_SESSION_VERIFY_PUBKEY) {
+                g_warning("only pubkey active");
+                verify = SPICE_SESSION_VERIFY_PUBKEY;
+            } else {
+                c->event = SPICE_CHANNEL_ERROR_TLS;
+                goto cleanup;
             }
         }
 
-        c->ssl = SSL_new(c->ctx);
+        c->ssl = SSL_new(ctx);
         if (c->ssl == NULL) {
             g_critical("SSL_new failed");
             c->event = SPICE_CHANNEL_ERROR_TLS;
             goto cleanup;
         }
 
-
-        BIO *bio = bio_new_giostream(G_IO_STREAM(c->conn));
-        SSL_set_bio(c->ssl, bio, bio);
+#ifdef USE_KTLS
+        /* the kernel needs the socket itself, not a stream on top of it */
+        if (spice_channel_want_ktls(channel)) {
+            SSL_set_fd(c->ssl, g_socket_get_fd(c->sock));
+            SSL_set_options(c->ssl, SSL_OP_ENABLE_KTLS);
+        } else
+#endif
+        {
+            BIO *bio = bio_new_giostream(G_IO_STREAM(c->conn));
+            SSL_set_bio(c->ssl, bio, bio);
+        }
 
         {
             guint8 *pubkey;
@@ -2389,6 +4193,11 @@ reconnect:
                 spice_session_get_cert_subject(c->session));
         }
 
+        /* resume the TLS session of the previous channel to the server */
+        ssl_session = spice_session_get_ssl_session(c->session);
+        if (ssl_session != NULL)
+            SSL_set_session(c->ssl, ssl_session);
+
 ssl_reconnect:
         rc = SSL_connect(c->ssl);
         if (rc <= 0) {
@@ -2403,6 +4212,13 @@ ssl_reconnect:
                 goto cleanup;
             }
         }
+
+#ifdef USE_KTLS
+        /* otherwise OpenSSL keeps the crypto in user space, as usual */
+        c->ktls = BIO_get_ktls_send(SSL_get_wbio(c->ssl)) &&
+                  BIO_get_ktls_recv(SSL_get_rbio(c->ssl));
+        CHANNEL_DEBUG(channel, "kernel TLS %s", c->ktls ? "on" : "off");
+#endif
     }
 
 connected:
@@ -2420,13 +4236,31 @@ connected:
         g_warning("%s: could not set sockopt TCP_NODELAY: %s", c->name,
                   strerror(errno));
     }
+    spice_channel_set_socket_priority(channel);
+    spice_channel_set_keepalive(channel);
+
+    if (c->hold_link) {
+        CHANNEL_DEBUG(channel, "connected, waiting to link");
+        if (!g_coroutine_condition_wait_on(&c->coroutine, &c->waiters,
+                                           link_released, channel) ||
+            c->has_error)
+            goto cleanup;
+    }
 
+    spice_channel_capture_open(channel);
     spice_channel_send_link(channel);
     if (!spice_channel_recv_link_hdr(channel) ||
         !spice_channel_recv_link_msg(channel) ||
         !spice_channel_recv_auth(channel))
         goto cleanup;
 
+    if (c->ssl) {
+        /* the session tickets came with the handshake or just after */
+        CHANNEL_DEBUG(channel, "TLS session %s",
+                      SSL_session_reused(c->ssl) ? "resumed" : "negotiated");
+        spice_session_set_ssl_session(c->session, SSL_get1_session(c->ssl));
+    }
+
     while (spice_channel_iterate(channel))
         ;
 
@@ -2448,6 +4282,22 @@ cleanup:
     return NULL;
 }
 
+/*
+ * Stack size hint for the channel coroutines. Most channels run
+ * decoders or other library code from their coroutine and get the
+ * default stack, but some only deal with small messages.
+ */
+static size_t spice_channel_get_stack_size(SpiceChannel *channel)
+{
+    switch (channel->priv->channel_type) {
+    case SPICE_CHANNEL_INPUTS:
+    case SPICE_CHANNEL_CURSOR:
+        return 1 << 20; /* 1Mb */
+    default:
+        return COROUTINE_DEFAULT_STACK_SIZE;
+    }
+}
+
 static gboolean connect_delayed(gpointer data)
 {
     SpiceChannel *channel = data;
@@ -2459,7 +4309,7 @@ static gboolean connect_delayed(gpointer data)
 
     co = &c->coroutine.coroutine;
 
-    co->stack_size = 16 << 20; /* 16Mb */
+    co->stack_size = spice_channel_get_stack_size(channel);
     co->entry = spice_channel_coroutine;
     co->release = NULL;
 
@@ -2469,6 +4319,26 @@ static gboolean connect_delayed(gpointer data)
     return FALSE;
 }
 
+/*
+ * The channels the user interacts with first come up before the
+ * others: the connections are all asynchronous, this only orders the
+ * idle callbacks that create and start them.
+ */
+G_GNUC_INTERNAL
+gint spice_channel_connect_priority(gint type, gint id)
+{
+    switch (type) {
+    case SPICE_CHANNEL_MAIN:
+    case SPICE_CHANNEL_INPUTS:
+    case SPICE_CHANNEL_CURSOR:
+        return G_PRIORITY_DEFAULT_IDLE - 10;
+    case SPICE_CHANNEL_DISPLAY:
+        return id == 0 ? G_PRIORITY_DEFAULT_IDLE - 10 : G_PRIORITY_DEFAULT_IDLE;
+    default:
+        return G_PRIORITY_DEFAULT_IDLE;
+    }
+}
+
 /* any context */
 static gboolean channel_connect(SpiceChannel *channel, gboolean tls)
 {
@@ -2482,9 +4352,20 @@ static gboolean channel_connect(SpiceChannel *channel, gboolean tls)
         return false;
     }
 
+    /* a reconnection in TLS is part of the same bring-up */
+    if (c->state != SPICE_CHANNEL_STATE_RECONNECTING)
+        c->connect_start = g_get_monotonic_time();
     c->state = SPICE_CHANNEL_STATE_CONNECTING;
     c->tls = tls;
 
+    /* a socket the launcher connected for us */
+    if (c->fd == -1 && !spice_session_get_client_provided_socket(c->session)) {
+        c->fd = spice_session_take_channel_fd(c->session, c->channel_type,
+                                              c->channel_id, &c->tls);
+        if (c->fd != -1)
+            CHANNEL_DEBUG(channel, "using the given fd %d%s", c->fd, c->tls ? ", TLS" : "");
+    }
+
     if (spice_session_get_client_provided_socket(c->session)) {
         if (c->fd == -1) {
             CHANNEL_DEBUG(channel, "requesting fd");
@@ -2496,13 +4377,16 @@ static gboolean channel_connect(SpiceChannel *channel, gboolean tls)
         }
     }
 
-    c->xmit_queue_blocked = FALSE;
+    /* allow queuing new messages */
+    g_atomic_pointer_compare_and_exchange(&c->xmit_pushed, XMIT_BLOCKED, NULL);
 
     g_return_val_if_fail(c->sock == NULL, FALSE);
     g_object_ref(G_OBJECT(channel)); /* Unref'd when co-routine exits */
 
     /* we connect in idle, to let previous coroutine exit, if present */
-    c->connect_delayed_id = g_idle_add(connect_delayed, channel);
+    c->connect_delayed_id =
+        g_idle_add_full(spice_channel_connect_priority(c->channel_type, c->channel_id),
+                        connect_delayed, channel, NULL);
 
     return true;
 }
@@ -2571,6 +4455,8 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
         g_source_remove(c->connect_delayed_id);
         c->connect_delayed_id = 0;
     }
+    if (!migrating)
+        c->migration_last_msg = 0;
 
 #if HAVE_SASL
     if (c->sasl_conn) {
@@ -2578,6 +4464,8 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
         c->sasl_conn = NULL;
         c->sasl_decoded_offset = c->sasl_decoded_length = 0;
     }
+    g_clear_pointer(&c->sasl_encoded, g_byte_array_unref);
+    g_clear_pointer(&c->sasl_encoded_in, g_free);
 #endif
 
     spice_openssl_verify_free(c->sslverify);
@@ -2587,11 +4475,10 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
         SSL_free(c->ssl);
         c->ssl = NULL;
     }
+    c->ktls = FALSE;
 
-    if (c->ctx) {
-        SSL_CTX_free(c->ctx);
-        c->ctx = NULL;
-    }
+    /* before the socket and read_buf go */
+    spice_channel_uring_stop(channel);
 
     if (c->conn) {
         g_object_unref(c->conn);
@@ -2608,16 +4495,34 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
     c->peer_msg = NULL;
     c->peer_pos = 0;
 
-    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-    c->xmit_queue_blocked = TRUE; /* Disallow queuing new messages */
-    gboolean was_empty = g_queue_is_empty(&c->xmit_queue);
+    g_free(c->read_buf);
+    c->read_buf = NULL;
+    c->read_buf_pos = c->read_buf_len = 0;
+    c->read_window_start = 0;
+    c->read_window_bytes = 0;
+    c->read_drained_at = 0;
+
+    if (c->capture) {
+        fclose(c->capture);
+        c->capture = NULL;
+    }
+
+    if (c->xmit_buf) {
+        g_byte_array_unref(c->xmit_buf);
+        c->xmit_buf = NULL;
+    }
+
+    g_clear_pointer(&c->compress_buf, g_byte_array_unref);
+    c->compress = c->compress_out = FALSE;
+    c->compress_skip = 0;
+
+    /* Disallow queuing new messages */
+    gpointer pushed = xmit_pushed_exchange(c, XMIT_BLOCKED);
+    gboolean was_empty = g_queue_is_empty(&c->xmit_queue) &&
+        (pushed == NULL || pushed == XMIT_BLOCKED);
+    xmit_pushed_free(pushed);
     g_queue_foreach(&c->xmit_queue, (GFunc)spice_msg_out_unref, NULL);
     g_queue_clear(&c->xmit_queue);
-    if (c->xmit_queue_wakeup_id) {
-        g_source_remove(c->xmit_queue_wakeup_id);
-        c->xmit_queue_wakeup_id = 0;
-    }
-    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
     spice_channel_flushed(channel, was_empty);
 
     g_array_set_size(c->remote_common_caps, 0);
@@ -2661,8 +4566,11 @@ void spice_channel_disconnect(SpiceChannel *channel, SpiceChannelEvent reason)
 
     c = channel->priv;
 
-    if (c->state == SPICE_CHANNEL_STATE_UNCONNECTED)
+    if (c->state == SPICE_CHANNEL_STATE_UNCONNECTED) {
+        /* the channels waiting for it see it gone */
+        g_coroutine_condition_signal(&c->waiters);
         return;
+    }
 
     if (reason == SPICE_CHANNEL_SWITCHING)
         c->state = SPICE_CHANNEL_STATE_SWITCHING;
@@ -2673,6 +4581,8 @@ void spice_channel_disconnect(SpiceChannel *channel, SpiceChannelEvent reason)
         c->state = SPICE_CHANNEL_STATE_READY;
     } else
         spice_channel_wakeup(channel, TRUE);
+    /* and the channels waiting for its messages */
+    g_coroutine_condition_signal(&c->waiters);
 
     if (reason != SPICE_CHANNEL_NONE)
         g_signal_emit(G_OBJECT(channel), signals[SPICE_CHANNEL_EVENT], 0, reason);
@@ -2807,6 +4717,10 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     g_return_if_fail(s->session != NULL);
     g_return_if_fail(s->sock != NULL);
 
+    /* the receives posted into read_buf */
+    spice_channel_uring_stop(channel);
+    spice_channel_uring_stop(swap);
+
 #define SWAP(Field) ({                          \
     typeof (c->Field) Field = c->Field;         \
     c->Field = s->Field;                        \
@@ -2819,14 +4733,17 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(conn);
     SWAP(in);
     SWAP(out);
-    SWAP(ctx);
     SWAP(ssl);
     SWAP(sslverify);
     SWAP(tls);
+    SWAP(ktls);
+    SWAP(read_buf);
+    SWAP(read_buf_pos);
+    SWAP(read_buf_len);
     SWAP(use_mini_header);
     if (swap_msgs) {
         SWAP(xmit_queue);
-        SWAP(xmit_queue_blocked);
+        SWAP(xmit_pushed);
         SWAP(in_serial);
         SWAP(out_serial);
     }
@@ -2834,26 +4751,34 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(common_caps);
     SWAP(remote_caps);
     SWAP(remote_common_caps);
+    SWAP(compress);
+    SWAP(compress_out);
+    /* the next message comes from the destination */
+    c->migration_last_msg = c->last_msg_time;
 #if HAVE_SASL
     SWAP(sasl_conn);
     SWAP(sasl_decoded);
     SWAP(sasl_decoded_length);
     SWAP(sasl_decoded_offset);
+    SWAP(sasl_maxout);
 #endif
+    spice_channel_uring_start(channel);
+    /* its coroutine may wait for a receive that was cancelled */
+    spice_channel_wakeup(channel, FALSE);
 }
 
 /* coroutine context */
 static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg)
 {
-    SpiceChannelClass *klass = SPICE_CHANNEL_GET_CLASS(channel);
-    int type = spice_msg_in_type(msg);
+    SpiceChannelClassPrivate *klass = SPICE_CHANNEL_GET_CLASS(channel)->priv;
+    guint type = spice_msg_in_type(msg);
     spice_msg_handler handler;
 
-    g_return_if_fail(type < klass->priv->handlers->len);
+    g_return_if_fail(type < klass->n_handlers);
     if (type > SPICE_MSG_BASE_LAST && channel->priv->disable_channel_msg)
         return;
 
-    handler = g_array_index(klass->priv->handlers, spice_msg_handler, type);
+    handler = klass->handlers[type];
     g_return_if_fail(handler != NULL);
     handler(channel, msg);
 }
@@ -2915,9 +4840,8 @@ void spice_channel_flush_async(SpiceChannel *self, GCancellable *cancellable,
     simple = g_simple_async_result_new(G_OBJECT(self), callback, user_data,
                                        spice_channel_flush_async);
 
-    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
+    spice_channel_xmit_take(self);
     was_empty = g_queue_is_empty(&c->xmit_queue);
-    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
     if (was_empty) {
         g_simple_async_result_set_op_res_gboolean(simple, TRUE);
         g_simple_async_result_complete_in_idle(simple);
@@ -2959,3 +4883,179 @@ gboolean spice_channel_flush_finish(SpiceChannel *self, GAsyncResult *result,
     CHANNEL_DEBUG(self, "flushed finished!");
     return g_simple_async_result_get_op_res_gboolean(simple);
 }
+
+G_DEFINE_BOXED_TYPE(SpiceChannelStats, spice_channel_stats,
+                    spice_channel_stats_copy, spice_channel_stats_free)
+
+/**
+ * spice_channel_stats_copy:
+ * @stats: a #SpiceChannelStats
+ *
+ * Returns: (transfer full): a copy of @stats, to be freed with
+ * spice_channel_stats_free()
+ * Since: 0.29
+ **/
+SpiceChannelStats *spice_channel_stats_copy(const SpiceChannelStats *stats)
+{
+    g_return_val_if_fail(stats != NULL, NULL);
+
+    return g_slice_dup(SpiceChannelStats, stats);
+}
+
+/**
+ * spice_channel_stats_free:
+ * @stats: a #SpiceChannelStats
+ *
+ * Free @stats.
+ *
+ * Since: 0.29
+ **/
+void spice_channel_stats_free(SpiceChannelStats *stats)
+{
+    g_slice_free(SpiceChannelStats, stats);
+}
+
+/* main context: the buffers of the channel, and its coroutine stack */
+G_GNUC_INTERNAL
+gsize spice_channel_get_memory_usage(SpiceChannel *channel)
+{
+    SpiceChannelClass *klass = SPICE_CHANNEL_GET_CLASS(channel);
+    SpiceChannelPrivate *c = channel->priv;
+    gsize size = 0;
+
+    if (c->state != SPICE_CHANNEL_STATE_UNCONNECTED)
+        size += c->coroutine.coroutine.stack_size;
+    if (c->read_buf)
+        size += READ_BUFFER_SIZE;
+    if (c->msg_in_pool)
+        size += msg_in_pool_get_size(c->msg_in_pool);
+    if (c->xmit_buf)
+        size += c->xmit_buf->len;
+    if (c->compress_buf)
+        size += c->compress_buf->len;
+    if (klass->priv->get_memory_usage)
+        size += klass->priv->get_memory_usage(channel);
+
+    return size;
+}
+
+/**
+ * spice_channel_get_stats:
+ * @channel: a #SpiceChannel
+ *
+ * Retrieves the current wire statistics of @channel.
+ *
+ * The round-trip time is sampled from the connection when available
+ * (currently from the TCP stack on Linux).
+ *
+ * Returns: (transfer full): a new #SpiceChannelStats, to be freed with
+ * spice_channel_stats_free()
+ * Since: 0.29
+ **/
+SpiceChannelStats *spice_channel_get_stats(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c;
+    SpiceChannelStats *stats;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+    c = channel->priv;
+
+    spice_channel_sample_rtt(channel);
+
+    stats = spice_channel_stats_copy(&c->stats);
+
+    spice_channel_xmit_take(channel);
+    stats->xmit_queue_depth = g_queue_get_length(&c->xmit_queue);
+
+    STATIC_MUTEX_LOCK(c->msg_out_pool->lock);
+    stats->msg_out_pool_hits = c->msg_out_pool->hits;
+    stats->msg_out_pool_misses = c->msg_out_pool->misses;
+    STATIC_MUTEX_UNLOCK(c->msg_out_pool->lock);
+
+    return stats;
+}
+
+/**
+ * spice_channel_reset_stats:
+ * @channel: a #SpiceChannel
+ *
+ * Reset all the counters of @channel statistics, including the
+ * per-message type counters.
+ *
+ * Since: 0.29
+ **/
+void spice_channel_reset_stats(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c;
+
+    g_return_if_fail(SPICE_IS_CHANNEL(channel));
+    c = channel->priv;
+
+    memset(&c->stats, 0, sizeof(c->stats));
+    c->total_read_bytes = 0;
+    STATIC_MUTEX_LOCK(c->msg_out_pool->lock);
+    c->msg_out_pool->hits = c->msg_out_pool->misses = 0;
+    STATIC_MUTEX_UNLOCK(c->msg_out_pool->lock);
+    memset(c->msg_stats[0]->data, 0,
+           c->msg_stats[0]->len * sizeof(SpiceMsgTypeStats));
+    g_array_set_size(c->msg_stats[1], 0);
+}
+
+/**
+ * spice_channel_get_msg_stats:
+ * @channel: a #SpiceChannel
+ * @outgoing: %TRUE for messages sent by the client, %FALSE for
+ * messages received from the server
+ * @msg_type: a message type, as defined by the protocol
+ * @count: (out) (allow-none): number of messages of @msg_type
+ * @bytes: (out) (allow-none): cumulated payload size of the messages
+ *
+ * Retrieves the statistics of a given message type.
+ *
+ * Returns: %TRUE if at least one message of @msg_type was seen
+ * Since: 0.29
+ **/
+gboolean spice_channel_get_msg_stats(SpiceChannel *channel, gboolean outgoing,
+                                     guint msg_type, guint64 *count, guint64 *bytes)
+{
+    GArray *msg_stats;
+    SpiceMsgTypeStats *stats = NULL;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), FALSE);
+
+    msg_stats = channel->priv->msg_stats[outgoing ? 1 : 0];
+    if (msg_type < msg_stats->len)
+        stats = &g_array_index(msg_stats, SpiceMsgTypeStats, msg_type);
+
+    if (count)
+        *count = stats ? stats->count : 0;
+    if (bytes)
+        *bytes = stats ? stats->bytes : 0;
+
+    return stats != NULL && stats->count > 0;
+}
+
+/**
+ * spice_channel_get_msg_handle_time:
+ * @channel: a #SpiceChannel
+ * @msg_type: a message type, as defined by the protocol
+ *
+ * Retrieves the time spent handling the received messages of a given
+ * type, demarshalling excluded. For the display channel, that is
+ * mostly the decoding and drawing of their images.
+ *
+ * Returns: the cumulated handling time, in µs
+ * Since: 0.29
+ **/
+guint64 spice_channel_get_msg_handle_time(SpiceChannel *channel, guint msg_type)
+{
+    GArray *msg_stats;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), 0);
+
+    msg_stats = channel->priv->msg_stats[0];
+    if (msg_type >= msg_stats->len)
+        return 0;
+
+    return g_array_index(msg_stats, SpiceMsgTypeStats, msg_type).handle_time_us;
+}
@@ -61,6 +61,24 @@ typedef enum
     SPICE_CHANNEL_ERROR_IO,
 } SpiceChannelEvent;
 
+/**
+ * SpiceChannelAckPolicy:
+ * @SPICE_CHANNEL_ACK_POLICY_SERVER: acknowledge every window of
+ * messages, as requested by the server
+ * @SPICE_CHANNEL_ACK_POLICY_ADAPTIVE: acknowledge messages ahead of
+ * the server window, according to the measured message rate and
+ * round-trip time, so that high-latency links are kept busy
+ *
+ * Message acknowledgement policy of a #SpiceChannel.
+ *
+ * Since: 0.29
+ **/
+typedef enum
+{
+    SPICE_CHANNEL_ACK_POLICY_SERVER,
+    SPICE_CHANNEL_ACK_POLICY_ADAPTIVE,
+} SpiceChannelAckPolicy;
+
 struct _SpiceChannel
 {
     GObject parent;
@@ -106,6 +124,80 @@ struct _SpiceChannelClass
 
 GType spice_channel_get_type(void);
 
+/**
+ * SpiceChannelStats:
+ * @bytes_in: bytes received on the channel
+ * @bytes_out: bytes sent on the channel
+ * @messages_in: messages received, including sub-messages
+ * @messages_out: messages sent
+ * @read_calls: read calls made on the socket (or TLS layer)
+ * @write_calls: write calls made on the socket (or TLS layer)
+ * @parse_time_us: cumulative time spent demarshalling messages, in µs
+ * @handle_time_us: cumulative time spent in message handlers, in µs
+ * @rtt_us: last measured round-trip time of the connection, in µs,
+ * or 0 if unknown; it is sampled when the server pings the channel
+ * @xmit_queue_depth: current number of messages waiting to be sent
+ * @xmit_queue_max_depth: highest number of messages waiting to be sent
+ * @msg_rate: recent rate of received messages, per second
+ * @acks_sent: number of SPICE_MSGC_ACK sent
+ * @ready_time_us: time from the last connection request to the end of
+ * the link handshake, in µs
+ * @migration_blackout_us: time between the last message from the source
+ * server and the first one from the destination, for the last migration,
+ * in µs
+ * @uncompressed_bytes_out: payload of the messages sent compressed,
+ * before compression
+ * @compressed_bytes_out: payload of the messages sent compressed
+ * @compress_time_us: time spent compressing, including the data that
+ * did not compress well enough to be sent compressed, in µs
+ * @uncompressed_bytes_in: payload of the messages received compressed,
+ * once decompressed
+ * @compressed_bytes_in: payload of the messages received compressed
+ * @decompress_time_us: time spent decompressing, in µs
+ * @msg_out_pool_hits: messages sent that were recycled from a previous one
+ * @msg_out_pool_misses: messages sent that had to be allocated
+ *
+ * Wire statistics of a #SpiceChannel, cumulative over the channel
+ * life-time (reconnections included), unless reset with
+ * spice_channel_reset_stats().
+ *
+ * The structure is allocated by the library, and more fields may be
+ * appended in future versions.
+ *
+ * Since: 0.29
+ */
+typedef struct _SpiceChannelStats SpiceChannelStats;
+struct _SpiceChannelStats {
+    guint64 bytes_in;
+    guint64 bytes_out;
+    guint64 messages_in;
+    guint64 messages_out;
+    guint64 read_calls;
+    guint64 write_calls;
+    guint64 parse_time_us;
+    guint64 handle_time_us;
+    guint64 rtt_us;
+    guint   xmit_queue_depth;
+    guint   xmit_queue_max_depth;
+    guint64 msg_rate;
+    guint64 acks_sent;
+    guint64 ready_time_us;
+    guint64 migration_blackout_us;
+    guint64 uncompressed_bytes_out;
+    guint64 compressed_bytes_out;
+    guint64 compress_time_us;
+    guint64 uncompressed_bytes_in;
+    guint64 compressed_bytes_in;
+    guint64 decompress_time_us;
+    guint64 msg_out_pool_hits;
+    guint64 msg_out_pool_misses;
+};
+
+#define SPICE_TYPE_CHANNEL_STATS (spice_channel_stats_get_type ())
+GType spice_channel_stats_get_type(void);
+SpiceChannelStats *spice_channel_stats_copy(const SpiceChannelStats *stats);
+void spice_channel_stats_free(SpiceChannelStats *stats);
+
 typedef void (*spice_msg_handler)(SpiceChannel *channel, SpiceMsgIn *in);
 
 SpiceChannel *spice_channel_new(SpiceSession *s, int type, int id);
@@ -128,6 +220,12 @@ gint spice_channel_string_to_type(const gchar *str);
 
 const GError* spice_channel_get_error(SpiceChannel *channel);
 
+SpiceChannelStats *spice_channel_get_stats(SpiceChannel *channel);
+void spice_channel_reset_stats(SpiceChannel *channel);
+gboolean spice_channel_get_msg_stats(SpiceChannel *channel, gboolean outgoing,
+                                     guint msg_type, guint64 *count, guint64 *bytes);
+guint64 spice_channel_get_msg_handle_time(SpiceChannel *channel, guint msg_type);
+
 G_END_DECLS
 
 #endif /* __SPICE_CLIENT_CHANNEL_H__ */
@@ -36,6 +36,18 @@
 
 #include "glib-compat.h"
 
+/*
+ * The helper stays alive for the whole session of the app invoking us, it
+ * reads one request per line on stdin:
+ *   "<busnum> <devnum>"        give the user access to the device node, and
+ *                              answer "SUCCESS", "CANCELED" or an error
+ *   "CLOSE <busnum> <devnum>"  take that access away again, no answer
+ *   "CANCEL"                   cancel the authorization being waited for
+ * Only one device node request is handled at a time. Once PolicyKit has
+ * authorized the user, the authorization is kept until we exit, and on
+ * EOF all the ACLs we set are removed.
+ */
+
 #define FATAL_ERROR(...) \
     do { \
         /* We print the error both to stdout, for the app invoking us and \
@@ -46,22 +58,24 @@
         cleanup(); \
     } while (0)
 
+/* fails the current request only */
 #define ERROR(...) \
     do { \
         fprintf(stdout, __VA_ARGS__); \
-        cleanup(); \
+        fflush(stdout); \
+        state = STATE_WAITING_FOR_REQUEST; \
     } while (0)
 
 enum state {
-    STATE_WAITING_FOR_BUS_N_DEV,
+    STATE_WAITING_FOR_REQUEST,
     STATE_WAITING_FOR_POL_KIT,
-    STATE_WAITING_FOR_STDIN_EOF,
 };
 
-static enum state state = STATE_WAITING_FOR_BUS_N_DEV;
+static enum state state = STATE_WAITING_FOR_REQUEST;
 static int exit_status;
 static int busnum, devnum;
-static char path[PATH_MAX];
+static gboolean authorized;
+static GSList *acl_paths; /* of the device nodes we gave access to */
 static GMainLoop *loop;
 static GDataInputStream *stdin_stream;
 static GCancellable *polkit_cancellable;
@@ -153,8 +167,11 @@ static void cleanup(void)
     if (polkit_cancellable)
         g_cancellable_cancel(polkit_cancellable);
 
-    if (state == STATE_WAITING_FOR_STDIN_EOF)
-        set_facl(path, getuid(), 0);
+    while (acl_paths) {
+        set_facl(acl_paths->data, getuid(), 0);
+        g_free(acl_paths->data);
+        acl_paths = g_slist_delete_link(acl_paths, acl_paths);
+    }
 
     if (loop)
         g_main_loop_quit(loop);
@@ -179,58 +196,104 @@ polkit_authorization_result_get_dismissed(PolkitAuthorizationResult *result)
 }
 #endif
 
+static void open_acl(void)
+{
+    char path[PATH_MAX];
+    struct stat stat_buf;
+
+    snprintf(path, PATH_MAX, "/dev/bus/usb/%03d/%03d", busnum, devnum);
+
+    if (stat(path, &stat_buf) != 0) {
+        ERROR("Error statting %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (!S_ISCHR(stat_buf.st_mode)) {
+        ERROR("Error %s is not a character device\n", path);
+        return;
+    }
+
+    if (set_facl(path, getuid(), 1)) {
+        ERROR("Error setting facl: %s\n", strerror(errno));
+        return;
+    }
+
+    if (!g_slist_find_custom(acl_paths, path, (GCompareFunc)strcmp))
+        acl_paths = g_slist_prepend(acl_paths, g_strdup(path));
+
+    fprintf(stdout, "SUCCESS\n");
+    fflush(stdout);
+    state = STATE_WAITING_FOR_REQUEST;
+}
+
+static void close_acl(int bus, int dev)
+{
+    char path[PATH_MAX];
+    GSList *l;
+
+    snprintf(path, PATH_MAX, "/dev/bus/usb/%03d/%03d", bus, dev);
+
+    /* only the nodes we gave access to */
+    l = g_slist_find_custom(acl_paths, path, (GCompareFunc)strcmp);
+    if (!l)
+        return;
+
+    set_facl(path, getuid(), 0);
+    g_free(l->data);
+    acl_paths = g_slist_delete_link(acl_paths, l);
+}
+
 static void check_authorization_cb(PolkitAuthority *authority,
                                    GAsyncResult *res, gpointer data)
 {
     PolkitAuthorizationResult *result;
     GError *err = NULL;
-    struct stat stat_buf;
 
     g_clear_object(&polkit_cancellable);
 
     result = polkit_authority_check_authorization_finish(authority, res, &err);
     if (err) {
-        FATAL_ERROR("PoliciKit error: %s\n", err->message);
+        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            ERROR("CANCELED\n");
+        else
+            FATAL_ERROR("PoliciKit error: %s\n", err->message);
         g_error_free(err);
         return;
     }
 
     if (polkit_authorization_result_get_dismissed(result)) {
         ERROR("CANCELED\n");
-        return;
+        goto end;
     }
 
     if (!polkit_authorization_result_get_is_authorized(result)) {
         ERROR("Not authorized\n");
-        return;
+        goto end;
     }
 
-    snprintf(path, PATH_MAX, "/dev/bus/usb/%03d/%03d", busnum, devnum);
+    authorized = TRUE;
+    open_acl();
 
-    if (stat(path, &stat_buf) != 0) {
-        FATAL_ERROR("statting %s: %s\n", path, strerror(errno));
-        return;
-    }
-    if (!S_ISCHR(stat_buf.st_mode)) {
-        FATAL_ERROR("%s is not a character device\n", path);
-        return;
-    }
+end:
+    g_object_unref(result);
+}
 
-    if (set_facl(path, getuid(), 1)) {
-        FATAL_ERROR("setting facl: %s\n", strerror(errno));
-        return;
-    }
+static gboolean parse_bus_n_dev(const char *s, int *bus, int *dev)
+{
+    char *ep;
 
-    fprintf(stdout, "SUCCESS\n");
-    fflush(stdout);
-    state = STATE_WAITING_FOR_STDIN_EOF;
+    *bus = strtol(s, &ep, 10);
+    if (ep == s || !isspace(*ep))
+        return FALSE;
+    *dev = strtol(ep, &ep, 10);
+    return *ep == '\0';
 }
 
 static void stdin_read_complete(GObject *src, GAsyncResult *res, gpointer data)
 {
-    char *s, *ep;
+    char *s;
     GError *err = NULL;
     gsize len;
+    int bus, dev;
 
     s = g_data_input_stream_read_line_finish(G_DATA_INPUT_STREAM(src), res,
                                              &len, &err);
@@ -241,38 +304,36 @@ static void stdin_read_complete(GObject *src, GAsyncResult *res, gpointer data)
             return;
         }
 
-        switch (state) {
-        case STATE_WAITING_FOR_BUS_N_DEV:
-            FATAL_ERROR("EOF while waiting for bus and device num\n");
-            break;
-        case STATE_WAITING_FOR_POL_KIT:
-            ERROR("Cancelled while waiting for authorization\n");
-            break;
-        case STATE_WAITING_FOR_STDIN_EOF:
-            cleanup();
-            break;
-        }
+        /* The app is done with us, or died */
+        cleanup();
         return;
     }
 
-    switch (state) {
-    case STATE_WAITING_FOR_BUS_N_DEV:
-        busnum = strtol(s, &ep, 10);
-        if (!isspace(*ep)) {
+    if (!strcmp(s, "CANCEL")) {
+        /* The answer to the request is given by check_authorization_cb */
+        if (state == STATE_WAITING_FOR_POL_KIT)
+            g_cancellable_cancel(polkit_cancellable);
+    } else if (g_str_has_prefix(s, "CLOSE ")) {
+        if (!parse_bus_n_dev(s + strlen("CLOSE "), &bus, &dev)) {
             FATAL_ERROR("Invalid busnum / devnum: %s\n", s);
-            break;
+            goto end;
         }
-        devnum = strtol(ep, &ep, 10);
-        if (*ep != '\0') {
+        close_acl(bus, dev);
+    } else if (state != STATE_WAITING_FOR_REQUEST) {
+        FATAL_ERROR("Unexpected extra input in state %d: %s\n", state, s);
+        goto end;
+    } else {
+        if (!parse_bus_n_dev(s, &busnum, &devnum)) {
             FATAL_ERROR("Invalid busnum / devnum: %s\n", s);
-            break;
+            goto end;
         }
 
         /*
          * The set_facl() call is a no-op for root, so no need to ask PolKit
          * and then if ok call set_facl(), when called by a root process.
+         * Neither do we ask again once the user was authorized.
          */
-        if (getuid() != 0) {
+        if (getuid() != 0 && !authorized) {
             polkit_cancellable = g_cancellable_new();
             polkit_authority_check_authorization(
                 authority, subject, "org.spice-space.lowlevelusbaccess", NULL,
@@ -281,17 +342,13 @@ static void stdin_read_complete(GObject *src, GAsyncResult *res, gpointer data)
                 (GAsyncReadyCallback)check_authorization_cb, NULL);
             state = STATE_WAITING_FOR_POL_KIT;
         } else {
-            fprintf(stdout, "SUCCESS\n");
-            fflush(stdout);
-            state = STATE_WAITING_FOR_STDIN_EOF;
+            open_acl();
         }
-
-        g_data_input_stream_read_line_async(stdin_stream, G_PRIORITY_DEFAULT,
-                                            NULL, stdin_read_complete, NULL);
-        break;
-    default:
-        FATAL_ERROR("Unexpected extra input in state %d: %s\n", state, s);
     }
+
+    g_data_input_stream_read_line_async(stdin_stream, G_PRIORITY_DEFAULT,
+                                        NULL, stdin_read_complete, NULL);
+end:
     g_free(s);
 }
 
@@ -17,15 +17,19 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_AUDIO
+
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/app/gstappsink.h>
 #include <gst/audio/streamvolume.h>
+#include <gst/audio/gstaudiobasesink.h>
 
 #include "spice-gstaudio.h"
 #include "spice-common.h"
 #include "spice-session.h"
-#include "spice-util.h"
+#include "spice-util-priv.h"
+#include "channel-playback-priv.h"
 
 #define SPICE_GSTAUDIO_GET_PRIVATE(obj)                                  \
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), SPICE_TYPE_GSTAUDIO, SpiceGstaudioPrivate))
@@ -36,6 +40,7 @@ struct stream {
     GstElement              *pipe;
     GstElement              *src;
     GstElement              *sink;
+    guint                   bus_watch;
     guint                   rate;
     guint                   channels;
 };
@@ -45,9 +50,15 @@ struct _SpiceGstaudioPrivate {
     SpiceChannel            *rchannel;
     struct stream           playback;
     struct stream           record;
-    guint                   mmtime_id;
+    guint                   min_latency; /* ms, asked by the server */
+    GstClockTime            pipe_latency;
+    gpointer                write_buf;
 };
 
+/* the ring buffer of the audio sink, whatever the server asks for */
+#define PLAYBACK_MIN_BUFFER_US  20000
+#define PLAYBACK_MIN_PERIOD_US  5000
+
 static gboolean connect_channel(SpiceAudio *audio, SpiceChannel *channel);
 static void channel_weak_notified(gpointer data, GObject *where_the_object_was);
 static void spice_gstaudio_get_playback_volume_info_async(SpiceAudio *audio,
@@ -68,6 +79,11 @@ static void spice_gstaudio_finalize(GObject *obj)
 
 void stream_dispose(struct stream *s)
 {
+    if (s->bus_watch) {
+        g_source_remove(s->bus_watch);
+        s->bus_watch = 0;
+    }
+
     if (s->pipe) {
         gst_element_set_state(s->pipe, GST_STATE_NULL);
         gst_object_unref(s->pipe);
@@ -94,9 +110,12 @@ static void spice_gstaudio_dispose(GObject *obj)
 
     stream_dispose(&p->playback);
     stream_dispose(&p->record);
+    g_clear_pointer(&p->write_buf, g_free);
 
-    if (p->pchannel)
+    if (p->pchannel) {
+        spice_playback_channel_set_sink(SPICE_PLAYBACK_CHANNEL(p->pchannel), NULL, NULL);
         g_object_weak_unref(G_OBJECT(p->pchannel), channel_weak_notified, gstaudio);
+    }
     p->pchannel = NULL;
 
     if (p->rchannel)
@@ -210,8 +229,7 @@ static void record_start(SpiceRecordChannel *channel, gint format, gint channels
         (p->record.rate != frequency ||
          p->record.channels != channels)) {
         record_stop(gstaudio);
-        gst_object_unref(p->record.pipe);
-        p->record.pipe = NULL;
+        stream_dispose(&p->record);
     }
 
     if (!p->record.pipe) {
@@ -222,7 +240,8 @@ static void record_start(SpiceRecordChannel *channel, gint format, gint channels
                             "layout=interleaved", channels, frequency);
         gchar *pipeline =
             g_strdup_printf("autoaudiosrc name=audiosrc ! queue ! audioconvert ! audioresample ! "
-                            "appsink caps=\"%s\" name=appsink", audio_caps);
+                            "appsink caps=\"%s\" name=appsink sync=0 max-buffers=16 drop=1",
+                            audio_caps);
 
         p->record.pipe = gst_parse_launch(pipeline, &error);
         if (error != NULL) {
@@ -231,7 +250,7 @@ static void record_start(SpiceRecordChannel *channel, gint format, gint channels
         }
 
         bus = gst_pipeline_get_bus(GST_PIPELINE(p->record.pipe));
-        gst_bus_add_watch(bus, record_bus_cb, data);
+        p->record.bus_watch = gst_bus_add_watch(bus, record_bus_cb, data);
         gst_object_unref(GST_OBJECT(bus));
 
         p->record.src = gst_bin_get_by_name(GST_BIN(p->record.pipe), "audiosrc");
@@ -263,15 +282,36 @@ static void playback_stop(SpiceGstaudio *gstaudio)
 
     if (p->playback.pipe)
         gst_element_set_state(p->playback.pipe, GST_STATE_READY);
-    if (p->mmtime_id != 0) {
-        g_source_remove(p->mmtime_id);
-        p->mmtime_id = 0;
-    }
 }
 
-static gboolean update_mmtime_timeout_cb(gpointer data)
+/* appsrc holds up to twice the latency asked by the server, the rest is dropped */
+static guint64 playback_max_bytes(SpiceGstaudio *gstaudio)
+{
+    SpiceGstaudioPrivate *p = gstaudio->priv;
+    guint ms = MAX(p->min_latency, 20) * 2;
+
+    return (guint64)p->playback.rate * p->playback.channels * 2 * ms / 1000;
+}
+
+/* the time spent in the pipeline by the data queued now */
+static void playback_report_delay(SpiceGstaudio *gstaudio)
+{
+    SpiceGstaudioPrivate *p = gstaudio->priv;
+    guint64 queued = 0;
+    guint delay;
+
+    if (!p->pchannel || !p->playback.src || p->pipe_latency == GST_CLOCK_TIME_NONE)
+        return;
+
+    if (p->playback.rate != 0)
+        queued = gst_app_src_get_current_level_bytes(GST_APP_SRC(p->playback.src)) * 1000 /
+            (p->playback.rate * p->playback.channels * 2);
+    delay = GST_TIME_AS_MSECONDS(p->pipe_latency) + queued;
+    spice_playback_channel_set_delay(SPICE_PLAYBACK_CHANNEL(p->pchannel), delay);
+}
+
+static void playback_update_latency(SpiceGstaudio *gstaudio)
 {
-    SpiceGstaudio *gstaudio = data;
     SpiceGstaudioPrivate *p = gstaudio->priv;
     GstQuery *q;
 
@@ -283,13 +323,58 @@ static gboolean update_mmtime_timeout_cb(gpointer data)
         SPICE_DEBUG("got min latency %" GST_TIME_FORMAT ", max latency %"
                     GST_TIME_FORMAT ", live %d", GST_TIME_ARGS (minlat),
                     GST_TIME_ARGS (maxlat), live);
-        spice_playback_channel_set_delay(SPICE_PLAYBACK_CHANNEL(p->pchannel), GST_TIME_AS_MSECONDS(minlat));
+        p->pipe_latency = minlat;
+        playback_report_delay(gstaudio);
     }
     gst_query_unref (q);
+}
+
+/* the pipeline tells when its latency changes, no need to poll it */
+static gboolean playback_bus_cb(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    SpiceGstaudio *gstaudio = data;
+    SpiceGstaudioPrivate *p = gstaudio->priv;
+
+    switch (GST_MESSAGE_TYPE(msg)) {
+    case GST_MESSAGE_LATENCY:
+        gst_bin_recalculate_latency(GST_BIN(p->playback.pipe));
+        playback_update_latency(gstaudio);
+        break;
+    case GST_MESSAGE_ASYNC_DONE:
+        playback_update_latency(gstaudio);
+        break;
+    default:
+        break;
+    }
 
     return TRUE;
 }
 
+/* the ring buffer of the sink holds what the server wants to be buffered */
+static void playback_configure_sink(SpiceGstaudio *gstaudio, GstElement *sink)
+{
+    SpiceGstaudioPrivate *p = gstaudio->priv;
+    gint64 buffer_time, latency_time;
+
+    if (!GST_IS_AUDIO_BASE_SINK(sink))
+        return;
+
+    buffer_time = MAX((gint64)p->min_latency * 1000, PLAYBACK_MIN_BUFFER_US);
+    latency_time = MAX(buffer_time / 4, PLAYBACK_MIN_PERIOD_US);
+    SPICE_DEBUG("%s: buffer-time %" G_GINT64_FORMAT " us, latency-time %" G_GINT64_FORMAT " us",
+                GST_ELEMENT_NAME(sink), buffer_time, latency_time);
+    g_object_set(sink,
+                 "buffer-time", buffer_time,
+                 "latency-time", latency_time,
+                 NULL);
+}
+
+/* autoaudiosink creates the actual sink when it goes to READY */
+static void playback_sink_added(GstBin *bin, GstElement *element, gpointer data)
+{
+    playback_configure_sink(data, element);
+}
+
 static void playback_start(SpicePlaybackChannel *channel, gint format, gint channels,
                            gint frequency, gpointer data)
 {
@@ -303,19 +388,24 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
         (p->playback.rate != frequency ||
          p->playback.channels != channels)) {
         playback_stop(gstaudio);
-        gst_object_unref(p->playback.pipe);
-        p->playback.pipe = NULL;
+        stream_dispose(&p->playback);
     }
 
     if (!p->playback.pipe) {
         GError *error = NULL;
+        GstBus *bus;
         gchar *audio_caps =
             g_strdup_printf("audio/x-raw,format=\"S16LE\",channels=%d,rate=%d,"
                             "layout=interleaved", channels, frequency);
         gchar *pipeline = g_strdup (g_getenv("SPICE_GST_AUDIOSINK"));
+        /* a late buffer is dropped, rather than late ones behind it */
         if (pipeline == NULL)
-            pipeline = g_strdup_printf("appsrc is-live=1 do-timestamp=0 caps=\"%s\" name=\"appsrc\" ! queue ! "
-                                       "audioconvert ! audioresample ! autoaudiosink name=\"audiosink\"", audio_caps);
+            pipeline = g_strdup_printf("appsrc is-live=1 do-timestamp=0 caps=\"%s\" name=\"appsrc\" ! "
+                                       "queue max-size-buffers=0 max-size-bytes=0 "
+                                       "max-size-time=%" G_GUINT64_FORMAT " leaky=downstream ! "
+                                       "audioconvert ! audioresample ! autoaudiosink name=\"audiosink\"",
+                                       audio_caps,
+                                       (guint64)MAX(p->min_latency, 20) * GST_MSECOND);
         SPICE_DEBUG("audio pipeline: %s", pipeline);
         p->playback.pipe = gst_parse_launch(pipeline, &error);
         if (error != NULL) {
@@ -326,6 +416,20 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
         p->playback.sink = gst_bin_get_by_name(GST_BIN(p->playback.pipe), "audiosink");
         p->playback.rate = frequency;
         p->playback.channels = channels;
+        p->pipe_latency = GST_CLOCK_TIME_NONE;
+
+        bus = gst_pipeline_get_bus(GST_PIPELINE(p->playback.pipe));
+        p->playback.bus_watch = gst_bus_add_watch(bus, playback_bus_cb, gstaudio);
+        gst_object_unref(GST_OBJECT(bus));
+
+        if (p->playback.src)
+            gst_app_src_set_max_bytes(GST_APP_SRC(p->playback.src),
+                                      playback_max_bytes(gstaudio));
+        if (p->playback.sink && GST_IS_BIN(p->playback.sink))
+            spice_g_signal_connect_object(p->playback.sink, "element-added",
+                                          G_CALLBACK(playback_sink_added), gstaudio, 0);
+        else if (p->playback.sink)
+            playback_configure_sink(gstaudio, p->playback.sink);
 
 cleanup:
         if (error != NULL && p->playback.pipe != NULL) {
@@ -339,26 +443,90 @@ cleanup:
 
     if (p->playback.pipe)
         gst_element_set_state(p->playback.pipe, GST_STATE_PLAYING);
+}
+
+/* the channel asks for it every 100 packets */
+static void playback_get_delay(SpicePlaybackChannel *channel, gpointer data)
+{
+    playback_report_delay(data);
+}
+
+/*
+ * The channel decodes in a buffer that the GstBuffer takes over. The raw
+ * data is copied: its message can't be released from the streaming
+ * thread.
+ */
+/* coroutine context */
+static gpointer playback_begin_write(gpointer user_data, gsize *size)
+{
+    SpiceGstaudio *gstaudio = user_data;
+    SpiceGstaudioPrivate *p = gstaudio->priv;
+
+    if (!p->playback.src)
+        return NULL;
+
+    g_free(p->write_buf);
+    p->write_buf = g_malloc(*size);
+    return p->write_buf;
+}
 
-    if (p->mmtime_id == 0) {
-        update_mmtime_timeout_cb(gstaudio);
-        p->mmtime_id = g_timeout_add_seconds(1, update_mmtime_timeout_cb, gstaudio);
+/* coroutine context */
+static void playback_cancel_write(gpointer user_data)
+{
+    SpiceGstaudio *gstaudio = user_data;
+
+    g_clear_pointer(&gstaudio->priv->write_buf, g_free);
+}
+
+/* coroutine context */
+static gboolean playback_write(gpointer user_data, gpointer audio, gsize size,
+                               GDestroyNotify free_func, gpointer free_data)
+{
+    SpiceGstaudio *gstaudio = user_data;
+    SpiceGstaudioPrivate *p = gstaudio->priv;
+    GstAppSrc *src = GST_APP_SRC(p->playback.src);
+    GstBuffer *buf;
+
+    if (src == NULL ||
+        gst_app_src_get_current_level_bytes(src) >= gst_app_src_get_max_bytes(src)) {
+        SPICE_DEBUG("%s: the pipeline is late, dropping %" G_GSIZE_FORMAT " bytes",
+                    __FUNCTION__, size);
+        if (audio == p->write_buf)
+            g_clear_pointer(&p->write_buf, g_free);
+        return FALSE;
     }
+
+    if (audio == p->write_buf) {
+        buf = gst_buffer_new_wrapped(audio, size);
+        p->write_buf = NULL;
+    } else {
+        buf = gst_buffer_new_wrapped(g_memdup(audio, size), size);
+        if (free_func != NULL)
+            free_func(free_data);
+    }
+    gst_app_src_push_buffer(src, buf);
+
+    return TRUE;
 }
 
-static void playback_data(SpicePlaybackChannel *channel,
-                          gpointer *audio, gint size,
-                          gpointer data)
+static const SpicePlaybackSink playback_sink = {
+    .begin_write = playback_begin_write,
+    .cancel_write = playback_cancel_write,
+    .write = playback_write,
+};
+
+static void playback_min_latency_changed(GObject *object, GParamSpec *pspec, gpointer data)
 {
     SpiceGstaudio *gstaudio = data;
     SpiceGstaudioPrivate *p = gstaudio->priv;
-    GstBuffer *buf;
 
-    g_return_if_fail(p != NULL);
+    g_object_get(object, "min-latency", &p->min_latency, NULL);
+    SPICE_DEBUG("%s: min latency %u ms", __FUNCTION__, p->min_latency);
 
-    audio = g_memdup(audio, size); /* TODO: try to avoid memory copy */
-    buf = gst_buffer_new_wrapped(audio, size);
-    gst_app_src_push_buffer(GST_APP_SRC(p->playback.src), buf);
+    /* the ring buffer is sized when the sink starts */
+    if (p->playback.src)
+        gst_app_src_set_max_bytes(GST_APP_SRC(p->playback.src),
+                                  playback_max_bytes(gstaudio));
 }
 
 #define VOLUME_NORMAL 65535
@@ -516,8 +684,13 @@ static gboolean connect_channel(SpiceAudio *audio, SpiceChannel *channel)
         g_object_weak_ref(G_OBJECT(p->pchannel), channel_weak_notified, audio);
         spice_g_signal_connect_object(channel, "playback-start",
                                       G_CALLBACK(playback_start), gstaudio, 0);
-        spice_g_signal_connect_object(channel, "playback-data",
-                                      G_CALLBACK(playback_data), gstaudio, 0);
+        spice_g_signal_connect_object(channel, "playback-get-delay",
+                                      G_CALLBACK(playback_get_delay), gstaudio, 0);
+        spice_g_signal_connect_object(channel, "notify::min-latency",
+                                      G_CALLBACK(playback_min_latency_changed), gstaudio, 0);
+        g_object_get(channel, "min-latency", &p->min_latency, NULL);
+        spice_playback_channel_set_sink(SPICE_PLAYBACK_CHANNEL(channel),
+                                        &playback_sink, gstaudio);
         spice_g_signal_connect_object(channel, "playback-stop",
                                       G_CALLBACK(playback_stop), gstaudio, G_CONNECT_SWAPPED);
         spice_g_signal_connect_object(channel, "notify::volume",
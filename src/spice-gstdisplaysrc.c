@@ -0,0 +1,393 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_DISPLAY
+
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/base/gstpushsrc.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-util-priv.h"
+
+/*
+ * The "spicedisplaysrc" element: the primary surface of a display
+ * channel, as raw video. The frames are taken from the main loop, where
+ * the surface does not change, and only their damaged rectangles are
+ * copied into the last buffer, unless it is still used downstream.
+ *
+ * The "channel" property and the state changes are set from the main
+ * context, like the rest of the library.
+ */
+
+#define SPICE_TYPE_GST_DISPLAY_SRC      (spice_gst_display_src_get_type())
+#define SPICE_GST_DISPLAY_SRC(obj)      (G_TYPE_CHECK_INSTANCE_CAST((obj), SPICE_TYPE_GST_DISPLAY_SRC, SpiceGstDisplaySrc))
+
+typedef struct _SpiceGstDisplaySrc SpiceGstDisplaySrc;
+typedef struct _SpiceGstDisplaySrcClass SpiceGstDisplaySrcClass;
+
+struct _SpiceGstDisplaySrc {
+    GstPushSrc                  parent;
+
+    SpiceChannel                *channel;
+    SpiceDisplayExport          *display_export;
+
+    /* the streaming thread waits for the main context */
+    GMutex                      lock;
+    GCond                       cond;
+    GstBuffer                   *buffer; /* the whole surface, updated in place */
+    GstCaps                     *caps; /* of the buffer, not set yet */
+    gint                        width, height, stride, bpp;
+    enum SpiceSurfaceFmt        format;
+    gboolean                    ready; /* changed since the last buffer pushed */
+    gboolean                    flushing;
+};
+
+struct _SpiceGstDisplaySrcClass {
+    GstPushSrcClass             parent_class;
+};
+
+enum {
+    PROP_0,
+    PROP_CHANNEL,
+};
+
+static GType spice_gst_display_src_get_type(void);
+
+G_DEFINE_TYPE(SpiceGstDisplaySrc, spice_gst_display_src, GST_TYPE_PUSH_SRC)
+
+static GstStaticPadTemplate src_template =
+    GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+                            GST_STATIC_CAPS("video/x-raw, "
+                                            "format = (string) { BGRx, BGRA, RGB16, RGB15 }, "
+                                            "width = (int) [ 1, MAX ], "
+                                            "height = (int) [ 1, MAX ], "
+                                            "framerate = (fraction) 0/1"));
+
+static const gchar *video_format(enum SpiceSurfaceFmt format, gint *bpp)
+{
+    switch (format) {
+    case SPICE_SURFACE_FMT_32_xRGB:
+        *bpp = 4;
+        return G_BYTE_ORDER == G_LITTLE_ENDIAN ? "BGRx" : "xRGB";
+    case SPICE_SURFACE_FMT_32_ARGB:
+        *bpp = 4;
+        return G_BYTE_ORDER == G_LITTLE_ENDIAN ? "BGRA" : "ARGB";
+    case SPICE_SURFACE_FMT_16_565:
+        *bpp = 2;
+        return "RGB16";
+    case SPICE_SURFACE_FMT_16_555:
+        *bpp = 2;
+        return "RGB15";
+    default:
+        return NULL;
+    }
+}
+
+/* buffer locked */
+static gboolean display_src_resize(SpiceGstDisplaySrc *src, enum SpiceSurfaceFmt format,
+                                   gint width, gint height)
+{
+    const gchar *name;
+    gint bpp;
+
+    name = video_format(format, &bpp);
+    if (name == NULL) {
+        g_warning("unsupported surface format %d", format);
+        return FALSE;
+    }
+
+    src->format = format;
+    src->width = width;
+    src->height = height;
+    src->bpp = bpp;
+    src->stride = GST_ROUND_UP_4(width * bpp);
+
+    g_clear_pointer(&src->buffer, gst_buffer_unref);
+    src->buffer = gst_buffer_new_allocate(NULL, (gsize)src->stride * height, NULL);
+
+    if (src->caps != NULL)
+        gst_caps_unref(src->caps);
+    src->caps = gst_caps_new_simple("video/x-raw",
+                                    "format", G_TYPE_STRING, name,
+                                    "width", G_TYPE_INT, width,
+                                    "height", G_TYPE_INT, height,
+                                    "framerate", GST_TYPE_FRACTION, 0, 1,
+                                    NULL);
+    return TRUE;
+}
+
+/* main context */
+static void display_src_ready(SpiceDisplayExport *display_export, gpointer user_data)
+{
+    SpiceGstDisplaySrc *src = user_data;
+    SpiceDisplayFrame *frame;
+    const SpiceDisplayRect *damage;
+    const guint8 *data;
+    enum SpiceSurfaceFmt format;
+    GstMapInfo map;
+    gint width, height, stride;
+    guint i, n;
+
+    frame = spice_display_export_get_frame(display_export);
+    if (frame == NULL)
+        return;
+
+    data = spice_display_frame_get_data(frame, &stride);
+    format = spice_display_frame_get_format(frame, &width, &height);
+    damage = spice_display_frame_get_damage(frame, &n);
+    if (data == NULL || n == 0)
+        goto end;
+
+    g_mutex_lock(&src->lock);
+    if (src->buffer == NULL || format != src->format ||
+        width != src->width || height != src->height) {
+        static const SpiceDisplayRect all = { 0, 0, G_MAXINT, G_MAXINT };
+
+        if (!display_src_resize(src, format, width, height))
+            goto unlock;
+        damage = &all;
+        n = 1;
+    }
+
+    /* the memory is copied first if the buffer is still used downstream */
+    src->buffer = gst_buffer_make_writable(src->buffer);
+    if (!gst_buffer_map(src->buffer, &map, GST_MAP_WRITE))
+        goto unlock;
+
+    for (i = 0; i < n; i++) {
+        gint x = damage[i].x, y = damage[i].y;
+        gint w = MIN(damage[i].width, width - x) * src->bpp;
+        gint h = MIN(damage[i].height, height - y);
+        const guint8 *from = data + (gsize)y * stride + x * src->bpp;
+        guint8 *to = map.data + (gsize)y * src->stride + x * src->bpp;
+
+        for (; h > 0; h--) {
+            memcpy(to, from, w);
+            from += stride;
+            to += src->stride;
+        }
+    }
+    gst_buffer_unmap(src->buffer, &map);
+
+    src->ready = TRUE;
+    g_cond_signal(&src->cond);
+
+unlock:
+    g_mutex_unlock(&src->lock);
+end:
+    spice_display_frame_unref(frame);
+}
+
+/* streaming thread */
+static GstFlowReturn display_src_create(GstPushSrc *push, GstBuffer **buf)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(push);
+    GstCaps *caps;
+
+    g_mutex_lock(&src->lock);
+    while (!src->ready && !src->flushing)
+        g_cond_wait(&src->cond, &src->lock);
+
+    if (src->flushing) {
+        g_mutex_unlock(&src->lock);
+        return GST_FLOW_FLUSHING;
+    }
+
+    caps = src->caps;
+    src->caps = NULL;
+    /* not writable anymore, until downstream is done with it */
+    *buf = gst_buffer_ref(src->buffer);
+    src->ready = FALSE;
+    g_mutex_unlock(&src->lock);
+
+    if (caps != NULL) {
+        gboolean ok = gst_base_src_set_caps(GST_BASE_SRC(push), caps);
+
+        gst_caps_unref(caps);
+        if (!ok) {
+            gst_buffer_unref(*buf);
+            *buf = NULL;
+            return GST_FLOW_NOT_NEGOTIATED;
+        }
+    }
+
+    return GST_FLOW_OK;
+}
+
+static gboolean display_src_start(GstBaseSrc *base)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(base);
+
+    if (src->channel == NULL) {
+        GST_ELEMENT_ERROR(src, RESOURCE, NOT_FOUND, ("no display channel set"), (NULL));
+        return FALSE;
+    }
+
+    src->flushing = FALSE;
+    src->display_export = spice_display_export_new(src->channel, display_src_ready, src, NULL);
+    /* the first frame, if there is a primary already */
+    display_src_ready(src->display_export, src);
+
+    return TRUE;
+}
+
+static gboolean display_src_stop(GstBaseSrc *base)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(base);
+
+    g_clear_pointer(&src->display_export, spice_display_export_free);
+
+    g_mutex_lock(&src->lock);
+    g_clear_pointer(&src->buffer, gst_buffer_unref);
+    g_clear_pointer(&src->caps, gst_caps_unref);
+    src->ready = FALSE;
+    g_mutex_unlock(&src->lock);
+
+    return TRUE;
+}
+
+static gboolean display_src_unlock(GstBaseSrc *base)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(base);
+
+    g_mutex_lock(&src->lock);
+    src->flushing = TRUE;
+    g_cond_signal(&src->cond);
+    g_mutex_unlock(&src->lock);
+
+    return TRUE;
+}
+
+static gboolean display_src_unlock_stop(GstBaseSrc *base)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(base);
+
+    g_mutex_lock(&src->lock);
+    src->flushing = FALSE;
+    g_mutex_unlock(&src->lock);
+
+    return TRUE;
+}
+
+static void spice_gst_display_src_set_property(GObject *object, guint prop_id,
+                                               const GValue *value, GParamSpec *pspec)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(object);
+
+    switch (prop_id) {
+    case PROP_CHANNEL:
+        g_clear_object(&src->channel);
+        src->channel = g_value_dup_object(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        break;
+    }
+}
+
+static void spice_gst_display_src_get_property(GObject *object, guint prop_id,
+                                               GValue *value, GParamSpec *pspec)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(object);
+
+    switch (prop_id) {
+    case PROP_CHANNEL:
+        g_value_set_object(value, src->channel);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        break;
+    }
+}
+
+static void spice_gst_display_src_finalize(GObject *object)
+{
+    SpiceGstDisplaySrc *src = SPICE_GST_DISPLAY_SRC(object);
+
+    g_clear_object(&src->channel);
+    g_mutex_clear(&src->lock);
+    g_cond_clear(&src->cond);
+
+    G_OBJECT_CLASS(spice_gst_display_src_parent_class)->finalize(object);
+}
+
+static void spice_gst_display_src_init(SpiceGstDisplaySrc *src)
+{
+    g_mutex_init(&src->lock);
+    g_cond_init(&src->cond);
+
+    gst_base_src_set_live(GST_BASE_SRC(src), TRUE);
+    gst_base_src_set_format(GST_BASE_SRC(src), GST_FORMAT_TIME);
+    gst_base_src_set_do_timestamp(GST_BASE_SRC(src), TRUE);
+}
+
+static void spice_gst_display_src_class_init(SpiceGstDisplaySrcClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+    GstBaseSrcClass *base_class = GST_BASE_SRC_CLASS(klass);
+    GstPushSrcClass *push_class = GST_PUSH_SRC_CLASS(klass);
+
+    gobject_class->set_property = spice_gst_display_src_set_property;
+    gobject_class->get_property = spice_gst_display_src_get_property;
+    gobject_class->finalize = spice_gst_display_src_finalize;
+
+    base_class->start = display_src_start;
+    base_class->stop = display_src_stop;
+    base_class->unlock = display_src_unlock;
+    base_class->unlock_stop = display_src_unlock_stop;
+    push_class->create = display_src_create;
+
+    g_object_class_install_property
+        (gobject_class, PROP_CHANNEL,
+         g_param_spec_object("channel",
+                             "Display channel",
+                             "The SpiceDisplayChannel to read",
+                             SPICE_TYPE_DISPLAY_CHANNEL,
+                             G_PARAM_READWRITE |
+                             G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_add_pad_template(element_class,
+                                       gst_static_pad_template_get(&src_template));
+    gst_element_class_set_static_metadata(element_class,
+                                          "SPICE display source", "Source/Video",
+                                          "The primary surface of a SPICE display channel",
+                                          "The spice-gtk authors");
+}
+
+/**
+ * spice_display_gst_src_register:
+ *
+ * Registers the "spicedisplaysrc" GStreamer element, the primary
+ * surface of the display channel set in its "channel" property, as raw
+ * video with a frame each time it changes. GStreamer must be
+ * initialized first.
+ *
+ * Returns: %TRUE if the element is available, %FALSE when the library
+ * was built without GStreamer or the registration failed
+ *
+ * Since: 0.29
+ */
+gboolean spice_display_gst_src_register(void)
+{
+    return gst_element_register(NULL, "spicedisplaysrc", GST_RANK_NONE,
+                                SPICE_TYPE_GST_DISPLAY_SRC);
+}
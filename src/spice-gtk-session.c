@@ -47,6 +47,8 @@
 #include "spice-channel-priv.h"
 
 #define CLIPBOARD_LAST (VD_AGENT_CLIPBOARD_SELECTION_SECONDARY + 1)
+/* owner changes closer than that are handled as one */
+#define CLIPBOARD_OWNER_CHANGE_DELAY_MS 100
 
 struct _SpiceGtkSessionPrivate {
     SpiceSession            *session;
@@ -60,9 +62,22 @@ struct _SpiceGtkSessionPrivate {
     gboolean                clip_hasdata[CLIPBOARD_LAST];
     gboolean                clip_grabbed[CLIPBOARD_LAST];
     gboolean                clipboard_by_guest[CLIPBOARD_LAST];
+    /* the types of our last grab, to not repeat it */
+    guint32                 clip_grab_types[CLIPBOARD_LAST][VD_AGENT_CLIPBOARD_IMAGE_JPG + 1];
+    guint                   nclip_grab_types[CLIPBOARD_LAST];
+    gboolean                clip_requested[CLIPBOARD_LAST];
+    guint                   clip_owner_change_id;
+    guint                   clip_owner_change_pending; /* mask of selections */
+    guint                   clip_grabs;
+    guint                   clip_grabs_suppressed;
+    /* the last data the guest gave us, for the next requests of the type */
+    guchar                  *clip_cache_data[CLIPBOARD_LAST];
+    guint                   clip_cache_size[CLIPBOARD_LAST];
+    guint32                 clip_cache_type[CLIPBOARD_LAST];
     /* auto-usbredir related */
     gboolean                auto_usbredir_enable;
     int                     auto_usbredir_reqs;
+    gboolean                usbredir_seen; /* until then, no usb manager */
     gboolean                pointer_grabbed;
 };
 
@@ -101,6 +116,7 @@ static void channel_new(SpiceSession *session, SpiceChannel *channel,
 static void channel_destroy(SpiceSession *session, SpiceChannel *channel,
                             gpointer user_data);
 static gboolean read_only(SpiceGtkSession *self);
+static void clipboard_cache_clear(SpiceGtkSession *self, guint selection);
 
 /* ------------------------------------------------------------------ */
 /* gobject glue                                                       */
@@ -267,6 +283,14 @@ static void spice_gtk_session_dispose(GObject *gobject)
     SpiceGtkSessionPrivate *s = self->priv;
 
     /* release stuff */
+    if (s->clip_owner_change_id) {
+        g_source_remove(s->clip_owner_change_id);
+        s->clip_owner_change_id = 0;
+    }
+    if (s->clip_grabs)
+        SPICE_DEBUG("clipboard: %u grabs sent, %u suppressed",
+                    s->clip_grabs, s->clip_grabs_suppressed);
+
     if (s->clipboard) {
         g_signal_handlers_disconnect_by_func(s->clipboard,
                 G_CALLBACK(clipboard_owner_change), self);
@@ -304,6 +328,7 @@ static void spice_gtk_session_finalize(GObject *gobject)
     for (i = 0; i < CLIPBOARD_LAST; ++i) {
         g_free(s->clip_targets[i]);
         s->clip_targets[i] = NULL;
+        clipboard_cache_clear(self, i);
     }
 
     /* Chain up to the parent class */
@@ -338,6 +363,29 @@ static void spice_gtk_session_get_property(GObject    *gobject,
     }
 }
 
+/* the usb device manager is only created once there is a usbredir channel */
+static void auto_usbredir_set(SpiceGtkSession *self, gboolean state)
+{
+    SpiceGtkSessionPrivate *s = self->priv;
+    SpiceDesktopIntegration *desktop_int;
+    SpiceUsbDeviceManager *manager;
+
+    if (!s->usbredir_seen)
+        return;
+
+    manager = spice_usb_device_manager_get(s->session, NULL);
+    if (!manager)
+        return;
+
+    g_object_set(manager, "auto-connect", state, NULL);
+
+    desktop_int = spice_desktop_integration_get(s->session);
+    if (state)
+        spice_desktop_integration_inhibit_automount(desktop_int);
+    else
+        spice_desktop_integration_uninhibit_automount(desktop_int);
+}
+
 static void spice_gtk_session_set_property(GObject      *gobject,
                                            guint         prop_id,
                                            const GValue *value,
@@ -354,29 +402,14 @@ static void spice_gtk_session_set_property(GObject      *gobject,
         s->auto_clipboard_enable = g_value_get_boolean(value);
         break;
     case PROP_AUTO_USBREDIR: {
-        SpiceDesktopIntegration *desktop_int;
         gboolean orig_value = s->auto_usbredir_enable;
 
         s->auto_usbredir_enable = g_value_get_boolean(value);
         if (s->auto_usbredir_enable == orig_value)
             break;
 
-        if (s->auto_usbredir_reqs) {
-            SpiceUsbDeviceManager *manager =
-                spice_usb_device_manager_get(s->session, NULL);
-
-            if (!manager)
-                break;
-
-            g_object_set(manager, "auto-connect", s->auto_usbredir_enable,
-                         NULL);
-
-            desktop_int = spice_desktop_integration_get(s->session);
-            if (s->auto_usbredir_enable)
-                spice_desktop_integration_inhibit_automount(desktop_int);
-            else
-                spice_desktop_integration_uninhibit_automount(desktop_int);
-        }
+        if (s->auto_usbredir_reqs)
+            auto_usbredir_set(self, s->auto_usbredir_enable);
         break;
     }
     default:
@@ -569,6 +602,19 @@ static void weak_unref(WeakRef* weakref)
     g_free(weakref);
 }
 
+static void clipboard_release_grab(SpiceGtkSession *self, guint selection)
+{
+    SpiceGtkSessionPrivate *s = self->priv;
+
+    if (!s->clip_grabbed[selection])
+        return;
+
+    s->clip_grabbed[selection] = FALSE;
+    s->nclip_grab_types[selection] = 0;
+    if (spice_main_agent_test_capability(s->main, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
+        spice_main_clipboard_selection_release(s->main, selection);
+}
+
 static void clipboard_get_targets(GtkClipboard *clipboard,
                                   GdkAtom *atoms,
                                   gint n_atoms,
@@ -632,8 +678,26 @@ static void clipboard_get_targets(GtkClipboard *clipboard,
             break;
         }
     }
-    if (!s->clip_grabbed[selection] && t > 0) {
+
+    /* The same types as our grab, and the guest never asked for the
+     * data, it has nothing to forget: the grab is still good */
+    if (s->clip_grabbed[selection] && !s->clip_requested[selection] &&
+        s->nclip_grab_types[selection] == t &&
+        memcmp(s->clip_grab_types[selection], types, t * sizeof(guint32)) == 0) {
+        s->clip_grabs_suppressed++;
+        SPICE_DEBUG("clipboard: same targets, grab suppressed (%u/%u)",
+                    s->clip_grabs_suppressed,
+                    s->clip_grabs + s->clip_grabs_suppressed);
+        return;
+    }
+
+    clipboard_release_grab(self, selection);
+    if (t > 0) {
         s->clip_grabbed[selection] = TRUE;
+        s->clip_requested[selection] = FALSE;
+        s->nclip_grab_types[selection] = t;
+        memcpy(s->clip_grab_types[selection], types, t * sizeof(guint32));
+        s->clip_grabs++;
 
         if (spice_main_agent_test_capability(s->main, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
             spice_main_clipboard_selection_grab(s->main, selection, types, t);
@@ -642,6 +706,36 @@ static void clipboard_get_targets(GtkClipboard *clipboard,
     }
 }
 
+static gboolean clipboard_owner_change_delayed(gpointer user_data)
+{
+    SpiceGtkSession *self = user_data;
+    SpiceGtkSessionPrivate *s = self->priv;
+    GtkClipboard *cb;
+    guint selection;
+
+    s->clip_owner_change_id = 0;
+
+    for (selection = 0; selection < CLIPBOARD_LAST; selection++) {
+        if (!(s->clip_owner_change_pending & (1 << selection)))
+            continue;
+
+        cb = get_clipboard_from_selection(s, selection);
+        /* the guest may have grabbed it meanwhile */
+        if (s->main == NULL || cb == NULL ||
+            gtk_clipboard_get_owner(cb) == G_OBJECT(self))
+            continue;
+
+        if (s->auto_clipboard_enable && !read_only(self))
+            gtk_clipboard_request_targets(cb, clipboard_get_targets,
+                                          weak_ref(G_OBJECT(self)));
+        else
+            clipboard_release_grab(self, selection);
+    }
+    s->clip_owner_change_pending = 0;
+
+    return FALSE;
+}
+
 static void clipboard_owner_change(GtkClipboard        *clipboard,
                                    GdkEventOwnerChange *event,
                                    gpointer            user_data)
@@ -658,24 +752,26 @@ static void clipboard_owner_change(GtkClipboard        *clipboard,
     if (s->main == NULL)
         return;
 
-    if (s->clip_grabbed[selection]) {
-        s->clip_grabbed[selection] = FALSE;
-        if (spice_main_agent_test_capability(s->main, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
-            spice_main_clipboard_selection_release(s->main, selection);
-    }
-
     switch (event->reason) {
     case GDK_OWNER_CHANGE_NEW_OWNER:
-        if (gtk_clipboard_get_owner(clipboard) == G_OBJECT(self))
+        if (gtk_clipboard_get_owner(clipboard) == G_OBJECT(self)) {
+            clipboard_release_grab(self, selection);
             break;
+        }
 
         s->clipboard_by_guest[selection] = FALSE;
+        clipboard_cache_clear(self, selection);
         s->clip_hasdata[selection] = TRUE;
-        if (s->auto_clipboard_enable && !read_only(self))
-            gtk_clipboard_request_targets(clipboard, clipboard_get_targets,
-                                          weak_ref(G_OBJECT(self)));
+        /* the grab is kept until the new targets are known, a burst of
+         * owner changes ends up in one request and at most one grab */
+        s->clip_owner_change_pending |= 1 << selection;
+        if (s->clip_owner_change_id == 0)
+            s->clip_owner_change_id =
+                g_timeout_add(CLIPBOARD_OWNER_CHANGE_DELAY_MS,
+                              clipboard_owner_change_delayed, self);
         break;
     default:
+        clipboard_release_grab(self, selection);
         s->clip_hasdata[selection] = FALSE;
         break;
     }
@@ -690,19 +786,25 @@ typedef struct
     guint selection;
 } RunInfo;
 
-static void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
-                                     guint type, const guchar *data, guint size,
-                                     gpointer user_data)
+static void clipboard_cache_clear(SpiceGtkSession *self, guint selection)
 {
-    RunInfo *ri = user_data;
-    SpiceGtkSessionPrivate *s = ri->self->priv;
-    gchar *conv = NULL;
+    SpiceGtkSessionPrivate *s = self->priv;
 
-    g_return_if_fail(selection == ri->selection);
+    g_free(s->clip_cache_data[selection]);
+    s->clip_cache_data[selection] = NULL;
+    s->clip_cache_size[selection] = 0;
+    s->clip_cache_type[selection] = VD_AGENT_CLIPBOARD_NONE;
+}
 
-    SPICE_DEBUG("clipboard got data");
+static void clipboard_set_selection_data(SpiceGtkSession *self,
+                                         GtkSelectionData *selection_data,
+                                         guint info,
+                                         const guchar *data, guint size)
+{
+    SpiceGtkSessionPrivate *s = self->priv;
+    gchar *conv = NULL;
 
-    if (atom2agent[ri->info].vdagent == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
+    if (atom2agent[info].vdagent == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
         /* on windows, gtk+ would already convert to LF endings, but
            not on unix */
         if (spice_main_agent_test_capability(s->main, VD_AGENT_CAP_GUEST_LINEEND_CRLF)) {
@@ -712,24 +814,46 @@ static void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
             if (err) {
                 g_warning("Failed to convert text line ending: %s", err->message);
                 g_clear_error(&err);
-                goto end;
+                return;
             }
 
             size = strlen(conv);
         }
 
-        gtk_selection_data_set_text(ri->selection_data, conv ?: (gchar*)data, size);
+        gtk_selection_data_set_text(selection_data, conv ?: (gchar*)data, size);
     } else {
-        gtk_selection_data_set(ri->selection_data,
-            gdk_atom_intern_static_string(atom2agent[ri->info].xatom),
+        gtk_selection_data_set(selection_data,
+            gdk_atom_intern_static_string(atom2agent[info].xatom),
             8, data, size);
     }
 
-end:
+    g_free(conv);
+}
+
+static void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
+                                     guint type, const guchar *data, guint size,
+                                     gpointer user_data)
+{
+    RunInfo *ri = user_data;
+    SpiceGtkSessionPrivate *s = ri->self->priv;
+
+    g_return_if_fail(selection == ri->selection);
+
+    SPICE_DEBUG("clipboard got data");
+
+    /* applications ask again for each target of a type, and at each
+     * paste: keep it until the guest grabs again */
+    if (type == atom2agent[ri->info].vdagent && s->clipboard_by_guest[selection]) {
+        clipboard_cache_clear(ri->self, selection);
+        s->clip_cache_data[selection] = g_memdup(data, size);
+        s->clip_cache_size[selection] = size;
+        s->clip_cache_type[selection] = type;
+    }
+
+    clipboard_set_selection_data(ri->self, ri->selection_data, ri->info, data, size);
+
     if (g_main_loop_is_running (ri->loop))
         g_main_loop_quit (ri->loop);
-
-    g_free(conv);
 }
 
 static void clipboard_agent_connected(RunInfo *ri)
@@ -761,6 +885,15 @@ static void clipboard_get(GtkClipboard *clipboard,
     g_return_if_fail(info < SPICE_N_ELEMENTS(atom2agent));
     g_return_if_fail(s->main != NULL);
 
+    if (s->clip_cache_data[selection] != NULL &&
+        s->clip_cache_type[selection] == atom2agent[info].vdagent) {
+        SPICE_DEBUG("clipboard get, from cache");
+        clipboard_set_selection_data(self, selection_data, info,
+                                     s->clip_cache_data[selection],
+                                     s->clip_cache_size[selection]);
+        return;
+    }
+
     ri.selection_data = selection_data;
     ri.info = info;
     ri.loop = g_main_loop_new(NULL, FALSE);
@@ -845,6 +978,8 @@ static gboolean clipboard_grab(SpiceMainChannel *main, guint selection,
     s->clip_targets[selection] = g_memdup(targets, sizeof(GtkTargetEntry) * i);
     /* Receiving a grab implies we've released our own grab */
     s->clip_grabbed[selection] = FALSE;
+    s->nclip_grab_types[selection] = 0;
+    clipboard_cache_clear(self, selection);
 
     if (read_only(self) ||
         !s->auto_clipboard_enable ||
@@ -957,9 +1092,12 @@ static void clipboard_received_cb(GtkClipboard *clipboard,
         }
     }
 
-    spice_main_clipboard_selection_notify(s->main, selection, type,
-                                          conv ?: data, len);
-    g_free(conv);
+    /* the converted text is sent as is, the data of gtk+ has to be copied */
+    if (conv != NULL)
+        spice_main_clipboard_selection_notify_full(s->main, selection, type,
+                                                   conv, len, g_free);
+    else
+        spice_main_clipboard_selection_notify(s->main, selection, type, data, len);
 }
 
 static gboolean clipboard_request(SpiceMainChannel *main, guint selection,
@@ -989,6 +1127,8 @@ static gboolean clipboard_request(SpiceMainChannel *main, guint selection,
 
     g_return_val_if_fail(m < SPICE_N_ELEMENTS(atom2agent), FALSE);
 
+    /* the guest may keep the data until the next grab */
+    s->clip_requested[selection] = TRUE;
     atom = gdk_atom_intern_static_string(atom2agent[m].xatom);
     gtk_clipboard_request_contents(cb, atom, clipboard_received_cb,
                                    weak_ref(G_OBJECT(self)));
@@ -1009,6 +1149,7 @@ static void clipboard_release(SpiceMainChannel *main, guint selection,
         return;
 
     s->nclip_targets[selection] = 0;
+    clipboard_cache_clear(self, selection);
 
     if (!s->clipboard_by_guest[selection])
         return;
@@ -1039,6 +1180,11 @@ static void channel_new(SpiceSession *session, SpiceChannel *channel,
                                       G_CALLBACK(guest_modifiers_changed), self, 0);
         spice_gtk_session_sync_keyboard_modifiers_for_channel(self, SPICE_INPUTS_CHANNEL(channel), TRUE);
     }
+    if (SPICE_IS_USBREDIR_CHANNEL(channel) && !s->usbredir_seen) {
+        s->usbredir_seen = TRUE;
+        if (s->auto_usbredir_enable && s->auto_usbredir_reqs)
+            auto_usbredir_set(self, TRUE);
+    }
 }
 
 static void channel_destroy(SpiceSession *session, SpiceChannel *channel,
@@ -1060,7 +1206,9 @@ static void channel_destroy(SpiceSession *session, SpiceChannel *channel,
                 s->clipboard_by_guest[i] = FALSE;
             }
             s->clip_grabbed[i] = FALSE;
+            s->nclip_grab_types[i] = 0;
             s->nclip_targets[i] = 0;
+            clipboard_cache_clear(self, i);
         }
     }
 }
@@ -1079,8 +1227,6 @@ void spice_gtk_session_request_auto_usbredir(SpiceGtkSession *self,
     g_return_if_fail(SPICE_IS_GTK_SESSION(self));
 
     SpiceGtkSessionPrivate *s = self->priv;
-    SpiceDesktopIntegration *desktop_int;
-    SpiceUsbDeviceManager *manager;
 
     if (state) {
         s->auto_usbredir_reqs++;
@@ -1096,17 +1242,7 @@ void spice_gtk_session_request_auto_usbredir(SpiceGtkSession *self,
     if (!s->auto_usbredir_enable)
         return;
 
-    manager = spice_usb_device_manager_get(s->session, NULL);
-    if (!manager)
-        return;
-
-    g_object_set(manager, "auto-connect", state, NULL);
-
-    desktop_int = spice_desktop_integration_get(s->session);
-    if (state)
-        spice_desktop_integration_inhibit_automount(desktop_int);
-    else
-        spice_desktop_integration_uninhibit_automount(desktop_int);
+    auto_usbredir_set(self, state);
 }
 
 /* ------------------------------------------------------------------ */
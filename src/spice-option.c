@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <glib-object.h>
 #include <glib/gi18n.h>
 #include "glib-compat.h"
@@ -39,8 +40,19 @@ static gboolean disable_audio = FALSE;
 static gboolean disable_usbredir = FALSE;
 static gint cache_size = 0;
 static gint glz_window_size = 0;
+static gint reconnect_grace = 0;
+static gint keepalive_timeout = 0;
 static gchar *secure_channels = NULL;
+static gchar *compress_channels = NULL;
 static gchar *shared_dir = NULL;
+static GSList *channel_fds = NULL;
+
+typedef struct OptionChannelFd {
+    gint type;
+    gint id;
+    gint fd;
+    gboolean tls;
+} OptionChannelFd;
 
 G_GNUC_NORETURN
 static void option_version(void)
@@ -92,13 +104,14 @@ static gboolean parse_disable_effects(const gchar *option_name, const gchar *val
         if ((g_strcmp0(*it, "wallpaper") != 0)
              && (g_strcmp0(*it, "font-smooth") != 0)
              && (g_strcmp0(*it, "animation") != 0)
-             && (g_strcmp0(*it, "all") != 0)) {
+             && (g_strcmp0(*it, "all") != 0)
+             && (g_strcmp0(*it, "auto") != 0)) {
             /* Translators: do not translate 'wallpaper', 'font-smooth',
-             * 'animation', 'all' as the user must use these values with the
+             * 'animation', 'all', 'auto' as the user must use these values with the
              * --spice-disable-effects command line option
              */
             g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
-                    _("invalid effect name (%s), must be 'wallpaper', 'font-smooth', 'animation' or 'all'"), *it);
+                    _("invalid effect name (%s), must be 'wallpaper', 'font-smooth', 'animation', 'all' or 'auto'"), *it);
             g_strfreev(disable_effects);
             disable_effects = NULL;
             return FALSE;
@@ -108,8 +121,7 @@ static gboolean parse_disable_effects(const gchar *option_name, const gchar *val
     return TRUE;
 }
 
-static gboolean parse_secure_channels(const gchar *option_name, const gchar *value,
-                                      gpointer data, GError **error)
+static gboolean check_channel_names(const gchar *value, GError **error)
 {
     gint i;
     gchar **channels = g_strsplit(value, ",", -1);
@@ -126,17 +138,96 @@ static gboolean parse_secure_channels(const gchar *option_name, const gchar *val
                         _("invalid channel name (%s), valid names: all, %s"),
                         channels[i], supported);
             g_free(supported);
+            g_strfreev(channels);
             return FALSE;
         }
     }
 
     g_strfreev(channels);
 
+    return TRUE;
+}
+
+static gboolean parse_secure_channels(const gchar *option_name, const gchar *value,
+                                      gpointer data, GError **error)
+{
+    if (!check_channel_names(value, error))
+        return FALSE;
+
     secure_channels = g_strdup(value);
 
     return TRUE;
 }
 
+static gboolean parse_compress_channels(const gchar *option_name, const gchar *value,
+                                        gpointer data, GError **error)
+{
+    if (!check_channel_names(value, error))
+        return FALSE;
+
+    compress_channels = g_strdup(value);
+
+    return TRUE;
+}
+
+/* <channel[:id]=fd[:tls]>,... */
+static gboolean parse_channel_fds(const gchar *option_name, const gchar *value,
+                                  gpointer data, GError **error)
+{
+    gint i;
+    gchar **items = g_strsplit(value, ",", -1);
+    GSList *fds = NULL;
+
+    g_return_val_if_fail(items != NULL, FALSE);
+
+    for (i = 0; items[i]; i++) {
+        OptionChannelFd *cfd = g_new0(OptionChannelFd, 1);
+        gchar **kv = g_strsplit(items[i], "=", 2);
+        gchar *name, *sep, *end;
+
+        fds = g_slist_prepend(fds, cfd);
+        if (kv[0] == NULL || kv[1] == NULL)
+            goto error;
+
+        name = kv[0];
+        sep = strchr(name, ':');
+        if (sep) {
+            *sep++ = '\0';
+            cfd->id = strtol(sep, &end, 10);
+            if (*sep == '\0' || *end != '\0' || cfd->id < 0)
+                goto error;
+        }
+        cfd->type = spice_channel_string_to_type(name);
+        if (cfd->type == -1)
+            goto error;
+
+        cfd->fd = strtol(kv[1], &end, 10);
+        if (end == kv[1] || cfd->fd < 0)
+            goto error;
+        if (g_str_equal(end, ":tls"))
+            cfd->tls = TRUE;
+        else if (*end != '\0')
+            goto error;
+
+        g_strfreev(kv);
+        continue;
+
+error:
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                    _("invalid channel socket (%s), expected <channel[:id]=fd[:tls]>"),
+                    items[i]);
+        g_strfreev(kv);
+        g_strfreev(items);
+        g_slist_free_full(fds, g_free);
+        return FALSE;
+    }
+
+    g_strfreev(items);
+    g_slist_free_full(channel_fds, g_free);
+    channel_fds = g_slist_reverse(fds);
+
+    return TRUE;
+}
 
 static gboolean parse_usbredir_filter(const gchar *option_name,
                                       const gchar *value,
@@ -163,8 +254,10 @@ GOptionGroup* spice_get_option_group(void)
     const GOptionEntry entries[] = {
         { "spice-secure-channels", '\0', 0, G_OPTION_ARG_CALLBACK, parse_secure_channels,
           N_("Force the specified channels to be secured"), "<main,display,inputs,...,all>" },
+        { "spice-compress-channels", '\0', 0, G_OPTION_ARG_CALLBACK, parse_compress_channels,
+          N_("Compress the data of the specified channels"), "<usbredir,port,webdav,all>" },
         { "spice-disable-effects", '\0', 0, G_OPTION_ARG_CALLBACK, parse_disable_effects,
-          N_("Disable guest display effects"), "<wallpaper,font-smooth,animation,all>" },
+          N_("Disable guest display effects"), "<wallpaper,font-smooth,animation,all,auto>" },
         { "spice-color-depth", '\0', 0, G_OPTION_ARG_CALLBACK, parse_color_depth,
           N_("Guest display color depth"), "<16,32>" },
         { "spice-ca-file", '\0', 0, G_OPTION_ARG_FILENAME, &ca_file,
@@ -192,8 +285,15 @@ GOptionGroup* spice_get_option_group(void)
           N_("Image cache size"), N_("<bytes>") },
         { "spice-glz-window-size", '\0', 0, G_OPTION_ARG_INT, &glz_window_size,
           N_("Glz compression history size"), N_("<bytes>") },
+        { "spice-reconnect-grace", '\0', 0, G_OPTION_ARG_INT, &reconnect_grace,
+          N_("Time to reconnect after a network failure, keeping the display state"), N_("<seconds>") },
+        { "spice-keepalive-timeout", '\0', 0, G_OPTION_ARG_INT, &keepalive_timeout,
+          N_("Time to detect an unresponsive server"), N_("<seconds>") },
         { "spice-shared-dir", '\0', 0, G_OPTION_ARG_FILENAME, &shared_dir,
           N_("Shared directory"), N_("<dir>") },
+        { "spice-channel-fds", '\0', 0, G_OPTION_ARG_CALLBACK, parse_channel_fds,
+          N_("Sockets already connected to the server, for the specified channels"),
+          "<channel[:id]=fd[:tls],...>" },
 
         { "spice-debug", '\0', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, option_debug,
           N_("Enable Spice-GTK debugging"), NULL },
@@ -241,6 +341,14 @@ void spice_set_session_option(SpiceSession *session)
         g_strfreev(channels);
     }
 
+    if (compress_channels) {
+        GStrv channels;
+        channels = g_strsplit(compress_channels, ",", -1);
+        if (channels)
+            g_object_set(session, "compress-channels", channels, NULL);
+        g_strfreev(channels);
+    }
+
     if (color_depth)
         g_object_set(session, "color-depth", color_depth, NULL);
     if (ca_file)
@@ -279,6 +387,24 @@ void spice_set_session_option(SpiceSession *session)
         g_object_set(session, "cache-size", cache_size, NULL);
     if (glz_window_size)
         g_object_set(session, "glz-window-size", glz_window_size, NULL);
+    if (reconnect_grace > 0)
+        g_object_set(session, "reconnect-grace", (guint)reconnect_grace, NULL);
+    if (keepalive_timeout > 0)
+        g_object_set(session, "keepalive-timeout", (guint)keepalive_timeout, NULL);
     if (shared_dir)
         g_object_set(session, "shared-dir", shared_dir, NULL);
+    if (channel_fds) {
+        GSList *l;
+
+        for (l = channel_fds; l != NULL; l = l->next) {
+            OptionChannelFd *cfd = l->data;
+            if (!spice_session_add_channel_fd(session, cfd->type, cfd->id,
+                                              cfd->fd, cfd->tls))
+                g_warning("socket %d: a socket was already given to %s:%d",
+                          cfd->fd, spice_channel_type_to_string(cfd->type), cfd->id);
+        }
+        /* the session owns them now, and only one can */
+        g_slist_free_full(channel_fds, g_free);
+        channel_fds = NULL;
+    }
 }
@@ -17,10 +17,13 @@
 */
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_AUDIO
+
 #include "spice-pulse.h"
 #include "spice-common.h"
 #include "spice-session-priv.h"
 #include "spice-channel-priv.h"
+#include "channel-playback-priv.h"
 #include "spice-util-priv.h"
 #include "glib-compat.h"
 
@@ -31,6 +34,12 @@
 #define SPICE_PULSE_GET_PRIVATE(obj)                                  \
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), SPICE_TYPE_PULSE, SpicePulsePrivate))
 
+/*
+ * A stopped playback keeps its stream, corked, that long before letting
+ * it go: PulseAudio updates the timing of a stream as long as it exists.
+ */
+#define PLAYBACK_IDLE_STOP_S 10
+
 struct async_task {
     SpicePulse                 *pulse;
     SpiceMainChannel           *main_channel;
@@ -67,6 +76,12 @@ struct _SpicePulsePrivate {
     struct stream           record;
     guint                   last_delay;
     guint                   target_delay;
+    guint                   buffer_delay; /* the tlength, in ms */
+    guint                   underflow_delay; /* added after underflows, in ms */
+    guint                   last_num_underflow;
+    gint64                  last_underflow_time;
+    gint64                  last_adjust_time;
+    guint                   playback_idle_id;
     struct async_task       *pending_restore_task;
     GList                   *results;
 };
@@ -133,6 +148,11 @@ static void spice_pulse_dispose(GObject *obj)
     SPICE_DEBUG("%s", __FUNCTION__);
     p = pulse->priv;
 
+    if (p->playback_idle_id != 0) {
+        g_source_remove(p->playback_idle_id);
+        p->playback_idle_id = 0;
+    }
+
     if (p->playback.uncork_op)
         pa_operation_unref(p->playback.uncork_op);
     p->playback.uncork_op = NULL;
@@ -155,8 +175,10 @@ static void spice_pulse_dispose(GObject *obj)
     g_clear_pointer(&p->playback.name, g_free);
     g_clear_pointer(&p->record.name, g_free);
 
-    if (p->pchannel)
+    if (p->pchannel) {
+        spice_playback_channel_set_sink(SPICE_PLAYBACK_CHANNEL(p->pchannel), NULL, NULL);
         g_object_weak_unref(G_OBJECT(p->pchannel), channel_weak_notified, pulse);
+    }
     p->pchannel = NULL;
 
     if (p->rchannel)
@@ -315,6 +337,63 @@ static void stream_state_callback(pa_stream *s, void *userdata)
     }
 }
 
+/*
+ * The buffer of the playback stream follows the network: its length is
+ * the latency asked by the server, or 4 times the jitter of the packets
+ * if more, plus an allowance that grows at once on underflows and
+ * decays slowly once they stopped for a while. The session mm-time is
+ * derived from the actual delay, so the video streams stay in sync as
+ * it changes.
+ */
+#define PLAYBACK_ADJUST_INTERVAL_US (2 * G_USEC_PER_SEC)
+#define PLAYBACK_STABLE_US (10 * G_USEC_PER_SEC)
+#define PLAYBACK_MAX_DELAY_MS 500
+#define PLAYBACK_UNDERFLOW_STEP_MS 20
+#define PLAYBACK_MIN_PREBUF_MS 20
+
+static void playback_adjust_latency(SpicePulse *pulse, gboolean force)
+{
+    SpicePulsePrivate *p = pulse->priv;
+    const pa_buffer_attr *buffer_attr;
+    pa_buffer_attr new_buffer_attr;
+    pa_operation *op;
+    gint64 now = g_get_monotonic_time();
+    guint jitter, target, max;
+
+    if (!force && now - p->last_adjust_time < PLAYBACK_ADJUST_INTERVAL_US)
+        return;
+    p->last_adjust_time = now;
+
+    if (p->playback.num_underflow == p->last_num_underflow &&
+        now - p->last_underflow_time >= PLAYBACK_STABLE_US)
+        p->underflow_delay -= MIN(p->underflow_delay, PLAYBACK_UNDERFLOW_STEP_MS / 2);
+    p->last_num_underflow = p->playback.num_underflow;
+
+    jitter = spice_playback_channel_get_jitter(SPICE_PLAYBACK_CHANNEL(p->pchannel));
+    max = MAX(p->target_delay, PLAYBACK_MAX_DELAY_MS);
+    target = MIN(MAX(p->target_delay, jitter * 4) + p->underflow_delay, max);
+
+    /* within 10%, not worth a change, unless an underflow asks for room */
+    if (target == p->buffer_delay ||
+        (!force && ABS((gint)target - (gint)p->buffer_delay) * 10 <= (gint)p->buffer_delay))
+        return;
+
+    buffer_attr = pa_stream_get_buffer_attr(p->playback.stream);
+    g_return_if_fail(buffer_attr != NULL);
+
+    SPICE_DEBUG("%s: buffer %u -> %u ms, jitter %u ms, %u underflows", __FUNCTION__,
+                p->buffer_delay, target, jitter, p->playback.num_underflow);
+    new_buffer_attr = *buffer_attr;
+    new_buffer_attr.tlength = pa_usec_to_bytes(target * PA_USEC_PER_MSEC, &p->playback.spec);
+    /* enough to ride out the jitter when starting over */
+    new_buffer_attr.prebuf = pa_usec_to_bytes(MIN(target, jitter * 2 + PLAYBACK_MIN_PREBUF_MS) *
+                                              PA_USEC_PER_MSEC, &p->playback.spec);
+    op = pa_stream_set_buffer_attr(p->playback.stream, &new_buffer_attr, NULL, NULL);
+    if (op != NULL)
+        pa_operation_unref(op);
+    p->buffer_delay = target;
+}
+
 static void stream_underflow_cb(pa_stream *s, void *userdata)
 {
     SpicePulse *pulse = userdata;
@@ -325,20 +404,13 @@ static void stream_underflow_cb(pa_stream *s, void *userdata)
     p = pulse->priv;
     g_return_if_fail(p != NULL);
     p->playback.num_underflow++;
-#ifdef PULSE_ADJUST_LATENCY
-    const pa_buffer_attr *buffer_attr;
-    pa_buffer_attr new_buffer_attr;
-    pa_operation *op;
-
-    buffer_attr = pa_stream_get_buffer_attr(s);
-    g_return_if_fail(buffer_attr != NULL);
-
-    new_buffer_attr = *buffer_attr;
-    new_buffer_attr.tlength *= 2;
-    new_buffer_attr.minreq *= 2;
-    op = pa_stream_set_buffer_attr(s, &new_buffer_attr, NULL, NULL);
-    pa_operation_unref(op);
-#endif
+    /* the next adjustment of the buffer makes room for it */
+    p->underflow_delay = MIN(p->underflow_delay + PLAYBACK_UNDERFLOW_STEP_MS,
+                             PLAYBACK_MAX_DELAY_MS);
+    p->last_underflow_time = g_get_monotonic_time();
+    /* growing can't wait, the next latency update reports the delay */
+    if (p->playback.stream && p->playback.started)
+        playback_adjust_latency(pulse, TRUE);
 }
 
 static void stream_update_latency_callback(pa_stream *s, void *userdata)
@@ -364,6 +436,8 @@ static void stream_update_latency_callback(pa_stream *s, void *userdata)
     g_return_if_fail(negative == FALSE);
     p->last_delay = usec / PA_USEC_PER_MSEC;
     spice_playback_channel_set_delay(SPICE_PLAYBACK_CHANNEL(p->pchannel), usec / 1000);
+    if (!pa_stream_is_corked(p->playback.stream))
+        playback_adjust_latency(pulse, FALSE);
     if (pa_stream_is_corked(p->playback.stream)) {
         if (p->last_delay >= p->target_delay) {
             SPICE_DEBUG("%s: uncork playback. delay %u target %u",  __FUNCTION__, p->last_delay, p->target_delay);
@@ -379,6 +453,10 @@ static void create_playback(SpicePulse *pulse)
     SpicePulsePrivate *p = pulse->priv;
     pa_stream_flags_t flags;
     pa_buffer_attr buffer_attr = { 0, };
+    pa_cvolume v, *volume = NULL;
+    guint16 *channel_volume;
+    guint nchannels, i;
+    gboolean mute;
 
     g_return_if_fail(p != NULL);
     g_return_if_fail(p->context != NULL);
@@ -394,12 +472,30 @@ static void create_playback(SpicePulse *pulse)
 
     buffer_attr.maxlength = -1;
     buffer_attr.tlength = pa_usec_to_bytes(p->target_delay * PA_USEC_PER_MSEC, &p->playback.spec);
+    p->buffer_delay = p->target_delay;
+    p->last_adjust_time = g_get_monotonic_time();
     buffer_attr.prebuf = -1;
     buffer_attr.minreq = -1;
     flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE;
 
+    /* a stream created again after being idle starts as the guest left it */
+    g_object_get(p->pchannel,
+                 "volume", &channel_volume,
+                 "nchannels", &nchannels,
+                 "mute", &mute,
+                 NULL);
+    if (nchannels == p->playback.spec.channels) {
+        pa_cvolume_init(&v);
+        v.channels = nchannels;
+        for (i = 0; i < nchannels; i++)
+            v.values[i] = (PA_VOLUME_NORM - PA_VOLUME_MUTED) * channel_volume[i] / G_MAXUINT16;
+        volume = &v;
+    }
+    if (mute)
+        flags |= PA_STREAM_START_MUTED;
+
     if (pa_stream_connect_playback(p->playback.stream,
-                                   NULL, &buffer_attr, flags, NULL, NULL) < 0) {
+                                   NULL, &buffer_attr, flags, volume, NULL) < 0) {
         g_warning("pa_stream_connect_playback() failed: %s",
                   pa_strerror(pa_context_errno(p->context)));
     }
@@ -415,6 +511,11 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
 
     g_return_if_fail(p != NULL);
 
+    if (p->playback_idle_id != 0) {
+        g_source_remove(p->playback_idle_id);
+        p->playback_idle_id = 0;
+    }
+
     p->playback.started = TRUE;
     p->playback.num_underflow = 0;
     g_object_get(p->pchannel, "min-latency", &latency, NULL);
@@ -432,6 +533,8 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
     p->playback.spec.channels = channels;
     p->target_delay = latency;
     p->last_delay = 0;
+    p->underflow_delay = 0;
+    p->last_num_underflow = 0;
 
     state = pa_context_get_state(p->context);
     switch (state) {
@@ -454,16 +557,13 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
     p->state = state;
 }
 
-static void playback_data(SpicePlaybackChannel *channel,
-                          gpointer *audio, gint size,
-                          gpointer data)
+static gboolean playback_stream_ready(SpicePulse *pulse)
 {
-    SpicePulse *pulse = data;
     SpicePulsePrivate *p = pulse->priv;
     pa_stream_state_t state;
 
     if (!p->playback.stream)
-        return;
+        return FALSE;
 
     state = pa_stream_get_state(p->playback.stream);
     switch (state) {
@@ -474,10 +574,6 @@ static void playback_data(SpicePlaybackChannel *channel,
         if (p->playback.state != state) {
             SPICE_DEBUG("%s: pulse playback stream ready", __FUNCTION__);
         }
-        if (pa_stream_write(p->playback.stream, audio, size, NULL, 0, PA_SEEK_RELATIVE) < 0) {
-            g_warning("pa_stream_write() failed: %s",
-                      pa_strerror(pa_context_errno(p->context)));
-        }
         break;
     default:
         if (p->playback.state != state) {
@@ -487,6 +583,94 @@ static void playback_data(SpicePlaybackChannel *channel,
         break;
     }
     p->playback.state = state;
+
+    return state == PA_STREAM_READY;
+}
+
+/*
+ * The playback channel decodes in the buffer of the stream, and gives
+ * the raw data with the message it came in, without copies.
+ */
+static gpointer playback_begin_write(gpointer user_data, gsize *size)
+{
+    SpicePulse *pulse = user_data;
+    SpicePulsePrivate *p = pulse->priv;
+    void *buf = NULL;
+    size_t nbytes = *size;
+
+    if (!playback_stream_ready(pulse))
+        return NULL;
+
+    if (pa_stream_begin_write(p->playback.stream, &buf, &nbytes) < 0) {
+        g_warning("pa_stream_begin_write() failed: %s",
+                  pa_strerror(pa_context_errno(p->context)));
+        return NULL;
+    }
+
+    *size = nbytes;
+    return buf;
+}
+
+static void playback_cancel_write(gpointer user_data)
+{
+    SpicePulse *pulse = user_data;
+
+    pa_stream_cancel_write(pulse->priv->playback.stream);
+}
+
+static gboolean playback_write(gpointer user_data, gpointer audio, gsize size,
+                               GDestroyNotify free_func, gpointer free_data)
+{
+    SpicePulse *pulse = user_data;
+    SpicePulsePrivate *p = pulse->priv;
+    int rc;
+
+    if (!playback_stream_ready(pulse))
+        return FALSE;
+
+#if PA_CHECK_VERSION(6,0,0)
+    if (free_func != NULL)
+        rc = pa_stream_write_ext_free(p->playback.stream, audio, size,
+                                      free_func, free_data, 0, PA_SEEK_RELATIVE);
+    else
+#endif
+    {
+        /* no copy of a pa_stream_begin_write() buffer */
+        rc = pa_stream_write(p->playback.stream, audio, size, NULL, 0, PA_SEEK_RELATIVE);
+        if (free_func != NULL)
+            free_func(free_data);
+    }
+
+    if (rc < 0) {
+        g_warning("pa_stream_write() failed: %s",
+                  pa_strerror(pa_context_errno(p->context)));
+    }
+
+    return TRUE;
+}
+
+static const SpicePlaybackSink playback_sink = {
+    .begin_write = playback_begin_write,
+    .cancel_write = playback_cancel_write,
+    .write = playback_write,
+};
+
+static gboolean playback_idle_stop(gpointer data)
+{
+    SpicePulse *pulse = data;
+    SpicePulsePrivate *p = pulse->priv;
+
+    /* the flush still refers to the stream */
+    if (p->playback.cork_op != NULL)
+        return G_SOURCE_CONTINUE;
+
+    p->playback_idle_id = 0;
+    if (p->playback.stream != NULL && !p->playback.started) {
+        SPICE_DEBUG("%s: playback idle, closing its stream", __FUNCTION__);
+        stream_stop(pulse, &p->playback);
+    }
+
+    return G_SOURCE_REMOVE;
 }
 
 static void playback_stop(SpicePulse *pulse)
@@ -500,6 +684,9 @@ static void playback_stop(SpicePulse *pulse)
         return;
 
     stream_cork(pulse, &p->playback, TRUE);
+    if (p->playback_idle_id == 0)
+        p->playback_idle_id = g_timeout_add_seconds(PLAYBACK_IDLE_STOP_S,
+                                                    playback_idle_stop, pulse);
 }
 
 static void stream_read_callback(pa_stream *s, size_t length, void *data)
@@ -798,8 +985,8 @@ static gboolean connect_channel(SpiceAudio *audio, SpiceChannel *channel)
         g_object_weak_ref(G_OBJECT(p->pchannel), channel_weak_notified, audio);
         spice_g_signal_connect_object(channel, "playback-start",
                                       G_CALLBACK(playback_start), pulse, 0);
-        spice_g_signal_connect_object(channel, "playback-data",
-                                      G_CALLBACK(playback_data), pulse, 0);
+        spice_playback_channel_set_sink(SPICE_PLAYBACK_CHANNEL(channel),
+                                        &playback_sink, pulse);
         spice_g_signal_connect_object(channel, "playback-stop",
                                       G_CALLBACK(playback_stop), pulse, G_CONNECT_SWAPPED);
         spice_g_signal_connect_object(channel, "notify::volume",
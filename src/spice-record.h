@@ -0,0 +1,96 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPICE_RECORD_H_
+# define SPICE_RECORD_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Recording of a session once decoded, made by spicy-record and read by
+ * spicy-play. Unlike a capture (see spice-capture.h), it can be read
+ * from any keyframe on, without the state of the channels.
+ *
+ * The file is a SpiceRecordHeader followed by chunks, each one a
+ * SpiceRecordChunk and @size bytes of data, and ends with the index of
+ * the keyframes and a SpiceRecordTrailer. A recording that was cut
+ * short has no trailer, it can still be read from the start.
+ *
+ * The pixels are xRGB, 4 bytes per pixel and packed rows, and are
+ * deflated with zlib. The integers are in host byte order.
+ */
+
+#define SPICE_RECORD_MAGIC      "SPICEREC"
+#define SPICE_RECORD_VERSION    1
+
+typedef enum {
+    SPICE_RECORD_KEYFRAME = 1,  /* SpiceRecordSurface, the deflated surface */
+    SPICE_RECORD_DAMAGE,        /* guint32 count, SpiceRecordRect[count], their deflated
+                                   pixels one after the other */
+    SPICE_RECORD_CURSOR,        /* SpiceRecordCursor, the deflated RGBA if visible */
+    SPICE_RECORD_CURSOR_MOVE,   /* gint32 x, gint32 y */
+    SPICE_RECORD_AUDIO_START,   /* guint32 format, channels, frequency */
+    SPICE_RECORD_AUDIO,         /* the samples, as received */
+    SPICE_RECORD_INDEX,         /* SpiceRecordIndexEntry, one per keyframe */
+} SpiceRecordType;
+
+typedef struct SpiceRecordHeader {
+    char        magic[8];
+    guint32     version;
+    guint32     padding;
+} SpiceRecordHeader;
+
+typedef struct SpiceRecordChunk {
+    guint64     time_us; /* since the start of the recording */
+    guint32     type;
+    guint32     size;
+} SpiceRecordChunk;
+
+typedef struct SpiceRecordSurface {
+    guint32     width;
+    guint32     height;
+} SpiceRecordSurface;
+
+typedef struct SpiceRecordRect {
+    guint32     x;
+    guint32     y;
+    guint32     width;
+    guint32     height;
+} SpiceRecordRect;
+
+typedef struct SpiceRecordCursor {
+    guint32     width; /* 0 for a hidden cursor */
+    guint32     height;
+    gint32      hot_x;
+    gint32      hot_y;
+} SpiceRecordCursor;
+
+typedef struct SpiceRecordIndexEntry {
+    guint64     time_us;
+    guint64     offset; /* of the chunk */
+} SpiceRecordIndexEntry;
+
+typedef struct SpiceRecordTrailer {
+    guint64     index_offset; /* of the index chunk */
+    char        magic[8];
+} SpiceRecordTrailer;
+
+G_END_DECLS
+
+#endif /* SPICE_RECORD_H_ */
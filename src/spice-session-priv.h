@@ -22,6 +22,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <openssl/ssl.h>
 
 #ifdef USE_PHODAV
 #include <libphodav/phodav.h>
@@ -34,16 +35,47 @@ typedef struct _PhodavServer PhodavServer;
 #include "spice-gtk-session.h"
 #include "spice-channel-cache.h"
 #include "decode.h"
+#ifdef HAVE_LIBURING
+#include "spice-uring.h"
+#endif
 
 G_BEGIN_DECLS
 
 #define WEBDAV_MAGIC_SIZE 16
 
+/* see spice_session_get_startup_times() */
+typedef enum {
+    SPICE_SESSION_STARTUP_MAIN_READY,
+    SPICE_SESSION_STARTUP_FIRST_FRAME,
+    SPICE_SESSION_STARTUP_USB_INIT,
+    SPICE_SESSION_STARTUP_SMARTCARD_INIT,
+    SPICE_SESSION_STARTUP_AUDIO_INIT,
+    SPICE_SESSION_STARTUP_LAST
+} SpiceSessionStartup;
+
 SpiceSession *spice_session_new_from_session(SpiceSession *session);
 
 void spice_session_set_connection_id(SpiceSession *session, int id);
 int spice_session_get_connection_id(SpiceSession *session);
 gboolean spice_session_get_client_provided_socket(SpiceSession *session);
+int spice_session_take_channel_fd(SpiceSession *session, gint type, gint id,
+                                  gboolean *tls);
+gboolean spice_session_get_compress_channel(SpiceSession *session, gint type);
+#ifdef HAVE_LIBURING
+SpiceUring *spice_session_get_uring(SpiceSession *session);
+#endif
+guint spice_session_get_keepalive_timeout(SpiceSession *session);
+SpiceSessionCompressionPolicy spice_session_get_compression_policy(SpiceSession *session);
+void spice_session_sample_bandwidth(SpiceSession *session, guint64 rate);
+guint64 spice_session_get_bandwidth(SpiceSession *session);
+gboolean spice_session_channel_lost(SpiceSession *session, SpiceChannel *channel,
+                                    SpiceChannelEvent event);
+void spice_session_main_reconnected(SpiceSession *session, int connection_id);
+void spice_session_startup_reached(SpiceSession *session, SpiceSessionStartup step);
+void spice_session_startup_took(SpiceSession *session, SpiceSessionStartup step,
+                                gint64 start);
+gboolean spice_session_reconnect_channel(SpiceSession *session, gint type, gint id);
+gboolean spice_session_defer_channel(SpiceSession *session, gint type, gint id);
 
 GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceChannel *channel,
                                                    gboolean *use_tls, GError **error);
@@ -52,6 +84,7 @@ void spice_session_channel_migrate(SpiceSession *session, SpiceChannel *channel)
 
 void spice_session_set_mm_time(SpiceSession *session, guint32 time);
 guint32 spice_session_get_mm_time(SpiceSession *session);
+guint32 spice_session_get_mm_time_error(SpiceSession *session);
 
 void spice_session_switching_disconnect(SpiceSession *session);
 void spice_session_start_migrating(SpiceSession *session,
@@ -69,10 +102,18 @@ const gchar* spice_session_get_cert_subject(SpiceSession *session);
 const gchar* spice_session_get_ciphers(SpiceSession *session);
 const gchar* spice_session_get_ca_file(SpiceSession *session);
 void spice_session_get_ca(SpiceSession *session, guint8 **ca, guint *size);
+SSL_CTX *spice_session_get_ssl_ctx(SpiceSession *session, gboolean *ca_loaded);
+void spice_session_set_ssl_ctx(SpiceSession *session, SSL_CTX *ctx, gboolean ca_loaded);
+void spice_session_share_ssl_ctx(SpiceSession *session, SpiceSession *from);
+SSL_SESSION *spice_session_get_ssl_session(SpiceSession *session);
+void spice_session_set_ssl_session(SpiceSession *session, SSL_SESSION *ssl_session);
 
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
                                     uint32_t n_display_channels);
+void spice_session_update_caches(SpiceSession *session);
+void spice_session_get_cache_limits(SpiceSession *session, int *images_size,
+                                    int *glz_size);
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
                               SpiceGlzDecoderWindow **glz_window);
@@ -94,9 +135,13 @@ gboolean spice_session_get_usbredir_enabled(SpiceSession *session);
 
 const guint8* spice_session_get_webdav_magic(SpiceSession *session);
 PhodavServer *spice_session_get_webdav_server(SpiceSession *session);
+GIOStream *spice_session_webdav_connect(SpiceSession *session, gsize capacity,
+                                        GError **error);
 PhodavServer* channel_webdav_server_new(SpiceSession *session);
 guint spice_session_get_n_display_channels(SpiceSession *session);
 void spice_session_set_main_channel(SpiceSession *session, SpiceChannel *channel);
+void spice_session_monitors_config_sent(SpiceSession *session);
+void spice_session_primary_created(SpiceSession *session);
 gboolean spice_session_set_migration_session(SpiceSession *session, SpiceSession *mig_session);
 SpiceAudio *spice_audio_get(SpiceSession *session, GMainContext *context);
 G_END_DECLS
@@ -21,6 +21,12 @@
 #include <glib.h>
 #ifdef G_OS_UNIX
 #include <gio/gunixsocketaddress.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+#ifdef G_OS_WIN32
+#include <windows.h>
 #endif
 #include "common/ring.h"
 
@@ -35,15 +41,36 @@
 #include "spice-uri-priv.h"
 #include "channel-playback-priv.h"
 #include "spice-audio.h"
+#include "giopipe.h"
 
 struct channel {
     SpiceChannel      *channel;
     RingItem          link;
 };
 
+/* a channel of the server not created while preconnected */
+struct deferred_channel {
+    gint              type;
+    gint              id;
+};
+
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
+/* the image cache is not shrunk further to fit SpiceSession:memory-budget */
+#define MIN_IMAGES_CACHE_SIZE (1024 * 1024 * 4)
+/* when sized automatically: frames of the displays the image cache holds */
+#define IMAGES_CACHE_FRAMES 10
+/* the geometry assumed for a display whose monitors are not known yet */
+#define DEFAULT_DISPLAY_PIXELS (1920 * 1080)
+/* the shares of the client RAM left to the image cache and the Glz window */
+#define IMAGES_CACHE_RAM_DIVISOR 16
+#define GLZ_WINDOW_RAM_DIVISOR 32
+
+#if defined(USE_PHODAV) && defined(G_OS_UNIX)
+/* phodav serves the shared folder from its own thread, through socket pairs */
+#define WEBDAV_THREAD 1
+#endif
 
 struct _SpiceSessionPrivate {
     char              *host;
@@ -60,6 +87,7 @@ struct _SpiceSessionPrivate {
     guint             verify;
     gboolean          read_only;
     SpiceURI          *proxy;
+    gboolean          proxy_pipelining;
     gchar             *shared_dir;
     gboolean          share_dir_ro;
 
@@ -90,7 +118,10 @@ struct _SpiceSessionPrivate {
 
     GStrv             disable_effects;
     GStrv             secure_channels;
+    GStrv             compress_channels;
     gint              color_depth;
+    guint             keepalive_timeout;
+    SpiceSessionCompressionPolicy compression_policy;
 
     int               connection_id;
     int               protocol;
@@ -98,7 +129,16 @@ struct _SpiceSessionPrivate {
     Ring              channels;
     guint32           mm_time;
     gboolean          client_provided_sockets;
+    GList             *channel_fds; /* ChannelFd, sockets connected by the launcher */
+#ifdef HAVE_LIBURING
+    SpiceUring        *uring; /* shared by the channels, created on demand */
+    gboolean          uring_tried;
+#endif
     guint64           mm_time_at_clock;
+    gdouble           mm_time_drift; /* server ms per local ms, minus 1 */
+    gint32            mm_time_slew; /* ms still to catch up, at MM_TIME_SLEW_RATE */
+    gdouble           mm_time_error; /* filtered deviation of the samples, ms */
+    guint64           mm_time_last_sample;
     SpiceSession      *migration;
     GList             *migration_left;
     SpiceSessionMigration migration_state;
@@ -113,16 +153,65 @@ struct _SpiceSessionPrivate {
     SpiceGlzDecoderWindow *glz_window;
     int               images_cache_size;
     int               glz_window_size;
+    gboolean          images_cache_auto; /* sized by the session */
+    gboolean          glz_window_auto;
+    /* the sizes applied to the caches, within the memory budget */
+    int               images_cache_limit;
+    int               glz_window_limit;
+    guint64           memory_budget;
+    guint             glz_overflow_id;
+    guint64           bandwidth; /* bytes/s, of the link, 0 until known */
+    guint64           bandwidth_notified;
+    guint             bandwidth_notify_id;
+    GSource           *wakeup_source; /* a WakeupSource */
     uint32_t          pci_ram_size;
     uint32_t          n_display_channels;
     guint8            uuid[16];
     gchar             *name;
+    gint64            monitors_config_time; /* waiting for a new primary */
+    gint64            connect_time;
+    guint64           startup_us[SPICE_SESSION_STARTUP_LAST];
+
+    /* the address the channels connected to, and the proxy one, with
+     * the names they are for: they are resolved once */
+    gchar             *connect_host;
+    GInetAddress      *connect_address;
+    gchar             *proxy_host;
+    GInetAddress      *proxy_address;
+
+    /* shared by the TLS channels, the TLS session is the last one
+     * negotiated with ssl_session_server */
+    SSL_CTX           *ssl_ctx;
+    gboolean          ssl_ca_loaded;
+    gchar             *ssl_ctx_key; /* in shared_ssl_ctxs */
+    SSL_SESSION       *ssl_session;
+    gchar             *ssl_session_server;
+
+    /* fast reconnection: the channels that lost their connection wait
+     * for the main channel during reconnect_grace seconds, see
+     * spice_session_channel_lost() */
+    guint             reconnect_grace;
+    guint             reconnect_id;
+    guint             reconnect_retry_id;
+    gboolean          reconnect_main; /* waiting for the main channel init */
+    gboolean          reconnect_main_lost;
+    GList             *reconnect_channels;
+
+    /* warm standby, see spice_session_preconnect() */
+    gboolean          preconnect;
+    guint             preconnect_timeout_id;
+    GArray            *preconnect_deferred; /* struct deferred_channel */
 
     /* associated objects */
     SpiceAudio        *audio_manager;
     SpiceUsbDeviceManager *usb_manager;
     SpicePlaybackChannel *playback_channel;
     PhodavServer      *webdav;
+#ifdef WEBDAV_THREAD
+    GThread           *webdav_thread;
+    GMainContext      *webdav_context;
+    GMainLoop         *webdav_loop;
+#endif
 };
 
 
@@ -203,6 +292,16 @@ enum {
     PROP_SHARE_DIR_RO,
     PROP_USERNAME,
     PROP_UNIX_PATH,
+    PROP_GLZ_WINDOW_OCCUPANCY,
+    PROP_RECONNECT_GRACE,
+    PROP_COMPRESS_CHANNELS,
+    PROP_KEEPALIVE_TIMEOUT,
+    PROP_PROXY_PIPELINING,
+    PROP_MEMORY_USAGE,
+    PROP_MEMORY_BUDGET,
+    PROP_COMPRESSION_POLICY,
+    PROP_BANDWIDTH,
+    PROP_MAIN_LOOP_WAKEUPS,
 };
 
 /* signals */
@@ -216,6 +315,9 @@ enum {
 static guint signals[SPICE_SESSION_LAST_SIGNAL];
 
 static void spice_session_channel_destroy(SpiceSession *session, SpiceChannel *channel);
+#ifdef WEBDAV_THREAD
+static void webdav_session_notify(GObject *gobject, GParamSpec *pspec, gpointer user_data);
+#endif
 
 static void update_proxy(SpiceSession *self, const gchar *str)
 {
@@ -244,6 +346,108 @@ static void update_proxy(SpiceSession *self, const gchar *str)
     }
 }
 
+static gsize image_size(gpointer value)
+{
+    pixman_image_t *image = value;
+
+    return (gsize)pixman_image_get_stride(image) * pixman_image_get_height(image);
+}
+
+/* main context */
+static gboolean glz_window_overflow_idle(gpointer data)
+{
+    SpiceSession *session = data;
+    SpiceSessionPrivate *s = session->priv;
+    struct channel *item;
+    RingItem *ring, *next;
+
+    s->glz_overflow_id = 0;
+
+    /* the window is useless without the images the server refers to */
+    for (ring = ring_get_head(&s->channels); ring != NULL; ring = next) {
+        next = ring_next(&s->channels, ring);
+        item = SPICE_CONTAINEROF(ring, struct channel, link);
+
+        if (SPICE_IS_DISPLAY_CHANNEL(item->channel))
+            spice_channel_disconnect(item->channel, SPICE_CHANNEL_ERROR_IO);
+    }
+
+    return FALSE;
+}
+
+/* coroutine context */
+static void glz_window_overflow(SpiceGlzDecoderWindow *window, gpointer data)
+{
+    SpiceSession *session = data;
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->glz_overflow_id == 0) {
+        g_warning("the glz window is over %d bytes, disconnecting the displays",
+                  s->glz_window_limit);
+        s->glz_overflow_id = g_idle_add(glz_window_overflow_idle, session);
+    }
+}
+
+/* the memory held outside of the image cache and the Glz window */
+static guint64 session_get_channels_memory_usage(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    struct channel *item;
+    RingItem *ring;
+    guint64 size = 0;
+
+    for (ring = ring_get_head(&s->channels); ring != NULL;
+         ring = ring_next(&s->channels, ring)) {
+        item = SPICE_CONTAINEROF(ring, struct channel, link);
+        size += spice_channel_get_memory_usage(item->channel);
+    }
+
+    return size;
+}
+
+static guint64 session_get_memory_usage(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+
+    return s->images->size + glz_decoder_window_get_size(s->glz_window) +
+        session_get_channels_memory_usage(session);
+}
+
+/*
+ * Counts the iterations of the main loop: it is prepared before each
+ * poll, and never has anything to dispatch. It goes first, the
+ * sources after a ready one are not prepared.
+ */
+typedef struct WakeupSource {
+    GSource source;
+    guint64 count;
+} WakeupSource;
+
+static gboolean wakeup_source_prepare(GSource *source, gint *timeout)
+{
+    ((WakeupSource *)source)->count++;
+    *timeout = -1;
+
+    return FALSE;
+}
+
+static gboolean wakeup_source_check(GSource *source)
+{
+    return FALSE;
+}
+
+static gboolean wakeup_source_dispatch(GSource *source, GSourceFunc callback,
+                                       gpointer user_data)
+{
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs wakeup_source_funcs = {
+    .prepare = wakeup_source_prepare,
+    .check = wakeup_source_check,
+    .dispatch = wakeup_source_dispatch,
+};
+
 static void spice_session_init(SpiceSession *session)
 {
     SpiceSessionPrivate *s;
@@ -257,9 +461,47 @@ static void spice_session_init(SpiceSession *session)
     g_free(channels);
 
     ring_init(&s->channels);
-    s->images = cache_new((GDestroyNotify)pixman_image_unref);
+    s->preconnect_deferred = g_array_new(FALSE, FALSE, sizeof(struct deferred_channel));
+    s->images_cache_auto = TRUE;
+    s->glz_window_auto = TRUE;
+    s->images = cache_new_sized((GDestroyNotify)pixman_image_unref, image_size);
     s->glz_window = glz_decoder_window_new();
+    glz_decoder_window_set_overflow_func(s->glz_window, glz_window_overflow, session);
     update_proxy(session, NULL);
+
+    s->wakeup_source = g_source_new(&wakeup_source_funcs, sizeof(WakeupSource));
+    g_source_set_priority(s->wakeup_source, G_MININT);
+    g_source_attach(s->wakeup_source, NULL);
+}
+
+static void session_reconnect_clear(SpiceSession *self)
+{
+    SpiceSessionPrivate *s = self->priv;
+
+    if (s->reconnect_id != 0) {
+        g_source_remove(s->reconnect_id);
+        s->reconnect_id = 0;
+    }
+    if (s->reconnect_retry_id != 0) {
+        g_source_remove(s->reconnect_retry_id);
+        s->reconnect_retry_id = 0;
+    }
+    g_list_free(s->reconnect_channels);
+    s->reconnect_channels = NULL;
+    s->reconnect_main = FALSE;
+    s->reconnect_main_lost = FALSE;
+}
+
+static void session_preconnect_clear(SpiceSession *self)
+{
+    SpiceSessionPrivate *s = self->priv;
+
+    if (s->preconnect_timeout_id != 0) {
+        g_source_remove(s->preconnect_timeout_id);
+        s->preconnect_timeout_id = 0;
+    }
+    g_array_set_size(s->preconnect_deferred, 0);
+    s->preconnect = FALSE;
 }
 
 static void
@@ -271,6 +513,9 @@ session_disconnect(SpiceSession *self, gboolean keep_main)
 
     s = self->priv;
 
+    session_reconnect_clear(self);
+    session_preconnect_clear(self);
+
     for (ring = ring_get_head(&s->channels); ring != NULL; ring = next) {
         next = ring_next(&s->channels, ring);
         item = SPICE_CONTAINEROF(ring, struct channel, link);
@@ -306,9 +551,33 @@ spice_session_dispose(GObject *gobject)
     g_warn_if_fail(s->after_main_init == 0);
     g_warn_if_fail(s->disconnecting == 0);
 
+    if (s->glz_overflow_id != 0) {
+        g_source_remove(s->glz_overflow_id);
+        s->glz_overflow_id = 0;
+    }
+    if (s->bandwidth_notify_id != 0) {
+        g_source_remove(s->bandwidth_notify_id);
+        s->bandwidth_notify_id = 0;
+    }
+    if (s->wakeup_source != NULL) {
+        g_source_destroy(s->wakeup_source);
+        g_source_unref(s->wakeup_source);
+        s->wakeup_source = NULL;
+    }
+
     g_clear_object(&s->audio_manager);
     g_clear_object(&s->usb_manager);
     g_clear_object(&s->proxy);
+#ifdef WEBDAV_THREAD
+    if (s->webdav_thread != NULL) {
+        g_signal_handlers_disconnect_by_func(session, webdav_session_notify, NULL);
+        g_main_loop_quit(s->webdav_loop);
+        g_thread_join(s->webdav_thread);
+        s->webdav_thread = NULL;
+        g_clear_pointer(&s->webdav_loop, g_main_loop_unref);
+        g_clear_pointer(&s->webdav_context, g_main_context_unref);
+    }
+#endif
     g_clear_object(&s->webdav);
 
     /* Chain up to the parent class */
@@ -316,6 +585,96 @@ spice_session_dispose(GObject *gobject)
         G_OBJECT_CLASS(spice_session_parent_class)->dispose(gobject);
 }
 
+/* the TLS settings changed */
+/*
+ * The sessions of the process with the same TLS settings share their
+ * SSL_CTX, whose CA store is most of the size. The table does not hold
+ * a reference, the entry goes with the last session using it.
+ */
+typedef struct {
+    SSL_CTX *ctx;
+    gboolean ca_loaded;
+    guint users;
+} SharedSslCtx;
+
+static GHashTable *shared_ssl_ctxs; /* key -> SharedSslCtx */
+
+static void shared_ssl_ctx_free(SharedSslCtx *shared)
+{
+    g_slice_free(SharedSslCtx, shared);
+}
+
+static gchar *session_ssl_ctx_key(SpiceSessionPrivate *s)
+{
+    gchar *ca_sum = NULL, *key;
+
+    if (s->ca != NULL)
+        ca_sum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, s->ca->data, s->ca->len);
+
+    /* the CA is only loaded when the certificate is verified */
+    key = g_strdup_printf("%d|%s|%s|%s",
+                          (s->verify & (SPICE_SESSION_VERIFY_SUBJECT |
+                                        SPICE_SESSION_VERIFY_HOSTNAME)) != 0,
+                          s->ca_file ? s->ca_file : "", ca_sum ? ca_sum : "",
+                          s->ciphers ? s->ciphers : "");
+    g_free(ca_sum);
+
+    return key;
+}
+
+static void session_use_shared_ssl_ctx(SpiceSessionPrivate *s, const gchar *key,
+                                       SharedSslCtx *shared)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    SSL_CTX_up_ref(shared->ctx);
+#else
+    CRYPTO_add(&shared->ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif
+    shared->users++;
+    s->ssl_ctx = shared->ctx;
+    s->ssl_ca_loaded = shared->ca_loaded;
+    s->ssl_ctx_key = g_strdup(key);
+}
+
+static void session_clear_tls(SpiceSessionPrivate *s)
+{
+    if (s->ssl_ctx_key) {
+        SharedSslCtx *shared = g_hash_table_lookup(shared_ssl_ctxs, s->ssl_ctx_key);
+
+        if (shared != NULL && --shared->users == 0)
+            g_hash_table_remove(shared_ssl_ctxs, s->ssl_ctx_key);
+        g_clear_pointer(&s->ssl_ctx_key, g_free);
+    }
+    if (s->ssl_ctx) {
+        SSL_CTX_free(s->ssl_ctx);
+        s->ssl_ctx = NULL;
+    }
+    if (s->ssl_session) {
+        SSL_SESSION_free(s->ssl_session);
+        s->ssl_session = NULL;
+    }
+    g_clear_pointer(&s->ssl_session_server, g_free);
+}
+
+typedef struct ChannelFd {
+    gint type;
+    gint id;
+    int fd;
+    gboolean tls;
+} ChannelFd;
+
+static void channel_fd_free(gpointer data)
+{
+    ChannelFd *cfd = data;
+    GSocket *sock;
+
+    /* not used: the socket closes it, on any platform */
+    sock = g_socket_new_from_fd(cfd->fd, NULL);
+    if (sock)
+        g_object_unref(sock);
+    g_free(cfd);
+}
+
 static void
 spice_session_finalize(GObject *gobject)
 {
@@ -323,6 +682,12 @@ spice_session_finalize(GObject *gobject)
     SpiceSessionPrivate *s = session->priv;
 
     /* release stuff */
+    g_array_free(s->preconnect_deferred, TRUE);
+    session_clear_tls(s);
+    g_free(s->connect_host);
+    g_clear_object(&s->connect_address);
+    g_free(s->proxy_host);
+    g_clear_object(&s->proxy_address);
     g_free(s->unix_path);
     g_free(s->host);
     g_free(s->port);
@@ -336,7 +701,12 @@ spice_session_finalize(GObject *gobject)
     g_free(s->smartcard_db);
     g_strfreev(s->disable_effects);
     g_strfreev(s->secure_channels);
+    g_strfreev(s->compress_channels);
     g_free(s->shared_dir);
+    g_list_free_full(s->channel_fds, channel_fd_free);
+#ifdef HAVE_LIBURING
+    g_clear_pointer(&s->uring, spice_uring_free);
+#endif
 
     g_clear_pointer(&s->images, cache_unref);
     glz_decoder_window_destroy(s->glz_window);
@@ -643,6 +1013,37 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_GLZ_WINDOW_SIZE:
         g_value_set_int(value, s->glz_window_size);
         break;
+    case PROP_GLZ_WINDOW_OCCUPANCY:
+        g_value_set_uint(value, MIN(glz_decoder_window_get_size(s->glz_window), G_MAXUINT));
+        break;
+    case PROP_RECONNECT_GRACE:
+        g_value_set_uint(value, s->reconnect_grace);
+        break;
+    case PROP_COMPRESS_CHANNELS:
+        g_value_set_boxed(value, s->compress_channels);
+        break;
+    case PROP_KEEPALIVE_TIMEOUT:
+        g_value_set_uint(value, s->keepalive_timeout);
+        break;
+    case PROP_COMPRESSION_POLICY:
+        g_value_set_enum(value, s->compression_policy);
+        break;
+    case PROP_BANDWIDTH:
+        g_value_set_uint64(value, s->bandwidth);
+        break;
+    case PROP_MAIN_LOOP_WAKEUPS:
+        g_value_set_uint64(value, s->wakeup_source ?
+                           ((WakeupSource *)s->wakeup_source)->count : 0);
+        break;
+    case PROP_PROXY_PIPELINING:
+        g_value_set_boolean(value, s->proxy_pipelining);
+        break;
+    case PROP_MEMORY_USAGE:
+        g_value_set_uint64(value, session_get_memory_usage(session));
+        break;
+    case PROP_MEMORY_BUDGET:
+        g_value_set_uint64(value, s->memory_budget);
+        break;
     case PROP_NAME:
         g_value_set_string(value, s->name);
 	break;
@@ -701,10 +1102,12 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_CA_FILE:
         g_free(s->ca_file);
         s->ca_file = g_value_dup_string(value);
+        session_clear_tls(s);
         break;
     case PROP_CIPHERS:
         g_free(s->ciphers);
         s->ciphers = g_value_dup_string(value);
+        session_clear_tls(s);
         break;
     case PROP_PROTOCOL:
         s->protocol = g_value_get_int(value);
@@ -725,6 +1128,7 @@ static void spice_session_set_property(GObject      *gobject,
             s->verify |= SPICE_SESSION_VERIFY_PUBKEY;
         else
             s->verify &= ~SPICE_SESSION_VERIFY_PUBKEY;
+        session_clear_tls(s);
 	break;
     case PROP_CERT_SUBJECT:
         g_free(s->cert_subject);
@@ -733,9 +1137,11 @@ static void spice_session_set_property(GObject      *gobject,
             s->verify |= SPICE_SESSION_VERIFY_SUBJECT;
         else
             s->verify &= ~SPICE_SESSION_VERIFY_SUBJECT;
+        session_clear_tls(s);
         break;
     case PROP_VERIFY:
         s->verify = g_value_get_flags(value);
+        session_clear_tls(s);
         break;
     case PROP_MIGRATION_STATE:
         s->migration_state = g_value_get_enum(value);
@@ -777,13 +1183,16 @@ static void spice_session_set_property(GObject      *gobject,
         break;
     case PROP_CACHE_SIZE:
         s->images_cache_size = g_value_get_int(value);
+        s->images_cache_auto = s->images_cache_size == 0;
         break;
     case PROP_GLZ_WINDOW_SIZE:
         s->glz_window_size = g_value_get_int(value);
+        s->glz_window_auto = s->glz_window_size == 0;
         break;
     case PROP_CA:
         g_clear_pointer(&s->ca, g_byte_array_unref);
         s->ca = g_value_dup_boxed(value);
+        session_clear_tls(s);
         break;
     case PROP_PROXY:
         update_proxy(session, g_value_get_string(value));
@@ -794,6 +1203,25 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_SHARE_DIR_RO:
         s->share_dir_ro = g_value_get_boolean(value);
         break;
+    case PROP_RECONNECT_GRACE:
+        s->reconnect_grace = g_value_get_uint(value);
+        break;
+    case PROP_COMPRESS_CHANNELS:
+        g_strfreev(s->compress_channels);
+        s->compress_channels = g_value_dup_boxed(value);
+        break;
+    case PROP_KEEPALIVE_TIMEOUT:
+        s->keepalive_timeout = g_value_get_uint(value);
+        break;
+    case PROP_COMPRESSION_POLICY:
+        s->compression_policy = g_value_get_enum(value);
+        break;
+    case PROP_PROXY_PIPELINING:
+        s->proxy_pipelining = g_value_get_boolean(value);
+        break;
+    case PROP_MEMORY_BUDGET:
+        s->memory_budget = g_value_get_uint64(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -1045,7 +1473,10 @@ static void spice_session_class_init(SpiceSessionClass *klass)
      * A string array of effects to disable. The settings will
      * be applied on new display channels. The following effets can be
      * disabled "wallpaper", "font-smooth", "animation", and "all",
-     * which will disable all the effects. If NULL, don't apply changes.
+     * which will disable all the effects. "auto" disables the
+     * wallpaper and the animations while the link is slow, see
+     * #SpiceMainChannel:disable-effects-auto. If NULL, don't apply
+     * changes.
      *
      * Since: 0.7
      **/
@@ -1292,7 +1723,8 @@ static void spice_session_class_init(SpiceSessionClass *klass)
     /**
      * SpiceSession:cache-size:
      *
-     * Images cache size. If 0, don't set.
+     * Images cache size. If 0, it is sized from the client memory and
+     * the geometry of the displays.
      *
      * Since: 0.9
      **/
@@ -1308,7 +1740,8 @@ static void spice_session_class_init(SpiceSessionClass *klass)
     /**
      * SpiceSession:glz-window-size:
      *
-     * Glz window size. If 0, don't set.
+     * Glz window size. If 0, it is sized from the guest video memory
+     * and the client memory.
      *
      * Since: 0.9
      **/
@@ -1321,6 +1754,70 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                           G_PARAM_READWRITE |
                           G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceSession:glz-window-occupancy:
+     *
+     * The size of the images currently held by the Glz window, in bytes.
+     * It is bounded by #SpiceSession:glz-window-size with some slack: the
+     * display channels are disconnected rather than letting a server that
+     * does not release its images grow the window past it. This property
+     * is not notified.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GLZ_WINDOW_OCCUPANCY,
+         g_param_spec_uint("glz-window-occupancy",
+                           "Glz window occupancy",
+                           "Glz window occupancy (bytes)",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:memory-usage:
+     *
+     * The memory held by the session, in bytes: the image cache, the
+     * Glz window, and for each channel its buffers and coroutine stack,
+     * the display surfaces and stream frames, the queued agent messages
+     * and the file transfer buffers. This property is not notified.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MEMORY_USAGE,
+         g_param_spec_uint64("memory-usage",
+                             "Memory usage",
+                             "Memory held by the session (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:memory-budget:
+     *
+     * If not 0, the memory the session should fit in, in bytes. When
+     * the server tells the size of its display, what is left of the
+     * budget once the channels are accounted for is shared between the
+     * image cache and the Glz window: the image cache is shrunk first,
+     * down to 4 MiB, then the Glz window, down to its minimum size. The
+     * sizes are told to the server, which evicts from its side so that
+     * the images it refers to are always there.
+     *
+     * The display surfaces are not known at that point, and are not
+     * limited: the budget should leave room for them.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MEMORY_BUDGET,
+         g_param_spec_uint64("memory-budget",
+                             "Memory budget",
+                             "Memory the session should fit in (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READWRITE |
+                             G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceSession:name:
      *
@@ -1369,6 +1866,27 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                              G_PARAM_READWRITE |
                              G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceSession:proxy-pipelining:
+     *
+     * Whether to send the first data of the channels right after the
+     * CONNECT request to the HTTP proxy, without waiting for its reply.
+     * It saves a round-trip through the proxy on each channel connection,
+     * but the proxy must not drop the data it receives before it replies,
+     * which most of them do not. A rejected request is still reported as
+     * a proxy error.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_PROXY_PIPELINING,
+         g_param_spec_boolean("proxy-pipelining",
+                              "Proxy pipelining",
+                              "Do not wait for the HTTP proxy reply",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceSession:shared-dir:
      *
@@ -1403,6 +1921,142 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                               G_PARAM_CONSTRUCT |
                               G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceSession:reconnect-grace:
+     *
+     * When a connection to the server is lost, the number of seconds
+     * during which the session tries to reconnect its channels, with the
+     * same connection id, before reporting the error. Meanwhile, the
+     * channels and their surfaces are kept; the image cache and the Glz
+     * window are flushed once the main channel is back, as nothing tells
+     * what the server still has. If 0, the errors are reported right away.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_RECONNECT_GRACE,
+         g_param_spec_uint("reconnect-grace",
+                           "Reconnect grace",
+                           "Reconnection grace period (seconds)",
+                           0, G_MAXUINT / 1000, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:compress-channels:
+     *
+     * A string array of channel types, or "all", whose data should be
+     * compressed with LZ4 when the server supports it. Only the
+     * usbredir, port and webdav channels have this capability. The
+     * library needs to be built with LZ4 support.
+     *
+     * It is useful on low-bandwidth links. The data that is already
+     * compressed is detected and sent as is.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_COMPRESS_CHANNELS,
+         g_param_spec_boxed ("compress-channels",
+                             "Compress channels",
+                             "Array of channel type to compress",
+                             G_TYPE_STRV,
+                             G_PARAM_READWRITE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:keepalive-timeout:
+     *
+     * The number of seconds after which a server that does not answer
+     * anymore is considered gone, and its channels report an
+     * %SPICE_CHANNEL_ERROR_IO. The TCP keep-alive probes start after
+     * half of it without traffic, and the data sent must be acknowledged
+     * within it. If 0, the system defaults are used, which usually take
+     * hours to detect a dead peer on an idle link.
+     *
+     * It applies to the channels connected afterwards.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_KEEPALIVE_TIMEOUT,
+         g_param_spec_uint("keepalive-timeout",
+                           "Keep-alive timeout",
+                           "Time to detect an unresponsive server (seconds)",
+                           0, G_MAXINT / 1000, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:compression-policy:
+     *
+     * How the image compression is chosen. With
+     * %SPICE_SESSION_COMPRESSION_POLICY_ADAPTIVE, the display channels
+     * measure the time they take to decode each kind of image, and the
+     * speed of the link, and send the server a preferred compression
+     * when it supports it: GLZ when the client is fast and the link
+     * slow, LZ or QUIC when the client is slow and the link fast.
+     * When the library is built with LZ4, LZ4 is preferred on a fast
+     * link, and its images are decoded straight into the surfaces.
+     *
+     * It applies to the display channels connected afterwards.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_COMPRESSION_POLICY,
+         g_param_spec_enum("compression-policy",
+                           "Compression policy",
+                           "How the image compression is chosen",
+                           SPICE_TYPE_SESSION_COMPRESSION_POLICY,
+                           SPICE_SESSION_COMPRESSION_POLICY_SERVER,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:bandwidth:
+     *
+     * An estimate of the bandwidth of the link to the server, in bytes
+     * per second, or 0 until it is known. It is measured passively,
+     * from the data the channels receive in bursts, when the server
+     * sends more than a few messages at once. It is a lower bound: a
+     * link that is never busy is never measured at its full speed.
+     *
+     * The property is notified when the estimate changes by more than
+     * an eighth.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_BANDWIDTH,
+         g_param_spec_uint64("bandwidth",
+                             "Bandwidth",
+                             "Estimated bandwidth of the link (bytes/s)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:main-loop-wakeups:
+     *
+     * The iterations of the default main loop since the session was
+     * created, whatever woke it up. Sampled twice, it tells how often
+     * the process wakes up, which keeps an idle CPU from its deeper
+     * sleep states.
+     *
+     * The property is not notified.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MAIN_LOOP_WAKEUPS,
+         g_param_spec_uint64("main-loop-wakeups",
+                             "Main loop wakeups",
+                             "Iterations of the default main loop",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     g_type_class_add_private(klass, sizeof(SpiceSessionPrivate));
 }
 
@@ -1471,6 +2125,11 @@ SpiceSession *spice_session_new_from_session(SpiceSession *session)
                  "enable-audio", &c->audio,
                  "enable-usbredir", &c->usbredir,
                  "ca", &c->ca,
+                 "compress-channels", &c->compress_channels,
+                 "keepalive-timeout", &c->keepalive_timeout,
+                 "compression-policy", &c->compression_policy,
+                 "proxy-pipelining", &c->proxy_pipelining,
+                 "memory-budget", &c->memory_budget,
                  NULL);
 
     c->client_provided_sockets = s->client_provided_sockets;
@@ -1482,46 +2141,155 @@ SpiceSession *spice_session_new_from_session(SpiceSession *session)
     return copy;
 }
 
-/**
- * spice_session_connect:
- * @session:
- *
- * Open the session using the #SpiceSession:host and
- * #SpiceSession:port.
- *
- * Returns: %FALSE if the connection failed.
- **/
-gboolean spice_session_connect(SpiceSession *session)
+/* main context */
+static void session_preconnect_finish(SpiceSession *session)
 {
-    SpiceSessionPrivate *s;
+    SpiceSessionPrivate *s = session->priv;
+    GArray *deferred = s->preconnect_deferred;
+    guint i;
 
-    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+    SPICE_DEBUG("preconnected session attached, %u more channels", deferred->len);
+    s->preconnect_deferred = g_array_new(FALSE, FALSE, sizeof(struct deferred_channel));
+    session_preconnect_clear(session);
 
-    s = session->priv;
-    g_return_val_if_fail(!s->disconnecting, FALSE);
+    for (i = 0; i < deferred->len; i++) {
+        struct deferred_channel *d = &g_array_index(deferred, struct deferred_channel, i);
 
-    session_disconnect(session, TRUE);
+        if (!spice_session_reconnect_channel(session, d->type, d->id))
+            spice_channel_new(session, d->type, d->id);
+    }
+    g_array_free(deferred, TRUE);
+}
 
-    s->client_provided_sockets = FALSE;
+static gboolean session_preconnect_timeout(gpointer data)
+{
+    SpiceSession *session = data;
 
-    if (s->cmain == NULL)
-        s->cmain = spice_channel_new(session, SPICE_CHANNEL_MAIN, 0);
+    SPICE_DEBUG("preconnected session not attached, disconnecting");
+    session->priv->preconnect_timeout_id = 0;
+    spice_session_disconnect(session);
 
-    glz_decoder_window_clear(s->glz_window);
-    return spice_channel_connect(s->cmain);
+    return FALSE;
 }
 
-/**
- * spice_session_open_fd:
- * @session:
- * @fd: a file descriptor (socket) or -1
- *
- * Open the session using the provided @fd socket file
- * descriptor. This is useful if you create the fd yourself, for
- * example to setup a SSH tunnel.
- *
- * Note however that additional sockets will be needed by all the channels
- * created for @session so users of this API should hook into
+/* the channels a user sees and acts on first */
+static gboolean is_fast_path_channel(gint type, gint id)
+{
+    switch (type) {
+    case SPICE_CHANNEL_MAIN:
+    case SPICE_CHANNEL_DISPLAY:
+    case SPICE_CHANNEL_INPUTS:
+    case SPICE_CHANNEL_CURSOR:
+        return id == 0;
+    default:
+        return FALSE;
+    }
+}
+
+/* main context: %TRUE if the channel is created once the session is attached */
+G_GNUC_INTERNAL
+gboolean spice_session_defer_channel(SpiceSession *session, gint type, gint id)
+{
+    SpiceSessionPrivate *s;
+    struct deferred_channel d = { type, id };
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    s = session->priv;
+    if (!s->preconnect || is_fast_path_channel(type, id))
+        return FALSE;
+
+    g_array_append_val(s->preconnect_deferred, d);
+    return TRUE;
+}
+
+/**
+ * spice_session_preconnect:
+ * @session: a #SpiceSession
+ * @timeout: seconds before an unused session is disconnected, 0 for none
+ *
+ * Opens the session ahead of its use, like spice_session_connect(), but
+ * only the main channel, the first display, the inputs and the cursor
+ * channels are connected: they are authenticated, and the display
+ * keeps drawing its surfaces without a #SpiceDisplay.
+ *
+ * Calling spice_session_connect() on the preconnected session attaches
+ * it: the other channels are connected, and a #SpiceDisplay created
+ * then shows the desktop right away. If that does not happen within
+ * @timeout seconds, the session is disconnected.
+ *
+ * Returns: %FALSE if the connection failed.
+ * Since: 0.29
+ **/
+gboolean spice_session_preconnect(SpiceSession *session, guint timeout)
+{
+    SpiceSessionPrivate *s;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    s = session->priv;
+    /* a new connection, even if already preconnected */
+    session_preconnect_clear(session);
+    if (!spice_session_connect(session))
+        return FALSE;
+
+    s->preconnect = TRUE;
+    if (timeout > 0)
+        s->preconnect_timeout_id =
+            g_timeout_add_seconds(timeout, session_preconnect_timeout, session);
+
+    return TRUE;
+}
+
+/**
+ * spice_session_connect:
+ * @session:
+ *
+ * Open the session using the #SpiceSession:host and
+ * #SpiceSession:port. A session opened with spice_session_preconnect()
+ * is attached instead, keeping its connection.
+ *
+ * Returns: %FALSE if the connection failed.
+ **/
+gboolean spice_session_connect(SpiceSession *session)
+{
+    SpiceSessionPrivate *s;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    s = session->priv;
+    g_return_val_if_fail(!s->disconnecting, FALSE);
+
+    if (s->preconnect && s->cmain != NULL &&
+        s->cmain->priv->state != SPICE_CHANNEL_STATE_UNCONNECTED) {
+        session_preconnect_finish(session);
+        return TRUE;
+    }
+
+    session_disconnect(session, TRUE);
+
+    s->client_provided_sockets = FALSE;
+    s->connect_time = g_get_monotonic_time();
+    memset(s->startup_us, 0, sizeof(s->startup_us));
+
+    if (s->cmain == NULL)
+        s->cmain = spice_channel_new(session, SPICE_CHANNEL_MAIN, 0);
+
+    glz_decoder_window_clear(s->glz_window);
+    return spice_channel_connect(s->cmain);
+}
+
+/**
+ * spice_session_open_fd:
+ * @session:
+ * @fd: a file descriptor (socket) or -1
+ *
+ * Open the session using the provided @fd socket file
+ * descriptor. This is useful if you create the fd yourself, for
+ * example to setup a SSH tunnel.
+ *
+ * Note however that additional sockets will be needed by all the channels
+ * created for @session so users of this API should hook into
  * SpiceChannel::open-fd signal for each channel they are interested in, and
  * create and pass a new socket to the channel using #spice_channel_open_fd, in
  * the signal callback.
@@ -1544,6 +2312,8 @@ gboolean spice_session_open_fd(SpiceSession *session, int fd)
     g_return_val_if_fail(!s->disconnecting, FALSE);
 
     session_disconnect(session, TRUE);
+    s->connect_time = g_get_monotonic_time();
+    memset(s->startup_us, 0, sizeof(s->startup_us));
 
     s->client_provided_sockets = TRUE;
 
@@ -1554,6 +2324,180 @@ gboolean spice_session_open_fd(SpiceSession *session, int fd)
     return spice_channel_open_fd(s->cmain, fd);
 }
 
+/**
+ * spice_session_add_channel_fd:
+ * @session: a #SpiceSession
+ * @type: the channel type, a #SPICE_CHANNEL_TYPE
+ * @id: the channel id
+ * @fd: a socket connected to the server
+ * @tls: whether @fd is connected to the TLS port
+ *
+ * Give @session a socket already connected to the server, for the
+ * channel @type and @id, as a launcher that resolved the host and
+ * connected to it can do. The channel uses it for its first
+ * connection, instead of connecting by itself. The other channels,
+ * and the reconnections, are connected the usual way, with the
+ * session host and ports. The session takes the ownership of @fd.
+ *
+ * The link and authentication of the channel are still done by the
+ * client, on @fd.
+ *
+ * On Windows, @fd is a SOCKET handle of the process, for example one
+ * inherited from the launcher.
+ *
+ * Returns: %FALSE if there is already a socket for that channel.
+ *
+ * Since: 0.29
+ **/
+gboolean spice_session_add_channel_fd(SpiceSession *session, gint type, gint id,
+                                      int fd, gboolean tls)
+{
+    SpiceSessionPrivate *s;
+    ChannelFd *cfd;
+    GList *l;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+    g_return_val_if_fail(fd >= 0, FALSE);
+
+    s = session->priv;
+    for (l = s->channel_fds; l != NULL; l = l->next) {
+        cfd = l->data;
+        if (cfd->type == type && cfd->id == id)
+            return FALSE;
+    }
+
+    cfd = g_new0(ChannelFd, 1);
+    cfd->type = type;
+    cfd->id = id;
+    cfd->fd = fd;
+    cfd->tls = tls;
+    s->channel_fds = g_list_prepend(s->channel_fds, cfd);
+
+    return TRUE;
+}
+
+/* the socket given for that channel, or -1 */
+G_GNUC_INTERNAL
+int spice_session_take_channel_fd(SpiceSession *session, gint type, gint id,
+                                  gboolean *tls)
+{
+    SpiceSessionPrivate *s = session->priv;
+    ChannelFd *cfd;
+    GList *l;
+    int fd;
+
+    for (l = s->channel_fds; l != NULL; l = l->next) {
+        cfd = l->data;
+        if (cfd->type != type || cfd->id != id)
+            continue;
+
+        fd = cfd->fd;
+        *tls = cfd->tls;
+        s->channel_fds = g_list_delete_link(s->channel_fds, l);
+        g_free(cfd);
+        return fd;
+    }
+
+    return -1;
+}
+
+#ifdef HAVE_LIBURING
+/* the io_uring of the channel sockets, or NULL if it is not available */
+G_GNUC_INTERNAL
+SpiceUring *spice_session_get_uring(SpiceSession *session)
+{
+    SpiceSessionPrivate *s;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    s = session->priv;
+    if (!s->uring_tried) {
+        s->uring_tried = TRUE;
+        if (g_getenv("SPICE_DISABLE_IO_URING") == NULL)
+            s->uring = spice_uring_new();
+        SPICE_DEBUG("channel sockets: %s", s->uring ? "io_uring" : "polled");
+    }
+
+    return s->uring;
+}
+#endif
+
+G_GNUC_INTERNAL
+gboolean spice_session_get_compress_channel(SpiceSession *session, gint type)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    SpiceSessionPrivate *s = session->priv;
+
+    return spice_strv_contains(s->compress_channels, "all") ||
+        spice_strv_contains(s->compress_channels, spice_channel_type_to_string(type));
+}
+
+G_GNUC_INTERNAL
+guint spice_session_get_keepalive_timeout(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), 0);
+
+    return session->priv->keepalive_timeout;
+}
+
+/* main context */
+static gboolean bandwidth_notify(gpointer data)
+{
+    SpiceSession *session = data;
+
+    session->priv->bandwidth_notify_id = 0;
+    g_object_notify(G_OBJECT(session), "bandwidth");
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * @rate is the rate of a read burst of a channel, in bytes/s. A burst
+ * is at most as fast as the link, the estimate rises quickly toward
+ * the faster ones and falls slowly with the others.
+ */
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_session_sample_bandwidth(SpiceSession *session, guint64 rate)
+{
+    SpiceSessionPrivate *s;
+    guint64 delta;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    s = session->priv;
+    if (s->bandwidth == 0)
+        s->bandwidth = rate;
+    else if (rate > s->bandwidth)
+        s->bandwidth += (rate - s->bandwidth) / 2;
+    else
+        s->bandwidth -= (s->bandwidth - rate) / 16;
+
+    delta = s->bandwidth > s->bandwidth_notified ?
+        s->bandwidth - s->bandwidth_notified : s->bandwidth_notified - s->bandwidth;
+    if (delta > s->bandwidth_notified / 8 && s->bandwidth_notify_id == 0) {
+        s->bandwidth_notified = s->bandwidth;
+        s->bandwidth_notify_id = g_idle_add(bandwidth_notify, session);
+    }
+}
+
+G_GNUC_INTERNAL
+guint64 spice_session_get_bandwidth(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), 0);
+
+    return session->priv->bandwidth;
+}
+
+G_GNUC_INTERNAL
+SpiceSessionCompressionPolicy spice_session_get_compression_policy(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), SPICE_SESSION_COMPRESSION_POLICY_SERVER);
+
+    return session->priv->compression_policy;
+}
+
 G_GNUC_INTERNAL
 gboolean spice_session_get_client_provided_socket(SpiceSession *session)
 {
@@ -1572,6 +2516,182 @@ static void cache_clear_all(SpiceSession *self)
     glz_decoder_window_clear(s->glz_window);
 }
 
+#define RECONNECT_RETRY_MS 1000
+
+/* main context */
+static gboolean reconnect_expired(gpointer data)
+{
+    SpiceSession *session = data;
+    SpiceSessionPrivate *s = session->priv;
+    SpiceChannel *cmain = s->cmain;
+    GList *channels = s->reconnect_channels, *l;
+
+    s->reconnect_id = 0;
+    if (s->reconnect_retry_id != 0) {
+        g_source_remove(s->reconnect_retry_id);
+        s->reconnect_retry_id = 0;
+    }
+    s->reconnect_channels = NULL;
+
+    if (cmain != NULL && !s->reconnect_main &&
+        cmain->priv->state == SPICE_CHANNEL_STATE_READY) {
+        SPICE_DEBUG("session: reconnected, %u channels left behind",
+                    g_list_length(channels));
+        /* the server no longer has them */
+        for (l = channels; l != NULL; l = l->next)
+            spice_session_channel_destroy(session, l->data);
+        g_list_free(channels);
+        return FALSE;
+    }
+
+    SPICE_DEBUG("session: could not reconnect within %u s", s->reconnect_grace);
+    s->reconnect_main = FALSE;
+    s->reconnect_main_lost = FALSE;
+    for (l = channels; l != NULL; l = l->next)
+        g_signal_emit_by_name(l->data, "channel-event", SPICE_CHANNEL_ERROR_IO);
+    g_list_free(channels);
+
+    if (cmain == NULL)
+        return FALSE;
+    if (cmain->priv->state == SPICE_CHANNEL_STATE_UNCONNECTED)
+        g_signal_emit_by_name(cmain, "channel-event", SPICE_CHANNEL_ERROR_IO);
+    else
+        spice_channel_disconnect(cmain, SPICE_CHANNEL_ERROR_IO);
+
+    return FALSE;
+}
+
+/* main context */
+static gboolean reconnect_retry(gpointer data)
+{
+    SpiceSession *session = data;
+    SpiceSessionPrivate *s = session->priv;
+
+    s->reconnect_retry_id = 0;
+
+    if (s->reconnect_main) {
+        if (s->cmain != NULL &&
+            s->cmain->priv->state == SPICE_CHANNEL_STATE_UNCONNECTED) {
+            CHANNEL_DEBUG(s->cmain, "reconnecting with connection id %d",
+                          s->connection_id);
+            spice_channel_connect(s->cmain);
+        }
+    } else if (!s->reconnect_main_lost) {
+        /* the main channel is still up, the others can come back right
+         * away, otherwise they wait for the new list of channels */
+        while (s->reconnect_channels != NULL) {
+            SpiceChannel *channel = s->reconnect_channels->data;
+
+            s->reconnect_channels = g_list_delete_link(s->reconnect_channels,
+                                                       s->reconnect_channels);
+            spice_channel_connect(channel);
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Called when @channel stopped with @event: returns %TRUE if the session
+ * reconnects it, and the event should not be reported.
+ */
+/* main context */
+G_GNUC_INTERNAL
+gboolean spice_session_channel_lost(SpiceSession *session, SpiceChannel *channel,
+                                    SpiceChannelEvent event)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    SpiceSessionPrivate *s = session->priv;
+    gboolean reconnecting = s->reconnect_id != 0;
+
+    if (s->reconnect_grace == 0 || s->disconnecting ||
+        s->client_provided_sockets ||
+        s->migration_state != SPICE_SESSION_MIGRATION_NONE)
+        return FALSE;
+
+    /* an established connection broke, or another attempt failed */
+    if (event != SPICE_CHANNEL_ERROR_IO &&
+        !(reconnecting && (event == SPICE_CHANNEL_ERROR_CONNECT ||
+                           event == SPICE_CHANNEL_ERROR_LINK)))
+        return FALSE;
+
+    if (!reconnecting) {
+        if (s->connection_id == 0)
+            return FALSE;
+        SPICE_DEBUG("session: connection lost, reconnecting within %u s",
+                    s->reconnect_grace);
+        s->reconnect_id = g_timeout_add_seconds(s->reconnect_grace,
+                                                reconnect_expired, session);
+    }
+
+    if (channel == s->cmain) {
+        s->reconnect_main = TRUE;
+        s->reconnect_main_lost = TRUE;
+    } else if (g_list_find(s->reconnect_channels, channel) == NULL) {
+        s->reconnect_channels = g_list_prepend(s->reconnect_channels, channel);
+    }
+
+    if (s->reconnect_retry_id == 0)
+        s->reconnect_retry_id = g_timeout_add(RECONNECT_RETRY_MS,
+                                              reconnect_retry, session);
+
+    return TRUE;
+}
+
+/*
+ * The main channel is linked again. The server echoes any connection id
+ * it is given, which says nothing of what it still has: the cached
+ * images and Glz dictionary may refer to data it forgot, so they go.
+ */
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_session_main_reconnected(SpiceSession *session, int connection_id)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
+
+    if (!s->reconnect_main)
+        return;
+
+    s->reconnect_main = FALSE;
+    SPICE_DEBUG("session: reconnected with connection id %d, flushing the caches",
+                connection_id);
+    cache_clear_all(session);
+}
+
+/*
+ * The server lists the channel @type:@id: returns %TRUE if an existing
+ * channel waiting for the main channel is reconnected, %FALSE if a new
+ * one should be created.
+ */
+/* main context */
+G_GNUC_INTERNAL
+gboolean spice_session_reconnect_channel(SpiceSession *session, gint type, gint id)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    SpiceSessionPrivate *s = session->priv;
+    SpiceChannel *channel = NULL;
+    GList *l;
+
+    for (l = s->reconnect_channels; l != NULL; l = l->next) {
+        if (spice_channel_get_channel_type(l->data) == type &&
+            spice_channel_get_channel_id(l->data) == id) {
+            channel = l->data;
+            break;
+        }
+    }
+    if (channel == NULL)
+        return FALSE;
+
+    s->reconnect_channels = g_list_delete_link(s->reconnect_channels, l);
+    spice_channel_connect(channel);
+
+    return TRUE;
+}
+
 G_GNUC_INTERNAL
 void spice_session_switching_disconnect(SpiceSession *self)
 {
@@ -1763,6 +2883,7 @@ static gboolean after_main_init(gpointer data)
 
         spice_session_channel_migrate(self, channel);
         channel->priv->state = SPICE_CHANNEL_STATE_READY;
+        g_coroutine_condition_signal(&channel->priv->waiters);
         spice_channel_up(channel);
     }
 
@@ -1945,6 +3066,7 @@ gboolean spice_session_has_channel_type(SpiceSession *session, gint type)
 /* private functions                                                  */
 
 typedef struct spice_open_host spice_open_host;
+typedef struct spice_connect_attempt spice_connect_attempt;
 
 struct spice_open_host {
     struct coroutine *from;
@@ -1956,8 +3078,25 @@ struct spice_open_host {
     GError *error;
     GSocketConnection *connection;
     GSocketClient *client;
+    gboolean cached; /* connecting to the session address */
+
+    /* the connections raced to the addresses of each family */
+    spice_connect_attempt *attempts[2];
+    guint race_id;
+};
+
+/* the second family is tried if the first didn't connect in that time */
+#define CONNECT_RACE_DELAY_MS 250
+
+struct spice_connect_attempt {
+    spice_open_host *open_host; /* NULL once another one connected */
+    GList *addresses; /* GInetAddress, the next ones to try */
+    GCancellable *cancellable;
+    gboolean started;
 };
 
+static void open_host_lookup(spice_open_host *open_host);
+
 static void socket_client_connect_ready(GObject *source_object, GAsyncResult *result,
                                         gpointer data)
 {
@@ -1969,6 +3108,16 @@ static void socket_client_connect_ready(GObject *source_object, GAsyncResult *re
     connection = g_socket_client_connect_finish(client, result, &open_host->error);
     if (connection == NULL) {
         g_warn_if_fail(open_host->error != NULL);
+        if (open_host->cached) {
+            /* the address may be stale, resolve it again */
+            CHANNEL_DEBUG(open_host->channel, "session address failed: %s",
+                          open_host->error->message);
+            g_clear_error(&open_host->error);
+            g_clear_object(&open_host->session->priv->connect_address);
+            open_host->cached = FALSE;
+            open_host_lookup(open_host);
+            return;
+        }
         goto end;
     }
 
@@ -1988,6 +3137,209 @@ static void open_host_connectable_connect(spice_open_host *open_host, GSocketCon
                                   socket_client_connect_ready, open_host);
 }
 
+static void connect_attempt_free(spice_connect_attempt *attempt)
+{
+    g_list_free_full(attempt->addresses, g_object_unref);
+    g_object_unref(attempt->cancellable);
+    g_slice_free(spice_connect_attempt, attempt);
+}
+
+static void connect_attempt_next(spice_connect_attempt *attempt);
+
+static gboolean connect_race_timeout(gpointer data)
+{
+    spice_open_host *open_host = data;
+
+    open_host->race_id = 0;
+    CHANNEL_DEBUG(open_host->channel, "no connection yet, racing the other family");
+    connect_attempt_next(open_host->attempts[1]);
+
+    return FALSE;
+}
+
+/* main context */
+static void connect_race_end(spice_open_host *open_host)
+{
+    guint i;
+
+    if (open_host->race_id) {
+        g_source_remove(open_host->race_id);
+        open_host->race_id = 0;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(open_host->attempts); i++) {
+        spice_connect_attempt *attempt = open_host->attempts[i];
+
+        if (attempt == NULL)
+            continue;
+        open_host->attempts[i] = NULL;
+        attempt->open_host = NULL;
+        if (attempt->started) {
+            /* freed when it returns */
+            g_cancellable_cancel(attempt->cancellable);
+        } else {
+            connect_attempt_free(attempt);
+        }
+    }
+
+    coroutine_yieldto(open_host->from, NULL);
+}
+
+static void connect_attempt_ready(GObject *source_object, GAsyncResult *result,
+                                  gpointer data)
+{
+    spice_connect_attempt *attempt = data;
+    spice_open_host *open_host = attempt->open_host;
+    GSocketConnection *connection;
+    GError *error = NULL;
+    guint i;
+
+    attempt->started = FALSE;
+    connection = g_socket_client_connect_finish(G_SOCKET_CLIENT(source_object),
+                                                result, &error);
+    if (open_host == NULL) {
+        /* another one connected */
+        g_clear_object(&connection);
+        g_clear_error(&error);
+        connect_attempt_free(attempt);
+        return;
+    }
+
+    if (connection != NULL) {
+        /* the failures of the other addresses don't matter anymore */
+        g_clear_error(&open_host->error);
+        open_host->connection = connection;
+        connect_race_end(open_host);
+        return;
+    }
+
+    CHANNEL_DEBUG(open_host->channel, "connect failed: %s", error->message);
+    g_clear_error(&open_host->error);
+    open_host->error = error;
+    if (attempt->addresses != NULL) {
+        connect_attempt_next(attempt);
+        return;
+    }
+
+    /* this family is done with, the other one goes on, or starts now */
+    for (i = 0; i < G_N_ELEMENTS(open_host->attempts); i++) {
+        if (open_host->attempts[i] == attempt) {
+            open_host->attempts[i] = NULL;
+            connect_attempt_free(attempt);
+        }
+    }
+    if (open_host->attempts[1] != NULL && !open_host->attempts[1]->started) {
+        if (open_host->race_id) {
+            g_source_remove(open_host->race_id);
+            open_host->race_id = 0;
+        }
+        connect_attempt_next(open_host->attempts[1]);
+        return;
+    }
+    if (open_host->attempts[0] == NULL && open_host->attempts[1] == NULL)
+        connect_race_end(open_host);
+}
+
+/* main context */
+static void connect_attempt_next(spice_connect_attempt *attempt)
+{
+    spice_open_host *open_host = attempt->open_host;
+    GInetAddress *address = attempt->addresses->data;
+    GSocketAddress *sockaddr;
+
+    attempt->addresses = g_list_delete_link(attempt->addresses, attempt->addresses);
+    sockaddr = g_inet_socket_address_new(address, open_host->port);
+    g_object_unref(address);
+
+    CHANNEL_DEBUG(open_host->channel, "connecting %p...", attempt);
+    attempt->started = TRUE;
+    g_socket_client_connect_async(open_host->client, G_SOCKET_CONNECTABLE(sockaddr),
+                                  attempt->cancellable,
+                                  connect_attempt_ready, attempt);
+    g_object_unref(sockaddr);
+}
+
+static spice_connect_attempt *connect_attempt_new(spice_open_host *open_host)
+{
+    spice_connect_attempt *attempt = g_slice_new0(spice_connect_attempt);
+
+    attempt->open_host = open_host;
+    attempt->cancellable = g_cancellable_new();
+
+    return attempt;
+}
+
+/* main context */
+static void host_lookup_ready(GObject *source_object, GAsyncResult *result,
+                              gpointer data)
+{
+    spice_open_host *open_host = data;
+    GList *addresses, *it;
+    GSocketFamily first;
+    guint i;
+
+    addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source_object),
+                                                 result, &open_host->error);
+    if (addresses == NULL || open_host->error) {
+        coroutine_yieldto(open_host->from, NULL);
+        return;
+    }
+
+    /* the resolver sorted them, the first family goes first */
+    first = g_inet_address_get_family(addresses->data);
+    for (i = 0; i < G_N_ELEMENTS(open_host->attempts); i++)
+        open_host->attempts[i] = connect_attempt_new(open_host);
+    for (it = addresses; it != NULL; it = it->next) {
+        i = g_inet_address_get_family(it->data) == first ? 0 : 1;
+        open_host->attempts[i]->addresses =
+            g_list_append(open_host->attempts[i]->addresses, g_object_ref(it->data));
+    }
+    g_resolver_free_addresses(addresses);
+
+    if (open_host->attempts[1]->addresses == NULL) {
+        connect_attempt_free(open_host->attempts[1]);
+        open_host->attempts[1] = NULL;
+    } else {
+        open_host->race_id = g_timeout_add(CONNECT_RACE_DELAY_MS,
+                                           connect_race_timeout, open_host);
+    }
+    connect_attempt_next(open_host->attempts[0]);
+}
+
+/* main context */
+static void open_host_lookup(spice_open_host *open_host)
+{
+    SpiceSessionPrivate *s = open_host->session->priv;
+
+    SPICE_DEBUG("open host %s:%d", s->host, open_host->port);
+    g_resolver_lookup_by_name_async(g_resolver_get_default(), s->host,
+                                    open_host->cancellable,
+                                    host_lookup_ready, open_host);
+}
+
+/* main context */
+static void proxy_connect(spice_open_host *open_host, GInetAddress *proxy_address)
+{
+    SpiceSessionPrivate *s = open_host->session->priv;
+    GSocketAddress *address;
+    gchar *protocol;
+
+    /* the pipelined variants of the proxies are registered on their own */
+    protocol = g_strconcat(spice_uri_get_scheme(open_host->proxy),
+                           s->proxy_pipelining ? WOCKY_HTTP_PROXY_PIPELINED_SUFFIX : "",
+                           NULL);
+    address = g_proxy_address_new(proxy_address,
+                                  spice_uri_get_port(open_host->proxy),
+                                  protocol,
+                                  s->host, open_host->port,
+                                  spice_uri_get_user(open_host->proxy),
+                                  spice_uri_get_password(open_host->proxy));
+
+    open_host_connectable_connect(open_host, G_SOCKET_CONNECTABLE(address));
+    g_object_unref(address);
+    g_free(protocol);
+}
+
 /* main context */
 static void proxy_lookup_ready(GObject *source_object, GAsyncResult *result,
                                gpointer data)
@@ -1995,8 +3347,7 @@ static void proxy_lookup_ready(GObject *source_object, GAsyncResult *result,
     spice_open_host *open_host = data;
     SpiceSession *session = open_host->session;
     SpiceSessionPrivate *s = session->priv;
-    GList *addresses = NULL, *it;
-    GSocketAddress *address;
+    GList *addresses = NULL;
 
     SPICE_DEBUG("proxy lookup ready");
     addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source_object),
@@ -2007,20 +3358,14 @@ static void proxy_lookup_ready(GObject *source_object, GAsyncResult *result,
         return;
     }
 
-    for (it = addresses; it != NULL; it = it->next) {
-        address = g_proxy_address_new(G_INET_ADDRESS(it->data),
-                                      spice_uri_get_port(open_host->proxy),
-                                      spice_uri_get_scheme(open_host->proxy),
-                                      s->host, open_host->port,
-                                      spice_uri_get_user(open_host->proxy),
-                                      spice_uri_get_password(open_host->proxy));
-        if (address != NULL)
-            break;
-    }
+    /* for the next channels */
+    g_free(s->proxy_host);
+    s->proxy_host = g_strdup(spice_uri_get_hostname(open_host->proxy));
+    g_clear_object(&s->proxy_address);
+    s->proxy_address = g_object_ref(addresses->data);
 
-    open_host_connectable_connect(open_host, G_SOCKET_CONNECTABLE(address));
+    proxy_connect(open_host, addresses->data);
     g_resolver_free_addresses(addresses);
-    g_object_unref(address);
 }
 
 /* main context */
@@ -2043,25 +3388,26 @@ static gboolean open_host_idle_cb(gpointer data)
     }
 
     if (open_host->proxy) {
-        g_resolver_lookup_by_name_async(g_resolver_get_default(),
-                                        spice_uri_get_hostname(open_host->proxy),
-                                        open_host->cancellable,
-                                        proxy_lookup_ready, open_host);
-    } else {
+        const gchar *proxy_host = spice_uri_get_hostname(open_host->proxy);
+
+        if (s->proxy_address && g_strcmp0(s->proxy_host, proxy_host) == 0) {
+            proxy_connect(open_host, s->proxy_address);
+        } else {
+            g_resolver_lookup_by_name_async(g_resolver_get_default(),
+                                            proxy_host,
+                                            open_host->cancellable,
+                                            proxy_lookup_ready, open_host);
+        }
+    } else if (s->unix_path) {
         GSocketConnectable *address = NULL;
 
-        if (s->unix_path) {
-            SPICE_DEBUG("open unix path %s", s->unix_path);
+        SPICE_DEBUG("open unix path %s", s->unix_path);
 #ifdef G_OS_UNIX
-            address = G_SOCKET_CONNECTABLE(g_unix_socket_address_new(s->unix_path));
+        address = G_SOCKET_CONNECTABLE(g_unix_socket_address_new(s->unix_path));
 #else
-            g_set_error_literal(&open_host->error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
-                                "Unix path unsupported on this platform");
+        g_set_error_literal(&open_host->error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                            "Unix path unsupported on this platform");
 #endif
-        } else {
-            SPICE_DEBUG("open host %s:%d", s->host, open_host->port);
-            address = g_network_address_new(s->host, open_host->port);
-        }
 
         if (address == NULL || open_host->error != NULL) {
             coroutine_yieldto(open_host->from, NULL);
@@ -2070,6 +3416,17 @@ static gboolean open_host_idle_cb(gpointer data)
 
         open_host_connectable_connect(open_host, address);
         g_object_unref(address);
+    } else if (s->connect_address && g_strcmp0(s->connect_host, s->host) == 0) {
+        GSocketAddress *address;
+
+        /* where the previous channels connected to */
+        SPICE_DEBUG("open host %s:%d, session address", s->host, open_host->port);
+        address = g_inet_socket_address_new(s->connect_address, open_host->port);
+        open_host->cached = TRUE;
+        open_host_connectable_connect(open_host, G_SOCKET_CONNECTABLE(address));
+        g_object_unref(address);
+    } else {
+        open_host_lookup(open_host);
     }
 
     if (open_host->proxy != NULL) {
@@ -2144,6 +3501,19 @@ GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceC
         g_propagate_error(error, open_host.error);
     } else if (open_host.connection != NULL) {
         GSocket *socket;
+        GSocketAddress *remote;
+
+        /* the next channels connect to the same address */
+        remote = g_socket_connection_get_remote_address(open_host.connection, NULL);
+        if (!s->proxy && !s->unix_path && G_IS_INET_SOCKET_ADDRESS(remote)) {
+            g_free(s->connect_host);
+            s->connect_host = g_strdup(s->host);
+            g_clear_object(&s->connect_address);
+            s->connect_address =
+                g_object_ref(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote)));
+        }
+        g_clear_object(&remote);
+
         socket = g_socket_connection_get_socket(open_host.connection);
         g_socket_set_timeout(socket, 0);
         g_socket_set_blocking(socket, FALSE);
@@ -2176,6 +3546,7 @@ void spice_session_channel_new(SpiceSession *session, SpiceChannel *channel)
                      "disable-wallpaper", all || spice_strv_contains(s->disable_effects, "wallpaper"),
                      "disable-font-smooth", all || spice_strv_contains(s->disable_effects, "font-smooth"),
                      "disable-animation", all || spice_strv_contains(s->disable_effects, "animation"),
+                     "disable-effects-auto", spice_strv_contains(s->disable_effects, "auto"),
                      NULL);
         if (s->color_depth != 0)
             g_object_set(channel, "color-depth", s->color_depth, NULL);
@@ -2201,6 +3572,7 @@ static void spice_session_channel_destroy(SpiceSession *session, SpiceChannel *c
 
     if (s->migration_left)
         s->migration_left = g_list_remove(s->migration_left, channel);
+    s->reconnect_channels = g_list_remove(s->reconnect_channels, channel);
 
     for (ring = ring_get_head(&s->channels); ring != NULL;
          ring = ring_next(&s->channels, ring)) {
@@ -2246,6 +3618,35 @@ int spice_session_get_connection_id(SpiceSession *session)
     return s->connection_id;
 }
 
+/*
+ * The mm time of the server is estimated from its samples, the
+ * SPICE_MSG_MAIN_MULTI_MEDIA_TIME messages and the playback latency,
+ * with a clock running at the rate of the server one. A sample that is
+ * off by less than MM_TIME_SLEW_THRESH is jitter, or drift: the clock
+ * takes a part of the difference and catches up slowly, and the drift
+ * is corrected by a part of the difference per elapsed time. The clock
+ * is only stepped, and mm-time-reset emitted, by larger differences.
+ */
+#define MM_TIME_DIFF_RESET_THRESH 500 // 0.5 sec
+#define MM_TIME_SLEW_THRESH 100
+#define MM_TIME_SLEW_RATE 0.05 /* of the elapsed time */
+#define MM_TIME_GAIN 0.25
+#define MM_TIME_DRIFT_GAIN 0.05
+#define MM_TIME_DRIFT_MAX 0.005
+
+static gint64 session_mm_time_elapsed(SpiceSessionPrivate *s, guint64 now)
+{
+    gdouble elapsed = (now - s->mm_time_at_clock) / 1000.0;
+    gdouble slew = elapsed * MM_TIME_SLEW_RATE;
+
+    if (slew > ABS(s->mm_time_slew))
+        slew = ABS(s->mm_time_slew);
+    if (s->mm_time_slew < 0)
+        slew = -slew;
+
+    return elapsed * (1.0 + s->mm_time_drift) + slew;
+}
+
 G_GNUC_INTERNAL
 guint32 spice_session_get_mm_time(SpiceSession *session)
 {
@@ -2253,12 +3654,17 @@ guint32 spice_session_get_mm_time(SpiceSession *session)
 
     SpiceSessionPrivate *s = session->priv;
 
-    /* FIXME: we may want to estimate the drift of clocks, and well,
-       do something better than this trivial approach */
-    return s->mm_time + (g_get_monotonic_time() - s->mm_time_at_clock) / 1000;
+    return s->mm_time + session_mm_time_elapsed(s, g_get_monotonic_time());
 }
 
-#define MM_TIME_DIFF_RESET_THRESH 500 // 0.5 sec
+/* the deviation of the mm time samples from the clock, in ms */
+G_GNUC_INTERNAL
+guint32 spice_session_get_mm_time_error(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), 0);
+
+    return session->priv->mm_time_error + 0.5;
+}
 
 G_GNUC_INTERNAL
 void spice_session_set_mm_time(SpiceSession *session, guint32 time)
@@ -2266,16 +3672,41 @@ void spice_session_set_mm_time(SpiceSession *session, guint32 time)
     g_return_if_fail(SPICE_IS_SESSION(session));
 
     SpiceSessionPrivate *s = session->priv;
+    guint64 now = g_get_monotonic_time();
     guint32 old_time;
-
-    old_time = spice_session_get_mm_time(session);
+    gint32 diff;
+
+    old_time = s->mm_time + session_mm_time_elapsed(s, now);
+    diff = time - old_time;
+
+    if (s->mm_time_last_sample != 0 &&
+        diff < MM_TIME_SLEW_THRESH && diff > -MM_TIME_SLEW_THRESH) {
+        gdouble interval = (now - s->mm_time_last_sample) / 1000.0;
+
+        /* continue from the current estimate */
+        s->mm_time = old_time;
+        s->mm_time_at_clock = now;
+        s->mm_time_slew = diff * MM_TIME_GAIN;
+        if (interval >= 1.0)
+            s->mm_time_drift = CLAMP(s->mm_time_drift + diff * MM_TIME_DRIFT_GAIN / interval,
+                                     -MM_TIME_DRIFT_MAX, MM_TIME_DRIFT_MAX);
+        s->mm_time_error += (ABS(diff) - s->mm_time_error) / 8;
+        s->mm_time_last_sample = now;
+        SPICE_DEBUG("mm time sample: %u, off by %d ms, drift %.0f ppm, error %.1f ms",
+                    time, diff, s->mm_time_drift * 1e6, s->mm_time_error);
+        return;
+    }
 
     s->mm_time = time;
-    s->mm_time_at_clock = g_get_monotonic_time();
+    s->mm_time_at_clock = now;
+    s->mm_time_slew = 0;
+    s->mm_time_last_sample = now;
     SPICE_DEBUG("set mm time: %u", spice_session_get_mm_time(session));
     if (time > old_time + MM_TIME_DIFF_RESET_THRESH ||
         time < old_time) {
         SPICE_DEBUG("%s: mm-time-reset, old %u, new %u", __FUNCTION__, old_time, s->mm_time);
+        s->mm_time_drift = 0;
+        s->mm_time_error = 0;
         g_coroutine_signal_emit(session, signals[SPICE_SESSION_MM_TIME_RESET], 0);
     }
 }
@@ -2404,6 +3835,127 @@ const gchar* spice_session_get_ca_file(SpiceSession *session)
     return s->ca_file;
 }
 
+/* returns the SSL_CTX of the session TLS channels, or the one of
+ * another session with the same settings, or NULL */
+G_GNUC_INTERNAL
+SSL_CTX *spice_session_get_ssl_ctx(SpiceSession *session, gboolean *ca_loaded)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->ssl_ctx == NULL && shared_ssl_ctxs != NULL) {
+        gchar *key = session_ssl_ctx_key(s);
+        SharedSslCtx *shared = g_hash_table_lookup(shared_ssl_ctxs, key);
+
+        if (shared != NULL)
+            session_use_shared_ssl_ctx(s, key, shared);
+        g_free(key);
+    }
+
+    *ca_loaded = s->ssl_ca_loaded;
+    return s->ssl_ctx;
+}
+
+/* takes @ctx, the channels free their SSL only */
+G_GNUC_INTERNAL
+void spice_session_set_ssl_ctx(SpiceSession *session, SSL_CTX *ctx, gboolean ca_loaded)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
+
+    session_clear_tls(s);
+    s->ssl_ctx = ctx;
+    s->ssl_ca_loaded = ca_loaded;
+
+    if (shared_ssl_ctxs == NULL)
+        shared_ssl_ctxs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)shared_ssl_ctx_free);
+    s->ssl_ctx_key = session_ssl_ctx_key(s);
+    if (!g_hash_table_lookup(shared_ssl_ctxs, s->ssl_ctx_key)) {
+        SharedSslCtx *shared = g_slice_new0(SharedSslCtx);
+
+        shared->ctx = ctx;
+        shared->ca_loaded = ca_loaded;
+        shared->users = 1;
+        g_hash_table_insert(shared_ssl_ctxs, g_strdup(s->ssl_ctx_key), shared);
+    } else {
+        /* another session made one meanwhile, this one is not shared */
+        g_clear_pointer(&s->ssl_ctx_key, g_free);
+    }
+}
+
+/* @session connects with the CA already loaded for @from */
+G_GNUC_INTERNAL
+void spice_session_share_ssl_ctx(SpiceSession *session, SpiceSession *from)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+    g_return_if_fail(SPICE_IS_SESSION(from));
+
+    SpiceSessionPrivate *s = session->priv;
+    SpiceSessionPrivate *f = from->priv;
+
+    /* the CA is only loaded when the certificate is verified */
+    if (f->ssl_ctx == NULL || !f->ssl_ca_loaded)
+        return;
+
+    session_clear_tls(s);
+    if (f->ssl_ctx_key) {
+        session_use_shared_ssl_ctx(s, f->ssl_ctx_key,
+                                   g_hash_table_lookup(shared_ssl_ctxs, f->ssl_ctx_key));
+        return;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    SSL_CTX_up_ref(f->ssl_ctx);
+#else
+    CRYPTO_add(&f->ssl_ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif
+    s->ssl_ctx = f->ssl_ctx;
+    s->ssl_ca_loaded = TRUE;
+}
+
+static gchar *session_tls_server(SpiceSessionPrivate *s)
+{
+    return g_strdup_printf("%s:%s", s->host, s->tls_port);
+}
+
+/* returns the TLS session to resume with the current server, or NULL */
+G_GNUC_INTERNAL
+SSL_SESSION *spice_session_get_ssl_session(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+    SSL_SESSION *ssl_session = NULL;
+    gchar *server;
+
+    if (s->ssl_session == NULL)
+        return NULL;
+
+    server = session_tls_server(s);
+    if (g_strcmp0(server, s->ssl_session_server) == 0)
+        ssl_session = s->ssl_session;
+    g_free(server);
+
+    return ssl_session;
+}
+
+/* takes @ssl_session, negotiated with the current server */
+G_GNUC_INTERNAL
+void spice_session_set_ssl_session(SpiceSession *session, SSL_SESSION *ssl_session)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->ssl_session)
+        SSL_SESSION_free(s->ssl_session);
+    s->ssl_session = ssl_session;
+    g_free(s->ssl_session_server);
+    s->ssl_session_server = session_tls_server(s);
+}
+
 G_GNUC_INTERNAL
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
@@ -2419,6 +3971,121 @@ void spice_session_get_caches(SpiceSession *session,
         *glz_window = s->glz_window;
 }
 
+/*
+ * The sizes of the cache properties, the image cache shrunk first, then
+ * the Glz window, to fit the memory budget. The properties are left as
+ * they are, so the budget always applies to the same sizes.
+ */
+static void session_get_budgeted_sizes(SpiceSession *session, int *images_size,
+                                       int *glz_size)
+{
+    SpiceSessionPrivate *s = session->priv;
+    guint64 images = s->images_cache_size;
+    guint64 glz = s->glz_window_size;
+    guint64 used, left;
+
+    *images_size = images;
+    *glz_size = glz;
+    if (s->memory_budget == 0)
+        return;
+
+    used = session_get_channels_memory_usage(session);
+    left = s->memory_budget > used ? s->memory_budget - used : 0;
+    if (images + glz > left)
+        images = MAX(left > glz ? left - glz : 0, MIN(images, MIN_IMAGES_CACHE_SIZE));
+    if (images + glz > left)
+        glz = MAX(left > images ? left - images : 0, MIN(glz, MIN_GLZ_WINDOW_SIZE_DEFAULT));
+
+    if (images != (guint64)s->images_cache_size || glz != (guint64)s->glz_window_size)
+        SPICE_DEBUG("memory budget %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT
+                    " used: image cache %" G_GUINT64_FORMAT ", glz window %" G_GUINT64_FORMAT,
+                    s->memory_budget, used, images, glz);
+    *images_size = images;
+    *glz_size = glz;
+}
+
+/* the physical memory of the client, in bytes, 0 if unknown */
+static guint64 get_physical_memory(void)
+{
+#ifdef G_OS_WIN32
+    MEMORYSTATUSEX status;
+
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        return status.ullTotalPhys;
+#elif defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (pages > 0 && page_size > 0)
+        return (guint64)pages * page_size;
+#endif
+    return 0;
+}
+
+/* the pixels of the monitors, the display channels not configured yet count for one */
+static guint64 session_get_display_pixels(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    struct channel *item;
+    RingItem *ring;
+    guint64 pixels = 0;
+    guint n_displays = 0;
+
+    for (ring = ring_get_head(&s->channels); ring != NULL;
+         ring = ring_next(&s->channels, ring)) {
+        GArray *monitors = NULL;
+        guint i;
+
+        item = SPICE_CONTAINEROF(ring, struct channel, link);
+        if (!SPICE_IS_DISPLAY_CHANNEL(item->channel))
+            continue;
+
+        g_object_get(item->channel, "monitors", &monitors, NULL);
+        if (monitors == NULL)
+            continue;
+        for (i = 0; i < monitors->len; i++) {
+            SpiceDisplayMonitorConfig *mc =
+                &g_array_index(monitors, SpiceDisplayMonitorConfig, i);
+            pixels += (guint64)mc->width * mc->height;
+        }
+        if (monitors->len > 0)
+            n_displays++;
+        g_array_unref(monitors);
+    }
+
+    if (s->n_display_channels > n_displays)
+        pixels += (guint64)(s->n_display_channels - n_displays) * DEFAULT_DISPLAY_PIXELS;
+
+    return MAX(pixels, DEFAULT_DISPLAY_PIXELS);
+}
+
+/* the sizes left to the session: scaled to the displays, bounded by the client RAM */
+static void session_auto_size_caches(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    guint64 ram = get_physical_memory();
+
+    if (s->images_cache_auto) {
+        guint64 images = session_get_display_pixels(session) * 4 * IMAGES_CACHE_FRAMES;
+
+        if (ram != 0)
+            images = MIN(images, ram / IMAGES_CACHE_RAM_DIVISOR);
+        s->images_cache_size = CLAMP(images, MIN_IMAGES_CACHE_SIZE, G_MAXINT);
+    }
+
+    if (s->glz_window_auto) {
+        guint64 glz = MIN(MAX_GLZ_WINDOW_SIZE_DEFAULT, s->pci_ram_size / 2);
+
+        if (ram != 0)
+            glz = MIN(glz, ram / GLZ_WINDOW_RAM_DIVISOR);
+        s->glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE_DEFAULT, glz);
+    }
+
+    SPICE_DEBUG("caches for %" G_GUINT64_FORMAT " bytes of RAM: image cache %d, glz window %d",
+                ram, s->images_cache_size, s->glz_window_size);
+}
+
 G_GNUC_INTERNAL
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
@@ -2431,15 +4098,58 @@ void spice_session_set_caches_hints(SpiceSession *session,
     s->pci_ram_size = pci_ram_size;
     s->n_display_channels = n_display_channels;
 
-    /* TODO: when setting cache and window size, we should consider the client's
-     *       available memory and the number of display channels */
-    if (s->images_cache_size == 0) {
-        s->images_cache_size = IMAGES_CACHE_SIZE_DEFAULT;
-    }
+    session_auto_size_caches(session);
+    session_get_budgeted_sizes(session, &s->images_cache_limit, &s->glz_window_limit);
+
+    /* the server accounts 4 bytes per pixel, so it evicts no later */
+    cache_set_max_size(s->images, s->images_cache_limit);
+    glz_decoder_window_set_size_hint(s->glz_window, s->glz_window_limit);
+}
+
+/*
+ * The sizes the display channels advertise: the ones of the caches, the
+ * properties until the server gave its hints.
+ */
+G_GNUC_INTERNAL
+void spice_session_get_cache_limits(SpiceSession *session, int *images_size,
+                                    int *glz_size)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
 
-    if (s->glz_window_size == 0) {
-        s->glz_window_size = MIN(MAX_GLZ_WINDOW_SIZE_DEFAULT, pci_ram_size / 2);
-        s->glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE_DEFAULT, s->glz_window_size);
+    *images_size = s->images_cache_limit != 0 ? s->images_cache_limit : s->images_cache_size;
+    *glz_size = s->glz_window_limit != 0 ? s->glz_window_limit : s->glz_window_size;
+}
+
+/*
+ * The monitors of a display changed. The sizes are advertised by the
+ * display channels when they connect, so the new ones take effect on
+ * the next connection; until then, the caches only grow past their
+ * limits, never below what the server accounts for.
+ */
+G_GNUC_INTERNAL
+void spice_session_update_caches(SpiceSession *session)
+{
+    SpiceSessionPrivate *s;
+    int images, glz;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    s = session->priv;
+    if (s->n_display_channels == 0 || (!s->images_cache_auto && !s->glz_window_auto))
+        return;
+
+    session_auto_size_caches(session);
+    session_get_budgeted_sizes(session, &images, &glz);
+
+    if (images > s->images_cache_limit) {
+        s->images_cache_limit = images;
+        cache_set_max_size(s->images, images);
+    }
+    if (glz > s->glz_window_limit) {
+        s->glz_window_limit = glz;
+        glz_decoder_window_set_size_hint(s->glz_window, glz);
     }
 }
 
@@ -2583,8 +4293,11 @@ SpiceAudio *spice_audio_get(SpiceSession *session, GMainContext *context)
     g_static_mutex_lock(&mutex);
     self = session->priv->audio_manager;
     if (self == NULL) {
+        gint64 start = g_get_monotonic_time();
+
         self = spice_audio_new(session, context, NULL);
         session->priv->audio_manager = self;
+        spice_session_startup_took(session, SPICE_SESSION_STARTUP_AUDIO_INIT, start);
     }
     g_static_mutex_unlock(&mutex);
 
@@ -2616,9 +4329,12 @@ SpiceUsbDeviceManager *spice_usb_device_manager_get(SpiceSession *session,
     g_static_mutex_lock(&mutex);
     self = session->priv->usb_manager;
     if (self == NULL) {
+        gint64 start = g_get_monotonic_time();
+
         self = g_initable_new(SPICE_TYPE_USB_DEVICE_MANAGER, NULL, err,
                               "session", session, NULL);
         session->priv->usb_manager = self;
+        spice_session_startup_took(session, SPICE_SESSION_STARTUP_USB_INIT, start);
     }
     g_static_mutex_unlock(&mutex);
 
@@ -2649,6 +4365,54 @@ gboolean spice_session_get_smartcard_enabled(SpiceSession *session)
     return session->priv->smartcard;
 }
 
+#ifdef WEBDAV_THREAD
+static gpointer webdav_thread_run(gpointer data)
+{
+    SpiceSessionPrivate *s = data;
+
+    g_main_context_push_thread_default(s->webdav_context);
+    g_main_loop_run(s->webdav_loop);
+    g_main_context_pop_thread_default(s->webdav_context);
+
+    return NULL;
+}
+
+typedef struct WebdavProperties {
+    PhodavServer *server;
+    gchar *root;
+    gboolean read_only;
+} WebdavProperties;
+
+/* webdav thread */
+static gboolean webdav_set_properties(gpointer data)
+{
+    WebdavProperties *props = data;
+
+    g_object_set(props->server,
+                 "root", props->root,
+                 "read-only", props->read_only,
+                 NULL);
+    g_object_unref(props->server);
+    g_free(props->root);
+    g_free(props);
+
+    return FALSE;
+}
+
+/* the server is only touched from its thread */
+static void webdav_session_notify(GObject *gobject, GParamSpec *pspec, gpointer user_data)
+{
+    SpiceSession *session = SPICE_SESSION(gobject);
+    SpiceSessionPrivate *s = session->priv;
+    WebdavProperties *props = g_new0(WebdavProperties, 1);
+
+    props->server = g_object_ref(s->webdav);
+    props->root = g_strdup(spice_session_get_shared_dir(session));
+    props->read_only = s->share_dir_ro;
+    g_main_context_invoke(s->webdav_context, webdav_set_properties, props);
+}
+#endif
+
 G_GNUC_INTERNAL
 PhodavServer* spice_session_get_webdav_server(SpiceSession *session)
 {
@@ -2672,12 +4436,24 @@ PhodavServer* spice_session_get_webdav_server(SpiceSession *session)
         goto end;
 
     priv->webdav = phodav_server_new(shared_dir);
+#ifdef WEBDAV_THREAD
+    g_object_set(priv->webdav, "read-only", priv->share_dir_ro, NULL);
+    g_signal_connect(session, "notify::shared-dir",
+                     G_CALLBACK(webdav_session_notify), NULL);
+    g_signal_connect(session, "notify::share-dir-ro",
+                     G_CALLBACK(webdav_session_notify), NULL);
+
+    priv->webdav_context = g_main_context_new();
+    priv->webdav_loop = g_main_loop_new(priv->webdav_context, FALSE);
+    priv->webdav_thread = g_thread_new("webdav", webdav_thread_run, priv);
+#else
     g_object_bind_property(session,  "share-dir-ro",
                            priv->webdav, "read-only",
                            G_BINDING_SYNC_CREATE|G_BINDING_BIDIRECTIONAL);
     g_object_bind_property(session,  "shared-dir",
                            priv->webdav, "root",
                            G_BINDING_SYNC_CREATE|G_BINDING_BIDIRECTIONAL);
+#endif
 
 end:
     g_mutex_unlock(&mutex);
@@ -2686,6 +4462,123 @@ end:
     return priv->webdav;
 }
 
+#ifdef USE_PHODAV
+typedef struct WebdavAccept {
+    PhodavServer *server;
+    GIOStream *stream;
+} WebdavAccept;
+
+/* webdav thread, or main context without it */
+static gboolean webdav_accept(gpointer data)
+{
+    WebdavAccept *accept = data;
+    SoupServer *server = phodav_server_get_soup_server(accept->server);
+    GSocketAddress *addr = g_inet_socket_address_new_from_string("127.0.0.1", 0);
+    GError *error = NULL;
+
+    if (!soup_server_accept_iostream(server, accept->stream, addr, addr, &error)) {
+        g_debug("failed to accept the webdav client: %s",
+                error ? error->message : "unknown error");
+        g_clear_error(&error);
+        /* the channel sees the end of its stream */
+        g_io_stream_close(accept->stream, NULL, NULL);
+    }
+
+    g_object_unref(addr);
+    g_object_unref(accept->stream);
+    g_object_unref(accept->server);
+    g_free(accept);
+
+    return FALSE;
+}
+
+#ifdef WEBDAV_THREAD
+static GIOStream *webdav_socket_stream_new(int fd, gsize capacity, GError **error)
+{
+    GSocketConnection *conn;
+    GSocket *sock;
+    int size = capacity;
+
+    /* like the pipe, each side buffers that much */
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    sock = g_socket_new_from_fd(fd, error);
+    if (sock == NULL) {
+        close(fd);
+        return NULL;
+    }
+    conn = g_socket_connection_factory_create_connection(sock);
+    g_object_unref(sock);
+
+    return G_IO_STREAM(conn);
+}
+#endif
+#endif
+
+/*
+ * Returns a new connection to the webdav server, the channel side of
+ * it, buffering @capacity bytes each way. With a server thread, it is
+ * a socket pair: the channel and the server run unaware of each other.
+ */
+G_GNUC_INTERNAL
+GIOStream *spice_session_webdav_connect(SpiceSession *session, gsize capacity,
+                                        GError **error)
+{
+#ifdef USE_PHODAV
+    PhodavServer *server;
+    WebdavAccept *accept;
+    GIOStream *stream = NULL, *peer = NULL;
+#ifdef WEBDAV_THREAD
+    int fds[2];
+#endif
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    server = spice_session_get_webdav_server(session);
+    if (server == NULL) {
+        g_set_error_literal(error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                            "no shared folder");
+        return NULL;
+    }
+
+#ifdef WEBDAV_THREAD
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "socketpair failed: %s", g_strerror(errno));
+        return NULL;
+    }
+    stream = webdav_socket_stream_new(fds[0], capacity, error);
+    if (stream == NULL) {
+        close(fds[1]);
+        return NULL;
+    }
+    peer = webdav_socket_stream_new(fds[1], capacity, error);
+    if (peer == NULL) {
+        g_object_unref(stream);
+        return NULL;
+    }
+#else
+    spice_make_pipe_buffered(&stream, &peer, capacity);
+#endif
+
+    accept = g_new0(WebdavAccept, 1);
+    accept->server = g_object_ref(server);
+    accept->stream = peer;
+#ifdef WEBDAV_THREAD
+    g_main_context_invoke(session->priv->webdav_context, webdav_accept, accept);
+#else
+    webdav_accept(accept);
+#endif
+
+    return stream;
+#else
+    g_set_error_literal(error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                        "built without webdav support");
+    return NULL;
+#endif
+}
+
 /**
  * spice_session_is_for_migration:
  * @session: a Spice session
@@ -2705,6 +4598,105 @@ gboolean spice_session_is_for_migration(SpiceSession *session)
     return session->priv->for_migration;
 }
 
+/**
+ * spice_session_get_image_cache_stats:
+ * @session: a Spice session
+ * @hits: (out) (allow-none): lookups that found the image
+ * @misses: (out) (allow-none): lookups that did not find the image
+ * @evictions: (out) (allow-none): images evicted to stay within
+ * #SpiceSession:cache-size
+ * @bytes: (out) (allow-none): current size of the cached images
+ *
+ * Retrieve the counters of the image cache shared by the display
+ * channels of @session.
+ *
+ * Since: 0.29
+ **/
+void spice_session_get_image_cache_stats(SpiceSession *session,
+                                         guint64 *hits, guint64 *misses,
+                                         guint64 *evictions, guint64 *bytes)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    display_cache *images = session->priv->images;
+
+    if (hits)
+        *hits = images->hits;
+    if (misses)
+        *misses = images->misses;
+    if (evictions)
+        *evictions = images->evictions;
+    if (bytes)
+        *bytes = images->size;
+}
+
+/**
+ * spice_session_get_startup_times:
+ * @session: a Spice session
+ * @main_ready_us: (out) (allow-none): from the connection to the main
+ * channel being ready
+ * @first_frame_us: (out) (allow-none): from the connection to the first
+ * display update shown, see spice_display_presented()
+ * @usb_init_us: (out) (allow-none): spent creating the #SpiceUsbDeviceManager
+ * @smartcard_init_us: (out) (allow-none): spent initializing the smartcard
+ * emulation, in a thread
+ * @audio_init_us: (out) (allow-none): spent creating the #SpiceAudio
+ *
+ * Retrieve where the start of the last connection of @session went, in
+ * µs. A step that hasn't been reached, or a subsystem that wasn't used,
+ * is 0. The subsystems are only initialized once their channel appears
+ * or they are asked for.
+ *
+ * Since: 0.29
+ **/
+void spice_session_get_startup_times(SpiceSession *session,
+                                     guint64 *main_ready_us, guint64 *first_frame_us,
+                                     guint64 *usb_init_us, guint64 *smartcard_init_us,
+                                     guint64 *audio_init_us)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    guint64 *startup_us = session->priv->startup_us;
+
+    if (main_ready_us)
+        *main_ready_us = startup_us[SPICE_SESSION_STARTUP_MAIN_READY];
+    if (first_frame_us)
+        *first_frame_us = startup_us[SPICE_SESSION_STARTUP_FIRST_FRAME];
+    if (usb_init_us)
+        *usb_init_us = startup_us[SPICE_SESSION_STARTUP_USB_INIT];
+    if (smartcard_init_us)
+        *smartcard_init_us = startup_us[SPICE_SESSION_STARTUP_SMARTCARD_INIT];
+    if (audio_init_us)
+        *audio_init_us = startup_us[SPICE_SESSION_STARTUP_AUDIO_INIT];
+}
+
+/* the first time since the connection */
+G_GNUC_INTERNAL
+void spice_session_startup_reached(SpiceSession *session, SpiceSessionStartup step)
+{
+    SpiceSessionPrivate *s;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+    g_return_if_fail(step < SPICE_SESSION_STARTUP_LAST);
+
+    s = session->priv;
+    if (s->connect_time == 0 || s->startup_us[step] != 0)
+        return;
+
+    s->startup_us[step] = MAX(g_get_monotonic_time() - s->connect_time, 1);
+}
+
+/* from @start to now, any thread */
+G_GNUC_INTERNAL
+void spice_session_startup_took(SpiceSession *session, SpiceSessionStartup step,
+                                gint64 start)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+    g_return_if_fail(step < SPICE_SESSION_STARTUP_LAST);
+
+    session->priv->startup_us[step] = MAX(g_get_monotonic_time() - start, 1);
+}
+
 G_GNUC_INTERNAL
 void spice_session_set_main_channel(SpiceSession *session, SpiceChannel *channel)
 {
@@ -2715,6 +4707,31 @@ void spice_session_set_main_channel(SpiceSession *session, SpiceChannel *channel
     session->priv->cmain = channel;
 }
 
+/* the time it takes the guest to apply a monitors config */
+G_GNUC_INTERNAL
+void spice_session_monitors_config_sent(SpiceSession *session)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    session->priv->monitors_config_time = g_get_monotonic_time();
+}
+
+G_GNUC_INTERNAL
+void spice_session_primary_created(SpiceSession *session)
+{
+    SpiceSessionPrivate *s;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    s = session->priv;
+    if (s->monitors_config_time == 0)
+        return;
+
+    SPICE_DEBUG("monitors config applied in %" G_GINT64_FORMAT " ms",
+                (g_get_monotonic_time() - s->monitors_config_time) / 1000);
+    s->monitors_config_time = 0;
+}
+
 G_GNUC_INTERNAL
 gboolean spice_session_set_migration_session(SpiceSession *session, SpiceSession *mig_session)
 {
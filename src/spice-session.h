@@ -63,6 +63,23 @@ typedef enum {
     SPICE_SESSION_MIGRATION_CONNECTING,
 } SpiceSessionMigration;
 
+/**
+ * SpiceSessionCompressionPolicy:
+ * @SPICE_SESSION_COMPRESSION_POLICY_SERVER: the server picks the image
+ * compression on its own
+ * @SPICE_SESSION_COMPRESSION_POLICY_ADAPTIVE: the display channels tell
+ * the server the image compression that fits the decoding cost and the
+ * link, as they change
+ *
+ * How the image compression of the display channels is chosen.
+ *
+ * Since: 0.29
+ **/
+typedef enum {
+    SPICE_SESSION_COMPRESSION_POLICY_SERVER,
+    SPICE_SESSION_COMPRESSION_POLICY_ADAPTIVE,
+} SpiceSessionCompressionPolicy;
+
 struct _SpiceSession
 {
     GObject parent;
@@ -90,13 +107,23 @@ GType spice_session_get_type(void);
 
 SpiceSession *spice_session_new(void);
 gboolean spice_session_connect(SpiceSession *session);
+gboolean spice_session_preconnect(SpiceSession *session, guint timeout);
 gboolean spice_session_open_fd(SpiceSession *session, int fd);
+gboolean spice_session_add_channel_fd(SpiceSession *session, gint type, gint id,
+                                      int fd, gboolean tls);
 void spice_session_disconnect(SpiceSession *session);
 GList *spice_session_get_channels(SpiceSession *session);
 gboolean spice_session_has_channel_type(SpiceSession *session, gint type);
 gboolean spice_session_get_read_only(SpiceSession *session);
 SpiceURI *spice_session_get_proxy_uri(SpiceSession *session);
 gboolean spice_session_is_for_migration(SpiceSession *session);
+void spice_session_get_startup_times(SpiceSession *session,
+                                     guint64 *main_ready_us, guint64 *first_frame_us,
+                                     guint64 *usb_init_us, guint64 *smartcard_init_us,
+                                     guint64 *audio_init_us);
+void spice_session_get_image_cache_stats(SpiceSession *session,
+                                         guint64 *hits, guint64 *misses,
+                                         guint64 *evictions, guint64 *bytes);
 
 G_END_DECLS
 
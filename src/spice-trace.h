@@ -0,0 +1,56 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPICE_TRACE_H_
+# define SPICE_TRACE_H_
+
+#include "config.h"
+
+/*
+ * Static trace points, built in with --enable-systemtap. They are SDT
+ * probes of the "spice_gtk" provider, a nop when nothing is attached,
+ * and can be listed with "perf list sdt_spice_gtk:*" once
+ * "perf buildid-cache --add" has seen the library, or used from
+ * bpftrace as usdt:libspice-client-glib-2.0.so:spice_gtk:msg_recv.
+ *
+ * msg_recv (channel, type, size)    a message header was read
+ * msg_parsed (channel, type)        its payload was read and parsed
+ * msg_handled (channel, type)       its handler returned
+ * draw_start (type, image type)     a draw, and the decoding of its image
+ * draw_done (type)
+ * frame_decode_start (codec)        a stream frame, in any thread
+ * frame_decode_done (codec)
+ * frame_present (codec)             a decoded frame is put on the surface
+ * audio_data (size)                 playback data to the sink or the signal
+ * widget_paint (x, y, width, height) the area the widget repaints
+ * widget_painted (channel id)
+ */
+#ifdef ENABLE_SYSTEMTAP
+#include <sys/sdt.h>
+
+#define SPICE_TRACE1(name, a)           DTRACE_PROBE1(spice_gtk, name, a)
+#define SPICE_TRACE2(name, a, b)        DTRACE_PROBE2(spice_gtk, name, a, b)
+#define SPICE_TRACE3(name, a, b, c)     DTRACE_PROBE3(spice_gtk, name, a, b, c)
+#define SPICE_TRACE4(name, a, b, c, d)  DTRACE_PROBE4(spice_gtk, name, a, b, c, d)
+#else
+#define SPICE_TRACE1(name, a)           do { } while (0)
+#define SPICE_TRACE2(name, a, b)        do { } while (0)
+#define SPICE_TRACE3(name, a, b, c)     do { } while (0)
+#define SPICE_TRACE4(name, a, b, c, d)  do { } while (0)
+#endif
+
+#endif /* SPICE_TRACE_H_ */
@@ -0,0 +1,252 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+  Copyright (C) 2016 Red Hat, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+
+#include "spice-util.h"
+#include "spice-uring.h"
+
+/* a receive and a send per channel, at most */
+#define URING_ENTRIES 64
+
+struct SpiceUring {
+    GSource source;
+    struct io_uring ring;
+    GPollFD pollfd; /* the eventfd of the completions */
+    GQueue completed; /* SpiceUringOp, reaped and not dispatched yet */
+};
+
+static void uring_reap(SpiceUring *r)
+{
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&r->ring, &cqe) == 0) {
+        SpiceUringOp *op = io_uring_cqe_get_data(cqe);
+
+        /* the cancellations have no op */
+        if (op != NULL) {
+            op->res = cqe->res;
+            op->pending = FALSE;
+            g_queue_push_tail(&r->completed, op);
+        }
+        io_uring_cqe_seen(&r->ring, cqe);
+    }
+}
+
+static gboolean uring_ready(SpiceUring *r)
+{
+    return !g_queue_is_empty(&r->completed) || io_uring_cq_ready(&r->ring) > 0;
+}
+
+static gboolean uring_prepare(GSource *src, gint *timeout)
+{
+    SpiceUring *r = (SpiceUring *)src;
+
+    *timeout = -1;
+    /* the requests of all the channels of the last iteration, at once */
+    if (io_uring_sq_ready(&r->ring) > 0)
+        io_uring_submit(&r->ring);
+
+    return uring_ready(r);
+}
+
+static gboolean uring_check(GSource *src)
+{
+    SpiceUring *r = (SpiceUring *)src;
+
+    return (r->pollfd.revents & G_IO_IN) || uring_ready(r);
+}
+
+static gboolean uring_dispatch(GSource *src, GSourceFunc cb G_GNUC_UNUSED,
+                               gpointer data G_GNUC_UNUSED)
+{
+    SpiceUring *r = (SpiceUring *)src;
+    SpiceUringOp *op;
+    eventfd_t value;
+
+    if (r->pollfd.revents & G_IO_IN)
+        eventfd_read(r->pollfd.fd, &value);
+
+    uring_reap(r);
+    while ((op = g_queue_pop_head(&r->completed)) != NULL)
+        op->func(op, op->res, op->data);
+
+    return TRUE;
+}
+
+static GSourceFuncs uring_funcs = {
+    .prepare = uring_prepare,
+    .check = uring_check,
+    .dispatch = uring_dispatch,
+};
+
+/* main context: NULL if the kernel does not have it, or forbids it */
+G_GNUC_INTERNAL
+SpiceUring *spice_uring_new(void)
+{
+    SpiceUring *r;
+    int ret;
+
+    r = (SpiceUring *)g_source_new(&uring_funcs, sizeof(SpiceUring));
+    ret = io_uring_queue_init(URING_ENTRIES, &r->ring, 0);
+    if (ret < 0) {
+        SPICE_DEBUG("io_uring not available: %s", g_strerror(-ret));
+        g_source_unref(&r->source);
+        return NULL;
+    }
+
+    r->pollfd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->pollfd.fd < 0 ||
+        (ret = io_uring_register_eventfd(&r->ring, r->pollfd.fd)) < 0) {
+        SPICE_DEBUG("io_uring eventfd failed: %s",
+                    g_strerror(r->pollfd.fd < 0 ? errno : -ret));
+        if (r->pollfd.fd >= 0)
+            close(r->pollfd.fd);
+        io_uring_queue_exit(&r->ring);
+        g_source_unref(&r->source);
+        return NULL;
+    }
+
+    r->pollfd.events = G_IO_IN;
+    g_source_add_poll(&r->source, &r->pollfd);
+    g_queue_init(&r->completed);
+    g_source_attach(&r->source, NULL);
+
+    return r;
+}
+
+/* main context, once the channels are gone */
+G_GNUC_INTERNAL
+void spice_uring_free(SpiceUring *ring)
+{
+    g_return_if_fail(ring != NULL);
+
+    g_warn_if_fail(g_queue_is_empty(&ring->completed));
+    g_source_destroy(&ring->source);
+    io_uring_queue_exit(&ring->ring);
+    close(ring->pollfd.fd);
+    g_queue_clear(&ring->completed);
+    g_source_unref(&ring->source);
+}
+
+G_GNUC_INTERNAL
+void spice_uring_op_init(SpiceUringOp *op, SpiceUringFunc func, gpointer data)
+{
+    op->func = func;
+    op->data = data;
+    op->pending = FALSE;
+    op->res = 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(SpiceUring *r)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+
+    /* the queue is full, it can't wait for the next iteration */
+    if (sqe == NULL) {
+        io_uring_submit(&r->ring);
+        sqe = io_uring_get_sqe(&r->ring);
+    }
+
+    return sqe;
+}
+
+/* any context: @buf must stay valid until @op completes */
+G_GNUC_INTERNAL
+gboolean spice_uring_recv(SpiceUring *ring, SpiceUringOp *op,
+                          int fd, void *buf, size_t len)
+{
+    struct io_uring_sqe *sqe;
+
+    g_return_val_if_fail(!op->pending, FALSE);
+
+    sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return FALSE;
+
+    io_uring_prep_recv(sqe, fd, buf, len, 0);
+    io_uring_sqe_set_data(sqe, op);
+    op->pending = TRUE;
+
+    return TRUE;
+}
+
+/* any context: @msg and its vectors must stay valid until @op completes */
+G_GNUC_INTERNAL
+gboolean spice_uring_sendmsg(SpiceUring *ring, SpiceUringOp *op,
+                             int fd, const struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe;
+
+    g_return_val_if_fail(!op->pending, FALSE);
+
+    sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return FALSE;
+
+    io_uring_prep_sendmsg(sqe, fd, msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, op);
+    op->pending = TRUE;
+
+    return TRUE;
+}
+
+/*
+ * Cancel @op, and wait for its completion: its callback is called
+ * before returning, with the data it may have got already. The other
+ * completions are left to the main loop. It does not return before the
+ * completion of @op, which may still write to its buffer until then.
+ */
+/* any context */
+G_GNUC_INTERNAL
+void spice_uring_cancel_sync(SpiceUring *ring, SpiceUringOp *op)
+{
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe;
+
+    while (op->pending) {
+        sqe = uring_get_sqe(ring);
+        if (sqe != NULL)
+            break;
+
+        /* the submission failed, until completions are reaped */
+        io_uring_wait_cqe(&ring->ring, &cqe);
+        uring_reap(ring);
+    }
+
+    if (sqe != NULL) {
+        io_uring_prep_cancel(sqe, op, 0);
+        io_uring_sqe_set_data(sqe, NULL);
+        io_uring_submit(&ring->ring);
+    }
+
+    while (op->pending) {
+        int ret = io_uring_wait_cqe(&ring->ring, &cqe);
+
+        if (ret < 0 && ret != -EINTR)
+            g_warning("io_uring wait failed: %s", g_strerror(-ret));
+        uring_reap(ring);
+    }
+
+    if (g_queue_remove(&ring->completed, op))
+        op->func(op, op->res, op->data);
+}
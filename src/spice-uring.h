@@ -0,0 +1,56 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+  Copyright (C) 2016 Red Hat, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_URING_H__
+#define __SPICE_URING_H__
+
+#include <glib.h>
+#include <sys/socket.h>
+
+G_BEGIN_DECLS
+
+/*
+ * An io_uring shared by the channels of a session. The requests are
+ * queued, and submitted together once per main loop iteration; their
+ * completions are dispatched from the main context, through an eventfd.
+ */
+typedef struct SpiceUring SpiceUring;
+typedef struct SpiceUringOp SpiceUringOp;
+
+/* @res is the result of the syscall, or -errno */
+typedef void (*SpiceUringFunc)(SpiceUringOp *op, int res, gpointer data);
+
+struct SpiceUringOp {
+    SpiceUringFunc func;
+    gpointer data;
+    gboolean pending; /* queued or submitted, not completed yet */
+    int res; /* once completed, until dispatched */
+};
+
+SpiceUring *spice_uring_new(void);
+void spice_uring_free(SpiceUring *ring);
+
+void spice_uring_op_init(SpiceUringOp *op, SpiceUringFunc func, gpointer data);
+gboolean spice_uring_recv(SpiceUring *ring, SpiceUringOp *op,
+                          int fd, void *buf, size_t len);
+gboolean spice_uring_sendmsg(SpiceUring *ring, SpiceUringOp *op,
+                             int fd, const struct msghdr *msg);
+void spice_uring_cancel_sync(SpiceUring *ring, SpiceUringOp *op);
+
+G_END_DECLS
+
+#endif /* __SPICE_URING_H__ */
@@ -33,6 +33,52 @@ gchar* spice_dos2unix(const gchar *str, gssize len, GError **error);
 void spice_mono_edge_highlight(unsigned width, unsigned hight,
                                const guint8 *and, const guint8 *xor, guint8 *dest);
 
+/*
+ * Within libspice-client-glib, the messages of each source file belong
+ * to a category, and SPICE_DEBUG=display,cursor only enables those.
+ * They cost a branch on a variable when disabled, before any of their
+ * arguments is evaluated, and are left out with --disable-debug-log.
+ * A file sets SPICE_DEBUG_FILE_CATEGORY before including this header.
+ */
+typedef enum {
+    SPICE_DEBUG_GENERAL = 1 << 0,
+    SPICE_DEBUG_CHANNEL = 1 << 1,
+    SPICE_DEBUG_DISPLAY = 1 << 2,
+    SPICE_DEBUG_CURSOR  = 1 << 3,
+    SPICE_DEBUG_INPUTS  = 1 << 4,
+    SPICE_DEBUG_AUDIO   = 1 << 5,
+    SPICE_DEBUG_USB     = 1 << 6,
+} SpiceDebugCategory;
+
+/* all set until SPICE_DEBUG is read, by spice_util_debug_enabled() */
+G_GNUC_INTERNAL extern guint spice_debug_categories;
+G_GNUC_INTERNAL gboolean spice_util_debug_enabled(guint categories);
+
+#ifdef SPICE_GLIB_COMPILATION
+#ifndef SPICE_DEBUG_FILE_CATEGORY
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_GENERAL
+#endif
+
+#ifdef SPICE_DISABLE_DEBUG_LOG
+#define SPICE_DEBUG_ENABLED(categories) FALSE
+#else
+#define SPICE_DEBUG_ENABLED(categories)                         \
+    (G_UNLIKELY(spice_debug_categories & (categories)) &&       \
+     spice_util_debug_enabled(categories))
+#endif
+
+#define SPICE_DEBUG_CAT(categories, fmt, ...)                   \
+    do {                                                        \
+        if (SPICE_DEBUG_ENABLED(categories))                    \
+            g_debug(G_STRLOC " " fmt, ## __VA_ARGS__);          \
+    } while (0)
+
+/* replaces the one of spice-util.h */
+#undef SPICE_DEBUG
+#define SPICE_DEBUG(fmt, ...) \
+    SPICE_DEBUG_CAT(SPICE_DEBUG_FILE_CATEGORY, fmt, ## __VA_ARGS__)
+#endif
+
 #if GLIB_CHECK_VERSION(2,32,0)
 #define STATIC_MUTEX            GMutex
 #define STATIC_MUTEX_INIT(m)    g_mutex_init(&(m))
@@ -40,6 +40,20 @@
 
 static GOnce debug_once = G_ONCE_INIT;
 
+G_GNUC_INTERNAL guint spice_debug_categories = ~0u;
+
+static const GDebugKey debug_keys[] = {
+    { "general", SPICE_DEBUG_GENERAL },
+    { "channel", SPICE_DEBUG_CHANNEL },
+    { "display", SPICE_DEBUG_DISPLAY },
+    { "cursor", SPICE_DEBUG_CURSOR },
+    { "inputs", SPICE_DEBUG_INPUTS },
+    { "audio", SPICE_DEBUG_AUDIO },
+    { "usb", SPICE_DEBUG_USB },
+};
+
+#define SPICE_DEBUG_ALL ((1u << G_N_ELEMENTS(debug_keys)) - 1)
+
 static void spice_util_enable_debug_messages(void)
 {
 #if GLIB_CHECK_VERSION(2, 31, 0)
@@ -75,18 +89,25 @@ void spice_util_set_debug(gboolean enabled)
         spice_util_enable_debug_messages();
     }
 
+    spice_debug_categories = enabled ? SPICE_DEBUG_ALL : 0;
     debug_once.retval = GINT_TO_POINTER(enabled);
 }
 
+/* SPICE_DEBUG is a list of categories, any other value enables them all */
 static gpointer getenv_debug(gpointer data)
 {
-    gboolean debug;
+    const gchar *env = g_getenv("SPICE_DEBUG");
+    guint categories = 0;
 
-    debug = (g_getenv("SPICE_DEBUG") != NULL);
-    if (debug)
+    if (env != NULL) {
+        categories = g_parse_debug_string(env, debug_keys, G_N_ELEMENTS(debug_keys));
+        if (categories == 0)
+            categories = SPICE_DEBUG_ALL;
         spice_util_enable_debug_messages();
+    }
+    spice_debug_categories = categories;
 
-    return GINT_TO_POINTER(debug);
+    return GINT_TO_POINTER(categories != 0);
 }
 
 gboolean spice_util_get_debug(void)
@@ -96,6 +117,15 @@ gboolean spice_util_get_debug(void)
     return GPOINTER_TO_INT(debug_once.retval);
 }
 
+/* the slow path of SPICE_DEBUG_ENABLED(), the first time or when enabled */
+G_GNUC_INTERNAL
+gboolean spice_util_debug_enabled(guint categories)
+{
+    spice_util_get_debug();
+
+    return (spice_debug_categories & categories) != 0;
+}
+
 /**
  * spice_util_get_version_string:
  *
@@ -447,6 +477,31 @@ void spice_mono_edge_highlight(unsigned width, unsigned height,
     int x, y, bit;
     const guint8 *xor_base = xor;
 
+    /*
+     * Without edges, one byte of the masks (8 pixels) at a time: the
+     * inner loop has no data dependent branch, and can be vectorized.
+     */
+    if (!and_ones) {
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x += 8) {
+                guint8 a = and[x / 8], o = xor[x / 8];
+                int j, len = MIN(8, width - x);
+
+                for (j = 0; j < len; j++, dest += 4) {
+                    guint8 set = -((o >> (7 - j)) & 1);
+                    guint8 keep = -((a >> (7 - j)) & 1);
+
+                    /* set -> white, clear -> black, unchanged -> transparent */
+                    dest[0] = dest[1] = dest[2] = set;
+                    dest[3] = set | ~keep;
+                }
+            }
+            and += bpl;
+            xor += bpl;
+        }
+        return;
+    }
+
     for (y = 0; y < height; y++) {
         bit = 0x80;
         for (x = 0; x < width; x++, dest += 4) {
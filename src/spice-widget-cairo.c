@@ -22,6 +22,11 @@
 #include "spice-widget-priv.h"
 #include "spice-gtk-session-priv.h"
 
+#include <math.h>
+
+/* once the damage stops for that long, the area is scaled again, better */
+#define SCALED_GOOD_DELAY_MS 200
+
 
 G_GNUC_INTERNAL
 int spicex_image_create(SpiceDisplay *display)
@@ -32,7 +37,8 @@ int spicex_image_create(SpiceDisplay *display)
         return 0;
 
     if (d->format == SPICE_SURFACE_FMT_16_555 ||
-        d->format == SPICE_SURFACE_FMT_16_565) {
+        d->format == SPICE_SURFACE_FMT_16_565 ||
+        d->front_buffer) {
         d->convert = TRUE;
         d->data = g_malloc0(d->area.width * d->area.height * 4);
 
@@ -46,14 +52,133 @@ int spicex_image_create(SpiceDisplay *display)
             (d->data, CAIRO_FORMAT_RGB24, d->width, d->height, d->stride);
     }
 
+#ifdef WITH_GL
+    spicex_gl_image_create(display);
+#endif
+
     return 0;
 }
 
+static void scaled_destroy(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->scaled_timeout_id) {
+        g_source_remove(d->scaled_timeout_id);
+        d->scaled_timeout_id = 0;
+    }
+    if (d->scaled) {
+        cairo_surface_destroy(d->scaled);
+        d->scaled = NULL;
+        pixman_region32_fini(&d->scaled_damage);
+    }
+}
+
+/* scales @rect of the area, in guest coordinates, into the backbuffer */
+static void scaled_update(SpiceDisplay *display, const pixman_box32_t *rect,
+                          cairo_filter_t filter)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    double s = d->scaled_s;
+    /* the guest pixels around that the filter reads too, when downscaling */
+    int margin = ceil(1 / s) + 1;
+    int x1, y1, x2, y2;
+    cairo_pattern_t *pattern;
+    cairo_t *cr;
+
+    x1 = MAX(floor((rect->x1 - d->area.x - margin) * s), 0);
+    y1 = MAX(floor((rect->y1 - d->area.y - margin) * s), 0);
+    x2 = MIN(ceil((rect->x2 - d->area.x + margin) * s),
+             cairo_image_surface_get_width(d->scaled));
+    y2 = MIN(ceil((rect->y2 - d->area.y + margin) * s),
+             cairo_image_surface_get_height(d->scaled));
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    cr = cairo_create(d->scaled);
+    cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
+    cairo_clip(cr);
+    cairo_scale(cr, s, s);
+    if (!d->convert)
+        cairo_translate(cr, -d->area.x, -d->area.y);
+    cairo_set_source_surface(cr, d->ximage, 0, 0);
+    pattern = cairo_get_source(cr);
+    cairo_pattern_set_filter(pattern, filter);
+    /* no black fading in at the edges of the area */
+    cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+}
+
+static gboolean scaled_good_timeout(gpointer user_data)
+{
+    SpiceDisplay *display = user_data;
+    SpiceDisplayPrivate *d = display->priv;
+    pixman_box32_t area = {
+        d->area.x, d->area.y, d->area.x + d->area.width, d->area.y + d->area.height
+    };
+
+    d->scaled_timeout_id = 0;
+    if (d->scaled && d->scaled_fast) {
+        pixman_region32_clear(&d->scaled_damage);
+        scaled_update(display, &area, CAIRO_FILTER_GOOD);
+        d->scaled_fast = false;
+        gtk_widget_queue_draw(GTK_WIDGET(display));
+    }
+
+    return FALSE;
+}
+
+/*
+ * Keeps the backbuffer at the size @w x @h and scale @s, and brings its
+ * damaged parts up to date: with the fast filter while the damage goes
+ * on, the whole of it with the good one once it stops.
+ */
+static void scaled_prepare(SpiceDisplay *display, double s, int w, int h)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    pixman_box32_t *boxes;
+    int i, n;
+
+    if (d->scaled && (d->scaled_s != s ||
+                      cairo_image_surface_get_width(d->scaled) != w ||
+                      cairo_image_surface_get_height(d->scaled) != h))
+        scaled_destroy(display);
+
+    if (d->scaled == NULL) {
+        pixman_box32_t area = {
+            d->area.x, d->area.y, d->area.x + d->area.width, d->area.y + d->area.height
+        };
+
+        d->scaled = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+        d->scaled_s = s;
+        pixman_region32_init(&d->scaled_damage);
+        scaled_update(display, &area, CAIRO_FILTER_GOOD);
+        d->scaled_fast = false;
+        return;
+    }
+
+    boxes = pixman_region32_rectangles(&d->scaled_damage, &n);
+    if (n == 0)
+        return;
+
+    for (i = 0; i < n; i++)
+        scaled_update(display, &boxes[i], CAIRO_FILTER_FAST);
+    pixman_region32_clear(&d->scaled_damage);
+    d->scaled_fast = true;
+
+    if (d->scaled_timeout_id)
+        g_source_remove(d->scaled_timeout_id);
+    d->scaled_timeout_id = g_timeout_add(SCALED_GOOD_DELAY_MS, scaled_good_timeout, display);
+}
+
 G_GNUC_INTERNAL
 void spicex_image_destroy(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
 
+    scaled_destroy(display);
     if (d->ximage) {
         cairo_surface_destroy(d->ximage);
         d->ximage = NULL;
@@ -63,6 +188,23 @@ void spicex_image_destroy(SpiceDisplay *display)
         d->data = NULL;
     }
     d->convert = FALSE;
+#ifdef WITH_GL
+    spicex_gl_image_destroy(display);
+#endif
+}
+
+G_GNUC_INTERNAL
+void spicex_image_invalidate(SpiceDisplay *display, const GdkRectangle *rect)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    /* scaled on the next draw, with the rest of the damage until then */
+    if (d->scaled)
+        pixman_region32_union_rect(&d->scaled_damage, &d->scaled_damage,
+                                   rect->x, rect->y, rect->width, rect->height);
+#ifdef WITH_GL
+    spicex_gl_invalidate(display, rect);
+#endif
 }
 
 G_GNUC_INTERNAL
@@ -75,11 +217,17 @@ void spicex_draw_event(SpiceDisplay *display, cairo_t *cr)
     int x, y;
     int ww, wh;
     int w, h;
+    double cx1, cy1, cx2, cy2;
 
     spice_display_get_scaling(display, &s, &x, &y, &w, &h);
 
     gdk_drawable_get_size(gtk_widget_get_window(GTK_WIDGET(display)), &ww, &wh);
 
+    /* no border in the clip, usually, when only a damage is drawn */
+    cairo_clip_extents(cr, &cx1, &cy1, &cx2, &cy2);
+    if (d->ximage && cx1 >= x && cy1 >= y && cx2 <= x + w && cy2 <= y + h)
+        goto draw;
+
     /* We need to paint the bg color around the image */
     rect.x = 0;
     rect.y = 0;
@@ -107,15 +255,34 @@ void spicex_draw_event(SpiceDisplay *display, cairo_t *cr)
     cairo_set_source_rgb (cr, 0, 0, 0);
     cairo_fill(cr);
 
+ draw:
+#ifdef WITH_GL
+    /* scaled and composited with the cursor by the GPU */
+    if (d->ximage && spicex_gl_draw(display, cr, s, x, y, w, h))
+        return;
+#endif
+
     /* Draw the display */
     if (d->ximage) {
-        cairo_translate(cr, x, y);
-        cairo_rectangle(cr, 0, 0, w, h);
-        cairo_scale(cr, s, s);
-        if (!d->convert)
-            cairo_translate(cr, -d->area.x, -d->area.y);
-        cairo_set_source_surface(cr, d->ximage, 0, 0);
-        cairo_fill(cr);
+        if (s != 1.0) {
+            /* a 1:1 blit of the backbuffer */
+            scaled_prepare(display, s, w, h);
+            cairo_set_source_surface(cr, d->scaled, x, y);
+            cairo_rectangle(cr, x, y, w, h);
+            cairo_fill(cr);
+            cairo_translate(cr, x, y);
+            cairo_scale(cr, s, s);
+            if (!d->convert)
+                cairo_translate(cr, -d->area.x, -d->area.y);
+        } else {
+            scaled_destroy(display);
+            cairo_translate(cr, x, y);
+            cairo_rectangle(cr, 0, 0, w, h);
+            if (!d->convert)
+                cairo_translate(cr, -d->area.x, -d->area.y);
+            cairo_set_source_surface(cr, d->ximage, 0, 0);
+            cairo_fill(cr);
+        }
 
         if (d->mouse_mode == SPICE_MOUSE_MODE_SERVER &&
             d->mouse_guest_x != -1 && d->mouse_guest_y != -1 &&
@@ -0,0 +1,432 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+  Copyright (C) 2016 Red Hat, Inc.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+#include <epoxy/gl.h>
+
+#include "gtk-compat.h"
+#include "spice-widget.h"
+#include "spice-widget-priv.h"
+#include "spice-gtk-session-priv.h"
+
+/*
+ * OpenGL presentation, used by the cairo backend when a GL context can
+ * be created for the widget window. The damaged parts of the primary
+ * surface are streamed to a texture through a pixel buffer object; the
+ * scaling and the cursor compositing are done by the GPU into a
+ * renderbuffer, which GDK then composites into the window.
+ *
+ * Setting SPICE_DISABLE_GL in the environment keeps the software path.
+ */
+
+static const char *vertex_source =
+    "#version 150\n"
+    "in vec2 position;\n"
+    "in vec2 texcoord;\n"
+    "out vec2 uv;\n"
+    "void main()\n"
+    "{\n"
+    "    uv = texcoord;\n"
+    "    gl_Position = vec4(position, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *fragment_source =
+    "#version 150\n"
+    "uniform sampler2D tex;\n"
+    "uniform float opaque;\n"
+    "in vec2 uv;\n"
+    "out vec4 color;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 c = texture(tex, uv);\n"
+    "    color = vec4(c.rgb, mix(c.a, 1.0, opaque));\n"
+    "}\n";
+
+static GLuint gl_compile(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    GLint status;
+
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char log[512];
+
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        g_warning("failed to compile shader: %s", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+static gboolean gl_program_init(SpiceDisplayPrivate *d)
+{
+    GLuint vs, fs;
+    GLint status;
+
+    vs = gl_compile(GL_VERTEX_SHADER, vertex_source);
+    fs = gl_compile(GL_FRAGMENT_SHADER, fragment_source);
+    if (!vs || !fs) {
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        return FALSE;
+    }
+
+    d->gl.program = glCreateProgram();
+    glAttachShader(d->gl.program, vs);
+    glAttachShader(d->gl.program, fs);
+    glBindAttribLocation(d->gl.program, 0, "position");
+    glBindAttribLocation(d->gl.program, 1, "texcoord");
+    glLinkProgram(d->gl.program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    glGetProgramiv(d->gl.program, GL_LINK_STATUS, &status);
+    if (!status) {
+        g_warning("failed to link shader program");
+        return FALSE;
+    }
+
+    d->gl.opaque_loc = glGetUniformLocation(d->gl.program, "opaque");
+    glUseProgram(d->gl.program);
+    glUniform1i(glGetUniformLocation(d->gl.program, "tex"), 0);
+
+    glGenVertexArrays(1, &d->gl.vao);
+    glBindVertexArray(d->gl.vao);
+    glGenBuffers(1, &d->gl.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, d->gl.vbo);
+    glBufferData(GL_ARRAY_BUFFER, 16 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                          (void *)(2 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    return TRUE;
+}
+
+static gboolean gl_context_init(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GdkWindow *window = gtk_widget_get_window(GTK_WIDGET(display));
+    GError *err = NULL;
+
+    if (d->gl.context != NULL)
+        return TRUE;
+    if (d->gl.failed || window == NULL)
+        return FALSE;
+
+    if (g_getenv("SPICE_DISABLE_GL"))
+        goto failed;
+
+    d->gl.context = gdk_window_create_gl_context(window, &err);
+    if (d->gl.context == NULL || !gdk_gl_context_realize(d->gl.context, &err)) {
+        g_warning("failed to set up a GL context, drawing with cairo: %s",
+                  err ? err->message : "unknown error");
+        g_clear_error(&err);
+        g_clear_object(&d->gl.context);
+        goto failed;
+    }
+
+    gdk_gl_context_make_current(d->gl.context);
+    if (!gl_program_init(d))
+        goto failed;
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &d->gl.max_texture_size);
+    glGenBuffers(1, &d->gl.pbo);
+    glGenFramebuffers(1, &d->gl.fbo);
+    glGenRenderbuffers(1, &d->gl.rb);
+    SPICE_DEBUG("drawing with OpenGL");
+
+    return TRUE;
+
+failed:
+    spicex_gl_cleanup(display);
+    d->gl.failed = TRUE;
+    return FALSE;
+}
+
+G_GNUC_INTERNAL
+void spicex_gl_image_create(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (!gl_context_init(display))
+        return;
+
+    gdk_gl_context_make_current(d->gl.context);
+    if (d->area.width > d->gl.max_texture_size ||
+        d->area.height > d->gl.max_texture_size) {
+        glDeleteTextures(1, &d->gl.tex);
+        d->gl.tex = 0;
+        return;
+    }
+
+    if (d->gl.tex == 0)
+        glGenTextures(1, &d->gl.tex);
+    glBindTexture(GL_TEXTURE_2D, d->gl.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, d->area.width, d->area.height,
+                 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+
+    pixman_region32_fini(&d->gl.dirty);
+    pixman_region32_init_rect(&d->gl.dirty, d->area.x, d->area.y,
+                              d->area.width, d->area.height);
+}
+
+G_GNUC_INTERNAL
+void spicex_gl_image_destroy(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    pixman_region32_fini(&d->gl.dirty);
+    pixman_region32_init(&d->gl.dirty);
+}
+
+G_GNUC_INTERNAL
+void spicex_gl_invalidate(SpiceDisplay *display, const GdkRectangle *rect)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->gl.tex == 0)
+        return;
+
+    pixman_region32_union_rect(&d->gl.dirty, &d->gl.dirty,
+                               rect->x, rect->y, rect->width, rect->height);
+}
+
+G_GNUC_INTERNAL
+void spicex_gl_cleanup(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->gl.context == NULL)
+        return;
+
+    gdk_gl_context_make_current(d->gl.context);
+    glDeleteTextures(1, &d->gl.tex);
+    glDeleteTextures(1, &d->gl.cursor_tex);
+    glDeleteBuffers(1, &d->gl.pbo);
+    glDeleteBuffers(1, &d->gl.vbo);
+    glDeleteVertexArrays(1, &d->gl.vao);
+    glDeleteFramebuffers(1, &d->gl.fbo);
+    glDeleteRenderbuffers(1, &d->gl.rb);
+    glDeleteProgram(d->gl.program);
+    gdk_gl_context_clear_current();
+
+    g_clear_object(&d->gl.context);
+    g_clear_object(&d->gl.cursor_pixbuf);
+    pixman_region32_fini(&d->gl.dirty);
+    pixman_region32_init(&d->gl.dirty);
+    d->gl.tex = d->gl.cursor_tex = d->gl.pbo = d->gl.vbo = 0;
+    d->gl.vao = d->gl.fbo = d->gl.rb = d->gl.program = 0;
+    d->gl.rb_width = d->gl.rb_height = 0;
+    d->gl.failed = FALSE;
+}
+
+/* stream the dirty boxes through the PBO, packed one after the other */
+static void gl_upload(SpiceDisplayPrivate *d)
+{
+    pixman_box32_t *boxes;
+    const guint8 *src;
+    guint8 *dst;
+    gsize size = 0, offset = 0;
+    int stride, i, n, y;
+
+    boxes = pixman_region32_rectangles(&d->gl.dirty, &n);
+    if (n == 0)
+        return;
+
+    for (i = 0; i < n; i++)
+        size += (gsize)(boxes[i].x2 - boxes[i].x1) * (boxes[i].y2 - boxes[i].y1) * 4;
+
+    /* the converted data only covers the area, the primary is whole */
+    if (d->convert) {
+        src = d->data;
+        stride = d->area.width * 4;
+    } else {
+        src = (guint8 *)d->data + d->area.y * d->stride + d->area.x * 4;
+        stride = d->stride;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, d->gl.pbo);
+    /* orphan the previous storage, it may still be in use */
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                           GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (dst == NULL) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        int x = boxes[i].x1 - d->area.x;
+        int w = boxes[i].x2 - boxes[i].x1;
+
+        for (y = boxes[i].y1 - d->area.y; y < boxes[i].y2 - d->area.y; y++) {
+            memcpy(dst + offset, src + y * stride + x * 4, w * 4);
+            offset += w * 4;
+        }
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glBindTexture(GL_TEXTURE_2D, d->gl.tex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    offset = 0;
+    for (i = 0; i < n; i++) {
+        int w = boxes[i].x2 - boxes[i].x1;
+        int h = boxes[i].y2 - boxes[i].y1;
+
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        boxes[i].x1 - d->area.x, boxes[i].y1 - d->area.y, w, h,
+                        GL_BGRA, GL_UNSIGNED_BYTE, (void *)offset);
+        offset += (gsize)w * h * 4;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    pixman_region32_fini(&d->gl.dirty);
+    pixman_region32_init(&d->gl.dirty);
+}
+
+static void gl_upload_cursor(SpiceDisplayPrivate *d, GdkPixbuf *pixbuf)
+{
+    gboolean alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+
+    if (d->gl.cursor_pixbuf == pixbuf)
+        return;
+
+    g_clear_object(&d->gl.cursor_pixbuf);
+    d->gl.cursor_pixbuf = g_object_ref(pixbuf);
+
+    if (d->gl.cursor_tex == 0)
+        glGenTextures(1, &d->gl.cursor_tex);
+    glBindTexture(GL_TEXTURE_2D, d->gl.cursor_tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH,
+                  gdk_pixbuf_get_rowstride(pixbuf) / gdk_pixbuf_get_n_channels(pixbuf));
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8,
+                 gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf), 0,
+                 alpha ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE,
+                 gdk_pixbuf_get_pixels(pixbuf));
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+/* draw a textured quad, in pixels of a @fb_w x @fb_h top-down framebuffer */
+static void gl_draw_quad(int fb_w, int fb_h, double x, double y, double w, double h)
+{
+    GLfloat x1 = 2.0 * x / fb_w - 1.0;
+    GLfloat x2 = 2.0 * (x + w) / fb_w - 1.0;
+    GLfloat y1 = 1.0 - 2.0 * y / fb_h;
+    GLfloat y2 = 1.0 - 2.0 * (y + h) / fb_h;
+    const GLfloat vertices[] = {
+        x1, y1, 0.0, 0.0,
+        x2, y1, 1.0, 0.0,
+        x1, y2, 0.0, 1.0,
+        x2, y2, 1.0, 1.0,
+    };
+
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* returns FALSE if the image must be drawn with cairo instead */
+G_GNUC_INTERNAL
+gboolean spicex_gl_draw(SpiceDisplay *display, cairo_t *cr,
+                        double s, int x, int y, int w, int h)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GLint filter;
+
+    if (d->gl.context == NULL || d->gl.tex == 0 || w <= 0 || h <= 0 ||
+        w > d->gl.max_texture_size || h > d->gl.max_texture_size)
+        return FALSE;
+
+    gdk_gl_context_make_current(d->gl.context);
+    gl_upload(d);
+
+    if (d->gl.rb_width != w || d->gl.rb_height != h) {
+        glBindRenderbuffer(GL_RENDERBUFFER, d->gl.rb);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+        glBindFramebuffer(GL_FRAMEBUFFER, d->gl.fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER, d->gl.rb);
+        d->gl.rb_width = w;
+        d->gl.rb_height = h;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, d->gl.fbo);
+    glViewport(0, 0, w, h);
+    glUseProgram(d->gl.program);
+    glBindVertexArray(d->gl.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, d->gl.vbo);
+    glActiveTexture(GL_TEXTURE0);
+
+    /* unscaled pixels are copied as they are */
+    filter = (s == 1.0) ? GL_NEAREST : GL_LINEAR;
+    glBindTexture(GL_TEXTURE_2D, d->gl.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glDisable(GL_BLEND);
+    glUniform1f(d->gl.opaque_loc, 1.0);
+    gl_draw_quad(w, h, 0, 0, w, h);
+
+    if (d->mouse_mode == SPICE_MOUSE_MODE_SERVER &&
+        d->mouse_guest_x != -1 && d->mouse_guest_y != -1 &&
+        !d->show_cursor &&
+        spice_gtk_session_get_pointer_grabbed(d->gtk_session) &&
+        d->mouse_pixbuf != NULL) {
+        GdkPixbuf *image = d->mouse_pixbuf;
+        int cx = d->mouse_guest_x - d->mouse_hotspot.x;
+        int cy = d->mouse_guest_y - d->mouse_hotspot.y;
+
+        /* same placement as the cairo path */
+        if (!d->convert) {
+            cx -= d->area.x;
+            cy -= d->area.y;
+        }
+
+        gl_upload_cursor(d, image);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glUniform1f(d->gl.opaque_loc, 0.0);
+        gl_draw_quad(w, h, cx * s, cy * s,
+                     gdk_pixbuf_get_width(image) * s,
+                     gdk_pixbuf_get_height(image) * s);
+        glDisable(GL_BLEND);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    cairo_save(cr);
+    cairo_translate(cr, x, y);
+    gdk_cairo_draw_from_gl(cr, gtk_widget_get_window(GTK_WIDGET(display)),
+                           d->gl.rb, GL_RENDERBUFFER, 1, 0, 0, w, h);
+    cairo_restore(cr);
+
+    return TRUE;
+}
@@ -25,6 +25,9 @@ G_BEGIN_DECLS
 #ifdef WITH_X11
 #include <X11/Xlib.h>
 #include <X11/extensions/XShm.h>
+#ifdef HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
 #include <gdk/gdkx.h>
 #endif
 
@@ -32,6 +35,12 @@ G_BEGIN_DECLS
 #include <windows.h>
 #endif
 
+#ifdef WITH_GL
+#include <epoxy/gl.h>
+#endif
+
+#include <pixman.h>
+
 #include "spice-widget.h"
 #include "spice-common.h"
 #include "spice-gtk-session.h"
@@ -57,8 +66,18 @@ struct _SpiceDisplayPrivate {
     gint                    shmid;
     gpointer                data_origin; /* the original display image data */
     gpointer                data; /* converted if necessary to 32 bits */
+    gboolean                front_buffer; /* data is always a copy, see do_color_convert() */
 
     GdkRectangle            area;
+    pixman_region32_t       damage; /* pending invalidation, in guest coordinates */
+    gulong                  invalidate_id; /* of the monitor shown, or of all */
+    guint                   damage_flush_id;
+    gboolean                damage_flush_tick;
+    gint64                  damage_time; /* when the pending damage started */
+    gint64                  present_time; /* damage flushed, not drawn yet */
+    guint                   present_latency; /* µs, smoothed */
+    gboolean                frame_paced;
+    gboolean                obscured; /* fully, by other windows */
     /* window border */
     gint                    ww, wh, mx, my;
 
@@ -74,9 +93,41 @@ struct _SpiceDisplayPrivate {
     XVisualInfo             *vi;
     XImage                  *ximage;
     XShmSegmentInfo         *shminfo;
+    gpointer                shm_data; /* our segment, for the area only */
+    gpointer                convert_data; /* the pixels of XPutImage, when converted */
     GC                      gc;
+#ifdef HAVE_XRENDER
+    /* a copy of the area on the server, that XRender scales */
+    Pixmap                  pixmap;
+    GC                      pixmap_gc;
+    Picture                 src_picture;
+    Picture                 dest_picture;
+#endif
 #else
     cairo_surface_t         *ximage;
+    /* the area at the scale of the window, redone where damaged */
+    cairo_surface_t         *scaled;
+    double                  scaled_s;
+    pixman_region32_t       scaled_damage; /* in guest coordinates */
+    guint                   scaled_timeout_id;
+    bool                    scaled_fast; /* parts were scaled with the fast filter */
+#endif
+#ifdef WITH_GL
+    struct {
+        GdkGLContext        *context;
+        gboolean            failed;
+        GLint               max_texture_size;
+        GLuint              program;
+        GLint               opaque_loc;
+        GLuint              vao, vbo;
+        GLuint              tex; /* the monitor area */
+        GLuint              pbo;
+        pixman_region32_t   dirty; /* not uploaded yet, in guest coordinates */
+        GLuint              fbo, rb; /* the scaled image, with the cursor */
+        gint                rb_width, rb_height;
+        GLuint              cursor_tex;
+        GdkPixbuf           *cursor_pixbuf;
+    } gl;
 #endif
 
     SpiceSession            *session;
@@ -94,16 +145,31 @@ struct _SpiceDisplayPrivate {
     GdkPixbuf               *mouse_pixbuf;
     GdkPoint                mouse_hotspot;
     GdkCursor               *show_cursor;
+    GQueue                  cursor_cache; /* SpiceCursorCacheEntry, most recent first */
     int                     mouse_last_x;
     int                     mouse_last_y;
-    int                     mouse_guest_x;
+    int                     mouse_button_mask; /* spice mask of the pressed buttons */
+    int                     xi_opcode; /* 0 if there's no XInput2, -1 until checked */
+    gboolean                raw_motion; /* relative motion from XInput2 raw events */
+    double                  raw_dx; /* the motion left over, in guest pixels */
+    double                  raw_dy;
+    int                     mouse_guest_x; /* where the cursor is drawn */
     int                     mouse_guest_y;
+    int                     mouse_server_x; /* the last position from the server */
+    int                     mouse_server_y;
+    gboolean                predict_cursor;
+    int                     predict_dx; /* motion the server did not show yet */
+    int                     predict_dy;
+    gint64                  predict_time; /* of the last predicted motion */
+    guint                   predict_error; /* 1/16 pixel, smoothed */
 
     bool                    keyboard_grab_active;
     bool                    keyboard_have_focus;
 
     const guint16          *keycode_map;
     size_t                  keycode_maplen;
+    GHashTable             *keyval_scancodes; /* keyval -> scancode, for the current keymap */
+    gulong                  keys_changed_id;
     uint32_t                key_state[512 / 32];
     int                     key_delayed_scancode;
     guint                   key_delayed_id;
@@ -118,6 +184,7 @@ struct _SpiceDisplayPrivate {
     int                     win_mouse_speed;
 #endif
     guint                   keypress_delay;
+    gboolean                guest_key_repeat; /* drop the client autorepeat */
     gint                    zoom_level;
 #ifdef GDK_WINDOWING_X11
     int                     x11_accel_numerator;
@@ -128,6 +195,7 @@ struct _SpiceDisplayPrivate {
 
 int      spicex_image_create                 (SpiceDisplay *display);
 void     spicex_image_destroy                (SpiceDisplay *display);
+void     spicex_image_invalidate             (SpiceDisplay *display, const GdkRectangle *rect);
 #if GTK_CHECK_VERSION (2, 91, 0)
 void     spicex_draw_event                   (SpiceDisplay *display, cairo_t *cr);
 #else
@@ -136,6 +204,15 @@ void     spicex_expose_event                 (SpiceDisplay *display, GdkEventExp
 gboolean spicex_is_scaled                    (SpiceDisplay *display);
 void     spice_display_get_scaling           (SpiceDisplay *display, double *s, int *x, int *y, int *w, int *h);
 
+#ifdef WITH_GL
+void     spicex_gl_image_create              (SpiceDisplay *display);
+void     spicex_gl_image_destroy             (SpiceDisplay *display);
+void     spicex_gl_invalidate                (SpiceDisplay *display, const GdkRectangle *rect);
+void     spicex_gl_cleanup                   (SpiceDisplay *display);
+gboolean spicex_gl_draw                      (SpiceDisplay *display, cairo_t *cr,
+                                              double s, int x, int y, int w, int h);
+#endif
+
 G_END_DECLS
 
 #endif
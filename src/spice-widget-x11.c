@@ -28,6 +28,8 @@
 #include <sys/ipc.h>
 #endif
 
+#include <string.h>
+
 static bool no_mitshm;
 
 static struct format_table {
@@ -116,24 +118,97 @@ static int catch_no_mitshm(Display * dpy, XErrorEvent * event)
     return 0;
 }
 
-G_GNUC_INTERNAL
-int spicex_image_create(SpiceDisplay *display)
+/*
+ * Shares @data, the segment @shmid, with the X server, or a new segment
+ * if @shmid is -1.
+ */
+static bool image_create_shm(SpiceDisplay *display, gpointer data, int shmid,
+                             int width, int height)
 {
-    SpiceDisplayPrivate   *d = display->priv;
+    SpiceDisplayPrivate *d = display->priv;
+    void *old_handler;
 
-    if (d->ximage != NULL)
-        return 0;
+    no_mitshm = false;
+    old_handler = XSetErrorHandler(catch_no_mitshm);
+    d->shminfo = g_new0(XShmSegmentInfo, 1);
+    d->ximage = XShmCreateImage(d->dpy, d->vi->visual, d->vi->depth,
+                                ZPixmap, NULL, d->shminfo, width, height);
+    if (d->ximage == NULL)
+        goto fail;
+
+    if (shmid == -1) {
+        shmid = shmget(IPC_PRIVATE, d->ximage->bytes_per_line * height, IPC_CREAT | 0600);
+        if (shmid < 0)
+            goto fail;
+        data = shmat(shmid, NULL, 0);
+        if (data == (void *)-1) {
+            shmctl(shmid, IPC_RMID, 0);
+            goto fail;
+        }
+        d->shm_data = data;
+    }
+
+    d->ximage->data = data;
+    d->shminfo->shmaddr = data;
+    d->shminfo->shmid = shmid;
+    d->shminfo->readOnly = false;
+    XShmAttach(d->dpy, d->shminfo);
+    XSync(d->dpy, False);
+    shmctl(shmid, IPC_RMID, 0);
+    XSetErrorHandler(old_handler);
+    if (no_mitshm)
+        goto fail;
+
+    return true;
 
+ fail:
+    XSetErrorHandler(old_handler);
+    if (d->ximage) {
+        d->ximage->data = NULL;
+        XDestroyImage(d->ximage);
+        d->ximage = NULL;
+    }
+    if (d->shm_data) {
+        shmdt(d->shm_data);
+        d->shm_data = NULL;
+    }
+    g_free(d->shminfo);
+    d->shminfo = NULL;
+
+    return false;
+}
+
+/* the position of the area in the image: only the surface has more */
+static void image_get_area_origin(SpiceDisplayPrivate *d, int *x, int *y)
+{
+    if (d->convert || d->shm_data) {
+        *x = 0;
+        *y = 0;
+    } else {
+        *x = d->area.x;
+        *y = d->area.y;
+    }
+}
+
+/*
+ * The image is the primary surface when the X server can share it.
+ * Otherwise, when the guest pixels must be converted or when the
+ * surface isn't in shared memory, it is a segment of our own, of the
+ * size of the area shown, that the damage is copied or converted to.
+ * XPutImage() is the last resort.
+ */
+static int image_create(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate   *d = display->priv;
     GdkDrawable     *window = gtk_widget_get_window(GTK_WIDGET(display));
     GdkDisplay      *gtkdpy = gdk_drawable_get_display(window);
-    void            *old_handler = NULL;
     XGCValues       gcval = {
         .foreground = 0,
         .background = 0,
     };
 
     d->dpy = gdk_x11_display_get_xdisplay(gtkdpy);
-    d->convert = false;
+    d->convert = d->front_buffer;
     d->vi = get_visual_for_format(GTK_WIDGET(display), d->format);
     if (d->vi == NULL) {
         d->convert = true;
@@ -141,79 +216,218 @@ int spicex_image_create(SpiceDisplay *display)
         d->vi = get_visual_for_format(GTK_WIDGET(display), SPICE_SURFACE_FMT_32_xRGB);
         g_return_val_if_fail(d->vi != NULL, 1);
     }
-    if (d->convert) {
-        d->data = g_malloc0(d->height * d->stride); /* pixels are 32 bits */
-    }
 
     d->gc = XCreateGC(d->dpy, gdk_x11_drawable_get_xid(window),
                       GCForeground | GCBackground, &gcval);
 
-    if (d->convert) /* do not use shm when doing color format conversion */
-        goto xcreate;
+    if (d->have_mitshm && !XShmQueryExtension(d->dpy))
+        d->have_mitshm = false;
 
-    if (d->have_mitshm && d->shmid != -1) {
-        if (!XShmQueryExtension(d->dpy)) {
-            goto shm_fail;
+    if (d->have_mitshm) {
+        /* an XShm image has packed rows, a padded surface is copied */
+        if (!d->convert && d->shmid != -1 && d->stride == d->width * 4) {
+            if (image_create_shm(display, d->data, d->shmid, d->width, d->height))
+                return 0;
+        } else if (image_create_shm(display, NULL, -1, d->area.width, d->area.height)) {
+            /* the pixels are converted straight into the segment */
+            if (d->convert)
+                d->data = d->shm_data;
+            return 0;
         }
-        no_mitshm = false;
-        old_handler = XSetErrorHandler(catch_no_mitshm);
-        d->shminfo = g_new0(XShmSegmentInfo, 1);
-        d->ximage = XShmCreateImage(d->dpy, d->vi->visual, d->vi->depth,
-                                    ZPixmap, d->data, d->shminfo, d->width, d->height);
-        if (d->ximage == NULL)
-            goto shm_fail;
-        d->shminfo->shmaddr = d->data;
-        d->shminfo->shmid = d->shmid;
-        d->shminfo->readOnly = false;
-        XShmAttach(d->dpy, d->shminfo);
-        XSync(d->dpy, False);
-        shmctl(d->shmid, IPC_RMID, 0);
-        if (no_mitshm)
-            goto shm_fail;
-        XSetErrorHandler(old_handler);
-        return 0;
+        d->have_mitshm = false;
     }
 
- shm_fail:
-    d->have_mitshm = false;
-    g_free(d->shminfo);
-    d->shminfo = NULL;
-    if (old_handler)
-        XSetErrorHandler(old_handler);
- xcreate:
-    d->ximage = XCreateImage(d->dpy, d->vi->visual, d->vi->depth, ZPixmap, 0,
-                             d->data, d->width, d->height, 32, d->stride);
+    if (d->convert) {
+        /* pixels are 32 bits */
+        d->convert_data = g_malloc0(d->area.width * d->area.height * 4);
+        d->data = d->convert_data;
+        d->ximage = XCreateImage(d->dpy, d->vi->visual, d->vi->depth, ZPixmap, 0,
+                                 d->data, d->area.width, d->area.height, 32,
+                                 d->area.width * 4);
+    } else {
+        d->ximage = XCreateImage(d->dpy, d->vi->visual, d->vi->depth, ZPixmap, 0,
+                                 d->data, d->width, d->height, 32, d->stride);
+    }
     return 0;
 }
 
+#ifdef HAVE_XRENDER
+/*
+ * When scaling, the area is kept in a pixmap on the server, updated with
+ * the damage only, and XRender scales it to the window, with the
+ * filtering of the server.
+ */
+static void render_create(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GdkDrawable *window = gtk_widget_get_window(GTK_WIDGET(display));
+    XRenderPictFormat *src_format, *dest_format;
+    XRenderPictureAttributes attrs = { 0, };
+    int event_base, error_base;
+
+    if (d->area.width == 0 || d->area.height == 0 ||
+        !XRenderQueryExtension(d->dpy, &event_base, &error_base))
+        return;
+
+    src_format = XRenderFindVisualFormat(d->dpy, d->vi->visual);
+    dest_format = XRenderFindVisualFormat(d->dpy,
+        GDK_VISUAL_XVISUAL(gdk_drawable_get_visual(window)));
+    if (src_format == NULL || dest_format == NULL)
+        return;
+
+    d->pixmap = XCreatePixmap(d->dpy, gdk_x11_drawable_get_xid(window),
+                              d->area.width, d->area.height, d->vi->depth);
+    d->pixmap_gc = XCreateGC(d->dpy, d->pixmap, 0, NULL);
+    d->src_picture = XRenderCreatePicture(d->dpy, d->pixmap, src_format, 0, &attrs);
+    XRenderSetPictureFilter(d->dpy, d->src_picture, FilterBilinear, NULL, 0);
+    d->dest_picture = XRenderCreatePicture(d->dpy, gdk_x11_drawable_get_xid(window),
+                                           dest_format, 0, &attrs);
+}
+
+static void render_destroy(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->pixmap == None)
+        return;
+
+    XRenderFreePicture(d->dpy, d->dest_picture);
+    XRenderFreePicture(d->dpy, d->src_picture);
+    XFreeGC(d->dpy, d->pixmap_gc);
+    XFreePixmap(d->dpy, d->pixmap);
+    d->dest_picture = None;
+    d->src_picture = None;
+    d->pixmap_gc = NULL;
+    d->pixmap = None;
+}
+
+/* pushes @rect of the area, in guest coordinates, to the pixmap */
+static void render_update(SpiceDisplay *display, const GdkRectangle *rect)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    int ax, ay;
+
+    if (d->pixmap == None)
+        return;
+
+    image_get_area_origin(d, &ax, &ay);
+    if (d->have_mitshm && d->shminfo)
+        XShmPutImage(d->dpy, d->pixmap, d->pixmap_gc, d->ximage,
+                     ax + rect->x - d->area.x, ay + rect->y - d->area.y,
+                     rect->x - d->area.x, rect->y - d->area.y,
+                     rect->width, rect->height, false);
+    else
+        XPutImage(d->dpy, d->pixmap, d->pixmap_gc, d->ximage,
+                  ax + rect->x - d->area.x, ay + rect->y - d->area.y,
+                  rect->x - d->area.x, rect->y - d->area.y,
+                  rect->width, rect->height);
+}
+
+/* draws @area of the window, in the scaled display at @x, @y */
+static void render_draw(SpiceDisplay *display, const GdkRectangle *area,
+                        int x, int y, double s)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    XTransform transform = {{
+        { XDoubleToFixed(1 / s), 0, 0 },
+        { 0, XDoubleToFixed(1 / s), 0 },
+        { 0, 0, XDoubleToFixed(1) },
+    }};
+
+    XRenderSetPictureTransform(d->dpy, d->src_picture, &transform);
+    XRenderComposite(d->dpy, PictOpSrc, d->src_picture, None, d->dest_picture,
+                     area->x - x, area->y - y, 0, 0,
+                     area->x, area->y, area->width, area->height);
+}
+#endif
+
+G_GNUC_INTERNAL
+int spicex_image_create(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    int ret;
+
+    if (d->ximage != NULL)
+        return 0;
+
+    ret = image_create(display);
+#ifdef HAVE_XRENDER
+    if (ret == 0)
+        render_create(display);
+#endif
+    return ret;
+}
+
 G_GNUC_INTERNAL
 void spicex_image_destroy(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
 
+#ifdef HAVE_XRENDER
+    render_destroy(display);
+#endif
+
     if (d->ximage) {
-        /* avoid XDestroy to free shared memory, owned and freed by
-           channel-display itself */
-        if (d->ximage->data == d->data_origin)
-            d->ximage->data = NULL;
+        /* avoid XDestroy to free the data: the surface, owned and
+           freed by channel-display itself, or ours */
+        d->ximage->data = NULL;
         XDestroyImage(d->ximage);
         d->ximage = NULL;
-        if (d->convert)
-            d->data = 0;
     }
     if (d->shminfo) {
         XShmDetach(d->dpy, d->shminfo);
-        free(d->shminfo);
+        g_free(d->shminfo);
         d->shminfo = NULL;
     }
+    if (d->shm_data) {
+        shmdt(d->shm_data);
+        if (d->data == d->shm_data)
+            d->data = NULL;
+        d->shm_data = NULL;
+    }
     if (d->gc) {
         XFreeGC(d->dpy, d->gc);
         d->gc = NULL;
     }
-    if (d->convert && d->data) {
-        g_free(d->data);
-        d->data = NULL;
+    /* d->data may be a new surface already */
+    if (d->convert_data) {
+        if (d->data == d->convert_data)
+            d->data = NULL;
+        g_free(d->convert_data);
+        d->convert_data = NULL;
+    }
+}
+
+G_GNUC_INTERNAL
+void spicex_image_invalidate(SpiceDisplay *display, const GdkRectangle *rect)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    int bpp, y;
+    guint8 *src, *dest;
+
+    if (d->ximage == NULL)
+        return;
+
+    /* XShm images of the surface are drawn straight from its data, and
+       the converted pixels are already in the image */
+    if (d->shm_data == NULL || d->convert)
+        goto render;
+
+    bpp = d->ximage->bits_per_pixel / 8;
+    src = (guint8 *)d->data_origin + rect->y * d->stride + rect->x * bpp;
+    dest = (guint8 *)d->shm_data + (rect->y - d->area.y) * d->ximage->bytes_per_line +
+        (rect->x - d->area.x) * bpp;
+    for (y = 0; y < rect->height; y++) {
+        memcpy(dest, src, rect->width * bpp);
+        src += d->stride;
+        dest += d->ximage->bytes_per_line;
     }
+
+ render:
+#ifdef HAVE_XRENDER
+    render_update(display, rect);
+#endif
+    return;
 }
 
 G_GNUC_INTERNAL
@@ -222,31 +436,38 @@ void spicex_expose_event(SpiceDisplay *display, GdkEventExpose *expose)
     GdkDrawable *window = gtk_widget_get_window(GTK_WIDGET(display));
     SpiceDisplayPrivate *d = display->priv;
     int x, y, w, h;
+    int ax, ay;
+    double s;
 
-    spice_display_get_scaling(display, NULL, &x, &y, &w, &h);
+    spice_display_get_scaling(display, &s, &x, &y, &w, &h);
+    image_get_area_origin(d, &ax, &ay);
 
     if (expose->area.x >= x &&
         expose->area.y >= y &&
         expose->area.x + expose->area.width  <= x + w &&
         expose->area.y + expose->area.height <= y + h) {
         /* area is completely inside the guest screen -- blit it */
-        if (d->have_mitshm && d->shminfo) {
+        if (s != 1.0) {
+#ifdef HAVE_XRENDER
+            render_draw(display, &expose->area, x, y, s);
+#endif
+        } else if (d->have_mitshm && d->shminfo) {
             XShmPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
                          d->gc, d->ximage,
-                         d->area.x + expose->area.x - x, d->area.y + expose->area.y - y,
+                         ax + expose->area.x - x, ay + expose->area.y - y,
                          expose->area.x, expose->area.y,
                          expose->area.width, expose->area.height,
                          true);
         } else {
             XPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
                       d->gc, d->ximage,
-                      d->area.x + expose->area.x - x, d->area.y + expose->area.y - y,
+                      ax + expose->area.x - x, ay + expose->area.y - y,
                       expose->area.x, expose->area.y,
                       expose->area.width, expose->area.height);
         }
     } else {
         /* complete window update */
-        if (d->ww > d->area.width || d->wh > d->area.height) {
+        if (d->ww > w || d->wh > h) {
             int x1 = x;
             int x2 = x + w;
             int y1 = y;
@@ -260,15 +481,21 @@ void spicex_expose_event(SpiceDisplay *display, GdkEventExpose *expose)
             XFillRectangle(d->dpy, gdk_x11_drawable_get_xid(window),
                            d->gc, 0, y2, d->ww, d->wh - y2);
         }
-        if (d->have_mitshm && d->shminfo) {
+        if (s != 1.0) {
+#ifdef HAVE_XRENDER
+            GdkRectangle rect = { x, y, w, h };
+
+            render_draw(display, &rect, x, y, s);
+#endif
+        } else if (d->have_mitshm && d->shminfo) {
             XShmPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
                          d->gc, d->ximage,
-                         d->area.x, d->area.y, x, y, w, h,
+                         ax, ay, x, y, w, h,
                          true);
         } else {
             XPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
                       d->gc, d->ximage,
-                      d->area.x, d->area.y, x, y, w, h);
+                      ax, ay, x, y, w, h);
         }
     }
 }
@@ -276,5 +503,12 @@ void spicex_expose_event(SpiceDisplay *display, GdkEventExpose *expose)
 G_GNUC_INTERNAL
 gboolean spicex_is_scaled(SpiceDisplay *display)
 {
-    return FALSE; /* backend doesn't support scaling yet */
+#ifdef HAVE_XRENDER
+    SpiceDisplayPrivate *d = display->priv;
+
+    /* XRender scales the copy of the area on the server */
+    return d->allow_scaling && d->pixmap != None;
+#else
+    return FALSE; /* scaling needs XRender */
+#endif
 }
@@ -28,6 +28,9 @@
 #include <X11/Xlib.h>
 #include <gdk/gdkx.h>
 #endif
+#ifdef HAVE_XINPUT2
+#include <X11/extensions/XInput2.h>
+#endif
 #ifdef G_OS_WIN32
 #include <windows.h>
 #include <gdk/gdkwin32.h>
@@ -40,6 +43,8 @@
 #include "spice-widget-priv.h"
 #include "spice-gtk-session-priv.h"
 #include "vncdisplaykeymap.h"
+#include "color-convert.h"
+#include "spice-trace.h"
 
 #include "glib-compat.h"
 #include "gtk-compat.h"
@@ -87,7 +92,12 @@ enum {
     PROP_ZOOM_LEVEL,
     PROP_MONITOR_ID,
     PROP_KEYPRESS_DELAY,
-    PROP_READY
+    PROP_READY,
+    PROP_FRAME_PACED,
+    PROP_PRESENT_LATENCY,
+    PROP_PREDICT_CURSOR,
+    PROP_CURSOR_PREDICTION_ERROR,
+    PROP_GUEST_KEY_REPEAT,
 };
 
 /* Signals */
@@ -114,8 +124,16 @@ static void recalc_geometry(GtkWidget *widget);
 static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data);
 static void channel_destroy(SpiceSession *s, SpiceChannel *channel, gpointer data);
 static void cursor_invalidate(SpiceDisplay *display);
+static void connect_invalidate(SpiceDisplay *display);
+static void cursor_cache_clear(SpiceDisplay *display);
+static void cursor_predict_reset(SpiceDisplay *display);
+static void cursor_predict_motion(SpiceDisplay *display, gint dx, gint dy);
 static void update_area(SpiceDisplay *display, gint x, gint y, gint width, gint height);
 static void release_keys(SpiceDisplay *display);
+static void damage_clear(SpiceDisplay *display);
+static void update_view(SpiceDisplay *display);
+static void raw_motion_start(SpiceDisplay *display);
+static void raw_motion_stop(SpiceDisplay *display);
 
 /* ---------------------------------------------------------------- */
 
@@ -169,6 +187,21 @@ static void spice_display_get_property(GObject    *object,
     case PROP_KEYPRESS_DELAY:
         g_value_set_uint(value, d->keypress_delay);
         break;
+    case PROP_FRAME_PACED:
+        g_value_set_boolean(value, d->frame_paced);
+        break;
+    case PROP_PRESENT_LATENCY:
+        g_value_set_uint(value, d->present_latency);
+        break;
+    case PROP_PREDICT_CURSOR:
+        g_value_set_boolean(value, d->predict_cursor);
+        break;
+    case PROP_CURSOR_PREDICTION_ERROR:
+        g_value_set_double(value, d->predict_error / 16.0);
+        break;
+    case PROP_GUEST_KEY_REPEAT:
+        g_value_set_boolean(value, d->guest_key_repeat);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -326,8 +359,10 @@ static void spice_display_set_property(GObject      *object,
         break;
     case PROP_MONITOR_ID:
         d->monitor_id = g_value_get_int(value);
-        if (d->display) /* if constructed */
+        if (d->display) { /* if constructed */
+            connect_invalidate(display);
             update_monitor_area(display);
+        }
         break;
     case PROP_KEYBOARD_GRAB:
         d->keyboard_grab_enable = g_value_get_boolean(value);
@@ -366,6 +401,16 @@ static void spice_display_set_property(GObject      *object,
     case PROP_KEYPRESS_DELAY:
         d->keypress_delay = g_value_get_uint(value);
         break;
+    case PROP_FRAME_PACED:
+        d->frame_paced = g_value_get_boolean(value);
+        break;
+    case PROP_GUEST_KEY_REPEAT:
+        d->guest_key_repeat = g_value_get_boolean(value);
+        break;
+    case PROP_PREDICT_CURSOR:
+        d->predict_cursor = g_value_get_boolean(value);
+        cursor_predict_reset(display);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -402,14 +447,24 @@ static void spice_display_dispose(GObject *obj)
     SPICE_DEBUG("spice display dispose");
 
     spicex_image_destroy(display);
+    if (d->display)
+        spice_display_set_view_scale(d->display, display, 0);
     g_clear_object(&d->session);
     d->gtk_session = NULL;
+    raw_motion_stop(display);
 
     if (d->key_delayed_id) {
         g_source_remove(d->key_delayed_id);
         d->key_delayed_id = 0;
     }
 
+    if (d->keys_changed_id) {
+        g_signal_handler_disconnect(gdk_keymap_get_default(), d->keys_changed_id);
+        d->keys_changed_id = 0;
+    }
+
+    damage_clear(display);
+
     G_OBJECT_CLASS(spice_display_parent_class)->dispose(obj);
 }
 
@@ -427,6 +482,13 @@ static void spice_display_finalize(GObject *obj)
     g_free(d->activeseq);
     d->activeseq = NULL;
 
+    g_hash_table_destroy(d->keyval_scancodes);
+
+    pixman_region32_fini(&d->damage);
+#ifdef WITH_GL
+    pixman_region32_fini(&d->gl.dirty);
+#endif
+
     if (d->show_cursor) {
         gdk_cursor_unref(d->show_cursor);
         d->show_cursor = NULL;
@@ -442,6 +504,8 @@ static void spice_display_finalize(GObject *obj)
         d->mouse_pixbuf = NULL;
     }
 
+    cursor_cache_clear(display);
+
     G_OBJECT_CLASS(spice_display_parent_class)->finalize(obj);
 }
 
@@ -521,6 +585,13 @@ static void grab_notify(SpiceDisplay *display, gboolean was_grabbed)
         release_keys(display);
 }
 
+static void keys_changed(GdkKeymap *keymap G_GNUC_UNUSED, gpointer user_data)
+{
+    SpiceDisplay *display = user_data;
+
+    g_hash_table_remove_all(display->priv->keyval_scancodes);
+}
+
 static void spice_display_init(SpiceDisplay *display)
 {
     GtkWidget *widget = GTK_WIDGET(display);
@@ -528,10 +599,20 @@ static void spice_display_init(SpiceDisplay *display)
     GtkTargetEntry targets = { "text/uri-list", 0, 0 };
 
     d = display->priv = SPICE_DISPLAY_GET_PRIVATE(display);
+    pixman_region32_init(&d->damage);
+    d->front_buffer = g_getenv("SPICE_FRONT_BUFFER") != NULL;
+    d->xi_opcode = -1;
+#ifdef WITH_GL
+    pixman_region32_init(&d->gl.dirty);
+#endif
 
     g_signal_connect(display, "grab-broken-event", G_CALLBACK(grab_broken), NULL);
     g_signal_connect(display, "grab-notify", G_CALLBACK(grab_notify), NULL);
 
+    d->keyval_scancodes = g_hash_table_new(NULL, NULL);
+    d->keys_changed_id = g_signal_connect(gdk_keymap_get_default(), "keys-changed",
+                                          G_CALLBACK(keys_changed), display);
+
     gtk_drag_dest_set(widget, GTK_DEST_DEFAULT_ALL, &targets, 1, GDK_ACTION_COPY);
     g_signal_connect(display, "drag-data-received",
                      G_CALLBACK(drag_data_received_callback), NULL);
@@ -545,7 +626,8 @@ static void spice_display_init(SpiceDisplay *display)
                           GDK_ENTER_NOTIFY_MASK |
                           GDK_LEAVE_NOTIFY_MASK |
                           GDK_KEY_PRESS_MASK |
-                          GDK_SCROLL_MASK);
+                          GDK_SCROLL_MASK |
+                          GDK_VISIBILITY_NOTIFY_MASK);
 #ifdef WITH_X11
     gtk_widget_set_double_buffered(widget, false);
 #else
@@ -899,6 +981,7 @@ static GdkGrabStatus do_pointer_grab(SpiceDisplay *display)
         g_signal_emit(display, signals[SPICE_DISPLAY_MOUSE_GRAB], 0, true);
         spice_gtk_session_set_pointer_grabbed(d->gtk_session, true);
         set_mouse_accel(display, FALSE);
+        raw_motion_start(display);
     }
 
 end:
@@ -989,6 +1072,138 @@ static void mouse_wrap(SpiceDisplay *display, GdkEventMotion *motion)
 
 }
 
+#ifdef HAVE_XINPUT2
+static void raw_motion(SpiceDisplay *display, double dx, double dy)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    double s;
+    int x, y;
+
+    if (!d->inputs || d->disable_inputs ||
+        !d->mouse_grab_active || d->mouse_mode != SPICE_MOUSE_MODE_SERVER)
+        return;
+
+    /* keep the fractions, a precise mouse moves less than a pixel */
+    spice_display_get_scaling(display, &s, NULL, NULL, NULL, NULL);
+    d->raw_dx += dx / s;
+    d->raw_dy += dy / s;
+    x = (int)d->raw_dx;
+    y = (int)d->raw_dy;
+    if (x == 0 && y == 0)
+        return;
+    d->raw_dx -= x;
+    d->raw_dy -= y;
+
+    spice_inputs_motion(d->inputs, x, y, d->mouse_button_mask);
+    cursor_predict_motion(display, x, y);
+}
+
+static GdkFilterReturn raw_motion_filter(GdkXEvent *gdk_xevent,
+                                         GdkEvent *event G_GNUC_UNUSED,
+                                         gpointer data)
+{
+    SpiceDisplay *display = data;
+    SpiceDisplayPrivate *d = display->priv;
+    XGenericEventCookie *cookie = &((XEvent *)gdk_xevent)->xcookie;
+    Display *x_display = cookie->display;
+    gboolean fetched = FALSE;
+    double v[2] = { 0, 0 };
+    const double *values;
+    XIRawEvent *raw;
+    int i;
+
+    if (cookie->type != GenericEvent ||
+        cookie->extension != d->xi_opcode ||
+        cookie->evtype != XI_RawMotion)
+        return GDK_FILTER_CONTINUE;
+
+    /* gdk usually got it already */
+    if (cookie->data == NULL) {
+        if (!XGetEventData(x_display, cookie))
+            return GDK_FILTER_CONTINUE;
+        fetched = TRUE;
+    }
+
+    /* the values of the axes in the mask, accelerated as the pointer
+     * would be, X and Y are the first two */
+    raw = cookie->data;
+    values = raw->valuators.values;
+    for (i = 0; i < MIN(raw->valuators.mask_len * 8, 2); i++) {
+        if (XIMaskIsSet(raw->valuators.mask, i))
+            v[i] = *values++;
+    }
+
+    if (fetched)
+        XFreeEventData(x_display, cookie);
+
+    raw_motion(display, v[0], v[1]);
+
+    return GDK_FILTER_CONTINUE;
+}
+
+static void raw_motion_select(Display *x_display, gboolean enable)
+{
+    unsigned char bits[XIMaskLen(XI_RawMotion)] = { 0, };
+    XIEventMask mask;
+
+    mask.deviceid = XIAllMasterDevices;
+    mask.mask_len = sizeof(bits);
+    mask.mask = bits;
+    if (enable)
+        XISetMask(bits, XI_RawMotion);
+
+    XISelectEvents(x_display, DefaultRootWindow(x_display), &mask, 1);
+    XFlush(x_display);
+}
+#endif
+
+/* server mouse mode relative motion without warping the pointer and for
+ * the events it makes, when the windowing system can tell it */
+static void raw_motion_start(SpiceDisplay *display)
+{
+#ifdef HAVE_XINPUT2
+    SpiceDisplayPrivate *d = display->priv;
+    GdkDisplay *gdk_display = gtk_widget_get_display(GTK_WIDGET(display));
+    Display *x_display;
+    int event, error, major = 2, minor = 0;
+
+    if (d->raw_motion || d->mouse_mode != SPICE_MOUSE_MODE_SERVER)
+        return;
+    if (g_getenv("SPICE_DISABLE_RAW_MOTION") || !GDK_IS_X11_DISPLAY(gdk_display))
+        return;
+
+    x_display = GDK_DISPLAY_XDISPLAY(gdk_display);
+    if (d->xi_opcode == -1) {
+        if (!XQueryExtension(x_display, "XInputExtension", &d->xi_opcode, &event, &error) ||
+            XIQueryVersion(x_display, &major, &minor) != Success)
+            d->xi_opcode = 0;
+        SPICE_DEBUG("XInput2 raw motion %s", d->xi_opcode ? "available" : "unavailable");
+    }
+    if (d->xi_opcode == 0)
+        return;
+
+    d->raw_motion = TRUE;
+    d->raw_dx = d->raw_dy = 0;
+    gdk_window_add_filter(NULL, raw_motion_filter, display);
+    raw_motion_select(x_display, TRUE);
+#endif
+}
+
+static void raw_motion_stop(SpiceDisplay *display)
+{
+#ifdef HAVE_XINPUT2
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (!d->raw_motion)
+        return;
+
+    d->raw_motion = FALSE;
+    raw_motion_select(GDK_DISPLAY_XDISPLAY(gtk_widget_get_display(GTK_WIDGET(display))),
+                      FALSE);
+    gdk_window_remove_filter(NULL, raw_motion_filter, display);
+#endif
+}
+
 static void try_mouse_ungrab(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
@@ -998,6 +1213,7 @@ static void try_mouse_ungrab(SpiceDisplay *display)
     if (!d->mouse_grab_active)
         return;
 
+    raw_motion_stop(display);
     gdk_pointer_ungrab(GDK_CURRENT_TIME);
     gtk_grab_remove(GTK_WIDGET(display));
 #ifdef G_OS_WIN32
@@ -1050,62 +1266,107 @@ static void recalc_geometry(GtkWidget *widget)
     if (d->resize_guest_enable)
         spice_main_set_display(d->main, get_display_id(display),
                                d->area.x, d->area.y, d->ww / zoom, d->wh / zoom);
+
+    update_view(display);
+}
+
+/* tells the channel how it is displayed, see spice_display_set_view_scale() */
+static void update_view(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    gdouble s;
+
+    if (d->display == NULL)
+        return;
+
+    /* the scale is meaningless until there's a primary surface */
+    if (d->area.width > 0 && d->area.height > 0)
+        spice_display_get_scaling(display, &s, NULL, NULL, NULL, NULL);
+    else
+        s = 1.0;
+    spice_display_set_view_scale(d->display, display, s);
+    spice_display_set_view_visible(d->display, display,
+                                   gtk_widget_get_mapped(GTK_WIDGET(display)) && !d->obscured);
 }
 
 /* ---------------------------------------------------------------- */
 
-#define CONVERT_0565_TO_0888(s)                                         \
-    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |                       \
-     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |                   \
-     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
+/*
+ * With a front buffer, the 32 bits pixels are copied as they are: the
+ * widget only paints what the damage flushes gave it, whole frames of
+ * the channel, never a primary that is half updated.
+ */
+static void do_front_copy(SpiceDisplay *display, GdkRectangle *r)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    guint32 *dest = d->data;
+    guint8 *src = d->data_origin;
+    gint y;
 
-#define CONVERT_0565_TO_8888(s) (CONVERT_0565_TO_0888(s) | 0xff000000)
+    src += d->stride * r->y + r->x * 4;
+    dest += d->area.width * (r->y - d->area.y) + (r->x - d->area.x);
 
-#define CONVERT_0555_TO_0888(s)                                         \
-    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |                  \
-     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |                  \
-     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
+    for (y = 0; y < r->height; y++) {
+        memcpy(dest, src, r->width * 4);
 
-#define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
+        dest += d->area.width;
+        src += d->stride;
+    }
+}
 
 static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
 {
     SpiceDisplayPrivate *d = display->priv;
+    const SpiceColorConverter *converter = spice_color_converter_get();
+    SpiceColorConvertRow convert;
     guint32 *dest = d->data;
     guint16 *src = d->data_origin;
-    gint x, y;
+    gint y;
 
     g_return_val_if_fail(r != NULL, false);
-    g_return_val_if_fail(d->format == SPICE_SURFACE_FMT_16_555 ||
-                         d->format == SPICE_SURFACE_FMT_16_565, false);
+
+    if (d->format != SPICE_SURFACE_FMT_16_555 &&
+        d->format != SPICE_SURFACE_FMT_16_565) {
+        g_return_val_if_fail(d->front_buffer, false);
+        do_front_copy(display, r);
+        return true;
+    }
 
     src += (d->stride / 2) * r->y + r->x;
     dest += d->area.width * (r->y - d->area.y) + (r->x - d->area.x);
 
-    if (d->format == SPICE_SURFACE_FMT_16_555) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0555_TO_0888(src[x]);
-            }
+    if (d->format == SPICE_SURFACE_FMT_16_555)
+        convert = converter->convert_555;
+    else
+        convert = converter->convert_565;
 
-            dest += d->area.width;
-            src += d->stride / 2;
-        }
-    } else if (d->format == SPICE_SURFACE_FMT_16_565) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0565_TO_0888(src[x]);
-            }
+    for (y = 0; y < r->height; y++) {
+        convert(dest, src, r->width);
 
-            dest += d->area.width;
-            src += d->stride / 2;
-        }
+        dest += d->area.width;
+        src += d->stride / 2;
     }
 
     return true;
 }
 
 
+static void update_present_latency(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    guint latency;
+
+    if (d->present_time == 0)
+        return;
+
+    latency = g_get_monotonic_time() - d->present_time;
+    if (d->present_latency == 0)
+        d->present_latency = latency;
+    else
+        d->present_latency = (d->present_latency * 7 + latency) / 8;
+    d->present_time = 0;
+}
+
 #if GTK_CHECK_VERSION (2, 91, 0)
 static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
 {
@@ -1118,8 +1379,20 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
         return false;
     g_return_val_if_fail(d->ximage != NULL, false);
 
+#ifdef ENABLE_SYSTEMTAP
+    {
+        GdkRectangle clip;
+
+        gdk_cairo_get_clip_rectangle(cr, &clip);
+        SPICE_TRACE4(widget_paint, clip.x, clip.y, clip.width, clip.height);
+    }
+#endif
     spicex_draw_event(display, cr);
+    SPICE_TRACE1(widget_painted, d->channel_id);
     update_mouse_pointer(display);
+    update_present_latency(display);
+    if (d->display)
+        spice_display_presented(d->display);
 
     return true;
 }
@@ -1135,8 +1408,14 @@ static gboolean expose_event(GtkWidget *widget, GdkEventExpose *expose)
         return false;
     g_return_val_if_fail(d->ximage != NULL, false);
 
+    SPICE_TRACE4(widget_paint, expose->area.x, expose->area.y,
+                 expose->area.width, expose->area.height);
     spicex_expose_event(display, expose);
+    SPICE_TRACE1(widget_painted, d->channel_id);
     update_mouse_pointer(display);
+    update_present_latency(display);
+    if (d->display)
+        spice_display_presented(d->display);
 
     return true;
 }
@@ -1203,6 +1482,10 @@ static void send_key(SpiceDisplay *display, int scancode, SendKeyType type, gboo
 
     switch (type) {
     case SEND_KEY_PRESS:
+        /* a press of a pressed key is the client autorepeat */
+        if (d->guest_key_repeat && (d->key_state[i] & m))
+            break;
+
         /* ensure delayed key is pressed before any new input event */
         key_press_delayed(display);
 
@@ -1382,21 +1665,53 @@ static gboolean key_event(GtkWidget *widget, GdkEventKey *key)
 static guint get_scancode_from_keyval(SpiceDisplay *display, guint keyval)
 {
     SpiceDisplayPrivate *d = display->priv;
-    guint keycode = 0;
+    guint keycode = 0, scancode = 0;
     GdkKeymapKey *keys = NULL;
     gint n_keys = 0;
+    gpointer value;
+
+    /* the keymap lookup walks every key, a sequence would do it per keyval */
+    if (g_hash_table_lookup_extended(d->keyval_scancodes, GUINT_TO_POINTER(keyval),
+                                     NULL, &value))
+        return GPOINTER_TO_UINT(value);
 
     if (gdk_keymap_get_entries_for_keyval(gdk_keymap_get_default(),
                                           keyval, &keys, &n_keys)) {
         /* FIXME what about levels? */
         keycode = keys[0].keycode;
         g_free(keys);
+        scancode = vnc_display_keymap_gdk2xtkbd(d->keycode_map, d->keycode_maplen, keycode);
     } else {
         g_warning("could not lookup keyval %u, please report a bug", keyval);
-        return 0;
     }
 
-    return vnc_display_keymap_gdk2xtkbd(d->keycode_map, d->keycode_maplen, keycode);
+    g_hash_table_insert(d->keyval_scancodes, GUINT_TO_POINTER(keyval),
+                        GUINT_TO_POINTER(scancode));
+    return scancode;
+}
+
+/* updates key_state as send_key() does, false if there's nothing to send */
+static bool key_sequence_add(SpiceDisplay *display, int scancode, SendKeyType type)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    uint32_t i, b, m;
+
+    g_return_val_if_fail(scancode != 0, false);
+
+    i = scancode / 32;
+    b = scancode % 32;
+    m = (1 << b);
+    g_return_val_if_fail(i < SPICE_N_ELEMENTS(d->key_state), false);
+
+    if (type == SEND_KEY_PRESS) {
+        d->key_state[i] |= m;
+        return true;
+    }
+
+    if (!(d->key_state[i] & m))
+        return false;
+    d->key_state[i] &= ~m;
+    return true;
 }
 
 
@@ -1413,6 +1728,9 @@ static guint get_scancode_from_keyval(SpiceDisplay *display, guint keyval)
 void spice_display_send_keys(SpiceDisplay *display, const guint *keyvals,
                              int nkeyvals, SpiceDisplayKeyEvent kind)
 {
+    SpiceDisplayPrivate *d;
+    guint *scancodes;
+    guint n = 0;
     int i;
 
     g_return_if_fail(SPICE_IS_DISPLAY(display));
@@ -1420,15 +1738,36 @@ void spice_display_send_keys(SpiceDisplay *display, const guint *keyvals,
 
     SPICE_DEBUG("%s", __FUNCTION__);
 
+    d = display->priv;
+    if (!d->inputs || d->disable_inputs)
+        return;
+
+    /* ensure delayed key is pressed before the sequence */
+    key_press_delayed(display);
+
+    /* all of it in as few messages as the server allows */
+    scancodes = g_new(guint, nkeyvals * 2);
+
     if (kind & SPICE_DISPLAY_KEY_EVENT_PRESS) {
-        for (i = 0 ; i < nkeyvals ; i++)
-            send_key(display, get_scancode_from_keyval(display, keyvals[i]), SEND_KEY_PRESS, FALSE);
+        for (i = 0 ; i < nkeyvals ; i++) {
+            guint scancode = get_scancode_from_keyval(display, keyvals[i]);
+
+            if (key_sequence_add(display, scancode, SEND_KEY_PRESS))
+                scancodes[n++] = scancode;
+        }
     }
 
     if (kind & SPICE_DISPLAY_KEY_EVENT_RELEASE) {
-        for (i = (nkeyvals-1) ; i >= 0 ; i--)
-            send_key(display, get_scancode_from_keyval(display, keyvals[i]), SEND_KEY_RELEASE, FALSE);
+        for (i = (nkeyvals-1) ; i >= 0 ; i--) {
+            guint scancode = get_scancode_from_keyval(display, keyvals[i]);
+
+            if (key_sequence_add(display, scancode, SEND_KEY_RELEASE))
+                scancodes[n++] = scancode | SPICE_INPUTS_KEY_RELEASE;
+        }
     }
+
+    spice_inputs_key_sequence(d->inputs, scancodes, n);
+    g_free(scancodes);
 }
 
 static gboolean enter_event(GtkWidget *widget, GdkEventCrossing *crossing G_GNUC_UNUSED)
@@ -1500,9 +1839,14 @@ static gboolean focus_out_event(GtkWidget *widget, GdkEventFocus *focus G_GNUC_U
     /*
      * Ignore focus out after a keyboard grab
      * (this happens when doing the grab from the enter_event callback).
+     * The guest repeating a key until we send its release, a key held
+     * then is released anyway: its key-up may never reach us.
      */
-    if (d->keyboard_grab_active)
+    if (d->keyboard_grab_active) {
+        if (d->guest_key_repeat)
+            release_keys(display);
         return true;
+    }
 
     release_keys(display);
     update_keyboard_focus(display, false);
@@ -1606,12 +1950,17 @@ static gboolean motion_event(GtkWidget *widget, GdkEventMotion *motion)
         }
         break;
     case SPICE_MOUSE_MODE_SERVER:
+        /* the raw events have it, and the pointer is never warped */
+        if (d->mouse_grab_active && d->raw_motion)
+            break;
         if (d->mouse_grab_active) {
             gint dx = d->mouse_last_x != -1 ? x - d->mouse_last_x : 0;
             gint dy = d->mouse_last_y != -1 ? y - d->mouse_last_y : 0;
 
             spice_inputs_motion(d->inputs, dx, dy,
                                 button_mask_gdk_to_spice(motion->state));
+            if (dx != 0 || dy != 0)
+                cursor_predict_motion(display, dx, dy);
 
             d->mouse_last_x = x;
             d->mouse_last_y = y;
@@ -1700,6 +2049,14 @@ static gboolean button_event(GtkWidget *widget, GdkEventButton *button)
     if (!d->inputs)
         return true;
 
+    d->mouse_button_mask = button_mask_gdk_to_spice(button->state);
+    if (button->button >= 1 && button->button <= 3) {
+        if (button->type == GDK_BUTTON_PRESS)
+            d->mouse_button_mask |= 1 << (button->button - 1);
+        else if (button->type == GDK_BUTTON_RELEASE)
+            d->mouse_button_mask &= ~(1 << (button->button - 1));
+    }
+
     switch (button->type) {
     case GDK_BUTTON_PRESS:
         spice_inputs_button_press(d->inputs,
@@ -1750,9 +2107,12 @@ static void update_image(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
 
+    /* the whole area is converted and drawn again */
+    damage_clear(display);
     spicex_image_create(display);
     if (d->convert)
         do_color_convert(display, &d->area);
+    spicex_image_invalidate(display, &d->area);
 }
 
 static void realize(GtkWidget *widget)
@@ -1765,12 +2125,40 @@ static void realize(GtkWidget *widget)
     d->keycode_map =
         vnc_display_keymap_gdk2xtkbd_table(gtk_widget_get_window(widget),
                                            &d->keycode_maplen);
+    g_hash_table_remove_all(d->keyval_scancodes);
     update_image(display);
 }
 
+static void map(GtkWidget *widget)
+{
+    GTK_WIDGET_CLASS(spice_display_parent_class)->map(widget);
+    update_view(SPICE_DISPLAY(widget));
+}
+
+static void unmap(GtkWidget *widget)
+{
+    /* no key-up will come anymore */
+    release_keys(SPICE_DISPLAY(widget));
+    GTK_WIDGET_CLASS(spice_display_parent_class)->unmap(widget);
+    update_view(SPICE_DISPLAY(widget));
+}
+
+static gboolean visibility_notify_event(GtkWidget *widget, GdkEventVisibility *visibility)
+{
+    SpiceDisplay *display = SPICE_DISPLAY(widget);
+
+    display->priv->obscured = visibility->state == GDK_VISIBILITY_FULLY_OBSCURED;
+    update_view(display);
+
+    return false;
+}
+
 static void unrealize(GtkWidget *widget)
 {
     spicex_image_destroy(SPICE_DISPLAY(widget));
+#ifdef WITH_GL
+    spicex_gl_cleanup(SPICE_DISPLAY(widget));
+#endif
 
     GTK_WIDGET_CLASS(spice_display_parent_class)->unrealize(widget);
 }
@@ -1801,6 +2189,9 @@ static void spice_display_class_init(SpiceDisplayClass *klass)
     gtkwidget_class->scroll_event = scroll_event;
     gtkwidget_class->realize = realize;
     gtkwidget_class->unrealize = unrealize;
+    gtkwidget_class->map = map;
+    gtkwidget_class->unmap = unmap;
+    gtkwidget_class->visibility_notify_event = visibility_notify_event;
 
     gobject_class->constructor = spice_display_constructor;
     gobject_class->dispose = spice_display_dispose;
@@ -2005,6 +2396,101 @@ static void spice_display_class_init(SpiceDisplayClass *klass)
                           G_PARAM_CONSTRUCT |
                           G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplay:frame-paced:
+     *
+     * Flush the display updates on the frame clock, so that they are
+     * presented at most once per refresh of the client monitor. When
+     * disabled, or with GTK+ older than 3.8, the updates are flushed
+     * just before GTK+ redraws.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_FRAME_PACED,
+         g_param_spec_boolean("frame-paced",
+                              "Frame paced",
+                              "Present the display updates on the frame clock",
+                              TRUE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplay:present-latency:
+     *
+     * Smoothed delay between the invalidation of the display by the
+     * server and its drawing in the widget, in microseconds.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_PRESENT_LATENCY,
+         g_param_spec_uint("present-latency",
+                           "Present latency",
+                           "Delay between display updates and their drawing, in us",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplay:predict-cursor:
+     *
+     * In server mouse mode, draw the cursor where the pointer motion
+     * sent to the guest will bring it, without waiting for the server
+     * to move it. The prediction is corrected as the server moves
+     * the cursor.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_PREDICT_CURSOR,
+         g_param_spec_boolean("predict-cursor",
+                              "Predict cursor",
+                              "Draw the cursor ahead of the server in server mouse mode",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplay:cursor-prediction-error:
+     *
+     * Smoothed distance between the predicted cursor positions and the
+     * ones later sent by the server, in guest pixels.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_CURSOR_PREDICTION_ERROR,
+         g_param_spec_double("cursor-prediction-error",
+                             "Cursor prediction error",
+                             "Distance between the predicted and the server cursor positions",
+                             0, G_MAXDOUBLE, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplay:guest-key-repeat:
+     *
+     * Let the guest repeat the held keys: the autorepeat of the client
+     * is not forwarded, only the first press of a key and its release
+     * are sent. This avoids irregular repeats and a flood of messages
+     * over a slow link. The held keys are released when the widget
+     * loses the focus or is unmapped.
+     *
+     * Since: 0.29
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GUEST_KEY_REPEAT,
+         g_param_spec_boolean("guest-key-repeat",
+                              "Guest key repeat",
+                              "Let the guest repeat the held keys",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT |
+                              G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplay::mouse-grab:
      * @display: the #SpiceDisplay that emitted the signal
@@ -2081,6 +2567,7 @@ static void update_mouse_mode(SpiceChannel *channel, gpointer data)
     case SPICE_MOUSE_MODE_SERVER:
         d->mouse_guest_x = -1;
         d->mouse_guest_y = -1;
+        cursor_predict_reset(display);
 
         if (window != NULL) {
             GdkModifierType modifiers;
@@ -2118,6 +2605,7 @@ static void update_area(SpiceDisplay *display,
 
     if (!gdk_rectangle_intersect(&primary, &area, &area)) {
         SPICE_DEBUG("The monitor area is not intersecting primary surface");
+        spicex_image_destroy(display);
         memset(&d->area, '\0', sizeof(d->area));
         set_monitor_ready(display, false);
         return;
@@ -2155,6 +2643,7 @@ static void primary_destroy(SpiceChannel *channel, gpointer data)
     SpiceDisplay *display = SPICE_DISPLAY(data);
     SpiceDisplayPrivate *d = display->priv;
 
+    damage_clear(display);
     spicex_image_destroy(display);
     d->width  = 0;
     d->height = 0;
@@ -2165,14 +2654,111 @@ static void primary_destroy(SpiceChannel *channel, gpointer data)
     set_monitor_ready(display, false);
 }
 
+static void damage_flush(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    pixman_region32_t area;
+    pixman_box32_t *boxes;
+    int display_x, display_y;
+    double s;
+    int i, n;
+
+    if (d->data == NULL || !gtk_widget_get_window(GTK_WIDGET(display)))
+        goto end;
+
+    pixman_region32_init_rect(&area, d->area.x, d->area.y,
+                              d->area.width, d->area.height);
+    pixman_region32_intersect(&d->damage, &d->damage, &area);
+    pixman_region32_fini(&area);
+
+    spice_display_get_scaling(display, &s,
+                              &display_x, &display_y,
+                              NULL, NULL);
+
+    boxes = pixman_region32_rectangles(&d->damage, &n);
+    if (n > 0 && d->present_time == 0)
+        d->present_time = d->damage_time;
+    for (i = 0; i < n; i++) {
+        GdkRectangle rect = {
+            .x = boxes[i].x1,
+            .y = boxes[i].y1,
+            .width = boxes[i].x2 - boxes[i].x1,
+            .height = boxes[i].y2 - boxes[i].y1
+        };
+        int x1, y1, x2, y2;
+
+        if (d->convert)
+            do_color_convert(display, &rect);
+        spicex_image_invalidate(display, &rect);
+
+        x1 = floor ((rect.x - d->area.x) * s);
+        y1 = floor ((rect.y - d->area.y) * s);
+        x2 = ceil ((rect.x - d->area.x + rect.width) * s);
+        y2 = ceil ((rect.y - d->area.y + rect.height) * s);
+
+        gtk_widget_queue_draw_area(GTK_WIDGET(display),
+                                   display_x + x1, display_y + y1,
+                                   x2 - x1, y2-y1);
+    }
+
+end:
+    pixman_region32_fini(&d->damage);
+    pixman_region32_init(&d->damage);
+}
+
+#if GTK_CHECK_VERSION (3, 8, 0)
+static gboolean damage_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    SpiceDisplay *display = SPICE_DISPLAY(widget);
+
+    display->priv->damage_flush_id = 0;
+    damage_flush(display);
+
+    return G_SOURCE_REMOVE;
+}
+#endif
+
+static gboolean damage_idle(gpointer data)
+{
+    SpiceDisplay *display = data;
+
+    display->priv->damage_flush_id = 0;
+    damage_flush(display);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void damage_clear(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    pixman_region32_fini(&d->damage);
+    pixman_region32_init(&d->damage);
+    if (d->damage_flush_id == 0)
+        return;
+
+#if GTK_CHECK_VERSION (3, 8, 0)
+    if (d->damage_flush_tick)
+        gtk_widget_remove_tick_callback(GTK_WIDGET(display), d->damage_flush_id);
+    else
+#endif
+        g_source_remove(d->damage_flush_id);
+    d->damage_flush_id = 0;
+}
+
+/* above this, the damage is flushed as a single rectangle */
+#define DAMAGE_MAX_RECTS 16
+
+/*
+ * The display channel may emit hundreds of invalidations per frame. The
+ * damage is accumulated, and converted and queued for redraw once per
+ * frame: on the frame clock when available, or just before GTK redraws.
+ */
 static void invalidate(SpiceChannel *channel,
                        gint x, gint y, gint w, gint h, gpointer data)
 {
     SpiceDisplay *display = data;
     SpiceDisplayPrivate *d = display->priv;
-    int display_x, display_y;
-    int x1, y1, x2, y2;
-    double s;
     GdkRectangle rect = {
         .x = x,
         .y = y,
@@ -2186,21 +2772,50 @@ static void invalidate(SpiceChannel *channel,
     if (!gdk_rectangle_intersect(&rect, &d->area, &rect))
         return;
 
-    if (d->convert)
-        do_color_convert(display, &rect);
+    if (!pixman_region32_not_empty(&d->damage))
+        d->damage_time = g_get_monotonic_time();
+    pixman_region32_union_rect(&d->damage, &d->damage,
+                               rect.x, rect.y, rect.width, rect.height);
+    if (pixman_region32_n_rects(&d->damage) > DAMAGE_MAX_RECTS) {
+        pixman_box32_t extents = *pixman_region32_extents(&d->damage);
 
-    spice_display_get_scaling(display, &s,
-                              &display_x, &display_y,
-                              NULL, NULL);
+        pixman_region32_reset(&d->damage, &extents);
+    }
 
-    x1 = floor ((rect.x - d->area.x) * s);
-    y1 = floor ((rect.y - d->area.y) * s);
-    x2 = ceil ((rect.x - d->area.x + rect.width) * s);
-    y2 = ceil ((rect.y - d->area.y + rect.height) * s);
+    if (d->damage_flush_id != 0)
+        return;
 
-    gtk_widget_queue_draw_area(GTK_WIDGET(display),
-                               display_x + x1, display_y + y1,
-                               x2 - x1, y2-y1);
+#if GTK_CHECK_VERSION (3, 8, 0)
+    d->damage_flush_tick = d->frame_paced;
+    if (d->damage_flush_tick) {
+        d->damage_flush_id = gtk_widget_add_tick_callback(GTK_WIDGET(display),
+                                                          damage_tick, NULL, NULL);
+        return;
+    }
+#endif
+    d->damage_flush_id = g_idle_add_full(GDK_PRIORITY_REDRAW - 1, damage_idle,
+                                         display, NULL);
+}
+
+/*
+ * With several monitors on the primary surface, the channel sends each
+ * widget the updates of its monitor only, rather than all of them.
+ */
+static void connect_invalidate(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    gchar *signal;
+
+    if (d->invalidate_id != 0)
+        g_signal_handler_disconnect(d->display, d->invalidate_id);
+
+    if (d->monitor_id < 0)
+        signal = g_strdup("display-invalidate");
+    else
+        signal = g_strdup_printf("display-invalidate-monitor::%d", d->monitor_id);
+    d->invalidate_id = spice_g_signal_connect_object(d->display, signal,
+                                                     G_CALLBACK(invalidate), display, 0);
+    g_free(signal);
 }
 
 static void mark(SpiceDisplay *display, gint mark)
@@ -2213,6 +2828,96 @@ static void mark(SpiceDisplay *display, gint mark)
     update_ready(display);
 }
 
+/*
+ * The guests set the same few cursors over and over, keep the GdkCursor
+ * made for them: creating one is a round trip to the windowing system.
+ * The cursor-set signal has no id, the entries are found by content.
+ */
+#define CURSOR_CACHE_MAX 16
+
+typedef struct {
+    gint width, height, hot_x, hot_y;
+    guint32 hash;
+    GdkPixbuf *pixbuf;
+    GdkCursor *cursor;
+} SpiceCursorCacheEntry;
+
+static guint32 cursor_hash(const guint32 *rgba, gsize n)
+{
+    guint32 h = 2166136261u;
+    gsize i;
+
+    /* FNV-1a on the pixels */
+    for (i = 0; i < n; i++)
+        h = (h ^ rgba[i]) * 16777619u;
+
+    return h;
+}
+
+static void cursor_cache_entry_free(SpiceCursorCacheEntry *entry)
+{
+    g_object_unref(entry->pixbuf);
+    gdk_cursor_unref(entry->cursor);
+    g_slice_free(SpiceCursorCacheEntry, entry);
+}
+
+static void cursor_cache_clear(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    SpiceCursorCacheEntry *entry;
+
+    while ((entry = g_queue_pop_head(&d->cursor_cache)) != NULL)
+        cursor_cache_entry_free(entry);
+}
+
+static SpiceCursorCacheEntry *cursor_cache_get(SpiceDisplay *display,
+                                               gint width, gint height,
+                                               gint hot_x, gint hot_y,
+                                               gpointer rgba)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    gsize size = (gsize)width * height * 4;
+    guint32 hash = cursor_hash(rgba, size / 4);
+    SpiceCursorCacheEntry *entry;
+    GList *l;
+
+    for (l = d->cursor_cache.head; l != NULL; l = l->next) {
+        entry = l->data;
+        if (entry->hash == hash &&
+            entry->width == width && entry->height == height &&
+            entry->hot_x == hot_x && entry->hot_y == hot_y &&
+            memcmp(gdk_pixbuf_get_pixels(entry->pixbuf), rgba, size) == 0) {
+            if (l != d->cursor_cache.head) {
+                g_queue_unlink(&d->cursor_cache, l);
+                g_queue_push_head_link(&d->cursor_cache, l);
+            }
+            return entry;
+        }
+    }
+
+    entry = g_slice_new(SpiceCursorCacheEntry);
+    entry->width = width;
+    entry->height = height;
+    entry->hot_x = hot_x;
+    entry->hot_y = hot_y;
+    entry->hash = hash;
+    entry->pixbuf = gdk_pixbuf_new_from_data(g_memdup(rgba, size),
+                                             GDK_COLORSPACE_RGB,
+                                             TRUE, 8,
+                                             width,
+                                             height,
+                                             width * 4,
+                                             (GdkPixbufDestroyNotify)g_free, NULL);
+    entry->cursor = gdk_cursor_new_from_pixbuf(gtk_widget_get_display(GTK_WIDGET(display)),
+                                               entry->pixbuf, hot_x, hot_y);
+    g_queue_push_head(&d->cursor_cache, entry);
+
+    if (g_queue_get_length(&d->cursor_cache) > CURSOR_CACHE_MAX)
+        cursor_cache_entry_free(g_queue_pop_tail(&d->cursor_cache));
+
+    return entry;
+}
+
 static void cursor_set(SpiceCursorChannel *channel,
                        gint width, gint height, gint hot_x, gint hot_y,
                        gpointer rgba, gpointer data)
@@ -2229,17 +2934,13 @@ static void cursor_set(SpiceCursorChannel *channel,
     }
 
     if (rgba != NULL) {
-        d->mouse_pixbuf = gdk_pixbuf_new_from_data(g_memdup(rgba, width * height * 4),
-                                                   GDK_COLORSPACE_RGB,
-                                                   TRUE, 8,
-                                                   width,
-                                                   height,
-                                                   width * 4,
-                                                   (GdkPixbufDestroyNotify)g_free, NULL);
+        SpiceCursorCacheEntry *entry =
+            cursor_cache_get(display, width, height, hot_x, hot_y, rgba);
+
+        d->mouse_pixbuf = g_object_ref(entry->pixbuf);
         d->mouse_hotspot.x = hot_x;
         d->mouse_hotspot.y = hot_y;
-        cursor = gdk_cursor_new_from_pixbuf(gtk_widget_get_display(GTK_WIDGET(display)),
-                                            d->mouse_pixbuf, hot_x, hot_y);
+        cursor = gdk_cursor_ref(entry->cursor);
     } else
         g_warn_if_reached();
 
@@ -2355,17 +3056,123 @@ static void cursor_invalidate(SpiceDisplay *display)
                                ceil (gdk_pixbuf_get_height(d->mouse_pixbuf) * s));
 }
 
-static void cursor_move(SpiceCursorChannel *channel, gint x, gint y, gpointer data)
+/*
+ * Cursor prediction, in server mouse mode: the cursor is drawn at the
+ * last server position plus the motion sent since, which the server
+ * has not shown yet. Each server move consumes the pending motion it
+ * accounts for, what it does not account for is prediction error
+ * (guest pointer acceleration, warps, ...).
+ */
+#define PREDICT_SETTLE_US (200 * 1000)
+
+static void cursor_predict_reset(SpiceDisplay *display)
 {
-    SpiceDisplay *display = data;
     SpiceDisplayPrivate *d = display->priv;
 
-    cursor_invalidate(display);
+    /* unknown, until the server moves the cursor */
+    d->mouse_server_x = -1;
+    d->mouse_server_y = -1;
+    d->predict_dx = 0;
+    d->predict_dy = 0;
+}
 
+/* draws the cursor at the server position moved by the pending motion */
+static void cursor_predict_update(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    int x = CLAMP(d->mouse_server_x + d->predict_dx, 0, MAX(d->width - 1, 0));
+    int y = CLAMP(d->mouse_server_y + d->predict_dy, 0, MAX(d->height - 1, 0));
+
+    /* the guest cursor stops at the edges too */
+    d->predict_dx = x - d->mouse_server_x;
+    d->predict_dy = y - d->mouse_server_y;
+
+    if (x == d->mouse_guest_x && y == d->mouse_guest_y)
+        return;
+
+    cursor_invalidate(display);
     d->mouse_guest_x = x;
     d->mouse_guest_y = y;
-
     cursor_invalidate(display);
+}
+
+static void cursor_predict_motion(SpiceDisplay *display, gint dx, gint dy)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    /* until the server gave a position, there is nothing to move */
+    if (!d->predict_cursor || d->mouse_server_x == -1)
+        return;
+
+    d->predict_dx += dx;
+    d->predict_dy += dy;
+    d->predict_time = g_get_monotonic_time();
+    cursor_predict_update(display);
+}
+
+/* removes @moved from @pending, returns what @pending did not cover */
+static int cursor_predict_consume(int *pending, int moved)
+{
+    int covered;
+
+    if ((*pending > 0 && moved > 0) || (*pending < 0 && moved < 0)) {
+        covered = ABS(moved) < ABS(*pending) ? moved : *pending;
+        *pending -= covered;
+        return moved - covered;
+    }
+
+    return moved;
+}
+
+static void cursor_predict_server_move(SpiceDisplay *display, gint x, gint y)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    int ex, ey;
+    guint error;
+
+    if (d->mouse_server_x == -1) {
+        d->mouse_server_x = x;
+        d->mouse_server_y = y;
+        cursor_predict_update(display);
+        return;
+    }
+
+    ex = cursor_predict_consume(&d->predict_dx, x - d->mouse_server_x);
+    ey = cursor_predict_consume(&d->predict_dy, y - d->mouse_server_y);
+
+    /* the motion was idle long enough for the server to catch up */
+    if (g_get_monotonic_time() - d->predict_time > PREDICT_SETTLE_US) {
+        ex -= d->predict_dx;
+        ey -= d->predict_dy;
+        d->predict_dx = 0;
+        d->predict_dy = 0;
+    }
+
+    error = sqrt((double)ex * ex + (double)ey * ey) * 16;
+    d->predict_error = (d->predict_error * 7 + error) / 8;
+
+    d->mouse_server_x = x;
+    d->mouse_server_y = y;
+    cursor_predict_update(display);
+}
+
+static void cursor_move(SpiceCursorChannel *channel, gint x, gint y, gpointer data)
+{
+    SpiceDisplay *display = data;
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->predict_cursor && d->mouse_mode == SPICE_MOUSE_MODE_SERVER) {
+        cursor_predict_server_move(display, x, y);
+    } else {
+        cursor_invalidate(display);
+
+        d->mouse_guest_x = x;
+        d->mouse_guest_y = y;
+        d->mouse_server_x = x;
+        d->mouse_server_y = y;
+
+        cursor_invalidate(display);
+    }
 
     /* apparently we have to restore cursor when "cursor_move" */
     if (d->show_cursor != NULL) {
@@ -2414,8 +3221,8 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
                                       G_CALLBACK(primary_create), display, 0);
         spice_g_signal_connect_object(channel, "display-primary-destroy",
                                       G_CALLBACK(primary_destroy), display, 0);
-        spice_g_signal_connect_object(channel, "display-invalidate",
-                                      G_CALLBACK(invalidate), display, 0);
+        connect_invalidate(display);
+        update_view(display);
         spice_g_signal_connect_object(channel, "display-mark",
                                       G_CALLBACK(mark), display, G_CONNECT_AFTER | G_CONNECT_SWAPPED);
         spice_g_signal_connect_object(channel, "notify::monitors",
@@ -2481,6 +3288,9 @@ static void channel_destroy(SpiceSession *s, SpiceChannel *channel, gpointer dat
         if (id != d->channel_id)
             return;
         primary_destroy(d->display, display);
+        spice_display_set_view_scale(d->display, display, 0);
+        g_signal_handler_disconnect(d->display, d->invalidate_id);
+        d->invalidate_id = 0;
         d->display = NULL;
         return;
     }
@@ -2617,7 +3427,8 @@ GdkPixbuf *spice_display_get_pixbuf(SpiceDisplay *display)
     g_return_val_if_fail(d->data != NULL, NULL);
 
     data = g_malloc0(d->area.width * d->area.height * 3);
-    src = d->data;
+    /* the copy only covers the area */
+    src = d->front_buffer ? d->data_origin : d->data;
     dest = data;
 
     src += d->area.y * d->stride + d->area.x * 4;
@@ -0,0 +1,400 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <glib/gi18n.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-cmdline.h"
+#include "spicy-script.h"
+
+/*
+ * Runs a number of sessions against a server, without any widget: the
+ * display channels decode into their surfaces, the cursor and playback
+ * data are dropped. Inputs can be played from a script, see
+ * spicy-script.h.
+ *
+ * Every interval, a JSON object is printed on a line for each session.
+ * The frames are the main loop iterations with an invalidated area, as
+ * a widget would redraw them, and the input latency is the time from
+ * an input to the next frame.
+ */
+
+typedef struct {
+    guint index;
+    SpiceSession *session;
+    gboolean ended;
+
+    /* display */
+    guint frame_id;
+    guint64 frames, invalidates;
+    guint64 last_frames;
+    gint64 last_report;
+
+    /* inputs */
+    SpicyScriptPlayer player;
+    gint64 input_time; /* of the first input not followed by a frame yet */
+    guint64 latency_total_us, latency_max_us, n_latencies;
+
+    guint64 cursor_sets, audio_bytes;
+} Client;
+
+/* config */
+static gboolean version = FALSE;
+static gint n_sessions = 1;
+static gint interval = 1;
+static gint duration = 0;
+static gchar *script_file = NULL;
+static gboolean repeat = FALSE;
+
+/* state */
+static GMainLoop     *mainloop;
+static Client        *clients;
+static GArray        *script; /* SpicyCommand */
+static gint64        start_time;
+static guint         n_running;
+
+/* ------------------------------------------------------------------ */
+
+static void client_input_sent(gpointer user_data)
+{
+    Client *client = user_data;
+
+    if (client->input_time == 0)
+        client->input_time = g_get_monotonic_time();
+}
+
+/* ------------------------------------------------------------------ */
+
+static gboolean client_frame(gpointer user_data)
+{
+    Client *client = user_data;
+
+    client->frame_id = 0;
+    client->frames++;
+
+    if (client->input_time != 0) {
+        guint64 latency = g_get_monotonic_time() - client->input_time;
+
+        client->latency_total_us += latency;
+        client->latency_max_us = MAX(client->latency_max_us, latency);
+        client->n_latencies++;
+        client->input_time = 0;
+    }
+
+    return FALSE;
+}
+
+static void display_invalidate(SpiceChannel *channel, gint x, gint y, gint w, gint h,
+                               gpointer user_data)
+{
+    Client *client = user_data;
+
+    client->invalidates++;
+    if (client->frame_id == 0)
+        client->frame_id = g_idle_add(client_frame, client);
+}
+
+static void cursor_set(SpiceChannel *channel, gint width, gint height,
+                       gint hot_x, gint hot_y, gpointer rgba, gpointer user_data)
+{
+    Client *client = user_data;
+
+    client->cursor_sets++;
+}
+
+static void playback_data(SpiceChannel *channel, gpointer data, gint size,
+                          gpointer user_data)
+{
+    Client *client = user_data;
+
+    client->audio_bytes += size;
+}
+
+static void client_end(Client *client)
+{
+    if (client->ended)
+        return;
+
+    client->ended = TRUE;
+    spicy_script_player_stop(&client->player);
+    client->player.inputs = NULL;
+    if (--n_running == 0)
+        g_main_loop_quit(mainloop);
+}
+
+static void main_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
+                               gpointer user_data)
+{
+    Client *client = user_data;
+
+    switch (event) {
+    case SPICE_CHANNEL_OPENED:
+        break;
+    default:
+        g_warning("session %u: main channel event: %d", client->index, event);
+        client_end(client);
+    }
+}
+
+static void inputs_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
+                                 gpointer user_data)
+{
+    Client *client = user_data;
+
+    if (event != SPICE_CHANNEL_OPENED) {
+        spicy_script_player_stop(&client->player);
+        client->player.inputs = NULL;
+        return;
+    }
+
+    if (script != NULL && !client->ended) {
+        client->player.inputs = SPICE_INPUTS_CHANNEL(channel);
+        spicy_script_player_run(&client->player);
+    }
+}
+
+static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer user_data)
+{
+    Client *client = user_data;
+
+    if (SPICE_IS_MAIN_CHANNEL(channel))
+        g_signal_connect(channel, "channel-event",
+                         G_CALLBACK(main_channel_event), client);
+    else if (SPICE_IS_DISPLAY_CHANNEL(channel))
+        g_signal_connect(channel, "display-invalidate",
+                         G_CALLBACK(display_invalidate), client);
+    else if (SPICE_IS_CURSOR_CHANNEL(channel))
+        g_signal_connect(channel, "cursor-set",
+                         G_CALLBACK(cursor_set), client);
+    else if (SPICE_IS_PLAYBACK_CHANNEL(channel))
+        g_signal_connect(channel, "playback-data",
+                         G_CALLBACK(playback_data), client);
+    else if (SPICE_IS_INPUTS_CHANNEL(channel))
+        g_signal_connect(channel, "channel-event",
+                         G_CALLBACK(inputs_channel_event), client);
+
+    spice_channel_connect(channel);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void client_report(Client *client, gint64 now)
+{
+    GList *iter, *list = spice_session_get_channels(client->session);
+    guint64 bytes_in = 0, rtt_us = 0, memory;
+    gdouble elapsed = (now - client->last_report) / 1e6;
+
+    for (iter = list; iter; iter = iter->next) {
+        SpiceChannelStats *stats = spice_channel_get_stats(iter->data);
+
+        bytes_in += stats->bytes_in;
+        if (SPICE_IS_MAIN_CHANNEL(iter->data))
+            rtt_us = stats->rtt_us;
+        spice_channel_stats_free(stats);
+    }
+    g_list_free(list);
+    g_object_get(client->session, "memory-usage", &memory, NULL);
+
+    printf("{\"session\": %u, \"time\": %.3f, \"running\": %s, "
+           "\"fps\": %.1f, \"frames\": %" G_GUINT64_FORMAT ", "
+           "\"invalidates\": %" G_GUINT64_FORMAT ", "
+           "\"input_latency_us\": %" G_GUINT64_FORMAT ", "
+           "\"input_latency_max_us\": %" G_GUINT64_FORMAT ", "
+           "\"rtt_us\": %" G_GUINT64_FORMAT ", "
+           "\"bytes_in\": %" G_GUINT64_FORMAT ", "
+           "\"cursor_sets\": %" G_GUINT64_FORMAT ", "
+           "\"audio_bytes\": %" G_GUINT64_FORMAT ", "
+           "\"memory\": %" G_GUINT64_FORMAT "}\n",
+           client->index, (now - start_time) / 1e6, client->ended ? "false" : "true",
+           elapsed > 0 ? (client->frames - client->last_frames) / elapsed : 0.,
+           client->frames, client->invalidates,
+           client->n_latencies ? client->latency_total_us / client->n_latencies : 0,
+           client->latency_max_us, rtt_us, bytes_in,
+           client->cursor_sets, client->audio_bytes, memory);
+
+    client->last_frames = client->frames;
+    client->last_report = now;
+}
+
+static void report(void)
+{
+    gint64 now = g_get_monotonic_time();
+    gint i;
+
+    for (i = 0; i < n_sessions; i++)
+        client_report(&clients[i], now);
+    fflush(stdout);
+}
+
+static gboolean report_timeout(gpointer user_data)
+{
+    report();
+
+    return TRUE;
+}
+
+static gboolean duration_timeout(gpointer user_data)
+{
+    g_main_loop_quit(mainloop);
+
+    return FALSE;
+}
+
+/* ------------------------------------------------------------------ */
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "version",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &version,
+        .description      = N_("Display version and quit"),
+    },{
+        .long_name        = "sessions",
+        .short_name       = 'n',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &n_sessions,
+        .description      = N_("Number of sessions to run"),
+        .arg_description  = N_("<count>"),
+    },{
+        .long_name        = "interval",
+        .short_name       = 'i',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &interval,
+        .description      = N_("Report every <seconds>, 0 for only at the end"),
+        .arg_description  = N_("<seconds>"),
+    },{
+        .long_name        = "duration",
+        .short_name       = 'd',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &duration,
+        .description      = N_("Stop after <seconds>"),
+        .arg_description  = N_("<seconds>"),
+    },{
+        .long_name        = "script",
+        .arg              = G_OPTION_ARG_FILENAME,
+        .arg_data         = &script_file,
+        .description      = N_("Play the inputs of <file> in every session"),
+        .arg_description  = N_("<file>"),
+    },{
+        .long_name        = "repeat",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &repeat,
+        .description      = N_("Play the script again once it ended"),
+    },
+    {
+        /* end of list */
+    }
+};
+
+static void
+signal_handler(int signum)
+{
+    g_main_loop_quit(mainloop);
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    gint i;
+
+    signal(SIGINT, signal_handler);
+
+    bindtextdomain(GETTEXT_PACKAGE, SPICE_GTK_LOCALEDIR);
+    bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+    textdomain(GETTEXT_PACKAGE);
+
+    context = g_option_context_new(NULL);
+    g_option_context_set_summary(context, _("Runs Spice sessions without a display, "
+                                            "for load testing."));
+    g_option_context_set_description(context, _("Report bugs to " PACKAGE_BUGREPORT "."));
+    g_option_context_set_main_group(context, spice_cmdline_get_option_group());
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print(_("option parsing failed: %s\n"), error->message);
+        exit(1);
+    }
+
+    if (version) {
+        g_print("spicy-load " PACKAGE_VERSION "\n");
+        exit(0);
+    }
+
+    if (n_sessions < 1) {
+        fprintf(stderr, _("invalid number of sessions: %d\n"), n_sessions);
+        exit(1);
+    }
+
+    if (script_file && !(script = spicy_script_load(script_file, &error))) {
+        fprintf(stderr, "%s\n", error->message);
+        exit(1);
+    }
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init();
+#endif
+    mainloop = g_main_loop_new(NULL, false);
+
+    start_time = g_get_monotonic_time();
+    clients = g_new0(Client, n_sessions);
+    for (i = 0; i < n_sessions; i++) {
+        Client *client = &clients[i];
+
+        client->index = i;
+        client->last_report = start_time;
+        client->player.script = script;
+        client->player.repeat = repeat;
+        client->player.input_sent = client_input_sent;
+        client->player.user_data = client;
+        client->session = spice_session_new();
+        g_signal_connect(client->session, "channel-new",
+                         G_CALLBACK(channel_new), client);
+        spice_cmdline_session_setup(client->session);
+
+        if (!spice_session_connect(client->session)) {
+            fprintf(stderr, _("spice_session_connect failed\n"));
+            exit(1);
+        }
+        n_running++;
+    }
+
+    if (interval > 0)
+        g_timeout_add_seconds(interval, report_timeout, NULL);
+    if (duration > 0)
+        g_timeout_add_seconds(duration, duration_timeout, NULL);
+
+    g_main_loop_run(mainloop);
+    report();
+
+    for (i = 0; i < n_sessions; i++) {
+        if (clients[i].frame_id)
+            g_source_remove(clients[i].frame_id);
+        spicy_script_player_stop(&clients[i].player);
+        spice_session_disconnect(clients[i].session);
+        g_object_unref(clients[i].session);
+    }
+    g_free(clients);
+    if (script)
+        g_array_unref(script);
+    g_main_loop_unref(mainloop);
+
+    return 0;
+}
@@ -0,0 +1,445 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <glib/gi18n.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "spice-record.h"
+
+/*
+ * Reads a recording made by spicy-record: describes it, writes the
+ * screen at a given time, from the keyframe before it, or extracts the
+ * audio track.
+ */
+
+/* config */
+static gboolean version = FALSE;
+static gboolean info = FALSE;
+static gdouble at = -1;
+static const char *outf = "spicy-play.ppm";
+static const char *audiof = NULL;
+
+/* state */
+static FILE          *fp;
+static GArray        *keyframes; /* SpiceRecordIndexEntry */
+
+static guint         s_width, s_height;
+static guint8        *s_data;
+static gint32        cursor_x, cursor_y;
+
+/* ------------------------------------------------------------------ */
+
+static gboolean read_index(void)
+{
+    SpiceRecordTrailer trailer;
+    SpiceRecordChunk chunk;
+
+    if (fseek(fp, -(long)sizeof(trailer), SEEK_END) != 0 ||
+        fread(&trailer, sizeof(trailer), 1, fp) != 1 ||
+        memcmp(trailer.magic, SPICE_RECORD_MAGIC, sizeof(trailer.magic)) != 0)
+        return FALSE;
+
+    if (fseek(fp, trailer.index_offset, SEEK_SET) != 0 ||
+        fread(&chunk, sizeof(chunk), 1, fp) != 1 ||
+        chunk.type != SPICE_RECORD_INDEX)
+        return FALSE;
+
+    g_array_set_size(keyframes, chunk.size / sizeof(SpiceRecordIndexEntry));
+    if (fread(keyframes->data, sizeof(SpiceRecordIndexEntry), keyframes->len, fp) != keyframes->len) {
+        g_array_set_size(keyframes, 0);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* returns the data of the next chunk, NULL at the end */
+static guint8 *read_chunk(SpiceRecordChunk *chunk)
+{
+    guint8 *data;
+
+    if (fread(chunk, sizeof(*chunk), 1, fp) != 1)
+        return NULL;
+
+    data = g_malloc(chunk->size + 1);
+    if (fread(data, 1, chunk->size, fp) != chunk->size) {
+        g_warning("truncated recording");
+        g_free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+static gboolean inflate_to(guint8 *dest, gsize size, const guint8 *src, gsize src_size)
+{
+    uLongf dest_size = size;
+
+    return uncompress(dest, &dest_size, src, src_size) == Z_OK && dest_size == size;
+}
+
+/* the bytes of a @width x @height 32-bit image, 0 if it does not fit a gsize */
+static gsize image_size(guint32 width, guint32 height)
+{
+    if (width == 0 || height == 0 || height > G_MAXSIZE / 4 / width)
+        return 0;
+
+    return (gsize)width * height * 4;
+}
+
+static void apply_keyframe(const guint8 *data, gsize size)
+{
+    const SpiceRecordSurface *surface = (const SpiceRecordSurface *)data;
+    gsize pixels_size;
+
+    if (size < sizeof(*surface))
+        return;
+
+    pixels_size = image_size(surface->width, surface->height);
+    if (pixels_size == 0) {
+        g_warning("invalid keyframe size");
+        return;
+    }
+
+    s_width = surface->width;
+    s_height = surface->height;
+    s_data = g_realloc(s_data, pixels_size);
+    if (!inflate_to(s_data, pixels_size,
+                    data + sizeof(*surface), size - sizeof(*surface)))
+        g_warning("invalid keyframe");
+}
+
+static void apply_damage(const guint8 *data, gsize size)
+{
+    const SpiceRecordRect *rects;
+    guint32 i, count;
+    gsize pixels_size = 0, head_size;
+    guint8 *pixels, *p;
+
+    if (s_data == NULL || size < sizeof(count))
+        return;
+
+    memcpy(&count, data, sizeof(count));
+    if (count > (size - sizeof(count)) / sizeof(SpiceRecordRect))
+        return;
+    head_size = sizeof(count) + (gsize)count * sizeof(SpiceRecordRect);
+
+    rects = (const SpiceRecordRect *)(data + sizeof(count));
+    for (i = 0; i < count; i++) {
+        gsize rect_size;
+
+        /* written this way, the sums can't wrap */
+        if (rects[i].x > s_width || rects[i].width > s_width - rects[i].x ||
+            rects[i].y > s_height || rects[i].height > s_height - rects[i].y) {
+            g_warning("damage out of the surface");
+            return;
+        }
+        /* within the surface, so it fits */
+        rect_size = (gsize)rects[i].width * rects[i].height * 4;
+        if (rect_size > G_MAXSIZE - pixels_size) {
+            g_warning("damage too large");
+            return;
+        }
+        pixels_size += rect_size;
+    }
+
+    p = pixels = g_malloc(pixels_size);
+    if (!inflate_to(pixels, pixels_size, data + head_size, size - head_size)) {
+        g_warning("invalid damage");
+        g_free(pixels);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        guint y;
+
+        for (y = 0; y < rects[i].height; y++) {
+            memcpy(s_data + ((gsize)(rects[i].y + y) * s_width + rects[i].x) * 4,
+                   p, (gsize)rects[i].width * 4);
+            p += (gsize)rects[i].width * 4;
+        }
+    }
+    g_free(pixels);
+}
+
+static int write_ppm(void)
+{
+    FILE *out;
+    guint8 *row, *p = s_data;
+    guint x, y;
+
+    out = fopen(outf, "wb");
+    if (out == NULL) {
+        fprintf(stderr, _("%s: can't open %s: %s\n"), g_get_prgname(), outf, strerror(errno));
+        return -1;
+    }
+
+    row = g_malloc((gsize)s_width * 3);
+    fprintf(out, "P6\n%u %u\n255\n", s_width, s_height);
+    for (y = 0; y < s_height; y++) {
+        for (x = 0; x < s_width; x++, p += 4) {
+            row[x * 3] = p[2];
+            row[x * 3 + 1] = p[1];
+            row[x * 3 + 2] = p[0];
+        }
+        fwrite(row, 1, (gsize)s_width * 3, out);
+    }
+    g_free(row);
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, _("%s: can't write %s: %s\n"), g_get_prgname(), outf, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+
+static int print_info(void)
+{
+    static const char *names[] = {
+        [SPICE_RECORD_KEYFRAME] = "keyframe",
+        [SPICE_RECORD_DAMAGE] = "damage",
+        [SPICE_RECORD_CURSOR] = "cursor",
+        [SPICE_RECORD_CURSOR_MOVE] = "cursor-move",
+        [SPICE_RECORD_AUDIO_START] = "audio-start",
+        [SPICE_RECORD_AUDIO] = "audio",
+        [SPICE_RECORD_INDEX] = "index",
+    };
+    guint64 count[G_N_ELEMENTS(names)] = { 0, }, bytes[G_N_ELEMENTS(names)] = { 0, };
+    SpiceRecordChunk chunk;
+    guint64 end_us = 0;
+    guint8 *data;
+    guint i;
+
+    while ((data = read_chunk(&chunk)) != NULL) {
+        if (chunk.type < G_N_ELEMENTS(names)) {
+            count[chunk.type]++;
+            bytes[chunk.type] += chunk.size;
+        }
+        end_us = chunk.time_us;
+        g_free(data);
+    }
+
+    printf("duration: %.3f s\n", end_us / 1e6);
+    printf("index: %s, %u keyframes\n", keyframes->len ? "yes" : "no", keyframes->len);
+    for (i = 1; i < G_N_ELEMENTS(names); i++)
+        printf("  %-12s %8" G_GUINT64_FORMAT " chunks %12" G_GUINT64_FORMAT " bytes\n",
+               names[i], count[i], bytes[i]);
+
+    return 0;
+}
+
+static int extract_audio(void)
+{
+    SpiceRecordChunk chunk;
+    FILE *out;
+    guint8 *data;
+    int rc = 0;
+
+    out = fopen(audiof, "wb");
+    if (out == NULL) {
+        fprintf(stderr, _("%s: can't open %s: %s\n"), g_get_prgname(), audiof, strerror(errno));
+        return -1;
+    }
+
+    while ((data = read_chunk(&chunk)) != NULL) {
+        if (chunk.type == SPICE_RECORD_AUDIO_START && chunk.size >= 3 * sizeof(guint32)) {
+            guint32 *start = (guint32 *)data;
+
+            printf("audio at %.3f s: format %u, %u channels, %u Hz\n",
+                   chunk.time_us / 1e6, start[0], start[1], start[2]);
+        } else if (chunk.type == SPICE_RECORD_AUDIO) {
+            fwrite(data, 1, chunk.size, out);
+        }
+        g_free(data);
+    }
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, _("%s: can't write %s: %s\n"), g_get_prgname(), audiof, strerror(errno));
+        rc = -1;
+    }
+
+    return rc;
+}
+
+static int write_screen_at(guint64 time_us)
+{
+    SpiceRecordChunk chunk;
+    guint8 *data;
+    guint i;
+
+    /* the last keyframe before */
+    for (i = 0; i < keyframes->len; i++) {
+        SpiceRecordIndexEntry *entry = &g_array_index(keyframes, SpiceRecordIndexEntry, i);
+
+        if (entry->time_us > time_us)
+            break;
+        if (fseek(fp, entry->offset, SEEK_SET) != 0)
+            return -1;
+    }
+
+    while ((data = read_chunk(&chunk)) != NULL) {
+        if (chunk.time_us > time_us || chunk.type == SPICE_RECORD_INDEX) {
+            g_free(data);
+            break;
+        }
+
+        switch (chunk.type) {
+        case SPICE_RECORD_KEYFRAME:
+            apply_keyframe(data, chunk.size);
+            break;
+        case SPICE_RECORD_DAMAGE:
+            apply_damage(data, chunk.size);
+            break;
+        case SPICE_RECORD_CURSOR_MOVE:
+            if (chunk.size >= 2 * sizeof(gint32)) {
+                memcpy(&cursor_x, data, sizeof(gint32));
+                memcpy(&cursor_y, data + sizeof(gint32), sizeof(gint32));
+            }
+            break;
+        default:
+            break;
+        }
+        g_free(data);
+    }
+
+    if (s_data == NULL) {
+        fprintf(stderr, _("no screen at %.3f s\n"), time_us / 1e6);
+        return -1;
+    }
+
+    if (write_ppm() != 0)
+        return -1;
+    printf("wrote the screen at %.3f s to %s, cursor at %d,%d\n",
+           time_us / 1e6, outf, cursor_x, cursor_y);
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "info",
+        .short_name       = 'i',
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &info,
+        .description      = N_("Describe the recording"),
+    },{
+        .long_name        = "at",
+        .short_name       = 't',
+        .arg              = G_OPTION_ARG_DOUBLE,
+        .arg_data         = &at,
+        .description      = N_("Write the screen at <seconds>"),
+        .arg_description  = N_("<seconds>"),
+    },{
+        .long_name        = "out-file",
+        .short_name       = 'o',
+        .arg              = G_OPTION_ARG_FILENAME,
+        .arg_data         = &outf,
+        .description      = N_("Screen file name (default spicy-play.ppm)"),
+        .arg_description  = N_("<filename>"),
+    },{
+        .long_name        = "audio",
+        .short_name       = 'a',
+        .arg              = G_OPTION_ARG_FILENAME,
+        .arg_data         = &audiof,
+        .description      = N_("Write the raw audio samples to <filename>"),
+        .arg_description  = N_("<filename>"),
+    },{
+        .long_name        = "version",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &version,
+        .description      = N_("Display version and quit"),
+    },
+    {
+        /* end of list */
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    SpiceRecordHeader header;
+    int rc = 0;
+
+    bindtextdomain(GETTEXT_PACKAGE, SPICE_GTK_LOCALEDIR);
+    bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+    textdomain(GETTEXT_PACKAGE);
+
+    context = g_option_context_new(_("RECORDING - read a session recording"));
+    g_option_context_set_summary(context, _("Reads a recording made with spicy-record."));
+    g_option_context_set_description(context, _("Report bugs to " PACKAGE_BUGREPORT "."));
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print(_("option parsing failed: %s\n"), error->message);
+        exit(1);
+    }
+
+    if (version) {
+        g_print("spicy-play " PACKAGE_VERSION "\n");
+        exit(0);
+    }
+
+    if (argc != 2 || (!info && at < 0 && audiof == NULL)) {
+        g_print("%s", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, _("failed to open %s: %s\n"), argv[1], strerror(errno));
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, SPICE_RECORD_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SPICE_RECORD_VERSION) {
+        fprintf(stderr, _("%s is not a recording\n"), argv[1]);
+        exit(1);
+    }
+
+    /* without an index, the recording is read from the start */
+    keyframes = g_array_new(FALSE, FALSE, sizeof(SpiceRecordIndexEntry));
+    read_index();
+
+    if (info) {
+        fseek(fp, sizeof(header), SEEK_SET);
+        rc |= print_info();
+    }
+    if (audiof) {
+        fseek(fp, sizeof(header), SEEK_SET);
+        rc |= extract_audio();
+    }
+    if (at >= 0) {
+        fseek(fp, sizeof(header), SEEK_SET);
+        rc |= write_screen_at(at * G_USEC_PER_SEC);
+    }
+
+    g_array_unref(keyframes);
+    g_free(s_data);
+    fclose(fp);
+
+    return rc ? 1 : 0;
+}
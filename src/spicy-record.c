@@ -0,0 +1,496 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <glib/gi18n.h>
+#include <signal.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-cmdline.h"
+#include "spice-record.h"
+
+/*
+ * Records the first display, the cursor and the playback of a session,
+ * see spice-record.h. The damage of a main loop iteration makes one
+ * chunk. The chunks are deflated and written by a writer thread; when
+ * it is late, the damage is dropped until a keyframe can be written.
+ */
+
+/* the chunks waiting for the writer before the damage is dropped */
+#define MAX_PENDING 64
+
+typedef struct {
+    SpiceRecordChunk chunk;
+    guint8 *head; /* written as is */
+    gsize head_size;
+    guint8 *data; /* deflated if @deflate, NULL if none */
+    gsize data_size;
+    gboolean deflate;
+} Chunk;
+
+/* config */
+static const char *outf = "spicy-record.rec";
+static gboolean version = FALSE;
+static gint keyframe_interval = 10;
+static gint duration = 0;
+
+/* state */
+static SpiceSession  *session;
+static GMainLoop     *mainloop;
+static GThreadPool   *writer;
+static gint64        start_time;
+
+static enum SpiceSurfaceFmt d_format;
+static gint          d_width, d_height, d_stride;
+static guint8        *d_data;
+static GArray        *damage; /* SpiceRecordRect */
+static guint         flush_id;
+static gint64        last_keyframe; /* -1 for one at the next flush */
+
+/* writer thread */
+static FILE          *fp;
+static guint64       offset;
+static GArray        *keyframes; /* SpiceRecordIndexEntry */
+static gboolean      write_failed;
+
+/* ------------------------------------------------------------------ */
+
+static void write_data(const void *data, gsize size)
+{
+    if (write_failed || size == 0)
+        return;
+
+    if (fwrite(data, 1, size, fp) != size) {
+        fprintf(stderr, _("%s: can't write %s: %s\n"), g_get_prgname(), outf, strerror(errno));
+        write_failed = TRUE;
+    }
+    offset += size;
+}
+
+/* writer thread */
+static void chunk_write(gpointer data, gpointer user_data)
+{
+    Chunk *c = data;
+    guint8 *deflated = NULL;
+    uLongf deflated_size = 0;
+
+    if (c->data && c->deflate) {
+        deflated_size = compressBound(c->data_size);
+        deflated = g_malloc(deflated_size);
+        if (compress2(deflated, &deflated_size, c->data, c->data_size, Z_BEST_SPEED) != Z_OK) {
+            g_warning("deflate failed");
+            deflated_size = 0;
+        }
+    }
+
+    if (c->chunk.type == SPICE_RECORD_KEYFRAME) {
+        SpiceRecordIndexEntry entry = { c->chunk.time_us, offset };
+
+        g_array_append_val(keyframes, entry);
+    }
+
+    c->chunk.size = c->head_size + (deflated ? deflated_size : c->data_size);
+    write_data(&c->chunk, sizeof(c->chunk));
+    write_data(c->head, c->head_size);
+    if (deflated)
+        write_data(deflated, deflated_size);
+    else
+        write_data(c->data, c->data_size);
+
+    g_free(deflated);
+    g_free(c->head);
+    g_free(c->data);
+    g_free(c);
+}
+
+static void push_chunk(SpiceRecordType type, gpointer head, gsize head_size,
+                       gpointer data, gsize data_size, gboolean deflate)
+{
+    Chunk *c = g_new0(Chunk, 1);
+
+    c->chunk.time_us = g_get_monotonic_time() - start_time;
+    c->chunk.type = type;
+    c->head = head;
+    c->head_size = head_size;
+    c->data = data;
+    c->data_size = data_size;
+    c->deflate = deflate;
+    g_thread_pool_push(writer, c, NULL);
+}
+
+/* the packed rows of a rectangle of the primary surface */
+static void copy_rect(guint8 *dest, guint x, guint y, guint w, guint h)
+{
+    guint i;
+
+    for (i = 0; i < h; i++)
+        memcpy(dest + i * w * 4, d_data + (y + i) * d_stride + x * 4, w * 4);
+}
+
+static void write_keyframe(void)
+{
+    SpiceRecordSurface *surface = g_new(SpiceRecordSurface, 1);
+    guint8 *pixels = g_malloc(d_width * d_height * 4);
+
+    surface->width = d_width;
+    surface->height = d_height;
+    copy_rect(pixels, 0, 0, d_width, d_height);
+    push_chunk(SPICE_RECORD_KEYFRAME, surface, sizeof(*surface),
+               pixels, d_width * d_height * 4, TRUE);
+    last_keyframe = g_get_monotonic_time();
+}
+
+static void write_damage(void)
+{
+    guint32 count = damage->len;
+    gsize head_size = sizeof(count) + count * sizeof(SpiceRecordRect);
+    guint8 *head = g_malloc(head_size), *pixels, *p;
+    gsize size = 0;
+    guint i;
+
+    memcpy(head, &count, sizeof(count));
+    memcpy(head + sizeof(count), damage->data, count * sizeof(SpiceRecordRect));
+    for (i = 0; i < count; i++) {
+        SpiceRecordRect *r = &g_array_index(damage, SpiceRecordRect, i);
+
+        size += r->width * r->height * 4;
+    }
+
+    p = pixels = g_malloc(size);
+    for (i = 0; i < count; i++) {
+        SpiceRecordRect *r = &g_array_index(damage, SpiceRecordRect, i);
+
+        copy_rect(p, r->x, r->y, r->width, r->height);
+        p += r->width * r->height * 4;
+    }
+    push_chunk(SPICE_RECORD_DAMAGE, head, head_size, pixels, size, TRUE);
+}
+
+static gboolean flush_frame(gpointer user_data)
+{
+    gint64 now = g_get_monotonic_time();
+
+    flush_id = 0;
+    if (d_data == NULL) {
+        g_array_set_size(damage, 0);
+        return FALSE;
+    }
+
+    if (g_thread_pool_unprocessed(writer) >= MAX_PENDING) {
+        /* drop it, the next frame written is complete */
+        last_keyframe = -1;
+    } else if (last_keyframe < 0 ||
+               now - last_keyframe >= keyframe_interval * G_USEC_PER_SEC) {
+        write_keyframe();
+    } else if (damage->len > 0) {
+        write_damage();
+    }
+    g_array_set_size(damage, 0);
+
+    return FALSE;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void primary_create(SpiceChannel *channel, gint format,
+                           gint width, gint height, gint stride,
+                           gint shmid, gpointer imgdata, gpointer data)
+{
+    d_format = format;
+    d_width  = width;
+    d_height = height;
+    d_stride = stride;
+    d_data   = imgdata;
+
+    if (format != SPICE_SURFACE_FMT_32_xRGB) {
+        fprintf(stderr, _("unsupported spice surface format %d\n"), format);
+        d_data = NULL;
+        return;
+    }
+
+    last_keyframe = -1;
+    if (flush_id == 0)
+        flush_id = g_idle_add(flush_frame, NULL);
+}
+
+static void primary_destroy(SpiceChannel *channel, gpointer data)
+{
+    d_data = NULL;
+}
+
+static void invalidate(SpiceChannel *channel,
+                       gint x, gint y, gint w, gint h, gpointer data)
+{
+    SpiceRecordRect r;
+
+    if (d_data == NULL)
+        return;
+
+    x = CLAMP(x, 0, d_width);
+    y = CLAMP(y, 0, d_height);
+    w = MIN(w, d_width - x);
+    h = MIN(h, d_height - y);
+    if (w <= 0 || h <= 0)
+        return;
+
+    r.x = x;
+    r.y = y;
+    r.width = w;
+    r.height = h;
+    g_array_append_val(damage, r);
+    if (flush_id == 0)
+        flush_id = g_idle_add(flush_frame, NULL);
+}
+
+static void cursor_set(SpiceChannel *channel, gint width, gint height,
+                       gint hot_x, gint hot_y, gpointer rgba, gpointer data)
+{
+    SpiceRecordCursor *cursor = g_new0(SpiceRecordCursor, 1);
+
+    if (rgba == NULL) {
+        push_chunk(SPICE_RECORD_CURSOR, cursor, sizeof(*cursor), NULL, 0, FALSE);
+        return;
+    }
+
+    cursor->width = width;
+    cursor->height = height;
+    cursor->hot_x = hot_x;
+    cursor->hot_y = hot_y;
+    push_chunk(SPICE_RECORD_CURSOR, cursor, sizeof(*cursor),
+               g_memdup(rgba, width * height * 4), width * height * 4, TRUE);
+}
+
+static void cursor_hide(SpiceChannel *channel, gpointer data)
+{
+    push_chunk(SPICE_RECORD_CURSOR, g_new0(SpiceRecordCursor, 1),
+               sizeof(SpiceRecordCursor), NULL, 0, FALSE);
+}
+
+static void cursor_move(SpiceChannel *channel, gint x, gint y, gpointer data)
+{
+    gint32 *pos = g_new(gint32, 2);
+
+    pos[0] = x;
+    pos[1] = y;
+    push_chunk(SPICE_RECORD_CURSOR_MOVE, pos, 2 * sizeof(gint32), NULL, 0, FALSE);
+}
+
+static void playback_start(SpiceChannel *channel, gint format, gint channels,
+                           gint frequency, gpointer data)
+{
+    guint32 *start = g_new(guint32, 3);
+
+    start[0] = format;
+    start[1] = channels;
+    start[2] = frequency;
+    push_chunk(SPICE_RECORD_AUDIO_START, start, 3 * sizeof(guint32), NULL, 0, FALSE);
+}
+
+static void playback_data(SpiceChannel *channel, gpointer audio, gint size,
+                          gpointer data)
+{
+    /* the samples barely deflate */
+    push_chunk(SPICE_RECORD_AUDIO, NULL, 0, g_memdup(audio, size), size, FALSE);
+}
+
+static void main_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
+                               gpointer data)
+{
+    switch (event) {
+    case SPICE_CHANNEL_OPENED:
+        break;
+    default:
+        g_warning("main channel event: %d", event);
+        g_main_loop_quit(mainloop);
+    }
+}
+
+static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
+{
+    int id;
+
+    g_object_get(channel, "channel-id", &id, NULL);
+
+    if (SPICE_IS_MAIN_CHANNEL(channel)) {
+        g_signal_connect(channel, "channel-event",
+                         G_CALLBACK(main_channel_event), NULL);
+    } else if (SPICE_IS_DISPLAY_CHANNEL(channel)) {
+        if (id != 0)
+            return;
+        g_signal_connect(channel, "display-primary-create",
+                         G_CALLBACK(primary_create), NULL);
+        g_signal_connect(channel, "display-primary-destroy",
+                         G_CALLBACK(primary_destroy), NULL);
+        g_signal_connect(channel, "display-invalidate",
+                         G_CALLBACK(invalidate), NULL);
+    } else if (SPICE_IS_CURSOR_CHANNEL(channel)) {
+        if (id != 0)
+            return;
+        g_signal_connect(channel, "cursor-set",
+                         G_CALLBACK(cursor_set), NULL);
+        g_signal_connect(channel, "cursor-hide",
+                         G_CALLBACK(cursor_hide), NULL);
+        g_signal_connect(channel, "cursor-move",
+                         G_CALLBACK(cursor_move), NULL);
+    } else if (SPICE_IS_PLAYBACK_CHANNEL(channel)) {
+        g_signal_connect(channel, "playback-start",
+                         G_CALLBACK(playback_start), NULL);
+        g_signal_connect(channel, "playback-data",
+                         G_CALLBACK(playback_data), NULL);
+    } else {
+        return;
+    }
+
+    spice_channel_connect(channel);
+}
+
+/* ------------------------------------------------------------------ */
+
+static gboolean duration_timeout(gpointer user_data)
+{
+    g_main_loop_quit(mainloop);
+
+    return FALSE;
+}
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "out-file",
+        .short_name       = 'o',
+        .arg              = G_OPTION_ARG_FILENAME,
+        .arg_data         = &outf,
+        .description      = N_("Output file name (default spicy-record.rec)"),
+        .arg_description  = N_("<filename>"),
+    },{
+        .long_name        = "keyframe-interval",
+        .short_name       = 'k',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &keyframe_interval,
+        .description      = N_("Write the whole screen every <seconds> (default 10)"),
+        .arg_description  = N_("<seconds>"),
+    },{
+        .long_name        = "duration",
+        .short_name       = 'd',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &duration,
+        .description      = N_("Stop after <seconds>"),
+        .arg_description  = N_("<seconds>"),
+    },{
+        .long_name        = "version",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &version,
+        .description      = N_("Display version and quit"),
+    },
+    {
+        /* end of list */
+    }
+};
+
+static void
+signal_handler(int signum)
+{
+    g_main_loop_quit(mainloop);
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    SpiceRecordHeader header = { SPICE_RECORD_MAGIC, SPICE_RECORD_VERSION, 0 };
+    SpiceRecordChunk chunk = { 0, SPICE_RECORD_INDEX, 0 };
+    SpiceRecordTrailer trailer = { 0, SPICE_RECORD_MAGIC };
+
+#if !GLIB_CHECK_VERSION(2,31,18)
+    g_thread_init(NULL);
+#endif
+    signal(SIGINT, signal_handler);
+
+    bindtextdomain(GETTEXT_PACKAGE, SPICE_GTK_LOCALEDIR);
+    bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+    textdomain(GETTEXT_PACKAGE);
+
+    context = g_option_context_new(_(" - record a session"));
+    g_option_context_set_summary(context, _("Records the display, cursor and audio of a "
+                                            "Spice session, to be read with spicy-play."));
+    g_option_context_set_description(context, _("Report bugs to " PACKAGE_BUGREPORT "."));
+    g_option_context_set_main_group(context, spice_cmdline_get_option_group());
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print(_("option parsing failed: %s\n"), error->message);
+        exit(1);
+    }
+
+    if (version) {
+        g_print("spicy-record " PACKAGE_VERSION "\n");
+        exit(0);
+    }
+
+    fp = fopen(outf, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, _("%s: can't open %s: %s\n"), g_get_prgname(), outf, strerror(errno));
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+    write_data(&header, sizeof(header));
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init();
+#endif
+    mainloop = g_main_loop_new(NULL, false);
+    writer = g_thread_pool_new(chunk_write, NULL, 1, FALSE, NULL);
+    keyframes = g_array_new(FALSE, FALSE, sizeof(SpiceRecordIndexEntry));
+    damage = g_array_new(FALSE, FALSE, sizeof(SpiceRecordRect));
+    start_time = g_get_monotonic_time();
+
+    session = spice_session_new();
+    g_signal_connect(session, "channel-new",
+                     G_CALLBACK(channel_new), NULL);
+    spice_cmdline_session_setup(session);
+
+    if (!spice_session_connect(session)) {
+        fprintf(stderr, _("spice_session_connect failed\n"));
+        exit(1);
+    }
+
+    if (duration > 0)
+        g_timeout_add_seconds(duration, duration_timeout, NULL);
+
+    g_main_loop_run(mainloop);
+
+    spice_session_disconnect(session);
+    g_thread_pool_free(writer, FALSE, TRUE);
+
+    /* the index, to seek to the keyframes */
+    trailer.index_offset = offset;
+    chunk.time_us = g_get_monotonic_time() - start_time;
+    chunk.size = keyframes->len * sizeof(SpiceRecordIndexEntry);
+    write_data(&chunk, sizeof(chunk));
+    write_data(keyframes->data, chunk.size);
+    write_data(&trailer, sizeof(trailer));
+    if (fclose(fp) != 0 && !write_failed)
+        fprintf(stderr, _("%s: can't write %s: %s\n"), g_get_prgname(), outf, strerror(errno));
+
+    g_array_unref(keyframes);
+    g_array_unref(damage);
+    g_object_unref(session);
+    g_main_loop_unref(mainloop);
+
+    return write_failed ? 1 : 0;
+}
@@ -0,0 +1,303 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <glib/gi18n.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-capture.h"
+
+/*
+ * Feeds a capture made with SPICE_CAPTURE_DIR back to a channel of the
+ * same type, over a socket pair, and reports how fast it was handled.
+ * The data sent by the channel is discarded.
+ */
+
+/* config */
+static gboolean version = FALSE;
+static gboolean realtime = FALSE;
+
+/* state */
+static GMainLoop            *mainloop;
+static FILE                 *capture;
+static SpiceCaptureHeader   header;
+static SpiceChannel         *channel;
+static int                  peer = -1;
+static guint                out_watch;
+static guint                delay_id;
+static gint64               start_time;
+static guint64              n_invalidates;
+
+/* the record being sent */
+static SpiceCaptureRecord   record;
+static guint8               *data;
+static gsize                data_pos;
+
+static gboolean peer_writable(GIOChannel *source, GIOCondition condition, gpointer user_data);
+
+static gboolean read_record(void)
+{
+    if (fread(&record, sizeof(record), 1, capture) != 1)
+        return FALSE;
+
+    data = g_realloc(data, record.size);
+    data_pos = 0;
+    if (fread(data, record.size, 1, capture) != 1) {
+        g_warning("truncated capture");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void watch_peer(void)
+{
+    GIOChannel *io = g_io_channel_unix_new(peer);
+
+    out_watch = g_io_add_watch(io, G_IO_OUT, peer_writable, NULL);
+    g_io_channel_unref(io);
+}
+
+static gboolean delay_done(gpointer user_data)
+{
+    delay_id = 0;
+    watch_peer();
+
+    return FALSE;
+}
+
+static gboolean peer_writable(GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+    gint64 elapsed;
+    ssize_t n;
+
+    while (TRUE) {
+        if (data_pos == record.size) {
+            if (!read_record()) {
+                /* the channel sees the end of the stream */
+                shutdown(peer, SHUT_WR);
+                out_watch = 0;
+                return FALSE;
+            }
+
+            elapsed = g_get_monotonic_time() - start_time;
+            if (realtime && record.time_us > elapsed) {
+                delay_id = g_timeout_add((record.time_us - elapsed) / 1000, delay_done, NULL);
+                out_watch = 0;
+                return FALSE;
+            }
+        }
+
+        n = write(peer, data + data_pos, record.size - data_pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return TRUE;
+            g_warning("write failed: %s", strerror(errno));
+            out_watch = 0;
+            return FALSE;
+        }
+        data_pos += n;
+    }
+}
+
+static gboolean peer_readable(GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+    char buf[4096];
+    ssize_t n;
+
+    /* drop the client messages */
+    n = read(peer, buf, sizeof(buf));
+
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR));
+}
+
+static void display_invalidate(SpiceChannel *display, gint x, gint y, gint w, gint h,
+                               gpointer user_data)
+{
+    n_invalidates++;
+}
+
+static void print_report(void)
+{
+    SpiceChannelStats *stats = spice_channel_get_stats(channel);
+    gdouble elapsed = (g_get_monotonic_time() - start_time) / 1e6;
+    guint64 count, bytes;
+    guint type;
+
+    printf("%s-%u: %" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT " bytes in %.3f s\n",
+           spice_channel_type_to_string(header.channel_type), header.channel_id,
+           stats->messages_in, stats->bytes_in, elapsed);
+    printf("  %.0f messages/s, %.1f MB/s\n",
+           stats->messages_in / elapsed, stats->bytes_in / elapsed / (1024 * 1024));
+    printf("  parse %" G_GUINT64_FORMAT " us, handle %" G_GUINT64_FORMAT " us\n",
+           stats->parse_time_us, stats->handle_time_us);
+    if (n_invalidates)
+        printf("  %" G_GUINT64_FORMAT " invalidates, %.0f per second\n",
+               n_invalidates, n_invalidates / elapsed);
+
+    printf("  type      count        bytes   handle us   us/msg\n");
+    for (type = 0; type < G_MAXUINT16; type++) {
+        guint64 time_us;
+
+        if (!spice_channel_get_msg_stats(channel, FALSE, type, &count, &bytes))
+            continue;
+        time_us = spice_channel_get_msg_handle_time(channel, type);
+        printf("  %4u %10" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " %11" G_GUINT64_FORMAT
+               " %8.1f\n", type, count, bytes, time_us, (gdouble)time_us / count);
+    }
+
+    spice_channel_stats_free(stats);
+}
+
+static void channel_event(SpiceChannel *c, SpiceChannelEvent event, gpointer user_data)
+{
+    switch (event) {
+    case SPICE_CHANNEL_OPENED:
+        break;
+    case SPICE_CHANNEL_CLOSED:
+    case SPICE_CHANNEL_ERROR_IO:
+        /* the end of the capture */
+        g_main_loop_quit(mainloop);
+        break;
+    default:
+        g_warning("channel event: %d", event);
+        g_main_loop_quit(mainloop);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "version",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &version,
+        .description      = N_("Display version and quit"),
+    },{
+        .long_name        = "realtime",
+        .short_name       = 'r',
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &realtime,
+        .description      = N_("Replay at the pace of the capture, instead of as fast as possible"),
+    },
+    {
+        /* end of list */
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    SpiceSession *session;
+    GIOChannel *io;
+    int fds[2];
+
+    bindtextdomain(GETTEXT_PACKAGE, SPICE_GTK_LOCALEDIR);
+    bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+    textdomain(GETTEXT_PACKAGE);
+
+    context = g_option_context_new(_("CAPTURE - replay a channel capture"));
+    g_option_context_set_summary(context, _("Replays a capture made with SPICE_CAPTURE_DIR "
+                                            "set, and reports the time spent on it."));
+    g_option_context_set_description(context, _("Report bugs to " PACKAGE_BUGREPORT "."));
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print(_("option parsing failed: %s\n"), error->message);
+        exit(1);
+    }
+
+    if (version) {
+        g_print("spicy-replay " PACKAGE_VERSION "\n");
+        exit(0);
+    }
+
+    if (argc != 2) {
+        g_print("%s", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+
+    capture = fopen(argv[1], "rb");
+    if (capture == NULL) {
+        fprintf(stderr, _("failed to open %s: %s\n"), argv[1], strerror(errno));
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, capture) != 1 ||
+        memcmp(header.magic, SPICE_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SPICE_CAPTURE_VERSION) {
+        fprintf(stderr, _("%s is not a capture\n"), argv[1]);
+        exit(1);
+    }
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init();
+#endif
+    mainloop = g_main_loop_new(NULL, FALSE);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, _("socketpair failed: %s\n"), strerror(errno));
+        exit(1);
+    }
+    peer = fds[1];
+    fcntl(peer, F_SETFL, fcntl(peer, F_GETFL) | O_NONBLOCK);
+
+    session = spice_session_new();
+    channel = spice_channel_new(session, header.channel_type, header.channel_id);
+    if (channel == NULL) {
+        fprintf(stderr, _("unsupported channel type %u\n"), header.channel_type);
+        exit(1);
+    }
+    g_signal_connect(channel, "channel-event", G_CALLBACK(channel_event), NULL);
+    if (SPICE_IS_DISPLAY_CHANNEL(channel))
+        g_signal_connect(channel, "display-invalidate",
+                         G_CALLBACK(display_invalidate), NULL);
+
+    io = g_io_channel_unix_new(peer);
+    g_io_add_watch(io, G_IO_IN, peer_readable, NULL);
+    g_io_channel_unref(io);
+    watch_peer();
+
+    start_time = g_get_monotonic_time();
+    if (!spice_channel_open_fd(channel, fds[0])) {
+        fprintf(stderr, _("failed to open the channel\n"));
+        exit(1);
+    }
+
+    g_main_loop_run(mainloop);
+
+    print_report();
+
+    if (out_watch)
+        g_source_remove(out_watch);
+    if (delay_id)
+        g_source_remove(delay_id);
+    fclose(capture);
+    g_free(data);
+    g_object_unref(session);
+    g_main_loop_unref(mainloop);
+
+    return 0;
+}
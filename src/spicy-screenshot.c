@@ -17,23 +17,185 @@
 */
 #include "config.h"
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <jpeglib.h>
 
 #include "spice-client.h"
 #include "spice-common.h"
 #include "spice-cmdline.h"
 
+/* the damage is tracked on tiles of this size without --tile-size */
+#define DAMAGE_TILE_SIZE 64
+
 /* config */
 static const char *outf      = "spicy-screenshot.ppm";
 static gboolean version = FALSE;
+static gint interval = 0;
+static gint threshold = 0;
+static gint tile_size = 0;
+static gint quality = 85;
 
 /* state */
 static SpiceSession  *session;
 static GMainLoop     *mainloop;
+static GThreadPool   *writer;
+static volatile gint writer_pending; /* captures pushed, not written yet */
 
 enum SpiceSurfaceFmt d_format;
 gint                 d_width, d_height, d_stride;
 gpointer             d_data;
 
+/* the damaged tiles since the last capture */
+static guint8        *damage;
+static gint          damage_tile, damage_cols, damage_rows;
+
+/*
+ * A copy of the surface, written by the writer thread while the display
+ * channel goes on. @tiles lists the damaged tiles to write for a tiled
+ * output, or is %NULL for the whole image.
+ */
+typedef struct {
+    gint width, height, stride;
+    guint8 *data;
+    guint8 *tiles;
+} Capture;
+
+/* ------------------------------------------------------------------ */
+
+static void rgb_row(const Capture *cap, gint x, gint y, gint w, guint8 *row)
+{
+    const guint8 *p = cap->data + y * cap->stride + x * 4;
+    gint i;
+
+    for (i = 0; i < w; i++, p += 4) {
+        *row++ = p[2];
+        *row++ = p[1];
+        *row++ = p[0];
+    }
+}
+
+static void write_ppm_32(FILE *fp, const Capture *cap, gint x, gint y, gint w, gint h)
+{
+    guint8 *row = g_malloc(w * 3);
+    gint i;
+
+    fprintf(fp, "P6\n%d %d\n255\n", w, h);
+    for (i = 0; i < h; i++) {
+        rgb_row(cap, x, y + i, w, row);
+        fwrite(row, 1, w * 3, fp);
+    }
+    g_free(row);
+}
+
+static void write_jpeg_32(FILE *fp, const Capture *cap, gint x, gint y, gint w, gint h)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row = g_malloc(w * 3);
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        rgb_row(cap, x, y + cinfo.next_scanline, w, row);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    g_free(row);
+}
+
+static gboolean is_jpeg(const gchar *filename)
+{
+    return g_str_has_suffix(filename, ".jpg") || g_str_has_suffix(filename, ".jpeg");
+}
+
+/* replaces @filename at once, for the readers following it */
+static int write_image(const gchar *filename, const Capture *cap,
+                       gint x, gint y, gint w, gint h)
+{
+    gchar *tmp = g_strconcat(filename, ".tmp", NULL);
+    FILE *fp;
+    int rc = 0;
+
+    fp = fopen(tmp, "wb");
+    if (NULL == fp) {
+        fprintf(stderr, _("%s: can't open %s: %s\n"), g_get_prgname(), tmp, strerror(errno));
+        g_free(tmp);
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, 256 * 1024);
+
+    if (is_jpeg(filename))
+        write_jpeg_32(fp, cap, x, y, w, h);
+    else
+        write_ppm_32(fp, cap, x, y, w, h);
+
+    if (fclose(fp) != 0 || g_rename(tmp, filename) != 0) {
+        fprintf(stderr, _("%s: can't write %s: %s\n"), g_get_prgname(), filename, strerror(errno));
+        g_unlink(tmp);
+        rc = -1;
+    }
+    g_free(tmp);
+
+    return rc;
+}
+
+static int write_tiles(const Capture *cap)
+{
+    const gchar *ext = strrchr(outf, '.');
+    gsize base_len = ext ? ext - outf : strlen(outf);
+    gint tx, ty, cols = (cap->width + tile_size - 1) / tile_size;
+    int rc = 0;
+
+    for (ty = 0; ty * tile_size < cap->height; ty++) {
+        for (tx = 0; tx < cols; tx++) {
+            gint x = tx * tile_size, y = ty * tile_size;
+            gchar *filename;
+
+            if (!cap->tiles[ty * cols + tx])
+                continue;
+
+            filename = g_strdup_printf("%.*s-%d-%d%s", (int)base_len, outf, tx, ty,
+                                       ext ? ext : "");
+            rc |= write_image(filename, cap, x, y,
+                              MIN(tile_size, cap->width - x), MIN(tile_size, cap->height - y));
+            g_free(filename);
+        }
+    }
+
+    return rc;
+}
+
+/* writer thread */
+static void capture_write(gpointer data, gpointer user_data)
+{
+    Capture *cap = data;
+    int rc;
+
+    if (cap->tiles)
+        rc = write_tiles(cap);
+    else
+        rc = write_image(outf, cap, 0, 0, cap->width, cap->height);
+    if (rc == 0 && interval == 0)
+        fprintf(stderr, _("wrote screen shot to %s\n"), outf);
+
+    g_free(cap->tiles);
+    g_free(cap->data);
+    g_free(cap);
+    g_atomic_int_add(&writer_pending, -1);
+}
+
 /* ------------------------------------------------------------------ */
 
 static void primary_create(SpiceChannel *channel, gint format,
@@ -46,53 +208,90 @@ static void primary_create(SpiceChannel *channel, gint format,
     d_height = height;
     d_stride = stride;
     d_data   = imgdata;
+
+    /* all damaged, the first capture is complete */
+    damage_tile = tile_size > 0 ? tile_size : DAMAGE_TILE_SIZE;
+    damage_cols = (width + damage_tile - 1) / damage_tile;
+    damage_rows = (height + damage_tile - 1) / damage_tile;
+    g_free(damage);
+    damage = g_malloc(damage_cols * damage_rows);
+    memset(damage, 1, damage_cols * damage_rows);
 }
 
-static int write_ppm_32(void)
+static void primary_destroy(SpiceChannel *channel, gpointer data)
 {
-    FILE *fp;
-    uint8_t *p;
-    int n;
+    d_data = NULL;
+}
 
-    fp = fopen(outf,"w");
-    if (NULL == fp) {
-	fprintf(stderr, _("%s: can't open %s: %s\n"), g_get_prgname(), outf, strerror(errno));
-	return -1;
-    }
-    fprintf(fp, "P6\n%d %d\n255\n",
-            d_width, d_height);
-    n = d_width * d_height;
-    p = d_data;
-    while (n > 0) {
-        fputc(p[2], fp);
-        fputc(p[1], fp);
-        fputc(p[0], fp);
-        p += 4;
-        n--;
+static int capture(void)
+{
+    Capture *cap;
+
+    if (d_data == NULL)
+        return -1;
+
+    if (d_format != SPICE_SURFACE_FMT_32_xRGB) {
+        fprintf(stderr, _("unsupported spice surface format %d\n"), d_format);
+        return -1;
     }
-    fclose(fp);
+
+    cap = g_new0(Capture, 1);
+    cap->width = d_width;
+    cap->height = d_height;
+    cap->stride = d_stride;
+    cap->data = g_memdup(d_data, d_stride * d_height);
+    if (tile_size > 0)
+        cap->tiles = g_memdup(damage, damage_cols * damage_rows);
+    memset(damage, 0, damage_cols * damage_rows);
+
+    g_atomic_int_inc(&writer_pending);
+    g_thread_pool_push(writer, cap, NULL);
+
     return 0;
 }
 
 static void invalidate(SpiceChannel *channel,
                        gint x, gint y, gint w, gint h, gpointer *data)
 {
-    int rc;
+    gint tx, ty;
 
-    switch (d_format) {
-    case SPICE_SURFACE_FMT_32_xRGB:
-        rc = write_ppm_32();
-        break;
-    default:
-        fprintf(stderr, _("unsupported spice surface format %d\n"), d_format);
-        rc = -1;
-        break;
-    }
-    if (rc == 0)
-        fprintf(stderr, _("wrote screen shot to %s\n"), outf);
+    if (damage == NULL || w <= 0 || h <= 0)
+        return;
+
+    for (ty = y / damage_tile; ty <= MIN(y + h - 1, d_height - 1) / damage_tile; ty++)
+        for (tx = x / damage_tile; tx <= MIN(x + w - 1, d_width - 1) / damage_tile; tx++)
+            damage[ty * damage_cols + tx] = 1;
+
+    if (interval > 0)
+        return;
+
+    /* a single screen shot */
+    capture();
     g_main_loop_quit(mainloop);
 }
 
+static gboolean interval_capture(gpointer user_data)
+{
+    guint i, n = 0, total = damage_cols * damage_rows;
+
+    if (damage == NULL)
+        return TRUE;
+
+    for (i = 0; i < total; i++)
+        n += damage[i];
+    if (n == 0 || n * 100 < (guint)threshold * total)
+        return TRUE;
+
+    /* the writer is late, wait for the next one; the capture being
+       written is not counted by g_thread_pool_unprocessed() */
+    if (g_atomic_int_get(&writer_pending) > 0)
+        return TRUE;
+
+    capture();
+
+    return TRUE;
+}
+
 static void main_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
                                gpointer data)
 {
@@ -124,6 +323,8 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer *data)
 
     g_signal_connect(channel, "display-primary-create",
                      G_CALLBACK(primary_create), NULL);
+    g_signal_connect(channel, "display-primary-destroy",
+                     G_CALLBACK(primary_destroy), NULL);
     g_signal_connect(channel, "display-invalidate",
                      G_CALLBACK(invalidate), NULL);
     spice_channel_connect(channel);
@@ -140,6 +341,37 @@ static GOptionEntry app_entries[] = {
         .description      = N_("Output file name (default spicy-screenshot.ppm)"),
         .arg_description  = N_("<filename>"),
     },
+    {
+        .long_name        = "interval",
+        .short_name       = 'i',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &interval,
+        .description      = N_("Keep the session, and take a screen shot every <seconds>"),
+        .arg_description  = N_("<seconds>"),
+    },
+    {
+        .long_name        = "threshold",
+        .short_name       = 't',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &threshold,
+        .description      = N_("With --interval, only when this percentage of the screen changed"),
+        .arg_description  = N_("<percent>"),
+    },
+    {
+        .long_name        = "tile-size",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &tile_size,
+        .description      = N_("Write the changed tiles of this size, as NAME-X-Y.EXT"),
+        .arg_description  = N_("<pixels>"),
+    },
+    {
+        .long_name        = "quality",
+        .short_name       = 'q',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &quality,
+        .description      = N_("JPEG quality, for a .jpg output file (default 85)"),
+        .arg_description  = N_("<0-100>"),
+    },
     {
         .long_name        = "version",
         .arg              = G_OPTION_ARG_NONE,
@@ -156,13 +388,16 @@ int main(int argc, char *argv[])
     GError *error = NULL;
     GOptionContext *context;
 
+#if !GLIB_CHECK_VERSION(2,31,18)
+    g_thread_init(NULL);
+#endif
     bindtextdomain(GETTEXT_PACKAGE, SPICE_GTK_LOCALEDIR);
     bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
     textdomain(GETTEXT_PACKAGE);
 
     /* parse opts */
     context = g_option_context_new(_(" - make screen shots"));
-    g_option_context_set_summary(context, _("A Spice server client to take screenshots in ppm format."));
+    g_option_context_set_summary(context, _("A Spice server client to take screenshots in ppm or jpeg format."));
     g_option_context_set_description(context, _("Report bugs to " PACKAGE_BUGREPORT "."));
     g_option_context_set_main_group(context, spice_cmdline_get_option_group());
     g_option_context_add_main_entries(context, app_entries, NULL);
@@ -180,6 +415,7 @@ int main(int argc, char *argv[])
     g_type_init();
 #endif
     mainloop = g_main_loop_new(NULL, false);
+    writer = g_thread_pool_new(capture_write, NULL, 1, FALSE, NULL);
 
     session = spice_session_new();
     g_signal_connect(session, "channel-new",
@@ -191,6 +427,12 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (interval > 0)
+        g_timeout_add_seconds(interval, interval_capture, NULL);
+
     g_main_loop_run(mainloop);
+
+    /* the last screen shot is written */
+    g_thread_pool_free(writer, FALSE, TRUE);
     return 0;
 }
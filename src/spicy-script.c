@@ -0,0 +1,140 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <glib/gi18n.h>
+#include <stdio.h>
+
+#include "spice-client.h"
+#include "spicy-script.h"
+
+GArray *spicy_script_load(const gchar *filename, GError **error)
+{
+    gchar *contents, **lines;
+    GArray *script;
+    guint i;
+
+    if (!g_file_get_contents(filename, &contents, NULL, error))
+        return NULL;
+
+    script = g_array_new(FALSE, FALSE, sizeof(SpicyCommand));
+    lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        gchar name[16];
+        SpicyCommand cmd = { 0, };
+        int n;
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        n = sscanf(line, "%15s %d %d", name, &cmd.a, &cmd.b);
+        if (n == 2 && g_str_equal(name, "wait"))
+            cmd.type = SPICY_COMMAND_WAIT;
+        else if (n == 3 && g_str_equal(name, "move"))
+            cmd.type = SPICY_COMMAND_MOVE;
+        else if (n == 2 && g_str_equal(name, "press"))
+            cmd.type = SPICY_COMMAND_PRESS;
+        else if (n == 2 && g_str_equal(name, "release"))
+            cmd.type = SPICY_COMMAND_RELEASE;
+        else if (n == 2 && g_str_equal(name, "key"))
+            cmd.type = SPICY_COMMAND_KEY;
+        else {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                        _("%s:%u: invalid command: %s"), filename, i + 1, line);
+            g_strfreev(lines);
+            g_array_unref(script);
+            return NULL;
+        }
+        g_array_append_val(script, cmd);
+    }
+    g_strfreev(lines);
+
+    return script;
+}
+
+/* between the repeats of a script with no wait, not to spin the main loop */
+#define PLAYER_REPEAT_DELAY_MS 10
+
+static gboolean player_wait_done(gpointer user_data)
+{
+    SpicyScriptPlayer *player = user_data;
+
+    player->wait_id = 0;
+    spicy_script_player_run(player);
+
+    return FALSE;
+}
+
+/* runs the script until a wait, or its end */
+void spicy_script_player_run(SpicyScriptPlayer *player)
+{
+    while (player->inputs != NULL && player->wait_id == 0) {
+        SpicyCommand *cmd;
+        gint mask;
+
+        if (player->pos == player->script->len) {
+            if (!player->repeat || player->script->len == 0) {
+                if (player->ended)
+                    player->ended(player->user_data);
+                return;
+            }
+            player->pos = 0;
+            if (!player->waited) {
+                player->wait_id = g_timeout_add(PLAYER_REPEAT_DELAY_MS,
+                                                player_wait_done, player);
+                return;
+            }
+            player->waited = FALSE;
+        }
+
+        cmd = &g_array_index(player->script, SpicyCommand, player->pos++);
+        mask = cmd->a >= 1 && cmd->a <= 3 ? 1 << (cmd->a - 1) : 0;
+        switch (cmd->type) {
+        case SPICY_COMMAND_WAIT:
+            player->waited = TRUE;
+            player->wait_id = g_timeout_add(MAX(cmd->a, 0), player_wait_done, player);
+            return;
+        case SPICY_COMMAND_MOVE:
+            spice_inputs_position(player->inputs, cmd->a, cmd->b, 0, player->button_state);
+            break;
+        case SPICY_COMMAND_PRESS:
+            player->button_state |= mask;
+            spice_inputs_button_press(player->inputs, cmd->a, player->button_state);
+            break;
+        case SPICY_COMMAND_RELEASE:
+            player->button_state &= ~mask;
+            spice_inputs_button_release(player->inputs, cmd->a, player->button_state);
+            break;
+        case SPICY_COMMAND_KEY:
+            spice_inputs_key_press_and_release(player->inputs, cmd->a);
+            break;
+        }
+        if (player->input_sent)
+            player->input_sent(player->user_data);
+    }
+}
+
+/* pauses the script, spicy_script_player_run() goes on from there */
+void spicy_script_player_stop(SpicyScriptPlayer *player)
+{
+    if (player->wait_id != 0)
+        g_source_remove(player->wait_id);
+    player->wait_id = 0;
+}
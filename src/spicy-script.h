@@ -0,0 +1,73 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPICY_SCRIPT_H_
+# define SPICY_SCRIPT_H_
+
+G_BEGIN_DECLS
+
+/*
+ * Inputs played from a script, one command per line:
+ *
+ *   wait <ms>            pause the script
+ *   move <x> <y>         move the pointer on the first display
+ *   press <button>       press a mouse button (1 left, 2 middle, 3 right,
+ *                        4 and 5 for the wheel)
+ *   release <button>     release it
+ *   key <scancode>       press and release a key
+ *
+ * Empty lines and lines starting with '#' are skipped.
+ */
+typedef enum {
+    SPICY_COMMAND_WAIT,
+    SPICY_COMMAND_MOVE,
+    SPICY_COMMAND_PRESS,
+    SPICY_COMMAND_RELEASE,
+    SPICY_COMMAND_KEY,
+} SpicyCommandType;
+
+typedef struct {
+    SpicyCommandType type;
+    gint a, b;
+} SpicyCommand;
+
+GArray *spicy_script_load(const gchar *filename, GError **error);
+
+/* plays a script on an inputs channel, any number of them share a script */
+typedef struct {
+    GArray *script; /* SpicyCommand */
+    gboolean repeat;
+    SpiceInputsChannel *inputs;
+    /* after each input, and once the script ended */
+    void (*input_sent)(gpointer user_data);
+    void (*ended)(gpointer user_data);
+    gpointer user_data;
+
+    /*< private >*/
+    guint pos;
+    guint wait_id;
+    gboolean waited; /* in this pass of the script */
+    gint button_state;
+} SpicyScriptPlayer;
+
+void spicy_script_player_run(SpicyScriptPlayer *player);
+void spicy_script_player_stop(SpicyScriptPlayer *player);
+
+G_END_DECLS
+
+#endif // SPICY_SCRIPT_H_
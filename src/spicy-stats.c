@@ -24,10 +24,13 @@
 
 /* config */
 static gboolean version = FALSE;
+static gint interval = 0;
 
 /* state */
 static SpiceSession  *session;
 static GMainLoop     *mainloop;
+static guint64       last_wakeups;
+static gint64        last_wakeups_time;
 
 /* ------------------------------------------------------------------ */
 static void main_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
@@ -61,6 +64,76 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer *data)
     spice_channel_connect(channel);
 }
 
+static gboolean print_stats(gpointer user_data)
+{
+    GList *iter, *list = spice_session_get_channels(session);
+    guint64 hits, misses, evictions, bytes, memory, bandwidth, wakeups;
+    gint64 now = g_get_monotonic_time();
+    guint64 main_ready, first_frame, usb_init, smartcard_init, audio_init;
+
+    for (iter = list ; iter ; iter = iter->next) {
+        SpiceChannel *channel = iter->data;
+        SpiceChannelStats *stats = spice_channel_get_stats(channel);
+        gint channel_type, channel_id;
+
+        g_object_get(channel,
+                     "channel-type", &channel_type,
+                     "channel-id", &channel_id,
+                     NULL);
+        printf("%s-%d: in %" G_GUINT64_FORMAT "B/%" G_GUINT64_FORMAT " msgs"
+               " out %" G_GUINT64_FORMAT "B/%" G_GUINT64_FORMAT " msgs"
+               " reads %" G_GUINT64_FORMAT " writes %" G_GUINT64_FORMAT
+               " parse %" G_GUINT64_FORMAT "us handle %" G_GUINT64_FORMAT "us"
+               " queue %u/%u rtt %" G_GUINT64_FORMAT "us"
+               " ready %" G_GUINT64_FORMAT "us\n",
+               spice_channel_type_to_string(channel_type), channel_id,
+               stats->bytes_in, stats->messages_in,
+               stats->bytes_out, stats->messages_out,
+               stats->read_calls, stats->write_calls,
+               stats->parse_time_us, stats->handle_time_us,
+               stats->xmit_queue_depth, stats->xmit_queue_max_depth,
+               stats->rtt_us, stats->ready_time_us);
+        if (stats->compressed_bytes_out || stats->compressed_bytes_in)
+            printf("  lz4 out %" G_GUINT64_FORMAT "B->%" G_GUINT64_FORMAT "B %" G_GUINT64_FORMAT "us"
+                   " in %" G_GUINT64_FORMAT "B->%" G_GUINT64_FORMAT "B %" G_GUINT64_FORMAT "us\n",
+                   stats->uncompressed_bytes_out, stats->compressed_bytes_out,
+                   stats->compress_time_us,
+                   stats->compressed_bytes_in, stats->uncompressed_bytes_in,
+                   stats->decompress_time_us);
+        if (stats->msg_out_pool_hits || stats->msg_out_pool_misses)
+            printf("  message pool hits %" G_GUINT64_FORMAT " misses %" G_GUINT64_FORMAT "\n",
+                   stats->msg_out_pool_hits, stats->msg_out_pool_misses);
+        spice_channel_stats_free(stats);
+    }
+    g_list_free(list);
+
+    spice_session_get_image_cache_stats(session, &hits, &misses, &evictions, &bytes);
+    printf("image cache: %" G_GUINT64_FORMAT "B hits %" G_GUINT64_FORMAT
+           " misses %" G_GUINT64_FORMAT " evictions %" G_GUINT64_FORMAT "\n",
+           bytes, hits, misses, evictions);
+    g_object_get(session,
+                 "memory-usage", &memory,
+                 "bandwidth", &bandwidth,
+                 "main-loop-wakeups", &wakeups,
+                 NULL);
+    printf("memory: %" G_GUINT64_FORMAT "B\n", memory);
+    printf("bandwidth: %" G_GUINT64_FORMAT "B/s\n", bandwidth);
+    /* this printout is one of them */
+    if (last_wakeups_time != 0)
+        printf("wakeups: %.1f/s\n",
+               (wakeups - last_wakeups) * 1e6 / (now - last_wakeups_time));
+    last_wakeups = wakeups;
+    last_wakeups_time = now;
+    spice_session_get_startup_times(session, &main_ready, &first_frame,
+                                    &usb_init, &smartcard_init, &audio_init);
+    printf("startup: main ready %" G_GUINT64_FORMAT "us first frame %" G_GUINT64_FORMAT
+           "us usb %" G_GUINT64_FORMAT "us smartcard %" G_GUINT64_FORMAT
+           "us audio %" G_GUINT64_FORMAT "us\n",
+           main_ready, first_frame, usb_init, smartcard_init, audio_init);
+
+    return TRUE;
+}
+
 /* ------------------------------------------------------------------ */
 
 static GOptionEntry app_entries[] = {
@@ -69,6 +142,13 @@ static GOptionEntry app_entries[] = {
         .arg              = G_OPTION_ARG_NONE,
         .arg_data         = &version,
         .description      = N_("Display version and quit"),
+    },{
+        .long_name        = "interval",
+        .short_name       = 'i',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &interval,
+        .description      = N_("Print channel statistics every <seconds>"),
+        .arg_description  = N_("<seconds>"),
     },
     {
         /* end of list */
@@ -123,6 +203,9 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (interval > 0)
+        g_timeout_add_seconds(interval, print_stats, NULL);
+
     g_main_loop_run(mainloop);
     {
         GList *iter, *list = spice_session_get_channels(session);
@@ -19,7 +19,9 @@
 #include "config.h"
 #include <glib/gi18n.h>
 
+#include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #ifdef HAVE_TERMIOS_H
 #include <termios.h>
 #endif
@@ -36,6 +38,7 @@
 #include "spice-common.h"
 #include "spice-cmdline.h"
 #include "spice-option.h"
+#include "spicy-script.h"
 #include "usb-device-widget.h"
 
 typedef struct spice_connection spice_connection;
@@ -66,6 +69,14 @@ struct _SpiceWindow {
     GtkWidget        *menubar, *toolbar;
     GtkWidget        *ritem, *rmenu;
     GtkWidget        *statusbar, *status, *st[STATE_MAX];
+    GtkWidget        *hud;
+    guint            hud_id;
+    gchar            *hud_text;
+    gint64           hud_time;
+    guint64          hud_bytes_in, hud_bytes_out;
+    guint64          hud_latency[SPICE_DISPLAY_LATENCY_BUCKETS];
+    guint64          hud_cache_hits, hud_cache_misses;
+    GHashTable       *hud_streams; /* stream id -> HudStream */
     GtkActionGroup   *ag;
     GtkUIManager     *ui;
     bool             fullscreen;
@@ -100,6 +111,7 @@ struct spice_connection {
     const char       *mouse_state;
     const char       *agent_state;
     gboolean         agent_connected;
+    gboolean         usb_manager_connected;
     int              channels;
     int              disconnecting;
 };
@@ -119,6 +131,7 @@ static void del_window(spice_connection *conn, SpiceWindow *win);
 static gboolean fullscreen = false;
 static gboolean version = false;
 static char *spicy_title = NULL;
+static char *benchmark_file = NULL;
 /* globals */
 static GMainLoop     *mainloop = NULL;
 static int           connections = 0;
@@ -565,6 +578,364 @@ static void menu_cb_statusbar(GtkToggleAction *action, gpointer data)
     g_key_file_set_boolean(keyfile, "ui", "statusbar", state);
 }
 
+/* ------------------------------------------------------------------ */
+/* performance overlay, refreshed at 2 Hz while shown */
+
+#define HUD_INTERVAL_MS 500
+/* a stream without stats for that long is gone */
+#define HUD_STREAM_TIMEOUT_US (2 * G_USEC_PER_SEC)
+
+typedef struct HudStream {
+    SpiceDisplayStreamStats *stats;
+    gint64 time;
+} HudStream;
+
+static void hud_stream_free(gpointer data)
+{
+    HudStream *st = data;
+
+    spice_display_stream_stats_free(st->stats);
+    g_free(st);
+}
+
+static void hud_stream_stats(SpiceChannel *display, SpiceDisplayStreamStats *stats,
+                             gpointer data)
+{
+    SpiceWindow *win = data;
+    HudStream *st;
+
+    if (win->hud_id == 0)
+        return;
+
+    st = g_new0(HudStream, 1);
+    st->stats = spice_display_stream_stats_copy(stats);
+    st->time = g_get_monotonic_time();
+    g_hash_table_replace(win->hud_streams, GUINT_TO_POINTER(stats->id), st);
+}
+
+static gboolean hud_stream_expired(gpointer key, gpointer value, gpointer data)
+{
+    HudStream *st = value;
+    gint64 *now = data;
+
+    return *now - st->time > HUD_STREAM_TIMEOUT_US;
+}
+
+static const gchar *hud_codec_name(gint codec)
+{
+    switch (codec) {
+    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
+        return "mjpeg";
+    default:
+        return "?";
+    }
+}
+
+/* the latency of the median frame, from the counts of the histogram buckets */
+static const gchar *hud_latency_median(const guint64 *counts, guint64 total)
+{
+    static const gchar *bounds[SPICE_DISPLAY_LATENCY_BUCKETS] = {
+        "<1", "<2", "<4", "<8", "<16", "<32", "<64", "<128", "<256", "<512",
+        "<1024", "<2048", "<4096", "<8192", "<16384", ">16384",
+    };
+    guint64 seen = 0;
+    guint i;
+
+    for (i = 0; i < SPICE_DISPLAY_LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen * 2 >= total)
+            return bounds[i];
+    }
+
+    return "-";
+}
+
+/* the counters are sampled since the previous update */
+static gboolean hud_update(gpointer data)
+{
+    SpiceWindow *win = data;
+    SpiceSession *session = win->conn->session;
+    GList *iter, *list;
+    GString *text;
+    GHashTableIter stream_iter;
+    gpointer value;
+    guint64 latency[SPICE_DISPLAY_LATENCY_BUCKETS], counts[SPICE_DISPLAY_LATENCY_BUCKETS];
+    guint64 bytes_in = 0, bytes_out = 0, frames = 0, rtt_us = 0;
+    guint64 hits, misses, evictions, bytes, lookups;
+    guint audio_ms = 0;
+    gboolean playback = FALSE;
+    gint64 now = g_get_monotonic_time();
+    gdouble seconds = win->hud_time ? (now - win->hud_time) / (gdouble)G_USEC_PER_SEC : 0;
+    guint i;
+
+    list = spice_session_get_channels(session);
+    for (iter = list; iter != NULL; iter = iter->next) {
+        SpiceChannel *channel = iter->data;
+        SpiceChannelStats *stats = spice_channel_get_stats(channel);
+
+        bytes_in += stats->bytes_in;
+        bytes_out += stats->bytes_out;
+        if (SPICE_IS_INPUTS_CHANNEL(channel))
+            rtt_us = stats->rtt_us;
+        if (SPICE_IS_PLAYBACK_CHANNEL(channel)) {
+            g_object_get(channel, "min-latency", &audio_ms, NULL);
+            playback = TRUE;
+        }
+        spice_channel_stats_free(stats);
+    }
+    g_list_free(list);
+
+    spice_display_get_latency_histogram(win->display_channel, latency);
+    for (i = 0; i < SPICE_DISPLAY_LATENCY_BUCKETS; i++) {
+        counts[i] = latency[i] - win->hud_latency[i];
+        frames += counts[i];
+    }
+    spice_session_get_image_cache_stats(session, &hits, &misses, &evictions, &bytes);
+    lookups = hits + misses - win->hud_cache_hits - win->hud_cache_misses;
+
+    text = g_string_new(NULL);
+    if (seconds > 0) {
+        g_string_append_printf(text, "display %d:%d  %.1f fps  latency %s ms\n",
+                               win->id, win->monitor_id, frames / seconds,
+                               frames ? hud_latency_median(counts, frames) : "-");
+        g_string_append_printf(text, "link  in %.1f KiB/s  out %.1f KiB/s\n",
+                               (bytes_in - win->hud_bytes_in) / seconds / 1024,
+                               (bytes_out - win->hud_bytes_out) / seconds / 1024);
+        if (lookups > 0)
+            g_string_append_printf(text, "image cache  %.0f%% hits  %" G_GUINT64_FORMAT " KiB\n",
+                                   100.0 * (hits - win->hud_cache_hits) / lookups,
+                                   bytes / 1024);
+        else
+            g_string_append_printf(text, "image cache  -  %" G_GUINT64_FORMAT " KiB\n",
+                                   bytes / 1024);
+    }
+
+    g_hash_table_foreach_remove(win->hud_streams, hud_stream_expired, &now);
+    g_hash_table_iter_init(&stream_iter, win->hud_streams);
+    while (g_hash_table_iter_next(&stream_iter, NULL, &value)) {
+        SpiceDisplayStreamStats *stats = ((HudStream *)value)->stats;
+
+        g_string_append_printf(text, "stream %u  %s  %.1f fps  decode %.1f ms  drops %u\n",
+                               stats->id, hud_codec_name(stats->codec), stats->fps,
+                               stats->decode_time_us / 1000.0,
+                               stats->num_drops_on_receive + stats->num_drops_on_playback);
+    }
+
+    if (playback)
+        g_string_append_printf(text, "audio  buffer %u ms\n", audio_ms);
+    if (rtt_us != 0)
+        g_string_append_printf(text, "input  rtt %.1f ms\n", rtt_us / 1000.0);
+    if (text->len > 0)
+        g_string_truncate(text, text->len - 1);
+
+    /* the label is laid out again only when its text changes */
+    if (g_strcmp0(text->str, win->hud_text) != 0) {
+        gtk_label_set_text(GTK_LABEL(win->hud), text->str);
+        g_free(win->hud_text);
+        win->hud_text = g_string_free(text, FALSE);
+    } else {
+        g_string_free(text, TRUE);
+    }
+
+    win->hud_time = now;
+    win->hud_bytes_in = bytes_in;
+    win->hud_bytes_out = bytes_out;
+    memcpy(win->hud_latency, latency, sizeof(latency));
+    win->hud_cache_hits = hits;
+    win->hud_cache_misses = misses;
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void hud_show(SpiceWindow *win, gboolean show)
+{
+    if (win->hud == NULL)
+        return;
+
+    gtk_widget_set_visible(win->hud, show);
+    if (show && win->hud_id == 0) {
+        win->hud_time = 0;
+        hud_update(win);
+        win->hud_id = g_timeout_add(HUD_INTERVAL_MS, hud_update, win);
+    } else if (!show && win->hud_id != 0) {
+        g_source_remove(win->hud_id);
+        win->hud_id = 0;
+        g_hash_table_remove_all(win->hud_streams);
+    }
+}
+
+static void menu_cb_hud(GtkToggleAction *action, gpointer data)
+{
+    SpiceWindow *win = data;
+    gboolean state = gtk_toggle_action_get_active(action);
+
+    hud_show(win, state);
+    g_key_file_set_boolean(keyfile, "ui", "hud", state);
+}
+
+/* ------------------------------------------------------------------ */
+/*
+ * Benchmark: the inputs of a script (see spicy-script.h) are played
+ * once the inputs channel is open, and a second after its end, a JSON
+ * report is printed and spicy quits. A present is a draw of a display
+ * widget, and the input latency is the time from an input to the next
+ * present.
+ */
+
+#define BENCHMARK_SETTLE_MS 1000
+
+static struct {
+    GArray *script;
+    SpicyScriptPlayer player;
+    spice_connection *conn;
+    gboolean done;
+    guint end_id;
+    gint64 start_time;
+    clock_t start_clock;
+    guint64 presents;
+    gint64 input_time; /* of the first input not presented yet */
+    guint64 latency_total_us, latency_max_us, n_latencies;
+} benchmark;
+
+static gboolean benchmark_present(GtkWidget *widget, gpointer event_or_cr, gpointer data)
+{
+    if (benchmark.start_time == 0)
+        return FALSE;
+
+    benchmark.presents++;
+    if (benchmark.input_time != 0) {
+        guint64 latency = g_get_monotonic_time() - benchmark.input_time;
+
+        benchmark.latency_total_us += latency;
+        benchmark.latency_max_us = MAX(benchmark.latency_max_us, latency);
+        benchmark.n_latencies++;
+        benchmark.input_time = 0;
+    }
+
+    return FALSE;
+}
+
+static void benchmark_input_sent(gpointer user_data)
+{
+    if (benchmark.input_time == 0)
+        benchmark.input_time = g_get_monotonic_time();
+}
+
+/* a JSON string, with its quotes */
+static gchar *json_string(const gchar *str)
+{
+    GString *json = g_string_new("\"");
+
+    for (; str && *str; str++) {
+        guchar c = *str;
+
+        if (c == '"' || c == '\\')
+            g_string_append_printf(json, "\\%c", c);
+        else if (c < 0x20)
+            g_string_append_printf(json, "\\u%04x", c);
+        else
+            g_string_append_c(json, c);
+    }
+    g_string_append_c(json, '"');
+
+    return g_string_free(json, FALSE);
+}
+
+/* a JSON number, whatever the locale */
+static gchar *json_number(gdouble value, const gchar *format)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    return g_strdup(g_ascii_formatd(buf, sizeof(buf), format, value));
+}
+
+static void benchmark_report(void)
+{
+    GList *iter, *list = spice_session_get_channels(benchmark.conn->session);
+    gdouble elapsed = (g_get_monotonic_time() - benchmark.start_time) / 1e6;
+    gdouble cpu = (gdouble)(clock() - benchmark.start_clock) / CLOCKS_PER_SEC;
+    guint64 bytes_in = 0, bytes_out = 0;
+    guint64 latency[SPICE_DISPLAY_LATENCY_BUCKETS] = { 0, };
+    gchar *script, *duration, *cpu_s, *fps;
+    guint i;
+
+    for (iter = list; iter; iter = iter->next) {
+        SpiceChannelStats *stats = spice_channel_get_stats(iter->data);
+
+        bytes_in += stats->bytes_in;
+        bytes_out += stats->bytes_out;
+        spice_channel_stats_free(stats);
+        if (SPICE_IS_DISPLAY_CHANNEL(iter->data)) {
+            guint64 histogram[SPICE_DISPLAY_LATENCY_BUCKETS];
+
+            spice_display_get_latency_histogram(iter->data, histogram);
+            for (i = 0; i < SPICE_DISPLAY_LATENCY_BUCKETS; i++)
+                latency[i] += histogram[i];
+        }
+    }
+    g_list_free(list);
+
+    script = json_string(benchmark_file);
+    duration = json_number(elapsed, "%.3f");
+    cpu_s = json_number(cpu, "%.3f");
+    fps = json_number(elapsed > 0 ? benchmark.presents / elapsed : 0., "%.1f");
+    printf("{\"script\": %s, \"duration_s\": %s, \"cpu_s\": %s, "
+           "\"presents\": %" G_GUINT64_FORMAT ", \"fps\": %s, "
+           "\"inputs_presented\": %" G_GUINT64_FORMAT ", "
+           "\"input_latency_us\": %" G_GUINT64_FORMAT ", "
+           "\"input_latency_max_us\": %" G_GUINT64_FORMAT ", "
+           "\"bytes_in\": %" G_GUINT64_FORMAT ", \"bytes_out\": %" G_GUINT64_FORMAT ", "
+           "\"wire_latency_histogram\": [",
+           script, duration, cpu_s,
+           benchmark.presents, fps,
+           benchmark.n_latencies,
+           benchmark.n_latencies ? benchmark.latency_total_us / benchmark.n_latencies : 0,
+           benchmark.latency_max_us, bytes_in, bytes_out);
+    g_free(script);
+    g_free(duration);
+    g_free(cpu_s);
+    g_free(fps);
+    for (i = 0; i < SPICE_DISPLAY_LATENCY_BUCKETS; i++)
+        printf("%s%" G_GUINT64_FORMAT, i ? ", " : "", latency[i]);
+    printf("]}\n");
+    fflush(stdout);
+}
+
+static gboolean benchmark_end(gpointer data)
+{
+    benchmark.end_id = 0;
+    benchmark.done = TRUE;
+    benchmark_report();
+    connection_disconnect(benchmark.conn);
+
+    return FALSE;
+}
+
+static void benchmark_script_ended(gpointer user_data)
+{
+    if (benchmark.end_id == 0 && !benchmark.done)
+        benchmark.end_id = g_timeout_add(BENCHMARK_SETTLE_MS, benchmark_end, NULL);
+}
+
+static void benchmark_inputs_event(SpiceChannel *channel, SpiceChannelEvent event,
+                                   gpointer data)
+{
+    if (event != SPICE_CHANNEL_OPENED) {
+        spicy_script_player_stop(&benchmark.player);
+        benchmark.player.inputs = NULL;
+        return;
+    }
+
+    if (benchmark.done)
+        return;
+    if (benchmark.start_time == 0) {
+        benchmark.start_time = g_get_monotonic_time();
+        benchmark.start_clock = clock();
+    }
+    benchmark.player.inputs = SPICE_INPUTS_CHANNEL(channel);
+    spicy_script_player_run(&benchmark.player);
+}
+
 static void menu_cb_about(GtkAction *action, void *data)
 {
     char *comments = _("gtk test client app for the\n"
@@ -725,6 +1096,11 @@ static void restore_configuration(SpiceWindow *win)
     if (error == NULL)
         gtk_widget_set_visible(win->statusbar, state);
     g_clear_error(&error);
+
+    state = g_key_file_get_boolean(keyfile, "ui", "hud", &error);
+    if (error == NULL)
+        hud_show(win, state);
+    g_clear_error(&error);
 }
 
 /* ------------------------------------------------------------------ */
@@ -866,6 +1242,10 @@ static const GtkToggleActionEntry tentries[] = {
         .name        = "Toolbar",
         .label       = N_("Toolbar"),
         .callback    = G_CALLBACK(menu_cb_toolbar),
+    },{
+        .name        = "HUD",
+        .label       = N_("Performance overlay"),
+        .callback    = G_CALLBACK(menu_cb_hud),
     }
 };
 
@@ -886,6 +1266,7 @@ static char ui_xml[] =
 "      <menuitem action='Fullscreen'/>\n"
 "      <menuitem action='Toolbar'/>\n"
 "      <menuitem action='Statusbar'/>\n"
+"      <menuitem action='HUD'/>\n"
 "    </menu>\n"
 "    <menu action='InputMenu'>\n"
 #ifdef USE_SMARTCARD
@@ -983,7 +1364,7 @@ static SpiceWindow *create_spice_window(spice_connection *conn, SpiceChannel *ch
     SpiceWindow *win;
     GtkAction *toggle;
     gboolean state;
-    GtkWidget *vbox, *frame;
+    GtkWidget *vbox, *frame, *display_area;
     GError *err = NULL;
     int i;
     SpiceGrabSequence *seq;
@@ -1058,6 +1439,40 @@ static SpiceWindow *create_spice_window(spice_connection *conn, SpiceChannel *ch
                      G_CALLBACK(keyboard_grab_cb), win);
     g_signal_connect(G_OBJECT(win->spice), "grab-keys-pressed",
                      G_CALLBACK(grab_keys_pressed_cb), win);
+    if (benchmark.script != NULL)
+#if GTK_CHECK_VERSION(3,0,0)
+        g_signal_connect_after(win->spice, "draw", G_CALLBACK(benchmark_present), NULL);
+#else
+        g_signal_connect_after(win->spice, "expose-event", G_CALLBACK(benchmark_present), NULL);
+#endif
+
+    /* performance overlay, in a corner of the display */
+    display_area = win->spice;
+    win->hud_streams = g_hash_table_new_full(NULL, NULL, NULL, hud_stream_free);
+#if GTK_CHECK_VERSION(3,2,0)
+    {
+        PangoAttrList *attrs = pango_attr_list_new();
+
+        pango_attr_list_insert(attrs, pango_attr_family_new("monospace"));
+        pango_attr_list_insert(attrs, pango_attr_foreground_new(0xffff, 0xffff, 0xffff));
+        pango_attr_list_insert(attrs, pango_attr_background_new(0, 0, 0));
+        win->hud = gtk_label_new(NULL);
+        gtk_label_set_attributes(GTK_LABEL(win->hud), attrs);
+        pango_attr_list_unref(attrs);
+        gtk_widget_set_halign(win->hud, GTK_ALIGN_START);
+        gtk_widget_set_valign(win->hud, GTK_ALIGN_START);
+        gtk_widget_set_no_show_all(win->hud, TRUE);
+
+        display_area = gtk_overlay_new();
+        gtk_container_add(GTK_CONTAINER(display_area), win->spice);
+        gtk_overlay_add_overlay(GTK_OVERLAY(display_area), win->hud);
+#if GTK_CHECK_VERSION(3,18,0)
+        gtk_overlay_set_overlay_pass_through(GTK_OVERLAY(display_area), win->hud, TRUE);
+#endif
+        spice_g_signal_connect_object(channel, "display-stream-stats",
+                                      G_CALLBACK(hud_stream_stats), win, 0);
+    }
+#endif
 
     /* status line */
 #if GTK_CHECK_VERSION(3,0,0)
@@ -1093,7 +1508,7 @@ static SpiceWindow *create_spice_window(spice_connection *conn, SpiceChannel *ch
     gtk_container_add(GTK_CONTAINER(win->toplevel), vbox);
     gtk_box_pack_start(GTK_BOX(vbox), win->menubar, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(vbox), win->toolbar, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(vbox), win->spice, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), display_area, TRUE, TRUE, 0);
     gtk_box_pack_end(GTK_BOX(vbox), win->statusbar, FALSE, TRUE, 0);
 
     /* show window */
@@ -1137,6 +1552,10 @@ static SpiceWindow *create_spice_window(spice_connection *conn, SpiceChannel *ch
     state = gtk_widget_get_visible(win->statusbar);
     gtk_toggle_action_set_active(GTK_TOGGLE_ACTION(toggle), state);
 
+    toggle = gtk_action_group_get_action(win->ag, "HUD");
+    gtk_toggle_action_set_active(GTK_TOGGLE_ACTION(toggle), win->hud_id != 0);
+    gtk_action_set_visible(toggle, win->hud != NULL);
+
 #ifdef USE_SMARTCARD
     gboolean smartcard;
 
@@ -1172,6 +1591,10 @@ static void destroy_spice_window(SpiceWindow *win)
         return;
 
     SPICE_DEBUG("destroy window (#%d:%d)", win->id, win->monitor_id);
+    if (win->hud_id != 0)
+        g_source_remove(win->hud_id);
+    g_hash_table_unref(win->hud_streams);
+    g_free(win->hud_text);
     g_object_unref(win->ag);
     g_object_unref(win->ui);
     gtk_widget_destroy(win->toplevel);
@@ -1549,6 +1972,9 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
         SPICE_DEBUG("new inputs channel");
         g_signal_connect(channel, "inputs-modifiers",
                          G_CALLBACK(inputs_modifiers), conn);
+        if (benchmark.script != NULL)
+            g_signal_connect(channel, "channel-event",
+                             G_CALLBACK(benchmark_inputs_event), conn);
     }
 
     if (SPICE_IS_PLAYBACK_CHANNEL(channel)) {
@@ -1557,6 +1983,17 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
     }
 
     if (SPICE_IS_USBREDIR_CHANNEL(channel)) {
+        SpiceUsbDeviceManager *manager;
+
+        /* only created once there's something to redirect to */
+        manager = spice_usb_device_manager_get(s, NULL);
+        if (manager && !conn->usb_manager_connected) {
+            g_signal_connect(manager, "auto-connect-failed",
+                             G_CALLBACK(usb_connect_failed), NULL);
+            g_signal_connect(manager, "device-error",
+                             G_CALLBACK(usb_connect_failed), NULL);
+            conn->usb_manager_connected = TRUE;
+        }
         update_auto_usbredir_sensitive(conn);
     }
 
@@ -1621,7 +2058,6 @@ static void migration_state(GObject *session,
 static spice_connection *connection_new(void)
 {
     spice_connection *conn;
-    SpiceUsbDeviceManager *manager;
 
     conn = g_new0(spice_connection, 1);
     conn->session = spice_session_new();
@@ -1633,14 +2069,6 @@ static spice_connection *connection_new(void)
     g_signal_connect(conn->session, "notify::migration-state",
                      G_CALLBACK(migration_state), conn);
 
-    manager = spice_usb_device_manager_get(conn->session, NULL);
-    if (manager) {
-        g_signal_connect(manager, "auto-connect-failed",
-                         G_CALLBACK(usb_connect_failed), NULL);
-        g_signal_connect(manager, "device-error",
-                         G_CALLBACK(usb_connect_failed), NULL);
-    }
-
     connections++;
     SPICE_DEBUG("%s (%d)", __FUNCTION__, connections);
     return conn;
@@ -1694,6 +2122,12 @@ static GOptionEntry cmd_entries[] = {
         .arg_data         = &spicy_title,
         .description      = N_("Set the window title"),
         .arg_description  = N_("<title>"),
+    },{
+        .long_name        = "benchmark",
+        .arg              = G_OPTION_ARG_FILENAME,
+        .arg_data         = &benchmark_file,
+        .description      = N_("Play the inputs of <script>, then print a report and quit"),
+        .arg_description  = N_("<script>"),
     },{
         /* end of list */
     }
@@ -1759,6 +2193,7 @@ int main(int argc, char *argv[])
     spice_connection *conn;
     gchar *conf_file, *conf;
     char *host = NULL, *port = NULL, *tls_port = NULL, *unix_path = NULL;
+    int status = 0;
 
 #if !GLIB_CHECK_VERSION(2,31,18)
     g_thread_init(NULL);
@@ -1802,12 +2237,24 @@ int main(int argc, char *argv[])
         exit(0);
     }
 
+    if (benchmark_file != NULL) {
+        benchmark.script = spicy_script_load(benchmark_file, &error);
+        if (benchmark.script == NULL) {
+            g_printerr("%s\n", error->message);
+            exit(1);
+        }
+        benchmark.player.script = benchmark.script;
+        benchmark.player.input_sent = benchmark_input_sent;
+        benchmark.player.ended = benchmark_script_ended;
+    }
+
 #if !GLIB_CHECK_VERSION(2,36,0)
     g_type_init();
 #endif
     mainloop = g_main_loop_new(NULL, false);
 
     conn = connection_new();
+    benchmark.conn = conn;
     spice_set_session_option(conn->session);
     spice_cmdline_session_setup(conn->session);
 
@@ -1850,6 +2297,17 @@ int main(int argc, char *argv[])
 
     g_free(spicy_title);
 
+    if (benchmark.script != NULL) {
+        if (benchmark.end_id != 0)
+            g_source_remove(benchmark.end_id);
+        spicy_script_player_stop(&benchmark.player);
+        g_array_unref(benchmark.script);
+        /* a benchmark that did not get to its end failed */
+        if (!benchmark.done)
+            status = 1;
+    }
+    g_free(benchmark_file);
+
     setup_terminal(true);
-    return 0;
+    return status;
 }
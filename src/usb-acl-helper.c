@@ -22,24 +22,38 @@
 #include "config.h"
 
 #include <errno.h>
-#include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 
 #include "usb-acl-helper.h"
 #include "glib-compat.h"
 
+/*
+ * A single spice-client-glib-usb-acl-helper is spawned on the first request
+ * and kept until we are finalized, so that PolicyKit is asked once, and the
+ * requests are sent to it one at a time.
+ */
+
 /* ------------------------------------------------------------------ */
 /* gobject glue                                                       */
 
 #define SPICE_USB_ACL_HELPER_GET_PRIVATE(obj)                                  \
     (G_TYPE_INSTANCE_GET_PRIVATE ((obj), SPICE_TYPE_USB_ACL_HELPER, SpiceUsbAclHelperPrivate))
 
+typedef struct _AclRequest {
+    SpiceUsbAclHelper *self;
+    GSimpleAsyncResult *result; /* NULL once cancelled */
+    gint busnum;
+    gint devnum;
+    GSource *cancel_source;
+} AclRequest;
+
 struct _SpiceUsbAclHelperPrivate {
-    GSimpleAsyncResult *result;
     GIOChannel *in_ch;
     GIOChannel *out_ch;
-    GCancellable *cancellable;
-    gulong cancellable_id;
+    guint out_watch;
+    GQueue requests; /* AclRequest, the head one is sent */
+    gboolean sent;
 };
 
 G_DEFINE_TYPE(SpiceUsbAclHelper, spice_usb_acl_helper, G_TYPE_OBJECT);
@@ -47,18 +61,30 @@ G_DEFINE_TYPE(SpiceUsbAclHelper, spice_usb_acl_helper, G_TYPE_OBJECT);
 static void spice_usb_acl_helper_init(SpiceUsbAclHelper *self)
 {
     self->priv = SPICE_USB_ACL_HELPER_GET_PRIVATE(self);
+    g_queue_init(&self->priv->requests);
 }
 
-static void spice_usb_acl_helper_cleanup(SpiceUsbAclHelper *self)
+static void request_free(AclRequest *req)
 {
-    SpiceUsbAclHelperPrivate *priv = self->priv;
+    g_warn_if_fail(req->result == NULL);
 
-    g_cancellable_disconnect(priv->cancellable, priv->cancellable_id);
-    priv->cancellable = NULL;
-    priv->cancellable_id = 0;
+    if (req->cancel_source) {
+        g_source_destroy(req->cancel_source);
+        g_source_unref(req->cancel_source);
+    }
+    g_free(req);
+}
 
-    g_clear_object(&priv->result);
+static void spice_usb_acl_helper_stop(SpiceUsbAclHelper *self)
+{
+    SpiceUsbAclHelperPrivate *priv = self->priv;
+
+    if (priv->out_watch) {
+        g_source_remove(priv->out_watch);
+        priv->out_watch = 0;
+    }
 
+    /* the helper takes the ACLs it set away once its stdin is closed */
     if (priv->in_ch) {
         g_io_channel_unref(priv->in_ch);
         priv->in_ch = NULL;
@@ -72,7 +98,12 @@ static void spice_usb_acl_helper_cleanup(SpiceUsbAclHelper *self)
 
 static void spice_usb_acl_helper_finalize(GObject *gobject)
 {
-    spice_usb_acl_helper_cleanup(SPICE_USB_ACL_HELPER(gobject));
+    SpiceUsbAclHelper *self = SPICE_USB_ACL_HELPER(gobject);
+
+    /* pending requests keep us alive, there can only be cancelled ones */
+    g_queue_foreach(&self->priv->requests, (GFunc)request_free, NULL);
+    g_queue_clear(&self->priv->requests);
+    spice_usb_acl_helper_stop(self);
 
     if (G_OBJECT_CLASS(spice_usb_acl_helper_parent_class)->finalize)
         G_OBJECT_CLASS(spice_usb_acl_helper_parent_class)->finalize(gobject);
@@ -88,7 +119,7 @@ static void spice_usb_acl_helper_class_init(SpiceUsbAclHelperClass *klass)
 }
 
 /* ------------------------------------------------------------------ */
-/* callbacks                                                          */
+/* helper process                                                     */
 
 static void async_result_set_cancelled(GSimpleAsyncResult *result)
 {
@@ -97,77 +128,204 @@ static void async_result_set_cancelled(GSimpleAsyncResult *result)
                 "Setting USB device node ACL cancelled");
 }
 
+/* err is taken, NULL for success */
+static void request_complete(AclRequest *req, GError *err)
+{
+    if (req->result == NULL) {
+        g_clear_error(&err);
+        return;
+    }
+
+    if (req->cancel_source) {
+        g_source_destroy(req->cancel_source);
+        g_source_unref(req->cancel_source);
+        req->cancel_source = NULL;
+    }
+
+    if (err)
+        g_simple_async_result_take_error(req->result, err);
+    g_simple_async_result_complete_in_idle(req->result);
+    g_clear_object(&req->result);
+}
+
+static gboolean helper_write(SpiceUsbAclHelper *self, GError **err,
+                             const gchar *format, ...) G_GNUC_PRINTF(3, 4);
+
+static gboolean helper_write(SpiceUsbAclHelper *self, GError **err,
+                             const gchar *format, ...)
+{
+    SpiceUsbAclHelperPrivate *priv = self->priv;
+    gsize bytes_written;
+    gchar buf[128];
+    va_list args;
+
+    va_start(args, format);
+    g_vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if (g_io_channel_write_chars(priv->in_ch, buf, -1,
+                                 &bytes_written, err) != G_IO_STATUS_NORMAL)
+        return FALSE;
+
+    return g_io_channel_flush(priv->in_ch, err) == G_IO_STATUS_NORMAL;
+}
+
+static void helper_send_next(SpiceUsbAclHelper *self);
+
 static gboolean cb_out_watch(GIOChannel    *channel,
                              GIOCondition   cond,
                              gpointer      *user_data)
 {
     SpiceUsbAclHelper *self = SPICE_USB_ACL_HELPER(user_data);
     SpiceUsbAclHelperPrivate *priv = self->priv;
-    gboolean success = FALSE;
+    AclRequest *req;
     GError *err = NULL;
     GIOStatus status;
     gchar *string;
     gsize size;
 
-    /* Check that we've not been cancelled */
-    if (priv->result == NULL)
-        goto done;
-
     g_return_val_if_fail(channel == priv->out_ch, FALSE);
 
     status = g_io_channel_read_line(priv->out_ch, &string, &size, NULL, &err);
+    if (status == G_IO_STATUS_AGAIN)
+        return TRUE; /* Wait for more input */
+
+    req = priv->sent ? g_queue_pop_head(&priv->requests) : NULL;
+    priv->sent = FALSE;
+
     switch (status) {
         case G_IO_STATUS_NORMAL:
             string[strlen(string) - 1] = 0;
             if (!strcmp(string, "SUCCESS")) {
-                success = TRUE;
+                /* the request was cancelled while the helper answered */
+                if (req && req->result == NULL)
+                    helper_write(self, NULL, "CLOSE %d %d\n",
+                                 req->busnum, req->devnum);
             } else if (!strcmp(string, "CANCELED")) {
-                async_result_set_cancelled(priv->result);
+                err = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                          "Setting USB device node ACL cancelled");
             } else {
-                g_simple_async_result_set_error(priv->result,
-                            SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
-                            "Error setting USB device node ACL: '%s'",
-                            string);
+                err = g_error_new(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                                  "Error setting USB device node ACL: '%s'",
+                                  string);
             }
             g_free(string);
             break;
         case G_IO_STATUS_ERROR:
-            g_simple_async_result_take_error(priv->result, err);
             break;
         case G_IO_STATUS_EOF:
-            g_simple_async_result_set_error(priv->result,
-                        SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
-                        "Unexpected EOF reading from acl helper stdout");
+            err = g_error_new_literal(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                                      "Unexpected EOF reading from acl helper stdout");
             break;
         case G_IO_STATUS_AGAIN:
-            return TRUE; /* Wait for more input */
+            g_return_val_if_reached(TRUE);
     }
 
-    g_cancellable_disconnect(priv->cancellable, priv->cancellable_id);
-    priv->cancellable = NULL;
-    priv->cancellable_id = 0;
+    if (req) {
+        request_complete(req, err);
+        request_free(req);
+    } else if (err) {
+        g_error_free(err);
+    }
 
-    g_simple_async_result_complete_in_idle(priv->result);
-    g_clear_object(&priv->result);
+    if (status != G_IO_STATUS_NORMAL) {
+        /* the helper is gone, the next request spawns a new one */
+        priv->out_watch = 0;
+        spice_usb_acl_helper_stop(self);
+        helper_send_next(self);
+        return FALSE;
+    }
 
-    if (!success)
-        spice_usb_acl_helper_cleanup(self);
+    helper_send_next(self);
+    return TRUE;
+}
 
-done:
-    g_object_unref(self);
-    return FALSE;
+static void helper_child_watch_cb(GPid pid, gint status, gpointer user_data)
+{
+    /* Nothing to do, but we need the child watch to avoid zombies */
 }
 
-static void cancelled_cb(GCancellable *cancellable, gpointer user_data)
+static gboolean helper_start(SpiceUsbAclHelper *self, GError **err)
 {
-    SpiceUsbAclHelper *self = SPICE_USB_ACL_HELPER(user_data);
+    SpiceUsbAclHelperPrivate *priv = self->priv;
+    gchar *argv[] = { (char*) ACL_HELPER_PATH"/spice-client-glib-usb-acl-helper", NULL };
+    GPid helper_pid;
+    gint in, out;
+
+    if (!g_spawn_async_with_pipes(NULL, argv, NULL,
+                           G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
+                           NULL, NULL, &helper_pid, &in, &out, NULL, err))
+        return FALSE;
+    g_child_watch_add(helper_pid, helper_child_watch_cb, NULL);
+
+    priv->in_ch = g_io_channel_unix_new(in);
+    g_io_channel_set_close_on_unref(priv->in_ch, TRUE);
+
+    priv->out_ch = g_io_channel_unix_new(out);
+    g_io_channel_set_close_on_unref(priv->out_ch, TRUE);
+    if (g_io_channel_set_flags(priv->out_ch, G_IO_FLAG_NONBLOCK, err)
+        != G_IO_STATUS_NORMAL) {
+        spice_usb_acl_helper_stop(self);
+        return FALSE;
+    }
 
-    spice_usb_acl_helper_close_acl(self);
+    priv->out_watch = g_io_add_watch(priv->out_ch, G_IO_IN|G_IO_HUP,
+                                     (GIOFunc)cb_out_watch, self);
+    return TRUE;
 }
 
-static void helper_child_watch_cb(GPid pid, gint status, gpointer user_data)
+static void helper_send_next(SpiceUsbAclHelper *self)
 {
-    /* Nothing to do, but we need the child watch to avoid zombies */
+    SpiceUsbAclHelperPrivate *priv = self->priv;
+    AclRequest *req;
+    GError *err = NULL;
+
+    while (!priv->sent && (req = g_queue_peek_head(&priv->requests))) {
+        if ((priv->in_ch || helper_start(self, &err)) &&
+            helper_write(self, &err, "%d %d\n", req->busnum, req->devnum)) {
+            priv->sent = TRUE;
+            break;
+        }
+
+        spice_usb_acl_helper_stop(self);
+        g_queue_pop_head(&priv->requests);
+        request_complete(req, err);
+        request_free(req);
+        err = NULL;
+    }
+}
+
+static void request_cancel(AclRequest *req)
+{
+    SpiceUsbAclHelper *self = req->self;
+    SpiceUsbAclHelperPrivate *priv = self->priv;
+
+    if (req->result == NULL)
+        return;
+
+    async_result_set_cancelled(req->result);
+    request_complete(req, NULL);
+
+    if (priv->sent && req == g_queue_peek_head(&priv->requests)) {
+        /* the answer of the helper is still awaited by cb_out_watch */
+        helper_write(self, NULL, "CANCEL\n");
+        return;
+    }
+
+    g_queue_remove(&priv->requests, req);
+    request_free(req);
+}
+
+/* main context */
+static gboolean cancelled_cb(GCancellable *cancellable, gpointer user_data)
+{
+    AclRequest *req = user_data;
+
+    g_source_unref(req->cancel_source);
+    req->cancel_source = NULL;
+    request_cancel(req);
+
+    return FALSE;
 }
 
 /* ------------------------------------------------------------------ */
@@ -194,76 +352,33 @@ void spice_usb_acl_helper_open_acl(SpiceUsbAclHelper *self,
 
     SpiceUsbAclHelperPrivate *priv = self->priv;
     GSimpleAsyncResult *result;
+    AclRequest *req;
     GError *err = NULL;
-    GIOStatus status;
-    GPid helper_pid;
-    gsize bytes_written;
-    gchar *argv[] = { (char*) ACL_HELPER_PATH"/spice-client-glib-usb-acl-helper", NULL };
-    gint in, out;
-    gchar buf[128];
 
     result = g_simple_async_result_new(G_OBJECT(self), callback, user_data,
                                        spice_usb_acl_helper_open_acl);
 
-    if (priv->out_ch) {
-        g_simple_async_result_set_error(result,
-                            SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
-                            "Error acl-helper already has an acl open");
-        goto done;
-    }
-
     if (g_cancellable_set_error_if_cancelled(cancellable, &err)) {
         g_simple_async_result_take_error(result, err);
-        goto done;
-    }
-
-    if (!g_spawn_async_with_pipes(NULL, argv, NULL,
-                           G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
-                           NULL, NULL, &helper_pid, &in, &out, NULL, &err)) {
-        g_simple_async_result_take_error(result, err);
-        goto done;
-    }
-    g_child_watch_add(helper_pid, helper_child_watch_cb, NULL);
-
-    priv->in_ch = g_io_channel_unix_new(in);
-    g_io_channel_set_close_on_unref(priv->in_ch, TRUE);
-
-    priv->out_ch = g_io_channel_unix_new(out);
-    g_io_channel_set_close_on_unref(priv->out_ch, TRUE);
-    status = g_io_channel_set_flags(priv->out_ch, G_IO_FLAG_NONBLOCK, &err);
-    if (status != G_IO_STATUS_NORMAL) {
-        g_simple_async_result_take_error(result, err);
-        goto done;
+        g_simple_async_result_complete_in_idle(result);
+        g_object_unref(result);
+        return;
     }
 
-    snprintf(buf, sizeof(buf), "%d %d\n", busnum, devnum);
-    status = g_io_channel_write_chars(priv->in_ch, buf, -1,
-                                      &bytes_written, &err);
-    if (status != G_IO_STATUS_NORMAL) {
-        g_simple_async_result_take_error(result, err);
-        goto done;
-    }
-    status = g_io_channel_flush(priv->in_ch, &err);
-    if (status != G_IO_STATUS_NORMAL) {
-        g_simple_async_result_take_error(result, err);
-        goto done;
-    }
-
-    priv->result = result;
+    req = g_new0(AclRequest, 1);
+    req->self = self;
+    req->result = result;
+    req->busnum = busnum;
+    req->devnum = devnum;
     if (cancellable) {
-        priv->cancellable = cancellable;
-        priv->cancellable_id = g_cancellable_connect(cancellable,
-                                                     G_CALLBACK(cancelled_cb),
-                                                     self, NULL);
+        req->cancel_source = g_cancellable_source_new(cancellable);
+        g_source_set_callback(req->cancel_source, (GSourceFunc)cancelled_cb,
+                              req, NULL);
+        g_source_attach(req->cancel_source, NULL);
     }
-    g_io_add_watch(priv->out_ch, G_IO_IN|G_IO_HUP,
-                   (GIOFunc)cb_out_watch, g_object_ref(self));
-    return;
-
-done:
-    spice_usb_acl_helper_cleanup(self);
-    g_simple_async_result_complete_in_idle(result);
-    g_object_unref(result);
+
+    g_queue_push_tail(&priv->requests, req);
+    helper_send_next(self);
 }
 
 G_GNUC_INTERNAL
@@ -282,18 +397,29 @@ gboolean spice_usb_acl_helper_open_acl_finish(
     return TRUE;
 }
 
+/*
+ * Takes the access to the device node away once the device is opened, or
+ * cancels the request if it has not completed yet.
+ */
 G_GNUC_INTERNAL
-void spice_usb_acl_helper_close_acl(SpiceUsbAclHelper *self)
+void spice_usb_acl_helper_close_acl(SpiceUsbAclHelper *self,
+                                    gint busnum, gint devnum)
 {
     g_return_if_fail(SPICE_IS_USB_ACL_HELPER(self));
 
     SpiceUsbAclHelperPrivate *priv = self->priv;
+    GList *l;
 
     /* If the acl open has not completed yet report it as cancelled */
-    if (priv->result) {
-        async_result_set_cancelled(priv->result);
-        g_simple_async_result_complete_in_idle(priv->result);
+    for (l = priv->requests.head; l != NULL; l = l->next) {
+        AclRequest *req = l->data;
+
+        if (req->result && req->busnum == busnum && req->devnum == devnum) {
+            request_cancel(req);
+            return;
+        }
     }
 
-    spice_usb_acl_helper_cleanup(self);
+    if (priv->in_ch)
+        helper_write(self, NULL, "CLOSE %d %d\n", busnum, devnum);
 }
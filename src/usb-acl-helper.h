@@ -65,7 +65,8 @@ void spice_usb_acl_helper_open_acl(SpiceUsbAclHelper *self,
 gboolean spice_usb_acl_helper_open_acl_finish(
     SpiceUsbAclHelper *self, GAsyncResult *res, GError **err);
 
-void spice_usb_acl_helper_close_acl(SpiceUsbAclHelper *self);
+void spice_usb_acl_helper_close_acl(SpiceUsbAclHelper *self,
+                                    gint busnum, gint devnum);
 
 G_END_DECLS
 
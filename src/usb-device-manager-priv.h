@@ -31,8 +31,17 @@ gboolean spice_usb_device_manager_start_event_listening(
 void spice_usb_device_manager_stop_event_listening(
     SpiceUsbDeviceManager *manager);
 
+void spice_usb_device_manager_inhibit_keyboard_grab(
+    SpiceUsbDeviceManager *manager, gboolean inhibit);
+
 #ifdef USE_USBREDIR
 #include <libusb.h>
+#if USE_POLKIT
+#include "usb-acl-helper.h"
+SpiceUsbAclHelper *spice_usb_device_manager_get_acl_helper(
+    SpiceUsbDeviceManager *manager);
+#endif
+
 void spice_usb_device_manager_device_error(
     SpiceUsbDeviceManager *manager, SpiceUsbDevice *device, GError *err);
 
@@ -21,6 +21,8 @@
 
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_USB
+
 #include <glib-object.h>
 
 #include "glib-compat.h"
@@ -48,6 +50,7 @@
 #include "spice-client.h"
 #include "spice-marshal.h"
 #include "usb-device-manager-priv.h"
+#include "spice-util-priv.h"
 
 #include <glib/gi18n.h>
 
@@ -108,21 +111,27 @@ struct _SpiceUsbDeviceManagerPrivate {
 #ifdef USE_USBREDIR
     libusb_context *context;
     int event_listeners;
+    int keyboard_grab_inhibitors; /* connects waiting for the acl helper */
     GThread *event_thread;
     gboolean event_thread_run;
     struct usbredirfilter_rule *auto_conn_filter_rules;
     struct usbredirfilter_rule *redirect_on_connect_rules;
     int auto_conn_filter_rules_count;
     int redirect_on_connect_rules_count;
+    guint redirect_on_connect_serial; /* bumped when the rules change */
 #ifdef USE_GUDEV
     GUdevClient *udev;
     libusb_device **coldplug_list; /* Avoid needless reprobing during init */
+    GList *udev_adds; /* UdevAdd, being looked up in a thread */
 #else
     libusb_hotplug_callback_handle hp_handle;
 #endif
 #ifdef G_OS_WIN32
     SpiceWinUsbDriver     *installer;
 #endif
+#if USE_POLKIT
+    SpiceUsbAclHelper *acl_helper; /* shared by the channels */
+#endif
 #endif
     GPtrArray *devices;
     GPtrArray *channels;
@@ -141,6 +150,9 @@ enum {
 
 #ifdef USE_USBREDIR
 
+/* as usbredirhost_check_device_filter() */
+#define FILTER_MAX_INTERFACES 32
+
 typedef struct _SpiceUsbDeviceInfo {
     guint8  busnum;
     guint8  devaddr;
@@ -152,8 +164,33 @@ typedef struct _SpiceUsbDeviceInfo {
     libusb_device *libdev;
 #endif
     gint    ref;
+    /* redirect-on-connect verdict, valid for redirect_on_connect_serial */
+    guint   redirect_serial;
+    gboolean redirect_ok;
+    /* what the filters look at, read once */
+    guint8  class;
+    guint8  subclass;
+    guint8  protocol;
+    guint16 bcd;
+    gint    interface_count;
+    gint    config_result; /* of reading the interfaces, a libusb error */
+    guint8  interface_class[FILTER_MAX_INTERFACES];
+    guint8  interface_subclass[FILTER_MAX_INTERFACES];
+    guint8  interface_protocol[FILTER_MAX_INTERFACES];
+    /* see spice_usb_device_manager_set_iso_buffering() */
+    guint   iso_buffer_ms;
+    guint   batch_size;
 } SpiceUsbDeviceInfo;
 
+#ifdef USE_GUDEV
+typedef struct {
+    int bus, address;
+    gboolean removed; /* while it was looked up */
+    libusb_device *libdev;
+    struct libusb_device_descriptor desc;
+} UdevAdd;
+#endif
+
 
 static void channel_new(SpiceSession *session, SpiceChannel *channel,
                         gpointer user_data);
@@ -175,9 +212,14 @@ static int spice_usb_device_manager_hotplug_cb(libusb_context       *ctx,
 static void spice_usb_device_manager_check_redir_on_connect(
     SpiceUsbDeviceManager *self, SpiceChannel *channel);
 
-static SpiceUsbDeviceInfo *spice_usb_device_new(libusb_device *libdev);
+static SpiceUsbDeviceInfo *spice_usb_device_new(libusb_device *libdev,
+                                                const struct libusb_device_descriptor *desc);
 static SpiceUsbDevice *spice_usb_device_ref(SpiceUsbDevice *device);
 static void spice_usb_device_unref(SpiceUsbDevice *device);
+static gboolean spice_usb_device_check_filter(SpiceUsbDeviceManager *self,
+                                              SpiceUsbDevice *device,
+                                              const struct usbredirfilter_rule *rules,
+                                              int rules_count);
 
 #ifdef G_OS_WIN32
 static guint8 spice_usb_device_get_state(SpiceUsbDevice *device);
@@ -186,6 +228,8 @@ static void  spice_usb_device_set_state(SpiceUsbDevice *device, guint8 s);
 
 static gboolean spice_usb_device_equal_libdev(SpiceUsbDevice *device,
                                               libusb_device *libdev);
+static void spice_usb_device_apply_iso_buffering(SpiceUsbDevice *device,
+                                                 SpiceUsbredirChannel *channel);
 static libusb_device *
 spice_usb_device_manager_device_to_libdev(SpiceUsbDeviceManager *self,
                                           SpiceUsbDevice *device);
@@ -205,6 +249,9 @@ G_DEFINE_BOXED_TYPE(SpiceUsbDevice, spice_usb_device,
 G_DEFINE_BOXED_TYPE(SpiceUsbDevice, spice_usb_device, g_object_ref, g_object_unref)
 #endif
 
+G_DEFINE_BOXED_TYPE(SpiceUsbDeviceStats, spice_usb_device_stats,
+                    spice_usb_device_stats_copy, spice_usb_device_stats_free)
+
 static void spice_usb_device_manager_initable_iface_init(GInitableIface *iface);
 
 static guint signals[LAST_SIGNAL] = { 0, };
@@ -221,6 +268,7 @@ static void spice_usb_device_manager_init(SpiceUsbDeviceManager *self)
 
     priv->channels = g_ptr_array_new();
 #ifdef USE_USBREDIR
+    priv->redirect_on_connect_serial = 1;
     priv->devices  = g_ptr_array_new_with_free_func((GDestroyNotify)
                                                     spice_usb_device_unref);
 #endif
@@ -354,6 +402,9 @@ static void spice_usb_device_manager_finalize(GObject *gobject)
     if (priv->installer)
         g_object_unref(priv->installer);
 #endif
+#if USE_POLKIT
+    g_clear_object(&priv->acl_helper);
+#endif
 #endif
 
     g_free(priv->auto_connect_filter);
@@ -452,6 +503,7 @@ static void spice_usb_device_manager_set_property(GObject       *gobject,
         free(priv->redirect_on_connect_rules);
         priv->redirect_on_connect_rules = rules;
         priv->redirect_on_connect_rules_count = count;
+        priv->redirect_on_connect_serial++;
 #endif
         g_free(priv->redirect_on_connect);
         priv->redirect_on_connect = g_strdup(filter);
@@ -709,6 +761,7 @@ spice_usb_device_get_libusb_device(const SpiceUsbDevice *device G_GNUC_UNUSED)
     return NULL;
 }
 
+#ifdef G_OS_WIN32 /* to match by vid:pid */
 static gboolean spice_usb_device_manager_get_libdev_vid_pid(
     libusb_device *libdev, int *vid, int *pid)
 {
@@ -728,6 +781,7 @@ static gboolean spice_usb_device_manager_get_libdev_vid_pid(
 
     return TRUE;
 }
+#endif
 
 /* ------------------------------------------------------------------ */
 /* callbacks                                                          */
@@ -847,21 +901,19 @@ spice_usb_device_manager_find_device(SpiceUsbDeviceManager *self,
     return device;
 }
 
-static void spice_usb_device_manager_add_dev(SpiceUsbDeviceManager  *self,
-                                             libusb_device          *libdev)
+/* the descriptor is read once, by the caller */
+static void spice_usb_device_manager_add_dev_desc(SpiceUsbDeviceManager  *self,
+                                                  libusb_device          *libdev,
+                                                  const struct libusb_device_descriptor *desc)
 {
     SpiceUsbDeviceManagerPrivate *priv = self->priv;
-    struct libusb_device_descriptor desc;
     SpiceUsbDevice *device;
 
-    if (!spice_usb_device_manager_get_device_descriptor(libdev, &desc))
-        return;
-
     /* Skip hubs */
-    if (desc.bDeviceClass == LIBUSB_CLASS_HUB)
+    if (desc->bDeviceClass == LIBUSB_CLASS_HUB)
         return;
 
-    device = (SpiceUsbDevice*)spice_usb_device_new(libdev);
+    device = (SpiceUsbDevice*)spice_usb_device_new(libdev, desc);
     if (!device)
         return;
 
@@ -873,10 +925,9 @@ static void spice_usb_device_manager_add_dev(SpiceUsbDeviceManager  *self,
         can_redirect = spice_usb_device_manager_can_redirect_device(
                                         self, device, NULL);
 
-        auto_ok = usbredirhost_check_device_filter(
+        auto_ok = spice_usb_device_check_filter(self, device,
                             priv->auto_conn_filter_rules,
-                            priv->auto_conn_filter_rules_count,
-                            libdev, 0) == 0;
+                            priv->auto_conn_filter_rules_count);
 
         if (can_redirect && auto_ok)
             spice_usb_device_manager_connect_device_async(self,
@@ -889,6 +940,17 @@ static void spice_usb_device_manager_add_dev(SpiceUsbDeviceManager  *self,
     g_signal_emit(self, signals[DEVICE_ADDED], 0, device);
 }
 
+static void spice_usb_device_manager_add_dev(SpiceUsbDeviceManager  *self,
+                                             libusb_device          *libdev)
+{
+    struct libusb_device_descriptor desc;
+
+    if (!spice_usb_device_manager_get_device_descriptor(libdev, &desc))
+        return;
+
+    spice_usb_device_manager_add_dev_desc(self, libdev, &desc);
+}
+
 static void spice_usb_device_manager_remove_dev(SpiceUsbDeviceManager *self,
                                                 int bus, int address)
 {
@@ -922,13 +984,72 @@ static void spice_usb_device_manager_remove_dev(SpiceUsbDeviceManager *self,
 }
 
 #ifdef USE_GUDEV
+static void udev_add_free(UdevAdd *add)
+{
+    if (add->libdev)
+        libusb_unref_device(add->libdev);
+    g_free(add);
+}
+
+/* thread context */
+static void udev_add_lookup(GSimpleAsyncResult *res, GObject *object,
+                            GCancellable *cancellable G_GNUC_UNUSED)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(object);
+    UdevAdd *add = g_simple_async_result_get_op_res_gpointer(res);
+    libusb_device **dev_list = NULL;
+    int i;
+
+    /* the enumeration opens every device on the host, and reads its
+       descriptors, a hub may take a while */
+    libusb_get_device_list(self->priv->context, &dev_list);
+    for (i = 0; dev_list && dev_list[i]; i++) {
+        if (spice_usb_device_manager_libdev_match(dev_list[i], add->bus, add->address)) {
+            if (spice_usb_device_manager_get_device_descriptor(dev_list[i], &add->desc))
+                add->libdev = libusb_ref_device(dev_list[i]);
+            break;
+        }
+    }
+    if (dev_list)
+        libusb_free_device_list(dev_list, 1);
+}
+
+/* main context */
+static void udev_add_done(GObject *source_object, GAsyncResult *res,
+                          gpointer user_data G_GNUC_UNUSED)
+{
+    SpiceUsbDeviceManager *self = SPICE_USB_DEVICE_MANAGER(source_object);
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+    UdevAdd *add = g_simple_async_result_get_op_res_gpointer(G_SIMPLE_ASYNC_RESULT(res));
+
+    priv->udev_adds = g_list_remove(priv->udev_adds, add);
+
+    if (add->removed)
+        return;
+
+    if (spice_usb_device_manager_find_device(self, add->bus, add->address)) {
+        SPICE_DEBUG("USB device at %d.%d was added meanwhile, ignored",
+                    add->bus, add->address);
+        return;
+    }
+
+    if (add->libdev)
+        spice_usb_device_manager_add_dev_desc(self, add->libdev, &add->desc);
+    else
+        g_warning("Could not find USB device to add " DEV_ID_FMT,
+                  add->bus, add->address);
+}
+
 static void spice_usb_device_manager_add_udev(SpiceUsbDeviceManager  *self,
                                               GUdevDevice            *udev)
 {
     SpiceUsbDeviceManagerPrivate *priv = self->priv;
-    libusb_device *libdev = NULL, **dev_list = NULL;
+    libusb_device *libdev = NULL;
     SpiceUsbDevice *device;
+    GSimpleAsyncResult *res;
     const gchar *devtype;
+    UdevAdd *add;
+    GList *l;
     int i, bus, address;
 
     devtype = g_udev_device_get_property(udev, "DEVTYPE");
@@ -951,36 +1072,60 @@ static void spice_usb_device_manager_add_udev(SpiceUsbDeviceManager  *self,
         return;
     }
 
-    if (priv->coldplug_list)
-        dev_list = priv->coldplug_list;
-    else
-        libusb_get_device_list(priv->context, &dev_list);
-
-    for (i = 0; dev_list && dev_list[i]; i++) {
-        if (spice_usb_device_manager_libdev_match(dev_list[i], bus, address)) {
-            libdev = dev_list[i];
-            break;
+    if (priv->coldplug_list) {
+        for (i = 0; priv->coldplug_list[i]; i++) {
+            if (spice_usb_device_manager_libdev_match(priv->coldplug_list[i],
+                                                      bus, address)) {
+                libdev = priv->coldplug_list[i];
+                break;
+            }
         }
+
+        if (libdev)
+            spice_usb_device_manager_add_dev(self, libdev);
+        else
+            g_warning("Could not find USB device to add " DEV_ID_FMT,
+                      bus, address);
+        return;
     }
 
-    if (libdev)
-        spice_usb_device_manager_add_dev(self, libdev);
-    else
-        g_warning("Could not find USB device to add " DEV_ID_FMT,
-                  bus, address);
+    for (l = priv->udev_adds; l != NULL; l = l->next) {
+        add = l->data;
+        if (!add->removed && add->bus == bus && add->address == address)
+            return;
+    }
 
-    if (!priv->coldplug_list)
-        libusb_free_device_list(dev_list, 1);
+    /* hotplug, look it up without blocking the UI */
+    add = g_new0(UdevAdd, 1);
+    add->bus = bus;
+    add->address = address;
+    priv->udev_adds = g_list_prepend(priv->udev_adds, add);
+
+    res = g_simple_async_result_new(G_OBJECT(self), udev_add_done, NULL,
+                                    spice_usb_device_manager_add_udev);
+    g_simple_async_result_set_op_res_gpointer(res, add, (GDestroyNotify)udev_add_free);
+    g_simple_async_result_run_in_thread(res, udev_add_lookup, G_PRIORITY_DEFAULT, NULL);
+    g_object_unref(res);
 }
 
 static void spice_usb_device_manager_remove_udev(SpiceUsbDeviceManager  *self,
                                                  GUdevDevice            *udev)
 {
+    GList *l;
     int bus, address;
 
     if (!spice_usb_device_manager_get_udev_bus_n_address(udev, &bus, &address))
         return;
 
+    for (l = self->priv->udev_adds; l != NULL; l = l->next) {
+        UdevAdd *add = l->data;
+
+        if (add->bus == bus && add->address == address && !add->removed) {
+            add->removed = TRUE;
+            return;
+        }
+    }
+
     spice_usb_device_manager_remove_dev(self, bus, address);
 }
 
@@ -1215,6 +1360,43 @@ void spice_usb_device_manager_stop_event_listening(
         priv->event_thread_run = FALSE;
 }
 
+#if USE_POLKIT
+/*
+ * The helper process, and the PolicyKit authorization it got, last as long
+ * as the manager, rather than being spawned again for each device.
+ */
+SpiceUsbAclHelper *spice_usb_device_manager_get_acl_helper(
+    SpiceUsbDeviceManager *self)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    if (priv->acl_helper == NULL)
+        priv->acl_helper = spice_usb_acl_helper_new();
+
+    return priv->acl_helper;
+}
+#endif
+
+/*
+ * Devices are opened concurrently, each on its own channel, the grab stays
+ * inhibited until the last one got through the acl helper.
+ */
+void spice_usb_device_manager_inhibit_keyboard_grab(
+    SpiceUsbDeviceManager *self, gboolean inhibit)
+{
+    SpiceUsbDeviceManagerPrivate *priv = self->priv;
+
+    g_return_if_fail(inhibit || priv->keyboard_grab_inhibitors > 0);
+
+    if (inhibit)
+        priv->keyboard_grab_inhibitors++;
+    else
+        priv->keyboard_grab_inhibitors--;
+
+    if (priv->keyboard_grab_inhibitors == (inhibit ? 1 : 0))
+        g_object_set(priv->session, "inhibit-keyboard-grab", inhibit, NULL);
+}
+
 static void spice_usb_device_manager_check_redir_on_connect(
     SpiceUsbDeviceManager *self, SpiceChannel *channel)
 {
@@ -1230,34 +1412,42 @@ static void spice_usb_device_manager_check_redir_on_connect(
     for (i = 0; i < priv->devices->len; i++) {
         device = g_ptr_array_index(priv->devices, i);
 
+        SpiceUsbDeviceInfo *info = (SpiceUsbDeviceInfo *)device;
+
         if (spice_usb_device_manager_is_device_connected(self, device))
             continue;
 
+        /* each new channel checks every device, the verdict is kept */
+        if (info->redirect_serial != priv->redirect_on_connect_serial) {
+            info->redirect_ok = spice_usb_device_check_filter(self, device,
+                                    priv->redirect_on_connect_rules,
+                                    priv->redirect_on_connect_rules_count);
+            /* not for an unconfigured device, its interfaces will come */
+            if (info->config_result == LIBUSB_SUCCESS)
+                info->redirect_serial = priv->redirect_on_connect_serial;
+        }
+        if (!info->redirect_ok)
+            continue;
+
         libdev = spice_usb_device_manager_device_to_libdev(self, device);
 #ifdef G_OS_WIN32
         if (libdev == NULL)
             continue;
 #endif
-        if (usbredirhost_check_device_filter(
-                            priv->redirect_on_connect_rules,
-                            priv->redirect_on_connect_rules_count,
-                            libdev, 0) == 0) {
-            /* Note: re-uses spice_usb_device_manager_connect_device_async's
-               completion handling code! */
-            result = g_simple_async_result_new(G_OBJECT(self),
-                               spice_usb_device_manager_auto_connect_cb,
-                               spice_usb_device_ref(device),
-                               spice_usb_device_manager_connect_device_async);
-            spice_usbredir_channel_connect_device_async(
-                               SPICE_USBREDIR_CHANNEL(channel),
-                               libdev, device, NULL,
-                               spice_usb_device_manager_channel_connect_cb,
-                               result);
-            libusb_unref_device(libdev);
-            return; /* We've taken the channel! */
-        }
-
+        /* Note: re-uses spice_usb_device_manager_connect_device_async's
+           completion handling code! */
+        result = g_simple_async_result_new(G_OBJECT(self),
+                           spice_usb_device_manager_auto_connect_cb,
+                           spice_usb_device_ref(device),
+                           spice_usb_device_manager_connect_device_async);
+        spice_usb_device_apply_iso_buffering(device, SPICE_USBREDIR_CHANNEL(channel));
+        spice_usbredir_channel_connect_device_async(
+                           SPICE_USBREDIR_CHANNEL(channel),
+                           libdev, device, NULL,
+                           spice_usb_device_manager_channel_connect_cb,
+                           result);
         libusb_unref_device(libdev);
+        return; /* We've taken the channel! */
     }
 }
 
@@ -1332,16 +1522,8 @@ GPtrArray* spice_usb_device_manager_get_devices_with_filter(
     for (i = 0; i < priv->devices->len; i++) {
         SpiceUsbDevice *device = g_ptr_array_index(priv->devices, i);
 
-        if (rules) {
-            libusb_device *libdev =
-                spice_usb_device_manager_device_to_libdev(self, device);
-#ifdef G_OS_WIN32
-            if (libdev == NULL)
-                continue;
-#endif
-            if (usbredirhost_check_device_filter(rules, count, libdev, 0) != 0)
-                continue;
-        }
+        if (rules && !spice_usb_device_check_filter(self, device, rules, count))
+            continue;
         g_ptr_array_add(devices_copy, spice_usb_device_ref(device));
     }
 
@@ -1378,6 +1560,104 @@ gboolean spice_usb_device_manager_is_device_connected(SpiceUsbDeviceManager *sel
     return !!spice_usb_device_manager_get_channel_for_dev(self, device);
 }
 
+/**
+ * spice_usb_device_manager_get_device_stats:
+ * @manager: the #SpiceUsbDeviceManager manager
+ * @device: a #SpiceUsbDevice
+ *
+ * Returns: (transfer full): the statistics of the redirection of @device,
+ * to be freed with spice_usb_device_stats_free(), or %NULL if @device
+ * isn't redirected
+ *
+ * Since: 0.29
+ */
+SpiceUsbDeviceStats *
+spice_usb_device_manager_get_device_stats(SpiceUsbDeviceManager *self,
+                                          SpiceUsbDevice *device)
+{
+    SpiceUsbredirChannel *channel;
+
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self), NULL);
+    g_return_val_if_fail(device != NULL, NULL);
+
+    channel = spice_usb_device_manager_get_channel_for_dev(self, device);
+    if (channel == NULL)
+        return NULL;
+
+#ifdef USE_USBREDIR
+    return spice_usbredir_channel_get_stats(channel);
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * spice_usb_device_manager_set_iso_buffering:
+ * @manager: the #SpiceUsbDeviceManager manager
+ * @device: a #SpiceUsbDevice
+ * @buffer_ms: how much the isochronous streams from @device may queue
+ * before their packets are dropped, in ms, or 0 to adapt it to the
+ * round-trip time and to the packets dropped
+ * @batch_size: the bytes of consecutive packets from @device sent in a
+ * single message, or 0 for the default
+ *
+ * Sets how the data of @device is buffered on its way to the guest:
+ * webcams and headsets would rather drop frames than be late. It applies
+ * right away if @device is redirected, and when it gets redirected.
+ * The packets dropped are part of the device statistics, see
+ * spice_usb_device_manager_get_device_stats().
+ *
+ * Since: 0.29
+ */
+void spice_usb_device_manager_set_iso_buffering(SpiceUsbDeviceManager *self,
+                                                SpiceUsbDevice *device,
+                                                guint buffer_ms,
+                                                guint batch_size)
+{
+    g_return_if_fail(SPICE_IS_USB_DEVICE_MANAGER(self));
+    g_return_if_fail(device != NULL);
+
+#ifdef USE_USBREDIR
+    SpiceUsbDeviceInfo *info = (SpiceUsbDeviceInfo *)device;
+    SpiceUsbredirChannel *channel;
+
+    info->iso_buffer_ms = buffer_ms;
+    info->batch_size = batch_size;
+
+    channel = spice_usb_device_manager_get_channel_for_dev(self, device);
+    if (channel != NULL)
+        spice_usb_device_apply_iso_buffering(device, channel);
+#endif
+}
+
+/**
+ * spice_usb_device_stats_copy:
+ * @stats: a #SpiceUsbDeviceStats
+ *
+ * Returns: (transfer full): a copy of @stats, to be freed with
+ * spice_usb_device_stats_free()
+ * Since: 0.29
+ **/
+SpiceUsbDeviceStats *spice_usb_device_stats_copy(const SpiceUsbDeviceStats *stats)
+{
+    g_return_val_if_fail(stats != NULL, NULL);
+
+    return g_slice_dup(SpiceUsbDeviceStats, stats);
+}
+
+/**
+ * spice_usb_device_stats_free:
+ * @stats: a #SpiceUsbDeviceStats
+ *
+ * Free @stats.
+ *
+ * Since: 0.29
+ **/
+void spice_usb_device_stats_free(SpiceUsbDeviceStats *stats)
+{
+    g_slice_free(SpiceUsbDeviceStats, stats);
+}
+
 /**
  * spice_usb_device_manager_connect_device_async:
  * @manager: the #SpiceUsbDeviceManager manager
@@ -1440,6 +1720,7 @@ _spice_usb_device_manager_connect_device_async(SpiceUsbDeviceManager *self,
             goto done;
         }
 #endif
+        spice_usb_device_apply_iso_buffering(device, channel);
         spice_usbredir_channel_connect_device_async(channel,
                                  libdev,
                                  device,
@@ -1602,22 +1883,8 @@ spice_usb_device_manager_can_redirect_device(SpiceUsbDeviceManager  *self,
         &guest_filter_rules, &guest_filter_rules_count);
 
     if (guest_filter_rules) {
-        gboolean filter_ok;
-        libusb_device *libdev;
-
-        libdev = spice_usb_device_manager_device_to_libdev(self, device);
-#ifdef G_OS_WIN32
-        if (libdev == NULL) {
-            g_set_error_literal(err, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
-                                _("Some USB devices were not found"));
-            return FALSE;
-        }
-#endif
-        filter_ok = (usbredirhost_check_device_filter(
-                            guest_filter_rules, guest_filter_rules_count,
-                            libdev, 0) == 0);
-        libusb_unref_device(libdev);
-        if (!filter_ok) {
+        if (!spice_usb_device_check_filter(self, device, guest_filter_rules,
+                                           guest_filter_rules_count)) {
             g_set_error_literal(err, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
                                 _("Some USB devices are blocked by host policy"));
             return FALSE;
@@ -1709,27 +1976,95 @@ gchar *spice_usb_device_get_description(SpiceUsbDevice *device, const gchar *for
 /*
  * SpiceUsbDeviceInfo
  */
-static SpiceUsbDeviceInfo *spice_usb_device_new(libusb_device *libdev)
+
+/* the interfaces of the active configuration, as usbredirhost would read
+   them for each filter check */
+static void spice_usb_device_read_interfaces(SpiceUsbDeviceInfo *info,
+                                             libusb_device *libdev)
+{
+    struct libusb_config_descriptor *config = NULL;
+    int i, r, previous = info->config_result;
+
+    info->interface_count = 0;
+    r = libusb_get_active_config_descriptor(libdev, &config);
+    info->config_result = MIN(r, LIBUSB_SUCCESS);
+    if (r < 0) {
+        /* once, it is read again for each check */
+        if (r != LIBUSB_ERROR_NOT_FOUND && r != previous)
+            g_warning("cannot get config descriptor for %d.%d -- %s(%d)",
+                      info->busnum, info->devaddr,
+                      spice_usbutil_libusb_strerror(r), r);
+        return;
+    }
+
+    info->interface_count = MIN(config->bNumInterfaces, FILTER_MAX_INTERFACES);
+    for (i = 0; i < info->interface_count; i++) {
+        const struct libusb_interface_descriptor *intf_desc =
+            config->interface[i].altsetting;
+
+        info->interface_class[i] = intf_desc->bInterfaceClass;
+        info->interface_subclass[i] = intf_desc->bInterfaceSubClass;
+        info->interface_protocol[i] = intf_desc->bInterfaceProtocol;
+    }
+    libusb_free_config_descriptor(config);
+}
+
+/* usbredirhost_check_device_filter(), reading the descriptors only until
+   a configuration is found */
+static gboolean spice_usb_device_check_filter(SpiceUsbDeviceManager *self,
+                                              SpiceUsbDevice *device,
+                                              const struct usbredirfilter_rule *rules,
+                                              int rules_count)
+{
+    SpiceUsbDeviceInfo *info = (SpiceUsbDeviceInfo *)device;
+
+    g_return_val_if_fail(info != NULL, FALSE);
+
+    /* it may have been configured since, or the read may work now */
+    if (info->config_result != LIBUSB_SUCCESS) {
+        libusb_device *libdev = spice_usb_device_manager_device_to_libdev(self, device);
+
+        if (libdev != NULL) {
+            spice_usb_device_read_interfaces(info, libdev);
+            libusb_unref_device(libdev);
+        }
+    }
+
+    /* as usbredirhost does, an unconfigured device is checked with no
+       interface, and one that can't be read is denied */
+    if (info->config_result != LIBUSB_SUCCESS &&
+        info->config_result != LIBUSB_ERROR_NOT_FOUND)
+        return FALSE;
+
+    return usbredirfilter_check(rules, rules_count,
+                                info->class, info->subclass, info->protocol,
+                                info->interface_class, info->interface_subclass,
+                                info->interface_protocol, info->interface_count,
+                                info->vid, info->pid, info->bcd, 0) == 0;
+}
+static SpiceUsbDeviceInfo *spice_usb_device_new(libusb_device *libdev,
+                                                const struct libusb_device_descriptor *desc)
 {
     SpiceUsbDeviceInfo *info;
-    int vid, pid;
     guint8 bus, addr;
 
     g_return_val_if_fail(libdev != NULL, NULL);
+    g_return_val_if_fail(desc != NULL, NULL);
 
     bus = libusb_get_bus_number(libdev);
     addr = libusb_get_device_address(libdev);
 
-    if (!spice_usb_device_manager_get_libdev_vid_pid(libdev, &vid, &pid)) {
-        return NULL;
-    }
-
     info = g_new0(SpiceUsbDeviceInfo, 1);
 
     info->busnum  = bus;
     info->devaddr = addr;
-    info->vid = vid;
-    info->pid = pid;
+    info->vid = desc->idVendor;
+    info->pid = desc->idProduct;
+    info->class = desc->bDeviceClass;
+    info->subclass = desc->bDeviceSubClass;
+    info->protocol = desc->bDeviceProtocol;
+    info->bcd = desc->bcdDevice;
+    spice_usb_device_read_interfaces(info, libdev);
     info->ref = 1;
 #ifndef G_OS_WIN32
     info->libdev = libusb_ref_device(libdev);
@@ -1820,6 +2155,14 @@ static void spice_usb_device_unref(SpiceUsbDevice *device)
     }
 }
 
+static void spice_usb_device_apply_iso_buffering(SpiceUsbDevice *device,
+                                                 SpiceUsbredirChannel *channel)
+{
+    SpiceUsbDeviceInfo *info = (SpiceUsbDeviceInfo *)device;
+
+    spice_usbredir_channel_set_iso_buffering(channel, info->iso_buffer_ms, info->batch_size);
+}
+
 #ifndef G_OS_WIN32 /* Linux -- directly compare libdev */
 static gboolean
 spice_usb_device_equal_libdev(SpiceUsbDevice *device,
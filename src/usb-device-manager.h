@@ -85,6 +85,56 @@ struct _SpiceUsbDeviceManagerClass
     gchar _spice_reserved[SPICE_RESERVED_PADDING];
 };
 
+/**
+ * SpiceUsbDeviceStats:
+ * @bytes_to_device: bytes received from the guest for the device
+ * @bytes_from_device: bytes sent to the guest from the device
+ * @control_transfers: control transfers completed
+ * @bulk_transfers: bulk transfers completed
+ * @iso_packets: isochronous packets, either way
+ * @interrupt_packets: interrupt transfers completed
+ * @bulk_in_flight: bulk transfers requested by the guest and not
+ * completed yet
+ * @bulk_max_in_flight: highest number of bulk transfers in flight
+ * @bulk_latency_us: average time between the request of a bulk transfer
+ * by the guest and its completion, in µs
+ * @bulk_max_latency_us: highest bulk transfer latency, in µs
+ * @redirected_time_us: time since the device is redirected, in µs
+ * @iso_packets_dropped: isochronous packets from the device dropped
+ * rather than queued behind a slow link
+ * @iso_buffer_ms: how much the isochronous streams from the device may
+ * queue before they are dropped, in ms, 0 until they start; see
+ * spice_usb_device_manager_set_iso_buffering()
+ *
+ * Statistics of a redirected #SpiceUsbDevice, since it got redirected.
+ *
+ * The structure is allocated by the library, and more fields may be
+ * appended in future versions.
+ *
+ * Since: 0.29
+ */
+typedef struct _SpiceUsbDeviceStats SpiceUsbDeviceStats;
+struct _SpiceUsbDeviceStats {
+    guint64 bytes_to_device;
+    guint64 bytes_from_device;
+    guint64 control_transfers;
+    guint64 bulk_transfers;
+    guint64 iso_packets;
+    guint64 interrupt_packets;
+    guint   bulk_in_flight;
+    guint   bulk_max_in_flight;
+    guint64 bulk_latency_us;
+    guint64 bulk_max_latency_us;
+    guint64 redirected_time_us;
+    guint64 iso_packets_dropped;
+    guint   iso_buffer_ms;
+};
+
+#define SPICE_TYPE_USB_DEVICE_STATS (spice_usb_device_stats_get_type ())
+GType spice_usb_device_stats_get_type(void);
+SpiceUsbDeviceStats *spice_usb_device_stats_copy(const SpiceUsbDeviceStats *stats);
+void spice_usb_device_stats_free(SpiceUsbDeviceStats *stats);
+
 GType spice_usb_device_get_type(void);
 GType spice_usb_device_manager_get_type(void);
 
@@ -117,6 +167,14 @@ spice_usb_device_manager_can_redirect_device(SpiceUsbDeviceManager  *self,
                                              SpiceUsbDevice         *device,
                                              GError                **err);
 
+SpiceUsbDeviceStats *
+spice_usb_device_manager_get_device_stats(SpiceUsbDeviceManager *manager,
+                                          SpiceUsbDevice *device);
+void spice_usb_device_manager_set_iso_buffering(SpiceUsbDeviceManager *manager,
+                                                SpiceUsbDevice *device,
+                                                guint buffer_ms,
+                                                guint batch_size);
+
 G_END_DECLS
 
 #endif /* __SPICE_USB_DEVICE_MANAGER_H__ */
@@ -485,6 +485,52 @@ static void checkbox_usb_device_destroy_notify(gpointer data)
     g_boxed_free(spice_usb_device_get_type(), data);
 }
 
+/* the statistics of a redirected device, to triage a slow one */
+static gboolean checkbox_query_tooltip_cb(GtkWidget *check, gint x, gint y,
+                                          gboolean keyboard_mode,
+                                          GtkTooltip *tooltip, gpointer user_data)
+{
+    SpiceUsbDeviceWidget *self = SPICE_USB_DEVICE_WIDGET(user_data);
+    SpiceUsbDeviceWidgetPrivate *priv = self->priv;
+    SpiceUsbDeviceStats *stats;
+    SpiceUsbDevice *device;
+    gdouble elapsed;
+    gchar *text;
+
+    device = g_object_get_data(G_OBJECT(check), "usb-device");
+    stats = spice_usb_device_manager_get_device_stats(priv->manager, device);
+    if (stats == NULL)
+        return FALSE;
+
+    elapsed = MAX(stats->redirected_time_us, 1) / 1e6;
+    text = g_strdup_printf(_("To the device: %.1f MiB, %.1f KiB/s\n"
+                             "From the device: %.1f MiB, %.1f KiB/s\n"
+                             "Transfers: %" G_GUINT64_FORMAT " control, "
+                             "%" G_GUINT64_FORMAT " bulk, "
+                             "%" G_GUINT64_FORMAT " isochronous, "
+                             "%" G_GUINT64_FORMAT " interrupt\n"
+                             "Bulk transfers in flight: %u (at most %u)\n"
+                             "Bulk transfer latency: %.1f ms (at most %.1f ms)\n"
+                             "Isochronous packets dropped: %.1f%% (buffer %u ms)"),
+                           stats->bytes_to_device / (1024.0 * 1024.0),
+                           stats->bytes_to_device / elapsed / 1024,
+                           stats->bytes_from_device / (1024.0 * 1024.0),
+                           stats->bytes_from_device / elapsed / 1024,
+                           stats->control_transfers, stats->bulk_transfers,
+                           stats->iso_packets, stats->interrupt_packets,
+                           stats->bulk_in_flight, stats->bulk_max_in_flight,
+                           stats->bulk_latency_us / 1000.0,
+                           stats->bulk_max_latency_us / 1000.0,
+                           100.0 * stats->iso_packets_dropped /
+                           MAX(stats->iso_packets + stats->iso_packets_dropped, 1),
+                           stats->iso_buffer_ms);
+    gtk_tooltip_set_text(tooltip, text);
+    g_free(text);
+    spice_usb_device_stats_free(stats);
+
+    return TRUE;
+}
+
 static void device_added_cb(SpiceUsbDeviceManager *manager,
     SpiceUsbDevice *device, gpointer user_data)
 {
@@ -508,6 +554,9 @@ static void device_added_cb(SpiceUsbDeviceManager *manager,
             checkbox_usb_device_destroy_notify);
     g_signal_connect(G_OBJECT(check), "clicked",
                      G_CALLBACK(checkbox_clicked_cb), self);
+    gtk_widget_set_has_tooltip(check, TRUE);
+    g_signal_connect(G_OBJECT(check), "query-tooltip",
+                     G_CALLBACK(checkbox_query_tooltip_cb), self);
 
     align = gtk_alignment_new(0, 0, 0, 0);
     gtk_alignment_set_padding(GTK_ALIGNMENT(align), 0, 0, 12, 0);
@@ -21,10 +21,13 @@
 
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_USB
+
 #include <glib-object.h>
 #include <glib/gi18n.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "glib-compat.h"
 
@@ -38,24 +41,29 @@
 #include "usbutil.h"
 #include "spice-util-priv.h"
 
-#define VENDOR_NAME_LEN (122 - sizeof(void *))
-#define PRODUCT_NAME_LEN 126
-
+/*
+ * usb.ids is mapped, and indexed by sorted arrays of vendors and
+ * products, the names are offsets in the mapping
+ */
 typedef struct _usb_product_info {
     guint16 product_id;
-    char name[PRODUCT_NAME_LEN];
+    guint16 name_len;
+    guint32 name;
 } usb_product_info;
 
 typedef struct _usb_vendor_info {
-    usb_product_info *product_info;
-    int product_count;
     guint16 vendor_id;
-    char name[VENDOR_NAME_LEN];
+    guint16 name_len;
+    guint32 name;
+    guint32 product_first; /* in usbids_product_info */
+    guint32 product_count;
 } usb_vendor_info;
 
 static GStaticMutex usbids_load_mutex = G_STATIC_MUTEX_INIT;
 static int usbids_vendor_count = 0; /* < 0: failed, 0: empty, > 0: loaded */
 static usb_vendor_info *usbids_vendor_info = NULL;
+static usb_product_info *usbids_product_info = NULL;
+static GMappedFile *usbids_file = NULL;
 
 G_GNUC_INTERNAL
 const char *spice_usbutil_libusb_strerror(enum libusb_error error_code)
@@ -120,92 +128,129 @@ static gchar *spice_usbutil_get_sysfs_attribute(int bus, int address,
 }
 #endif
 
-static gboolean spice_usbutil_parse_usbids(gchar *path)
+/* the 4 digits id at *p, *p is left after the spaces that follow */
+static gboolean spice_usbutil_parse_id(const gchar **p, const gchar *eol,
+                                       guint16 *id)
 {
-    gchar *contents, *line, **lines;
-    usb_product_info *product_info;
-    int i, j, id, product_count = 0;
-
-    usbids_vendor_count = 0;
-    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
-        usbids_vendor_count = -1;
-        return FALSE;
+    const gchar *s = *p;
+    int i;
+
+    *id = 0;
+    for (i = 0; i < 4; i++, s++) {
+        if (s == eol || !isxdigit(*s))
+            return FALSE;
+        *id = *id << 4 | g_ascii_xdigit_value(*s);
     }
+    while (s < eol && isspace(*s))
+        s++;
+    *p = s;
 
-    lines = g_strsplit(contents, "\n", -1);
+    return TRUE;
+}
 
-    for (i = 0; lines[i]; i++) {
-        if (!isxdigit(lines[i][0]) || !isxdigit(lines[i][1]))
-            continue;
+static gint spice_usbutil_vendor_cmp(gconstpointer a, gconstpointer b)
+{
+    const usb_vendor_info *va = a, *vb = b;
 
-        for (j = 1; lines[i + j] &&
-                   (lines[i + j][0] == '\t' ||
-                    lines[i + j][0] == '#'  ||
-                    lines[i + j][0] == '\0'); j++) {
-            if (lines[i + j][0] == '\t' && isxdigit(lines[i + j][1]))
-                product_count++;
-        }
-        i += j - 1;
+    return (gint)va->vendor_id - (gint)vb->vendor_id;
+}
 
-        usbids_vendor_count++;
-    }
+static gint spice_usbutil_product_cmp(gconstpointer a, gconstpointer b)
+{
+    const usb_product_info *pa = a, *pb = b;
 
-    usbids_vendor_info = g_new(usb_vendor_info, usbids_vendor_count);
-    product_info = g_new(usb_product_info, product_count);
+    return (gint)pa->product_id - (gint)pb->product_id;
+}
+
+static gboolean spice_usbutil_parse_usbids(gchar *path)
+{
+    GMappedFile *file;
+    GArray *vendors, *products;
+    const gchar *contents, *end, *p;
+    usb_vendor_info *vendor = NULL;
+    guint i;
 
     usbids_vendor_count = 0;
-    for (i = 0; lines[i]; i++) {
-        line = lines[i];
+    file = g_mapped_file_new(path, FALSE, NULL);
+    if (!file) {
+        usbids_vendor_count = -1;
+        return FALSE;
+    }
 
-        if (!isxdigit(line[0]) || !isxdigit(line[1]))
-            continue;
+    contents = g_mapped_file_get_contents(file);
+    end = contents + g_mapped_file_get_length(file);
+    vendors = g_array_new(FALSE, FALSE, sizeof(usb_vendor_info));
+    products = g_array_new(FALSE, FALSE, sizeof(usb_product_info));
 
-        id = strtoul(line, &line, 16);
-        while (isspace(line[0]))
-            line++;
+    for (p = contents; p < end; ) {
+        const gchar *line = p, *eol;
+        guint16 id;
 
-        usbids_vendor_info[usbids_vendor_count].vendor_id = id;
-        snprintf(usbids_vendor_info[usbids_vendor_count].name,
-                 VENDOR_NAME_LEN, "%s", line);
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        p = eol + 1;
 
-        product_count = 0;
-        for (j = 1; lines[i + j] &&
-                   (lines[i + j][0] == '\t' ||
-                    lines[i + j][0] == '#'  ||
-                    lines[i + j][0] == '\0'); j++) {
-            line = lines[i + j];
+        if (line < eol && line[0] == '\t') {
+            usb_product_info product;
 
-            if (line[0] != '\t' || !isxdigit(line[1]))
+            /* the interfaces, two tabs in, are skipped */
+            line++;
+            if (!vendor || !spice_usbutil_parse_id(&line, eol, &id))
                 continue;
 
-            id = strtoul(line + 1, &line, 16);
-            while (isspace(line[0]))
-                line++;
-            product_info[product_count].product_id = id;
-            snprintf(product_info[product_count].name,
-                     PRODUCT_NAME_LEN, "%s", line);
-
-            product_count++;
+            product.product_id = id;
+            product.name = line - contents;
+            product.name_len = MIN(eol - line, G_MAXUINT16);
+            g_array_append_val(products, product);
+            vendor->product_count++;
+            continue;
         }
-        i += j - 1;
 
-        usbids_vendor_info[usbids_vendor_count].product_count = product_count;
-        usbids_vendor_info[usbids_vendor_count].product_info  = product_info;
-        product_info += product_count;
-        usbids_vendor_count++;
+        if (line == eol || line[0] == '#')
+            continue;
+
+        /* anything else ends the products of the vendor */
+        vendor = NULL;
+        if (eol - line < 2 || !isxdigit(line[0]) || !isxdigit(line[1]) ||
+            !spice_usbutil_parse_id(&line, eol, &id))
+            continue;
+
+        g_array_set_size(vendors, vendors->len + 1);
+        vendor = &g_array_index(vendors, usb_vendor_info, vendors->len - 1);
+        vendor->vendor_id = id;
+        vendor->name = line - contents;
+        vendor->name_len = MIN(eol - line, G_MAXUINT16);
+        vendor->product_first = products->len;
+        vendor->product_count = 0;
+    }
+
+    /* the file is sorted, this is in case it isn't */
+    g_array_sort(vendors, spice_usbutil_vendor_cmp);
+    for (i = 0; i < vendors->len; i++) {
+        vendor = &g_array_index(vendors, usb_vendor_info, i);
+        qsort(&g_array_index(products, usb_product_info, vendor->product_first),
+              vendor->product_count, sizeof(usb_product_info),
+              spice_usbutil_product_cmp);
     }
 
-    g_strfreev(lines);
-    g_free(contents);
+    usbids_vendor_count = vendors->len;
+    usbids_vendor_info = (usb_vendor_info *)g_array_free(vendors, FALSE);
+    usbids_product_info = (usb_product_info *)g_array_free(products, FALSE);
+    usbids_file = file;
 
 #if 0 /* Testing only */
     for (i = 0; i < usbids_vendor_count; i++) {
-        printf("%04x  %s\n", usbids_vendor_info[i].vendor_id,
-               usbids_vendor_info[i].name);
-        product_info = usbids_vendor_info[i].product_info;
-        for (j = 0; j < usbids_vendor_info[i].product_count; j++) {
-            printf("\t%04x  %s\n", product_info[j].product_id,
-                   product_info[j].name);
+        guint j;
+
+        vendor = &usbids_vendor_info[i];
+        printf("%04x  %.*s\n", vendor->vendor_id,
+               vendor->name_len, contents + vendor->name);
+        for (j = 0; j < vendor->product_count; j++) {
+            usb_product_info *product =
+                &usbids_product_info[vendor->product_first + j];
+            printf("\t%04x  %.*s\n", product->product_id,
+                   product->name_len, contents + product->name);
         }
     }
 #endif
@@ -253,9 +298,6 @@ void spice_usb_util_get_device_strings(int bus, int address,
                                        int vendor_id, int product_id,
                                        gchar **manufacturer, gchar **product)
 {
-    usb_product_info *product_info;
-    int i, j;
-
     g_return_if_fail(manufacturer != NULL);
     g_return_if_fail(product != NULL);
 
@@ -269,25 +311,23 @@ void spice_usb_util_get_device_strings(int bus, int address,
 
     if ((!*manufacturer || !*product) &&
         spice_usbutil_load_usbids()) {
-
-        for (i = 0; i < usbids_vendor_count; i++) {
-            if ((int)usbids_vendor_info[i].vendor_id != vendor_id)
-                continue;
-
-            if (!*manufacturer && usbids_vendor_info[i].name[0])
-                *manufacturer = g_strdup(usbids_vendor_info[i].name);
-
-            product_info = usbids_vendor_info[i].product_info;
-            for (j = 0; j < usbids_vendor_info[i].product_count; j++) {
-                if ((int)product_info[j].product_id != product_id)
-                    continue;
-
-                if (!*product && product_info[j].name[0])
-                    *product = g_strdup(product_info[j].name);
-
-                break;
-            }
-            break;
+        const gchar *contents = g_mapped_file_get_contents(usbids_file);
+        usb_vendor_info vkey = { .vendor_id = vendor_id };
+        usb_product_info pkey = { .product_id = product_id };
+        const usb_vendor_info *vendor;
+        const usb_product_info *info;
+
+        vendor = bsearch(&vkey, usbids_vendor_info, usbids_vendor_count,
+                         sizeof(usb_vendor_info), spice_usbutil_vendor_cmp);
+        if (vendor) {
+            if (!*manufacturer && vendor->name_len)
+                *manufacturer = g_strndup(contents + vendor->name, vendor->name_len);
+
+            info = bsearch(&pkey, usbids_product_info + vendor->product_first,
+                           vendor->product_count, sizeof(usb_product_info),
+                           spice_usbutil_product_cmp);
+            if (info && !*product && info->name_len)
+                *product = g_strndup(contents + info->name, info->name_len);
         }
     }
 
@@ -38,8 +38,16 @@ struct _SpiceVmcInputStream
 
     GCancellable *cancellable;
     gulong cancel_id;
+
+    /* the data messages not read yet */
+    GQueue queue; /* SpiceMsgIn */
+    gsize queue_offset; /* in the head message */
+    gsize queued;
 };
 
+/* the channel goes on until a slow reader is that far behind */
+#define VMC_INPUT_QUEUE_MAX (1024 * 1024)
+
 struct _SpiceVmcInputStreamClass
 {
     GInputStreamClass parent_class;
@@ -71,11 +79,25 @@ static gboolean spice_vmc_input_stream_close       (GInputStream        *stream,
 G_DEFINE_TYPE(SpiceVmcInputStream, spice_vmc_input_stream, G_TYPE_INPUT_STREAM)
 
 
+static void
+spice_vmc_input_stream_finalize(GObject *object)
+{
+    SpiceVmcInputStream *self = SPICE_VMC_INPUT_STREAM(object);
+
+    g_queue_foreach(&self->queue, (GFunc)spice_msg_in_unref, NULL);
+    g_queue_clear(&self->queue);
+
+    G_OBJECT_CLASS(spice_vmc_input_stream_parent_class)->finalize(object);
+}
+
 static void
 spice_vmc_input_stream_class_init(SpiceVmcInputStreamClass *klass)
 {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
     GInputStreamClass *istream_class;
 
+    object_class->finalize = spice_vmc_input_stream_finalize;
+
     istream_class = G_INPUT_STREAM_CLASS(klass);
     istream_class->read_fn = spice_vmc_input_stream_read;
     istream_class->read_async = spice_vmc_input_stream_read_async;
@@ -99,57 +121,88 @@ spice_vmc_input_stream_new(void)
     return self;
 }
 
+/* serves the pending read from the queue, in either context */
+static void
+spice_vmc_input_stream_serve(SpiceVmcInputStream *self)
+{
+    if (!self->result)
+        return;
+
+    while (self->pos < self->count && self->queued > 0) {
+        SpiceMsgIn *in = g_queue_peek_head(&self->queue);
+        int size;
+        guint8 *data = spice_msg_in_raw(in, &size);
+        gsize min = MIN(self->count - self->pos, (gsize)size - self->queue_offset);
+
+        memcpy(self->buffer + self->pos, data + self->queue_offset, min);
+        self->pos += min;
+        self->queue_offset += min;
+        self->queued -= min;
+        if (self->queue_offset == (gsize)size) {
+            spice_msg_in_unref(g_queue_pop_head(&self->queue));
+            self->queue_offset = 0;
+        }
+    }
+
+    if (self->pos == 0 || (self->all && self->pos != self->count))
+        return;
+
+    SPICE_DEBUG("spicevmc read complete: %" G_GSIZE_FORMAT
+                "/%" G_GSIZE_FORMAT, self->pos, self->count);
+
+    g_simple_async_result_set_op_res_gssize(self->result, self->pos);
+
+    g_simple_async_result_complete_in_idle(self->result);
+    g_clear_object(&self->result);
+    if (self->cancellable) {
+        g_cancellable_disconnect(self->cancellable, self->cancel_id);
+        g_clear_object(&self->cancellable);
+    }
+}
+
 /* coroutine */
 /**
- * Feed a SpiceVmc stream with new data from a coroutine
+ * Feed a SpiceVmc stream with a data message from a coroutine
  *
- * The other end will be waiting on read_async() until data is fed
- * here.
+ * The message is queued, with a reference, until it is read: the
+ * coroutine only waits for the reader when too much data is queued.
  */
 G_GNUC_INTERNAL void
 spice_vmc_input_stream_co_data(SpiceVmcInputStream *self,
-                               const gpointer d, gsize size)
+                               SpiceMsgIn *in)
 {
-    guint8 *data = d;
+    int size;
 
     g_return_if_fail(SPICE_IS_VMC_INPUT_STREAM(self));
     g_return_if_fail(self->coroutine == NULL);
 
-    self->coroutine = coroutine_self();
+    spice_msg_in_raw(in, &size);
+    if (size <= 0)
+        return;
 
-    while (size > 0) {
-        SPICE_DEBUG("spicevmc co_data %p", self->result);
-        if (!self->result)
-            coroutine_yield(NULL);
+    spice_msg_in_ref(in);
+    g_queue_push_tail(&self->queue, in);
+    self->queued += size;
 
-        g_return_if_fail(self->result != NULL);
-
-        gsize min = MIN(self->count, size);
-        memcpy(self->buffer, data, min);
-
-        size -= min;
-        data += min;
-
-        SPICE_DEBUG("spicevmc co_data complete: %" G_GSIZE_FORMAT
-                    "/%" G_GSIZE_FORMAT, min, self->count);
-
-        self->pos += min;
-        self->buffer += min;
+    SPICE_DEBUG("spicevmc co_data %p, %" G_GSIZE_FORMAT " queued",
+                self->result, self->queued);
+    spice_vmc_input_stream_serve(self);
 
-        if (self->all && min > 0 && self->pos != self->count)
-            continue;
-
-        g_simple_async_result_set_op_res_gssize(self->result, self->pos);
-
-        g_simple_async_result_complete_in_idle(self->result);
-        g_clear_object(&self->result);
-        if (self->cancellable) {
-            g_cancellable_disconnect(self->cancellable, self->cancel_id);
-            g_clear_object(&self->cancellable);
-        }
+    while (self->queued > VMC_INPUT_QUEUE_MAX) {
+        self->coroutine = coroutine_self();
+        coroutine_yield(NULL);
+        self->coroutine = NULL;
     }
+}
+
+/* main context */
+static void
+spice_vmc_input_stream_start_read(SpiceVmcInputStream *self)
+{
+    spice_vmc_input_stream_serve(self);
 
-    self->coroutine = NULL;
+    if (self->coroutine && self->queued <= VMC_INPUT_QUEUE_MAX)
+        coroutine_yieldto(self->coroutine, NULL);
 }
 
 static void
@@ -202,8 +255,7 @@ spice_vmc_input_stream_read_all_async(GInputStream        *stream,
         self->cancel_id =
             g_cancellable_connect(cancellable, G_CALLBACK(read_cancelled), self, NULL);
 
-    if (self->coroutine)
-        coroutine_yieldto(self->coroutine, NULL);
+    spice_vmc_input_stream_start_read(self);
 }
 
 G_GNUC_INTERNAL gssize
@@ -263,8 +315,7 @@ spice_vmc_input_stream_read_async(GInputStream        *stream,
         self->cancel_id =
             g_cancellable_connect(cancellable, G_CALLBACK(read_cancelled), self, NULL);
 
-    if (self->coroutine)
-        coroutine_yieldto(self->coroutine, NULL);
+    spice_vmc_input_stream_start_read(self);
 }
 
 static gssize
@@ -21,6 +21,7 @@
 #include <gio/gio.h>
 
 #include "spice-types.h"
+#include "spice-channel.h"
 
 G_BEGIN_DECLS
 
@@ -36,8 +37,7 @@ typedef struct _SpiceVmcInputStream          SpiceVmcInputStream;
 
 GType          spice_vmc_input_stream_get_type   (void) G_GNUC_CONST;
 void           spice_vmc_input_stream_co_data    (SpiceVmcInputStream *input,
-                                                  const gpointer data,
-                                                  gsize size);
+                                                  SpiceMsgIn *in);
 
 void           spice_vmc_input_stream_read_all_async(GInputStream        *stream,
                                                      void                *buffer,
@@ -22,11 +22,14 @@
 
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_USB
+
 #include <windows.h>
+#include <dbt.h>
 #include <libusb.h>
 #include "win-usb-dev.h"
 #include "spice-marshal.h"
-#include "spice-util.h"
+#include "spice-util-priv.h"
 #include "usbutil.h"
 
 #define G_UDEV_CLIENT_GET_PRIVATE(obj) \
@@ -37,9 +40,18 @@ struct _GUdevClientPrivate {
     gssize udev_list_size;
     GList *udev_list;
     HWND hwnd;
+    HDEVNOTIFY notify; /* of the USB device interfaces */
+    guint rescan_id;
 };
 
 #define G_UDEV_CLIENT_WINCLASS_NAME  TEXT("G_UDEV_CLIENT")
+/* a dock brings a burst of arrivals, they are listed once */
+#define G_UDEV_CLIENT_RESCAN_DELAY_MS 200
+
+/* GUID_DEVINTERFACE_USB_DEVICE, without linking the ddk uuid library */
+static const GUID usb_device_interface = {
+    0xA5DCBF10, 0x6530, 0x11D2, { 0x90, 0x1F, 0x00, 0xC0, 0x4F, 0xB9, 0x51, 0xED }
+};
 
 static void g_udev_client_initable_iface_init(GInitableIface  *iface);
 
@@ -178,6 +190,7 @@ g_udev_client_initable_init(GInitable *initable, GCancellable *cancellable,
     GUdevClient *self;
     GUdevClientPrivate *priv;
     WNDCLASS wcls;
+    DEV_BROADCAST_DEVICEINTERFACE filter;
     int rc;
 
     g_return_val_if_fail(G_UDEV_IS_CLIENT(initable), FALSE);
@@ -225,6 +238,18 @@ g_udev_client_initable_init(GInitable *initable, GCancellable *cancellable,
         goto g_udev_client_init_failed_unreg;
     }
 
+    /* the arrivals and removals of USB devices, with their path, rather
+     * than only DBT_DEVNODES_CHANGED for any device node */
+    memset(&filter, 0, sizeof(filter));
+    filter.dbcc_size = sizeof(filter);
+    filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+    filter.dbcc_classguid = usb_device_interface;
+    priv->notify = RegisterDeviceNotification(priv->hwnd, &filter,
+                                              DEVICE_NOTIFY_WINDOW_HANDLE);
+    if (!priv->notify)
+        g_warning("RegisterDeviceNotification failed: %ld, rescanning on any change",
+                  (long)GetLastError());
+
     return TRUE;
 
  g_udev_client_init_failed_unreg:
@@ -259,6 +284,10 @@ static void g_udev_client_finalize(GObject *gobject)
     GUdevClientPrivate *priv = self->priv;
 
     singleton = NULL;
+    if (priv->rescan_id)
+        g_source_remove(priv->rescan_id);
+    if (priv->notify)
+        UnregisterDeviceNotification(priv->notify);
     DestroyWindow(priv->hwnd);
     UnregisterClass(G_UDEV_CLIENT_WINCLASS_NAME, NULL);
     g_udev_client_free_device_list(&priv->udev_list);
@@ -335,86 +364,179 @@ static gboolean gudev_devices_are_equal(GUdevDevice *a, GUdevDevice *b)
 }
 
 
-/* Assumes each event stands for a single device change (at most) */
+/* the devices of @a that are not in @b, each device of @b matching one
+ * of @a at most */
+static GList *gudev_devices_diff(GList *a, GList *b)
+{
+    GList *ait, *bit, *left, *diff = NULL;
+
+    left = g_list_copy(b);
+    for (ait = a; ait != NULL; ait = g_list_next(ait)) {
+        for (bit = left; bit != NULL; bit = g_list_next(bit)) {
+            if (gudev_devices_are_equal(ait->data, bit->data))
+                break;
+        }
+        if (bit != NULL)
+            left = g_list_delete_link(left, bit);
+        else
+            diff = g_list_prepend(diff, ait->data);
+    }
+    g_list_free(left);
+
+    return g_list_reverse(diff);
+}
+
 static void handle_dev_change(GUdevClient *self)
 {
     GUdevClientPrivate *priv = self->priv;
-    GUdevDevice *changed_dev = NULL;
     ssize_t dev_count;
-    int is_dev_change;
     GError *err = NULL;
     GList *now_devs = NULL;
-    GList *llist, *slist; /* long-list and short-list*/
-    GList *lit, *sit; /* iterators for long-list and short-list */
-    GUdevDevice *ldev, *sdev; /* devices on long-list and short-list */
+    GList *added, *removed, *it;
 
     dev_count = g_udev_client_list_devices(self, &now_devs, &err,
                                            __FUNCTION__);
-    g_return_if_fail(dev_count >= 0);
+    if (dev_count < 0) {
+        g_clear_error(&err);
+        return;
+    }
 
     SPICE_DEBUG("number of current devices %"G_GSSIZE_FORMAT
                 ", I know about %"G_GSSIZE_FORMAT" devices",
                 dev_count, priv->udev_list_size);
 
-    is_dev_change = dev_count - priv->udev_list_size;
-    if (is_dev_change == 0) {
-        g_udev_client_free_device_list(&now_devs);
-        return;
-    }
+    g_udev_device_print_list(now_devs, "handle_dev_change: now:");
+    g_udev_device_print_list(priv->udev_list, "handle_dev_change: before:");
 
-    if (is_dev_change > 0) {
-        llist  = now_devs;
-        slist = priv->udev_list;
-    } else {
-        llist = priv->udev_list;
-        slist  = now_devs;
-    }
-
-    g_udev_device_print_list(llist, "handle_dev_change: long list:");
-    g_udev_device_print_list(slist, "handle_dev_change: short list:");
-
-    /* Go over the longer list */
-    for (lit = g_list_first(llist); lit != NULL; lit=g_list_next(lit)) {
-        ldev = lit->data;
-        /* Look for dev in the shorther list */
-        for (sit = g_list_first(slist); sit != NULL; sit=g_list_next(sit)) {
-            sdev = sit->data;
-            if (gudev_devices_are_equal(ldev, sdev))
-                break;
-        }
-        if (sit == NULL) {
-            /* Found a device which appears only in the longer list */
-            changed_dev = ldev;
-            break;
-        }
-    }
+    /* any number of changes, since the last list */
+    removed = gudev_devices_diff(priv->udev_list, now_devs);
+    added = gudev_devices_diff(now_devs, priv->udev_list);
 
-    if (!changed_dev) {
-        g_warning("couldn't find any device change");
-        goto leave;
+    for (it = removed; it != NULL; it = g_list_next(it)) {
+        g_udev_device_print(it->data, "<<< USB device removed");
+        g_signal_emit(self, signals[UEVENT_SIGNAL], 0, "remove", it->data);
     }
-
-    if (is_dev_change > 0) {
-        g_udev_device_print(changed_dev, ">>> USB device inserted");
-        g_signal_emit(self, signals[UEVENT_SIGNAL], 0, "add", changed_dev);
-    } else {
-        g_udev_device_print(changed_dev, "<<< USB device removed");
-        g_signal_emit(self, signals[UEVENT_SIGNAL], 0, "remove", changed_dev);
+    for (it = added; it != NULL; it = g_list_next(it)) {
+        g_udev_device_print(it->data, ">>> USB device inserted");
+        g_signal_emit(self, signals[UEVENT_SIGNAL], 0, "add", it->data);
     }
+    g_list_free(removed);
+    g_list_free(added);
 
-leave:
     /* keep most recent info: free previous list, and keep current list */
     g_udev_client_free_device_list(&priv->udev_list);
     priv->udev_list = now_devs;
     priv->udev_list_size = dev_count;
 }
 
+static gboolean rescan_cb(gpointer user_data)
+{
+    GUdevClient *self = user_data;
+
+    self->priv->rescan_id = 0;
+    handle_dev_change(self);
+
+    return FALSE;
+}
+
+static void schedule_rescan(GUdevClient *self)
+{
+    GUdevClientPrivate *priv = self->priv;
+
+    if (priv->rescan_id == 0)
+        priv->rescan_id = g_timeout_add(G_UDEV_CLIENT_RESCAN_DELAY_MS, rescan_cb, self);
+}
+
+/* "\\?\USB#VID_046D&PID_C52B#..." */
+static gboolean parse_device_path(const DEV_BROADCAST_DEVICEINTERFACE *iface,
+                                  guint16 *vid, guint16 *pid)
+{
+    gchar *path, *p;
+    unsigned int v, d;
+    gboolean ret = FALSE;
+
+#ifdef UNICODE
+    path = g_utf16_to_utf8((const gunichar2 *)iface->dbcc_name, -1, NULL, NULL, NULL);
+#else
+    path = g_strdup(iface->dbcc_name);
+#endif
+    if (path == NULL)
+        return FALSE;
+
+    p = g_ascii_strup(path, -1);
+    g_free(path);
+    path = strstr(p, "VID_");
+    if (path && sscanf(path, "VID_%4x&PID_%4x", &v, &d) == 2) {
+        *vid = v;
+        *pid = d;
+        ret = TRUE;
+    }
+    g_free(p);
+
+    return ret;
+}
+
+/* the device is known without listing them all, unless it is ambiguous */
+static gboolean handle_dev_removal(GUdevClient *self,
+                                   const DEV_BROADCAST_DEVICEINTERFACE *iface)
+{
+    GUdevClientPrivate *priv = self->priv;
+    GList *it, *found = NULL;
+    GUdevDeviceInfo *info;
+    GUdevDevice *udev;
+    guint16 vid, pid;
+
+    if (!parse_device_path(iface, &vid, &pid))
+        return FALSE;
+
+    for (it = priv->udev_list; it != NULL; it = g_list_next(it)) {
+        info = G_UDEV_DEVICE(it->data)->priv->udevinfo;
+        if (info->vid != vid || info->pid != pid)
+            continue;
+        if (found != NULL)
+            return FALSE;
+        found = it;
+    }
+    if (found == NULL)
+        return FALSE;
+
+    udev = found->data;
+    priv->udev_list = g_list_delete_link(priv->udev_list, found);
+    priv->udev_list_size--;
+    g_udev_device_print(udev, "<<< USB device removed");
+    g_signal_emit(self, signals[UEVENT_SIGNAL], 0, "remove", udev);
+    g_object_unref(udev);
+
+    return TRUE;
+}
+
 static LRESULT CALLBACK wnd_proc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam)
 {
-    /* Only DBT_DEVNODES_CHANGED recieved */
-    if (message == WM_DEVICECHANGE) {
-        handle_dev_change(singleton);
+    DEV_BROADCAST_HDR *hdr = (DEV_BROADCAST_HDR *)lparam;
+
+    if (message != WM_DEVICECHANGE || singleton == NULL)
+        return DefWindowProc(hwnd, message, wparam, lparam);
+
+    switch (wparam) {
+    case DBT_DEVICEREMOVECOMPLETE:
+        if (hdr && hdr->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE &&
+            handle_dev_removal(singleton, (DEV_BROADCAST_DEVICEINTERFACE *)hdr))
+            break;
+        schedule_rescan(singleton);
+        break;
+    case DBT_DEVICEARRIVAL:
+        /* the bus and address are only known to libusb */
+        schedule_rescan(singleton);
+        break;
+    case DBT_DEVNODES_CHANGED:
+        /* the interface notifications tell the USB changes */
+        if (!singleton->priv->notify)
+            schedule_rescan(singleton);
+        break;
+    default:
+        break;
     }
+
     return DefWindowProc(hwnd, message, wparam, lparam);
 }
 
@@ -27,11 +27,13 @@
 
 #include "config.h"
 
+#define SPICE_DEBUG_FILE_CATEGORY SPICE_DEBUG_USB
+
 #include <windows.h>
 #include <gio/gio.h>
 #include <gio/gwin32inputstream.h>
 #include <gio/gwin32outputstream.h>
-#include "spice-util.h"
+#include "spice-util-priv.h"
 #include "win-usb-clerk.h"
 #include "win-usb-driver-install.h"
 #include "usb-device-manager-priv.h"
@@ -42,14 +44,22 @@
 #define SPICE_WIN_USB_DRIVER_GET_PRIVATE(obj)     \
     (G_TYPE_INSTANCE_GET_PRIVATE ((obj), SPICE_TYPE_WIN_USB_DRIVER, SpiceWinUsbDriverPrivate))
 
-struct _SpiceWinUsbDriverPrivate {
-    USBClerkReply         reply;
+/* the requests go through usbclerk one after the other */
+typedef struct _DriverOp {
     GSimpleAsyncResult    *result;
     GCancellable          *cancellable;
-    HANDLE                handle;
     SpiceUsbDevice        *device;
+    USBClerkDriverOp      req;
+} DriverOp;
+
+struct _SpiceWinUsbDriverPrivate {
+    USBClerkReply         reply;
+    GQueue                ops; /* DriverOp, the first one in progress */
+    HANDLE                handle;
 };
 
+static void spice_win_usb_driver_start_op(SpiceWinUsbDriver *self);
+
 
 static void spice_win_usb_driver_initable_iface_init(GInitableIface *iface);
 
@@ -91,11 +101,17 @@ static void spice_win_usb_driver_finalize(GObject *gobject)
 {
     SpiceWinUsbDriver *self = SPICE_WIN_USB_DRIVER(gobject);
     SpiceWinUsbDriverPrivate *priv = self->priv;
+    DriverOp *op;
 
     if (priv->handle)
         CloseHandle(priv->handle);
 
-    g_clear_object(&priv->result);
+    /* each of them holds a reference, none can be left */
+    while ((op = g_queue_pop_head(&priv->ops)) != NULL) {
+        g_warn_if_reached();
+        g_object_unref(op->result);
+        g_free(op);
+    }
 
     if (G_OBJECT_CLASS(spice_win_usb_driver_parent_class)->finalize)
         G_OBJECT_CLASS(spice_win_usb_driver_parent_class)->finalize(gobject);
@@ -118,12 +134,32 @@ static void spice_win_usb_driver_initable_iface_init(GInitableIface *iface)
 /* ------------------------------------------------------------------ */
 /* callbacks                                                          */
 
+/* completes the current request, and goes on with the next one */
+static void spice_win_usb_driver_op_done(SpiceWinUsbDriver *self)
+{
+    SpiceWinUsbDriverPrivate *priv = self->priv;
+    DriverOp *op = g_queue_pop_head(&priv->ops);
+
+    g_return_if_fail(op != NULL);
+
+    g_simple_async_result_complete_in_idle(op->result);
+    g_object_unref(op->result);
+    g_free(op);
+
+    if (!g_queue_is_empty(&priv->ops))
+        spice_win_usb_driver_start_op(self);
+
+    /* the reference of the request */
+    g_object_unref(self);
+}
+
 void win_usb_driver_handle_reply_cb(GObject *gobject,
                                     GAsyncResult *read_res,
                                     gpointer user_data)
 {
     SpiceWinUsbDriver *self;
     SpiceWinUsbDriverPrivate *priv;
+    GSimpleAsyncResult *result;
 
     GInputStream *istream;
     GError *err = NULL;
@@ -133,6 +169,7 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
     self = SPICE_WIN_USB_DRIVER(user_data);
     priv = self->priv;
     istream = G_INPUT_STREAM(gobject);
+    result = ((DriverOp *)g_queue_peek_head(&priv->ops))->result;
 
     bytes = g_input_stream_read_finish(istream, read_res, &err);
 
@@ -144,13 +181,13 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
 
     if (err) {
         g_warning("failed to read reply from usbclerk (%s)", err->message);
-        g_simple_async_result_take_error(priv->result, err);
+        g_simple_async_result_take_error(result, err);
         goto failed_reply;
     }
 
     if (bytes == 0) {
         g_warning("unexpected EOF from usbclerk");
-        g_simple_async_result_set_error(priv->result,
+        g_simple_async_result_set_error(result,
                                         SPICE_WIN_USB_DRIVER_ERROR,
                                         SPICE_WIN_USB_DRIVER_ERROR_FAILED,
                                         "unexpected EOF from usbclerk");
@@ -167,7 +204,7 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
     if (priv->reply.hdr.magic != USB_CLERK_MAGIC) {
         g_warning("usbclerk magic mismatch: mine=0x%04x  server=0x%04x",
                   USB_CLERK_MAGIC, priv->reply.hdr.magic);
-        g_simple_async_result_set_error(priv->result,
+        g_simple_async_result_set_error(result,
                                         SPICE_WIN_USB_DRIVER_ERROR,
                                         SPICE_WIN_USB_DRIVER_ERROR_MESSAGE,
                                         "usbclerk magic mismatch");
@@ -177,7 +214,7 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
     if (priv->reply.hdr.version != USB_CLERK_VERSION) {
         g_warning("usbclerk version mismatch: mine=0x%04x  server=0x%04x",
                   USB_CLERK_VERSION, priv->reply.hdr.version);
-        g_simple_async_result_set_error(priv->result,
+        g_simple_async_result_set_error(result,
                                         SPICE_WIN_USB_DRIVER_ERROR,
                                         SPICE_WIN_USB_DRIVER_ERROR_MESSAGE,
                                         "usbclerk version mismatch");
@@ -186,7 +223,7 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
     if (priv->reply.hdr.type != USB_CLERK_REPLY) {
         g_warning("usbclerk message with unexpected type %d",
                   priv->reply.hdr.type);
-        g_simple_async_result_set_error(priv->result,
+        g_simple_async_result_set_error(result,
                                         SPICE_WIN_USB_DRIVER_ERROR,
                                         SPICE_WIN_USB_DRIVER_ERROR_MESSAGE,
                                         "usbclerk message with unexpected type");
@@ -196,7 +233,7 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
     if (priv->reply.hdr.size != bytes) {
         g_warning("usbclerk message size mismatch: read %"G_GSSIZE_FORMAT" bytes  hdr.size=%d",
                   bytes, priv->reply.hdr.size);
-        g_simple_async_result_set_error(priv->result,
+        g_simple_async_result_set_error(result,
                                         SPICE_WIN_USB_DRIVER_ERROR,
                                         SPICE_WIN_USB_DRIVER_ERROR_MESSAGE,
                                         "usbclerk message with unexpected size");
@@ -204,7 +241,7 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
     }
 
     if (priv->reply.status == 0) {
-        g_simple_async_result_set_error(priv->result,
+        g_simple_async_result_set_error(result,
                                         SPICE_WIN_USB_DRIVER_ERROR,
                                         SPICE_WIN_USB_DRIVER_ERROR_MESSAGE,
                                         "usbclerk error reply");
@@ -212,66 +249,77 @@ void win_usb_driver_handle_reply_cb(GObject *gobject,
     }
 
  failed_reply:
-    g_simple_async_result_complete_in_idle(priv->result);
-    g_clear_object(&priv->result);
+    spice_win_usb_driver_op_done(self);
 }
 
 /* ------------------------------------------------------------------ */
 /* helper functions                                                   */
 
-static
-gboolean spice_win_usb_driver_send_request(SpiceWinUsbDriver *self, guint16 op,
-                                           guint16 vid, guint16 pid, GError **err)
-{
-    USBClerkDriverOp req;
-    GOutputStream *ostream;
-    SpiceWinUsbDriverPrivate *priv;
-    gsize bytes;
-    gboolean ret;
-
-    SPICE_DEBUG("sending a request to usbclerk service (op=%d vid=0x%04x pid=0x%04x",
-                op, vid, pid);
-
-    g_return_val_if_fail(SPICE_IS_WIN_USB_DRIVER(self), FALSE);
-    priv = self->priv;
-
-    memset(&req, 0, sizeof(req));
-    req.hdr.magic   = USB_CLERK_MAGIC;
-    req.hdr.version = USB_CLERK_VERSION;
-    req.hdr.type    = op;
-    req.hdr.size    = sizeof(req);
-    req.vid = vid;
-    req.pid = pid;
-
-    ostream = g_win32_output_stream_new(priv->handle, FALSE);
-
-    ret = g_output_stream_write_all(ostream, &req, sizeof(req), &bytes, NULL, err);
-    g_warn_if_fail(g_output_stream_close(ostream, NULL, NULL));
-    g_object_unref(ostream);
-    SPICE_DEBUG("write_all request returned %d written bytes %"G_GSIZE_FORMAT
-                " expecting %"G_GSIZE_FORMAT,
-                ret, bytes, sizeof(req));
-    return ret;
-}
-
 static
 void spice_win_usb_driver_read_reply_async(SpiceWinUsbDriver *self)
 {
     SpiceWinUsbDriverPrivate *priv;
     GInputStream  *istream;
+    DriverOp *op;
 
     g_return_if_fail(SPICE_IS_WIN_USB_DRIVER(self));
     priv = self->priv;
+    op = g_queue_peek_head(&priv->ops);
 
     SPICE_DEBUG("waiting for a reply from usbclerk");
 
     istream = g_win32_input_stream_new(priv->handle, FALSE);
 
     g_input_stream_read_async(istream, &priv->reply, sizeof(priv->reply),
-                              G_PRIORITY_DEFAULT, priv->cancellable,
+                              G_PRIORITY_DEFAULT, op->cancellable,
                               win_usb_driver_handle_reply_cb, self);
 }
 
+static void win_usb_driver_request_written_cb(GObject *gobject,
+                                              GAsyncResult *res,
+                                              gpointer user_data)
+{
+    SpiceWinUsbDriver *self = SPICE_WIN_USB_DRIVER(user_data);
+    GOutputStream *ostream = G_OUTPUT_STREAM(gobject);
+    DriverOp *op = g_queue_peek_head(&self->priv->ops);
+    GError *err = NULL;
+    gssize bytes;
+
+    bytes = g_output_stream_write_finish(ostream, res, &err);
+    g_warn_if_fail(g_output_stream_close(ostream, NULL, NULL));
+    g_object_unref(ostream);
+    SPICE_DEBUG("write request returned %"G_GSSIZE_FORMAT" bytes, expecting %"G_GSIZE_FORMAT,
+                bytes, sizeof(op->req));
+
+    if (err == NULL && bytes != sizeof(op->req))
+        g_set_error(&err, SPICE_WIN_USB_DRIVER_ERROR, SPICE_WIN_USB_DRIVER_ERROR_FAILED,
+                    "short write to usbclerk");
+    if (err) {
+        g_warning("failed to send a request to usbclerk %s", err->message);
+        g_simple_async_result_take_error(op->result, err);
+        spice_win_usb_driver_op_done(self);
+        return;
+    }
+
+    spice_win_usb_driver_read_reply_async(self);
+}
+
+/* sends the first request of the queue */
+static void spice_win_usb_driver_start_op(SpiceWinUsbDriver *self)
+{
+    SpiceWinUsbDriverPrivate *priv = self->priv;
+    DriverOp *op = g_queue_peek_head(&priv->ops);
+    GOutputStream *ostream;
+
+    SPICE_DEBUG("sending a request to usbclerk service (op=%d vid=0x%04x pid=0x%04x",
+                op->req.hdr.type, op->req.vid, op->req.pid);
+
+    ostream = g_win32_output_stream_new(priv->handle, FALSE);
+    g_output_stream_write_async(ostream, &op->req, sizeof(op->req),
+                                G_PRIORITY_DEFAULT, op->cancellable,
+                                win_usb_driver_request_written_cb, self);
+}
+
 
 /* ------------------------------------------------------------------ */
 /* private api                                                        */
@@ -297,50 +345,34 @@ void spice_win_usb_driver_op(SpiceWinUsbDriver *self,
                              GAsyncReadyCallback callback,
                              gpointer user_data)
 {
-    guint16 vid, pid;
-    GError *err = NULL;
-    GSimpleAsyncResult *result;
     SpiceWinUsbDriverPrivate *priv;
+    DriverOp *op;
 
     g_return_if_fail(SPICE_IS_WIN_USB_DRIVER(self));
     g_return_if_fail(device != NULL);
 
     priv = self->priv;
 
-    result = g_simple_async_result_new(G_OBJECT(self), callback, user_data,
-                                       spice_win_usb_driver_op);
-
-    if (priv->result) { /* allow one install/uninstall request at a time */
-        g_warning("Another request exists -- try later");
-        g_simple_async_result_set_error(result,
-                  SPICE_WIN_USB_DRIVER_ERROR, SPICE_WIN_USB_DRIVER_ERROR_FAILED,
-                  "Another request exists -- try later");
-        goto failed_request;
-    }
-
-
-    vid = spice_usb_device_get_vid(device);
-    pid = spice_usb_device_get_pid(device);
-
-    if (!spice_win_usb_driver_send_request(self, op_type,
-                                           vid, pid, &err)) {
-        g_warning("failed to send a request to usbclerk %s", err->message);
-        g_simple_async_result_take_error(result, err);
-        goto failed_request;
-    }
-
-    /* set up for async read */
-    priv->result = result;
-    priv->device = device;
-    priv->cancellable = cancellable;
-
-    spice_win_usb_driver_read_reply_async(self);
-
-    return;
-
- failed_request:
-    g_simple_async_result_complete_in_idle(result);
-    g_clear_object(&result);
+    op = g_new0(DriverOp, 1);
+    op->result = g_simple_async_result_new(G_OBJECT(self), callback, user_data,
+                                           spice_win_usb_driver_op);
+    op->cancellable = cancellable;
+    op->device = device;
+    op->req.hdr.magic   = USB_CLERK_MAGIC;
+    op->req.hdr.version = USB_CLERK_VERSION;
+    op->req.hdr.type    = op_type;
+    op->req.hdr.size    = sizeof(op->req);
+    op->req.vid = spice_usb_device_get_vid(device);
+    op->req.pid = spice_usb_device_get_pid(device);
+
+    /* a request does not wait for the previous ones to be asked, it
+     * is sent as soon as usbclerk answered them */
+    g_object_ref(self);
+    g_queue_push_tail(&priv->ops, op);
+    if (g_queue_get_length(&priv->ops) == 1)
+        spice_win_usb_driver_start_op(self);
+    else
+        SPICE_DEBUG("usbclerk busy, %u requests queued", g_queue_get_length(&priv->ops) - 1);
 }
 
 /**
@@ -367,7 +399,7 @@ spice_win_usb_driver_op_finish(SpiceWinUsbDriver *self,
  * spice_win_usb_driver_install_async:
  * Start libusb driver installation for @device
  *
- * A new NamedPipe is created for each request.
+ * The requests made while another one is in progress are queued.
  *
  * Returns: TRUE if a request was sent to usbclerk
  *          FALSE upon failure to send a request.
@@ -415,9 +447,12 @@ gboolean spice_win_usb_driver_uninstall_finish(SpiceWinUsbDriver *self,
 G_GNUC_INTERNAL
 SpiceUsbDevice *spice_win_usb_driver_get_device(SpiceWinUsbDriver *self)
 {
+    DriverOp *op;
+
     g_return_val_if_fail(SPICE_IS_WIN_USB_DRIVER(self), 0);
 
-    return self->priv->device;
+    op = g_queue_peek_head(&self->priv->ops);
+    return op ? op->device : NULL;
 }
 
 GQuark spice_win_usb_driver_error_quark(void)
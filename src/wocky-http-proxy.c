@@ -49,7 +49,9 @@ G_DEFINE_TYPE_WITH_CODE (WockyHttpProxy, wocky_http_proxy, G_TYPE_OBJECT,
     g_io_extension_point_register (G_PROXY_EXTENSION_POINT_NAME),
     G_TYPE_PROXY);
   g_io_extension_point_implement (G_PROXY_EXTENSION_POINT_NAME,
-    g_define_type_id, "http", 0))
+    g_define_type_id, "http", 0);
+  g_io_extension_point_implement (G_PROXY_EXTENSION_POINT_NAME,
+    g_define_type_id, "http" WOCKY_HTTP_PROXY_PIPELINED_SUFFIX, 0))
 
 static void
 wocky_http_proxy_init (WockyHttpProxy *proxy)
@@ -174,6 +176,336 @@ check_reply (const gchar *buffer, gboolean has_cred, GError **error)
   return TRUE;
 }
 
+static gboolean
+is_pipelined (GProxyAddress *proxy_address)
+{
+  const gchar *protocol = g_proxy_address_get_protocol (proxy_address);
+
+  return g_str_has_suffix (protocol, WOCKY_HTTP_PROXY_PIPELINED_SUFFIX);
+}
+
+/*
+ * With the pipelined protocols, the stream is returned as soon as the
+ * CONNECT request is sent, so that the first data of the caller follows
+ * it without waiting a round-trip for the reply. The reply is then read
+ * and checked by the input stream, before the data from the destination.
+ */
+#define MAX_REPLY_SIZE 4096
+
+typedef struct
+{
+  GFilterInputStream parent;
+
+  gboolean has_cred;
+  gboolean checked;
+  GError *error;          /* the reply was rejected */
+  GByteArray *buffer;     /* the reply, and the data read after it */
+  guint offset;           /* of the data left in buffer */
+} WockyHttpReplyInputStream;
+
+typedef struct
+{
+  GFilterInputStreamClass parent_class;
+} WockyHttpReplyInputStreamClass;
+
+static void wocky_http_reply_input_stream_pollable_iface_init (
+    GPollableInputStreamInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (WockyHttpReplyInputStream,
+  wocky_http_reply_input_stream, G_TYPE_FILTER_INPUT_STREAM,
+  G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_INPUT_STREAM,
+    wocky_http_reply_input_stream_pollable_iface_init))
+
+#define WOCKY_HTTP_REPLY_INPUT_STREAM(o) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((o), wocky_http_reply_input_stream_get_type (), \
+    WockyHttpReplyInputStream))
+
+static void
+wocky_http_reply_input_stream_init (WockyHttpReplyInputStream *self)
+{
+  self->buffer = g_byte_array_new ();
+}
+
+static void
+wocky_http_reply_input_stream_finalize (GObject *object)
+{
+  WockyHttpReplyInputStream *self = WOCKY_HTTP_REPLY_INPUT_STREAM (object);
+
+  g_clear_error (&self->error);
+  if (self->buffer != NULL)
+    g_byte_array_free (self->buffer, TRUE);
+
+  G_OBJECT_CLASS (wocky_http_reply_input_stream_parent_class)->finalize (object);
+}
+
+/* reads until the end of the reply, and checks it */
+static gboolean
+reply_input_stream_check (WockyHttpReplyInputStream *self,
+    gboolean blocking,
+    GCancellable *cancellable,
+    GError **error)
+{
+  GInputStream *base = G_FILTER_INPUT_STREAM (self)->base_stream;
+  guint8 buf[512];
+
+  while (!self->checked)
+    {
+      const gchar *data, *end;
+      gchar *reply;
+      gssize n;
+
+      if (self->error != NULL)
+        {
+          g_propagate_error (error, g_error_copy (self->error));
+          return FALSE;
+        }
+
+      if (blocking)
+        n = g_input_stream_read (base, buf, sizeof (buf), cancellable, error);
+      else
+        n = g_pollable_input_stream_read_nonblocking (
+            G_POLLABLE_INPUT_STREAM (base), buf, sizeof (buf), cancellable, error);
+      if (n < 0)
+        return FALSE;
+
+      if (n == 0)
+        {
+          g_set_error_literal (&self->error, G_IO_ERROR, G_IO_ERROR_PROXY_FAILED,
+              "HTTP proxy server closed connection unexpectedly.");
+          continue;
+        }
+
+      if (self->buffer->len + n > MAX_REPLY_SIZE)
+        {
+          g_set_error_literal (&self->error, G_IO_ERROR, G_IO_ERROR_PROXY_FAILED,
+              "Bad HTTP proxy reply");
+          continue;
+        }
+
+      g_byte_array_append (self->buffer, buf, n);
+      data = (const gchar *) self->buffer->data;
+      end = g_strstr_len (data, self->buffer->len, HTTP_END_MARKER);
+      if (end == NULL)
+        continue;
+
+      self->offset = end + strlen (HTTP_END_MARKER) - data;
+      reply = g_strndup (data, self->offset);
+      self->checked = check_reply (reply, self->has_cred, &self->error);
+      g_free (reply);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+reply_input_stream_has_data (WockyHttpReplyInputStream *self)
+{
+  return self->checked && self->offset < self->buffer->len;
+}
+
+static gssize
+reply_input_stream_read_data (WockyHttpReplyInputStream *self,
+    void *buffer,
+    gsize count)
+{
+  gsize n = MIN (count, self->buffer->len - self->offset);
+
+  memcpy (buffer, self->buffer->data + self->offset, n);
+  self->offset += n;
+
+  return n;
+}
+
+static gssize
+wocky_http_reply_input_stream_read (GInputStream *stream,
+    void *buffer,
+    gsize count,
+    GCancellable *cancellable,
+    GError **error)
+{
+  WockyHttpReplyInputStream *self = WOCKY_HTTP_REPLY_INPUT_STREAM (stream);
+
+  if (!reply_input_stream_check (self, TRUE, cancellable, error))
+    return -1;
+
+  if (reply_input_stream_has_data (self))
+    return reply_input_stream_read_data (self, buffer, count);
+
+  return g_input_stream_read (G_FILTER_INPUT_STREAM (self)->base_stream,
+      buffer, count, cancellable, error);
+}
+
+static gboolean
+wocky_http_reply_input_stream_can_poll (GPollableInputStream *stream)
+{
+  GInputStream *base = G_FILTER_INPUT_STREAM (stream)->base_stream;
+
+  return G_IS_POLLABLE_INPUT_STREAM (base) &&
+    g_pollable_input_stream_can_poll (G_POLLABLE_INPUT_STREAM (base));
+}
+
+static gboolean
+wocky_http_reply_input_stream_is_readable (GPollableInputStream *stream)
+{
+  WockyHttpReplyInputStream *self = WOCKY_HTTP_REPLY_INPUT_STREAM (stream);
+  GInputStream *base = G_FILTER_INPUT_STREAM (stream)->base_stream;
+
+  return reply_input_stream_has_data (self) ||
+    g_pollable_input_stream_is_readable (G_POLLABLE_INPUT_STREAM (base));
+}
+
+static GSource *
+wocky_http_reply_input_stream_create_source (GPollableInputStream *stream,
+    GCancellable *cancellable)
+{
+  WockyHttpReplyInputStream *self = WOCKY_HTTP_REPLY_INPUT_STREAM (stream);
+  GInputStream *base = G_FILTER_INPUT_STREAM (stream)->base_stream;
+  GSource *source, *base_source;
+
+  source = g_pollable_source_new (G_OBJECT (stream));
+  if (reply_input_stream_has_data (self))
+    base_source = g_timeout_source_new (0);
+  else
+    base_source = g_pollable_input_stream_create_source (
+        G_POLLABLE_INPUT_STREAM (base), cancellable);
+  g_source_set_dummy_callback (base_source);
+  g_source_add_child_source (source, base_source);
+  g_source_unref (base_source);
+
+  return source;
+}
+
+static gssize
+wocky_http_reply_input_stream_read_nonblocking (GPollableInputStream *stream,
+    void *buffer,
+    gsize count,
+    GError **error)
+{
+  WockyHttpReplyInputStream *self = WOCKY_HTTP_REPLY_INPUT_STREAM (stream);
+  GInputStream *base = G_FILTER_INPUT_STREAM (stream)->base_stream;
+
+  if (!reply_input_stream_check (self, FALSE, NULL, error))
+    return -1;
+
+  if (reply_input_stream_has_data (self))
+    return reply_input_stream_read_data (self, buffer, count);
+
+  return g_pollable_input_stream_read_nonblocking (G_POLLABLE_INPUT_STREAM (base),
+      buffer, count, NULL, error);
+}
+
+static void
+wocky_http_reply_input_stream_class_init (WockyHttpReplyInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = wocky_http_reply_input_stream_finalize;
+  stream_class->read_fn = wocky_http_reply_input_stream_read;
+}
+
+static void
+wocky_http_reply_input_stream_pollable_iface_init (
+    GPollableInputStreamInterface *iface)
+{
+  iface->can_poll = wocky_http_reply_input_stream_can_poll;
+  iface->is_readable = wocky_http_reply_input_stream_is_readable;
+  iface->create_source = wocky_http_reply_input_stream_create_source;
+  iface->read_nonblocking = wocky_http_reply_input_stream_read_nonblocking;
+}
+
+/* the stream to the destination, reading the reply first */
+typedef struct
+{
+  GIOStream parent;
+
+  GIOStream *base;
+  GInputStream *input;
+} WockyHttpPipelinedStream;
+
+typedef struct
+{
+  GIOStreamClass parent_class;
+} WockyHttpPipelinedStreamClass;
+
+G_DEFINE_TYPE (WockyHttpPipelinedStream, wocky_http_pipelined_stream,
+  G_TYPE_IO_STREAM)
+
+#define WOCKY_HTTP_PIPELINED_STREAM(o) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((o), wocky_http_pipelined_stream_get_type (), \
+    WockyHttpPipelinedStream))
+
+static void
+wocky_http_pipelined_stream_init (WockyHttpPipelinedStream *self)
+{
+}
+
+static void
+wocky_http_pipelined_stream_finalize (GObject *object)
+{
+  WockyHttpPipelinedStream *self = WOCKY_HTTP_PIPELINED_STREAM (object);
+
+  g_clear_object (&self->input);
+  g_clear_object (&self->base);
+
+  G_OBJECT_CLASS (wocky_http_pipelined_stream_parent_class)->finalize (object);
+}
+
+static GInputStream *
+wocky_http_pipelined_stream_get_input_stream (GIOStream *stream)
+{
+  return WOCKY_HTTP_PIPELINED_STREAM (stream)->input;
+}
+
+static GOutputStream *
+wocky_http_pipelined_stream_get_output_stream (GIOStream *stream)
+{
+  return g_io_stream_get_output_stream (WOCKY_HTTP_PIPELINED_STREAM (stream)->base);
+}
+
+static gboolean
+wocky_http_pipelined_stream_close (GIOStream *stream,
+    GCancellable *cancellable,
+    GError **error)
+{
+  WockyHttpPipelinedStream *self = WOCKY_HTTP_PIPELINED_STREAM (stream);
+
+  g_input_stream_close (self->input, cancellable, NULL);
+
+  return g_io_stream_close (self->base, cancellable, error);
+}
+
+static void
+wocky_http_pipelined_stream_class_init (WockyHttpPipelinedStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GIOStreamClass *stream_class = G_IO_STREAM_CLASS (klass);
+
+  object_class->finalize = wocky_http_pipelined_stream_finalize;
+  stream_class->get_input_stream = wocky_http_pipelined_stream_get_input_stream;
+  stream_class->get_output_stream = wocky_http_pipelined_stream_get_output_stream;
+  stream_class->close_fn = wocky_http_pipelined_stream_close;
+}
+
+static GIOStream *
+pipelined_stream_new (GIOStream *io_stream, gboolean has_cred)
+{
+  WockyHttpPipelinedStream *self;
+  WockyHttpReplyInputStream *input;
+
+  input = g_object_new (wocky_http_reply_input_stream_get_type (),
+      "base-stream", g_io_stream_get_input_stream (io_stream),
+      "close-base-stream", FALSE,
+      NULL);
+  input->has_cred = has_cred;
+
+  self = g_object_new (wocky_http_pipelined_stream_get_type (), NULL);
+  self->base = g_object_ref (io_stream);
+  self->input = G_INPUT_STREAM (input);
+
+  return G_IO_STREAM (self);
+}
+
 static GIOStream *
 wocky_http_proxy_connect (GProxy *proxy,
     GIOStream *io_stream,
@@ -220,6 +552,16 @@ wocky_http_proxy_connect (GProxy *proxy,
         cancellable, error))
       goto error;
 
+  if (is_pipelined (proxy_address))
+    {
+      GIOStream *pipelined = pipelined_stream_new (io_stream, has_cred);
+
+      g_object_unref (data_in);
+      g_free (buffer);
+      g_clear_object (&tlsconn);
+      return pipelined;
+    }
+
   g_free (buffer);
   buffer = g_data_input_stream_read_until (data_in, HTTP_END_MARKER, NULL,
       cancellable, error);
@@ -261,6 +603,7 @@ typedef struct
   gssize offset;
   GDataInputStream *data_in;
   gboolean has_cred;
+  gboolean pipelined;
   GCancellable *cancellable;
 } ConnectAsyncData;
 
@@ -370,6 +713,7 @@ wocky_http_proxy_connect_async (GProxy *proxy,
   data->simple = simple;
 
   data->buffer = create_request (proxy_address, &data->has_cred);
+  data->pipelined = is_pipelined (proxy_address);
   data->length = strlen (data->buffer);
   data->offset = 0;
 
@@ -432,6 +776,18 @@ request_write_cb (GObject *source,
       g_free (data->buffer);
       data->buffer = NULL;
 
+      if (data->pipelined)
+        {
+          GIOStream *pipelined = pipelined_stream_new (data->io_stream,
+              data->has_cred);
+
+          g_object_unref (data->io_stream);
+          data->io_stream = pipelined;
+          g_simple_async_result_complete (data->simple);
+          g_object_unref (data->simple);
+          return;
+        }
+
       g_data_input_stream_read_until_async (data->data_in,
           HTTP_END_MARKER,
           G_PRIORITY_DEFAULT,
@@ -524,7 +880,9 @@ G_DEFINE_TYPE_WITH_CODE (WockyHttpsProxy, wocky_https_proxy, WOCKY_TYPE_HTTP_PRO
     g_io_extension_point_register (G_PROXY_EXTENSION_POINT_NAME),
     G_TYPE_PROXY);
   g_io_extension_point_implement (G_PROXY_EXTENSION_POINT_NAME,
-    g_define_type_id, "https", 0))
+    g_define_type_id, "https", 0);
+  g_io_extension_point_implement (G_PROXY_EXTENSION_POINT_NAME,
+    g_define_type_id, "https" WOCKY_HTTP_PROXY_PIPELINED_SUFFIX, 0))
 
 static void
 wocky_https_proxy_init (WockyHttpsProxy *proxy)
@@ -37,6 +37,10 @@ typedef struct _WockyHttpProxyClass   WockyHttpProxyClass;
 
 GType _wocky_http_proxy_get_type (void);
 
+/* appended to the protocol of the proxies that do not wait for the
+ * CONNECT reply before returning the stream */
+#define WOCKY_HTTP_PROXY_PIPELINED_SUFFIX "-pipelined"
+
 #if GLIB_CHECK_VERSION(2, 28, 0)
 #define WOCKY_TYPE_HTTPS_PROXY         (_wocky_https_proxy_get_type ())
 #define WOCKY_HTTPS_PROXY(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), WOCKY_TYPE_HTTPS_PROXY, WockyHttpsProxy))
@@ -0,0 +1,50 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TESTS_BENCH_H_
+#define TESTS_BENCH_H_
+
+#include <glib.h>
+#include <stdio.h>
+
+/*
+ * Reports a measure of a perf test. With -m perf, it is also printed as
+ * a line of JSON, which "make bench" collects: keep the names stable,
+ * they are compared between releases.
+ */
+static inline void bench_report(const gchar *name, gdouble value, const gchar *unit,
+                                gboolean higher_is_better)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    if (higher_is_better)
+        g_test_maximized_result(value, "%s: %.2f %s", name, value, unit);
+    else
+        g_test_minimized_result(value, "%s: %.2f %s", name, value, unit);
+
+    if (!g_test_perf())
+        return;
+
+    /* whatever the locale */
+    g_ascii_formatd(buf, sizeof(buf), "%.3f", value);
+    printf("{\"name\": \"%s\", \"value\": %s, \"unit\": \"%s\", \"better\": \"%s\"}\n",
+           name, buf, unit, higher_is_better ? "higher" : "lower");
+    fflush(stdout);
+}
+
+#endif /* TESTS_BENCH_H_ */
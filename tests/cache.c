@@ -0,0 +1,179 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <stdio.h>
+
+#include "spice-channel-cache.h"
+#include "bench.h"
+
+#define N_IDS 4096
+
+static guint destroyed;
+
+static void value_destroy(gpointer value)
+{
+    destroyed++;
+}
+
+static gsize value_size(gpointer value)
+{
+    return 10;
+}
+
+static void test_cache_basic(void)
+{
+    display_cache *cache = cache_new(value_destroy);
+    gboolean lossy;
+    guint64 id;
+
+    destroyed = 0;
+    for (id = 1; id <= N_IDS; id++)
+        cache_add_lossy(cache, id << 32, GUINT_TO_POINTER(id), id & 1);
+
+    for (id = 1; id <= N_IDS; id++) {
+        g_assert(cache_find_lossy(cache, id << 32, &lossy) == GUINT_TO_POINTER(id));
+        g_assert_cmpint(lossy, ==, id & 1);
+    }
+    g_assert(cache_find(cache, 0) == NULL);
+    g_assert(cache_find(cache, (guint64)(N_IDS + 1) << 32) == NULL);
+
+    /* replacing destroys the previous value */
+    cache_add_lossy(cache, 1ULL << 32, GUINT_TO_POINTER(42), FALSE);
+    g_assert_cmpuint(destroyed, ==, 1);
+    g_assert(cache_find_lossy(cache, 1ULL << 32, &lossy) == GUINT_TO_POINTER(42));
+    g_assert(!lossy);
+
+    /* remove every other item, the others must still be found */
+    for (id = 2; id <= N_IDS; id += 2)
+        g_assert(cache_remove(cache, id << 32));
+    g_assert(!cache_remove(cache, 2ULL << 32));
+    for (id = 3; id <= N_IDS; id += 2)
+        g_assert(cache_find(cache, id << 32) == GUINT_TO_POINTER(id));
+    g_assert_cmpuint(destroyed, ==, 1 + N_IDS / 2);
+
+    cache_clear(cache);
+    g_assert(cache_find(cache, 3ULL << 32) == NULL);
+    g_assert_cmpuint(destroyed, ==, 1 + N_IDS);
+
+    cache_unref(cache);
+}
+
+static void test_cache_lru(void)
+{
+    display_cache *cache = cache_new_sized(value_destroy, value_size);
+    guint64 id;
+
+    destroyed = 0;
+    for (id = 1; id <= 10; id++)
+        cache_add(cache, id, GUINT_TO_POINTER(id));
+    g_assert_cmpuint(cache->size, ==, 100);
+
+    /* 1 becomes the most recently used */
+    g_assert(cache_find(cache, 1) != NULL);
+
+    cache_set_max_size(cache, 80);
+    g_assert_cmpuint(cache->evictions, ==, 2);
+    g_assert_cmpuint(cache->size, ==, 80);
+    g_assert(cache_find(cache, 2) == NULL);
+    g_assert(cache_find(cache, 3) == NULL);
+    g_assert(cache_find(cache, 1) != NULL);
+    g_assert(cache_find(cache, 4) != NULL);
+
+    /* adding evicts the least recently used, 5 */
+    cache_add(cache, 11, GUINT_TO_POINTER(11));
+    g_assert_cmpuint(cache->evictions, ==, 3);
+    g_assert(cache_find(cache, 5) == NULL);
+    g_assert(cache_find(cache, 11) != NULL);
+
+    g_assert_cmpuint(cache->hits, ==, 4);
+    g_assert_cmpuint(cache->misses, ==, 3);
+
+    cache_unref(cache);
+    g_assert_cmpuint(destroyed, ==, 11);
+}
+
+static guint64 *make_ids(void)
+{
+    guint64 *ids = g_new(guint64, N_IDS);
+    guint i;
+
+    /* image ids carry a group in the high bits */
+    for (i = 0; i < N_IDS; i++)
+        ids[i] = (G_GUINT64_CONSTANT(3) << 56) | g_random_int();
+
+    return ids;
+}
+
+static void report(const char *name, guint lookups, GTimer *timer)
+{
+    gdouble rate = lookups / 1e6 / g_timer_elapsed(timer, NULL);
+
+    bench_report(name, rate, "M lookups/s", TRUE);
+}
+
+/* compare with the GHashTable the cache used to be */
+static void test_cache_perf(void)
+{
+    guint64 *ids = make_ids();
+    guint i, l, loops = g_test_perf() ? 2000 : 10;
+    display_cache *cache = cache_new(NULL);
+    GHashTable *table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              g_free, NULL);
+    GTimer *timer;
+    gboolean lossy;
+    guint found = 0;
+
+    for (i = 0; i < N_IDS; i++) {
+        cache_add(cache, ids[i], GUINT_TO_POINTER(i + 1));
+        g_hash_table_replace(table, g_memdup(&ids[i], sizeof(guint64)),
+                             GUINT_TO_POINTER(i + 1));
+    }
+
+    timer = g_timer_new();
+    for (l = 0; l < loops; l++)
+        for (i = 0; i < N_IDS; i++)
+            found += cache_find_lossy(cache, ids[i], &lossy) != NULL;
+    g_timer_stop(timer);
+    report("cache/lookup/display_cache", loops * N_IDS, timer);
+
+    g_timer_start(timer);
+    for (l = 0; l < loops; l++)
+        for (i = 0; i < N_IDS; i++)
+            found += g_hash_table_lookup(table, &ids[i]) != NULL;
+    g_timer_stop(timer);
+    report("cache/lookup/GHashTable", loops * N_IDS, timer);
+
+    g_assert_cmpuint(found, ==, 2 * loops * N_IDS);
+
+    g_timer_destroy(timer);
+    g_hash_table_unref(table);
+    cache_unref(cache);
+    g_free(ids);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/cache/basic", test_cache_basic);
+    g_test_add_func("/cache/lru", test_cache_lru);
+    g_test_add_func("/cache/perf", test_cache_perf);
+
+    return g_test_run ();
+}
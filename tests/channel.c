@@ -0,0 +1,121 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+
+#include "spice-client.h"
+#include "fake-server.h"
+#include "bench.h"
+
+/*
+ * Receives data messages on a port channel, from a fake server on a
+ * socket pair: the read, the header and the dispatch of every message
+ * in the channel coroutine, with no network in the way.
+ */
+typedef struct {
+    GMainLoop *loop;
+    GTimer *timer;
+    guint8 *data;
+    gsize message_size;
+    gsize total;
+    gsize sent;
+    gsize received;
+} Recv;
+
+static void recv_queue(FakeServer *server, gpointer user_data)
+{
+    Recv *r = user_data;
+    guint i;
+
+    /* keep the socket busy, without queueing it all at once */
+    for (i = 0; i < 64 && r->sent < r->total; i++) {
+        fake_server_send(server, SPICE_MSG_SPICEVMC_DATA, r->data, r->message_size);
+        r->sent += r->message_size;
+    }
+}
+
+static void recv_ready(FakeServer *server, gpointer user_data)
+{
+    Recv *r = user_data;
+
+    g_timer_start(r->timer);
+    recv_queue(server, user_data);
+}
+
+static void port_data(SpicePortChannel *port, gpointer data, int size, gpointer user_data)
+{
+    Recv *r = user_data;
+
+    g_assert_cmpint(size, ==, r->message_size);
+    r->received += size;
+    if (r->received == r->total)
+        g_main_loop_quit(r->loop);
+}
+
+static void test_channel_recv(gconstpointer user_data)
+{
+    gsize message_size = GPOINTER_TO_SIZE(user_data);
+    SpiceSession *session;
+    SpiceChannel *channel;
+    FakeServer *server;
+    Recv r = { NULL, };
+    gdouble elapsed;
+    gchar *name;
+
+    r.message_size = message_size;
+    r.total = g_test_perf() ? 64 * 1024 * 1024 : 1024 * 1024;
+    r.data = g_malloc0(message_size);
+    r.loop = g_main_loop_new(NULL, FALSE);
+    r.timer = g_timer_new();
+
+    session = spice_session_new();
+    channel = spice_channel_new(session, SPICE_CHANNEL_PORT, 0);
+    g_signal_connect(channel, "port-data", G_CALLBACK(port_data), &r);
+
+    server = fake_server_new(channel, recv_ready, NULL, recv_queue, &r);
+    g_main_loop_run(r.loop);
+    g_timer_stop(r.timer);
+    elapsed = g_timer_elapsed(r.timer, NULL);
+
+    name = g_strdup_printf("channel/recv/%" G_GSIZE_FORMAT, message_size);
+    bench_report(name, r.total / (1024. * 1024.) / elapsed, "MB/s", TRUE);
+    g_free(name);
+    name = g_strdup_printf("channel/recv/%" G_GSIZE_FORMAT "/messages", message_size);
+    bench_report(name, r.total / message_size / elapsed, "messages/s", TRUE);
+    g_free(name);
+
+    spice_session_disconnect(session);
+    fake_server_free(server);
+    while (g_main_context_iteration(NULL, FALSE));
+
+    g_object_unref(session);
+    g_timer_destroy(r.timer);
+    g_main_loop_unref(r.loop);
+    g_free(r.data);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    /* the cost per message, then per byte */
+    g_test_add_data_func("/channel/recv/small", GSIZE_TO_POINTER(64), test_channel_recv);
+    g_test_add_data_func("/channel/recv/large", GSIZE_TO_POINTER(64 * 1024), test_channel_recv);
+
+    return g_test_run();
+}
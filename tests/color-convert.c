@@ -0,0 +1,118 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "color-convert.h"
+#include "bench.h"
+
+#define WIDTH  1027 /* not a multiple of the vector sizes */
+#define HEIGHT 768
+
+static guint16 *make_src(void)
+{
+    guint16 *src = g_new(guint16, WIDTH * HEIGHT);
+    guint i;
+
+    for (i = 0; i < WIDTH * HEIGHT; i++)
+        src[i] = g_random_int_range(0, 0x10000);
+
+    return src;
+}
+
+/* all the variants must give the same result as the scalar code */
+static void test_color_convert_match(void)
+{
+    const SpiceColorConverter *converters, *scalar;
+    guint16 *src = make_src();
+    guint32 *expected = g_new(guint32, WIDTH * HEIGHT);
+    guint32 *dest = g_new(guint32, WIDTH * HEIGHT);
+    guint i, n;
+
+    converters = spice_color_converter_list(&n);
+    scalar = &converters[n - 1];
+    g_assert_cmpstr(scalar->name, ==, "scalar");
+
+    for (i = 0; i < n; i++) {
+        if (!converters[i].supported()) {
+            g_test_message("%s: not supported", converters[i].name);
+            continue;
+        }
+
+        scalar->convert_555(expected, src, WIDTH * HEIGHT);
+        converters[i].convert_555(dest, src, WIDTH * HEIGHT);
+        g_assert(memcmp(dest, expected, WIDTH * HEIGHT * sizeof(guint32)) == 0);
+
+        scalar->convert_565(expected, src, WIDTH * HEIGHT);
+        converters[i].convert_565(dest, src, WIDTH * HEIGHT);
+        g_assert(memcmp(dest, expected, WIDTH * HEIGHT * sizeof(guint32)) == 0);
+    }
+
+    g_assert(spice_color_converter_get()->supported());
+
+    g_free(src);
+    g_free(expected);
+    g_free(dest);
+}
+
+static void test_color_convert_perf(void)
+{
+    const SpiceColorConverter *converters;
+    guint16 *src = make_src();
+    guint32 *dest = g_new(guint32, WIDTH * HEIGHT);
+    guint i, n, loops = g_test_perf() ? 200 : 5;
+
+    converters = spice_color_converter_list(&n);
+    for (i = 0; i < n; i++) {
+        GTimer *timer;
+        guint l, y;
+        gdouble mpix;
+        gchar *name;
+
+        if (!converters[i].supported())
+            continue;
+
+        timer = g_timer_new();
+        for (l = 0; l < loops; l++)
+            for (y = 0; y < HEIGHT; y++)
+                converters[i].convert_565(dest + y * WIDTH, src + y * WIDTH, WIDTH);
+        g_timer_stop(timer);
+
+        mpix = (gdouble)WIDTH * HEIGHT * loops / 1e6 / g_timer_elapsed(timer, NULL);
+        name = g_strdup_printf("color-convert/565/%s", converters[i].name);
+        bench_report(name, mpix, "MPix/s", TRUE);
+        g_free(name);
+        g_timer_destroy(timer);
+    }
+
+    g_free(src);
+    g_free(dest);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/color-convert/match", test_color_convert_match);
+    g_test_add_func("/color-convert/perf", test_color_convert_perf);
+
+    return g_test_run ();
+}
@@ -4,6 +4,15 @@
 #include <stdlib.h>
 
 #include "coroutine.h"
+#include "bench.h"
+
+#if WITH_UCONTEXT
+#define COROUTINE_BACKEND "ucontext"
+#elif WITH_WINFIBER
+#define COROUTINE_BACKEND "winfiber"
+#else
+#define COROUTINE_BACKEND "gthread"
+#endif
 
 static gpointer co_entry_check_self(gpointer data)
 {
@@ -124,6 +133,40 @@ static void test_coroutine_yield(void)
 #endif
 }
 
+static gpointer co_entry_perf(gpointer data)
+{
+    guint i, loops = GPOINTER_TO_UINT(data);
+
+    for (i = 0; i < loops; i++)
+        coroutine_yield(NULL);
+
+    return NULL;
+}
+
+/* what a channel pays for each read that would block */
+static void test_coroutine_perf(void)
+{
+    /* a thread handoff is a hundred times slower */
+    guint i, loops = g_test_perf() ? (WITH_GTHREAD ? 100000 : 10000000) : 1000;
+    struct coroutine co = {
+        .stack_size = 16 << 20,
+        .entry = co_entry_perf,
+    };
+    GTimer *timer;
+
+    coroutine_init(&co);
+    timer = g_timer_new();
+    for (i = 0; i <= loops; i++)
+        coroutine_yieldto(&co, GUINT_TO_POINTER(loops));
+    g_timer_stop(timer);
+    g_assert(co.exited);
+
+    /* a switch to the coroutine and back, of the backend built */
+    bench_report("coroutine/switch/" COROUTINE_BACKEND,
+                 loops / g_timer_elapsed(timer, NULL), "switches/s", TRUE);
+    g_timer_destroy(timer);
+}
+
 int main(int argc, char* argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -131,6 +174,7 @@ int main(int argc, char* argv[])
     g_test_add_func("/coroutine/simple", test_coroutine_simple);
     g_test_add_func("/coroutine/two", test_coroutine_two);
     g_test_add_func("/coroutine/yield", test_coroutine_yield);
+    g_test_add_func("/coroutine/perf", test_coroutine_perf);
 
     return g_test_run ();
 }
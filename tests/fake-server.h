@@ -0,0 +1,320 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TESTS_FAKE_SERVER_H_
+#define TESTS_FAKE_SERVER_H_
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "spice-client.h"
+#include "glib-compat.h"
+
+/*
+ * The server end of a single channel, on a socket pair: it links the
+ * channel with a spice ticket and the mini header, then passes the
+ * messages of the client to message() and sends what is queued with
+ * fake_server_send(). Everything runs from the default main context,
+ * as the channel coroutine, so a test only has to run a main loop.
+ */
+typedef struct _FakeServer FakeServer;
+
+typedef void (*FakeServerFunc)(FakeServer *server, gpointer user_data);
+typedef void (*FakeServerMessageFunc)(FakeServer *server, guint16 type,
+                                      const guint8 *data, guint32 size,
+                                      gpointer user_data);
+
+typedef enum {
+    FAKE_SERVER_LINK_HEADER,
+    FAKE_SERVER_LINK_MESS,
+    FAKE_SERVER_TICKET,
+    FAKE_SERVER_READY,
+} FakeServerState;
+
+struct _FakeServer {
+    GSocket *socket;
+    GSource *in_source;
+    GSource *out_source;
+    GByteArray *in;
+    GByteArray *out;
+    gsize out_pos;
+
+    FakeServerState state;
+    guint32 mess_size;
+    guint32 ticket_size;
+    guint8 pub_key[SPICE_TICKET_PUBKEY_BYTES];
+
+    FakeServerFunc ready;           /* the channel is linked */
+    FakeServerMessageFunc message;  /* a message from the client */
+    FakeServerFunc drained;         /* all is sent, may queue more */
+    gpointer user_data;
+};
+
+static inline void fake_server_write(FakeServer *server, gconstpointer data, gsize size);
+
+static inline void fake_server_send(FakeServer *server, guint16 type,
+                                    gconstpointer data, guint32 size)
+{
+    SpiceMiniDataHeader header;
+
+    g_assert_cmpint(server->state, ==, FAKE_SERVER_READY);
+
+    header.type = GUINT16_TO_LE(type);
+    header.size = GUINT32_TO_LE(size);
+    fake_server_write(server, &header, sizeof(header));
+    fake_server_write(server, data, size);
+}
+
+static inline gboolean fake_server_out_cb(GSocket *socket, GIOCondition condition,
+                                          gpointer user_data)
+{
+    FakeServer *server = user_data;
+    GError *error = NULL;
+    gssize size;
+
+    size = g_socket_send(socket, (gchar *)server->out->data + server->out_pos,
+                         server->out->len - server->out_pos, NULL, &error);
+    if (size < 0) {
+        /* the channel is gone, or the socket is full after all */
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            server->out_pos = server->out->len;
+        g_clear_error(&error);
+    } else {
+        server->out_pos += size;
+    }
+
+    if (server->out_pos < server->out->len)
+        return G_SOURCE_CONTINUE;
+
+    g_byte_array_set_size(server->out, 0);
+    server->out_pos = 0;
+    if (server->drained && server->state == FAKE_SERVER_READY)
+        server->drained(server, server->user_data);
+    if (server->out->len > 0)
+        return G_SOURCE_CONTINUE;
+
+    g_source_unref(server->out_source);
+    server->out_source = NULL;
+    return G_SOURCE_REMOVE;
+}
+
+static inline void fake_server_write(FakeServer *server, gconstpointer data, gsize size)
+{
+    g_byte_array_append(server->out, data, size);
+    if (server->out_source != NULL)
+        return;
+
+    server->out_source = g_socket_create_source(server->socket, G_IO_OUT, NULL);
+    g_source_set_callback(server->out_source, (GSourceFunc)fake_server_out_cb,
+                          server, NULL);
+    g_source_attach(server->out_source, NULL);
+}
+
+static inline void fake_server_send_link_reply(FakeServer *server)
+{
+    SpiceLinkHeader header = { 0, };
+    SpiceLinkReply reply = { 0, };
+    guint32 common_caps = GUINT32_TO_LE(1 << SPICE_COMMON_CAP_MINI_HEADER);
+
+    header.magic = SPICE_MAGIC;
+    header.major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR);
+    header.minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR);
+    header.size = GUINT32_TO_LE(sizeof(reply) + sizeof(common_caps));
+
+    /* no auth selection: the client sends the ticket right away */
+    reply.error = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+    memcpy(reply.pub_key, server->pub_key, sizeof(reply.pub_key));
+    reply.num_common_caps = GUINT32_TO_LE(1);
+    reply.caps_offset = GUINT32_TO_LE(sizeof(reply));
+
+    fake_server_write(server, &header, sizeof(header));
+    fake_server_write(server, &reply, sizeof(reply));
+    fake_server_write(server, &common_caps, sizeof(common_caps));
+}
+
+static inline void fake_server_parse(FakeServer *server)
+{
+    gsize pos = 0;
+
+    for (;;) {
+        const guint8 *data = server->in->data + pos;
+        gsize len = server->in->len - pos;
+
+        if (server->state == FAKE_SERVER_LINK_HEADER) {
+            SpiceLinkHeader header;
+
+            if (len < sizeof(header))
+                break;
+            memcpy(&header, data, sizeof(header));
+            g_assert_cmphex(header.magic, ==, SPICE_MAGIC);
+            server->mess_size = GUINT32_FROM_LE(header.size);
+            server->state = FAKE_SERVER_LINK_MESS;
+            pos += sizeof(header);
+        } else if (server->state == FAKE_SERVER_LINK_MESS) {
+            if (len < server->mess_size)
+                break;
+            fake_server_send_link_reply(server);
+            server->state = FAKE_SERVER_TICKET;
+            pos += server->mess_size;
+        } else if (server->state == FAKE_SERVER_TICKET) {
+            guint32 link_result = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+
+            /* any password will do */
+            if (len < server->ticket_size)
+                break;
+            fake_server_write(server, &link_result, sizeof(link_result));
+            server->state = FAKE_SERVER_READY;
+            pos += server->ticket_size;
+            if (server->ready)
+                server->ready(server, server->user_data);
+        } else {
+            SpiceMiniDataHeader header;
+            guint32 size;
+
+            if (len < sizeof(header))
+                break;
+            memcpy(&header, data, sizeof(header));
+            size = GUINT32_FROM_LE(header.size);
+            if (len < sizeof(header) + size)
+                break;
+            if (server->message)
+                server->message(server, GUINT16_FROM_LE(header.type),
+                                data + sizeof(header), size, server->user_data);
+            pos += sizeof(header) + size;
+        }
+    }
+
+    g_byte_array_remove_range(server->in, 0, pos);
+}
+
+static inline gboolean fake_server_in_cb(GSocket *socket, GIOCondition condition,
+                                         gpointer user_data)
+{
+    FakeServer *server = user_data;
+    GError *error = NULL;
+    gchar buf[64 * 1024];
+    gssize size;
+
+    size = g_socket_receive(socket, buf, sizeof(buf), NULL, &error);
+    if (size < 0 && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_clear_error(&error);
+        return G_SOURCE_CONTINUE;
+    }
+    g_clear_error(&error);
+
+    /* the channel hung up */
+    if (size <= 0) {
+        g_source_unref(server->in_source);
+        server->in_source = NULL;
+        return G_SOURCE_REMOVE;
+    }
+
+    g_byte_array_append(server->in, (guint8 *)buf, size);
+    fake_server_parse(server);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* one key for all the servers, the keys are slow to make */
+static guint8 fake_server_pub_key[SPICE_TICKET_PUBKEY_BYTES];
+static guint32 fake_server_ticket_size;
+
+static inline void fake_server_init_key(void)
+{
+    RSA *rsa;
+    BIGNUM *e;
+    EVP_PKEY *key;
+    guint8 *p = fake_server_pub_key;
+
+    if (fake_server_ticket_size != 0)
+        return;
+
+    rsa = RSA_new();
+    e = BN_new();
+    key = EVP_PKEY_new();
+    BN_set_word(e, RSA_F4);
+    g_assert_cmpint(RSA_generate_key_ex(rsa, 1024, e, NULL), ==, 1);
+    fake_server_ticket_size = RSA_size(rsa);
+    EVP_PKEY_assign_RSA(key, rsa);
+    g_assert_cmpint(i2d_PUBKEY(key, NULL), ==, SPICE_TICKET_PUBKEY_BYTES);
+    i2d_PUBKEY(key, &p);
+
+    EVP_PKEY_free(key);
+    BN_free(e);
+}
+
+/* connects @channel to a new fake server */
+static inline FakeServer *fake_server_new(SpiceChannel *channel,
+                                          FakeServerFunc ready,
+                                          FakeServerMessageFunc message,
+                                          FakeServerFunc drained,
+                                          gpointer user_data)
+{
+    FakeServer *server = g_new0(FakeServer, 1);
+    GError *error = NULL;
+    int fds[2];
+
+    server->ready = ready;
+    server->message = message;
+    server->drained = drained;
+    server->user_data = user_data;
+    server->in = g_byte_array_new();
+    server->out = g_byte_array_new();
+    fake_server_init_key();
+    memcpy(server->pub_key, fake_server_pub_key, sizeof(server->pub_key));
+    server->ticket_size = fake_server_ticket_size;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    server->socket = g_socket_new_from_fd(fds[1], &error);
+    g_assert_no_error(error);
+    g_socket_set_blocking(server->socket, FALSE);
+
+    server->in_source = g_socket_create_source(server->socket, G_IO_IN | G_IO_HUP, NULL);
+    g_source_set_callback(server->in_source, (GSourceFunc)fake_server_in_cb,
+                          server, NULL);
+    g_source_attach(server->in_source, NULL);
+
+    g_assert(spice_channel_open_fd(channel, fds[0]));
+
+    return server;
+}
+
+static inline void fake_server_free(FakeServer *server)
+{
+    if (server->in_source) {
+        g_source_destroy(server->in_source);
+        g_source_unref(server->in_source);
+    }
+    if (server->out_source) {
+        g_source_destroy(server->out_source);
+        g_source_unref(server->out_source);
+    }
+    g_socket_close(server->socket, NULL);
+    g_object_unref(server->socket);
+    g_byte_array_unref(server->in);
+    g_byte_array_unref(server->out);
+    g_free(server);
+}
+
+#endif /* TESTS_FAKE_SERVER_H_ */
@@ -0,0 +1,298 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "decode.h"
+#include "common/canvas_utils.h"
+#include "common/lz_common.h"
+#include "bench.h"
+
+#define WIDTH 1024
+#define HEIGHT 256
+#define N_FRAMES 8
+
+/*
+ * Synthetic RGB32 streams, with the kinds of matches found in desktop
+ * traffic: runs, short repeated patterns, copies from the row above and
+ * copies from the previous image of the window.
+ */
+typedef struct {
+    GByteArray *stream;
+    guint8 *expected; /* the decoded pixels, b g r pad */
+    guint n_pixels;
+} Frame;
+
+static void put_32(GByteArray *b, guint32 v)
+{
+    guint8 bytes[] = { v >> 24, v >> 16, v >> 8, v };
+
+    g_byte_array_append(b, bytes, sizeof(bytes));
+}
+
+static void put_8(GByteArray *b, guint8 v)
+{
+    g_byte_array_append(b, &v, 1);
+}
+
+static void emit_literal(Frame *f, GRand *rand, guint n)
+{
+    guint i;
+
+    g_assert(n > 0 && n <= 32);
+    put_8(f->stream, n - 1);
+    for (i = 0; i < n; i++) {
+        guint32 rgb = g_rand_int(rand);
+        guint8 *px = f->expected + f->n_pixels++ * 4;
+
+        px[0] = rgb;
+        px[1] = rgb >> 8;
+        px[2] = rgb >> 16;
+        px[3] = 0;
+        put_8(f->stream, px[0]);
+        put_8(f->stream, px[1]);
+        put_8(f->stream, px[2]);
+    }
+}
+
+/* @ref is the previous frame for a reference to another image */
+static void emit_ref(Frame *f, const Frame *ref, guint len, guint ofs)
+{
+    const guint8 *src;
+    guint coded_ofs, rem, i;
+
+    if (ref) {
+        coded_ofs = ofs;
+        src = ref->expected + ofs * 4;
+    } else {
+        /* the offset is biased by 1 in the same image */
+        coded_ofs = ofs - 1;
+        src = f->expected + (f->n_pixels - ofs) * 4;
+    }
+
+    /* always use the very long pixel offset form */
+    put_8(f->stream, MIN(len, 7) << 5 | 1 << 4 | (coded_ofs & 0x0f));
+    if (len >= 7) {
+        for (rem = len - 7; rem >= 255; rem -= 255)
+            put_8(f->stream, 255);
+        put_8(f->stream, rem);
+    }
+    put_8(f->stream, coded_ofs >> 4);
+    put_8(f->stream, (ref ? 1 : 0) << 6 | 1 << 5 | ((coded_ofs >> 12) & 0x1f));
+    if (ref)
+        put_8(f->stream, 1); /* image distance */
+    put_8(f->stream, coded_ofs >> 17);
+
+    /* the reference decoder, pixel by pixel */
+    for (i = 0; i < len * 4; i++)
+        f->expected[f->n_pixels * 4 + i] = src[i];
+    f->n_pixels += len;
+}
+
+static void frame_init(Frame *f, const Frame *prev, guint64 id, GRand *rand)
+{
+    guint x, y;
+
+    f->stream = g_byte_array_new();
+    f->expected = g_malloc(WIDTH * HEIGHT * 4);
+    f->n_pixels = 0;
+
+    put_32(f->stream, LZ_MAGIC);
+    put_32(f->stream, LZ_VERSION);
+    put_8(f->stream, LZ_IMAGE_TYPE_RGB32 | 1 << LZ_IMAGE_TYPE_LOG);
+    put_32(f->stream, WIDTH);
+    put_32(f->stream, HEIGHT);
+    put_32(f->stream, WIDTH * 4);
+    put_32(f->stream, id >> 32);
+    put_32(f->stream, id);
+    put_32(f->stream, prev ? 1 : 0);
+
+    for (x = 0; x < WIDTH; x += 32)
+        emit_literal(f, rand, 32);
+
+    for (y = 1; y < HEIGHT; y++) {
+        emit_literal(f, rand, 1);
+        emit_ref(f, NULL, 127, 1);
+        emit_literal(f, rand, 5);
+        emit_ref(f, NULL, 123, 5);
+        emit_ref(f, NULL, 256, WIDTH);
+        if (prev)
+            emit_ref(f, prev, 512, f->n_pixels);
+        else
+            emit_ref(f, NULL, 512, WIDTH);
+    }
+
+    g_assert_cmpuint(f->n_pixels, ==, WIDTH * HEIGHT);
+}
+
+static void frame_clear(Frame *f)
+{
+    g_byte_array_unref(f->stream);
+    g_free(f->expected);
+}
+
+static Frame *frames_new(void)
+{
+    Frame *frames = g_new(Frame, N_FRAMES);
+    GRand *rand = g_rand_new_with_seed(42);
+    guint i;
+
+    for (i = 0; i < N_FRAMES; i++)
+        frame_init(&frames[i], i ? &frames[i - 1] : NULL, i, rand);
+
+    g_rand_free(rand);
+    return frames;
+}
+
+static void frames_free(Frame *frames)
+{
+    guint i;
+
+    for (i = 0; i < N_FRAMES; i++)
+        frame_clear(&frames[i]);
+    g_free(frames);
+}
+
+static void decode_frame(SpiceGlzDecoder *decoder, Frame *frame, gboolean check)
+{
+    LzDecodeUsrData usr_data = { NULL, };
+    guint8 *data;
+    int stride;
+    guint y;
+
+    decoder->ops->decode(decoder, frame->stream->data, NULL, &usr_data);
+    g_assert(usr_data.out_surface != NULL);
+
+    if (check) {
+        data = (guint8 *)pixman_image_get_data(usr_data.out_surface);
+        stride = pixman_image_get_stride(usr_data.out_surface);
+        for (y = 0; y < HEIGHT; y++)
+            g_assert(memcmp(data + y * stride,
+                            frame->expected + y * WIDTH * 4, WIDTH * 4) == 0);
+    }
+
+    /* the canvas would keep it */
+    pixman_image_unref(usr_data.out_surface);
+}
+
+static void decode_frames(SpiceGlzDecoder *decoder, Frame *frames, gboolean check)
+{
+    guint i;
+
+    for (i = 0; i < N_FRAMES; i++)
+        decode_frame(decoder, &frames[i], check);
+}
+
+static void test_glz_decode(void)
+{
+    SpiceGlzDecoderWindow *window = glz_decoder_window_new();
+    SpiceGlzDecoder *decoder = glz_decoder_new(window);
+    Frame *frames = frames_new();
+
+    decode_frames(decoder, frames, TRUE);
+
+    /* and again, after a reset of the window */
+    glz_decoder_window_clear(window);
+    decode_frames(decoder, frames, TRUE);
+
+    frames_free(frames);
+    glz_decoder_destroy(decoder);
+    glz_decoder_window_destroy(window);
+}
+
+static void overflow(SpiceGlzDecoderWindow *w, gpointer data)
+{
+    guint *n_overflows = data;
+
+    (*n_overflows)++;
+}
+
+static void test_glz_bounded(void)
+{
+    SpiceGlzDecoderWindow *window = glz_decoder_window_new();
+    SpiceGlzDecoder *decoder = glz_decoder_new(window);
+    Frame *frames = frames_new();
+    gsize frame_size = WIDTH * HEIGHT * 4;
+    guint n_overflows = 0;
+
+    glz_decoder_window_set_overflow_func(window, overflow, &n_overflows);
+
+    /* each frame refers to the previous one, 2 frames are held at most */
+    glz_decoder_window_set_size_hint(window, 2 * frame_size);
+    decode_frames(decoder, frames, TRUE);
+    g_assert_cmpuint(n_overflows, ==, 0);
+    g_assert_cmpuint(glz_decoder_window_get_size(window), ==, 2 * frame_size);
+
+    /* a window of one frame cannot hold the second one */
+    glz_decoder_window_destroy(window);
+    glz_decoder_destroy(decoder);
+    window = glz_decoder_window_new();
+    decoder = glz_decoder_new(window);
+    glz_decoder_window_set_overflow_func(window, overflow, &n_overflows);
+    glz_decoder_window_set_size_hint(window, frame_size);
+
+    decode_frame(decoder, &frames[0], TRUE);
+    decode_frame(decoder, &frames[1], TRUE);
+    g_assert_cmpuint(n_overflows, ==, 1);
+    g_assert_cmpuint(glz_decoder_window_get_size(window), ==, frame_size);
+
+    glz_decoder_window_clear(window);
+    g_assert_cmpuint(glz_decoder_window_get_size(window), ==, 0);
+
+    frames_free(frames);
+    glz_decoder_destroy(decoder);
+    glz_decoder_window_destroy(window);
+}
+
+static void test_glz_perf(void)
+{
+    SpiceGlzDecoderWindow *window = glz_decoder_window_new();
+    SpiceGlzDecoder *decoder = glz_decoder_new(window);
+    Frame *frames = frames_new();
+    guint l, loops = g_test_perf() ? 100 : 2;
+    GTimer *timer = g_timer_new();
+    gdouble rate;
+
+    for (l = 0; l < loops; l++) {
+        glz_decoder_window_clear(window);
+        decode_frames(decoder, frames, FALSE);
+    }
+    g_timer_stop(timer);
+
+    rate = (gdouble)loops * N_FRAMES * WIDTH * HEIGHT * 4 /
+        (1024 * 1024) / g_timer_elapsed(timer, NULL);
+    bench_report("glz/decode/rgb32", rate, "MB/s", TRUE);
+
+    g_timer_destroy(timer);
+    frames_free(frames);
+    glz_decoder_destroy(decoder);
+    glz_decoder_window_destroy(window);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/glz/decode", test_glz_decode);
+    g_test_add_func("/glz/bounded", test_glz_bounded);
+    g_test_add_func("/glz/perf", test_glz_perf);
+
+    return g_test_run ();
+}
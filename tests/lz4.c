@@ -0,0 +1,209 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <lz4.h>
+
+#include "decode.h"
+#include "bench.h"
+
+#define WIDTH 1024
+#define HEIGHT 256
+/* the rows compressed at once, as the server does */
+#define BLOCK_ROWS 16
+
+/*
+ * The same kind of content as the GLZ test: random pixels, short
+ * repeated patterns and copies of the row above, so that the rates
+ * compare.
+ */
+static guint8 *make_pixels(void)
+{
+    GRand *rand = g_rand_new_with_seed(42);
+    guint8 *pixels = g_malloc(WIDTH * HEIGHT * 4);
+    guint32 *px = (guint32 *)pixels;
+    guint x, y;
+
+    for (x = 0; x < WIDTH; x++)
+        px[x] = g_rand_int(rand) & 0xffffff;
+
+    for (y = 1; y < HEIGHT; y++) {
+        guint32 *row = px + y * WIDTH;
+
+        for (x = 0; x < WIDTH; x++) {
+            if (x % 128 == 0 || x % 128 == 5)
+                row[x] = g_rand_int(rand) & 0xffffff;
+            else if (x < 512)
+                row[x] = row[x - 1];
+            else
+                row[x] = row[x - WIDTH];
+        }
+    }
+
+    g_rand_free(rand);
+    return pixels;
+}
+
+/* the image as the server sends it, the rows in memory order */
+static GByteArray *encode(const guint8 *pixels, gboolean top_down)
+{
+    GByteArray *out = g_byte_array_new();
+    LZ4_stream_t *stream = LZ4_createStream();
+    guint8 header[] = { top_down, SPICE_BITMAP_FMT_32BIT };
+    guint8 *rows = g_malloc(WIDTH * HEIGHT * 4);
+    char *block = g_malloc(LZ4_compressBound(BLOCK_ROWS * WIDTH * 4));
+    guint y;
+
+    /* a bottom-up image starts with its last row */
+    for (y = 0; y < HEIGHT; y++)
+        memcpy(rows + y * WIDTH * 4,
+               pixels + (top_down ? y : HEIGHT - 1 - y) * WIDTH * 4, WIDTH * 4);
+
+    g_byte_array_append(out, header, sizeof(header));
+    for (y = 0; y < HEIGHT; y += BLOCK_ROWS) {
+        int size = LZ4_compress_fast_continue(stream, (const char *)rows + y * WIDTH * 4,
+                                              block, BLOCK_ROWS * WIDTH * 4,
+                                              LZ4_compressBound(BLOCK_ROWS * WIDTH * 4), 1);
+        guint32 be = GUINT32_TO_BE(size);
+
+        g_assert_cmpint(size, >, 0);
+        g_byte_array_append(out, (guint8 *)&be, 4);
+        g_byte_array_append(out, (guint8 *)block, size);
+    }
+
+    LZ4_freeStream(stream);
+    g_free(block);
+    g_free(rows);
+    return out;
+}
+
+static void test_lz4_decode(void)
+{
+    guint8 *pixels = make_pixels();
+    GByteArray *image = encode(pixels, TRUE);
+    GByteArray *scratch = g_byte_array_new();
+    guint8 *dest = g_malloc(WIDTH * HEIGHT * 4);
+
+    /* the rows are contiguous */
+    g_assert(lz4_decode_image(image->data, image->len, WIDTH, HEIGHT,
+                              dest, WIDTH * 4, scratch));
+    g_assert(memcmp(dest, pixels, WIDTH * HEIGHT * 4) == 0);
+
+    g_byte_array_unref(image);
+    g_byte_array_unref(scratch);
+    g_free(dest);
+    g_free(pixels);
+}
+
+static void test_lz4_bottom_up(void)
+{
+    guint8 *pixels = make_pixels();
+    GByteArray *image = encode(pixels, FALSE);
+    GByteArray *scratch = g_byte_array_new();
+    int stride = (WIDTH + 64) * 4;
+    guint8 *surface = g_malloc0(stride * (HEIGHT + 2));
+    guint8 *dest = surface + stride + 32 * 4;
+    guint y;
+
+    /* in a rectangle of a larger surface */
+    g_assert(lz4_decode_image(image->data, image->len, WIDTH, HEIGHT,
+                              dest, stride, scratch));
+    for (y = 0; y < HEIGHT; y++) {
+        g_assert(memcmp(dest + y * stride, pixels + y * WIDTH * 4, WIDTH * 4) == 0);
+        g_assert_cmpuint(dest[y * stride - 1], ==, 0);
+        g_assert_cmpuint(dest[y * stride + WIDTH * 4], ==, 0);
+    }
+    for (y = 0; y < stride; y++) {
+        g_assert_cmpuint(surface[y], ==, 0);
+        g_assert_cmpuint(surface[(HEIGHT + 1) * stride + y], ==, 0);
+    }
+
+    g_byte_array_unref(image);
+    g_byte_array_unref(scratch);
+    g_free(surface);
+    g_free(pixels);
+}
+
+static void test_lz4_invalid(void)
+{
+    guint8 *pixels = make_pixels();
+    GByteArray *image = encode(pixels, TRUE);
+    GByteArray *scratch = g_byte_array_new();
+    guint8 *dest = g_malloc(WIDTH * HEIGHT * 4);
+    guint i;
+
+    /* cut short: the first blocks decode, and still leave it as it was */
+    memset(dest, 0xaa, WIDTH * HEIGHT * 4);
+    g_assert(!lz4_decode_image(image->data, image->len - 1, WIDTH, HEIGHT,
+                               dest, WIDTH * 4, scratch));
+    for (i = 0; i < WIDTH * HEIGHT * 4; i++)
+        g_assert_cmpuint(dest[i], ==, 0xaa);
+    /* larger than the image */
+    g_assert(!lz4_decode_image(image->data, image->len, WIDTH, HEIGHT - 1,
+                               dest, WIDTH * 4, scratch));
+    /* left to the canvas */
+    image->data[1] = SPICE_BITMAP_FMT_24BIT;
+    g_assert(!lz4_decode_image(image->data, image->len, WIDTH, HEIGHT,
+                               dest, WIDTH * 4, scratch));
+
+    g_byte_array_unref(image);
+    g_byte_array_unref(scratch);
+    g_free(dest);
+    g_free(pixels);
+}
+
+static void test_lz4_perf(void)
+{
+    guint8 *pixels = make_pixels();
+    GByteArray *image = encode(pixels, TRUE);
+    GByteArray *scratch = g_byte_array_new();
+    guint8 *dest = g_malloc(WIDTH * HEIGHT * 4);
+    guint l, loops = g_test_perf() ? 800 : 2;
+    GTimer *timer = g_timer_new();
+    gdouble rate;
+
+    for (l = 0; l < loops; l++)
+        lz4_decode_image(image->data, image->len, WIDTH, HEIGHT,
+                         dest, WIDTH * 4, scratch);
+    g_timer_stop(timer);
+
+    /* the same unit as glz/decode/rgb32 */
+    rate = (gdouble)loops * WIDTH * HEIGHT * 4 /
+        (1024 * 1024) / g_timer_elapsed(timer, NULL);
+    bench_report("lz4/decode/rgb32", rate, "MB/s", TRUE);
+
+    g_timer_destroy(timer);
+    g_byte_array_unref(image);
+    g_byte_array_unref(scratch);
+    g_free(dest);
+    g_free(pixels);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/lz4/decode", test_lz4_decode);
+    g_test_add_func("/lz4/bottom-up", test_lz4_bottom_up);
+    g_test_add_func("/lz4/invalid", test_lz4_invalid);
+    g_test_add_func("/lz4/perf", test_lz4_perf);
+
+    return g_test_run ();
+}
@@ -0,0 +1,145 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "spice-client.h"
+#include "channel-display-priv.h"
+#include "bench.h"
+
+#define WIDTH 1280
+#define HEIGHT 720
+#define QUALITY 80
+
+/* a frame of a video stream, gradients and a few edges */
+static guint8 *make_jpeg(gulong *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    guint8 *row = g_malloc(WIDTH * 3);
+    unsigned char *out = NULL;
+    unsigned long out_size = 0;
+    guint8 *data;
+    guint x, y;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &out_size);
+    cinfo.image_width = WIDTH;
+    cinfo.image_height = HEIGHT;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < WIDTH; x++) {
+            row[x * 3] = x * 255 / WIDTH;
+            row[x * 3 + 1] = y * 255 / HEIGHT;
+            row[x * 3 + 2] = ((x / 64) ^ (y / 64)) & 1 ? 0xff : 0;
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    /* owned by libjpeg's allocator */
+    data = g_memdup(out, out_size);
+    *size = out_size;
+    free(out);
+    g_free(row);
+
+    return data;
+}
+
+static void test_mjpeg_decode(void)
+{
+    guint l, loops = g_test_perf() ? 500 : 2;
+    display_stream st;
+    guint8 *jpeg, *frame;
+    gulong size;
+    GTimer *timer;
+
+    jpeg = make_jpeg(&size);
+    memset(&st, 0, sizeof(st));
+    stream_mjpeg_decoder.init(&st);
+    frame = g_malloc(WIDTH * HEIGHT * 4);
+
+    timer = g_timer_new();
+    for (l = 0; l < loops; l++)
+        stream_mjpeg_decoder.decode(&st, jpeg, size, WIDTH, HEIGHT, 1, FALSE,
+                                    frame, WIDTH * 4);
+    g_timer_stop(timer);
+
+    /* the blue squares survive the compression */
+    g_assert_cmpuint(frame[0] & 0xff, <, 0x40);
+    g_assert_cmpuint(frame[(64 * 4)] & 0xff, >, 0xc0);
+
+    bench_report("mjpeg/decode", loops / g_timer_elapsed(timer, NULL), "frames/s", TRUE);
+
+    g_timer_destroy(timer);
+    stream_mjpeg_decoder.cleanup(&st);
+    g_free(frame);
+    g_free(jpeg);
+}
+
+static void test_mjpeg_decode_scaled(void)
+{
+    guint l, loops = g_test_perf() ? 500 : 2;
+    display_stream st;
+    guint8 *jpeg, *frame;
+    gulong size;
+    GTimer *timer;
+
+    jpeg = make_jpeg(&size);
+    memset(&st, 0, sizeof(st));
+    stream_mjpeg_decoder.init(&st);
+    frame = g_malloc(WIDTH / 4 * HEIGHT / 4 * 4);
+
+    timer = g_timer_new();
+    for (l = 0; l < loops; l++)
+        stream_mjpeg_decoder.decode(&st, jpeg, size, WIDTH, HEIGHT, 4, FALSE,
+                                    frame, WIDTH / 4 * 4);
+    g_timer_stop(timer);
+
+    /* the squares are 16 pixels wide at 1/4 */
+    g_assert_cmpuint(frame[4] & 0xff, <, 0x40);
+    g_assert_cmpuint(frame[(20 * 4)] & 0xff, >, 0xc0);
+
+    bench_report("mjpeg/decode-scaled", loops / g_timer_elapsed(timer, NULL), "frames/s", TRUE);
+
+    g_timer_destroy(timer);
+    stream_mjpeg_decoder.cleanup(&st);
+    g_free(frame);
+    g_free(jpeg);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/mjpeg/decode", test_mjpeg_decode);
+    g_test_add_func("/mjpeg/decode-scaled", test_mjpeg_decode_scaled);
+
+    return g_test_run ();
+}
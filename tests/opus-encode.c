@@ -0,0 +1,149 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <math.h>
+#include <stdio.h>
+#include <opus.h>
+
+#include "common/snd_codec.h"
+#include "bench.h"
+
+#define FREQUENCY 48000
+#define CHANNELS 2
+#define FRAME_SIZE 480 /* 10 ms, what the server decodes */
+#define N_FRAMES 500
+
+/* a voice like signal: a few harmonics of a gliding pitch, and noise */
+static gint16 *make_signal(void)
+{
+    gint16 *pcm = g_new(gint16, N_FRAMES * FRAME_SIZE * CHANNELS);
+    GRand *rand = g_rand_new_with_seed(42);
+    gdouble phase = 0;
+    guint i, h;
+
+    for (i = 0; i < N_FRAMES * FRAME_SIZE; i++) {
+        gdouble t = (gdouble)i / FREQUENCY;
+        gdouble v = 0;
+
+        phase += 2 * G_PI * (150 + 50 * sin(2 * G_PI * t)) / FREQUENCY;
+        for (h = 1; h <= 4; h++)
+            v += sin(h * phase) / h;
+        v = v * 6000 + g_rand_double_range(rand, -500, 500);
+        pcm[i * CHANNELS] = pcm[i * CHANNELS + 1] = v;
+    }
+
+    g_rand_free(rand);
+    return pcm;
+}
+
+static void report(const char *name, guint n_frames, gsize bytes, GTimer *timer)
+{
+    gdouble us = g_timer_elapsed(timer, NULL) * 1e6 / n_frames;
+    gdouble kbps = bytes * 8.0 / (n_frames * FRAME_SIZE / (gdouble)FREQUENCY) / 1000;
+    gchar *rate = g_strconcat(name, "/rate", NULL);
+
+    bench_report(name, us, "us/frame", FALSE);
+    bench_report(rate, kbps, "kbps", FALSE);
+    g_free(rate);
+}
+
+static void test_opus_encode_complexity(void)
+{
+    static const int complexities[] = { 0, 2, 5, 8, 10 };
+    gint16 *pcm = make_signal();
+    guint8 out[SND_CODEC_MAX_COMPRESSED_BYTES];
+    guint c, i, loops = g_test_perf() ? 10 : 1;
+
+    for (c = 0; c < G_N_ELEMENTS(complexities); c++) {
+        OpusEncoder *enc;
+        GTimer *timer;
+        gsize bytes = 0;
+        gchar *name;
+        int error, l;
+
+        enc = opus_encoder_create(FREQUENCY, CHANNELS, OPUS_APPLICATION_VOIP, &error);
+        g_assert(enc != NULL);
+        opus_encoder_ctl(enc, OPUS_SET_COMPLEXITY(complexities[c]));
+
+        timer = g_timer_new();
+        for (l = 0; l < loops; l++) {
+            for (i = 0; i < N_FRAMES; i++) {
+                int n = opus_encode(enc, pcm + i * FRAME_SIZE * CHANNELS, FRAME_SIZE,
+                                    out, sizeof(out));
+                g_assert_cmpint(n, >, 0);
+                bytes += n;
+            }
+        }
+        g_timer_stop(timer);
+
+        name = g_strdup_printf("opus-encode/complexity/%d", complexities[c]);
+        report(name, loops * N_FRAMES, bytes, timer);
+        g_free(name);
+        g_timer_destroy(timer);
+        opus_encoder_destroy(enc);
+    }
+
+    g_free(pcm);
+}
+
+/* the encoder the record channel uses when it is not tuned */
+static void test_opus_encode_default(void)
+{
+    gint16 *pcm = make_signal();
+    guint8 out[SND_CODEC_MAX_COMPRESSED_BYTES];
+    SndCodec codec = NULL;
+    GTimer *timer;
+    gsize bytes = 0;
+    guint i;
+
+    if (!snd_codec_is_capable(SPICE_AUDIO_DATA_MODE_OPUS, FREQUENCY)) {
+        g_test_message("no Opus support in snd_codec");
+        g_free(pcm);
+        return;
+    }
+
+    g_assert_cmpint(snd_codec_create(&codec, SPICE_AUDIO_DATA_MODE_OPUS, FREQUENCY,
+                                     SND_CODEC_ENCODE), ==, SND_CODEC_OK);
+    g_assert_cmpint(snd_codec_frame_size(codec), ==, FRAME_SIZE);
+
+    timer = g_timer_new();
+    for (i = 0; i < N_FRAMES; i++) {
+        int len = sizeof(out);
+
+        g_assert_cmpint(snd_codec_encode(codec, (guint8 *)(pcm + i * FRAME_SIZE * CHANNELS),
+                                         FRAME_SIZE * CHANNELS * 2, out, &len), ==, SND_CODEC_OK);
+        bytes += len;
+    }
+    g_timer_stop(timer);
+    report("opus-encode/snd_codec", N_FRAMES, bytes, timer);
+
+    g_timer_destroy(timer);
+    snd_codec_destroy(&codec);
+    g_free(pcm);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/opus-encode/complexity", test_opus_encode_complexity);
+    g_test_add_func("/opus-encode/default", test_opus_encode_default);
+
+    return g_test_run ();
+}
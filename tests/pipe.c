@@ -5,6 +5,7 @@
 #include <locale.h>
 
 #include "giopipe.h"
+#include "bench.h"
 
 typedef struct _Fixture {
     GIOStream *p1;
@@ -45,7 +46,8 @@ fixture_set_up(Fixture *fixture,
 {
     int i;
 
-    spice_make_pipe(&fixture->p1, &fixture->p2);
+    /* the capacity of a buffered pipe */
+    spice_make_pipe_buffered(&fixture->p1, &fixture->p2, GPOINTER_TO_SIZE(user_data));
     g_assert_true(G_IS_IO_STREAM(fixture->p1));
     g_assert_true(G_IS_IO_STREAM(fixture->p2));
 
@@ -467,6 +469,125 @@ test_pipe_zombie_sources(Fixture *f, gconstpointer user_data)
     g_main_loop_run (f->loop);
 }
 
+static void
+test_pipe_buffered(Fixture *f, gconstpointer user_data)
+{
+    GError *error = NULL;
+    gssize size;
+
+    /* the writer goes on without a reader, up to the capacity */
+    size = g_output_stream_write(f->op1, "0123456789", 10, f->cancellable, &error);
+    g_assert_no_error(error);
+    g_assert_cmpint(size, ==, 10);
+    size = g_output_stream_write(f->op1, "abcdefghij", 10, f->cancellable, &error);
+    g_assert_no_error(error);
+    g_assert_cmpint(size, ==, 6);
+    test_pipe_writeblock(f, user_data);
+
+    size = g_input_stream_read(f->ip2, f->buf, 12, f->cancellable, &error);
+    g_assert_no_error(error);
+    g_assert_cmpint(size, ==, 12);
+    g_assert(memcmp(f->buf, "0123456789ab", 12) == 0);
+    g_assert_true(g_pollable_output_stream_is_writable(G_POLLABLE_OUTPUT_STREAM(f->op1)));
+
+    size = g_input_stream_read(f->ip2, f->buf, 16, f->cancellable, &error);
+    g_assert_no_error(error);
+    g_assert_cmpint(size, ==, 4);
+    g_assert(memcmp(f->buf, "cdef", 4) == 0);
+    test_pipe_readblock(f, user_data);
+}
+
+static void
+test_pipe_buffered_bytes(Fixture *f, gconstpointer user_data)
+{
+    static const gchar data[] = "0123456789abcdefghij";
+    GBytes *bytes, *read;
+    GError *error = NULL;
+    gsize size;
+
+    /* the whole of it is queued, beyond the capacity */
+    bytes = g_bytes_new_static(data, 20);
+    g_assert_true(spice_pipe_write_bytes(f->op1, bytes, &error));
+    g_assert_no_error(error);
+    g_assert_false(spice_pipe_write_bytes(f->op1, bytes, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+    g_clear_error(&error);
+
+    /* and read without a copy */
+    read = spice_pipe_read_bytes(f->ip2, 8, &error);
+    g_assert_no_error(error);
+    g_assert(g_bytes_get_data(read, &size) == data);
+    g_assert_cmpuint(size, ==, 8);
+    g_bytes_unref(read);
+
+    read = spice_pipe_read_bytes(f->ip2, 64, &error);
+    g_assert_no_error(error);
+    g_assert(g_bytes_get_data(read, &size) == data + 8);
+    g_assert_cmpuint(size, ==, 12);
+    g_bytes_unref(read);
+
+    g_assert_null(spice_pipe_read_bytes(f->ip2, 8, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+    g_clear_error(&error);
+
+    g_bytes_unref(bytes);
+}
+
+static void
+test_pipe_buffered_close(Fixture *f, gconstpointer user_data)
+{
+    GError *error = NULL;
+    gssize size;
+
+    size = g_output_stream_write(f->op1, "0123", 4, f->cancellable, &error);
+    g_assert_cmpint(size, ==, 4);
+    g_output_stream_close(f->op1, f->cancellable, &error);
+    g_assert_no_error(error);
+
+    /* what was written before the close is still read */
+    size = g_input_stream_read(f->ip2, f->buf, 16, f->cancellable, &error);
+    g_assert_no_error(error);
+    g_assert_cmpint(size, ==, 4);
+
+    size = g_input_stream_read(f->ip2, f->buf, 16, f->cancellable, &error);
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_CLOSED);
+    g_clear_error(&error);
+}
+
+#define PERF_CHUNK (64 * 1024)
+
+/* the transfer of the usbredir and webdav data, without the copies */
+static void
+test_pipe_perf(Fixture *f, gconstpointer user_data)
+{
+    guint i, loops = g_test_perf() ? 100000 : 100;
+    gchar *data = g_malloc0(PERF_CHUNK);
+    GBytes *bytes = g_bytes_new_take(data, PERF_CHUNK);
+    GError *error = NULL;
+    GTimer *timer;
+    gsize total = 0;
+
+    timer = g_timer_new();
+    for (i = 0; i < loops; i++) {
+        GBytes *read;
+
+        g_assert_true(spice_pipe_write_bytes(f->op1, bytes, &error));
+        g_assert_no_error(error);
+        while (total < (gsize)(i + 1) * PERF_CHUNK) {
+            read = spice_pipe_read_bytes(f->ip2, PERF_CHUNK, &error);
+            g_assert_no_error(error);
+            total += g_bytes_get_size(read);
+            g_bytes_unref(read);
+        }
+    }
+    g_timer_stop(timer);
+
+    bench_report("pipe/transfer", total / (1024. * 1024.) / g_timer_elapsed(timer, NULL),
+                 "MB/s", TRUE);
+    g_timer_destroy(timer);
+    g_bytes_unref(bytes);
+}
+
 int main(int argc, char* argv[])
 {
     setlocale(LC_ALL, "");
@@ -521,5 +642,21 @@ int main(int argc, char* argv[])
                fixture_set_up, test_pipe_readcancel,
                fixture_tear_down);
 
+    g_test_add("/pipe/buffered", Fixture, GSIZE_TO_POINTER(16),
+               fixture_set_up, test_pipe_buffered,
+               fixture_tear_down);
+
+    g_test_add("/pipe/buffered-bytes", Fixture, GSIZE_TO_POINTER(16),
+               fixture_set_up, test_pipe_buffered_bytes,
+               fixture_tear_down);
+
+    g_test_add("/pipe/buffered-close", Fixture, GSIZE_TO_POINTER(16),
+               fixture_set_up, test_pipe_buffered_close,
+               fixture_tear_down);
+
+    g_test_add("/pipe/perf", Fixture, GSIZE_TO_POINTER(PERF_CHUNK),
+               fixture_set_up, test_pipe_perf,
+               fixture_tear_down);
+
     return g_test_run();
 }
@@ -1,6 +1,13 @@
 #include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
 
-#include "spice-session.h"
+#include "spice-client.h"
+#include "spice-session-priv.h"
+#include "fake-server.h"
+#include "bench.h"
+
+#define N_SESSIONS 100
 
 static void test_session_uri(void)
 {
@@ -64,11 +71,179 @@ static void test_session_uri(void)
     }
 }
 
+static void test_session_shared_ssl_ctx(void)
+{
+    SpiceSession *a = spice_session_new();
+    SpiceSession *b = spice_session_new();
+    SpiceSession *c = spice_session_new();
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_method());
+    gboolean ca_loaded;
+
+    g_object_set(c, "ciphers", "HIGH", NULL);
+
+    g_assert(spice_session_get_ssl_ctx(b, &ca_loaded) == NULL);
+    spice_session_set_ssl_ctx(a, ctx, TRUE);
+
+    /* the same settings share it, not the others */
+    g_assert(spice_session_get_ssl_ctx(b, &ca_loaded) == ctx);
+    g_assert(ca_loaded);
+    g_assert(spice_session_get_ssl_ctx(c, &ca_loaded) == NULL);
+
+    /* it stays with b, and goes with it */
+    g_object_unref(a);
+    g_assert(spice_session_get_ssl_ctx(b, &ca_loaded) == ctx);
+    g_object_unref(b);
+    a = spice_session_new();
+    g_assert(spice_session_get_ssl_ctx(a, &ca_loaded) == NULL);
+
+    g_object_unref(a);
+    g_object_unref(c);
+}
+
+static gsize get_rss(void)
+{
+    unsigned long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    int n;
+
+    if (f == NULL)
+        return 0;
+    n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+
+    return n == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+static void session_channel_linked(FakeServer *server, gpointer user_data)
+{
+    guint *linked = user_data;
+
+    (*linked)++;
+}
+
+/* the memory of sessions with their main, display and cursor channels,
+ * each linked to a fake server */
+static void test_session_many(void)
+{
+    static const gint types[] = {
+        SPICE_CHANNEL_MAIN, SPICE_CHANNEL_DISPLAY, SPICE_CHANNEL_CURSOR
+    };
+    SpiceSession *sessions[N_SESSIONS];
+    FakeServer *servers[N_SESSIONS * G_N_ELEMENTS(types)];
+    gsize before, after;
+    gdouble per_session;
+    guint i, j, linked = 0;
+
+    /* not accounted to the sessions */
+    fake_server_init_key();
+
+    before = get_rss();
+    if (before == 0) {
+        g_test_message("no /proc/self/statm, skipping");
+        return;
+    }
+
+    for (i = 0; i < N_SESSIONS; i++) {
+        sessions[i] = spice_session_new();
+        for (j = 0; j < G_N_ELEMENTS(types); j++) {
+            SpiceChannel *channel = spice_channel_new(sessions[i], types[j], 0);
+
+            servers[i * G_N_ELEMENTS(types) + j] =
+                fake_server_new(channel, session_channel_linked, NULL, NULL, &linked);
+        }
+    }
+    while (linked < G_N_ELEMENTS(servers))
+        g_main_context_iteration(NULL, TRUE);
+    /* the channels take the link result */
+    while (g_main_context_iteration(NULL, FALSE));
+    after = get_rss();
+
+    per_session = after > before ? (gdouble)(after - before) / N_SESSIONS / 1024 : 0;
+    bench_report("session/memory", per_session, "KiB/session", FALSE);
+
+    for (i = 0; i < N_SESSIONS; i++)
+        spice_session_disconnect(sessions[i]);
+    for (i = 0; i < G_N_ELEMENTS(servers); i++)
+        fake_server_free(servers[i]);
+    while (g_main_context_iteration(NULL, FALSE));
+    for (i = 0; i < N_SESSIONS; i++)
+        g_object_unref(sessions[i]);
+}
+
+/* an idle session leaves the main loop asleep */
+static void test_session_wakeups(void)
+{
+    SpiceSession *s = spice_session_new();
+    guint64 before, after;
+    guint i;
+
+    g_object_get(s, "main-loop-wakeups", &before, NULL);
+    for (i = 0; i < 3; i++)
+        g_main_context_iteration(NULL, FALSE);
+    g_object_get(s, "main-loop-wakeups", &after, NULL);
+    g_assert_cmpuint(after - before, ==, 3);
+
+    g_object_unref(s);
+}
+
+/* the caches scale with the displays, unless set */
+static void test_session_caches_auto(void)
+{
+    SpiceSession *s = spice_session_new();
+    gint one, four, glz;
+
+    spice_session_set_caches_hints(s, 64 * 1024 * 1024, 1);
+    g_object_get(s, "cache-size", &one, "glz-window-size", &glz, NULL);
+    g_assert_cmpint(one, >, 0);
+    g_assert_cmpint(glz, >, 0);
+    g_assert_cmpint(glz, <=, 32 * 1024 * 1024);
+
+    spice_session_set_caches_hints(s, 64 * 1024 * 1024, 4);
+    g_object_get(s, "cache-size", &four, NULL);
+    g_assert_cmpint(four, >=, one);
+
+    g_object_set(s, "cache-size", 1234567, NULL);
+    spice_session_set_caches_hints(s, 64 * 1024 * 1024, 1);
+    g_object_get(s, "cache-size", &one, NULL);
+    g_assert_cmpint(one, ==, 1234567);
+
+    g_object_unref(s);
+}
+
+/* the budget applies to the properties, and leaves them alone */
+static void test_session_caches_budget(void)
+{
+    SpiceSession *s = spice_session_new();
+    gint size, images, glz, images2, glz2;
+
+    g_object_set(s, "cache-size", 64 * 1024 * 1024,
+                 "glz-window-size", 16 * 1024 * 1024,
+                 "memory-budget", (guint64)1, NULL);
+    spice_session_set_caches_hints(s, 64 * 1024 * 1024, 1);
+    spice_session_get_cache_limits(s, &images, &glz);
+    g_assert_cmpint(images, <, 64 * 1024 * 1024);
+    g_assert_cmpint(glz, <, 16 * 1024 * 1024);
+
+    spice_session_set_caches_hints(s, 64 * 1024 * 1024, 1);
+    spice_session_get_cache_limits(s, &images2, &glz2);
+    g_assert_cmpint(images2, ==, images);
+    g_assert_cmpint(glz2, ==, glz);
+    g_object_get(s, "cache-size", &size, NULL);
+    g_assert_cmpint(size, ==, 64 * 1024 * 1024);
+
+    g_object_unref(s);
+}
+
 int main(int argc, char* argv[])
 {
     g_test_init(&argc, &argv, NULL);
 
     g_test_add_func("/session/uri", test_session_uri);
+    g_test_add_func("/session/shared-ssl-ctx", test_session_shared_ssl_ctx);
+    g_test_add_func("/session/many", test_session_many);
+    g_test_add_func("/session/wakeups", test_session_wakeups);
+    g_test_add_func("/session/caches-auto", test_session_caches_auto);
+    g_test_add_func("/session/caches-budget", test_session_caches_budget);
 
     return g_test_run();
 }
@@ -107,6 +107,18 @@ static const struct {
         "0000" "0000" "0000" "0000" "0001" "1111" "0001" "0000"
         "0000" "0000" "0000" "0000" "0001" "0001" "0001" "0000"
         "0000" "0000" "0000" "0000" "0000" "0000" "0000" "0000"
+    },
+    {
+        /* no edges, set -> white, clear -> black, unchanged -> transparent */
+        8, 2,
+        "00001111"
+        "11110000"
+        ,
+        "01010101"
+        "00000000"
+        ,
+        "0001" "1111" "0001" "1111" "0000" "1111" "0000" "1111"
+        "0000" "0000" "0000" "0000" "0001" "0001" "0001" "0001"
     }
 };
 
@@ -0,0 +1,189 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "spice-client.h"
+#include "fake-server.h"
+#include "bench.h"
+
+#define CLIENT_ID 1
+#define MUX_HEADER_SIZE (sizeof(gint64) + sizeof(guint16))
+#define MAX_MUX_SIZE G_MAXUINT16
+
+/*
+ * Fetches a file of the shared folder as the guest does: the request
+ * goes to the webdav channel in a mux frame, and the channel demuxes
+ * it to the phodav server and muxes the reply back. Reports the rate,
+ * and the size of the mux frames sent to the guest.
+ */
+typedef struct {
+    GMainLoop *loop;
+    GTimer *timer;
+    GByteArray *mux;
+    gsize file_size;
+    gboolean in_body;
+    GString *header;
+    gsize body;
+    guint64 frames;
+} Transfer;
+
+static void transfer_ready(FakeServer *server, gpointer user_data)
+{
+    Transfer *t = user_data;
+    static const gchar request[] =
+        "GET /file HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n";
+    guint8 event = SPICE_PORT_EVENT_OPENED;
+    GByteArray *frame = g_byte_array_new();
+    gint64 id = GINT64_TO_LE(CLIENT_ID);
+    guint16 size = GUINT16_TO_LE(sizeof(request) - 1);
+
+    g_timer_start(t->timer);
+    /* the demux starts when the guest opens the port */
+    fake_server_send(server, SPICE_MSG_PORT_EVENT, &event, sizeof(event));
+
+    g_byte_array_append(frame, (guint8 *)&id, sizeof(id));
+    g_byte_array_append(frame, (guint8 *)&size, sizeof(size));
+    g_byte_array_append(frame, (guint8 *)request, sizeof(request) - 1);
+    fake_server_send(server, SPICE_MSG_SPICEVMC_DATA, frame->data, frame->len);
+    g_byte_array_unref(frame);
+}
+
+static void transfer_reply(Transfer *t, const guint8 *data, gsize size)
+{
+    gsize n = 0;
+
+    t->frames++;
+    if (!t->in_body) {
+        const gchar *end;
+
+        g_string_append_len(t->header, (gchar *)data, size);
+        end = strstr(t->header->str, "\r\n\r\n");
+        if (end) {
+            g_assert(g_str_has_prefix(t->header->str, "HTTP/1.1 200"));
+            t->in_body = TRUE;
+            n = t->header->len - (end + 4 - t->header->str);
+        }
+    } else {
+        n = size;
+    }
+
+    t->body += n;
+    g_assert_cmpuint(t->body, <=, t->file_size);
+    if (t->body == t->file_size)
+        g_main_loop_quit(t->loop);
+}
+
+static void transfer_message(FakeServer *server, guint16 type,
+                             const guint8 *data, guint32 size, gpointer user_data)
+{
+    Transfer *t = user_data;
+    gsize pos = 0;
+
+    if (type != SPICE_MSGC_SPICEVMC_DATA)
+        return;
+
+    /* the frames may span the messages */
+    g_byte_array_append(t->mux, data, size);
+    while (t->mux->len - pos >= MUX_HEADER_SIZE) {
+        gint64 id;
+        guint16 len;
+
+        memcpy(&id, t->mux->data + pos, sizeof(id));
+        memcpy(&len, t->mux->data + pos + sizeof(id), sizeof(len));
+        len = GUINT16_FROM_LE(len);
+        if (t->mux->len - pos < MUX_HEADER_SIZE + len)
+            break;
+
+        g_assert_cmpint(GINT64_FROM_LE(id), ==, CLIENT_ID);
+        g_assert_cmpuint(len, <=, MAX_MUX_SIZE);
+        /* an empty frame closes the client */
+        if (len > 0)
+            transfer_reply(t, t->mux->data + pos + MUX_HEADER_SIZE, len);
+        pos += MUX_HEADER_SIZE + len;
+    }
+    g_byte_array_remove_range(t->mux, 0, pos);
+}
+
+static void test_webdav_get(void)
+{
+    gchar *dir, *path, *data;
+    SpiceSession *session;
+    SpiceChannel *channel;
+    FakeServer *server;
+    GError *error = NULL;
+    Transfer t = { NULL, };
+    gdouble rate, frame;
+
+    /* the large one is for the benchmark only */
+    t.file_size = g_test_perf() ? 32 * 1024 * 1024 : 1024 * 1024;
+
+    dir = g_dir_make_tmp("webdav-XXXXXX", &error);
+    g_assert_no_error(error);
+    path = g_build_filename(dir, "file", NULL);
+    data = g_malloc0(t.file_size);
+    g_file_set_contents(path, data, t.file_size, &error);
+    g_assert_no_error(error);
+    g_free(data);
+
+    session = spice_session_new();
+    g_object_set(session, "shared-dir", dir, NULL);
+    channel = spice_channel_new(session, SPICE_CHANNEL_WEBDAV, 0);
+
+    t.loop = g_main_loop_new(NULL, FALSE);
+    t.mux = g_byte_array_new();
+    t.header = g_string_new(NULL);
+
+    t.timer = g_timer_new();
+    server = fake_server_new(channel, transfer_ready, transfer_message, NULL, &t);
+    g_main_loop_run(t.loop);
+    g_timer_stop(t.timer);
+
+    rate = t.file_size / (1024. * 1024.) / g_timer_elapsed(t.timer, NULL);
+    frame = (gdouble)t.file_size / t.frames;
+    bench_report("webdav/get", rate, "MB/s", TRUE);
+    bench_report("webdav/get/frame", frame, "bytes", TRUE);
+
+    spice_session_disconnect(session);
+    fake_server_free(server);
+    while (g_main_context_iteration(NULL, FALSE));
+
+    g_timer_destroy(t.timer);
+    g_string_free(t.header, TRUE);
+    g_byte_array_unref(t.mux);
+    g_main_loop_unref(t.loop);
+    g_object_unref(session);
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/webdav/get", test_webdav_get);
+
+    return g_test_run ();
+}